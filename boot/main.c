@@ -30,9 +30,10 @@
  **********************************************************************/
 
 #define SECTSIZE    512
+#define MAXSECTS    256                         // sectors in one read command
 #define ELFHDR        ((struct Elf *) 0x10000) // scratch space
 
-void readsect(void *, uint32_t);
+void readsects(void *, uint32_t, uint32_t);
 void readseg(uint32_t, uint32_t, uint32_t);
 
 void
@@ -78,7 +79,7 @@ bootmain(void)
 void
 readseg(uint32_t pa, uint32_t count, uint32_t offset)
 {
-	uint32_t end_pa;
+	uint32_t end_pa, n;
 
 	end_pa = pa + count;
 
@@ -88,18 +89,21 @@ readseg(uint32_t pa, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
+	// Read up to MAXSECTS sectors with each command.  The last one
+	// may write a little past end_pa, but it doesn't matter -- we load
+	// in increasing order.
 	while (pa < end_pa)
 	{
+		n = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+		if (n > MAXSECTS)
+			n = MAXSECTS;
 		// Since we haven't enabled paging yet and we're using
 		// an identity segment mapping (see boot.S), we can
 		// use physical addresses directly.  This won't be the
 		// case once JOS enables the MMU.
-		readsect((uint8_t *) pa, offset);
-		pa += SECTSIZE;
-		offset++;
+		readsects((uint8_t *) pa, offset, n);
+		pa += n * SECTSIZE;
+		offset += n;
 	}
 }
 
@@ -111,23 +115,29 @@ waitdisk(void)
 		/* do nothing */;
 }
 
+// Read 'nsecs' sectors, 1 to MAXSECTS, from sector 'offset' into 'dst'
+// with a single command.
 void
-readsect(void *dst, uint32_t offset)
+readsects(void *dst, uint32_t offset, uint32_t nsecs)
 {
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);        // count = 1
+	outb(0x1F2, nsecs);    // count; 0 means 256
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);    // cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
+	// the disk raises DRQ for each sector in turn
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE)
+	{
+		// wait for disk to be ready
+		waitdisk();
 
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE / 4);
+		// read a sector
+		insl(0x1F0, dst, SECTSIZE / 4);
+	}
 }
 
@@ -1,6 +1,18 @@
 
 #include "fs.h"
 
+// The resident blocks, in the order the CLOCK hand visits them, and the
+// hand.  A slot whose block is no longer mapped is free.
+static uint32_t resident[BC_NBLOCKS];
+static uint32_t nresident;
+static uint32_t hand;
+
+// Scratch for bc_writeback: the dirty resident blocks, sorted
+static uint32_t wb_blocks[BC_NBLOCKS];
+
+// Counters for FSREQ_STATS
+struct FsStats fsstats;
+
 // Return the virtual address of this disk block.
 void *
 diskaddr(uint32_t blockno)
@@ -24,7 +36,563 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return (uvpt[PGNUM(va)] & (PTE_D | PTE_BC_DIRTY)) != 0;
+}
+
+// The permissions to remap block page va with once the disk has it,
+// which clear PTE_D and PTE_BC_DIRTY.  A donated page stays
+// copy-on-write, so that its donor and the cache never see each other's
+// later writes.
+static int
+bc_clean_perm(void *va)
+{
+	return (uvpt[PGNUM(va)] & PTE_COW) ? PTE_P | PTE_U | PTE_COW :
+										 PTE_P | PTE_U | PTE_W;
+}
+
+// Fill in op with the operations that remap the n block pages at
+// blockno clean, one per run of pages with the same permissions.
+// Returns how many there are, at most n.
+static uint32_t
+bc_clean_ops(uint32_t blockno, uint32_t n, struct PageMapOp *op)
+{
+	uint32_t i, nops = 0;
+	uintptr_t va;
+	int perm;
+
+	for (i = 0; i < n; i++)
+	{
+		va = (uintptr_t) diskaddr(blockno + i);
+		perm = bc_clean_perm((void *) va);
+		if (nops > 0 && op[nops - 1].perm == perm)
+		{
+			op[nops - 1].npages++;
+			continue;
+		}
+		op[nops].srcva = op[nops].dstva = va;
+		op[nops].npages = 1;
+		op[nops].perm = perm;
+		nops++;
+	}
+	return nops;
+}
+
+// Is this block kept in memory for good?  The superblock and the
+// bitmap are, since bc_pgfault itself reads them; so is every block
+// read before the superblock is known.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return !super || blockno < 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+}
+
+static void bc_track(uint32_t blockno);
+
+// Count a disk transfer of n blocks that started at TSC value start and
+// has just ended.
+static void
+bc_count_io(uint32_t n, bool write, uint64_t start)
+{
+	struct SysStat *ss = write ? &fsstats.fs_disk_write : &fsstats.fs_disk_read;
+
+	ss->ss_calls++;
+	sysstat_count(ss, read_tsc() - start);
+	if (write)
+		fsstats.fs_blocks_written += n;
+	else
+		fsstats.fs_blocks_read += n;
+}
+
+// Disk transfers that the server started without waiting for them.
+// A slot is queued until the disk has room for its transfer, then busy
+// until bd_reap reports it; its tag is the slot number.  Transfers in
+// flight together never share a block, so they may complete in any
+// order.  Each slot owns a window of BC_MAXRUN pages at BC_IOVA that
+// holds its blocks' pages meanwhile: a read lands there and enters the
+// cache only when it is complete, and a write keeps its pages alive
+// even if their blocks are evicted meanwhile.
+enum {
+	IO_FREE = 0,
+	IO_QUEUED,
+	IO_BUSY,
+};
+
+struct BcIo {
+	int state;
+	uint32_t seq;       // submission order, to start the oldest first
+	uint32_t blockno;
+	uint32_t n;
+	bool write;
+	uint64_t start;     // TSC value when the disk took it
+};
+static struct BcIo ioq[BC_NIO];
+static uint32_t io_seq;
+
+// Transfers retired so far: serve threads waiting for a block to come
+// in wait for this to change.
+static volatile uint32_t io_nretired;
+
+// Scratch for bc_io_retire, which can recurse, but not while the
+// operations are in use.
+static struct PageMapOp io_ops[BC_MAXRUN + 1];
+
+static char *
+io_window(const struct BcIo *io)
+{
+	return (char *) BC_IOVA + (io - ioq) * BC_MAXRUN * PGSIZE;
+}
+
+// Hand the queued transfers to the disk, oldest first, for as long as
+// it has room.
+static void
+bc_io_start_queued(void)
+{
+	struct BcIo *io, *oldest;
+	int r;
+
+	for (;;)
+	{
+		oldest = NULL;
+		for (io = ioq; io < ioq + BC_NIO; io++)
+			if (io->state == IO_QUEUED &&
+				(!oldest || (int32_t) (io->seq - oldest->seq) < 0))
+				oldest = io;
+		if (!oldest)
+			return;
+		r = bdev->bd_start(bdev, oldest - ioq, oldest->blockno * BLKSECTS,
+						   io_window(oldest), oldest->n * BLKSECTS,
+						   oldest->write);
+		if (r == -E_WOULD_BLOCK)
+			return;
+		if (r < 0)
+			panic("bc_io_start_queued: cannot start transfer of block %08x: %e",
+				  oldest->blockno, r);
+		oldest->state = IO_BUSY;
+		oldest->start = read_tsc();
+	}
+}
+
+// Retire a transfer that the disk reported with result 'status', and
+// start what the queue can.  A failed transfer is redone synchronously.
+// The blocks a read brings in enter the cache, except any already there.
+static void
+bc_io_retire(struct BcIo *io, int status)
+{
+	uint32_t blockno = io->blockno, n = io->n, i, nops = 0, installed = 0;
+	char *win = io_window(io);
+	bool write = io->write;
+	size_t done;
+	int r;
+
+	if (status < 0)
+	{
+		if (write)
+			r = bdev->bd_write(bdev, blockno * BLKSECTS, win, n * BLKSECTS);
+		else
+			r = bdev->bd_read(bdev, blockno * BLKSECTS, win, n * BLKSECTS);
+		if (r < 0)
+			panic("bc_io_retire: %s of block %08x failed: %e",
+				  write ? "write" : "read", blockno, r);
+	}
+	bc_count_io(n, write, io->start);
+
+	for (i = 0; !write && i < n; i++)
+		if (!va_is_mapped(diskaddr(blockno + i)))
+		{
+			io_ops[nops].srcva = (uintptr_t) win + i * PGSIZE;
+			io_ops[nops].dstva = (uintptr_t) diskaddr(blockno + i);
+			io_ops[nops].npages = 1;
+			io_ops[nops].perm = PTE_P | PTE_U | PTE_W;
+			nops++;
+			installed |= 1U << i;
+		}
+	io_ops[nops].srcva = 0;
+	io_ops[nops].dstva = (uintptr_t) win;
+	io_ops[nops].npages = n;
+	io_ops[nops].perm = 0;
+	if ((r = sys_page_map_batch(0, 0, io_ops, nops + 1, &done)) < 0)
+		panic("in bc_io_retire, sys_page_map_batch: %e", r);
+
+	io->state = IO_FREE;
+	io_nretired++;
+	fs_wakeup(&io_nretired);
+	bc_io_start_queued();
+
+	// Touch every new block before making room for any of them, so the
+	// evictions give them a second chance.  Evictions may queue
+	// writes, and so call us again.
+	for (i = 0; i < n; i++)
+		if (installed & (1U << i))
+			(void) *(volatile char *) diskaddr(blockno + i);
+	for (i = 0; i < n; i++)
+		if (installed & (1U << i))
+			bc_track(blockno + i);
+}
+
+// Wait for some transfer in flight to end and retire it.
+static void
+bc_io_complete(void)
+{
+	uint32_t tag;
+	int r, status;
+
+	while ((r = bdev->bd_reap(bdev, &tag, &status)) == -E_WOULD_BLOCK)
+		sys_yield();
+	if (r < 0)
+		panic("in bc_io_complete, bd_reap: %e", r);
+	if (tag >= BC_NIO || ioq[tag].state != IO_BUSY)
+		panic("bc_io_complete: disk reported unknown transfer %08x", tag);
+	bc_io_retire(&ioq[tag], status);
+}
+
+// Is a queued transfer of any of the n blocks starting at blockno
+// still to complete?
+static bool
+bc_io_pending(uint32_t blockno, uint32_t n)
+{
+	struct BcIo *io;
+
+	for (io = ioq; io < ioq + BC_NIO; io++)
+		if (io->state != IO_FREE && blockno < io->blockno + io->n &&
+			io->blockno < blockno + n)
+			return true;
+	return false;
+}
+
+// Return a free transfer slot, or NULL if every one is taken.
+static struct BcIo *
+bc_io_slot(void)
+{
+	struct BcIo *io;
+
+	for (io = ioq; io < ioq + BC_NIO; io++)
+		if (io->state == IO_FREE)
+			return io;
+	return NULL;
+}
+
+// Wait until no queued transfer involves the n blocks at blockno.
+static void
+bc_io_wait(uint32_t blockno, uint32_t n)
+{
+	while (bc_io_pending(blockno, n))
+		bc_io_complete();
+}
+
+// Queue a transfer of the n adjacent blocks starting at blockno, once
+// any queued transfer of the same blocks is done, waiting only if every
+// slot is taken.  A write takes the blocks' contents as they are then
+// and clears their PTE_D bits; a read is only for blocks not in the
+// cache.
+static void
+bc_io_submit(uint32_t blockno, uint32_t n, bool write)
+{
+	struct PageMapOp op[1 + BC_MAXRUN];
+	struct BcIo *io;
+	uint32_t i, nops = 1;
+	size_t done;
+	int r;
+
+	assert(n > 0 && n <= BC_MAXRUN);
+	for (;;)
+	{
+		bc_io_wait(blockno, n);
+		if ((io = bc_io_slot()) != NULL)
+			break;
+		bc_io_complete();
+	}
+
+	// Waiting may have written some of the blocks out or evicted them:
+	// write what is still dirty instead.
+	for (i = 0; write && i < n; i++)
+		if (!va_is_mapped(diskaddr(blockno + i)) ||
+			!va_is_dirty(diskaddr(blockno + i)))
+		{
+			bc_flush(blockno, n);
+			return;
+		}
+
+	io->blockno = blockno;
+	io->n = n;
+	io->write = write;
+	io->seq = io_seq++;
+
+	// The disk only reads the window of a write, which may hold
+	// donated pages that must stay copy-on-write
+	op[0].srcva = write ? (uintptr_t) diskaddr(blockno) : PAGEMAP_ALLOC;
+	op[0].dstva = (uintptr_t) io_window(io);
+	op[0].npages = n;
+	op[0].perm = write ? PTE_P | PTE_U : PTE_P | PTE_U | PTE_W;
+	if (write)
+		nops += bc_clean_ops(blockno, n, op + 1);
+	if ((r = sys_page_map_batch(0, 0, op, nops, &done)) < 0)
+		panic("in bc_io_submit, sys_page_map_batch: %e", r);
+
+	io->state = IO_QUEUED;
+	bc_io_start_queued();
+}
+
+// Retire the queued transfers that have completed.  Called when the
+// disk interrupts.
+void
+bc_intr(void)
+{
+	uint32_t tag;
+	int status;
+
+	if (!bdev->bd_start)
+		return;
+	while (bdev->bd_reap(bdev, &tag, &status) == 0)
+	{
+		if (tag >= BC_NIO || ioq[tag].state != IO_BUSY)
+			panic("bc_intr: disk reported unknown transfer %08x", tag);
+		bc_io_retire(&ioq[tag], status);
+	}
+}
+
+// Wait for every queued transfer to complete.
+void
+bc_drain(void)
+{
+	struct BcIo *io;
+
+	for (io = ioq; io < ioq + BC_NIO; io++)
+		while (io->state != IO_FREE)
+			bc_io_complete();
+}
+
+// Write the n adjacent blocks starting at blockno, all in memory, out
+// to disk with one transfer and clear their PTE_D bits.  On a disk
+// that runs transfers in the background it is only queued.
+static void
+flush_run(uint32_t blockno, uint32_t n)
+{
+	struct PageMapOp op[BC_MAXRUN];
+	uint64_t start;
+	size_t done;
+	int r;
+
+	if (bdev->bd_start)
+	{
+		bc_io_submit(blockno, n, true);
+		return;
+	}
+	start = read_tsc();
+	if ((r = bdev->bd_write(bdev, blockno * BLKSECTS, diskaddr(blockno), n * BLKSECTS)) < 0)
+		panic("in flush_run, bd_write: %e", r);
+	bc_count_io(n, true, start);
+	if ((r = sys_page_map_batch(0, 0, op, bc_clean_ops(blockno, n, op), &done)) < 0)
+		panic("in flush_run, sys_page_map_batch: %e", r);
+}
+
+// Write the dirty blocks among the n starting at blockno out to disk:
+// each run of adjacent dirty blocks goes out in as few transfers as
+// possible.  Skips the blocks of a page table that is not there, and
+// those the journal holds until its next commit.
+// The writes may still be in flight on return (see bc_drain).
+void
+bc_flush(uint32_t blockno, uint32_t n)
+{
+	uint32_t end = blockno + n, start = 0, len = 0;
+	bool dirty;
+	void *va;
+
+	for (; blockno <= end; blockno++)
+	{
+		va = blockno < end ? diskaddr(blockno) : NULL;
+		dirty = va && va_is_mapped(va) && va_is_dirty(va) && !jnl_holds(blockno);
+		if (len > 0 && (!dirty || len == BC_MAXRUN))
+		{
+			flush_run(start, len);
+			len = 0;
+		}
+		if (dirty)
+		{
+			if (len++ == 0)
+				start = blockno;
+		} else if (va && !(uvpd[PDX(va)] & PTE_P))
+			blockno = MIN(ROUNDUP(blockno + 1, NPTENTRIES), end) - 1;
+	}
+}
+
+static void
+sort_blocks(uint32_t *a, uint32_t n)
+{
+	uint32_t gap, i, j, t;
+
+	// Shell sort: a cache's worth of block numbers needs nothing better
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++)
+			for (j = i; j >= gap && a[j - gap] > a[j]; j -= gap)
+			{
+				t = a[j];
+				a[j] = a[j - gap];
+				a[j - gap] = t;
+			}
+}
+
+// Write every dirty block back to disk.  Only the pinned blocks and
+// those in the resident ring can be dirty, so this looks at those
+// alone, not every block on the disk, and writes the dirty ones in
+// block order, each run of adjacent ones in as few transfers as
+// possible.  The writes may still be in flight on return.
+void
+bc_writeback(void)
+{
+	uint32_t npinned, slot, i, n = 0, start, len;
+	void *va;
+
+	npinned = MIN(2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE,
+				  super->s_nblocks);
+	bc_flush(1, npinned - 1);
+
+	for (slot = 0; slot < nresident; slot++)
+	{
+		va = diskaddr(resident[slot]);
+		if (va_is_mapped(va) && va_is_dirty(va) && !jnl_holds(resident[slot]))
+			wb_blocks[n++] = resident[slot];
+	}
+	sort_blocks(wb_blocks, n);
+	for (i = 0; i < n; i += len)
+	{
+		// A block evicted and read back in can be in two slots
+		if (i > 0 && wb_blocks[i] == wb_blocks[i - 1])
+		{
+			len = 1;
+			continue;
+		}
+		start = wb_blocks[i];
+		for (len = 1; i + len < n && len < BC_MAXRUN &&
+			 wb_blocks[i + len] == start + len; len++)
+			;
+		flush_run(start, len);
+	}
+}
+
+// Free a slot in the resident ring with the CLOCK algorithm.  The hand
+// gives a block that was accessed since its last visit a second chance,
+// clearing its PTE_A bit, and evicts the first block that was not:
+// flushed if dirty, then unmapped.  Remapping a page to clear PTE_A
+// clears PTE_D too, so a dirty block is flushed on its second chance.
+// Its dirty neighbours on disk go out in the same transfer.
+// Returns the slot.
+static uint32_t
+bc_evict(void)
+{
+	uint32_t slot, first;
+	bool accessed;
+	void *va;
+	int r;
+
+	for (;;)
+	{
+		slot = hand;
+		hand = (hand + 1) % BC_NBLOCKS;
+		va = diskaddr(resident[slot]);
+		if (!va_is_mapped(va))
+			return slot;
+		// Held by the journal: it must not go to disk yet
+		if (jnl_holds(resident[slot]))
+			continue;
+		accessed = (uvpt[PGNUM(va)] & PTE_A) != 0;
+		// Flushing remaps the page, clearing PTE_A
+		if (va_is_dirty(va))
+		{
+			first = MAX(resident[slot], BC_MAXRUN / 2) - BC_MAXRUN / 2;
+			first = MAX(first, 1);
+			bc_flush(first, MIN(BC_MAXRUN, super->s_nblocks - first));
+		}
+		else if (accessed &&
+				 (r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			panic("in bc_evict, sys_page_map: %e", r);
+		if (accessed)
+			continue;
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_evict, sys_page_unmap: %e", r);
+		return slot;
+	}
+}
+
+// Write every dirty block back and evict every block that is not
+// pinned or held by the journal, so that the next access to each one
+// reads the disk.
+void
+bc_drop(void)
+{
+	uint32_t slot, n = 0;
+	void *va;
+	int r;
+
+	bc_writeback();
+	bc_drain();
+	for (slot = 0; slot < nresident; slot++)
+	{
+		va = diskaddr(resident[slot]);
+		if (!va_is_mapped(va))
+			continue;
+		if (jnl_holds(resident[slot]))
+		{
+			resident[n++] = resident[slot];
+			continue;
+		}
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_drop, sys_page_unmap: %e", r);
+	}
+	nresident = n;
+	hand = 0;
+}
+
+// Give up to n clean blocks back to the kernel, which is short of
+// memory, by unmapping them from the hand on; the slots they held are
+// free for bc_evict.  Dirty blocks, those with a transfer queued and
+// those the journal holds are left for the CLOCK hand.  Returns the number unmapped.
+uint32_t
+bc_reclaim(uint32_t n)
+{
+	uint32_t i, slot, done = 0;
+	void *va;
+	int r;
+
+	for (i = 0; i < nresident && done < n; i++)
+	{
+		slot = (hand + i) % nresident;
+		va = diskaddr(resident[slot]);
+		if (!va_is_mapped(va) || va_is_dirty(va) || bc_io_pending(resident[slot], 1) ||
+			jnl_holds(resident[slot]))
+			continue;
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_reclaim, sys_page_unmap: %e", r);
+		done++;
+	}
+	return done;
+}
+
+// Allocate a page at va with perm for the file server.  The kernel
+// asks the file server for memory when it runs out (FSREQ_RECLAIM), so
+// rather than wait for a request that it would itself have to serve,
+// the file server gives clean blocks back here and tries again.
+int
+bc_page_alloc(void *va, int perm)
+{
+	int r;
+
+	while ((r = sys_page_alloc_nowait(0, va, perm)) == -E_NO_MEM &&
+		   bc_reclaim(FS_RECLAIM_BLOCKS) > 0)
+		/* do nothing */;
+	return r;
+}
+
+// Give a block that just came into memory a slot in the resident
+// ring, evicting another block if the cache is full.
+static void
+bc_track(uint32_t blockno)
+{
+	if (bc_pinned(blockno))
+		return;
+	if (nresident < BC_NBLOCKS)
+		resident[nresident++] = blockno;
+	else
+		resident[bc_evict()] = blockno;
 }
 
 // Fault any disk block that is read in to memory by
@@ -34,9 +602,10 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+	uint64_t start;
 	int r;
 
-	// Check that the fault was within the block cache region
+	// Check that the fault was within the block cache region.
 	if (addr < (void *) DISKMAP || addr >= (void *) (DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
 			  utf->utf_eip, addr, utf->utf_err);
@@ -44,6 +613,24 @@ bc_pgfault(struct UTrapframe *utf)
 	// Sanity check the block number.
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
+	fsstats.fs_faults++;
+
+	// A queued read may be bringing the block in already, and a queued
+	// write must reach the disk before we read it back.
+	if (bdev->bd_start)
+	{
+		bc_io_wait(blockno, 1);
+		// A disk busy with other transfers takes this one in turn: it
+		// enters the cache, clean, as soon as it is done.
+		if (!va_is_mapped(addr))
+		{
+			bc_io_submit(blockno, 1, false);
+			bc_io_wait(blockno, 1);
+		}
+		if (bitmap && block_is_free(blockno))
+			panic("reading free block %08x\n", blockno);
+		return;
+	}
 
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
@@ -51,10 +638,15 @@ bc_pgfault(struct UTrapframe *utf)
 	// the disk.
 	//
 	// LAB 5: you code here:
-	r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), PTE_P | PTE_U | PTE_W);
+	// Make room for the block first, if the cache is full.
+	bc_track(blockno);
+	r = bc_page_alloc(ROUNDDOWN(addr, PGSIZE), PTE_P | PTE_U | PTE_W);
 	if (r < 0)
 		panic("page_alloc fail: %e\n", r);
-	ide_read(((size_t) ROUNDDOWN(addr, PGSIZE) - DISKMAP) / SECTSIZE, ROUNDDOWN(addr, PGSIZE), BLKSIZE / SECTSIZE);
+	start = read_tsc();
+	if ((r = bdev->bd_read(bdev, blockno * BLKSECTS, ROUNDDOWN(addr, PGSIZE), BLKSECTS)) < 0)
+		panic("in bc_pgfault, bd_read: %e", r);
+	bc_count_io(1, false, start);
 
 	// Clear the dirty bit for the disk block page since we just read the
 	// block from disk
@@ -68,26 +660,200 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Read the n consecutive blocks starting at blockno, none of which may
+// be in memory, into the cache with a single disk transfer, ahead of
+// their first access.  On a disk that runs transfers in the background
+// it is only queued, and the blocks enter the cache when it completes.
+void
+bc_prefetch(uint32_t blockno, uint32_t n)
+{
+	struct PageMapOp op;
+	uint64_t start;
+	size_t done;
+	uint32_t i;
+	int r;
+
+	assert(n > 0 && n <= BC_MAXRUN);
+	fsstats.fs_readahead += n;
+	if (bdev->bd_start)
+	{
+		bc_io_submit(blockno, n, false);
+		return;
+	}
+
+	op.srcva = PAGEMAP_ALLOC;
+	op.dstva = (uintptr_t) diskaddr(blockno);
+	op.npages = n;
+	op.perm = PTE_P | PTE_U | PTE_W;
+	if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+		panic("in bc_prefetch, sys_page_map_batch: %e", r);
+
+	// Touch every page before making room for any of them, so the
+	// evictions give the pages of this run a second chance.
+	for (i = 0; i < n; i++)
+		(void) *(volatile char *) diskaddr(blockno + i);
+	for (i = 0; i < n; i++)
+		bc_track(blockno + i);
+
+	start = read_tsc();
+	if ((r = bdev->bd_read(bdev, blockno * BLKSECTS, diskaddr(blockno), n * BLKSECTS)) < 0)
+		panic("in bc_prefetch, bd_read: %e", r);
+	bc_count_io(n, false, start);
+
+	// Clear the dirty bits, as in bc_pgfault
+	op.srcva = op.dstva;
+	if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+		panic("in bc_prefetch, sys_page_map_batch: %e", r);
+}
+
+// Bring block blockno into the cache ahead of its first access.  On
+// a disk that runs transfers in the background, a serve thread queues
+// the read and waits for it with fs_wait, so that the server goes on
+// with other requests meanwhile.  Otherwise, and outside a serve
+// thread, this does nothing: the first access faults the block in,
+// holding up the whole server until it is read.
+void
+bc_fetch(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+
+	if (!bdev->bd_start)
+		return;
+	while (!va_is_mapped(addr))
+	{
+		// Behind any transfer of the block already queued, and only
+		// once a slot is free, since bc_io_submit would wait for one
+		// without letting the others run.
+		if (!bc_io_pending(blockno, 1) && bc_io_slot())
+			bc_io_submit(blockno, 1, false);
+		if (!fs_wait(&io_nretired))
+			return;
+	}
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
+// If the block is not in the block cache, is not dirty, or is held by
+// the journal, does nothing.
 // Hint: Use va_is_mapped, va_is_dirty, and ide_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
 void
 flush_block(void *addr)
 {
-	uint32_t sectno = ((uint32_t) addr - DISKMAP) / SECTSIZE;
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+	uint64_t start;
+	int r;
 
 	if (addr < (void *) DISKMAP || addr >= (void *) (DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
 	// LAB 5: Your code here.
-	if (!va_is_mapped(addr) || !va_is_dirty(addr))
+	if (!va_is_mapped(addr) || !va_is_dirty(addr) || jnl_holds(blockno))
+		return;
+	if (bdev->bd_start)
+	{
+		// Through the queue, after any transfer of the block already
+		// there, and waited for
+		bc_io_submit(blockno, 1, true);
+		bc_io_wait(blockno, 1);
 		return;
-	ide_write(sectno, ROUNDDOWN(addr, PGSIZE), BLKSIZE / SECTSIZE);
-	sys_page_map(0, ROUNDDOWN(addr, PGSIZE), 0, ROUNDDOWN(addr, PGSIZE), PTE_P | PTE_U | PTE_W);
+	}
+	start = read_tsc();
+	if ((r = bdev->bd_write(bdev, blockno * BLKSECTS, ROUNDDOWN(addr, PGSIZE), BLKSECTS)) < 0)
+		panic("in flush_block, bd_write: %e", r);
+	bc_count_io(1, true, start);
+	sys_page_map(0, ROUNDDOWN(addr, PGSIZE), 0, ROUNDDOWN(addr, PGSIZE),
+				 bc_clean_perm(addr));
+}
+
+// Make pg, a page a client donated copy-on-write, block blockno's page
+// in the cache, in place of whatever the cache held there, and dirty:
+// a write that covers the whole block so moves no data.  A transfer of
+// the block still in flight is unaffected: a read does not enter the
+// cache over a block already there, and a write has its own mapping of
+// the page it writes.
+void
+bc_donate(uint32_t blockno, void *pg)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	if (!va_is_mapped(addr))
+		bc_track(blockno);
+	if ((r = sys_page_map(0, pg, 0, addr,
+						  PTE_P | PTE_U | PTE_COW | PTE_BC_DIRTY)) < 0)
+		panic("in bc_donate, sys_page_map: %e", r);
+}
+
+// Write the dirty blocks among the n starting at blockno out to disk, as
+// bc_flush does, and wait until the disk has all n as the cache does,
+// including any written before and still in flight.
+void
+bc_sync(uint32_t blockno, uint32_t n)
+{
+	bc_flush(blockno, n);
+	if (bdev->bd_start)
+		bc_io_wait(blockno, n);
+}
+
+// Does the disk have block blockno as the cache does: not dirty, and
+// with no transfer of it still to complete?
+bool
+bc_clean(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+
+	return !(va_is_mapped(addr) && va_is_dirty(addr)) &&
+		   !(bdev->bd_start && bc_io_pending(blockno, 1));
+}
+
+// Map a cleared page for block blockno in place of what the disk holds,
+// without reading it, for a caller about to fill all of it; return its
+// address.  Like a donated page, it leaves any transfer of the block in
+// flight alone.
+void *
+bc_blank(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	if (!va_is_mapped(addr))
+		bc_track(blockno);
+	if ((r = bc_page_alloc(addr, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("in bc_blank, bc_page_alloc: %e", r);
+	return addr;
+}
+
+// Make the n blocks from blockno on, just allocated, read as zeros:
+// each gets a cleared page, dirty, so that the disk gets the zeros in
+// place of what it held, which is never read.
+void
+bc_zero(uint32_t blockno, uint32_t n)
+{
+	void *addr;
+	int r;
+
+	for (; n > 0; blockno++, n--)
+	{
+		addr = diskaddr(blockno);
+		if (!va_is_mapped(addr))
+			bc_track(blockno);
+		if ((r = bc_page_alloc(addr, PTE_P | PTE_U | PTE_W | PTE_BC_DIRTY)) < 0)
+			panic("in bc_zero, bc_page_alloc: %e", r);
+	}
+}
+
+// How many blocks the cache holds, besides the pinned ones.
+uint32_t
+bc_resident(void)
+{
+	uint32_t slot, n = 0;
+
+	for (slot = 0; slot < nresident; slot++)
+		if (va_is_mapped(diskaddr(resident[slot])))
+			n++;
+	return n;
 }
 
 // Test that the block cache works, by smashing the superblock and
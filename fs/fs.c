@@ -1,8 +1,12 @@
 #include <inc/string.h>
 #include <inc/partition.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
+// How many disks bdev stripes over
+static uint32_t fs_ndisks = 1;
+
 // --------------------------------------------------------------
 // Super block
 // --------------------------------------------------------------
@@ -14,9 +18,17 @@ check_super(void)
 	if (super->s_magic != FS_MAGIC)
 		panic("bad file system magic number");
 
+	if (super->s_version != FS_VERSION)
+		panic("file system format version %d, not %d: rebuild it with fsformat",
+			  super->s_version, FS_VERSION);
+
 	if (super->s_nblocks > DISKSIZE / BLKSIZE)
 		panic("file system is too large");
 
+	if ((super->s_ndisks ? super->s_ndisks : 1) != fs_ndisks)
+		panic("file system striped over %d disks, not %d: rebuild it with fsformat -s",
+			  super->s_ndisks ? super->s_ndisks : 1, fs_ndisks);
+
 	cprintf("superblock is good\n");
 }
 
@@ -43,34 +55,105 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	jnl_add(&bitmap[blockno / 32]);
 	bitmap[blockno / 32] |= 1 << (blockno % 32);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// The mask of the n bits of a bitmap word from bit 'first' on
+static uint32_t
+bitmap_mask(uint32_t first, uint32_t n)
+{
+	return (n == 32 ? ~0U : (1U << n) - 1) << first;
+}
+
+// Mark the n blocks from blockno on free, a bitmap word at a time.
+static void
+free_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t k;
+
+	if (blockno == 0)
+		panic("attempt to free zero block");
+	for (; n > 0; blockno += k, n -= k)
+	{
+		k = MIN(n, 32 - blockno % 32);
+		jnl_add(&bitmap[blockno / 32]);
+		bitmap[blockno / 32] |= bitmap_mask(blockno % 32, k);
+	}
+}
+
+// Where a search for a free block starts when the caller has no
+// better idea: just past the last block allocated.
+static uint32_t alloc_hint;
+
+// Search the bitmap for a free block and allocate it, trying 'goal'
+// first and then the blocks after it, wrapping around; the bitmap is
+// scanned a word at a time, skipping full ones.  The bitmap block
+// goes out with the journal's next commit.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
+static int
+alloc_block_near(uint32_t goal)
+{
+	uint32_t nwords = ROUNDUP(super->s_nblocks, 32) / 32, w, i, word, blockno;
+
+	if (goal >= super->s_nblocks)
+		goal = 0;
+	// The last round comes back to goal's word for the blocks below it
+	for (i = 0, w = goal / 32; i <= nwords; i++, w = (w + 1) % nwords)
+	{
+		word = bitmap[w];
+		if (i == 0)
+			word &= ~0U << (goal % 32);
+		// Bits past the end of the disk come after any real free block
+		if (word == 0 || (blockno = w * 32 + bsf(word)) >= super->s_nblocks)
+			continue;
+		jnl_add(&bitmap[w]);
+		bitmap[w] &= ~(1U << (blockno % 32));
+		alloc_hint = blockno + 1;
+		return blockno;
+	}
+
+	return -E_NO_DISK;
+}
+
+// Allocate a free block anywhere, next-fit.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	return alloc_block_near(alloc_hint);
+}
 
-	// LAB 5: Your code here.
-	for (uint32_t blockno = 0; blockno < super->s_nblocks; ++blockno)
-		if (block_is_free(blockno))
-		{
-			bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-			flush_block(bitmap);
-			return blockno;
-		}
+// Allocate up to 'want' free blocks in a row: the first as
+// alloc_block_near(goal) finds it, and those after it for as long as
+// they are free, taken a bitmap word at a time.
+//
+// Return the first block allocated and store the run's length in
+// *nalloc on success, -E_NO_DISK if we are out of blocks.
+static int
+alloc_run_near(uint32_t goal, uint32_t want, uint32_t *nalloc)
+{
+	uint32_t end, limit, bits, n;
+	int r;
 
-	return -E_NO_DISK;
+	if ((r = alloc_block_near(goal)) < 0)
+		return r;
+	limit = MIN(r + want, super->s_nblocks);
+	for (end = r + 1; end < limit; end += n)
+	{
+		// Bit i is block end + i, free if set
+		bits = bitmap[end / 32] >> (end % 32);
+		n = bits == ~0U ? 32 : bsf(~bits);
+		n = MIN(n, MIN(32 - end % 32, limit - end));
+		if (n == 0)
+			break;
+		jnl_add(&bitmap[end / 32]);
+		bitmap[end / 32] &= ~bitmap_mask(end % 32, n);
+	}
+	alloc_hint = end;
+	*nalloc = end - r;
+	return r;
 }
 
 // Validate the file system bitmap.
@@ -105,16 +188,33 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available
-	if (ide_probe_disk1())
-		ide_set_disk(1);
+	// Find a JOS disk.  Use the virtio-blk disks, striped, if there are
+	// any, else the second IDE disk (number 1) if available
+	struct BlockDev *disks[VBLK_MAXDISKS];
+	uint32_t i;
+
+	if ((fs_ndisks = vblk_probe()) > 0)
+	{
+		for (i = 0; i < fs_ndisks; i++)
+			disks[i] = &vblk_bdev[i];
+		bdev = stripe_init(disks, fs_ndisks);
+	}
 	else
-		ide_set_disk(0);
+	{
+		if (ide_probe_disk1())
+			ide_set_disk(1);
+		else
+			ide_set_disk(0);
+		ide_dma_init();
+		bdev = &ide_bdev;
+		fs_ndisks = 1;
+	}
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	jnl_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
@@ -122,86 +222,319 @@ fs_init(void)
 
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// Point *slot at a new, cleared index block if it has none and 'alloc'
+// is set.
+// Returns 0 on success, -E_NOT_FOUND if *slot is 0 and alloc is not,
+// -E_NO_DISK if the disk is full.
+static int
+file_index_block(uint32_t *slot, bool alloc)
+{
+	int r;
+
+	if (*slot)
+		return 0;
+	if (!alloc)
+		return -E_NOT_FOUND;
+	if ((r = alloc_block()) < 0)
+		return r;
+	jnl_add(diskaddr(r));
+	memset(diskaddr(r), 0, BLKSIZE);
+	jnl_add(slot);
+	*slot = r;
+	return 0;
+}
+
+// Find the disk block number slot for the 'filebno'th block in file 'f'
+// in its double-indirect tree, which holds the blocks past its extents.
+// Set '*ppdiskbno' to point to that slot, an entry in an indirect block.
+// When 'alloc' is set, this function will allocate the double-indirect
+// and indirect blocks if necessary.
 //
 // Returns:
 //	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
+//	-E_NOT_FOUND if the function needed to allocate an index block, but
 //		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_NO_DISK if there's no space on the disk for an index block.
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLOCKS).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
+	uint32_t *dind;
+	int r;
+
 	// Check that file block number is in a valid range
-	if (filebno >= NDIRECT + NINDIRECT)
+	if (filebno >= MAXFILEBLOCKS)
 		return -E_INVAL;
 
-	uint32_t *requested_blockno;
-	if (filebno < NDIRECT)
-		requested_blockno = &f->f_direct[filebno];
-	else
-	{
-		// Indirect block is NULL
-		if (f->f_indirect == 0)
+	if ((r = file_index_block(&f->f_dindirect, alloc)) < 0)
+		return r;
+	dind = diskaddr(f->f_dindirect);
+	if ((r = file_index_block(&dind[filebno / NINDIRECT], alloc)) < 0)
+		return r;
+	*ppdiskbno = (uint32_t *) diskaddr(dind[filebno / NINDIRECT]) + filebno % NINDIRECT;
+	return 0;
+}
+
+// Return the number of file blocks f's extents hold, and store the
+// number of extents in use in *nextent.
+static uint32_t
+file_extent_blocks(struct File *f, uint32_t *nextent)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < NEXTENT && f->f_extent[i].fe_len; i++)
+		n += f->f_extent[i].fe_len;
+	*nextent = i;
+	return n;
+}
+
+// Return the disk block holding file block 'filebno' of f, or 0 if it
+// has none, and store in *nrun how many file blocks from filebno on,
+// at least 1, lie at the disk blocks that follow, so that a whole range
+// resolves at once.
+static uint32_t
+file_block_lookup(struct File *f, uint32_t filebno, uint32_t *nrun)
+{
+	struct FileExtent *e;
+	uint32_t base = 0, *slot, n;
+
+	*nrun = 1;
+	if (f->f_flags & FILE_INLINE)
+		return 0;
+	for (e = f->f_extent; e < f->f_extent + NEXTENT && e->fe_len; base += e->fe_len, e++)
+		if (filebno < base + e->fe_len)
 		{
-			if (!alloc)
-				return -E_NOT_FOUND;
-
-			// Allocate indirect block
-			int block_number = alloc_block();
-			if (block_number < 0)
-				return -E_NO_DISK;
-			memset(diskaddr(block_number), 0, BLKSIZE);
-			f->f_indirect = block_number;
+			*nrun = base + e->fe_len - filebno;
+			return e->fe_start + filebno - base;
 		}
-		requested_blockno = &((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
 
+	if (file_block_walk(f, filebno, &slot, false) < 0 || *slot == 0)
+		return 0;
+	// Adjacent entries of the same indirect block
+	for (n = 1; (filebno + n) % NINDIRECT != 0 && slot[n] == slot[0] + n; n++)
+		/* do nothing */;
+	*nrun = n;
+	return *slot;
+}
+
+// Allocate a disk block for file block 'filebno' of f, which has none,
+// right after the file's previous block if we can so the file stays
+// contiguous on disk.  The block right past the extents grows the last
+// extent if it is adjacent on disk, or else starts a new one; any other
+// block, and any once the extents run out, goes in the double-indirect
+// tree.
+//
+// Returns the disk block on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the disk is full.
+//	-E_INVAL if filebno is out of range.
+static int
+file_block_alloc(struct File *f, uint32_t filebno)
+{
+	uint32_t nextent, nblocks, goal = alloc_hint, prev, nrun, *slot;
+	struct FileExtent *last;
+	int r;
+
+	nblocks = file_extent_blocks(f, &nextent);
+	last = nextent > 0 ? &f->f_extent[nextent - 1] : NULL;
+	if (filebno > 0 && (prev = file_block_lookup(f, filebno - 1, &nrun)) != 0)
+		goal = prev + 1;
+
+	if (filebno == nblocks)
+	{
+		if ((r = alloc_block_near(goal)) < 0)
+			return r;
+		jnl_add(f);
+		if (last && r == last->fe_start + last->fe_len)
+		{
+			last->fe_len++;
+			return r;
+		}
+		if (nextent < NEXTENT)
+		{
+			f->f_extent[nextent].fe_start = r;
+			f->f_extent[nextent].fe_len = 1;
+			return r;
+		}
+		// The extents are all taken
+		free_block(r);
 	}
 
-	*ppdiskbno = requested_blockno;
+	if ((r = file_block_walk(f, filebno, &slot, true)) < 0)
+		return r;
+	if ((r = alloc_block_near(goal)) < 0)
+		return r;
+	jnl_add(slot);
+	*slot = r;
+	return r;
+}
+
+// Move the data of f, if it is inline, out to a block of its own, so
+// that f has block pointers again.
+// Returns 0 on success, -E_NO_DISK if the disk is full.
+static int
+file_uninline(struct File *f)
+{
+	uint8_t data[FILE_INLINE_MAX];
+	int r;
+
+	if (!(f->f_flags & FILE_INLINE))
+		return 0;
+	jnl_add(f);
+	memcpy(data, f->f_inline, sizeof(data));
+	memset(f->f_inline, 0, sizeof(data));
+	f->f_flags &= ~FILE_INLINE;
+	if (f->f_size == 0)
+		return 0;
+	if ((r = file_block_alloc(f, 0)) < 0)
+	{
+		memcpy(f->f_inline, data, sizeof(data));
+		f->f_flags |= FILE_INLINE;
+		return r;
+	}
+	memset(diskaddr(r), 0, BLKSIZE);
+	memcpy(diskaddr(r), data, f->f_size);
 	return 0;
 }
 
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped, reading the block in first on a
+// serve thread (see bc_fetch).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-	uint32_t *diskbno;
-	int ret = file_block_walk(f, filebno, &diskbno, true);
-	if (ret < 0)
+	uint32_t diskbno, nrun;
+	int r;
+
+	if (filebno >= MAXFILEBLOCKS)
+		return -E_INVAL;
+	if ((r = file_uninline(f)) < 0)
+		return r;
+
+	// If data block is null, allocate it
+	if ((diskbno = file_block_lookup(f, filebno, &nrun)) == 0)
 	{
-		assert(ret != -E_NOT_FOUND);
-		return ret;
+		if ((r = file_block_alloc(f, filebno)) < 0)
+			return r;
+		diskbno = r;
 	}
 
-	// If data block is null, allocate it
-	if (*diskbno == 0)
+	fsstats.fs_lookups++;
+	if (!va_is_mapped(diskaddr(diskbno)))
+		fsstats.fs_misses++;
+	bc_fetch(diskbno);
+	*blk = (char *) diskaddr(diskbno);
+	return 0;
+}
+
+// In-memory hash indexes of large directories, so that a lookup takes
+// O(1) instead of a scan of every entry.  The first lookup in a
+// directory of more than one block builds its index, in one of
+// DIRIDX_NDIRS reused round-robin.  Each slot of its open-addressed
+// table holds 0 or 1 + the number of an entry (its block in the
+// directory * BLKFILES + its place in the block).  An index follows
+// the entries dir_alloc_file adds; anything else that changes the
+// directory bumps its f_version, which has the next lookup rebuild it.
+// A directory of more than DIRIDX_MAXENTS entries is left to scans.
+#define DIRIDX_NDIRS    4
+#define DIRIDX_NSLOTS   16384
+#define DIRIDX_MAXENTS  (DIRIDX_NSLOTS / 2)
+
+struct DirIndex {
+	struct File *di_dir;        // the directory, or 0 if unused
+	uint32_t di_version;        // its f_version when indexed
+	bool di_full;               // too large to index
+	uint32_t di_nents;          // entries in the table
+	uint32_t di_free;           // no free entry comes before this one
+	uint32_t di_slot[DIRIDX_NSLOTS];
+};
+static struct DirIndex diridx[DIRIDX_NDIRS];
+static uint32_t diridx_next;
+
+// FNV-1a
+static uint32_t
+name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
+// Set *f to entry number 'ent' of dir.
+static int
+dir_entry(struct File *dir, uint32_t ent, struct File **f)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(dir, ent / BLKFILES, &blk)) < 0)
+		return r;
+	*f = (struct File *) blk + ent % BLKFILES;
+	return 0;
+}
+
+// Add entry number 'ent', named 'name', to an index.
+static void
+diridx_add(struct DirIndex *di, const char *name, uint32_t ent)
+{
+	uint32_t i;
+
+	if (di->di_nents == DIRIDX_MAXENTS)
 	{
-		int block_no = alloc_block();
-		if (block_no < 0)
-			return block_no;
+		di->di_full = true;
+		return;
+	}
+	for (i = name_hash(name) % DIRIDX_NSLOTS; di->di_slot[i]; i = (i + 1) % DIRIDX_NSLOTS)
+		/* do nothing */;
+	di->di_slot[i] = ent + 1;
+	di->di_nents++;
+}
+
+// Return dir's index, up to date, or NULL if dir is too small or too
+// large to index.
+static struct DirIndex *
+dir_index(struct File *dir)
+{
+	uint32_t nents = dir->f_size / BLKSIZE * BLKFILES, ent;
+	struct DirIndex *di;
+	struct File *f;
 
-		*diskbno = block_no;
+	if (nents <= BLKFILES)
+		return NULL;
+	for (di = diridx; di < diridx + DIRIDX_NDIRS && di->di_dir != dir; di++)
+		/* do nothing */;
+	if (di < diridx + DIRIDX_NDIRS && di->di_version == dir->f_version)
+		return di->di_full ? NULL : di;
+	if (di == diridx + DIRIDX_NDIRS)
+	{
+		di = &diridx[diridx_next];
+		diridx_next = (diridx_next + 1) % DIRIDX_NDIRS;
 	}
 
-	*blk = (char *) diskaddr(*diskbno);
-	return 0;
+	di->di_dir = 0;
+	di->di_full = false;
+	di->di_nents = 0;
+	di->di_free = nents;
+	memset(di->di_slot, 0, sizeof(di->di_slot));
+	for (ent = 0; ent < nents && !di->di_full; ent++)
+	{
+		if (dir_entry(dir, ent, &f) < 0)
+			return NULL;
+		if (f->f_name[0] == '\0')
+			di->di_free = MIN(di->di_free, ent);
+		else
+			diridx_add(di, f->f_name, ent);
+	}
+	di->di_dir = dir;
+	di->di_version = dir->f_version;
+	return di->di_full ? NULL : di;
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
@@ -213,6 +546,7 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
 	uint32_t i, j, nblock;
+	struct DirIndex *di;
 	char *blk;
 	struct File *f;
 
@@ -220,6 +554,21 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+	if ((di = dir_index(dir)) != NULL)
+	{
+		for (i = name_hash(name) % DIRIDX_NSLOTS; di->di_slot[i]; i = (i + 1) % DIRIDX_NSLOTS)
+		{
+			if ((r = dir_entry(dir, di->di_slot[i] - 1, &f)) < 0)
+				return r;
+			if (strcmp(f->f_name, name) == 0)
+			{
+				*file = f;
+				return 0;
+			}
+		}
+		return -E_NOT_FOUND;
+	}
+
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++)
 	{
@@ -236,35 +585,47 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and name it
+// 'name'.  The caller is responsible for filling in the other File
+// fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
-	char *blk;
+	uint32_t nents, ent;
+	struct DirIndex *di;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++)
+	nents = dir->f_size / BLKSIZE * BLKFILES;
+	di = dir_index(dir);
+	for (ent = di ? di->di_free : 0; ent < nents; ent++)
 	{
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+		if ((r = dir_entry(dir, ent, &f)) < 0)
 			return r;
-		f = (struct File *) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0')
-			{
-				*file = &f[j];
-				return 0;
-			}
+		if (f->f_name[0] == '\0')
+			break;
 	}
-	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
-		return r;
-	f = (struct File *) blk;
-	*file = &f[0];
+	if (ent == nents)
+	{
+		// A new block, which may hold what a freed block left
+		jnl_add(dir);
+		dir->f_size += BLKSIZE;
+		if ((r = dir_entry(dir, ent, &f)) < 0)
+			return r;
+		jnl_add(f);
+		memset(f, 0, BLKSIZE);
+	}
+
+	jnl_add(f);
+	strcpy(f->f_name, name);
+	if (di)
+	{
+		di->di_free = ent + 1;
+		diridx_add(di, name, ent);
+	}
+	serve_file_changed(dir);
+	*file = f;
 	return 0;
 }
 
@@ -336,6 +697,69 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 	return 0;
 }
 
+// A cache of the files that paths name, keyed by the path exactly as
+// given, so that opening one again skips walking it component by
+// component.  Negative entries remember paths that name no file.
+// Creating a file drops the negative entries; writing or resizing a
+// directory, which may move or drop entries, drops them all.  Paths
+// longer than DCACHE_MAXPATH are not cached.
+#define DCACHE_SIZE     64
+#define DCACHE_MAXPATH  MAXNAMELEN
+
+struct Dentry {
+	bool d_valid;
+	uint32_t d_hash;
+	struct File *d_file;    // 0 for a path that names no file
+	char d_path[DCACHE_MAXPATH];
+};
+static struct Dentry dcache[DCACHE_SIZE];
+
+// Return the entry 'path' would have, and store its hash in *hash.
+static struct Dentry *
+dcache_slot(const char *path, uint32_t *hash)
+{
+	*hash = name_hash(path);
+	return &dcache[*hash % DCACHE_SIZE];
+}
+
+// Return the entry for path, or NULL if it has none.
+static struct Dentry *
+dcache_lookup(const char *path)
+{
+	uint32_t hash;
+	struct Dentry *d = dcache_slot(path, &hash);
+
+	if (d->d_valid && d->d_hash == hash && strcmp(d->d_path, path) == 0)
+		return d;
+	return NULL;
+}
+
+// Remember that path names f, or no file if f is 0.
+static void
+dcache_insert(const char *path, struct File *f)
+{
+	uint32_t hash;
+	struct Dentry *d = dcache_slot(path, &hash);
+
+	if (strlen(path) >= DCACHE_MAXPATH)
+		return;
+	d->d_valid = true;
+	d->d_hash = hash;
+	d->d_file = f;
+	strcpy(d->d_path, path);
+}
+
+// Drop the negative entries, or all entries if 'all' is set.
+static void
+dcache_invalidate(bool all)
+{
+	struct Dentry *d;
+
+	for (d = dcache; d < dcache + DCACHE_SIZE; d++)
+		if (all || !d->d_file)
+			d->d_valid = false;
+}
+
 // --------------------------------------------------------------
 // File operations
 // --------------------------------------------------------------
@@ -353,12 +777,11 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
+	dcache_invalidate(false);
 
-	strcpy(f->f_name, name);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -367,7 +790,18 @@ file_create(const char *path, struct File **pf)
 int
 file_open(const char *path, struct File **pf)
 {
-	return walk_path(path, 0, pf, 0);
+	struct Dentry *d;
+	int r;
+
+	if ((d = dcache_lookup(path)) != NULL)
+	{
+		*pf = d->d_file;
+		return d->d_file ? 0 : -E_NOT_FOUND;
+	}
+	r = walk_path(path, 0, pf, 0);
+	if (r == 0 || r == -E_NOT_FOUND)
+		dcache_insert(path, r == 0 ? *pf : 0);
+	return r;
 }
 
 // Read count bytes from f into buf, starting from seek position
@@ -384,6 +818,11 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (f->f_flags & FILE_INLINE)
+	{
+		memmove(buf, f->f_inline + offset, count);
+		return count;
+	}
 
 	for (pos = offset; pos < offset + count;)
 	{
@@ -398,10 +837,58 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Call fn on each run of file blocks filebno through filebno + n - 1 of
+// f that lie next to each other on disk, passing the first disk block
+// and the length of the run, at most BC_MAXRUN blocks.  Holes end a
+// run, and so do blocks in the block cache if uncached_only is set.
+static void
+file_block_runs(struct File *f, uint32_t filebno, uint32_t n, bool uncached_only,
+				void (*fn)(uint32_t blockno, uint32_t n))
+{
+	uint32_t end = MIN(filebno + n, MAXFILEBLOCKS), start = 0, len = 0;
+	uint32_t diskbno, nrun, blockno, i;
+
+	for (; filebno < end; filebno += nrun)
+	{
+		diskbno = file_block_lookup(f, filebno, &nrun);
+		nrun = MIN(nrun, end - filebno);
+		for (i = 0; i < nrun; i++)
+		{
+			blockno = diskbno ? diskbno + i : 0;
+			if (blockno && uncached_only && va_is_mapped(diskaddr(blockno)))
+				blockno = 0;
+			if (len > 0 && (blockno != start + len || len == BC_MAXRUN))
+			{
+				fn(start, len);
+				len = 0;
+			}
+			if (blockno && len++ == 0)
+				start = blockno;
+		}
+	}
+	if (len > 0)
+		fn(start, len);
+}
+
+// Bring file blocks filebno through filebno + n - 1 of f into the
+// block cache ahead of their first access.  Blocks that lie next to
+// each other on disk are read in together; blocks already cached and
+// holes are skipped.
+void
+file_prefetch(struct File *f, uint32_t filebno, uint32_t n)
+{
+	file_block_runs(f, filebno, n, true, bc_prefetch);
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
 // Extends the file if necessary.
+//
+// A regular file written while empty keeps its data in its File, with
+// no block, for as long as it fits in FILE_INLINE_MAX bytes; it is
+// read with the directory block that holds it.  Growing past that
+// moves the data out to a block (see file_uninline).
+//
 // Returns the number of bytes written, < 0 on error.
 int
 file_write(struct File *f, const void *buf, size_t count, off_t offset)
@@ -410,6 +897,21 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	jnl_add(f);
+	if (f->f_type == FTYPE_DIR)
+		dcache_invalidate(true);
+	else if (offset + count <= FILE_INLINE_MAX &&
+			 ((f->f_flags & FILE_INLINE) || f->f_size == 0))
+	{
+		f->f_flags |= FILE_INLINE;
+		if (offset + count > f->f_size)
+			f->f_size = offset + count;
+		memmove(f->f_inline + offset, buf, count);
+		f->f_version++;
+		serve_file_changed(f);
+		return count;
+	}
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
@@ -420,68 +922,270 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		if (f->f_type == FTYPE_DIR)
+			jnl_add(blk);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
 		buf += bn;
 	}
+	f->f_version++;
+	serve_file_changed(f);
 
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
+// Write count bytes into f at offset, as file_write does, from 'pages',
+// page-aligned pages a client donated copy-on-write (FSREQ_WRITE_PAGES).
+// Each page that lands on a whole block of the file becomes that
+// block's page in the cache (see bc_donate), with no copy and no read
+// of the block's old contents; the rest is copied as file_write would.
+// Returns the number of bytes written, < 0 on error.
+int
+file_write_pages(struct File *f, const void *pages, size_t count, off_t offset)
 {
+	uint32_t diskbno, nrun;
+	const char *buf = pages;
+	off_t pos, end = offset + count;
+	size_t n;
 	int r;
-	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+	if (f->f_type == FTYPE_DIR)
+		return file_write(f, pages, count, offset);
+	jnl_add(f);
+	if (end > f->f_size && (r = file_set_size(f, end)) < 0)
 		return r;
-	if (*ptr)
+
+	for (pos = offset; pos < end; pos += n, buf += n)
 	{
-		free_block(*ptr);
-		*ptr = 0;
+		n = MIN(BLKSIZE - pos % BLKSIZE, end - pos);
+		if (n < BLKSIZE || PGOFF(buf) != 0)
+		{
+			if ((r = file_write(f, buf, n, pos)) < 0)
+				return r;
+			continue;
+		}
+		if ((diskbno = file_block_lookup(f, pos / BLKSIZE, &nrun)) == 0)
+		{
+			if ((r = file_block_alloc(f, pos / BLKSIZE)) < 0)
+				return r;
+			diskbno = r;
+		}
+		bc_donate(diskbno, (void *) buf);
 	}
-	return 0;
+	f->f_version++;
+	serve_file_changed(f);
+
+	return count;
+}
+
+// Copy count bytes of file 'in' from inoff into file 'out' at outoff,
+// as file_read and file_write would through a buffer, but straight
+// from in's blocks in the cache.  in and out must be different files.
+// Returns the number of bytes copied, short at the end of in, or < 0
+// on error.
+ssize_t
+file_splice(struct File *in, off_t inoff, struct File *out, off_t outoff,
+			size_t count)
+{
+	const char *src;
+	char *blk;
+	size_t done, n;
+	int r;
+
+	if (inoff >= in->f_size)
+		return 0;
+	count = MIN(count, in->f_size - inoff);
+	for (done = 0; done < count; done += n)
+	{
+		if (in->f_flags & FILE_INLINE)
+		{
+			src = (const char *) in->f_inline + inoff + done;
+			n = count - done;
+		} else
+		{
+			if ((r = file_get_block(in, (inoff + done) / BLKSIZE, &blk)) < 0)
+				return done > 0 ? done : r;
+			src = blk + (inoff + done) % BLKSIZE;
+			n = MIN(BLKSIZE - (inoff + done) % BLKSIZE, count - done);
+		}
+		if ((r = file_write(out, src, n, outoff + done)) < 0)
+			return done > 0 ? done : r;
+	}
+	return count;
 }
 
 // Remove any blocks currently used by file 'f',
-// but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// but not necessary for a file of size 'newsize': cut the extents
+// short, and clear the double-indirect tree's entries past the new
+// size, freeing the index blocks left with none.  The blocks go back
+// to the bitmap a run at a time.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, base, keep, nextent, i, *dind, *ind;
+	uint32_t run = 0, runlen = 0;
+	struct FileExtent *e;
+	bool empty;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
+	jnl_add(f);
 
-	if (new_nblocks <= NDIRECT && f->f_indirect)
+	// The tree only holds blocks past the extents: it empties if the
+	// new size is within them
+	base = file_extent_blocks(f, &nextent);
+	empty = new_nblocks <= base;
+	if (f->f_dindirect)
 	{
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+		dind = diskaddr(f->f_dindirect);
+		jnl_add(dind);
+		for (i = new_nblocks / NINDIRECT; i * NINDIRECT < old_nblocks; i++)
+		{
+			if (!dind[i])
+				continue;
+			ind = diskaddr(dind[i]);
+			jnl_add(ind);
+			for (bno = MAX(new_nblocks, i * NINDIRECT);
+				 bno < MIN(old_nblocks, (i + 1) * NINDIRECT); bno++)
+				if (ind[bno % NINDIRECT])
+				{
+					// Free blocks next to each other on disk together
+					if (runlen > 0 && ind[bno % NINDIRECT] != run + runlen)
+					{
+						free_run(run, runlen);
+						runlen = 0;
+					}
+					if (runlen++ == 0)
+						run = ind[bno % NINDIRECT];
+					ind[bno % NINDIRECT] = 0;
+				}
+			if (empty || new_nblocks <= i * NINDIRECT)
+			{
+				free_block(dind[i]);
+				dind[i] = 0;
+			}
+		}
+		if (empty)
+		{
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+		if (runlen > 0)
+			free_run(run, runlen);
+	}
+
+	for (e = f->f_extent, base = 0; e < f->f_extent + nextent; e++)
+	{
+		keep = new_nblocks > base ? MIN(e->fe_len, new_nblocks - base) : 0;
+		if (keep < e->fe_len)
+			free_run(e->fe_start + keep, e->fe_len - keep);
+		base += e->fe_len;
+		e->fe_len = keep;
+		if (keep == 0)
+			e->fe_start = 0;
 	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// An inline file stays inline if it still fits, and becomes a plain
+// empty file if truncated to nothing.
+// Returns 0 on success, -E_NO_DISK if the disk is full.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	int r;
+
+	jnl_add(f);
+	if (f->f_type == FTYPE_DIR)
+		dcache_invalidate(true);
+	if ((f->f_flags & FILE_INLINE) && newsize > FILE_INLINE_MAX &&
+		(r = file_uninline(f)) < 0)
+		return r;
+	if (f->f_flags & FILE_INLINE)
+	{
+		if (f->f_size > newsize)
+			memset(f->f_inline + newsize, 0, f->f_size - newsize);
+		if (newsize == 0)
+			f->f_flags &= ~FILE_INLINE;
+	} else if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	f->f_version++;
+	serve_file_changed(f);
+	return 0;
+}
+
+// Give f disk blocks for the len bytes at offset that have none, as
+// posix_fallocate does, growing f to cover them if it is shorter.
+// Each hole past the end of the extents is filled with one search of
+// the bitmap: its first block as file_get_block would find it, and as
+// many free blocks after that as the hole needs.  Any other hole gets
+// its blocks one at a time.  The new blocks read as zeros.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the disk is full; blocks allocated so far stay.
+//	-E_INVAL if f is a directory, or the range is bad.
+int
+file_allocate(struct File *f, off_t offset, off_t len)
+{
+	uint32_t filebno, end, nblocks, nextent, nhole, nrun, goal;
+	struct FileExtent *last;
+	int r;
+
+	if (f->f_type == FTYPE_DIR || offset < 0 || len <= 0 ||
+		len > MAXFILESIZE - offset)
+		return -E_INVAL;
+	jnl_add(f);
+	if (offset + len > f->f_size && (r = file_set_size(f, offset + len)) < 0)
+		return r;
+	if (f->f_flags & FILE_INLINE)
+		return 0;
+
+	end = ROUNDUP(offset + len, BLKSIZE) / BLKSIZE;
+	for (filebno = offset / BLKSIZE; filebno < end; filebno += nrun)
+	{
+		if (file_block_lookup(f, filebno, &nrun) != 0)
+		{
+			nrun = MIN(nrun, end - filebno);
+			continue;
+		}
+		for (nhole = 1; filebno + nhole < end &&
+			 file_block_lookup(f, filebno + nhole, &nrun) == 0; nhole++)
+			/* do nothing */;
+
+		nblocks = file_extent_blocks(f, &nextent);
+		last = nextent > 0 ? &f->f_extent[nextent - 1] : NULL;
+		if (filebno != nblocks)
+			r = -E_INVAL;
+		else
+		{
+			goal = last ? last->fe_start + last->fe_len : alloc_hint;
+			if ((r = alloc_run_near(goal, nhole, &nrun)) < 0)
+				return r;
+			if (last && r == last->fe_start + last->fe_len)
+				last->fe_len += nrun;
+			else if (nextent < NEXTENT)
+			{
+				f->f_extent[nextent].fe_start = r;
+				f->f_extent[nextent].fe_len = nrun;
+			} else
+			{
+				free_run(r, nrun);
+				r = -E_INVAL;
+			}
+		}
+		// Not at the end of the extents, or they are all taken
+		if (r < 0)
+		{
+			if ((r = file_block_alloc(f, filebno)) < 0)
+				return r;
+			nrun = 1;
+		}
+		bc_zero(r, nrun);
+	}
+	f->f_version++;
+	serve_file_changed(f);
 	return 0;
 }
 
@@ -489,31 +1193,50 @@ file_set_size(struct File *f, off_t newsize)
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
+//
+// Blocks next to each other on disk are written with one transfer.
+// The File and index blocks then go out with a commit of the journal,
+// along with whatever else other requests changed meanwhile.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	uint32_t nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++)
-	{
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-			pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	file_block_runs(f, 0, nblocks, false, bc_flush);
+	bc_drain();
+	jnl_commit();
 }
 
 
+// Commit the journal, once the requests changing metadata are done,
+// and start writing every other dirty block back to disk, without
+// waiting for the disk.
+void
+fs_writeback(void)
+{
+	jnl_tick();
+	bc_writeback();
+}
+
 // Sync the entire file system.  A big hammer.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	jnl_commit();
+	bc_writeback();
+	bc_drain();
+}
+
+// Forget everything cached: path lookups, directory indexes, and,
+// once it is written back, the block cache.  For measuring the file
+// system cold.
+void
+fs_drop_cache(void)
+{
+	dcache_invalidate(true);
+	memset(diridx, 0, sizeof(diridx));
+	diridx_next = 0;
+	jnl_commit();
+	bc_drop();
 }
 
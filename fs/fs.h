@@ -11,39 +11,142 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE    0xC0000000
 
+/* Most blocks the block cache keeps in memory at once, besides the
+ * superblock and bitmap blocks, which always stay. */
+#define BC_NBLOCKS    1024
+
+/* Most blocks one disk transfer moves (256 sectors), and how many
+ * blocks past a sequential read the file server reads ahead. */
+#define BC_MAXRUN    (256 / BLKSECTS)
+#define BC_READAHEAD    BC_MAXRUN
+
+/* Most background disk transfers at once, and where their pages are mapped
+ * meanwhile: BC_MAXRUN pages for each. */
+#define BC_NIO        4
+#define BC_IOVA        (DISKMAP - 512 * PGSIZE)
+
+/* Marks a block cache page that the disk does not have yet although its
+ * PTE_D is clear: one a client donated (see bc_donate), which stays
+ * copy-on-write, so that it is never written to get PTE_D set, or one
+ * bc_zero cleared. */
+#define PTE_BC_DIRTY    0x200
+
+/* How often, in milliseconds, the file server writes dirty blocks back
+ * to disk. */
+#define FS_FLUSH_INTERVAL    1000
+
+/* How many clean blocks the file server gives back each time the kernel
+ * reports it is out of memory. */
+#define FS_RECLAIM_BLOCKS    64
+
 struct Super *super;        // superblock
 uint32_t *bitmap;        // bitmap blocks mapped in memory
 
+/* A disk.  bd_read and bd_write move nsecs sectors and wait for them;
+ * a device that can also run transfers in the background has bd_start
+ * and bd_reap, and several may be in flight if it has room.  bd_start
+ * returns -E_WOULD_BLOCK when it has none until some transfer is
+ * reaped, and bd_reap when no transfer has ended yet; otherwise
+ * bd_reap stores the tag of one that has and its result.  A device
+ * raises one of the IRQs in the mask bd_irqs when a background
+ * transfer ends.  Each operation gets the BlockDev it was called
+ * through, so that one driver may run several disks, told apart by
+ * bd_unit. */
+struct BlockDev {
+	const char *bd_name;
+	int (*bd_read)(struct BlockDev *bd, uint32_t secno, void *dst, size_t nsecs);
+	int (*bd_write)(struct BlockDev *bd, uint32_t secno, const void *src,
+					size_t nsecs);
+	int (*bd_start)(struct BlockDev *bd, uint32_t tag, uint32_t secno,
+					const void *buf, size_t nsecs, bool write);
+	int (*bd_reap)(struct BlockDev *bd, uint32_t *tag, int *status);
+	uint32_t bd_irqs;
+	uint32_t bd_unit;
+	uint32_t bd_nsectors;        // size, if known, else 0
+};
+
+struct BlockDev *bdev;        // the disk the block cache runs on
+
 /* ide.c */
+extern struct BlockDev ide_bdev;
 bool ide_probe_disk1(void);
 void ide_set_disk(int diskno);
 void ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int ide_read(uint32_t secno, void *dst, size_t nsecs);
 int ide_write(uint32_t secno, const void *src, size_t nsecs);
+void ide_dma_init(void);
+
+/* vblk.c */
+#define VBLK_MAXDISKS    4
+extern struct BlockDev vblk_bdev[VBLK_MAXDISKS];
+uint32_t vblk_probe(void);
+
+/* stripe.c */
+#define STRIPE_MAXDISKS    VBLK_MAXDISKS
+/* Most pieces one transfer splits into, one per stripe it touches */
+#define STRIPE_MAXPIECES    (BC_MAXRUN / FS_STRIPE_BLOCKS + 1)
+struct BlockDev *stripe_init(struct BlockDev **disks, uint32_t ndisks);
 
 /* bc.c */
+extern struct FsStats fsstats;
 void *diskaddr(uint32_t blockno);
 bool va_is_mapped(void *va);
 bool va_is_dirty(void *va);
 void flush_block(void *addr);
+void bc_flush(uint32_t blockno, uint32_t n);
+void bc_writeback(void);
+void bc_intr(void);
+void bc_drain(void);
+void bc_prefetch(uint32_t blockno, uint32_t n);
+void bc_fetch(uint32_t blockno);
+void bc_donate(uint32_t blockno, void *pg);
+void bc_sync(uint32_t blockno, uint32_t n);
+bool bc_clean(uint32_t blockno);
+void *bc_blank(uint32_t blockno);
+void bc_zero(uint32_t blockno, uint32_t n);
+void bc_drop(void);
+uint32_t bc_reclaim(uint32_t n);
+int bc_page_alloc(void *va, int perm);
+uint32_t bc_resident(void);
 void bc_init(void);
 
+/* journal.c */
+void jnl_init(void);
+bool jnl_holds(uint32_t blockno);
+void jnl_add(void *va);
+void jnl_begin(void);
+void jnl_end(void);
+void jnl_commit(void);
+void jnl_tick(void);
+
 /* fs.c */
 void fs_init(void);
 int file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int file_create(const char *path, struct File **f);
 int file_open(const char *path, struct File **f);
 ssize_t file_read(struct File *f, void *buf, size_t count, off_t offset);
+void file_prefetch(struct File *f, uint32_t filebno, uint32_t n);
 int file_write(struct File *f, const void *buf, size_t count, off_t offset);
+int file_write_pages(struct File *f, const void *pages, size_t count, off_t offset);
+ssize_t file_splice(struct File *in, off_t inoff, struct File *out, off_t outoff,
+					size_t count);
 int file_set_size(struct File *f, off_t newsize);
+int file_allocate(struct File *f, off_t offset, off_t len);
 void file_flush(struct File *f);
 int file_remove(const char *path);
+void fs_writeback(void);
 void fs_sync(void);
+void fs_drop_cache(void);
 
 /* int	map_block(uint32_t); */
 bool block_is_free(uint32_t blockno);
 int alloc_block(void);
 
+/* serv.c */
+void serve_file_changed(struct File *f);
+bool fs_wait(volatile uint32_t *chan);
+void fs_wakeup(volatile uint32_t *chan);
+
 /* test.c */
 void fs_test(void);
 
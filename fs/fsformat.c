@@ -18,6 +18,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #undef off_t
 #undef bool
@@ -34,12 +35,24 @@ typedef int bool;
 #include <inc/fs.h>
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
-#define MAX_DIR_ENTS 128
+// As much disk as the file server maps (DISKSIZE in fs/fs.h)
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
+#define MAX_JOBS 64
+// As many disks as the file server stripes over (VBLK_MAXDISKS)
+#define MAX_NDISKS 4
 
 struct Dir {
 	struct File *f;
 	struct File *ents;
-	int n;
+	int n, max;
+};
+
+// A file to copy into the image, once every block has been laid out:
+// 'size' bytes to the blocks from 'start'.
+struct Input {
+	const char *name;
+	uint32_t start;
+	size_t size;
 };
 
 uint32_t nblocks;
@@ -59,21 +72,6 @@ panic(const char *fmt, ...)
 	abort();
 }
 
-void
-readn(int f, void *out, size_t n)
-{
-	size_t p = 0;
-	while (p < n)
-	{
-		ssize_t m = read(f, out + p, n - p);
-		if (m < 0)
-			panic("read: %s", strerror(errno));
-		if (m == 0)
-			panic("read: Unexpected EOF");
-		p += m;
-	}
-}
-
 uint32_t
 blockof(void *pos)
 {
@@ -113,12 +111,17 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_version = FS_VERSION;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty journal: all zero, so no header
+	super->s_journal = blockof(alloc(FS_JOURNAL_BLOCKS * BLKSIZE));
+	super->s_njournal = FS_JOURNAL_BLOCKS;
 }
 
 void
@@ -136,58 +139,51 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	// Files are written contiguously: one extent holds them
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT)
+	if (len > 0)
 	{
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+		f->f_extent[0].fe_start = start;
+		f->f_extent[0].fe_len = len / BLKSIZE;
 	}
 }
 
+// Lay out a directory of 'n' entries, which go straight into its blocks.
 void
-startdir(struct File *f, struct Dir *dout)
+startdir(struct File *f, struct Dir *dout, int n)
 {
+	uint32_t size = ROUNDUP(n * sizeof(struct File), BLKSIZE);
+
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = alloc(size);
 	dout->n = 0;
+	dout->max = n;
+	finishfile(f, blockof(dout->ents), size);
 }
 
 struct File *
 diradd(struct Dir *d, uint32_t type, const char *name)
 {
 	struct File *out = &d->ents[d->n++];
-	if (d->n > MAX_DIR_ENTS)
+	if (d->n > d->max)
 		panic("too many directory entries");
+	if (strlen(name) >= MAXNAMELEN)
+		panic("%s: name too long", name);
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
 }
 
+// Add file 'name' to dir and give it its blocks, right after the last
+// file's, for copyfile to fill in later.
 void
-finishdir(struct Dir *d)
-{
-	int size = d->n * sizeof(struct File);
-	struct File *start = alloc(size);
-	memmove(start, d->ents, size);
-	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
-	free(d->ents);
-	d->ents = NULL;
-}
-
-void
-writefile(struct Dir *dir, const char *name)
+placefile(struct Dir *dir, const char *name, struct Input *in)
 {
 	int r, fd;
 	struct File *f;
 	struct stat st;
 	const char *last;
-	char *start;
 
 	if ((fd = open(name, O_RDONLY)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -197,6 +193,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("%s is not a regular file", name);
 	if (st.st_size >= MAXFILESIZE)
 		panic("%s too large", name);
+	close(fd);
 
 	last = strrchr(name, '/');
 	if (last)
@@ -205,43 +202,171 @@ writefile(struct Dir *dir, const char *name)
 		last = name;
 
 	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
+	if (st.st_size > 0 && st.st_size <= FILE_INLINE_MAX)
+	{
+		// Small enough to keep in its File, with no block
+		if ((fd = open(name, O_RDONLY)) < 0)
+			panic("open %s: %s", name, strerror(errno));
+		if (read(fd, f->f_inline, st.st_size) != st.st_size)
+			panic("read %s: %s", name, strerror(errno));
+		close(fd);
+		f->f_flags = FILE_INLINE;
+		f->f_size = st.st_size;
+		return;
+	}
+	in->name = name;
+	in->size = st.st_size;
+	in->start = blockof(alloc(in->size));
+	finishfile(f, in->start, in->size);
+}
+
+// Copy a placed file into the image, through a mapping of it.
+void
+copyfile(const struct Input *in)
+{
+	int fd;
+	void *src;
+
+	if (in->size == 0)
+		return;
+	if ((fd = open(in->name, O_RDONLY)) < 0)
+		panic("open %s: %s", in->name, strerror(errno));
+	if ((src = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		panic("mmap %s: %s", in->name, strerror(errno));
+	memcpy(diskmap + in->start * BLKSIZE, src, in->size);
+	munmap(src, in->size);
 	close(fd);
 }
 
+// Copy all n placed files with 'njobs' processes, each taking a share
+// of about the same number of bytes.  They all write the one shared
+// mapping of the image, to blocks no other one touches.
+void
+copyfiles(const struct Input *in, int n, int njobs)
+{
+	size_t total = 0, done = 0;
+	int i, j, first, status;
+	pid_t pid;
+
+	for (i = 0; i < n; i++)
+		total += in[i].size;
+	if (njobs > n)
+		njobs = n;
+	if (njobs <= 1)
+	{
+		for (i = 0; i < n; i++)
+			copyfile(&in[i]);
+		return;
+	}
+
+	for (i = 0, j = 0; j < njobs; j++)
+	{
+		first = i;
+		while (i < n && (j == njobs - 1 || done < total / njobs * (j + 1)))
+			done += in[i++].size;
+		if ((pid = fork()) < 0)
+			panic("fork: %s", strerror(errno));
+		if (pid == 0)
+		{
+			for (; first < i; first++)
+				copyfile(&in[first]);
+			exit(0);
+		}
+	}
+
+	while ((pid = wait(&status)) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			panic("copying files failed");
+}
+
+// Deal the finished image out to ndisks images, name.0 and on, the way
+// the file server stripes its disks: FS_STRIPE_BLOCKS blocks to each in
+// turn.
+void
+stripedisk(const char *name, uint32_t ndisks)
+{
+	char path[1024];
+	uint32_t b, n, d;
+	int fd;
+
+	for (d = 0; d < ndisks; d++)
+	{
+		snprintf(path, sizeof(path), "%s.%u", name, d);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+			panic("open %s: %s", path, strerror(errno));
+		for (b = d * FS_STRIPE_BLOCKS; b < nblocks; b += ndisks * FS_STRIPE_BLOCKS)
+		{
+			n = nblocks - b < FS_STRIPE_BLOCKS ? nblocks - b : FS_STRIPE_BLOCKS;
+			if (write(fd, diskmap + b * BLKSIZE, n * BLKSIZE) != n * BLKSIZE)
+				panic("write %s: %s", path, strerror(errno));
+		}
+		// Every disk holds whole stripes, so they are all the same size
+		if (ftruncate(fd, ROUNDUP(nblocks, ndisks * FS_STRIPE_BLOCKS) / ndisks * BLKSIZE) < 0)
+			panic("truncate %s: %s", path, strerror(errno));
+		close(fd);
+	}
+}
+
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-j JOBS] [-s NDISKS] fs.img NBLOCKS files...\n");
 	exit(2);
 }
 
 int
 main(int argc, char **argv)
 {
-	int i;
+	int i, nfiles, njobs = 1, ndisks = 1;
 	char *s;
 	struct Dir root;
+	struct Input *inputs;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	while (argc > 2 && argv[1][0] == '-')
+	{
+		if (strcmp(argv[1], "-j") == 0)
+		{
+			njobs = strtol(argv[2], &s, 0);
+			if (*s || s == argv[2] || njobs < 1 || njobs > MAX_JOBS)
+				usage();
+		}
+		else if (strcmp(argv[1], "-s") == 0)
+		{
+			ndisks = strtol(argv[2], &s, 0);
+			if (*s || s == argv[2] || ndisks < 1 || ndisks > MAX_NDISKS)
+				usage();
+		}
+		else
+			usage();
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 3)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
+	super->s_ndisks = ndisks > 1 ? ndisks : 0;
 
-	startdir(&super->s_root, &root);
-	for (i = 3; i < argc; i++)
-		writefile(&root, argv[i]);
-	finishdir(&root);
+	// Lay out the whole image first: the root directory, then every
+	// file in one contiguous extent, in order.
+	nfiles = argc - 3;
+	if (!(inputs = calloc(nfiles + 1, sizeof *inputs)))
+		panic("out of memory");
+	startdir(&super->s_root, &root, nfiles);
+	for (i = 0; i < nfiles; i++)
+		placefile(&root, argv[i + 3], &inputs[i]);
+
+	copyfiles(inputs, nfiles, njobs);
+	free(inputs);
 
 	finishdisk();
+	if (ndisks > 1)
+		stripedisk(argv[1], ndisks);
 	return 0;
 }
-
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code: bus-master DMA when the controller is a PCI
+ * bus-master IDE one (PIIX), which may run in the background while the
+ * file server does other work, and polled PIO otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +14,61 @@
 #define IDE_DF        0x20
 #define IDE_ERR        0x01
 
+// PCI configuration mechanism 1
+#define PCI_CONF_ADDR    0xCF8
+#define PCI_CONF_DATA    0xCFC
+
+// Bus-master IDE registers of the primary channel, from bmiba
+#define BM_CMD        0
+#define BM_STATUS    2
+#define BM_PRDT        4
+
+#define BM_CMD_START    0x01
+#define BM_CMD_READ    0x08    // transfer to memory
+#define BM_STATUS_ACTIVE    0x01
+#define BM_STATUS_ERR    0x02
+#define BM_STATUS_IRQ    0x04
+
+// A physical region descriptor: one piece of a DMA transfer, which may
+// not cross a 64KB boundary.
+struct IdePrd {
+	uint32_t prd_addr;
+	uint16_t prd_nbytes;
+	uint16_t prd_flags;
+};
+
+#define PRD_EOT        0x8000    // last descriptor of the table
+
 static int diskno = 1;
 
+// I/O base of the bus-master registers, or 0 if we only have PIO.
+static uint16_t bmiba;
+
+// The descriptor table, one entry per page of the largest transfer
+// plus one for an unaligned buffer.  Page-aligned, so it neither
+// crosses a 64KB boundary nor moves once written.
+static struct IdePrd prdt[BC_MAXRUN + 1] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+
+// Is a transfer started by ide_dma_start in flight, and its tag?
+static bool dma_busy;
+static uint32_t dma_tag;
+
+static int ide_bd_read(struct BlockDev *bd, uint32_t secno, void *dst,
+					   size_t nsecs);
+static int ide_bd_write(struct BlockDev *bd, uint32_t secno, const void *src,
+						size_t nsecs);
+static int ide_start(struct BlockDev *bd, uint32_t tag, uint32_t secno,
+					 const void *buf, size_t nsecs, bool write);
+static int ide_reap(struct BlockDev *bd, uint32_t *tag, int *status);
+
+struct BlockDev ide_bdev = {
+	.bd_name = "IDE",
+	.bd_read = ide_bd_read,
+	.bd_write = ide_bd_write,
+	.bd_irqs = 1 << IRQ_IDE,
+};
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -60,13 +115,60 @@ ide_set_disk(int d)
 }
 
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+static uint32_t
+pci_conf_read(uint32_t dev, uint32_t func, uint32_t off)
 {
-	int r;
+	outl(PCI_CONF_ADDR, (1 << 31) | (dev << 11) | (func << 8) | off);
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(uint32_t dev, uint32_t func, uint32_t off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, (1 << 31) | (dev << 11) | (func << 8) | off);
+	outl(PCI_CONF_DATA, v);
+}
+
+// Look for a bus-master IDE controller on PCI bus 0 and turn on its
+// bus mastering, so that ide_read and ide_write use DMA and ide_bdev
+// can run transfers in the background.  Without one they stay with PIO.
+void
+ide_dma_init(void)
+{
+	uint32_t dev, func, class, bar;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++)
+		{
+			if ((pci_conf_read(dev, func, 0x00) & 0xFFFF) == 0xFFFF)
+				continue;
+			// Mass storage, IDE, bus-master capable
+			class = pci_conf_read(dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || !(class & 0x8000))
+				continue;
+			bar = pci_conf_read(dev, func, 0x20);
+			if (!(bar & 1) || (bar & ~3) == 0)
+				continue;
+			// I/O space and bus master enable
+			pci_conf_write(dev, func, 0x04,
+						   pci_conf_read(dev, func, 0x04) | 0x05);
 
-	assert(nsecs <= 256);
+			// Writing the table resolves copy-on-write first
+			memset(prdt, 0, sizeof(prdt));
+			if (sys_page_paddr(prdt, 1, &prdt_pa) < 0)
+				return;
+			bmiba = bar & ~3;
+			ide_bdev.bd_start = ide_start;
+			ide_bdev.bd_reap = ide_reap;
+			cprintf("FS: bus-master IDE DMA at port 0x%x\n", bmiba);
+			return;
+		}
+}
 
+// Select the disk and issue an ATA command for nsecs sectors at secno.
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -74,7 +176,123 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
-	outb(0x1F7, 0x20);    // CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Start moving nsecs sectors between the disk at secno and the buffer
+// at buf by bus-master DMA, and return at once: the controller works
+// straight from the buffer's pages, one descriptor per page, and
+// raises IRQ_IDE when it is done.  ide_dma_done tells when that is and
+// ide_dma_finish ends the transfer; until then no other may start.
+// Returns 0 on success, < 0 if there is no DMA or the buffer is not
+// all mapped.
+static int
+ide_dma_start(uint32_t secno, const void *buf, size_t nsecs, bool write)
+{
+	physaddr_t pa[ARRAY_SIZE(prdt)];
+	uintptr_t va = ROUNDDOWN((uintptr_t) buf, PGSIZE);
+	size_t len = nsecs * SECTSIZE, off = (uintptr_t) buf - va, n, i;
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+
+	assert(nsecs <= 256 && !dma_busy);
+
+	n = (ROUNDUP((uintptr_t) buf + len, PGSIZE) - va) / PGSIZE;
+	if (!bmiba || n > ARRAY_SIZE(pa) || sys_page_paddr((void *) va, n, pa) < 0)
+		return -1;
+	for (i = 0; len > 0; i++, off = 0)
+	{
+		n = MIN(PGSIZE - off, len);
+		prdt[i].prd_addr = pa[i] + off;
+		prdt[i].prd_nbytes = n;
+		prdt[i].prd_flags = 0;
+		len -= n;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+
+	outb(bmiba + BM_CMD, 0);
+	outl(bmiba + BM_PRDT, prdt_pa);
+	outb(bmiba + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+	outb(bmiba + BM_CMD, dir);
+	ide_command(secno, nsecs, write ? 0xCA : 0xC8);    // WRITE/READ DMA
+	outb(bmiba + BM_CMD, dir | BM_CMD_START);
+	dma_busy = true;
+	return 0;
+}
+
+// Has the DMA transfer in flight ended?
+static bool
+ide_dma_done(void)
+{
+	return (inb(bmiba + BM_STATUS) & (BM_STATUS_IRQ | BM_STATUS_ERR)) != 0;
+}
+
+// End the DMA transfer in flight, which ide_dma_done reported over,
+// and acknowledge its interrupt.  Returns 0 if it succeeded, < 0 if
+// the transfer failed.
+static int
+ide_dma_finish(void)
+{
+	int st;
+
+	assert(dma_busy);
+	st = inb(bmiba + BM_STATUS);
+	outb(bmiba + BM_CMD, 0);
+	outb(bmiba + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+	dma_busy = false;
+	// Reading the status register lowers the interrupt line
+	if ((st & BM_STATUS_ERR) || ide_wait_ready(1) < 0)
+		return -1;
+	return 0;
+}
+
+// Move nsecs sectors by DMA and wait for the transfer, giving up the
+// CPU meanwhile.
+static int
+ide_dma(uint32_t secno, const void *buf, size_t nsecs, bool write)
+{
+	if (ide_dma_start(secno, buf, nsecs, write) < 0)
+		return -1;
+	while (!ide_dma_done())
+		sys_yield();
+	return ide_dma_finish();
+}
+
+// ide_bdev's background transfers: one DMA transfer at a time.
+static int
+ide_start(struct BlockDev *bd, uint32_t tag, uint32_t secno, const void *buf,
+		  size_t nsecs, bool write)
+{
+	int r;
+
+	if (dma_busy)
+		return -E_WOULD_BLOCK;
+	if ((r = ide_dma_start(secno, buf, nsecs, write)) < 0)
+		return r;
+	dma_tag = tag;
+	return 0;
+}
+
+static int
+ide_reap(struct BlockDev *bd, uint32_t *tag, int *status)
+{
+	if (!dma_busy || !ide_dma_done())
+		return -E_WOULD_BLOCK;
+	*tag = dma_tag;
+	*status = ide_dma_finish();
+	return 0;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256 && !dma_busy);
+
+	if (bmiba && ide_dma(secno, dst, nsecs, false) == 0)
+		return 0;
+
+	ide_command(secno, nsecs, 0x20);    // CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE)
 	{
@@ -91,16 +309,12 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	assert(nsecs <= 256 && !dma_busy);
 
-	ide_wait_ready(0);
+	if (bmiba && ide_dma(secno, src, nsecs, true) == 0)
+		return 0;
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
-	outb(0x1F7, 0x30);    // CMD 0x30 means write sector
+	ide_command(secno, nsecs, 0x30);    // CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE)
 	{
@@ -112,3 +326,14 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	return 0;
 }
 
+static int
+ide_bd_read(struct BlockDev *bd, uint32_t secno, void *dst, size_t nsecs)
+{
+	return ide_read(secno, dst, nsecs);
+}
+
+static int
+ide_bd_write(struct BlockDev *bd, uint32_t secno, const void *src, size_t nsecs)
+{
+	return ide_write(secno, src, nsecs);
+}
@@ -0,0 +1,312 @@
+/*
+ * Metadata journal.
+ *
+ * The blocks that hold the file system's structure -- the superblock,
+ * the bitmap, directory blocks with the Files in them, and index
+ * blocks -- are not written in place as they change.  fs.c calls
+ * jnl_add on each just before it changes it, which holds the block in
+ * the running transaction, and the block cache writes no held block
+ * back.  A commit writes a copy of every held block to the journal
+ * (see struct JournalHeader) with one sequential write, then lets them
+ * go, to be written home in the background like any others.  If the
+ * file server stops before they get there, jnl_init finds the
+ * transaction at the next start and copies it home.
+ *
+ * Many requests' changes go out in one commit: on the flush timer's
+ * tick, when a client flushes a file, or when the transaction fills
+ * up.  Requests that change metadata do so between jnl_begin and
+ * jnl_end; a commit waits for those in progress to end and holds up
+ * new ones until it has taken the held blocks, so a transaction has
+ * whole requests.  Only a request that would overfill one is split.
+ * File contents are not journaled.
+ *
+ * The journal holds one transaction.  Before a commit overwrites it,
+ * the blocks of the last one must all be home: jnl_add writes a block
+ * home, if the last commit left it dirty, before holding it again, and
+ * jnl_write waits for the rest.
+ */
+
+#include "fs.h"
+
+#define JNL_MAXBLOCKS   (FS_JOURNAL_BLOCKS - 1)
+#define JNL_NSLOTS      256     // of a transaction's hash table
+
+struct JnlTxn {
+	uint32_t jt_nblocks;
+	uint32_t jt_blocks[JNL_MAXBLOCKS];
+	uint32_t jt_slot[JNL_NSLOTS];   // 0, or 1 + a block number
+};
+
+// The running transaction, and the last one committed, or being
+// copied to the journal if jnl_committing is set
+static struct JnlTxn jnl_txn[2];
+static struct JnlTxn *jnl_open = &jnl_txn[0], *jnl_last = &jnl_txn[1];
+
+static bool jnl_on;
+static uint32_t jnl_max;        // blocks a transaction holds at most
+static uint32_t jnl_seq;        // number of the running transaction
+static uint32_t jnl_done;       // number of the last one in the journal
+static uint32_t jnl_nops;       // requests between jnl_begin and jnl_end
+static bool jnl_wanted;         // a commit waits for them to end
+static bool jnl_writing;        // in jnl_write
+static bool jnl_committing;     // ... and past taking the held blocks
+// Bumped whenever any of the above changes for a waiting thread
+static volatile uint32_t jnl_event;
+
+static bool
+txn_has(const struct JnlTxn *t, uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = blockno % JNL_NSLOTS; t->jt_slot[i]; i = (i + 1) % JNL_NSLOTS)
+		if (t->jt_slot[i] == blockno + 1)
+			return true;
+	return false;
+}
+
+static void
+txn_add(struct JnlTxn *t, uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = blockno % JNL_NSLOTS; t->jt_slot[i]; i = (i + 1) % JNL_NSLOTS)
+		/* do nothing */;
+	t->jt_slot[i] = blockno + 1;
+	t->jt_blocks[t->jt_nblocks++] = blockno;
+}
+
+static void
+jnl_changed(void)
+{
+	jnl_event++;
+	fs_wakeup(&jnl_event);
+}
+
+// FNV-1a of n words, going on from h
+static uint32_t
+jnl_sum(uint32_t h, const uint32_t *w, uint32_t n)
+{
+	while (n-- > 0)
+		h = (h ^ *w++) * 16777619U;
+	return h;
+}
+
+// The checksum of the transaction in the journal that jh heads
+static uint32_t
+jnl_txn_sum(struct JournalHeader *jh)
+{
+	uint32_t sum, h, i;
+
+	sum = jh->jh_sum;
+	jh->jh_sum = 0;
+	h = jnl_sum(2166136261U, (uint32_t *) jh, BLKSIZE / 4);
+	jh->jh_sum = sum;
+	for (i = 0; i < jh->jh_nblocks; i++)
+		h = jnl_sum(h, diskaddr(super->s_journal + 1 + i), BLKSIZE / 4);
+	return h;
+}
+
+// Is block blockno held, so that the block cache must not write it?
+bool
+jnl_holds(uint32_t blockno)
+{
+	return jnl_on && (txn_has(jnl_open, blockno) ||
+					  (jnl_committing && txn_has(jnl_last, blockno)));
+}
+
+// Commit the running transaction: write it to the journal and wait
+// for it, then start writing its blocks home.  Called with no request
+// between jnl_begin and jnl_end, but for one that would overfill the
+// transaction.
+static void
+jnl_write(void)
+{
+	struct JournalHeader *jh;
+	struct JnlTxn *t;
+	uint32_t i;
+
+	jnl_writing = true;
+	// The last transaction's blocks must be home before the journal
+	// forgets it; those held again already are
+	for (i = 0; i < jnl_last->jt_nblocks; i++)
+		if (!txn_has(jnl_open, jnl_last->jt_blocks[i]))
+			bc_sync(jnl_last->jt_blocks[i], 1);
+
+	t = jnl_open;
+	jnl_open = jnl_last;
+	memset(jnl_open, 0, sizeof(*jnl_open));
+	jnl_last = t;
+	jnl_seq++;
+	jnl_wanted = false;
+	jnl_committing = true;
+	jnl_changed();
+
+	if (t->jt_nblocks > 0)
+	{
+		for (i = 0; i < t->jt_nblocks; i++)
+			memmove(bc_blank(super->s_journal + 1 + i),
+					diskaddr(t->jt_blocks[i]), BLKSIZE);
+		jh = bc_blank(super->s_journal);
+		jh->jh_magic = JNL_MAGIC;
+		jh->jh_seq = jnl_seq - 1;
+		jh->jh_nblocks = t->jt_nblocks;
+		memmove(jh->jh_blocks, t->jt_blocks, t->jt_nblocks * sizeof(uint32_t));
+		jh->jh_sum = jnl_txn_sum(jh);
+		bc_sync(super->s_journal, 1 + t->jt_nblocks);
+	}
+
+	jnl_done = jnl_seq - 1;
+	jnl_writing = jnl_committing = false;
+	jnl_changed();
+	for (i = 0; i < t->jt_nblocks; i++)
+		bc_flush(t->jt_blocks[i], 1);
+}
+
+// Commit now if a commit is wanted and nothing stops it.
+static void
+jnl_kick(void)
+{
+	if (jnl_wanted && jnl_nops == 0 && !jnl_writing)
+		jnl_write();
+}
+
+//
+// Hold the block at va in the running transaction, before changing it.
+// Only blocks that hold file system structure need this.
+//
+void
+jnl_add(void *va)
+{
+	uint32_t blockno = ((uintptr_t) va - DISKMAP) / BLKSIZE;
+
+	while (jnl_on && !txn_has(jnl_open, blockno))
+	{
+		// Its copy is on the way to the journal
+		if (jnl_committing && txn_has(jnl_last, blockno))
+		{
+			if (!fs_wait(&jnl_event))
+				panic("jnl_add: block %08x committing", blockno);
+			continue;
+		}
+		if (jnl_open->jt_nblocks == jnl_max)
+		{
+			if (!jnl_writing)
+				jnl_write();
+			else if (!fs_wait(&jnl_event))
+				panic("jnl_add: transaction full");
+			continue;
+		}
+		// The last commit's changes go home first
+		if (!bc_clean(blockno))
+		{
+			bc_sync(blockno, 1);
+			continue;
+		}
+		txn_add(jnl_open, blockno);
+	}
+}
+
+//
+// Start a request that changes metadata: after any commit waiting to
+// start, and after a commit of the running transaction if it is half
+// full.
+//
+void
+jnl_begin(void)
+{
+	while (jnl_on && (jnl_wanted || jnl_open->jt_nblocks > jnl_max / 2))
+	{
+		jnl_wanted = true;
+		jnl_kick();
+		if (jnl_wanted && !fs_wait(&jnl_event))
+			break;
+	}
+	jnl_nops++;
+}
+
+// End a request that jnl_begin started, committing if a commit waits
+// for it.
+void
+jnl_end(void)
+{
+	assert(jnl_nops > 0);
+	jnl_nops--;
+	jnl_kick();
+}
+
+//
+// Commit the running transaction, with every change made by then, and
+// wait until it is in the journal.  Changes that other requests make
+// meanwhile go out in the same commit, so that many requests that flush
+// cost one journal write.  Not to be called between jnl_begin and
+// jnl_end.
+//
+void
+jnl_commit(void)
+{
+	// The transaction that has our changes: the running one, or the
+	// one before if that has them all
+	uint32_t seq = jnl_open->jt_nblocks > 0 ? jnl_seq : jnl_seq - 1;
+
+	while (jnl_on && (int32_t) (jnl_done - seq) < 0)
+	{
+		if (seq == jnl_seq)
+		{
+			jnl_wanted = true;
+			jnl_kick();
+		}
+		if ((int32_t) (jnl_done - seq) < 0 && !fs_wait(&jnl_event))
+			return;
+	}
+}
+
+//
+// The flush timer's tick: commit what the running transaction holds,
+// now or once the requests in progress end.
+//
+void
+jnl_tick(void)
+{
+	if (!jnl_on || jnl_open->jt_nblocks == 0)
+		return;
+	jnl_wanted = true;
+	jnl_kick();
+}
+
+//
+// Start journaling.  If the journal has a whole transaction, the file
+// server may have stopped before writing it home: copy it home again,
+// wait for the disk, and clear the journal.
+//
+void
+jnl_init(void)
+{
+	struct JournalHeader *jh;
+	uint32_t i;
+
+	static_assert(sizeof(struct JournalHeader) == BLKSIZE);
+	static_assert(JNL_MAXBLOCKS <= ARRAY_SIZE(((struct JournalHeader *) 0)->jh_blocks));
+	static_assert(JNL_NSLOTS >= 2 * JNL_MAXBLOCKS);
+	if (super->s_njournal < 2 || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal at block %u, %u blocks: rebuild it with fsformat",
+			  super->s_journal, super->s_njournal);
+	jnl_max = MIN(super->s_njournal - 1, JNL_MAXBLOCKS);
+
+	jh = diskaddr(super->s_journal);
+	if (jh->jh_magic == JNL_MAGIC && jh->jh_nblocks <= super->s_njournal - 1 &&
+		jh->jh_sum == jnl_txn_sum(jh))
+	{
+		for (i = 0; i < jh->jh_nblocks; i++)
+			memmove(diskaddr(jh->jh_blocks[i]),
+					diskaddr(super->s_journal + 1 + i), BLKSIZE);
+		bc_writeback();
+		bc_drain();
+		cprintf("FS: journal: replayed transaction %u, %u blocks\n",
+				jh->jh_seq, jh->jh_nblocks);
+		jnl_done = jh->jh_seq;
+		memset(jh, 0, BLKSIZE);
+		flush_block(jh);
+	}
+	jnl_seq = jnl_done + 1;
+	jnl_on = true;
+}
@@ -6,6 +6,8 @@
 #include <inc/x86.h>
 #include <inc/string.h>
 
+#include <arch/thread.h>
+
 #include "fs.h"
 
 
@@ -22,10 +24,10 @@
 //    on *its own page* in memory, and it is shared with any
 //    environments that have the file open.
 // 3. 'struct OpenFile' links these other two structures, and is kept
-//    private to the file server.  The server maintains an array of
-//    all open files, indexed by "file ID".  (There can be at most
-//    MAXOPEN files open concurrently.)  The client uses file IDs to
-//    communicate with the server.  File IDs are a lot like
+//    private to the file server.  The server maintains a table of
+//    all open files, indexed by "file ID" modulo MAXOPEN.  (There can
+//    be at most MAXOPEN files open concurrently.)  The client uses
+//    file IDs to communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
 
@@ -34,56 +36,268 @@ struct OpenFile {
 	struct File *o_file;    // mapped descriptor for open file
 	int o_mode;        // open mode
 	struct Fd *o_fd;    // Fd page
+	off_t o_seqpos;        // where a sequential read would start next
+	uint32_t o_raend;    // file block after the last one read ahead
+	bool o_free;        // on the free list
+	struct OpenFile *o_next;    // next on the free list
 };
 
-// Max number of open files in the file system at once
-#define MAXOPEN        1024
+// Max number of open files in the file system at once.  The table
+// grows OPENCHUNK entries at a time, as it fills up, from one chunk;
+// entry i has its Fd page at FILEVA + i * PGSIZE.
+#define MAXOPEN        16384
+#define OPENCHUNK    256
 #define FILEVA        0xD0000000
 
-// initialize to force into data section
-struct OpenFile opentab[MAXOPEN] = {
-		{0, 0, 1, 0}
+static struct OpenFile *openchunks[MAXOPEN / OPENCHUNK];
+static uint32_t nopen;        // entries in the table
+static struct OpenFile *openfree;    // entries known to be free
+
+// The version table, a page shared read-only with any client that asks
+// for it (FSREQ_VERSIONS), right after the Fd pages.  Each file hashes
+// to one of its NVERSIONS entries, which changes whenever the file
+// does, so that a client can tell in memory whether data it holds of
+// the file is still current.  Files that share an entry only make
+// each other's clients look again needlessly.
+#define VERSIONVA    (FILEVA + MAXOPEN * PGSIZE)
+#define NVERSIONS    (PGSIZE / sizeof(uint32_t))
+
+static volatile uint32_t *versions = (volatile uint32_t *) VERSIONVA;
+
+static uint32_t
+version_slot(struct File *f)
+{
+	return ((uintptr_t) f - DISKMAP) / sizeof(struct File) % NVERSIONS;
+}
+
+// Called whenever the contents or size of f change.
+void
+serve_file_changed(struct File *f)
+{
+	versions[version_slot(f)]++;
+}
+
+// The server takes up to FS_NTHREADS requests at once, each served on
+// a serve thread of its own (of the user-level thread library the
+// network server runs on), so that a request waiting for the disk
+// holds up no other.  Each thread has its own window of pages below
+// the block cache: the request page, followed by room for the data
+// pages of a large write, then the pages of a large read reply.
+#define FS_NTHREADS     8
+#define FSREQ_NPAGES    (1 + FSIPC_MAXPAGES)
+#define FSWIN_NPAGES    (FSREQ_NPAGES + FSIPC_MAXPAGES)
+#define FSWIN_VA(i)     (DISKMAP - ((i) + 1) * FSWIN_NPAGES * PGSIZE)
+
+enum {
+	ST_IDLE = 0,    // waiting for a request
+	ST_BUSY,        // serving one
+	ST_DONE,        // its reply ready for serve() to send
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *) 0x0ffff000;
+struct ServeThread {
+	volatile uint32_t st_state;
+	union Fsipc *st_req;    // where its requests arrive
+	union Fsipc *st_arg;    // where this one's arguments are: st_req,
+	                        // a session page or st_words
+	char *st_reply;         // where the data of a large read goes
+	uint32_t st_reqno;
+	envid_t st_whom;
+	int st_perm;            // of the request, then of the reply
+	uint32_t st_npages;     // pages the request came with
+	uint32_t st_words[IPC_NWORDS];  // the arguments of a small request
+	int32_t st_r;           // the reply
+	void *st_pg;
+	uint64_t st_start;      // TSC value when the request came in
+};
+
+static struct ServeThread sthreads[FS_NTHREADS];
+
+// The thread that receives the requests, and whether it has started.
+static thread_id_t main_tid;
+static bool threaded;
 
+// Let the other threads run until *chan changes, which whoever changes
+// it tells with fs_wakeup.  Returns false, without waiting, if not
+// called on a serve thread: the main thread and the file system code
+// run before it have nobody to wait for.
+bool
+fs_wait(volatile uint32_t *chan)
+{
+	if (!threaded || thread_id() == main_tid)
+		return false;
+	thread_wait(chan, *chan, (uint32_t) ~0);
+	return true;
+}
+
+// Wake the serve threads waiting for *chan to change.
 void
-serve_init(void)
+fs_wakeup(volatile uint32_t *chan)
+{
+	if (threaded)
+		thread_wakeup(chan);
+}
+
+// Locks on files, so that a serve thread waiting for the disk halfway
+// through a request never sees the blocks of its file change under it:
+// a request that reads a file holds its lock shared, and one that
+// changes it holds it exclusively.  Opens, which walk and change
+// directories, hold the lock on the superblock exclusively, one at a
+// time.  A lock is in use while any thread holds or waits for it, and
+// a thread takes at most two at once.
+struct FileLock {
+	const void *fl_key;     // the struct File, or super
+	uint32_t fl_nusers;     // threads holding or waiting for it
+	uint32_t fl_nshared;    // threads holding it shared
+	bool fl_excl;           // held exclusively
+	volatile uint32_t fl_nreleased;
+};
+
+static struct FileLock filelocks[2 * FS_NTHREADS];
+
+// Take the lock on key, exclusively if excl is set, waiting until
+// nobody holds it in a way that conflicts.
+static struct FileLock *
+file_lock(const void *key, bool excl)
+{
+	struct FileLock *fl, *unused = NULL;
+
+	for (fl = filelocks; fl < filelocks + ARRAY_SIZE(filelocks); fl++)
+	{
+		if (fl->fl_nusers && fl->fl_key == key)
+			break;
+		if (!fl->fl_nusers && !unused)
+			unused = fl;
+	}
+	if (fl == filelocks + ARRAY_SIZE(filelocks))
+	{
+		assert(unused);
+		fl = unused;
+		fl->fl_key = key;
+	}
+
+	fl->fl_nusers++;
+	while (fl->fl_excl || (excl && fl->fl_nshared))
+		if (!fs_wait(&fl->fl_nreleased))
+			panic("file_lock: lock held outside a serve thread");
+	if (excl)
+		fl->fl_excl = true;
+	else
+		fl->fl_nshared++;
+	return fl;
+}
+
+static void
+file_unlock(struct FileLock *fl)
+{
+	if (fl->fl_excl)
+		fl->fl_excl = false;
+	else
+		fl->fl_nshared--;
+	fl->fl_nusers--;
+	fl->fl_nreleased++;
+	fs_wakeup(&fl->fl_nreleased);
+}
+
+static struct OpenFile *
+openfile_entry(uint32_t i)
+{
+	return &openchunks[i / OPENCHUNK][i % OPENCHUNK];
+}
+
+static void
+openfile_free(struct OpenFile *o)
+{
+	o->o_free = true;
+	o->o_next = openfree;
+	openfree = o;
+}
+
+// Add a chunk of free entries to the open-file table.
+// Returns 0 on success, < 0 on error.
+static int
+openfile_grow(void)
 {
-	int i;
-	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++)
+	struct OpenFile *chunk;
+	uint32_t i;
+
+	if (nopen == MAXOPEN)
+		return -E_MAX_OPEN;
+	if (!(chunk = malloc(OPENCHUNK * sizeof(*chunk))))
+		return -E_NO_MEM;
+	memset(chunk, 0, OPENCHUNK * sizeof(*chunk));
+	openchunks[nopen / OPENCHUNK] = chunk;
+	// Backwards, so that the lowest entry comes off the list first
+	for (i = OPENCHUNK; i-- > 0;)
 	{
-		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd *) va;
-		va += PGSIZE;
+		chunk[i].o_fileid = nopen + i;
+		chunk[i].o_fd = (struct Fd *) (FILEVA + (nopen + i) * PGSIZE);
+		openfile_free(&chunk[i]);
 	}
+	nopen += OPENCHUNK;
+	return 0;
+}
+
+// Put the entries whose Fd page nobody else maps any more, since every
+// client closed the file, back on the free list.  Clients do not tell
+// us when they close a file, so this is the only way an entry comes
+// free.  Returns how many came free.
+static uint32_t
+openfile_reclaim(void)
+{
+	struct OpenFile *o;
+	uint32_t i, n = 0;
+
+	for (i = 0; i < nopen; i++)
+	{
+		o = openfile_entry(i);
+		if (!o->o_free && pageref(o->o_fd) <= 1)
+		{
+			openfile_free(o);
+			n++;
+		}
+	}
+	return n;
+}
+
+void
+serve_init(void)
+{
+	int r;
+
+	if ((r = openfile_grow()) < 0 ||
+		(r = bc_page_alloc((void *) versions, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("serve_init: %e", r);
 }
 
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
+	uint32_t n;
+	int r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++)
+	// Only sweep the table for closed files once the free list runs
+	// dry.  A sweep that finds less than an eighth of the table free
+	// grows it instead, so that sweeps, each a pass over the table,
+	// stay rare however many files are open.
+	if (!openfree)
 	{
-		switch (pageref(opentab[i].o_fd))
-		{
-			case 0:
-				if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P | PTE_U | PTE_W)) < 0)
-					return r;
-				/* fall through */
-			case 1:
-				opentab[i].o_fileid += MAXOPEN;
-				*o = &opentab[i];
-				memset(opentab[i].o_fd, 0, PGSIZE);
-				return (*o)->o_fileid;
-		}
+		n = openfile_reclaim();
+		for (r = 0; n < MAX(nopen / 8, 1) && (r = openfile_grow()) == 0;)
+			n += OPENCHUNK;
+		if (!openfree)
+			return r;
 	}
-	return -E_MAX_OPEN;
+
+	*o = openfree;
+	if (pageref((*o)->o_fd) == 0 &&
+		(r = bc_page_alloc((*o)->o_fd, PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	openfree = (*o)->o_next;
+	(*o)->o_free = false;
+	(*o)->o_fileid += MAXOPEN;
+	memset((*o)->o_fd, 0, PGSIZE);
+	return (*o)->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -92,8 +306,10 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 {
 	struct OpenFile *o;
 
-	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
+	if (fileid % MAXOPEN >= nopen)
+		return -E_INVAL;
+	o = openfile_entry(fileid % MAXOPEN);
+	if (o->o_free || pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
 	*po = o;
 	return 0;
@@ -111,6 +327,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	int fileid;
 	int r;
 	struct OpenFile *o;
+	struct FileLock *fl;
 
 	if (debug)
 		cprintf("serve_open %08x %s 0x%x\n", envid, req->req_path, req->req_omode);
@@ -153,7 +370,10 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	// Truncate
 	if (req->req_omode & O_TRUNC)
 	{
-		if ((r = file_set_size(f, 0)) < 0)
+		fl = file_lock(f, true);
+		r = file_set_size(f, 0);
+		file_unlock(fl);
+		if (r < 0)
 		{
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
@@ -172,9 +392,12 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.vslot = version_slot(f);
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
+	o->o_seqpos = 0;
+	o->o_raend = 0;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
@@ -193,6 +416,7 @@ int
 serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 {
 	struct OpenFile *o;
+	struct FileLock *fl;
 	int r;
 
 	if (debug)
@@ -206,20 +430,85 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	// Second, call the relevant file system function (from fs/fs.c).
-	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	// Second, call the relevant file system function (from fs/fs.c),
+	// holding the file's lock.  On failure, return the error code to
+	// the client.
+	fl = file_lock(o->o_file, true);
+	r = file_set_size(o->o_file, req->req_size);
+	file_unlock(fl);
+	return r;
+}
+
+// Give req->req_fileid disk blocks for req->req_len bytes from
+// req->req_offset, holding the file's lock.
+int
+serve_fallocate(envid_t envid, struct Fsreq_fallocate *req)
+{
+	struct OpenFile *o;
+	struct FileLock *fl;
+	int r;
+
+	if (debug)
+		cprintf("serve_fallocate %08x %08x %08x %08x\n", envid,
+				req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	fl = file_lock(o->o_file, true);
+	r = file_allocate(o->o_file, req->req_offset, req->req_len);
+	file_unlock(fl);
+	return r;
+}
+
+// Called before reading n bytes at offset from o.  If the read picks
+// up where the last one left off, read the blocks it covers and the
+// BC_READAHEAD blocks after them in ahead of time, so that a
+// sequential scan reaches the disk in large transfers rather than a
+// block per fault.  The window is only refilled once the reader is
+// halfway through it.
+static void
+readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t first, last, end;
+	bool sequential = offset == o->o_seqpos;
+
+	o->o_seqpos = offset + n;
+	if (!sequential)
+		o->o_raend = 0;
+	if (!sequential || n == 0 || offset >= o->o_file->f_size)
+		return;
+
+	first = offset / BLKSIZE;
+	last = (MIN(offset + n, o->o_file->f_size) - 1) / BLKSIZE;
+	if (o->o_raend > last + BC_READAHEAD / 2)
+		return;
+	end = MIN(last + 1 + BC_READAHEAD,
+			  ROUNDUP(o->o_file->f_size, BLKSIZE) / BLKSIZE);
+	first = MAX(first, o->o_raend);
+	if (first < end)
+		file_prefetch(o->o_file, first, end - first);
+	o->o_raend = end;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
 // the number of bytes successfully read, or < 0 on error.
+//
+// A read of more than a page returns up to FSIPC_MAXPAGES pages of
+// data instead, as fresh pages at 'reply' that are sent back with the
+// reply; *pg_store and *perm_store are set to send them.
 int
-serve_read(envid_t envid, union Fsipc *ipc)
+serve_read(envid_t envid, union Fsipc *ipc, char *reply,
+		   void **pg_store, int *perm_store)
 {
 	struct Fsreq_read *req = &ipc->read;
 	struct Fsret_read *ret = &ipc->readRet;
+	struct PageMapOp op;
+	struct FileLock *fl;
+	ssize_t count;
+	size_t n, done;
+	char *buf;
 
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
@@ -230,21 +519,123 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if (r < 0)
 		return r;
 
-	ssize_t count = file_read(open_file->o_file, ret->ret_buf, req->req_n, open_file->o_fd->fd_offset);
+	n = MIN(req->req_n, sizeof(ret->ret_buf));
+	buf = ret->ret_buf;
+	if (req->req_n > sizeof(ret->ret_buf))
+	{
+		// Fresh pages for every reply: the client keeps its mapping
+		// of the last ones.
+		n = MIN(req->req_n, FSIPC_MAXPAGES * PGSIZE);
+		op.srcva = PAGEMAP_ALLOC;
+		op.dstva = (uintptr_t) reply;
+		op.npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+		op.perm = PTE_P | PTE_U | PTE_W;
+		if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+			return r;
+		buf = reply;
+	}
+
+	fl = file_lock(open_file->o_file, false);
+	readahead(open_file, open_file->o_fd->fd_offset, n);
+	count = file_read(open_file->o_file, buf, n, open_file->o_fd->fd_offset);
+	if (count > 0)
+		open_file->o_fd->fd_offset += count;
+	file_unlock(fl);
 	if (count < 0)
 		return count;
-	open_file->o_fd->fd_offset += count;
+	if (buf == reply && count > 0)
+	{
+		*pg_store = reply;
+		*perm_store = PTE_P | PTE_U |
+					  IPC_SENDPAGES(ROUNDUP(count, PGSIZE) / PGSIZE);
+	}
 	return count;
 }
 
+// Map the block-cache pages holding up to ipc->map.req_n bytes of
+// req_fileid, starting at req_offset, at 'reply' and send them back
+// read-only with the reply, so that the caller may pass them on
+// (say, to the network server) without copying the data; mmap maps
+// files with it.  The pages stay shared with the block cache, and are
+// PTE_SHARE so that the caller's children share them in turn.  A file
+// whose data is inline (FILE_INLINE) has no block, so it gets a copy
+// instead.  Returns the number of bytes mapped, short at the end of
+// the file, or < 0 on error.
+int
+serve_map(envid_t envid, union Fsipc *ipc, char *reply,
+		  void **pg_store, int *perm_store)
+{
+	struct Fsreq_map *req = &ipc->map;
+	struct OpenFile *o;
+	struct FileLock *fl;
+	size_t n, npages, i;
+	char *blk;
+	int r = 0;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %08x\n", envid, req->req_fileid,
+				req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+
+	fl = file_lock(o->o_file, false);
+	n = MIN(req->req_n, FSIPC_MAXPAGES * PGSIZE);
+	if (req->req_offset < o->o_file->f_size)
+		n = MIN(n, o->o_file->f_size - req->req_offset);
+	else
+		n = 0;
+	if (n > 0)
+		readahead(o, req->req_offset, n);
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	if (n > 0 && (o->o_file->f_flags & FILE_INLINE))
+	{
+		// No block holds an inline file: send a copy of its data
+		if ((r = bc_page_alloc(reply, PTE_P | PTE_U | PTE_W)) >= 0)
+			memmove(reply, o->o_file->f_inline, n);
+	} else
+		for (i = 0; i < npages; i++)
+		{
+			if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE + i,
+									&blk)) < 0)
+				break;
+			// Fault the block in, since only mapped pages can be sent,
+			// and map it before the next fault may evict it.
+			(void) *(volatile char *) blk;
+			if ((r = sys_page_map(0, blk, 0, reply + i * PGSIZE,
+								  PTE_P | PTE_U | PTE_SHARE)) < 0)
+				break;
+		}
+	file_unlock(fl);
+	if (r < 0)
+		return r;
+	if (n == 0)
+		return 0;
+
+	*pg_store = reply;
+	*perm_store = PTE_P | PTE_U | PTE_SHARE | IPC_SENDPAGES(npages);
+	return n;
+}
+
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
 // bytes written, or < 0 on error.
+//
+// If req_n is more than req_buf holds, the data is instead in the
+// pages that came after the request page, at most FSIPC_MAXPAGES; the
+// request came with npages pages in all.
 int
-serve_write(envid_t envid, struct Fsreq_write *req)
+serve_write(envid_t envid, struct Fsreq_write *req, uint32_t npages)
 {
+	size_t n = req->req_n;
+	const char *buf = req->req_buf;
+	struct FileLock *fl;
+	ssize_t count;
+
 	if (debug)
 		cprintf("serve_write %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
@@ -254,13 +645,223 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if (r < 0)
 		return r;
 
-	ssize_t count = file_write(open_file->o_file, req->req_buf, req->req_n, open_file->o_fd->fd_offset);
-	if (count < 0)
-		return count;
-	open_file->o_fd->fd_offset += count;
+	if (n > sizeof(req->req_buf))
+	{
+		n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+		if (npages < 1 + ROUNDUP(n, PGSIZE) / PGSIZE)
+			return -E_INVAL;
+		buf = (const char *) req + PGSIZE;
+	}
+
+	fl = file_lock(open_file->o_file, true);
+	count = file_write(open_file->o_file, buf, n, open_file->o_fd->fd_offset);
+	if (count > 0)
+		open_file->o_fd->fd_offset += count;
+	file_unlock(fl);
+	return count;
+}
+
+// Write req->req_n bytes from the pages following the request page,
+// which the client donated copy-on-write, at the current seek position,
+// and update the seek position.  Whole blocks are not copied but
+// become the file's (see file_write_pages).  The request page is the
+// first of npages.
+int
+serve_write_pages(envid_t envid, struct Fsreq_write *req, uint32_t npages)
+{
+	size_t n = MIN(req->req_n, FSIPC_MAXPAGES * PGSIZE);
+	struct OpenFile *open_file;
+	struct FileLock *fl;
+	ssize_t count;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_pages %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &open_file)) < 0)
+		return r;
+	if (npages < 1 + ROUNDUP(n, PGSIZE) / PGSIZE)
+		return -E_INVAL;
+
+	fl = file_lock(open_file->o_file, true);
+	count = file_write_pages(open_file->o_file, (const char *) req + PGSIZE, n,
+							 open_file->o_fd->fd_offset);
+	if (count > 0)
+		open_file->o_fd->fd_offset += count;
+	file_unlock(fl);
+	return count;
+}
+
+// Copy up to req->req_n bytes from req_in's seek position to req_out's
+// without the data leaving the server, and move both positions on.
+// Returns the number of bytes copied, or < 0 on error.
+int
+serve_splice(envid_t envid, struct Fsreq_splice *req)
+{
+	struct OpenFile *in, *out;
+	struct FileLock *fl_in, *fl_out;
+	ssize_t count;
+	int r;
+
+	if (debug)
+		cprintf("serve_splice %08x %08x %08x %08x\n", envid, req->req_in,
+				req->req_out, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_in, &in)) < 0 ||
+		(r = openfile_lookup(envid, req->req_out, &out)) < 0)
+		return r;
+	if (in->o_file == out->o_file)
+		return -E_INVAL;
+
+	// Take the locks in address order, so that a splice the other way
+	// round cannot hold one and wait for the other.
+	if (in->o_file < out->o_file)
+	{
+		fl_in = file_lock(in->o_file, false);
+		fl_out = file_lock(out->o_file, true);
+	} else
+	{
+		fl_out = file_lock(out->o_file, true);
+		fl_in = file_lock(in->o_file, false);
+	}
+	count = file_splice(in->o_file, in->o_fd->fd_offset, out->o_file,
+						out->o_fd->fd_offset, MIN(req->req_n, FSIPC_MAXPAGES * PGSIZE));
+	if (count > 0)
+	{
+		in->o_fd->fd_offset += count;
+		out->o_fd->fd_offset += count;
+	}
+	file_unlock(fl_in);
+	file_unlock(fl_out);
 	return count;
 }
 
+// Check the ranges of a vectored request and copy them to iov, since
+// a reply may overwrite the request page.  Returns the number of bytes
+// they cover, or < 0 if they are bad or cover more than max.
+static ssize_t
+fsiov_check(const struct Fsiov *req_iov, uint32_t niov, size_t max,
+			struct Fsiov *iov)
+{
+	size_t n = 0;
+	uint32_t i;
+
+	if (niov > FSIPC_MAXIOV)
+		return -E_INVAL;
+	for (i = 0; i < niov; i++)
+	{
+		iov[i] = req_iov[i];
+		if (iov[i].iov_offset < 0 || iov[i].iov_len > max - n)
+			return -E_INVAL;
+		n += iov[i].iov_len;
+	}
+	return n;
+}
+
+// Read the ranges of ipc->readv.req_fileid in req_iov, leaving the seek
+// position alone, and return their data one after another as
+// serve_read does: in ipc->readRet, or in fresh pages at 'reply' if
+// they are more than a page.  Stops at the first range that comes up
+// short.  Returns the number of bytes read, or < 0 on error.
+int
+serve_readv(envid_t envid, union Fsipc *ipc, char *reply,
+			void **pg_store, int *perm_store)
+{
+	struct Fsiov iov[FSIPC_MAXIOV];
+	struct OpenFile *o;
+	struct FileLock *fl;
+	struct PageMapOp op;
+	uint32_t niov = ipc->readv.req_niov, i;
+	size_t done, total = 0;
+	ssize_t n, r;
+	char *buf;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %d\n", envid, ipc->readv.req_fileid, niov);
+
+	if ((r = openfile_lookup(envid, ipc->readv.req_fileid, &o)) < 0)
+		return r;
+	if ((n = fsiov_check(ipc->readv.req_iov, niov, FSIPC_MAXPAGES * PGSIZE, iov)) < 0)
+		return n;
+
+	buf = ipc->readRet.ret_buf;
+	if (n > sizeof(ipc->readRet.ret_buf))
+	{
+		op.srcva = PAGEMAP_ALLOC;
+		op.dstva = (uintptr_t) reply;
+		op.npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+		op.perm = PTE_P | PTE_U | PTE_W;
+		if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+			return r;
+		buf = reply;
+	}
+
+	fl = file_lock(o->o_file, false);
+	for (i = 0, r = 0; i < niov; i++)
+	{
+		if ((r = file_read(o->o_file, buf + total, iov[i].iov_len,
+						   iov[i].iov_offset)) < 0)
+			break;
+		total += r;
+		if (r < iov[i].iov_len)
+			break;
+	}
+	file_unlock(fl);
+	if (r < 0 && total == 0)
+		return r;
+	if (buf == reply && total > 0)
+	{
+		*pg_store = reply;
+		*perm_store = PTE_P | PTE_U |
+					  IPC_SENDPAGES(ROUNDUP(total, PGSIZE) / PGSIZE);
+	}
+	return total;
+}
+
+// Write the ranges of req->req_fileid in req_iov from the data in
+// req_buf, or if it is more than req_buf holds, in the pages that came
+// after the request page; the request came with npages pages in all.
+// Leaves the seek position alone, and extends the file as necessary.
+// Returns the number of bytes written, or < 0 on error.
+int
+serve_writev(envid_t envid, struct Fsreq_writev *req, uint32_t npages)
+{
+	struct Fsiov iov[FSIPC_MAXIOV];
+	struct OpenFile *o;
+	struct FileLock *fl;
+	const char *buf = req->req_buf;
+	size_t total = 0;
+	uint32_t i;
+	ssize_t n, r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %d\n", envid, req->req_fileid, req->req_niov);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((n = fsiov_check(req->req_iov, req->req_niov, FSIPC_MAXPAGES * PGSIZE, iov)) < 0)
+		return n;
+	if (n > sizeof(req->req_buf))
+	{
+		if (npages < 1 + ROUNDUP(n, PGSIZE) / PGSIZE)
+			return -E_INVAL;
+		buf = (const char *) req + PGSIZE;
+	}
+
+	fl = file_lock(o->o_file, true);
+	for (i = 0, r = 0; i < req->req_niov; i++)
+	{
+		if ((r = file_write(o->o_file, buf + total, iov[i].iov_len,
+							iov[i].iov_offset)) < 0)
+			break;
+		total += r;
+	}
+	file_unlock(fl);
+	if (r < 0 && total == 0)
+		return r;
+	return total;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -280,9 +881,73 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	strcpy(ret->ret_name, o->o_file->f_name);
 	ret->ret_size = o->o_file->f_size;
 	ret->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
+	ret->ret_version = o->o_file->f_version;
 	return 0;
 }
 
+// Pack the entries of directory ipc->readdir.req_fileid from
+// req_offset that fit in req_n bytes into ipc->readdirRet, skipping
+// free ones.  Returns the bytes packed, 0 at the end of the directory,
+// or < 0 on error.  Errors are:
+//	-E_INVAL if the file is not a directory, req_offset is not an
+//	entry's, or the next entry does not fit in req_n bytes.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_readdir *req = &ipc->readdir;
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	struct FileLock *fl;
+	struct File *f;
+	struct Dirent *d;
+	size_t n, len, done = 0;
+	char *blk = NULL;
+	off_t pos;
+	int r;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %08x %08x\n", envid,
+				req->req_fileid, req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	// The reply overwrites the request
+	pos = req->req_offset;
+	n = MIN(req->req_n, sizeof(ret->ret_buf));
+	if (o->o_file->f_type != FTYPE_DIR || pos < 0 ||
+		pos % sizeof(struct File) != 0)
+		return -E_INVAL;
+
+	fl = file_lock(o->o_file, false);
+	for (; pos < o->o_file->f_size; pos += sizeof(struct File))
+	{
+		if (!blk || pos % BLKSIZE == 0)
+			if ((r = file_get_block(o->o_file, pos / BLKSIZE, &blk)) < 0)
+				break;
+		f = (struct File *) (blk + pos % BLKSIZE);
+		if (!f->f_name[0])
+			continue;
+		len = strnlen(f->f_name, MAXNAMELEN - 1);
+		if (done + DIRENT_RECLEN(len) > n)
+			break;
+		d = (struct Dirent *) (ret->ret_buf + done);
+		d->d_size = f->f_size;
+		d->d_type = f->f_type;
+		d->d_namelen = len;
+		d->d_reclen = DIRENT_RECLEN(len);
+		memmove(d->d_name, f->f_name, len);
+		d->d_name[len] = '\0';
+		done += d->d_reclen;
+	}
+	file_unlock(fl);
+	if (r < 0 && done == 0)
+		return r;
+	if (done == 0 && pos < o->o_file->f_size)
+		return -E_INVAL;
+	ret->ret_offset = pos;
+	return done;
+}
+
 // Flush all data and metadata of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
@@ -300,6 +965,15 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Send the version table back read-only with the reply.
+int
+serve_versions(envid_t envid, union Fsipc *req, void **pg_store, int *perm_store)
+{
+	*pg_store = (void *) versions;
+	*perm_store = PTE_P | PTE_U | PTE_SHARE;
+	return 0;
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -307,63 +981,379 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+int
+serve_drop_cache(envid_t envid, union Fsipc *req)
+{
+	fs_drop_cache();
+	return 0;
+}
+
+// Report the server's counters, and reset them if asked to.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	bool reset = ipc->stats.req_reset;
+
+	fsstats.fs_resident = bc_resident();
+	ipc->statsRet.ret_stats = fsstats;
+	if (reset)
+		memset(&fsstats, 0, sizeof(fsstats));
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-		// Open is handled specially because it passes pages
+		// Open, read, map, versions, write and their vectored kinds
+		// are handled specially because they pass pages
 		/* [FSREQ_OPEN] =	(fshandler)serve_open, */
-		[FSREQ_READ] =        serve_read,
+		/* [FSREQ_READ] =	(fshandler)serve_read, */
 		[FSREQ_STAT] =        serve_stat,
+		[FSREQ_READDIR] =     serve_readdir,
 		[FSREQ_FLUSH] =        (fshandler) serve_flush,
-		[FSREQ_WRITE] =        (fshandler) serve_write,
 		[FSREQ_SET_SIZE] =    (fshandler) serve_set_size,
-		[FSREQ_SYNC] =        serve_sync
+		[FSREQ_FALLOCATE] =   (fshandler) serve_fallocate,
+		[FSREQ_SPLICE] =      (fshandler) serve_splice,
+		[FSREQ_SYNC] =        serve_sync,
+		[FSREQ_DROP_CACHE] =  serve_drop_cache,
+		[FSREQ_STATS] =       serve_stats
 };
 
+// Sessions: a client may lend us a page of its own for its requests
+// (FSREQ_SESSION), which stays mapped at SESSION_VA(slot).  It then
+// sends each request that fits in one page as just the request number,
+// with slot + 1 in its second IPC word and the arguments already on
+// that page, and finds the reply there: no page changes hands, so
+// neither side's page tables change.  A client whose session page
+// changes, as it does when a fork makes it copy-on-write, lends us the
+// new one.  Slots of clients that have exited are taken over when the
+// table fills up.
+#define FS_NSESSIONS    256
+#define SESSION_VA(i)   (VERSIONVA + ((i) + 1) * PGSIZE)
+
+static envid_t sessions[FS_NSESSIONS];
+
+// Make the page the request 'req' came on envid's session page.
+// Returns the session's slot, or < 0 on error.  Errors are:
+//	-E_MAX_OPEN if every slot belongs to a live client.
+int
+serve_session(envid_t envid, union Fsipc *req)
+{
+	int i, slot = -1, r;
+
+	for (i = 0; i < FS_NSESSIONS && sessions[i] != envid; i++)
+		if (slot < 0 && (sessions[i] == 0 ||
+						 envs[ENVX(sessions[i])].env_id != sessions[i]))
+			slot = i;
+	if (i < FS_NSESSIONS)
+		slot = i;
+	if (slot < 0)
+		return -E_MAX_OPEN;
+	if ((r = sys_page_map(0, req, 0, (void *) SESSION_VA(slot),
+						  PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	sessions[slot] = envid;
+	return slot;
+}
+
+// Unmap the pages of st's last request.
+static void
+unmap_request(struct ServeThread *st)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	op.srcva = 0;
+	op.dstva = (uintptr_t) st->st_req;
+	op.npages = MAX(st->st_npages, 1);
+	op.perm = 0;
+	sys_page_map_batch(0, 0, &op, 1, &done);
+}
+
+// Does request reqno change metadata?  It runs between jnl_begin and
+// jnl_end, so that a journal commit has all of it or none.
+static bool
+serve_changes(uint32_t reqno)
+{
+	return reqno == FSREQ_OPEN || reqno == FSREQ_SET_SIZE ||
+		   reqno == FSREQ_WRITE || reqno == FSREQ_WRITEV ||
+		   reqno == FSREQ_WRITE_PAGES || reqno == FSREQ_FALLOCATE ||
+		   reqno == FSREQ_SPLICE;
+}
+
+// Count a request of type reqno that came in at TSC value start and
+// has just been served.
+static void
+serve_count(uint32_t reqno, uint64_t start)
+{
+	struct SysStat *ss;
+
+	if (reqno >= FSSTAT_NREQ)
+		return;
+	ss = &fsstats.fs_req[reqno];
+	ss->ss_calls++;
+	sysstat_count(ss, read_tsc() - start);
+}
+
+// Serve st's request, leaving the reply in st.
+static void
+serve_request(struct ServeThread *st)
+{
+	struct FileLock *fl;
+	union Fsipc *req = st->st_arg;
+	int perm = 0, r;
+	void *pg = NULL;
+	bool changes = serve_changes(st->st_reqno);
+
+	if (changes)
+		jnl_begin();
+	if (st->st_reqno == FSREQ_OPEN)
+	{
+		fl = file_lock(super, true);
+		r = serve_open(st->st_whom, (struct Fsreq_open *) req, &pg, &perm);
+		file_unlock(fl);
+	} else if (st->st_reqno == FSREQ_READ)
+	{
+		r = serve_read(st->st_whom, req, st->st_reply, &pg, &perm);
+	} else if (st->st_reqno == FSREQ_MAP)
+	{
+		r = serve_map(st->st_whom, req, st->st_reply, &pg, &perm);
+	} else if (st->st_reqno == FSREQ_VERSIONS)
+	{
+		r = serve_versions(st->st_whom, req, &pg, &perm);
+	} else if (st->st_reqno == FSREQ_READV)
+	{
+		r = serve_readv(st->st_whom, req, st->st_reply, &pg, &perm);
+	} else if (st->st_reqno == FSREQ_WRITEV)
+	{
+		r = serve_writev(st->st_whom, (struct Fsreq_writev *) req,
+						 st->st_npages);
+	} else if (st->st_reqno == FSREQ_WRITE)
+	{
+		r = serve_write(st->st_whom, (struct Fsreq_write *) req,
+						st->st_npages);
+	} else if (st->st_reqno == FSREQ_WRITE_PAGES)
+	{
+		r = serve_write_pages(st->st_whom, (struct Fsreq_write *) req,
+							  st->st_npages);
+	} else if (st->st_reqno == FSREQ_SESSION)
+	{
+		r = serve_session(st->st_whom, req);
+	} else if (st->st_reqno < ARRAY_SIZE(handlers) && handlers[st->st_reqno])
+	{
+		r = handlers[st->st_reqno](st->st_whom, req);
+	} else
+	{
+		cprintf("Invalid request code %d from %08x\n", st->st_reqno, st->st_whom);
+		r = -E_INVAL;
+	}
+	if (changes)
+		jnl_end();
+	// The request pages are not part of the reply, so release them
+	// first.
+	if (st->st_arg == st->st_req)
+		unmap_request(st);
+	st->st_r = r;
+	st->st_pg = pg;
+	st->st_perm = perm;
+	serve_count(st->st_reqno, st->st_start);
+}
+
+// Body of a serve thread: serve each request serve() hands it.
+static void
+serve_thread(uint32_t arg)
+{
+	struct ServeThread *st = (struct ServeThread *) arg;
+
+	for (;;)
+	{
+		while (st->st_state != ST_BUSY)
+			thread_wait(&st->st_state, st->st_state, (uint32_t) ~0);
+		serve_request(st);
+		st->st_state = ST_DONE;
+	}
+}
+
+// Send st's reply without combining it with a receive.  As with
+// ipc_reply_wait, a reply the client is not waiting for is dropped.
+static void
+send_reply(struct ServeThread *st)
+{
+	st->st_state = ST_IDLE;
+	sys_ipc_try_send(st->st_whom, st->st_r,
+					 st->st_pg ? st->st_pg : (void *) (UTOP + PGSIZE),
+					 st->st_perm);
+}
+
+// The environment that sends us FSREQ_TICK and FSREQ_RECLAIM.
+static envid_t flush_envid;
+
+// The notification by which the kernel tells the flush timer that it
+// is out of memory (see sys_reclaim_notify).
+#define FS_NOTIFY_RECLAIM    1
+
+// Body of the flush timer: ask the file server to write its dirty
+// blocks back every FS_FLUSH_INTERVAL milliseconds, and to give clean
+// ones back whenever the kernel runs out of memory in between.
+static void
+flush_timer(envid_t fs_envid)
+{
+	uint32_t next;
+	int32_t wait;
+	int r;
+
+	binaryname = "fs_flush";
+	if ((r = sys_reclaim_notify(FS_NOTIFY_RECLAIM)) < 0)
+		cprintf("fs_flush: sys_reclaim_notify: %e\n", r);
+	next = time_msec() + FS_FLUSH_INTERVAL;
+	while (1)
+	{
+		if ((wait = (int32_t) (next - time_msec())) <= 0)
+		{
+			ipc_send(fs_envid, FSREQ_TICK, 0, 0);
+			next += FS_FLUSH_INTERVAL;
+		} else if (sys_wait_notify(FS_NOTIFY_RECLAIM, wait) > 0)
+			ipc_send(fs_envid, FSREQ_RECLAIM, 0, 0);
+	}
+}
+
+// Receive requests and hand each to an idle serve thread, then run the
+// serve threads until every one is idle or waiting, for the disk or a
+// file lock, and send the replies they have ready.  This thread blocks
+// in its receive only then; the disk's interrupt, which arrives as a
+// request, wakes the threads waiting for it.
 void
 serve(void)
 {
-	uint32_t req, whom;
+	struct ServeThread *st, *reply;
+	uint32_t req, whom, slot;
+	uint64_t start;
 	int perm, r;
-	void *pg;
+
+	for (st = sthreads; st < sthreads + FS_NTHREADS; st++)
+	{
+		st->st_req = (union Fsipc *) FSWIN_VA(st - sthreads);
+		st->st_reply = (char *) st->st_req + FSREQ_NPAGES * PGSIZE;
+		if ((r = thread_create(0, "serve_thread", serve_thread, (uint32_t) st)) < 0)
+			panic("serve: cannot create serve thread: %e", r);
+	}
+	threaded = true;
+	// Let each thread start waiting for its first request
+	thread_yield();
 
 	while (1)
 	{
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		while (thread_wakeups_pending())
+			thread_yield();
+
+		// All replies but one go as they are; the last goes with the
+		// wait for the next request, which its thread takes.
+		reply = NULL;
+		for (st = sthreads; st < sthreads + FS_NTHREADS; st++)
+			if (st->st_state == ST_DONE)
+			{
+				if (reply)
+					send_reply(reply);
+				reply = st;
+			}
+		st = reply;
+		if (!st)
+		{
+			for (st = sthreads; st < sthreads + FS_NTHREADS; st++)
+				if (st->st_state == ST_IDLE)
+					break;
+			if (st == sthreads + FS_NTHREADS)
+			{
+				// Every thread is busy: take no more requests, so that
+				// clients wait in their IPC calls, and poll the disk,
+				// since its interrupt only comes with a receive.
+				sys_yield();
+				bc_intr();
+				continue;
+			}
+		}
+
+		if (reply)
+		{
+			reply->st_state = ST_IDLE;
+			req = ipc_reply_wait(reply->st_whom, reply->st_r, reply->st_pg,
+								 reply->st_perm | IPC_RECVPAGES(FSREQ_NPAGES),
+								 (envid_t *) &whom, st->st_req, &perm);
+		} else
+			req = ipc_recv_pages((int32_t *) &whom, st->st_req, FSREQ_NPAGES, &perm);
+
+		start = read_tsc();
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-					req, whom, uvpt[PGNUM(fsreq)], fsreq);
+					req, whom, uvpt[PGNUM(st->st_req)], st->st_req);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P))
+		// Blocks are written back lazily, when evicted or on a tick,
+		// and clean ones given back when the kernel runs short.
+		// Disk transfers run while we serve other requests, and the
+		// kernel tells us when one ends.
+		if (((req == FSREQ_TICK || req == FSREQ_RECLAIM) && whom == flush_envid) ||
+			(req == FSREQ_DISK && whom == 0))
 		{
-			cprintf("Invalid request from %08x: no argument page\n",
-					whom);
-			continue; // just leave it hanging...
+			if (req == FSREQ_TICK)
+				fs_writeback();
+			else if (req == FSREQ_RECLAIM)
+				bc_reclaim(FS_RECLAIM_BLOCKS);
+			bc_intr();
+			serve_count(req, start);
+			continue;
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN)
+		// All requests must contain an argument page, but for those
+		// on a session page and the small ones that fit in the IPC
+		// itself (see fsipc_small).
+		st->st_arg = st->st_req;
+		st->st_npages = thisenv->env_ipc_npages;
+		if (perm & PTE_P)
+			/* arguments in st_req */;
+		else if ((slot = thisenv->env_ipc_words[1]) != 0 &&
+				 slot <= FS_NSESSIONS && sessions[slot - 1] == whom)
 		{
-			r = serve_open(whom, (struct Fsreq_open *) fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req])
+			st->st_arg = (union Fsipc *) SESSION_VA(slot - 1);
+			st->st_npages = 1;
+		} else if (slot == 0 && (req == FSREQ_FLUSH || req == FSREQ_SYNC ||
+								 req == FSREQ_DROP_CACHE))
 		{
-			r = handlers[req](whom, fsreq);
+			static_assert(sizeof(struct Fsreq_flush) <= sizeof(st->st_words));
+			st->st_words[0] = thisenv->env_ipc_words[0];
+			st->st_words[1] = 0;
+			st->st_arg = (union Fsipc *) st->st_words;
 		} else
 		{
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+			cprintf("Invalid request from %08x: no argument page\n",
+					whom);
+			// just leave it hanging...
+			continue;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+
+		st->st_reqno = req;
+		st->st_whom = whom;
+		st->st_perm = perm;
+		st->st_start = start;
+		st->st_state = ST_BUSY;
+		thread_wakeup(&st->st_state);
 	}
 }
 
+static void
+serve_main(uint32_t arg)
+{
+	serve();
+}
+
 void
 umain(int argc, char **argv)
 {
+	int r, irq;
+
 	static_assert(sizeof(struct File) == 256);
+	static_assert(FSREQ_DISK < FSSTAT_NREQ);
+	static_assert(sizeof(struct FsStats) <= PGSIZE);
+	static_assert(FSWIN_VA(FS_NTHREADS) >= BC_IOVA + BC_NIO * BC_MAXRUN * PGSIZE);
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
@@ -371,8 +1361,27 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
+	// Fork the flush timer before the file system is up, so that it
+	// shares none of the block cache.
+	envid_t fs_envid = sys_getenvid();
+	if ((flush_envid = fork()) < 0)
+		panic("fork flush timer: %e", flush_envid);
+	if (flush_envid == 0)
+		flush_timer(fs_envid);
+
 	serve_init();
 	fs_init();
-	serve();
+	for (irq = 0; bdev->bd_start && irq < 16; irq++)
+		if ((bdev->bd_irqs & (1 << irq)) &&
+			(r = sys_irq_ipc(irq, FSREQ_DISK)) < 0)
+			panic("sys_irq_ipc: %e", r);
+
+	// Serve from a thread, as the network server does, so that the
+	// serve threads can run while it waits.
+	thread_init();
+	if ((r = thread_create(&main_tid, "serve", serve_main, 0)) < 0)
+		panic("thread_create: %e", r);
+	thread_yield();
+	// never coming here!
 }
 
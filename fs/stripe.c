@@ -0,0 +1,231 @@
+/*
+ * Striping: one disk made of several, FS_STRIPE_BLOCKS blocks on each
+ * in turn, so that a long transfer keeps them all busy at once.
+ *
+ * A transfer is split into pieces, one for each stripe it touches,
+ * that each go to their own disk.  In the background, every piece is
+ * started right away if its disk has room, or else when some transfer
+ * on it ends; the transfer ends, with the first error of any piece,
+ * once the last piece has.  A piece's tag on its disk says which
+ * transfer and which piece it is.
+ */
+
+#include "fs.h"
+
+#define STRIPE_SECTS    (FS_STRIPE_BLOCKS * BLKSECTS)
+
+struct StripePiece {
+	struct BlockDev *sp_disk;
+	uint32_t sp_secno;      // on sp_disk
+	const char *sp_buf;
+	uint32_t sp_nsecs;
+	bool sp_started;
+};
+
+// A background transfer: free, or with npending pieces not yet ended.
+struct StripeIo {
+	uint32_t si_tag;
+	bool si_write;
+	int si_status;
+	uint32_t si_npieces;
+	uint32_t si_npending;
+	struct StripePiece si_piece[STRIPE_MAXPIECES];
+};
+
+static struct BlockDev *disks[STRIPE_MAXDISKS];
+static uint32_t ndisks;
+static struct StripeIo sio[BC_NIO];
+
+static int stripe_read(struct BlockDev *bd, uint32_t secno, void *dst,
+					   size_t nsecs);
+static int stripe_write(struct BlockDev *bd, uint32_t secno, const void *src,
+						size_t nsecs);
+static int stripe_start(struct BlockDev *bd, uint32_t tag, uint32_t secno,
+						const void *buf, size_t nsecs, bool write);
+static int stripe_reap(struct BlockDev *bd, uint32_t *tag, int *status);
+
+static struct BlockDev stripe_bdev = {
+	.bd_name = "stripe",
+	.bd_read = stripe_read,
+	.bd_write = stripe_write,
+};
+
+// Split the transfer of nsecs sectors at secno into pieces, one per
+// stripe.  Returns how many.
+static uint32_t
+stripe_split(uint32_t secno, const void *buf, size_t nsecs,
+			 struct StripePiece *piece)
+{
+	uint32_t n, stripe;
+	uint32_t i;
+
+	for (i = 0; nsecs > 0; i++)
+	{
+		assert(i < STRIPE_MAXPIECES);
+		stripe = secno / STRIPE_SECTS;
+		n = MIN(nsecs, STRIPE_SECTS - secno % STRIPE_SECTS);
+		piece[i].sp_disk = disks[stripe % ndisks];
+		piece[i].sp_secno = stripe / ndisks * STRIPE_SECTS + secno % STRIPE_SECTS;
+		piece[i].sp_buf = buf;
+		piece[i].sp_nsecs = n;
+		piece[i].sp_started = false;
+		secno += n;
+		buf += n * SECTSIZE;
+		nsecs -= n;
+	}
+	return i;
+}
+
+static int
+stripe_sync(uint32_t secno, const void *buf, size_t nsecs, bool write)
+{
+	struct StripePiece piece[STRIPE_MAXPIECES];
+	struct BlockDev *d;
+	uint32_t i, n;
+	int r;
+
+	if (nsecs > BC_MAXRUN * BLKSECTS)
+		return -E_INVAL;
+	n = stripe_split(secno, buf, nsecs, piece);
+	for (i = 0; i < n; i++)
+	{
+		d = piece[i].sp_disk;
+		r = write ? d->bd_write(d, piece[i].sp_secno, piece[i].sp_buf, piece[i].sp_nsecs)
+				  : d->bd_read(d, piece[i].sp_secno, (void *) piece[i].sp_buf,
+							   piece[i].sp_nsecs);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
+stripe_read(struct BlockDev *bd, uint32_t secno, void *dst, size_t nsecs)
+{
+	return stripe_sync(secno, dst, nsecs, false);
+}
+
+static int
+stripe_write(struct BlockDev *bd, uint32_t secno, const void *src, size_t nsecs)
+{
+	return stripe_sync(secno, src, nsecs, true);
+}
+
+// Start the pieces of io whose disks have room.
+static void
+stripe_kick(struct StripeIo *io)
+{
+	struct StripePiece *p;
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < io->si_npieces; i++)
+	{
+		p = &io->si_piece[i];
+		if (p->sp_started)
+			continue;
+		r = p->sp_disk->bd_start(p->sp_disk, (io - sio) * STRIPE_MAXPIECES + i,
+								 p->sp_secno, p->sp_buf, p->sp_nsecs,
+								 io->si_write);
+		if (r == -E_WOULD_BLOCK)
+			continue;
+		// The first piece started, so the rest are sound
+		if (r < 0)
+			panic("stripe_kick: cannot start piece at sector %08x: %e",
+				  p->sp_secno, r);
+		p->sp_started = true;
+	}
+}
+
+// Start a background transfer, unless not even its first piece can
+// start yet.
+static int
+stripe_start(struct BlockDev *bd, uint32_t tag, uint32_t secno,
+			 const void *buf, size_t nsecs, bool write)
+{
+	struct StripeIo *io;
+	struct StripePiece *p;
+	int r;
+
+	if (nsecs > BC_MAXRUN * BLKSECTS)
+		return -E_INVAL;
+	for (io = sio; io < sio + BC_NIO && io->si_npending > 0; io++)
+		/* do nothing */;
+	if (io == sio + BC_NIO)
+		return -E_WOULD_BLOCK;
+
+	io->si_npieces = stripe_split(secno, buf, nsecs, io->si_piece);
+	p = &io->si_piece[0];
+	if ((r = p->sp_disk->bd_start(p->sp_disk, (io - sio) * STRIPE_MAXPIECES,
+								  p->sp_secno, p->sp_buf, p->sp_nsecs, write)) < 0)
+		return r;
+	p->sp_started = true;
+	io->si_tag = tag;
+	io->si_write = write;
+	io->si_status = 0;
+	io->si_npending = io->si_npieces;
+	stripe_kick(io);
+	return 0;
+}
+
+// Report a transfer all of whose pieces have ended.
+static int
+stripe_reap(struct BlockDev *bd, uint32_t *tag, int *status)
+{
+	struct StripeIo *io, *other;
+	uint32_t i, ptag;
+	int pstatus;
+
+	for (i = 0; i < ndisks; i++)
+		while (disks[i]->bd_reap(disks[i], &ptag, &pstatus) == 0)
+		{
+			if (ptag >= BC_NIO * STRIPE_MAXPIECES ||
+				sio[ptag / STRIPE_MAXPIECES].si_npending == 0)
+				panic("stripe_reap: disk reported unknown transfer %08x", ptag);
+			io = &sio[ptag / STRIPE_MAXPIECES];
+			if (pstatus < 0 && io->si_status == 0)
+				io->si_status = pstatus;
+			io->si_npending--;
+			// Room on that disk, maybe for a piece still waiting
+			for (other = sio; other < sio + BC_NIO; other++)
+				if (other->si_npending > 0)
+					stripe_kick(other);
+			if (io->si_npending == 0)
+			{
+				*tag = io->si_tag;
+				*status = io->si_status;
+				return 0;
+			}
+		}
+	return -E_WOULD_BLOCK;
+}
+
+// Make one disk of the n 'members', striped, and return it, or return
+// members[0] itself if there is just one.  Background transfers are
+// only used if every member has them.
+struct BlockDev *
+stripe_init(struct BlockDev **members, uint32_t n)
+{
+	uint32_t i, nsectors = ~0U;
+
+	if (n == 1)
+		return members[0];
+	assert(n > 0 && n <= STRIPE_MAXDISKS);
+	ndisks = n;
+	stripe_bdev.bd_start = stripe_start;
+	stripe_bdev.bd_reap = stripe_reap;
+	for (i = 0; i < n; i++)
+	{
+		disks[i] = members[i];
+		stripe_bdev.bd_irqs |= members[i]->bd_irqs;
+		if (!members[i]->bd_start)
+			stripe_bdev.bd_start = NULL;
+		nsectors = MIN(nsectors, ROUNDDOWN(members[i]->bd_nsectors, STRIPE_SECTS));
+	}
+	if (!stripe_bdev.bd_start)
+		stripe_bdev.bd_reap = NULL;
+	stripe_bdev.bd_nsectors = nsectors * n;
+	cprintf("FS: striping over %u disks, %u blocks at a time\n",
+			n, FS_STRIPE_BLOCKS);
+	return &stripe_bdev;
+}
@@ -0,0 +1,126 @@
+/*
+ * The virtio-blk disks, which the kernel drives (kern/virtio_blk.c):
+ * transfers go straight between a disk and our pages, several at a
+ * time, with sys_blk_submit and sys_blk_reap.  vblk_bdev[i] is disk i.
+ * The kernel reports the transfers that end on all the disks together,
+ * so reaping through any of them may report another one's: tags must
+ * differ across the disks.
+ */
+
+#include "fs.h"
+
+// A tag no background transfer uses: bc.c's are slot numbers.
+#define SYNC_TAG    0xFFFFFFFF
+
+static int vblk_read(struct BlockDev *bd, uint32_t secno, void *dst,
+					 size_t nsecs);
+static int vblk_write(struct BlockDev *bd, uint32_t secno, const void *src,
+					  size_t nsecs);
+static int vblk_start(struct BlockDev *bd, uint32_t tag, uint32_t secno,
+					  const void *buf, size_t nsecs, bool write);
+static int vblk_reap(struct BlockDev *bd, uint32_t *tag, int *status);
+
+struct BlockDev vblk_bdev[VBLK_MAXDISKS];
+
+// Background transfers reaped while a synchronous one waited, oldest
+// first, for vblk_reap to hand out: as many as can be in flight, one
+// per piece of a striped transfer.
+static struct BlkDone stash[BC_NIO * STRIPE_MAXPIECES];
+static uint32_t nstash;
+
+static uint32_t
+vblk_flags(struct BlockDev *bd, bool write)
+{
+	return BLK_DISK(bd->bd_unit) | (write ? BLK_WRITE : 0);
+}
+
+static int
+vblk_start(struct BlockDev *bd, uint32_t tag, uint32_t secno, const void *buf,
+		   size_t nsecs, bool write)
+{
+	return sys_blk_submit(tag, secno, buf, nsecs, vblk_flags(bd, write));
+}
+
+static int
+vblk_reap(struct BlockDev *bd, uint32_t *tag, int *status)
+{
+	struct BlkDone done;
+	int r;
+
+	if (nstash > 0)
+	{
+		done = stash[0];
+		memmove(stash, stash + 1, --nstash * sizeof(stash[0]));
+	} else if ((r = sys_blk_reap(&done, 1)) <= 0)
+		return r < 0 ? r : -E_WOULD_BLOCK;
+	*tag = done.bd_tag;
+	*status = done.bd_status;
+	return 0;
+}
+
+// Move nsecs sectors and wait for them, giving up the CPU meanwhile.
+// Background transfers that end first are kept for vblk_reap.
+static int
+vblk_sync(struct BlockDev *bd, uint32_t secno, const void *buf, size_t nsecs,
+		  bool write)
+{
+	struct BlkDone done;
+	int r;
+
+	while ((r = sys_blk_submit(SYNC_TAG, secno, buf, nsecs,
+							   vblk_flags(bd, write))) == -E_WOULD_BLOCK)
+		sys_yield();
+	if (r < 0)
+		return r;
+	for (;;)
+	{
+		if ((r = sys_blk_reap(&done, 1)) < 0)
+			return r;
+		if (r == 0)
+			sys_yield();
+		else if (done.bd_tag == SYNC_TAG)
+			return done.bd_status;
+		else if (nstash < ARRAY_SIZE(stash))
+			stash[nstash++] = done;
+		else
+			panic("vblk_sync: more than %d transfers in flight", ARRAY_SIZE(stash));
+	}
+}
+
+static int
+vblk_read(struct BlockDev *bd, uint32_t secno, void *dst, size_t nsecs)
+{
+	return vblk_sync(bd, secno, dst, nsecs, false);
+}
+
+static int
+vblk_write(struct BlockDev *bd, uint32_t secno, const void *src, size_t nsecs)
+{
+	return vblk_sync(bd, secno, src, nsecs, true);
+}
+
+// How many virtio-blk disks are there?  The first that many of
+// vblk_bdev are ready to use.
+uint32_t
+vblk_probe(void)
+{
+	struct BlkInfo info;
+	uint32_t i, n;
+
+	for (i = 0, n = 1; i < n && i < VBLK_MAXDISKS; i++)
+	{
+		if (sys_blk_info(i, &info) < 0)
+			break;
+		n = info.bi_ndisks;
+		vblk_bdev[i].bd_name = "virtio-blk";
+		vblk_bdev[i].bd_read = vblk_read;
+		vblk_bdev[i].bd_write = vblk_write;
+		vblk_bdev[i].bd_start = vblk_start;
+		vblk_bdev[i].bd_reap = vblk_reap;
+		vblk_bdev[i].bd_irqs = 1 << info.bi_irq;
+		vblk_bdev[i].bd_unit = i;
+		vblk_bdev[i].bd_nsectors = info.bi_nsectors;
+		cprintf("FS: virtio-blk disk %u of %u sectors\n", i, info.bi_nsectors);
+	}
+	return i;
+}
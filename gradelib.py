@@ -96,6 +96,13 @@ def run_tests():
                       help="print commands")
     parser.add_option("--color", choices=["never", "always", "auto"],
                       default="auto", help="never, always, or auto")
+    parser.add_option("--baseline", default="bench.baseline",
+                      help="benchmark baseline file (default %default)")
+    parser.add_option("--tolerance", type="float", default=0.15,
+                      help="slowdown a benchmark may show against the "
+                      "baseline before it fails (default %default)")
+    parser.add_option("--update-baseline", action="store_true",
+                      help="record benchmark results as the new baseline")
     (options, args) = parser.parse_args()
 
     # Start with a full build to catch build errors
@@ -479,6 +486,16 @@ Failed to shutdown QEMU.  You might need to 'killall qemu' or
 
         assert_lines_match(self.qemu.output, *args, **kwargs)
 
+    def bench(self, cpus=1, timeout=300, **kw):
+        """Boot QEMU with 'cpus' CPUs, run user/bench on its own until it
+        prints "bench done", and return its results as parse_bench
+        does.  Other keyword arguments are as for user_test."""
+
+        kw.setdefault("make_args", []).append("CPUS=%d" % cpus)
+        self.user_test("bench", stop_on_line("bench done"), timeout=timeout, **kw)
+        assert_lines_match(self.qemu.output, "bench done", no=[".*panic"])
+        return parse_bench(self.qemu.output)
+
 ##################################################################
 # Monitors
 #
@@ -545,3 +562,75 @@ def stop_on_line(regexp):
     def stop(line):
         raise TerminateTest
     return call_on_line(regexp, stop)
+
+##################################################################
+# Benchmarks
+#
+
+__all__ += ["parse_bench", "Baseline", "assert_no_regression"]
+
+def parse_bench(text):
+    """Parse the lines user/bench prints into a dict mapping each
+    benchmark's name to its cycles/op."""
+
+    results = {}
+    for line in text.splitlines():
+        fields = line.strip().split("\t")
+        if len(fields) == 5 and fields[0] == "bench":
+            results[fields[1]] = int(fields[3])
+    return results
+
+class Baseline(object):
+    """Benchmark results to compare against, kept in a text file with
+    one "<key> <name> <cycles/op>" line per result, where key names
+    the configuration, such as the number of CPUs."""
+
+    def __init__(self, path):
+        self.path = path
+        self.results = {}
+        if os.path.exists(path):
+            for line in open(path):
+                fields = line.split()
+                if len(fields) == 3 and not line.startswith("#"):
+                    self.results[(fields[0], fields[1])] = int(fields[2])
+
+    def get(self, key, name):
+        return self.results.get((str(key), name))
+
+    def update(self, key, results):
+        for name, cycles in results.items():
+            self.results[(str(key), name)] = cycles
+        with open(self.path, "w") as f:
+            f.write("# key benchmark cycles/op, written by --update-baseline\n")
+            for (k, name), cycles in sorted(self.results.items()):
+                f.write("%s %s %d\n" % (k, name, cycles))
+
+def assert_no_regression(key, results, expect=()):
+    """Assert that none of the benchmark results, as from parse_bench,
+    is slower than the baseline (see the --baseline option) by more
+    than the --tolerance fraction, and that every name in expect has a
+    result.  Names the baseline lacks are reported but pass.  With
+    --update-baseline, record the results instead."""
+
+    missing = [name for name in expect if name not in results]
+    assert not missing, "no result for %s" % ", ".join(missing)
+    baseline = Baseline(options.baseline)
+    if options.update_baseline:
+        baseline.update(key, results)
+        return
+
+    msg, bad = [], False
+    for name in sorted(results):
+        got, base = results[name], baseline.get(key, name)
+        if base is None:
+            msg.append("%-16s %10d cycles/op (no baseline)" % (name, got))
+            continue
+        slower = got > base * (1 + options.tolerance)
+        bad = bad or slower
+        msg.append("%s %-16s %10d cycles/op, baseline %d (%+.1f%%)" %
+                   (color("red", "SLOW") if slower else color("green", "OK  "),
+                    name, got, base, 100.0 * (got - base) / base if base else 0))
+    if options.verbose or bad:
+        print("\n    " + "\n    ".join(msg), end=" ")
+    assert not bad, "benchmarks slower than %s by more than %d%%" % \
+        (options.baseline, options.tolerance * 100)
@@ -45,6 +45,15 @@ struct Secthdr {
 	uint32_t sh_entsize;
 };
 
+struct Elfsym {
+	uint32_t st_name;    // offset of the name in the linked string table
+	uint32_t st_value;
+	uint32_t st_size;
+	uint8_t st_info;
+	uint8_t st_other;
+	uint16_t st_shndx;
+};
+
 // Values for Proghdr::p_type
 #define ELF_PROG_LOAD        1
 
@@ -59,6 +68,10 @@ struct Secthdr {
 #define ELF_SHT_SYMTAB        2
 #define ELF_SHT_STRTAB        3
 
+// Symbol types, in the low bits of Elfsym::st_info
+#define ELF_ST_TYPE(info)    ((info) & 0xf)
+#define ELF_STT_FUNC        2
+
 // Values for Secthdr::sh_name
 #define ELF_SHN_UNDEF        0
 
@@ -6,26 +6,28 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/sysstat.h>
 
 typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+---------------18--------------+----------13---------+
+// |0|          Uniqueifier          |     Environment     |
+// | |                               |        Index        |
+// +---------------------------------+---------------------+
+//                                    \---- ENVX(eid) ----/
 //
 // The environment index ENVX(eid) equals the environment's index in the
-// 'envs[]' array.  The uniqueifier distinguishes environments that were
+// 'envs[]' array.  The array grows a page at a time as environments are
+// created, up to NENV slots; only the first uinfo.nenv are mapped.  The uniqueifier distinguishes environments that were
 // created at different times, but share the same environment index.
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV        10
+#define LOG2NENV        13
 #define NENV            (1 << LOG2NENV)
 #define ENVX(envid)        ((envid) & (NENV - 1))
 
@@ -38,6 +40,19 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling weights (see sys_env_set_weight).  An environment with
+// twice the weight of another gets twice its share of the CPU.
+#define ENV_WEIGHT_MIN        1
+#define ENV_WEIGHT_DEFAULT    1024
+#define ENV_WEIGHT_SERVER     (4 * ENV_WEIGHT_DEFAULT)
+#define ENV_WEIGHT_MAX        (1 << 16)
+
+// CPU affinity mask allowing every CPU (see sys_env_set_affinity)
+#define ENV_CPUMASK_ALL       0xffffffff
+
+// Words an IPC may carry besides its value (see sys_ipc_call_words)
+#define IPC_NWORDS            2
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -55,18 +70,95 @@ struct Env {
 	uint32_t env_runs;        // Number of times environment has run
 	int env_cpunum;            // The CPU that the env is running on
 
+	// Accounting (see env_charge_user in kern/env.c).  Read lock-free
+	// through UENVS, so a 64-bit count may be caught mid-update.
+	uint64_t env_user_cycles;    // TSC cycles run in user mode
+	uint64_t env_kern_cycles;    // ... and in the kernel on its behalf
+	uint32_t env_vol_switches;    // Gave up the CPU: blocked or yielded
+	uint32_t env_invol_switches;    // Preempted by the timer
+	uint32_t env_pgfaults;        // Page faults taken in user mode
+	uint32_t env_ipc_sends;        // IPC messages sent
+	uint32_t env_ipc_recvs;        // ... and received
+
+	// Scheduling
+	struct Env *env_rq_next;    // Next env on the run queue
+	struct Env *env_rq_prev;    // Previous env on the run queue
+	int env_rq_cpu;        // CPU whose run queue holds us, or -1
+	uint32_t env_weight;        // Share of the CPU, ENV_WEIGHT_MIN..MAX
+	uint32_t env_stride;        // Pass increment per quantum run
+	uint64_t env_pass;        // Virtual time; lowest pass runs first
+	uint32_t env_cpumask;        // CPUs we may run on, bit i = CPU i
+	uint64_t env_runnable_tsc;    // When we last became runnable, or 0
+	struct SysStat env_runwait;    // Run queue waits (see inc/sysstat.h)
+	envid_t env_peer;        // Who we exchange the most with (see sched_note_peer)
+	uint32_t env_peer_score;    // ... and by how far
+
 	// Address space
 	pde_t *env_pgdir;        // Kernel virtual address of page dir
+	const uint8_t *env_binary;    // ELF image env_create loaded, or 0
+
+	// FPU and SSE registers, saved on a page of their own from the
+	// first time the env uses them (see kern/fpu.c); 0 until then
+	struct FxSave *env_fpu;
+	// Performance counter state, on a page of its own, while the env
+	// uses counters (see kern/pmc.c); 0 otherwise
+	struct PmcState *env_pmc;
 
 	// Exception handling
 	void *env_pgfault_upcall;    // Page fault upcall entry point
+	bool env_cow_upcall;        // Copy-on-write faults go to it too
 
 	// Lab 4 IPC
 	bool env_ipc_recving;        // Env is blocked receiving
+	envid_t env_ipc_recv_from;    // ... from only this env, or 0 for any
 	void *env_ipc_dstva;        // VA at which to map received page
+	unsigned env_ipc_dstnpages;    // Pages we will accept at env_ipc_dstva
 	uint32_t env_ipc_value;        // Data value sent to us
+	uint32_t env_ipc_words[IPC_NWORDS];    // ... and words, or zeroes
 	envid_t env_ipc_from;        // envid of the sender
 	int env_ipc_perm;        // Perm of page mapping received
+	unsigned env_ipc_npages;    // Number of pages received
+
+	// Blocking sends (see sys_ipc_send in kern/syscall.c)
+	struct Env *env_ipc_sendq;    // Senders blocked on us, oldest first
+	struct Env *env_ipc_sendq_tail;
+	struct Env *env_ipc_send_next;    // Next sender on the same queue
+	envid_t env_ipc_send_to;    // Env we are blocked sending to, or 0
+	uint32_t env_ipc_send_value;    // Arguments of the blocked send
+	uint32_t env_ipc_send_words[IPC_NWORDS];
+	void *env_ipc_send_srcva;
+	unsigned env_ipc_send_perm;
+	bool env_ipc_send_call;        // Then receive a reply at env_ipc_dstva
+
+	// Top of the exception stack page faults are delivered on:
+	// UXSTACKTOP, or a thread slot's (see inc/memlayout.h)
+	uintptr_t env_xstacktop;
+
+	// Shared-memory ring doorbell (see sys_ring_wait in kern/syscall.c)
+	bool env_ring_waiting;        // Env is blocked in sys_ring_wait
+	struct PageInfo *env_wait_page;    // Page of its word, in sys_page_wait
+
+	// Timed sleep (see kern/timerq.c)
+	uint32_t env_timer_deadline;    // time_msec() to wake at, or 0
+	struct Env *env_timer_next;    // Next on the timer queue
+
+	// Console input (see cons_read_sleep in kern/console.c)
+	bool env_cons_reading;        // Env is waiting for a line
+
+	// Futex sleep (see kern/futex.c)
+	physaddr_t env_futex_pa;    // Address of the word we sleep on, or 0
+	uint32_t env_futex_deadline;    // time_msec() to give up at, or 0
+	struct Env *env_futex_next;    // Next sleeper on the same chain
+
+	// Zero-copy network sends completed but not yet reported
+	uint32_t env_net_tx_done;
+
+	// IRQs routed to us by sys_irq_ipc that we have not yet received
+	uint32_t env_irq_pending;
+
+	// Notifications (see sys_wait_notify in kern/syscall.c)
+	uint32_t env_notify;          // Bits posted and not yet taken
+	uint32_t env_notify_mask;     // Bits we last slept on
 };
 
 #endif // !JOS_INC_ENV_H
@@ -27,6 +27,8 @@ enum {
 	E_FILE_EXISTS,    // File already exists
 	E_NOT_EXEC,    // File not a valid executable
 	E_NOT_SUPP,    // Operation not supported
+	E_WOULD_BLOCK,    // Non-blocking operation found nothing to do
+	E_TIMEOUT,    // Wait gave up before it was satisfied
 
 	MAXERROR
 };
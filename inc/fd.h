@@ -12,6 +12,57 @@ struct Fd;
 struct Stat;
 struct Dev;
 
+// Open mode flag: reads and writes that would wait fail with
+// -E_WOULD_BLOCK instead (see fcntl).  Defined here, ahead of lwIP's
+// headers, so that lwIP takes the same value.
+#define O_NONBLOCK	0x1000
+
+// fcntl commands
+#define F_GETFL		3	// Return the open mode
+#define F_SETFL		4	// Set O_NONBLOCK as given, keeping the rest
+
+// One file descriptor for poll(), which sets 'revents' to the subset
+// of 'events' that holds, plus POLLHUP and POLLNVAL whether asked or
+// not.  Negative fds are skipped.
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
+};
+
+#define POLLIN		0x01	// Can read without waiting
+#define POLLOUT		0x04	// Can write without waiting
+#define POLLHUP		0x10	// The other end is gone
+#define POLLNVAL	0x20	// fd is not open
+
+// Edge-triggered readiness events for epoll_wait, about sockets
+// registered with epoll_ctl.  Each transition to readable or writable
+// is reported once, with the 'data' it was registered with.
+struct epoll_event {
+	uint32_t events;	// EPOLLIN, EPOLLOUT
+	uint32_t data;
+};
+
+#define EPOLLIN		POLLIN
+#define EPOLLOUT	POLLOUT
+
+#define EPOLL_CTL_ADD	1
+#define EPOLL_CTL_MOD	2
+#define EPOLL_CTL_DEL	3
+
+// Maximum number of file descriptors a program may hold open concurrently.
+// Each takes two pages of address space below FCACHE (see lib/fd.c).
+#define MAXFD		2048
+
+// One piece of a vectored read or write: iov_len bytes at iov_base,
+// moved from or to the file at iov_offset.  Unlike POSIX's, each piece
+// has its own offset, so that one call covers several ranges.
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+	off_t iov_offset;
+};
+
 // Per-device-class file descriptor operations
 struct Dev {
 	int dev_id;
@@ -21,14 +72,31 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Positional vectored I/O, which leaves fd_offset alone
+	ssize_t (*dev_preadv)(struct Fd *fd, const struct iovec *iov, int iovcnt);
+	ssize_t (*dev_pwritev)(struct Fd *fd, const struct iovec *iov, int iovcnt);
+	// Return the POLL* bits that hold for fd now, without waiting.
+	// Devices without one never make a reader or writer wait.
+	int (*dev_poll)(struct Fd *fd);
+	// Write out what the device holds back of fd's writes in this
+	// environment; seek and fsync call it.
+	int (*dev_fsync)(struct Fd *fd);
 };
 
 struct FdFile {
 	int id;
+	uint32_t vslot;		// Its entry in the server's version table
 };
 
 struct FdSock {
 	int sockid;
+	// What a socket was made with, so that it can move to another
+	// network server shard until it has a local address (see
+	// lib/sockets.c)
+	int domain, type, protocol;
+	bool placed;
+	// Sockets an event queue watches
+	uint32_t nwatch;
 };
 
 struct Fd {
@@ -47,6 +115,7 @@ struct Stat {
 	char st_name[MAXNAMELEN];
 	off_t st_size;
 	int st_isdir;
+	uint32_t st_version;	// Changes whenever the contents do
 	struct Dev *st_dev;
 };
 
@@ -59,6 +128,7 @@ int dev_lookup(int devid, struct Dev **dev_store);
 
 extern struct Dev devfile;
 extern struct Dev devsock;
+extern struct Dev devepoll;
 extern struct Dev devcons;
 extern struct Dev devpipe;
 
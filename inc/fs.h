@@ -5,6 +5,7 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/sysstat.h>
 
 // File nodes (both in-memory and on-disk)
 
@@ -19,28 +20,53 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN    1024
 
-// Number of block pointers in a File descriptor
-#define NDIRECT        10
-// Number of direct block pointers in an indirect block
+// Number of extents in a File descriptor
+#define NEXTENT        12
+// Number of block pointers in an indirect block
 #define NINDIRECT    (BLKSIZE / 4)
 
-#define MAXFILESIZE    ((NDIRECT + NINDIRECT) * BLKSIZE)
+// Most blocks a file can have, through its double-indirect block
+#define MAXFILEBLOCKS    (NINDIRECT * NINDIRECT)
+// ... and the most bytes, which off_t can address
+#define MAXFILESIZE    (0x7FFFFFFF / BLKSIZE * BLKSIZE)
+
+// A run of 'fe_len' blocks, adjacent on disk from block 'fe_start'.
+struct FileExtent {
+	uint32_t fe_start;
+	uint32_t fe_len;
+} __attribute__((packed));
+
+// Bytes of data a regular file may keep in its File, in place of its
+// block pointers; must do arithmetic in case we're compiling fsformat
+// on a 64-bit machine.
+#define FILE_INLINE_MAX    (256 - MAXNAMELEN - 16)
 
 struct File {
 	char f_name[MAXNAMELEN];    // filename
 	off_t f_size;            // file size in bytes
 	uint32_t f_type;        // file type
+	uint32_t f_version;     // bumped on every change to the contents
+	uint32_t f_flags;        // FILE_INLINE
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];    // direct blocks
-	uint32_t f_indirect;        // indirect block
-
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4 * NDIRECT - 4];
+	union {
+		// Block pointers.  The extents in use, those with fe_len != 0,
+		// come first and hold file blocks 0, 1, ... in order.  Past
+		// them, file block n is entry n % NINDIRECT of the indirect
+		// block that entry n / NINDIRECT of the double-indirect block
+		// points to.  A block is allocated iff its value is != 0.
+		struct {
+			struct FileExtent f_extent[NEXTENT];    // extents
+			uint32_t f_dindirect;        // double-indirect block
+		};
+		// With FILE_INLINE, the file's data instead, zero past f_size.
+		// Pads the File out to 256 bytes.
+		uint8_t f_inline[FILE_INLINE_MAX];
+	};
 } __attribute__((packed));    // required only on some 64-bit machines
 
+// File flags
+#define FILE_INLINE    0x1    // The data is in f_inline, and no blocks
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES    (BLKSIZE / sizeof(struct File))
 
@@ -52,25 +78,154 @@ struct File {
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC    0x4A0530AE    // related vaguely to 'J\0S!'
+// Version 4 has a metadata journal; version 3 keeps small files' data
+// in their File; version 2 lays files out in extents; version 1, before
+// s_version, had direct and indirect blocks.
+#define FS_VERSION    4
 
 struct Super {
 	uint32_t s_magic;        // Magic number: FS_MAGIC
 	uint32_t s_nblocks;        // Total number of blocks on disk
 	struct File s_root;        // Root directory node
+	uint32_t s_version;        // On-disk format: FS_VERSION
+	uint32_t s_ndisks;        // Disks the blocks are striped over, or 0 for 1
+	uint32_t s_journal;        // First block of the journal
+	uint32_t s_njournal;        // Blocks in the journal
+};
+
+// The journal, FS_JOURNAL_BLOCKS blocks that fsformat puts after the
+// bitmap, holds the last transaction of metadata blocks the file
+// server committed: this header, then a copy of each block, in order.
+// The checksum covers the header, with jh_sum 0, and the copies; a
+// transaction cut short by a crash does not match it.
+#define FS_JOURNAL_BLOCKS    64
+#define JNL_MAGIC    0x4A4E4C31    // 'JNL1'
+
+struct JournalHeader {
+	uint32_t jh_magic;        // JNL_MAGIC
+	uint32_t jh_seq;        // Transaction number
+	uint32_t jh_nblocks;        // Blocks that follow
+	uint32_t jh_sum;        // FNV-1a of the words
+	uint32_t jh_blocks[BLKSIZE / 4 - 4];    // Where each belongs
 };
 
+// Striped file systems lay out FS_STRIPE_BLOCKS blocks on each disk in
+// turn: block b is on disk b / FS_STRIPE_BLOCKS % s_ndisks.
+#define FS_STRIPE_BLOCKS    16
+
 // Definitions for requests from clients to file system
+
+// A read or write of more than fits in the request page moves its
+// data, up to FSIPC_MAXPAGES pages of it, in a multi-page IPC: the
+// pages of a FSREQ_READ reply, or FSREQ_WRITE's pages following the
+// request page.
+#define FSIPC_MAXPAGES    16
+
+// Most ranges one FSREQ_READV or FSREQ_WRITEV moves: iov_len bytes of
+// the file from iov_offset each.
+#define FSIPC_MAXIOV    32
+
+struct Fsiov {
+	off_t iov_offset;
+	size_t iov_len;
+};
+
+// A directory entry as FSREQ_READDIR packs it: the fixed fields, then
+// the name and its NUL, rounded up to a 4-byte boundary.  The next
+// entry starts d_reclen bytes on.
+struct Dirent {
+	off_t d_size;
+	uint8_t d_type;		// FTYPE_REG or FTYPE_DIR
+	uint8_t d_namelen;	// not counting the NUL
+	uint16_t d_reclen;
+	char d_name[0];
+};
+
+#define DIRENT_RECLEN(namelen) \
+	ROUNDUP(sizeof(struct Dirent) + (namelen) + 1, 4)
+
 enum {
 	FSREQ_OPEN = 1,
 	FSREQ_SET_SIZE,
-	// Read returns a Fsret_read on the request page
+	// Read returns a Fsret_read on the request page, or the
+	// reply's pages if req_n > PGSIZE
 	FSREQ_READ,
 	FSREQ_WRITE,
 	// Stat returns a Fsret_stat on the request page
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns the pages of the file's block cache that hold
+	// req_n bytes from req_offset, mapped read-only, and the number
+	// of those bytes there are before the end of the file
+	FSREQ_MAP,
+	// Versions returns the server's version table, a page mapped
+	// read-only: entry fd_file.vslot of an open file's Fd changes
+	// whenever the file does
+	FSREQ_VERSIONS,
+	// Vectored reads and writes move the ranges in req_iov, their
+	// data packed one after another as a read or write's would be,
+	// and leave the seek position alone.  They stop at the first
+	// range that comes up short, and return the bytes moved.
+	FSREQ_READV,
+	FSREQ_WRITEV,
+	// Write pages is FSREQ_WRITE with req_n bytes in the pages after
+	// the request page, which the client donates copy-on-write: the
+	// server makes those covering whole blocks the blocks' own pages
+	// instead of copying them
+	FSREQ_WRITE_PAGES,
+	// Readdir returns a Fsret_readdir on the request page: as many of
+	// the directory's entries from req_offset as fit in req_n bytes,
+	// packed as struct Dirents, and the offset that follows them.  It
+	// returns the bytes of entries, 0 at the end of the directory.
+	FSREQ_READDIR,
+	// Session lends the server the request page, for it to keep and
+	// take the client's later requests on; it returns the session's
+	// slot (see fsipc_session in lib/file.c)
+	FSREQ_SESSION,
+	// Drop cache writes the block cache back and empties it, and
+	// forgets cached lookups, so that what follows runs cold
+	FSREQ_DROP_CACHE,
+	// Fallocate gives the file disk blocks for the req_len bytes
+	// from req_offset, growing it to cover them (see file_allocate)
+	FSREQ_FALLOCATE,
+	// Stats returns a Fsret_stats on the request page, and starts
+	// counting afresh if req_reset is set
+	FSREQ_STATS,
+	// Splice copies up to req_n bytes, at most FSIPC_MAXPAGES pages'
+	// worth, from req_in's seek position to req_out's, two different
+	// files, moving both positions on; it returns the bytes copied,
+	// 0 at the end of req_in (see file_splice)
+	FSREQ_SPLICE,
+	// Sent by the file server's flush timer: write back dirty blocks
+	FSREQ_TICK,
+	// Sent by the flush timer when the kernel is out of memory: give
+	// clean blocks back
+	FSREQ_RECLAIM,
+	// Sent by the kernel when the disk interrupts (see sys_irq_ipc)
+	FSREQ_DISK
+};
+
+// Request types whose service times FSREQ_STATS reports; more than
+// there are.
+#define FSSTAT_NREQ    24
+
+// The file server's counters, as FSREQ_STATS reports them.  The disk
+// transfers and requests are timed in TSC cycles, in the histograms of
+// inc/sysstat.h: ss_calls counts them, and ss_returns the ones timed.
+// A background transfer is timed until the server reaps it.
+struct FsStats {
+	uint32_t fs_lookups;        // file blocks looked up by requests
+	uint32_t fs_misses;         // ... that were not in the cache
+	uint32_t fs_faults;         // block cache page faults
+	uint32_t fs_readahead;      // blocks read ahead of their use
+	uint32_t fs_blocks_read;    // blocks the disk transferred
+	uint32_t fs_blocks_written;
+	uint32_t fs_resident;       // blocks in the cache now
+	struct SysStat fs_disk_read;
+	struct SysStat fs_disk_write;
+	struct SysStat fs_req[FSSTAT_NREQ];     // by request type
 };
 
 union Fsipc {
@@ -82,6 +237,11 @@ union Fsipc {
 		int req_fileid;
 		off_t req_size;
 	} set_size;
+	struct Fsreq_fallocate {
+		int req_fileid;
+		off_t req_offset;
+		off_t req_len;
+	} fallocate;
 	struct Fsreq_read {
 		int req_fileid;
 		size_t req_n;
@@ -101,6 +261,7 @@ union Fsipc {
 		char ret_name[MAXNAMELEN];
 		off_t ret_size;
 		int ret_isdir;
+		uint32_t ret_version;
 	} statRet;
 	struct Fsreq_flush {
 		int req_fileid;
@@ -108,6 +269,43 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;	// A multiple of PGSIZE
+		size_t req_n;
+	} map;
+	struct Fsreq_readv {
+		int req_fileid;
+		uint32_t req_niov;
+		struct Fsiov req_iov[FSIPC_MAXIOV];
+	} readv;
+	struct Fsreq_writev {
+		int req_fileid;
+		uint32_t req_niov;
+		struct Fsiov req_iov[FSIPC_MAXIOV];
+		char req_buf[PGSIZE - (sizeof(int) + sizeof(uint32_t) +
+							   FSIPC_MAXIOV * sizeof(struct Fsiov))];
+	} writev;
+	struct Fsreq_readdir {
+		int req_fileid;
+		off_t req_offset;	// A multiple of sizeof(struct File)
+		size_t req_n;
+	} readdir;
+	struct Fsret_readdir {
+		off_t ret_offset;
+		char ret_buf[PGSIZE - sizeof(off_t)];
+	} readdirRet;
+	struct Fsreq_stats {
+		int req_reset;
+	} stats;
+	struct Fsreq_splice {
+		int req_in;
+		int req_out;
+		size_t req_n;
+	} splice;
+	struct Fsret_stats {
+		struct FsStats ret_stats;
+	} statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
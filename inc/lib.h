@@ -22,22 +22,56 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/uinfo.h>
+#include <inc/ring.h>
+#include <inc/trace.h>
+#include <inc/prof.h>
+#include <inc/pmc.h>
+#include <inc/sysstat.h>
 
 #define USED(x)        (void)(x)
 
 // main user program
 void umain(int argc, char **argv);
 
-// libmain.c or entry.S
+// libmain.c or uvars.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thisenv_main;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct Uinfo uinfo;
+
+// The base of the sfork thread slot (see inc/memlayout.h) we are
+// running on, or 0 on the main thread.
+static inline uintptr_t
+thread_slot(void)
+{
+	uintptr_t esp;
+
+	asm volatile("movl %%esp,%0" : "=r" (esp));
+	if (esp - UTHREADS < UTHREADTOP - UTHREADS)
+		return ROUNDDOWN(esp, THREADSLOT);
+	return 0;
+}
+
+static inline const volatile struct Env **
+thisenv_ptr(void)
+{
+	uintptr_t slot = thread_slot();
+
+	return slot ? (const volatile struct Env **) slot : &thisenv_main;
+}
+
+// Our Env.  Threads share their globals, so each keeps its own at the
+// bottom of its slot.
+#define thisenv (*thisenv_ptr())
 
 // exit.c
+extern void (*exit_flush)(void);
 void exit(void);
 
 // pgfault.c
+void pgfault_init(void);
 void set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 
 // readline.c
@@ -54,14 +88,67 @@ int sys_env_set_status(envid_t env, int status);
 int sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int sys_page_alloc(envid_t env, void *va, int perm);
+int sys_page_alloc_nowait(envid_t env, void *va, int perm);
 int sys_page_map(envid_t src_env, void *src_pg,
 				 envid_t dst_env, void *dst_pg, int perm);
 int sys_page_unmap(envid_t env, void *pg);
 int sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int sys_ipc_recv(void *rcv_pg);
+int sys_ipc_recv_pages(void *rcv_pg, unsigned npages);
 unsigned int sys_time_msec(void);
 int sys_try_transmit_packet(const uint8_t *packet_data, uint32_t packet_size);
 int sys_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_size);
+int sys_env_set_weight(envid_t env, uint32_t weight);
+int sys_env_set_affinity(envid_t env, uint32_t cpumask);
+envid_t sys_fork_cow(void);
+int sys_page_map_batch(envid_t src_env, envid_t dst_env,
+					   const struct PageMapOp *ops, size_t n, size_t *done);
+int sys_time_usec(uint64_t *usec);
+int sys_ipc_call(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva);
+int sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva);
+int sys_ring_wait(const volatile uint32_t *addr, uint32_t val);
+int sys_ring_notify(envid_t env);
+int sys_page_wait(const volatile uint32_t *addr, uint32_t val, uint32_t ref);
+int sys_futex_wait(const volatile uint32_t *addr, uint32_t expected, uint32_t timeout);
+int sys_futex_wake(const volatile uint32_t *addr, uint32_t n);
+int sys_env_wait(envid_t envid);
+int sys_page_cow_resolve(void *va);
+int sys_env_set_cow_upcall(envid_t envid, bool on);
+int sys_service_register(envid_t envid, const char *name);
+int sys_trace_read(int cpu, uint32_t *pos, struct TraceEvent *buf, size_t n);
+int sys_prof_ctl(bool on);
+int sys_prof_report(struct ProfReport *r);
+int sys_pmc_set(envid_t envid, const uint32_t *evtsel, uint32_t n);
+int sys_sysstat_reset(envid_t envid);
+int sys_sysstat_read(int cpu, struct SysStatReport *r);
+int sys_enter_ring(struct SysRing *ring);
+int sys_notify(envid_t envid, uint32_t bits);
+int sys_wait_notify(uint32_t mask, uint32_t timeout);
+int sys_irq_notify(uint32_t irq, uint32_t bits);
+int sys_reclaim_notify(uint32_t bits);
+int sys_shlib_map(envid_t envid);
+envid_t sys_spawn(const void *image, size_t size, const char **argv);
+int sys_cons_read(void *buf, size_t n, bool wait);
+int sys_ksm(int enable, struct KsmStats *st);
+int sys_ipc_send_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1);
+int sys_ipc_call_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1);
+int sys_ipc_recv_timeout(void *dstva, unsigned npages, uint32_t msec);
+int sys_sleep(uint32_t msec);
+int sys_ipc_recv_from(void *dstva, unsigned npages, envid_t from, uint32_t msec);
+envid_t sys_exofork_shared(void *eip, void *esp, void *xstacktop);
+int sys_net_recv_wait(uint32_t queue);
+int sys_net_recv_page(void *va, struct NetBuf *buf, uint32_t queue);
+int sys_net_transmit_page(const void *packet_data, uint32_t packet_size, uint32_t *ndone);
+int sys_net_recv_batch(struct NetBuf *bufs, size_t n, uint32_t queue);
+int sys_net_transmit_batch(const struct NetBuf *bufs, size_t n, uint32_t *ndone);
+int sys_net_moderate(const struct NetModeration *set, struct NetModeration *old);
+int sys_net_stats(struct NetStats *st);
+int sys_page_paddr(const void *va, size_t npages, physaddr_t *pa);
+int sys_irq_ipc(uint32_t irq, uint32_t value);
+int sys_blk_info(uint32_t disk, struct BlkInfo *info);
+int sys_blk_submit(uint32_t tag, uint32_t secno, const void *buf, size_t nsecs, uint32_t flags);
+int sys_blk_reap(struct BlkDone *done, size_t n);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -77,29 +164,58 @@ sys_exofork(void)
 // ipc.c
 void ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, unsigned npages,
+					   int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, unsigned npages,
+						 int *perm_store, uint32_t msec);
+int32_t ipc_recv_from(envid_t from, void *pg, unsigned npages, int *perm_store,
+					  uint32_t msec);
+int32_t ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+				 void *rcv_pg, int *perm_store);
+void ipc_send_words(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1);
+int32_t ipc_call_words(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+					   envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t ipc_find_env(enum EnvType type);
+envid_t ipc_find_service(const char *name);
 
 // fork.c
-#define    PTE_SHARE    0x400
+extern void (*fork_flush)(void);
 envid_t fork(void);
-envid_t sfork(void);    // Challenge!
+envid_t sfork(void (*fn)(void *), void *arg);
 
 // fd.c
 int close(int fd);
 ssize_t read(int fd, void *buf, size_t nbytes);
 ssize_t write(int fd, const void *buf, size_t nbytes);
 int seek(int fd, off_t offset);
+int fsync(int fd);
 void close_all(void);
 ssize_t readn(int fd, void *buf, size_t nbytes);
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t splice(int fdin, int fdout, size_t len);
 int dup(int oldfd, int newfd);
 int fstat(int fd, struct Stat *statbuf);
 int stat(const char *path, struct Stat *statbuf);
+int fcntl(int fd, int cmd, int arg);
+int poll(struct pollfd *fds, int nfds, int timeout);
 
 // file.c
 int open(const char *path, int mode);
 int ftruncate(int fd, off_t size);
+int fallocate(int fd, off_t offset, off_t len);
 int remove(const char *path);
 int sync(void);
+int drop_caches(void);
+int fs_stats(struct FsStats *st, bool reset);
+ssize_t fsplice(int fdin, int fdout, size_t n);
+ssize_t file_map(int fdnum, off_t offset, size_t n, void *dstva);
+ssize_t readdir(int fdnum, void *buf, size_t n);
+void *mmap(int fdnum, off_t offset, size_t len);
+int munmap(void *addr, size_t len);
 
 // pageref.c
 int pageref(void *addr);
@@ -111,9 +227,21 @@ int shutdown(int s, int how);
 int connect(int s, const struct sockaddr *name, socklen_t namelen);
 int listen(int s, int backlog);
 int socket(int domain, int type, int protocol);
+int sock_poll(struct pollfd *fds, int nfds, int timeout);
+int epoll_create(void);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+ssize_t sendfile(int s, int fd, off_t offset, size_t count);
+ssize_t sendto(int s, const void *buf, size_t len, unsigned int flags,
+			   const struct sockaddr *to, socklen_t tolen);
+ssize_t recvfrom(int s, void *buf, size_t len, unsigned int flags,
+				 struct sockaddr *from, socklen_t *fromlen);
+int sendmmsg(int s, const struct mmsg *msgs, int n, unsigned int flags);
+int recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags);
+int gethostaddr(const char *name, struct in_addr *addr);
 
 // nsipc.c
-int nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen, int flags);
 int nsipc_bind(int s, struct sockaddr *name, socklen_t namelen);
 int nsipc_shutdown(int s, int how);
 int nsipc_close(int s);
@@ -121,7 +249,22 @@ int nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 int nsipc_listen(int s, int backlog);
 int nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int nsipc_send(int s, const void *buf, int size, unsigned int flags);
-int nsipc_socket(int domain, int type, int protocol);
+int nsipc_sendto(int s, const void *buf, int size, unsigned int flags,
+				 const struct sockaddr *to, socklen_t tolen);
+int nsipc_recvfrom(int s, void *mem, int len, unsigned int flags,
+				   struct sockaddr *from, socklen_t *fromlen);
+int nsipc_sendmmsg(int s, const struct mmsg *msgs, int n, unsigned int flags);
+int nsipc_recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags);
+int nsipc_gethostbyname(const char *name, struct in_addr *addr);
+int nsipc_socket(int shard, int domain, int type, int protocol);
+int nsipc_stats(struct Nsret_stats *stats);
+int nsipc_poll(struct Nspollfd *fds, int nfds, int timeout);
+int nsipc_epoll_create(int shard);
+int nsipc_epoll_ctl(int q, int op, int s, uint32_t events, uint32_t data);
+int nsipc_epoll_wait(int q, struct epoll_event *events, int maxevents, int timeout);
+int nsipc_epoll_close(int q);
+ssize_t nsipc_sendfile(int s, int fd, off_t offset, size_t count);
+int nsipc_shard(const struct sockaddr *name, socklen_t namelen, bool connect);
 
 // spawn.c
 envid_t spawn(const char *program, const char **argv);
@@ -140,6 +283,39 @@ int pipeisclosed(int pipefd);
 // wait.c
 void wait(envid_t env);
 
+// time.c
+unsigned int time_msec(void);
+uint64_t time_usec(void);
+
+// ring.c
+int ring_create(struct Ring *r, uint32_t nslots, uint32_t slotsize);
+void ring_set_consumer(struct Ring *r, envid_t consumer, int32_t ipc_value);
+void *ring_reserve(struct Ring *r);
+void *ring_reserve_nth(struct Ring *r, uint32_t n);
+void ring_publish(struct Ring *r);
+void ring_publish_n(struct Ring *r, uint32_t n);
+void *ring_peek(struct Ring *r);
+void *ring_peek_nth(struct Ring *r, uint32_t n);
+void ring_release(struct Ring *r);
+void ring_release_n(struct Ring *r, uint32_t n);
+bool ring_arm(struct Ring *r);
+void ring_wait(struct Ring *r);
+
+// sysring.c
+int sysring_init(struct SysRing *r);
+int sysring_queue(struct SysRing *r, uint32_t syscallno, uint32_t user,
+				  uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+int sysring_enter(struct SysRing *r);
+const struct SysRingResult *sysring_result(struct SysRing *r);
+
+// arena.c
+struct Arena;
+struct Arena *arena_create(size_t size);
+void *arena_alloc(struct Arena *a, size_t n);
+char *arena_strndup(struct Arena *a, const char *s, size_t n);
+void arena_reset(struct Arena *a);
+void arena_destroy(struct Arena *a);
+
 /* File open modes */
 #define    O_RDONLY    0x0000        /* open for reading only */
 #define    O_WRONLY    0x0001        /* open for writing only */
@@ -1,7 +1,24 @@
 #ifndef JOS_INC_MALLOC_H
 #define JOS_INC_MALLOC_H 1
 
+// What the heap holds, for spotting fragmentation: ms_slab_free is the
+// part of the slab pages not handed out.
+struct MallocStats {
+	size_t ms_slab_pages;       // pages holding small objects
+	size_t ms_small;            // small objects in use
+	size_t ms_small_bytes;      // their bytes, rounded up to size classes
+	size_t ms_slab_free;        // bytes of slab pages not in use
+	size_t ms_large;            // large blocks in use
+	size_t ms_large_pages;      // their pages
+	size_t ms_inuse;            // bytes handed out, as rounded up
+	size_t ms_peak;             // most ms_inuse has been
+	size_t ms_failed;           // mallocs that returned 0
+};
+
 void *malloc(size_t size);
 void free(void *addr);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *addr, size_t size);
+void malloc_stats(struct MallocStats *ms);
 
 #endif
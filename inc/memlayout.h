@@ -20,6 +20,11 @@
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
 
+// From GD_TSS0 on, each CPU has two descriptors: its TSS, then the
+// segment over its struct CpuInfo that the kernel keeps in %gs
+#define GD_TSS(i) (GD_TSS0 + 16 * (i))
+#define GD_CPU(i) (GD_TSS0 + 16 * (i) + 8)
+
 /*
  * Virtual memory map:                                Permissions
  *                                                    kernel/user
@@ -43,16 +48,21 @@
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
  *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
  *                     +------------------------------+                   |
- *                     :              .               :
- *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
- *                     |       Memory-mapped I/O      | RW/--  PTSIZE
+ *                     :              .               :               PTSIZE/2
+ *                     +------------------------------+ 0xefe00000      --+
+ *                     |                              |
+ *                     |  Environments (kernel view)  | RW/--  PTSIZE
+ *                     |                              |
+ * MMIOLIM, KENVS -->  +------------------------------+ 0xefa00000
+ *                     |       Memory-mapped I/O      | RW/--  PTSIZE/2
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |        RO KERNEL INFO        | R-/R-  PGSIZE
+ *    UINFO     ---->  +------------------------------+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-  PTSIZE-PGSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -98,10 +108,16 @@
 #define KSTACKTOP    KERNBASE
 #define KSTKSIZE    (8*PGSIZE)        // size of a kernel stack
 #define KSTKGAP        (8*PGSIZE)        // size of a kernel stack guard
+#define KSTKSHIFT   16                // log2(KSTKSIZE + KSTKGAP)
 
 // Memory-mapped IO.
-#define MMIOLIM        (KSTACKTOP - PTSIZE)
-#define MMIOBASE    (MMIOLIM - PTSIZE)
+#define MMIOBASE    (KSTACKTOP - 2 * PTSIZE)
+#define MMIOLIM        (MMIOBASE + PTSIZE / 2)
+
+// The kernel's read-write view of the envs[] mapped at UENVS, from the
+// top of the MMIO page table into the bottom of the kernel stacks' one
+// (see env_grow in kern/env.c)
+#define KENVS        MMIOLIM
 
 #define ULIM        (MMIOBASE)
 
@@ -114,8 +130,11 @@
 #define UVPT        (ULIM - PTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES        (UVPT - PTSIZE)
-// Read-only copies of the global env structures
+// Read-only copies of the global env structures, mapped a page at a
+// time as the table grows
 #define UENVS        (UPAGES - PTSIZE)
+// Read-only kernel info page (see inc/uinfo.h), at the top of UENVS's PT
+#define UINFO        (UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -129,6 +148,25 @@
 // Top of normal user stack
 #define USTACKTOP    (UTOP - 2*PGSIZE)
 
+// Stacks of the threads sfork makes (see lib/fork.c): NTHREADS slots
+// of THREADSLOT bytes, in the page table below the normal stack's.
+// From the bottom, a slot holds the thread's thisenv, two guard pages,
+// its exception stack, another guard page and then its normal stack,
+// up to the top of the slot.
+#define UTHREADTOP    (UTOP - PTSIZE)
+#define UTHREADS    (UTHREADTOP - PTSIZE)
+#define THREADSLOT    (16*PGSIZE)
+#define NTHREADS    (PTSIZE / THREADSLOT)
+// Offsets within a slot
+#define THREAD_XSTACKTOP    (4*PGSIZE)
+#define THREAD_STACK    (5*PGSIZE)
+
+// The shared libjos of a "make SHLIB=1" build, in every environment:
+// its text, read-only pages that all environments share, then its data,
+// private to each (see lib/shlib.ld, which repeats the address).
+#define ULIB        0xE4000000
+#define ULIBTOP        (ULIB + PTSIZE)
+
 // Where user programs generally begin
 #define UTEXT        (2*PTSIZE)
 
@@ -187,6 +225,13 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state (see kern/pmap.c): the order of the free
+	// block this page heads, or -1, and the back link of its free list.
+	int8_t pp_order;
+	// Environments asleep in sys_page_wait on a word in this page.
+	uint8_t pp_waiters;
+	struct PageInfo *pp_prev;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -64,11 +64,18 @@
 #define PTE_D        0x040    // Dirty
 #define PTE_PS        0x080    // Page Size
 #define PTE_G        0x100    // Global
+#define PTE_PAT      0x080    // PAT index bit of a 4K page (PTE_PS in a PDE)
+#define PTE_PAT_PS   0x1000   // ... and of a 4MB page
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL    0xE00    // Available for software use
 
+// Software PTE bits with a meaning shared by the kernel and user
+// library (fork, spawn, sys_fork_cow).
+#define PTE_SHARE    0x400    // Shared with children, never copy-on-write
+#define PTE_COW      0x800    // Copy-on-write
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL    (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,7 +96,10 @@
 #define CR0_CD        0x40000000    // Cache Disable
 #define CR0_PG        0x80000000    // Paging
 
+#define CR4_OSXMMEXCPT 0x00000400    // SIMD floating-point exceptions
+#define CR4_OSFXSR     0x00000200    // fxsave/fxrstor and SSE
 #define CR4_PCE        0x00000100    // Performance counter enable
+#define CR4_PGE        0x00000080    // Page Global Enable
 #define CR4_MCE        0x00000040    // Machine Check Enable
 #define CR4_PSE        0x00000010    // Page Size Extensions
 #define CR4_DE        0x00000008    // Debugging Extensions
@@ -5,13 +5,52 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/syscall.h>
+#include <inc/fd.h>		// O_NONBLOCK, ahead of lwIP's
 #include <lwip/sockets.h>
 
 struct jif_pkt {
 	int jp_len;
+	uint32_t jp_flags;	// NETBUF_* checksum offload bits
 	char jp_data[0];
 };
 
+#define NSIPC_MAXPOLL	32	// Sockets per NSREQ_POLL
+#define NSIPC_MAXEVENTS	256	// Events per NSREQ_EPOLL_WAIT
+#define NSIPC_MAXPAGES	16	// Data pages after a request page
+#define NSIPC_MAXMSGS	64	// Datagrams per NSREQ_SENDMMSG or NSREQ_RECVMMSG
+#define NSIPC_MAXNAME	256	// Host name bytes for NSREQ_GETHOSTBYNAME
+
+// The network server may run as up to NS_MAX_SHARDS shards, each a
+// server of its own with its own lwIP, kept to its own CPU (see
+// net/serv.c).  Each owns the local TCP and UDP ports ns_port_shard
+// gives it: received packets go to the shard that owns their
+// destination port, and a socket lives in the shard that owns its
+// local port.  Shard 0 is the service SERVICE_NS, and shard i > 0 the
+// service SERVICE_NS followed by the digit i.
+#define NS_MAX_SHARDS	4
+
+static inline uint32_t
+ns_port_shard(uint16_t port, uint32_t nshards)
+{
+	return port % nshards;
+}
+
+// Clients name a socket, or an event queue, by its shard and its
+// number in that shard's lwIP.  Requests carry only the number.
+#define NSSOCK_ID(shard, s)	(((shard) << 16) | (s))
+#define NSSOCK_SHARD(id)	((uint32_t) (id) >> 16)
+#define NSSOCK_NUM(id)		((id) & 0xffff)
+
+// One datagram for sendmmsg and recvmmsg: msg_len bytes at msg_buf,
+// sent to or received from msg_addr.  recvmmsg takes msg_len as the
+// room at msg_buf and sets it to the datagram's length.
+struct mmsg {
+	void *msg_buf;
+	size_t msg_len;
+	struct sockaddr_in msg_addr;
+};
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -22,25 +61,57 @@ enum {
 	NSREQ_CLOSE,
 	NSREQ_CONNECT,
 	NSREQ_LISTEN,
-	// Recv returns a Nsret_recv on the request page.
+	// Recv returns a Nsret_recv on the request page.  A recv or send
+	// of more than fits there moves its data in up to NSIPC_MAXPAGES
+	// pages that follow the request page instead.
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Stats returns a Nsret_stats on the request page.
+	NSREQ_STATS,
+	// Poll sets the revents of its Nsreq_poll and returns how many
+	// sockets are ready.
+	NSREQ_POLL,
+	// Event queues (see lwip_evq_*).  Create returns the queue's
+	// number; wait returns a count of Nsret_epoll_wait events.
+	NSREQ_EPOLL_CREATE,
+	NSREQ_EPOLL_CTL,
+	NSREQ_EPOLL_WAIT,
+	NSREQ_EPOLL_CLOSE,
+	// Sendfile's data is in the pages that follow the request page,
+	// which lwIP references rather than copies, so it returns only
+	// once the peer has acknowledged all of it.
+	NSREQ_SENDFILE,
+	// Datagrams.  Sendto and recvfrom move one in the request page;
+	// recvfrom returns a Nsret_recvfrom there.  Sendmmsg and recvmmsg
+	// move up to NSIPC_MAXMSGS packed in the request page (see
+	// Nsreq_mmsg) and return how many they moved.
+	NSREQ_SENDTO,
+	NSREQ_RECVFROM,
+	NSREQ_SENDMMSG,
+	NSREQ_RECVMMSG,
+	// Resolve a host name through lwIP's DNS resolver, which keeps
+	// answers for their TTL.  Returns a Nsret_gethostbyname.
+	NSREQ_GETHOSTBYNAME,
+	// Shards returns how many shards the network server runs as, and
+	// a Nsret_shards.  Only shard 0 answers it, once all are running.
+	NSREQ_SHARDS,
 
-	// The following two messages pass a page containing a struct jif_pkt
+	// Packets themselves travel through shared rings (see net/ns.h).
+	// NSREQ_INPUT carries no page when the input environment sends it
+	// to wake a network server that is waiting for its ring to fill,
+	// and a page holding one struct jif_pkt in page-flip mode.
 	NSREQ_INPUT,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
 	// network server, to the output environment
 	NSREQ_OUTPUT,
-
-	// The following message passes no page
-	NSREQ_TIMER,
 };
 
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
 		socklen_t req_addrlen;
+		int req_flags;		// MSG_DONTWAIT or 0
 	} accept;
 
 	struct Nsret_accept {
@@ -91,12 +162,119 @@ union Nsipc {
 		char req_buf[0];
 	} send;
 
+	struct Nsreq_sendto {
+		int req_s;
+		int req_size;
+		unsigned int req_flags;
+		struct sockaddr req_to;
+		socklen_t req_tolen;	// 0 for the connected peer
+		char req_buf[0];
+	} sendto;
+
+	struct Nsreq_recvfrom {
+		int req_s;
+		int req_len;
+		unsigned int req_flags;
+	} recvfrom;
+
+	struct Nsret_recvfrom {
+		struct sockaddr ret_from;
+		socklen_t ret_fromlen;
+		char ret_buf[0];
+	} recvfromRet;
+
+	// The datagrams' data follows req_msgs[req_nmsgs], each len bytes
+	// after the one before.  For recvmmsg, each len is the room for a
+	// datagram, and the server sets it and addr for each it receives,
+	// leaving the data where the room was.  Only the first recvmmsg
+	// waits; the rest take what has already arrived.
+	struct Nsreq_mmsg {
+		int req_s;
+		unsigned int req_flags;
+		int req_nmsgs;
+		struct Nsmsg {
+			struct sockaddr addr;	// Family 0 for the connected peer
+			int len;
+		} req_msgs[0];
+	} mmsg;
+
+	struct Nsreq_gethostbyname {
+		char req_name[NSIPC_MAXNAME];
+	} gethostbyname;
+
+	struct Nsret_gethostbyname {
+		struct in_addr ret_addr;
+	} gethostbynameRet;
+
 	struct Nsreq_socket {
 		int req_domain;
 		int req_type;
 		int req_protocol;
 	} socket;
 
+	struct Nsret_shards {
+		struct in_addr ret_addr;	// The server's own IP address
+	} shardsRet;
+
+	// The network stack's counters, totals since the server started
+	struct Nsret_stats {
+		struct Nsstats_proto {
+			uint32_t xmit;      // Packets sent
+			uint32_t recv;      // Packets received
+			uint32_t drop;      // Packets dropped
+			uint32_t chkerr;    // Bad checksums
+			uint32_t lenerr;    // Bad lengths
+			uint32_t memerr;    // Out of memory
+			uint32_t rterr;     // No route
+			uint32_t proterr;   // Protocol errors
+			uint32_t err;       // Other errors
+		} ret_link, ret_etharp, ret_ip, ret_icmp, ret_udp, ret_tcp;
+		// Heap bytes in use, the most ever in use, and failed allocations
+		uint32_t ret_mem_used;
+		uint32_t ret_mem_max;
+		uint32_t ret_mem_err;
+	} statsRet;
+
+	// Wait up to req_timeout msec (forever if < 0) for one of the
+	// sockets to be ready for the POLLIN or POLLOUT it asks for.
+	struct Nsreq_poll {
+		int req_nfds;
+		int req_timeout;
+		struct Nspollfd {
+			int s;
+			short events;
+			short revents;
+		} req_fds[NSIPC_MAXPOLL];
+	} poll;
+
+	struct Nsreq_epoll_ctl {
+		int req_q;
+		int req_op;
+		int req_s;
+		uint32_t req_events;
+		uint32_t req_data;
+	} epollCtl;
+
+	struct Nsreq_epoll_wait {
+		int req_q;
+		int req_maxevents;
+		int req_timeout;	// msec; < 0 waits forever
+	} epollWait;
+
+	struct Nsret_epoll_wait {
+		struct lwip_event ret_events[NSIPC_MAXEVENTS];
+	} epollWaitRet;
+
+	struct Nsreq_epoll_close {
+		int req_q;
+	} epollClose;
+
+	struct Nsreq_sendfile {
+		int req_s;
+		int req_offset;		// Where the data starts in the first page
+		int req_size;
+	} sendfile;
+
 	struct jif_pkt pkt;
 
 	// Ensure Nsipc is one page
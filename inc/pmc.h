@@ -0,0 +1,30 @@
+#ifndef JOS_INC_PMC_H
+#define JOS_INC_PMC_H
+
+#include <inc/types.h>
+
+// Counters sys_pmc_set programs at most.  The hardware may have fewer;
+// uinfo.pmc_ncounters says how many (0 without Intel architectural
+// performance monitoring, as under QEMU's emulation).
+#define PMC_MAX		4
+
+// Event select values, as the IA32_PERFEVTSELx MSRs take them.  The
+// low byte is the event and the next the unit mask; the first three
+// are architectural, the dTLB one is the load-miss event of most Intel
+// cores since Nehalem and means something else elsewhere.
+#define PMC_CYCLES		0x003C	// Unhalted core cycles
+#define PMC_INSTRUCTIONS	0x00C0	// Instructions retired
+#define PMC_LLC_MISSES		0x412E	// Last-level cache misses
+#define PMC_DTLB_MISSES		0x0108	// dTLB load misses that walked
+
+// Flags to add to an event select
+#define PMC_USR		0x00010000	// Count in user mode
+#define PMC_OS		0x00020000	// Count in the kernel, for this env
+#define PMC_EDGE	0x00040000	// Count rising edges only
+#define PMC_INV		0x00800000	// Invert the CMASK comparison
+#define PMC_CMASK(n)	((uint32_t) (n) << 24)	// Count cycles with >= n events
+
+// The bits an event select passed to sys_pmc_set may have
+#define PMC_VALID	(0x0000FFFF | PMC_USR | PMC_OS | PMC_EDGE | PMC_INV | PMC_CMASK(0xFF))
+
+#endif /* !JOS_INC_PMC_H */
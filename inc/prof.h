@@ -0,0 +1,31 @@
+#ifndef JOS_INC_PROF_H
+#define JOS_INC_PROF_H
+
+#include <inc/types.h>
+
+// Functions a profile report lists, and how much of a name it keeps,
+// counting the terminating NUL.
+#define PROF_NREPORT	64
+#define PROF_NAMELEN	32
+
+// Time spent in one function.  pe_env is 0 for the kernel; pe_fn and
+// pe_name are 0 and "" for user code without symbols, so all of such an
+// environment's samples add up in one entry.
+struct ProfEntry {
+	uintptr_t pe_fn;		// Start of the function
+	int32_t pe_env;
+	uint32_t pe_samples;
+	char pe_name[PROF_NAMELEN];
+};
+
+// What sys_prof_report fills in: the samples taken since profiling
+// started, by function, most samples first.
+struct ProfReport {
+	uint32_t pr_samples;		// Samples taken
+	uint32_t pr_dropped;		// ... and lost to full buffers
+	uint32_t pr_nfns;		// Functions they fell in; the first
+					// PROF_NREPORT are in pr_fns
+	struct ProfEntry pr_fns[PROF_NREPORT];
+};
+
+#endif /* !JOS_INC_PROF_H */
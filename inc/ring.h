@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// A single-producer, single-consumer ring of fixed-size slots in pages
+// that two environments share (see lib/ring.c).  The first page holds
+// this header and the slots follow it, so a ring of 'nslots' slots of
+// 'slotsize' bytes takes RING_NPAGES(nslots, slotsize) pages.
+//
+// 'head' and 'tail' count slots ever published and ever released; only
+// the producer writes 'head' and only the consumer writes 'tail', each
+// on its own cache line.  The ring is empty when they are equal and
+// full when they are 'nslots' apart, so 'nslots' must be a power of
+// two for the indices to survive wrapping.
+struct Ring {
+	volatile uint32_t head;		// Written by the producer
+	uint8_t r_pad0[60];
+	volatile uint32_t tail;		// Written by the consumer
+	volatile uint32_t waiting;	// Consumer is (about to be) asleep
+	uint8_t r_pad1[56];
+	envid_t consumer;		// Env whose doorbell a publish rings
+	int32_t ipc_value;		// If nonzero, ring by IPC with this value
+	uint32_t nslots;
+	uint32_t slotsize;
+};
+
+#define RING_NPAGES(nslots, slotsize) \
+	(1 + ((nslots) * (slotsize) + PGSIZE - 1) / PGSIZE)
+
+#endif /* !JOS_INC_RING_H */
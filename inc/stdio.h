@@ -1,6 +1,7 @@
 #ifndef JOS_INC_STDIO_H
 #define JOS_INC_STDIO_H
 
+#include <inc/types.h>
 #include <inc/stdarg.h>
 
 #ifndef NULL
@@ -27,6 +28,37 @@ int printf(const char *fmt, ...);
 int fprintf(int fd, const char *fmt, ...);
 int vfprintf(int fd, const char *fmt, va_list);
 
+// lib/stdio.c
+typedef struct FILE FILE;
+
+#define EOF		(-1)
+#define FOPEN_MAX	16	// streams open at once, stdin, stdout and stderr too
+#define STDIO_BUFSIZ	4096	// a stream's default buffer: a page
+
+// setvbuf modes
+#define _IOFBF		1	// fully buffered
+#define _IOLBF		2	// line buffered
+#define _IONBF		3	// unbuffered
+
+extern FILE *stdin, *stdout, *stderr;
+
+FILE *fopen(const char *path, const char *mode);
+FILE *fdopen(int fd, const char *mode);
+int fclose(FILE *f);
+int fflush(FILE *f);
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+size_t fread(void *buf, size_t size, size_t n, FILE *f);
+size_t fwrite(const void *buf, size_t size, size_t n, FILE *f);
+char *fgets(char *s, int size, FILE *f);
+int fgetc(FILE *f);
+int fputc(int c, FILE *f);
+int fputs(const char *s, FILE *f);
+int feof(FILE *f);
+int ferror(FILE *f);
+int fileno(FILE *f);
+int fsprintf(FILE *f, const char *fmt, ...);
+int vfsprintf(FILE *f, const char *fmt, va_list);
+
 // lib/readline.c
 char *readline(const char *prompt);
 
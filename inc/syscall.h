@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,7 +22,214 @@ enum {
 	SYS_time_msec,
 	SYS_try_transmit_packet,
 	SYS_try_recv_packet,
+	SYS_env_set_weight,
+	SYS_env_set_affinity,
+	SYS_fork_cow,
+	SYS_page_map_batch,
+	SYS_time_usec,
+	SYS_ipc_call,
+	SYS_ipc_send,
+	SYS_ipc_reply_wait,
+	SYS_ring_wait,
+	SYS_ring_notify,
+	SYS_net_recv_wait,
+	SYS_net_recv_page,
+	SYS_net_transmit_page,
+	SYS_net_recv_batch,
+	SYS_net_transmit_batch,
+	SYS_net_moderate,
+	SYS_net_stats,
+	SYS_page_paddr,
+	SYS_irq_ipc,
+	SYS_blk_info,
+	SYS_blk_submit,
+	SYS_blk_reap,
+	SYS_page_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_env_wait,
+	SYS_exofork_shared,
+	SYS_page_cow_resolve,
+	SYS_env_set_cow_upcall,
+	SYS_service_register,
+	SYS_trace_read,
+	SYS_prof_ctl,
+	SYS_prof_report,
+	SYS_pmc_set,
+	SYS_sysstat_reset,
+	SYS_sysstat_read,
+	SYS_enter_ring,
+	SYS_notify,
+	SYS_wait_notify,
+	SYS_irq_notify,
+	SYS_ipc_send_words,
+	SYS_ipc_call_words,
+	SYS_ipc_recv_timeout,
+	SYS_sleep,
+	SYS_ipc_recv_from,
+	SYS_reclaim_notify,
+	SYS_shlib_map,
+	SYS_spawn,
+	SYS_cons_read,
+	SYS_ksm,
 	NSYSCALLS
 };
 
+// One operation of a sys_page_map_batch request, covering 'npages'
+// consecutive pages (4MB superpages if perm has PTE_PS).
+struct PageMapOp {
+	uintptr_t srcva;    // PAGEMAP_ALLOC: allocate fresh zeroed pages
+	uintptr_t dstva;
+	uint32_t npages;
+	int perm;           // 0: unmap the pages at dstva instead
+};
+
+#define PAGEMAP_ALLOC    ((uintptr_t) -1)
+
+// A submission and completion ring for sys_enter_ring, on a page of
+// its own.  The environment queues system calls at sq_tail; the kernel
+// runs them from sq_head and posts their results at cq_tail, and the
+// environment takes them from cq_head.  The indices run freely; an
+// entry's slot is its index modulo SYSRING_SIZE.
+#define SYSRING_SIZE    64
+
+struct SysRingEntry {
+	uint32_t sqe_syscall;       // SYS_*
+	uint32_t sqe_arg[5];
+	uint32_t sqe_user;          // Copied to the call's result
+};
+
+struct SysRingResult {
+	uint32_t cqe_user;
+	int32_t cqe_result;         // What the call returned
+};
+
+struct SysRing {
+	volatile uint32_t sq_head;  // Written by the kernel
+	volatile uint32_t sq_tail;  // Written by the environment
+	volatile uint32_t cq_head;  // Written by the environment
+	volatile uint32_t cq_tail;  // Written by the kernel
+	struct SysRingEntry sq[SYSRING_SIZE];
+	struct SysRingResult cq[SYSRING_SIZE];
+};
+
+// One frame of a batched network send or receive.  For
+// sys_net_recv_batch, 'len' is the size of the buffer at 'data' on
+// entry and the length of the frame received into it on return.
+// 'flags' holds NETBUF_TX_* bits from the sender, or NETBUF_RX_* bits
+// from the kernel for a received frame.
+struct NetBuf {
+	uintptr_t data;
+	uint32_t len;
+	uint32_t flags;
+};
+
+// Have the card fill in the TCP or UDP checksum of an IPv4 frame,
+// whose checksum field must hold the sum of the pseudo-header.  A UDP
+// checksum field of 0 (no checksum) is left alone.
+#define NETBUF_TX_L4CSUM	0x1
+// The card verified the frame's IPv4 header checksum.
+#define NETBUF_RX_IPCS_OK	0x2
+// The card verified the frame's TCP or UDP checksum.
+#define NETBUF_RX_L4CS_OK	0x4
+// Have the card cut an IPv4 TCP frame of up to NET_TSO_MAXLEN bytes
+// into segments of NETBUF_TX_MSS(mss) payload bytes each, the last
+// maybe shorter, replicating its headers (TCP segmentation offload).
+// In the header template the IPv4 checksum must be 0 and the TCP
+// checksum field must hold the pseudo-header sum without the length.
+#define NETBUF_TX_TSO		0x8
+#define NETBUF_TX_MSS(mss)	((uint32_t) (mss) << 16)
+#define NETBUF_MSS(flags)	((flags) >> 16)
+
+#define NET_TSO_MAXLEN  65536   // Largest frame to segment, headers included
+
+// Largest IP packet the card sends or receives in one frame.  Above
+// 1500 it takes jumbo frames, which the rest of the network must too.
+#ifndef NET_MTU
+#define NET_MTU         1500
+#endif
+// Largest frame: NET_MTU plus the Ethernet header and a VLAN tag or CRC
+#define NET_MAXFRAME    (NET_MTU + 18)
+
+#define NET_MAXBATCH    32    // Frames per batched network call
+
+// Receive interrupt moderation for sys_net_moderate, in microseconds.
+// The card holds back a receive interrupt until rx_delay_usec pass
+// without another frame, or rx_abs_usec after the first (if nonzero),
+// and never raises two within min_gap_usec of each other.  Zeroes
+// interrupt at once, for the lowest latency.
+struct NetModeration {
+	uint32_t rx_delay_usec;   // At most NET_MOD_DELAY_MAX (RDTR)
+	uint32_t rx_abs_usec;     // At most NET_MOD_DELAY_MAX (RADV)
+	uint32_t min_gap_usec;    // At most NET_MOD_GAP_MAX (ITR)
+};
+
+#define NET_MOD_DELAY_MAX  67107  // 65535 ticks of 1.024us
+#define NET_MOD_GAP_MAX    16776  // 65535 ticks of 256ns
+
+// What sys_net_stats reports.  The card's counters are totals since
+// boot; the ring fields are a snapshot.
+struct NetStats {
+	uint64_t rx_good;         // Frames received intact (GPRC)
+	uint64_t tx_good;         // Frames sent successfully (GPTC)
+	uint64_t tx_total;        // Frames sent, errors or not (TPT)
+	uint32_t rx_missed;       // Frames lost for lack of room (MPC)
+	uint32_t rx_crc_errors;   // Frames with a bad CRC (CRCERRS)
+	uint32_t rx_no_buffers;   // Times the receive ring ran dry (RNBC)
+	uint32_t rx_too_long;     // Frames dropped for spanning descriptors
+	uint32_t tx_queue_full;   // Sends refused with -E_NET_QUEUE_FULL
+	uint32_t tx_ring_size;    // Transmit descriptors
+	uint32_t tx_ring_used;    // ... queued or not yet reclaimed
+	uint32_t tx_pinned;       // ... holding user pages
+	uint32_t rx_queues;       // Receive queues, each rx_ring_size/rx_queues
+	uint32_t rx_ring_size;    // Receive descriptors, over all queues
+	uint32_t rx_ring_used;    // ... holding frames not yet taken
+};
+
+// What sys_ksm reports about same-page merging.  Merging saves
+// ks_pages_sharing - ks_pages_shared pages.
+struct KsmStats {
+	uint32_t ks_enabled;
+	uint32_t ks_pages_shared;   // Frames merged pages share
+	uint32_t ks_pages_sharing;  // Mappings of those frames
+	uint32_t ks_full_scans;     // Passes over every environment
+	uint64_t ks_pages_scanned;  // Pages hashed, ever
+};
+
+// What sys_blk_info reports about a virtio-blk disk.
+struct BlkInfo {
+	uint32_t bi_nsectors;     // Size of the disk, in 512-byte sectors
+	uint32_t bi_irq;          // IRQ raised when a transfer completes
+	uint32_t bi_ndisks;       // How many virtio-blk disks there are
+};
+
+// sys_blk_submit flags: the direction of the transfer, and which
+// virtio-blk disk it is on.
+#define BLK_WRITE             0x1
+#define BLK_DISK(n)           ((n) << 8)
+#define BLK_FLAGS_DISK(flags) ((flags) >> 8)
+
+// A transfer sys_blk_reap reports completed: the tag it was submitted
+// with, and 0 or the error it failed with.
+struct BlkDone {
+	uint32_t bd_tag;
+	int32_t bd_status;
+};
+
+// Notifications (see sys_wait_notify) are the low 31 bits of a word;
+// what each means is up to the environment that takes them.
+#define NOTIFY_MASK           0x7fffffff
+
+// Multi-page IPC.  The upper bits of the 'perm' argument of the IPC
+// system calls carry page counts: how many consecutive pages from
+// srcva to send, and (for sys_ipc_call and sys_ipc_reply_wait) how
+// many consecutive pages at dstva to accept in return.  Leaving them
+// zero means one page, so plain PTE permissions work as before.
+#define IPC_MAXPAGES          64
+#define IPC_SENDPAGES(n)      (((n) - 1) << 16)
+#define IPC_RECVPAGES(n)      (((n) - 1) << 24)
+#define IPC_PERM_SENDPAGES(perm)    ((((perm) >> 16) & 0xff) + 1)
+#define IPC_PERM_RECVPAGES(perm)    ((((perm) >> 24) & 0xff) + 1)
+#define IPC_PERM_PTE          0xffff    // The permission bits proper
+
 #endif /* !JOS_INC_SYSCALL_H */
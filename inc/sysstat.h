@@ -0,0 +1,70 @@
+#ifndef JOS_INC_SYSSTAT_H
+#define JOS_INC_SYSSTAT_H
+
+#include <inc/types.h>
+
+// System call numbers the statistics cover; at least NSYSCALLS.
+#define SYSSTAT_NSYSCALL	80
+
+// Latency histogram buckets.  Bucket 0 counts calls that took under
+// 2^SYSSTAT_SHIFT TSC cycles, bucket i > 0 those that took
+// [2^(SYSSTAT_SHIFT+i-1), 2^(SYSSTAT_SHIFT+i)), and the last bucket
+// everything slower.
+#define SYSSTAT_NBUCKET		20
+#define SYSSTAT_SHIFT		8
+
+// One system call's statistics.  Calls that block and are resumed by
+// some other environment (sys_ipc_recv, sys_yield, ...) never return
+// through the kernel's exit path, so ss_returns and the latencies only
+// count the calls that did.
+struct SysStat {
+	uint32_t ss_calls;		// Times entered
+	uint32_t ss_returns;		// ... and returned from
+	uint64_t ss_cycles;		// Total TSC cycles of those returns
+	uint32_t ss_hist[SYSSTAT_NBUCKET];
+};
+
+// Run queue waits, from becoming runnable to running, are kept in a
+// struct SysStat too: ss_calls counts the times an environment became
+// runnable, and ss_returns, ss_cycles and ss_hist the waits that ended
+// with it running.  Each environment keeps its own in env_runwait.
+
+// What sys_sysstat_read fills in.
+struct SysStatReport {
+	int32_t sr_env;			// Environment counted, or 0 for all
+	uint32_t sr_ncpu;		// CPUs added up
+	struct SysStat sr_calls[SYSSTAT_NSYSCALL];
+	struct SysStat sr_runwait;	// Waits that ended on these CPUs
+};
+
+// Count a latency of cycles in ss.
+static inline void
+sysstat_count(struct SysStat *ss, uint64_t cycles)
+{
+	uint32_t b;
+
+	ss->ss_returns++;
+	ss->ss_cycles += cycles;
+	for (b = 0; b < SYSSTAT_NBUCKET - 1 && cycles >= 1ULL << (SYSSTAT_SHIFT + b); b++)
+		;
+	ss->ss_hist[b]++;
+}
+
+// The upper bound, in TSC cycles, of the bucket holding the 'pct'th
+// percentile of the latencies in ss, or 0 if none were recorded.
+// The last bucket has no bound and reports its lower one.
+static inline uint64_t
+sysstat_percentile(const struct SysStat *ss, uint32_t pct)
+{
+	uint32_t want, seen = 0, i;
+
+	if (ss->ss_returns == 0)
+		return 0;
+	want = ((uint64_t) ss->ss_returns * pct + 99) / 100;
+	for (i = 0; i < SYSSTAT_NBUCKET - 1; i++)
+		if ((seen += ss->ss_hist[i]) >= want)
+			break;
+	return 1ULL << (SYSSTAT_SHIFT + (i < SYSSTAT_NBUCKET - 1 ? i : i - 1));
+}
+
+#endif /* !JOS_INC_SYSSTAT_H */
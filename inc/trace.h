@@ -0,0 +1,32 @@
+#ifndef JOS_INC_TRACE_H
+#define JOS_INC_TRACE_H
+
+#include <inc/types.h>
+
+// Events each CPU's kernel trace ring holds (see kern/trace.c), a
+// power of two.
+#define TRACE_NEVENTS	1024
+
+// Event types, and what their arguments hold.
+enum {
+	TRACE_SYSCALL_ENTER = 1,	// syscall number, a1, a2, a3
+	TRACE_SYSCALL_EXIT,		// syscall number, return value
+	TRACE_SWITCH,			// envid switched to, cycles it waited runnable
+	TRACE_IPC_SEND,			// receiver's envid, value, pages sent, sender's envid
+	TRACE_IPC_RECV,			// dstva, pages asked for, sender or 0
+	TRACE_PGFLT,			// fault va, eip, error code
+	TRACE_IRQ,			// IRQ number
+	TRACE_LOCK_CONTEND,		// lock's address, cycles spent waiting
+};
+
+// One event.  te_env is the environment running on the CPU when it
+// happened, or 0 if none was.
+struct TraceEvent {
+	uint64_t te_tsc;		// TSC value at the event
+	uint16_t te_type;		// TRACE_*
+	uint16_t te_cpu;		// CPU it happened on
+	int32_t te_env;
+	uint32_t te_arg[4];
+};
+
+#endif /* !JOS_INC_TRACE_H */
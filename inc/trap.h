@@ -27,6 +27,14 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48        // system call
+#define T_TLBSHOOT  49        // TLB shootdown IPI
+#define T_WAKEUP    50        // Wake a halted CPU to run queued work
+#define T_MSI       52        // First vector handed out to PCI MSI
+#define NMSI         4        // Number of MSI vectors
+
+// tf_err of a T_SYSCALL trap frame that was entered with sysenter.
+// Such frames return to user mode with sysexit.
+#define TF_SYSENTER  1
 #define T_DEFAULT   500        // catchall
 
 #define IRQ_OFFSET    32    // IRQ 0 corresponds to int IRQ_OFFSET
@@ -0,0 +1,103 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_UINFO_H
+#define JOS_INC_UINFO_H
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/env.h>
+
+// Number of per-CPU slots in the info page; must be at least NCPU.
+#define UINFO_NCPU	32
+
+// Length of a timer tick in microseconds.
+#define UINFO_TICK_USEC	10000
+
+// Slots in the service registry, a power of two, and the longest name
+// it holds, counting the terminating NUL.
+#define UINFO_NSERVICE	64
+#define SERVICE_NAMELEN	16
+
+// Names the kernel registers the file and network servers under.
+#define SERVICE_FS	"fs"
+#define SERVICE_NS	"ns"
+
+// Per-CPU load, updated by each CPU on its own timer interrupts.
+struct UinfoCpu {
+	uint32_t runq_len;		// Runnable environments queued here
+	uint32_t busy_ticks;		// Ticks that found an environment running
+	uint32_t idle_ticks;		// Ticks that found the CPU halted
+	uint32_t steal_ticks;		// Ticks mostly taken by the hypervisor
+};
+
+// A named service (see sys_service_register).  A slot with an empty
+// name has never held one; one with envid 0 held a service that is gone.
+struct UinfoService {
+	char name[SERVICE_NAMELEN];
+	envid_t envid;
+};
+
+// The kernel info page.  The kernel maps one read-only copy of this at
+// UINFO in every environment and rewrites it from the timer interrupt,
+// so user code can tell the time without trapping into the kernel.
+//
+// The clock fields are guarded by 'seq': the kernel makes it odd before
+// writing them and even again afterwards, so a reader that sees the
+// same even value before and after its reads got a consistent snapshot.
+// 'service_seq' guards the service registry the same way.  The registry
+// is a hash table, probed linearly from uinfo_service_hash(name).
+struct Uinfo {
+	volatile uint32_t seq;
+	uint32_t ticks;			// Timer ticks since boot
+	uint64_t tick_tsc;		// TSC value at the last tick
+	uint32_t tsc_khz;		// TSC cycles per millisecond; 0 if unknown
+	uint32_t ncpu;			// Number of CPUs in the system
+	uint32_t nenv;			// Slots of envs[] mapped, never shrinks
+	uint32_t pmc_ncounters;		// Counters sys_pmc_set can program
+	uint32_t pmc_width;		// ... and their width in bits
+	struct UinfoCpu cpus[UINFO_NCPU];
+	volatile uint32_t service_seq;
+	struct UinfoService services[UINFO_NSERVICE];
+};
+
+// The registry slot to start looking for 'name' in.
+static inline uint32_t
+uinfo_service_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h & (UINFO_NSERVICE - 1);
+}
+
+// Microseconds since boot according to 'ui'.  The TSC interpolates
+// between timer ticks, clamped so that the result never runs ahead of
+// the next tick; without a calibrated TSC this is tick resolution.
+static inline uint64_t
+uinfo_usec(const volatile struct Uinfo *ui)
+{
+	uint32_t seq, ticks;
+	uint64_t tick_tsc, delta;
+
+	do
+	{
+		while ((seq = ui->seq) & 1)
+			;
+		barrier();
+		ticks = ui->ticks;
+		tick_tsc = ui->tick_tsc;
+		barrier();
+	} while (ui->seq != seq);
+
+	delta = 0;
+	if (ui->tsc_khz != 0)
+	{
+		delta = (read_tsc() - tick_tsc) * 1000 / ui->tsc_khz;
+		if (delta >= UINFO_TICK_USEC)
+			delta = UINFO_TICK_USEC - 1;
+	}
+	return (uint64_t) ticks * UINFO_TICK_USEC + delta;
+}
+
+#endif /* !JOS_INC_UINFO_H */
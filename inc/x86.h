@@ -223,6 +223,13 @@ read_esp(void)
 	return esp;
 }
 
+// Feature bits in CPUID.1:EDX
+#define CPUID_PSE    (1 << 3)     // 4MB pages
+#define CPUID_SEP    (1 << 11)    // sysenter/sysexit
+#define CPUID_PGE    (1 << 13)    // Global pages
+#define CPUID_PAT    (1 << 16)    // Page Attribute Table
+#define CPUID_SSE2   (1 << 26)    // SSE2, movnti among it
+
 static inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
@@ -240,6 +247,30 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+// Read performance counter i; user code may do this only while the
+// kernel has set CR4.PCE (see kern/pmc.c)
+static inline uint64_t
+read_pmc(uint32_t i)
+{
+	uint64_t val;
+	asm volatile("rdpmc" : "=A" (val) : "c" (i));
+	return val;
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -261,4 +292,57 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add val to *addr and return the previous value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t val)
+{
+	asm volatile("lock; xaddl %0, %1"
+	: "+r" (val), "+m" (*addr)
+	:
+	: "memory", "cc");
+	return val;
+}
+
+// Atomically store newval to *addr if it still holds oldval.
+// Returns the value *addr held before the operation.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+	: "=a" (result), "+m" (*addr)
+	: "r" (newval), "0" (oldval)
+	: "memory", "cc");
+	return result;
+}
+
+// Keep the compiler from moving memory accesses across this point.
+// x86 does not reorder stores with other stores or loads with other
+// loads, so this is all a single-writer sequence counter needs.
+static inline void
+barrier(void)
+{
+	asm volatile("" : : : "memory");
+}
+
+// Full memory fence.  Unlike barrier(), this also keeps a store from
+// being passed by a later load, which is what a "publish, then check
+// whether anyone is asleep" handshake needs.
+static inline void
+mfence(void)
+{
+	asm volatile("mfence" : : : "memory");
+}
+
+// Index of the lowest set bit of x, which must not be 0.
+static inline uint32_t
+bsf(uint32_t x)
+{
+	uint32_t index;
+
+	asm("bsfl %1, %0" : "=r" (index) : "rm" (x) : "cc");
+	return index;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -6,12 +6,19 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 
+#include <inc/error.h>
+
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/sched.h>
 
 static void cons_intr(int (*proc)(void));
+static void cons_line_intr(void);
 static void cons_putc(int c);
+static void cga_move_cursor(void);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -33,8 +40,13 @@ delay(void)
 #define COM_DLM        1    // Out: Divisor Latch High (DLAB=1)
 #define COM_IER        1    // Out: Interrupt Enable Register
 #define   COM_IER_RDI    0x01    //   Enable receiver data interrupt
+#define   COM_IER_TBEI    0x02    //   Enable transmitter empty interrupt
 #define COM_IIR        2    // In:	Interrupt ID Register
+#define   COM_IIR_FIFO    0xC0    //   FIFOs enabled (16550A)
 #define COM_FCR        2    // Out: FIFO Control Register
+#define   COM_FCR_ENABLE    0x01    //   Enable the FIFOs
+#define   COM_FCR_CLEAR    0x06    //   Clear both of them
+#define   COM_FCR_TRIG8    0x80    //   Interrupt at 8 bytes received
 #define COM_LCR        3    // Out: Line Control Register
 #define      COM_LCR_DLAB    0x80    //   Divisor latch access bit
 #define      COM_LCR_WLEN8    0x03    //   Wordlength: 8 bits
@@ -49,6 +61,35 @@ delay(void)
 
 static bool serial_exists;
 
+// Output waiting for the serial port.  Once cons_start_async has been
+// called, cputchar and cons_write queue bytes here and return; the
+// transmitter-empty interrupt refills the UART's FIFO from it,
+// serial_fifo bytes at a time, as does cons_getc when it polls.  Before
+// that, and after a panic, output is polled out a byte at a time,
+// behind whatever is queued, so nothing is reordered.  rpos and wpos
+// run freely; serial_lock protects them and the UART's transmit side.
+#define SERIAL_OUTSIZE 4096
+static struct {
+	uint8_t buf[SERIAL_OUTSIZE];
+	uint32_t rpos;
+	uint32_t wpos;
+} serial_out;
+static unsigned serial_fifo = 1;
+static bool serial_async;
+static struct spinlock serial_lock = SPINLOCK_INIT(serial_lock);
+
+// Once the kernel has panicked, a CPU may have died holding the lock
+static bool
+serial_lock_acquire(void)
+{
+	extern const char *panicstr;
+
+	if (panicstr)
+		return false;
+	spin_lock(&serial_lock);
+	return true;
+}
+
 static int
 serial_proc_data(void)
 {
@@ -57,31 +98,95 @@ serial_proc_data(void)
 	return inb(COM1 + COM_RX);
 }
 
+// If the transmitter is empty, refill its FIFO from serial_out.
+// Called with serial_lock held.
+static void
+serial_tx_fill(void)
+{
+	unsigned i;
+
+	if (!(inb(COM1 + COM_LSR) & COM_LSR_TXRDY))
+		return;
+	for (i = 0; i < serial_fifo && serial_out.rpos != serial_out.wpos; i++)
+		outb(COM1 + COM_TX, serial_out.buf[serial_out.rpos++ % SERIAL_OUTSIZE]);
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	bool locked;
+
+	if (!serial_exists)
+		return;
+	cons_intr(serial_proc_data);
+	locked = serial_lock_acquire();
+	serial_tx_fill();
+	// Acknowledge a transmitter-empty interrupt that found nothing to send
+	(void) inb(COM1 + COM_IIR);
+	if (locked)
+		spin_unlock(&serial_lock);
 }
 
+// Send c, after everything queued, waiting for the port.
+// Called with serial_lock held.
 static void
-serial_putc(int c)
+serial_putc_sync(int c)
 {
 	int i;
 
-	for (i = 0;
-		 !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
-		 i++)
-		delay();
+	do
+	{
+		for (i = 0;
+			 !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
+			 i++)
+			delay();
+		if (serial_out.rpos == serial_out.wpos)
+			break;
+		outb(COM1 + COM_TX, serial_out.buf[serial_out.rpos++ % SERIAL_OUTSIZE]);
+	} while (1);
 
 	outb(COM1 + COM_TX, c);
 }
 
+// Queue c for the serial port, waiting only if the queue is full.
+// Called with serial_lock held.
+static void
+serial_putc_async(int c)
+{
+	if (serial_out.wpos - serial_out.rpos == SERIAL_OUTSIZE)
+		serial_putc_sync(serial_out.buf[serial_out.rpos++ % SERIAL_OUTSIZE]);
+	serial_out.buf[serial_out.wpos++ % SERIAL_OUTSIZE] = c;
+}
+
+static void
+serial_putc(int c)
+{
+	bool locked;
+
+	if (!serial_exists)
+		return;
+	locked = serial_lock_acquire();
+	if (serial_async && locked)
+	{
+		serial_putc_async(c);
+		serial_tx_fill();
+	} else
+		serial_putc_sync(c);
+	if (locked)
+		spin_unlock(&serial_lock);
+}
+
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1 + COM_FCR, 0);
+	// Turn on the FIFOs.  Only a 16550A's work, and then it takes 16
+	// bytes to send at a go, and interrupts once 8 have come in (or the
+	// line has been idle for 4 characters' time).
+	outb(COM1 + COM_FCR, COM_FCR_ENABLE | COM_FCR_CLEAR | COM_FCR_TRIG8);
+	if ((inb(COM1 + COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO)
+		serial_fifo = 16;
+	else
+		outb(COM1 + COM_FCR, 0);
 
 	// Set speed; requires DLAB latch
 	outb(COM1 + COM_LCR, COM_LCR_DLAB);
@@ -93,8 +198,8 @@ serial_init(void)
 
 	// No modem controls
 	outb(COM1 + COM_MCR, 0);
-	// Enable rcv interrupts
-	outb(COM1 + COM_IER, COM_IER_RDI);
+	// Enable rcv and xmit interrupts
+	outb(COM1 + COM_IER, COM_IER_RDI | COM_IER_TBEI);
 
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
@@ -104,7 +209,7 @@ serial_init(void)
 
 	// Enable serial interrupts
 	if (serial_exists)
-		irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_SERIAL));
+		irq_enable(IRQ_SERIAL);
 }
 
 
@@ -128,9 +233,19 @@ lpt_putc(int c)
 
 /***** Text-mode CGA/VGA display output *****/
 
+// The screen is a window of CRT_SIZE cells onto the video memory,
+// starting at crt_start, which the 6845's start address register tells
+// it.  Scrolling moves the window down a line, until it reaches the end
+// of the memory and the screen's contents are copied back to its start.
+// A monochrome adapter's memory holds only one screen, so it copies on
+// every scroll.  crt_pos, like the cursor register, counts from the
+// start of the memory.
 static unsigned addr_6845;
 static uint16_t *crt_buf;
 static uint16_t crt_pos;
+static uint16_t crt_start;
+static uint16_t crt_shown_start;	// what the start register holds
+static uint16_t crt_cells;		// size of the video memory in cells
 
 static void
 cga_init(void)
@@ -146,10 +261,12 @@ cga_init(void)
 	{
 		cp = (uint16_t *) (KERNBASE + MONO_BUF);
 		addr_6845 = MONO_BASE;
+		crt_cells = MONO_CELLS;
 	} else
 	{
 		*cp = was;
 		addr_6845 = CGA_BASE;
+		crt_cells = CGA_CELLS;
 	}
 
 	/* Extract cursor location */
@@ -159,7 +276,13 @@ cga_init(void)
 	pos |= inb(addr_6845 + 1);
 
 	crt_buf = (uint16_t *) cp;
-	crt_pos = pos;
+	crt_pos = MIN(pos, CRT_SIZE - 1);
+
+	/* show the screen from the start of memory, as the BIOS does */
+	outb(addr_6845, 12);
+	outb(addr_6845 + 1, 0);
+	outb(addr_6845, 13);
+	outb(addr_6845 + 1, 0);
 }
 
 
@@ -173,7 +296,7 @@ cga_putc(int c)
 	switch (c & 0xff)
 	{
 		case '\b':
-			if (crt_pos > 0)
+			if (crt_pos > crt_start)
 			{
 				crt_pos--;
 				crt_buf[crt_pos] = (c & ~0xff) | ' ';
@@ -197,18 +320,38 @@ cga_putc(int c)
 			break;
 	}
 
-	// What is the purpose of this?
-	if (crt_pos >= CRT_SIZE)
+	// Scroll when the cursor runs off the bottom of the screen
+	if (crt_pos >= crt_start + CRT_SIZE)
 	{
 		int i;
 
-		memmove(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
-		for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
+		if (crt_start + CRT_SIZE + CRT_COLS <= crt_cells)
+			crt_start += CRT_COLS;
+		else
+		{
+			memmove(crt_buf, crt_buf + crt_start + CRT_COLS,
+					(CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
+			crt_pos -= crt_start + CRT_COLS;
+			crt_start = 0;
+		}
+		for (i = crt_start + CRT_SIZE - CRT_COLS; i < crt_start + CRT_SIZE; i++)
 			crt_buf[i] = 0x0700 | ' ';
-		crt_pos -= CRT_COLS;
 	}
+}
 
-	/* move that little blinky thing */
+/* move that little blinky thing, and the screen if it has scrolled:
+ * once per write, as it takes four outbs each */
+static void
+cga_move_cursor(void)
+{
+	if (crt_start != crt_shown_start)
+	{
+		outb(addr_6845, 12);
+		outb(addr_6845 + 1, crt_start >> 8);
+		outb(addr_6845, 13);
+		outb(addr_6845 + 1, crt_start);
+		crt_shown_start = crt_start;
+	}
 	outb(addr_6845, 14);
 	outb(addr_6845 + 1, crt_pos >> 8);
 	outb(addr_6845, 15);
@@ -387,7 +530,7 @@ kbd_init(void)
 {
 	// Drain the kbd buffer so that QEMU generates interrupts.
 	kbd_intr();
-	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_KBD));
+	irq_enable(IRQ_KBD);
 }
 
 
@@ -420,14 +563,27 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	cons_line_intr();
+}
+
+// Take the next character from the input buffer, or 0 if it is empty.
+static int
+cons_buf_getc(void)
+{
+	int c;
+
+	if (cons.rpos == cons.wpos)
+		return 0;
+	c = cons.buf[cons.rpos++];
+	if (cons.rpos == CONSBUFSIZE)
+		cons.rpos = 0;
+	return c;
 }
 
 // return the next input character from the console, or 0 if none waiting
 int
 cons_getc(void)
 {
-	int c;
-
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
@@ -435,14 +591,131 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
-	if (cons.rpos != cons.wpos)
+	return cons_buf_getc();
+}
+
+/***** Cooked console input *****/
+// The line discipline behind sys_cons_read.  Characters are taken from
+// the input buffer and edited into cons_line, echoing as they go:
+// backspace takes back the last one, and a newline, carriage return
+// or ctl-d finishes the line.  Readers then take the finished line,
+// which ends in a newline unless ctl-d finished it; a ctl-d alone
+// reads as end of file.  Input is only edited while it is being read,
+// so that typed-ahead characters wait in the input buffer, unechoed,
+// and the monitor and sys_cgetc see raw input otherwise.  Protected by
+// the big kernel lock.  A line holds at most CONS_LINESIZE - 1 bytes,
+// newline included, so that it fits readline's buffer.
+#define CONS_LINESIZE 1024
+
+static struct {
+	char buf[CONS_LINESIZE];
+	uint32_t len;        // Bytes in the line so far
+	uint32_t rpos;       // Bytes of a finished line already read
+	bool done;           // Finished: no more editing until it is read
+	uint32_t nreaders;   // Environments asleep in cons_read_sleep
+} cons_line;
+
+static void
+cons_echo(char c)
+{
+	cputs_async(&c, 1);
+}
+
+// Edit the characters waiting in the input buffer into cons_line,
+// until it is finished.
+static void
+cons_cook(void)
+{
+	int c;
+
+	while (!cons_line.done && (c = cons_buf_getc()) != 0)
+	{
+		if (c == '\b' || c == '\x7f')
+		{
+			if (cons_line.len > 0)
+			{
+				cons_line.len--;
+				cons_echo('\b');
+			}
+		} else if (c == '\n' || c == '\r')
+		{
+			cons_line.buf[cons_line.len++] = '\n';
+			cons_echo('\n');
+			cons_line.done = true;
+		} else if (c == 0x04)    // ctl-d
+			cons_line.done = true;
+		else if (c >= ' ' && cons_line.len < CONS_LINESIZE - 2)
+		{
+			cons_line.buf[cons_line.len++] = c;
+			cons_echo(c);
+		}
+	}
+}
+
+// Copy up to n bytes of the finished line to buf.  A read of 0 bytes
+// only asks whether a line is finished.
+// Returns the number of bytes copied, 0 at end of file, or
+// -E_WOULD_BLOCK if no line is finished yet.
+int
+cons_read(char *buf, size_t n)
+{
+	cons_cook();
+	if (!cons_line.done)
+		return -E_WOULD_BLOCK;
+	if (n == 0)
+		return 0;
+	n = MIN(n, cons_line.len - cons_line.rpos);
+	memmove(buf, cons_line.buf + cons_line.rpos, n);
+	cons_line.rpos += n;
+	if (cons_line.rpos == cons_line.len)
+	{
+		cons_line.len = cons_line.rpos = 0;
+		cons_line.done = false;
+	}
+	return n;
+}
+
+// Put curenv to sleep until a line is finished, when it returns
+// -E_WOULD_BLOCK to read again.
+void
+cons_read_sleep(void)
+{
+	curenv->env_cons_reading = true;
+	cons_line.nreaders++;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = -E_WOULD_BLOCK;
+	sched_yield();
+}
+
+// Called when e is freed: stop waiting for a line.
+void
+cons_env_free(struct Env *e)
+{
+	if (e->env_cons_reading)
 	{
-		c = cons.buf[cons.rpos++];
-		if (cons.rpos == CONSBUFSIZE)
-			cons.rpos = 0;
-		return c;
+		e->env_cons_reading = false;
+		cons_line.nreaders--;
 	}
-	return 0;
+}
+
+// New input has arrived: if anyone is waiting for a line, edit it in,
+// and wake them all once it is finished.
+static void
+cons_line_intr(void)
+{
+	struct Env *e;
+
+	if (cons_line.nreaders == 0)
+		return;
+	cons_cook();
+	if (!cons_line.done)
+		return;
+	for (e = envs; e < envs + nenv && cons_line.nreaders > 0; e++)
+		if (e->env_cons_reading)
+		{
+			cons_env_free(e);
+			sched_enqueue(e);
+		}
 }
 
 // output a character to the console
@@ -452,6 +725,42 @@ cons_putc(int c)
 	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
+	cga_move_cursor();
+}
+
+// Queue serial output from now on, rather than polling it out; called
+// once the kernel is about to run environments, whose user-mode time
+// and idle hlts take the interrupts that drain the queue.
+void
+cons_start_async(void)
+{
+	serial_async = true;
+}
+
+// Write the len bytes at s to the console without waiting for the
+// serial port, for sys_cputs.  The display and parallel port have no
+// interrupt to drain a queue and are written at once.
+void
+cons_write(const char *s, size_t len)
+{
+	bool locked;
+	size_t i;
+
+	if (serial_exists)
+	{
+		locked = serial_lock_acquire();
+		for (i = 0; i < len; i++)
+			serial_putc_async(s[i]);
+		serial_tx_fill();
+		if (locked)
+			spin_unlock(&serial_lock);
+	}
+	for (i = 0; i < len; i++)
+	{
+		lpt_putc(s[i]);
+		cga_putc(s[i]);
+	}
+	cga_move_cursor();
 }
 
 // initialize the console devices
@@ -7,11 +7,14 @@
 #endif
 
 #include <inc/types.h>
+#include <inc/env.h>
 
 #define MONO_BASE    0x3B4
 #define MONO_BUF    0xB0000
 #define CGA_BASE    0x3D4
 #define CGA_BUF        0xB8000
+#define MONO_CELLS    2048    // video memory, in 16-bit character cells
+#define CGA_CELLS    8192
 
 #define CRT_ROWS    25
 #define CRT_COLS    80
@@ -19,6 +22,13 @@
 
 void cons_init(void);
 int cons_getc(void);
+int cons_read(char *buf, size_t n);
+void cons_read_sleep(void) __attribute__((noreturn));
+void cons_write(const char *s, size_t len);
+void cons_start_async(void);
+void cputs_async(const char *s, size_t len);
+
+void cons_env_free(struct Env *e);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
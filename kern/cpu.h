@@ -6,9 +6,15 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
+#include <kern/percpu.h>
 
-// Maximum number of CPUs
-#define NCPU  8
+// Maximum number of CPUs: at most 32, since env_cpumask has a bit for
+// each, and as many as KSTACKTOP has stack slots for above KENVS
+#define NCPU  32
+
+// Pending invalidations a CPU queues before falling back to a full flush
+#define TLB_BATCH  16
 
 // Values of status in struct Cpu
 enum {
@@ -19,10 +25,53 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
-	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
+	// These two stay first: kern/percpu.h reads them through %gs
+	struct CpuInfo *cpu_self;       // This struct (see thiscpu)
+	uint32_t cpu_id;                // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct Env *cpu_fpu_env;        // Env whose FPU registers are loaded (kern/fpu.c)
+	struct Env *cpu_pmc_env;        // Env whose counters are loaded (kern/pmc.c)
+
+	// Run queue of ENV_RUNNABLE environments (see kern/sched.c)
+	struct Env *cpu_runq_head;
+	struct Env *cpu_runq_tail;
+	unsigned cpu_runq_len;
+	unsigned cpu_sched_ticks;       // Timer ticks seen, for load balancing
+	uint64_t cpu_sched_pass;        // Pass of the last environment picked
+
+	// Magazine of free pages owned by this CPU (see kern/pmap.c)
+	struct spinlock cpu_pgcache_lock;
+	struct PageInfo *cpu_pgcache;
+	unsigned cpu_pgcache_len;
+
+	// TLB shootdown requests from other CPUs (see kern/pmap.c)
+	struct spinlock cpu_tlb_lock;
+	uintptr_t cpu_tlb_va[TLB_BATCH];
+	unsigned cpu_tlb_nva;           // > TLB_BATCH means flush everything
+	volatile uint32_t cpu_tlb_req;  // Requests made of this CPU
+	volatile uint32_t cpu_tlb_ack;  // Requests this CPU has carried out
+	volatile uint32_t cpu_in_kernel;// Entered the kernel from user mode
+
+	// Tickless idle (see kern/sched.c)
+	bool cpu_tickless;              // Timer stopped while halted
+	uint64_t cpu_halt_tsc;          // TSC when the timer was stopped
+	bool cpu_mwait;                 // Halted in mwait on cpu_wake, not hlt
+	volatile uint32_t cpu_wake;     // Set by sched_kick to end the mwait
+
+	// CPU time accounting (see env_charge_user in kern/env.c)
+	uint64_t cpu_acct_tsc;          // When curenv was last charged
+	bool cpu_preempting;            // The timer is rescheduling curenv
+
+	// Event trace ring (see kern/trace.c)
+	struct TraceEvent *cpu_trace;
+	volatile uint32_t cpu_trace_head;  // Events ever logged
+
+	// System call statistics (see kern/sysstat.c)
+	struct SysStat *cpu_sysstat;
+	uint64_t cpu_sysstat_tsc;       // When the call being counted entered
+	struct SysStat cpu_runwait;     // Run queue waits ended here
 };
 
 // Initialized in mpconfig.c
@@ -31,16 +80,17 @@ extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 
-// Per-CPU kernel stacks
-extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
-
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// The current CPU's struct CpuInfo, through %gs (see kern/percpu.h)
+#define thiscpu ((struct CpuInfo *) percpu_read(PERCPU_SELF))
 
 void mp_init(void);
 void lapic_init(void);
-void lapic_startap(uint8_t apicid, uint32_t addr);
+int lapic_id(void);
+void lapic_startaps(uint32_t addr);
 void lapic_eoi(void);
+void lapic_ipi_cpu(int apicid, int vector);
 void lapic_ipi(int vector);
+void lapic_timer_start(void);
+void lapic_timer_stop(void);
 
 #endif
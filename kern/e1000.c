@@ -2,35 +2,181 @@
 #include <kern/pmap.h>
 #include <inc/string.h>
 #include <inc/error.h>
+#include <inc/trap.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
+#include <kern/sched.h>
+#include <kern/pcireg.h>
+#include <kern/cpu.h>
 
 static volatile uint32_t *e1000_dma_io = NULL;
 
-struct tx_buffer {
-	char data[E1000_TX_BUFFER_SIZE];
+// The transmit ring and each receive queue are driven independently,
+// so each has its own lock; the NS output and input helpers never
+// contend.
+static struct spinlock e1000_tx_lock = SPINLOCK_INIT(e1000_tx_lock);
+
+// Ring sizes in descriptors, fixed by e1000_pci_attach; every receive
+// queue has rx_count
+static uint32_t tx_count, rx_count;
+
+// Transmit: a descriptor normally points at its tx_buffer(), but one
+// posted by e1000_transmit_pages points straight at a user page, which
+// tx_pages[] keeps referenced until the card has sent it.  A frame
+// spanning several pages takes a descriptor for each, and only the
+// last of them names the frame's owner in tx_owners[].  Unpinning
+// takes the kernel lock (see e1000_tx_reclaim), so the lock-free copy
+// path must leave the ring alone while any page is pinned.
+// All of these are arrays of tx_count entries.
+static union e1000_tx_desc *tx_descriptor_ring;
+static char *tx_buffers;
+static struct PageInfo **tx_pages;
+static envid_t *tx_owners;
+static volatile uint32_t tx_npinned;
+
+// Checksum offload: a frame sent with NETBUF_TX_L4CSUM goes out in an
+// extended data descriptor, which has the card checksum it as its last
+// context descriptor says.  Consecutive frames of one protocol share a
+// context, so a context descriptor is only queued (taking a ring slot
+// of its own) when the offsets change.  tx_context holds the current
+// ones as TX_CONTEXT(tucss, tucso), or 0 before the first.
+#define TX_CONTEXT(tucss, tucso) ((tucss) << 8 | (tucso))
+static uint16_t tx_context;
+
+// What the checksum and segmentation offloads need to know about the
+// headers
+#define ETH_HDR_LEN     14
+#define IP_HDR_MINLEN   20
+#define IP_CSUM_OFFSET  10
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define TCP_HDR_MINLEN  20
+#define TCP_CSUM_OFFSET 16
+#define UDP_CSUM_OFFSET 6
+
+// Receive: each descriptor DMAs into its own page, at
+// E1000_RX_PAGE_OFFSET, so that e1000_recv_page can hand the page
+// itself to an environment instead of copying the frame out.  With
+// jumbo frames a descriptor instead owns a block of 2^rx_order pages.
+// The driver holds one reference to every page on the ring.
+//
+// The 82574 has E1000_MAX_RXQ receive queues and spreads flows over
+// them by a hash of their addresses and ports (RSS), so that an input
+// environment on each CPU can serve one.  RSS needs the extended
+// descriptor layout, which rx_extended says the card writes back.
+struct e1000_rxq {
+	struct spinlock lock;
+	union e1000_rx_desc *ring;	// rx_count descriptors
+	struct PageInfo **pages;	// The buffer of each descriptor
+	uint32_t rdt;			// Index of the queue's RDT register
+	uint32_t tail;			// Software copy of RDT, so that
+					// receiving never reads the card
+	bool discard;			// Dropping the rest of a frame too long
+					// for one buffer (see rx_skip_partial)
+	uint32_t too_long;		// Frames dropped for that
+	envid_t waiter;			// Asleep in e1000_recv_wait; protected
+					// by the big kernel lock
 };
-struct rx_buffer {
-	char data[E1000_RX_BUFFER_SIZE];
+static struct e1000_rxq rxqs[E1000_MAX_RXQ];
+static uint32_t nrxq;
+static bool rx_extended;
+static int rx_order;
+
+// Receive interrupts are only unmasked while an environment is asleep
+// in e1000_recv_wait; the first one wakes it and masks them again, so
+// a busy receiver that keeps finding packets takes no interrupts.
+// The card's moderation timers (see e1000_moderate) let a burst build
+// up before that interrupt, so the receiver wakes to a batch.
+// The card raises a message interrupt on e1000_vector when it has MSI,
+// and otherwise falls back to its INTx line, IRQ e1000_irq.
+// All of these are protected by the big kernel lock.
+static uint8_t e1000_irq;
+static uint8_t e1000_vector;
+static struct pci_func e1000_pcif;	// For retargeting its messages
+static struct pci_bus e1000_bus;
+static struct NetModeration e1000_moderation = {
+	E1000_RX_DELAY_USEC, E1000_RX_ABS_USEC, E1000_MIN_GAP_USEC
 };
 
-// Transmit:
-union e1000_tx_desc tx_descriptor_ring[E1000_TX_DESCRIPTORS_COUNT];
-struct tx_buffer tx_buffers[E1000_TX_DESCRIPTORS_COUNT];
+// Software copy of TDT, kept under e1000_tx_lock, so that sending
+// never reads the card's registers.
+static uint32_t tx_tail;
 
-// Receive:
-struct e1000_rx_desc receive_descriptor_ring[E1000_RX_DESCRIPTORS_COUNT];
-struct rx_buffer receive_buffers[E1000_RX_DESCRIPTORS_COUNT];
+// Totals of the card's clear-on-read statistics registers, and the
+// driver's own count of refused sends (see struct NetStats).  The
+// totals are protected by the big kernel lock, tx_queue_full by
+// e1000_tx_lock.
+static struct NetStats e1000_totals;
+static uint32_t tx_queue_full;
+
+// The buddy order of the smallest block of pages holding 'size' bytes
+static int
+e1000_size_order(size_t size)
+{
+	int order = 0;
+
+	while ((size_t) PGSIZE << order < size)
+		order++;
+	return order;
+}
+
+// Allocate 'size' zeroed bytes of physically contiguous memory that
+// the driver keeps for good, or panic.
+static void *
+e1000_alloc(size_t size, const char *what)
+{
+	int order = e1000_size_order(size);
+	struct PageInfo *pp;
+
+	if ((pp = page_alloc_order(order, ALLOC_ZERO)) == NULL)
+		panic("e1000: out of memory for %s", what);
+	for (int i = 0; i < (1 << order); i++)
+		pp[i].pp_ref++;
+	return page2kva(pp);
+}
+
+// Allocate a ring of 'ntx' transmit descriptors and 'nrxq' queues of
+// 'nrx' receive descriptors, along with what the driver keeps for each
+// descriptor.
+static void
+e1000_alloc_rings(uint32_t ntx, uint32_t nrx, uint32_t nq)
+{
+	tx_count = ntx;
+	tx_descriptor_ring = e1000_alloc(ntx * sizeof(*tx_descriptor_ring), "the transmit ring");
+	tx_buffers = e1000_alloc(ntx * E1000_TX_BUFFER_SIZE, "transmit buffers");
+	tx_pages = e1000_alloc(ntx * sizeof(*tx_pages), "the transmit ring");
+	tx_owners = e1000_alloc(ntx * sizeof(*tx_owners), "the transmit ring");
+
+	rx_count = nrx;
+	nrxq = nq;
+	for (struct e1000_rxq *q = rxqs; q < rxqs + nq; q++)
+	{
+		spin_initlock(&q->lock);
+		q->ring = e1000_alloc(nrx * sizeof(*q->ring), "a receive ring");
+		q->pages = e1000_alloc(nrx * sizeof(*q->pages), "a receive ring");
+	}
+	rx_order = e1000_size_order(E1000_RX_BUFFER_OFFSET + E1000_RX_BUFFER_SIZE);
+}
+
+// The copy buffer of transmit descriptor 'i'
+static void *
+tx_buffer(uint32_t i)
+{
+	return tx_buffers + i * E1000_TX_BUFFER_SIZE;
+}
 
 static void e1000_init_transmit_ring()
 {
 	// Set base address and size of descriptor ring
 	e1000_dma_io[E1000_TDBAL] = PADDR((void *) tx_descriptor_ring);
 	e1000_dma_io[E1000_TDBAH] = 0;
-	e1000_dma_io[E1000_TDLEN] = sizeof(tx_descriptor_ring);
+	e1000_dma_io[E1000_TDLEN] = tx_count * sizeof(*tx_descriptor_ring);
 
 	// Initialize ring
-	for (int i = 0; i < E1000_TX_DESCRIPTORS_COUNT; ++i)
+	for (uint32_t i = 0; i < tx_count; ++i)
 	{
-		tx_descriptor_ring[i].fields.buffer_addr = PADDR((void *) &tx_buffers[i]);
+		tx_descriptor_ring[i].fields.buffer_addr = PADDR(tx_buffer(i));
 		// Report status, end of packet
 		tx_descriptor_ring[i].fields.cmd |= E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
 		// Turn DD(descriptor done) bit(index 0), to let the transmit function know it is safe to recycle
@@ -39,7 +185,7 @@ static void e1000_init_transmit_ring()
 
 	// Set TDH, TDT to 0
 	e1000_dma_io[E1000_TDH] = 0;
-	e1000_dma_io[E1000_TDT] = 0;
+	e1000_dma_io[E1000_TDT] = tx_tail = 0;
 
 	// Set TCTL register for desired operation
 	// Set enable bit, pad short packets, collision threshold to 0x10 (TODO remove this later if we don't need it), and collision distance to full duplex
@@ -50,6 +196,46 @@ static void e1000_init_transmit_ring()
 			((union e1000_tipg_register) {.fields.IPGT = 8, .fields.IPGR1 = 0, .fields.IPGR2=0}).raw;
 }
 
+// Hand descriptor 'i' of 'q' back to the card, pointing at the buffer
+// in q->pages[i].  An extended write-back overwrote the buffer address,
+// so this always rewrites all of the descriptor.
+static void
+rx_recycle(struct e1000_rxq *q, uint32_t i)
+{
+	volatile union e1000_rx_desc *d = &q->ring[i];
+
+	d->read.buffer_addr = page2pa(q->pages[i]) + E1000_RX_BUFFER_OFFSET;
+	d->read.reserved = 0;
+}
+
+// Have the 82574 spread received flows over its receive queues by the
+// Toeplitz hash of their IPv4 addresses (and TCP ports) under a fixed
+// key.  Each of the 128 redirection table entries picks queue 0 or 1
+// for the frames whose hash ends in its index.
+static void
+e1000_init_rss(void)
+{
+	static const uint32_t key[10] = {
+		0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0,
+		0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe,
+	};
+
+	for (int i = 0; i < 10; i++)
+		e1000_dma_io[E1000_RSSRK + i] = key[i];
+	// Four byte-wide entries to a register; alternate the queues
+	for (int i = 0; i < 32; i++)
+		e1000_dma_io[E1000_RETA + i] = E1000_RETA_QUEUE1 * 0x01000100u;
+
+	// RSS writes the hash where the packet checksum would go and needs
+	// the extended descriptor layout; the card still checks the IPv4,
+	// TCP and UDP checksums.
+	e1000_dma_io[E1000_RFCTL] |= E1000_RFCTL_EXTEN;
+	e1000_dma_io[E1000_RXCSUM] |= E1000_RXCSUM_PCSD;
+	e1000_dma_io[E1000_MRQC] = E1000_MRQC_RSS_2Q | E1000_MRQC_RSS_IPV4 |
+							   E1000_MRQC_RSS_TCPIPV4;
+	rx_extended = true;
+}
+
 static void e1000_init_receive_ring()
 {
 //#define E1000_RAH_AV  0x80000000        /* Receive descriptor valid */
@@ -64,37 +250,106 @@ static void e1000_init_receive_ring()
 	// Clear MTA
 	e1000_dma_io[E1000_MTA] = 0;
 
-	// Initialize ring pointers
-	e1000_dma_io[E1000_RDBAL] = PADDR((void *) receive_descriptor_ring);
-	e1000_dma_io[E1000_RDBAH] = 0;
-	e1000_dma_io[E1000_RDLEN] = sizeof(receive_descriptor_ring);
+	for (uint32_t n = 0; n < nrxq; n++)
+	{
+		struct e1000_rxq *q = &rxqs[n];
 
-	// Set RDH, RDT to 0
-	e1000_dma_io[E1000_RDH] = 0;
-	e1000_dma_io[E1000_RDT] = E1000_RX_DESCRIPTORS_COUNT - 1; // TODO check this, might be pointers?
+		// Initialize ring pointers
+		e1000_dma_io[E1000_RXQ_REG(E1000_RDBAL, n)] = PADDR((void *) q->ring);
+		e1000_dma_io[E1000_RXQ_REG(E1000_RDBAH, n)] = 0;
+		e1000_dma_io[E1000_RXQ_REG(E1000_RDLEN, n)] = rx_count * sizeof(*q->ring);
 
-	// Initialize ring descriptors
-	for (int i = 0; i < E1000_RX_DESCRIPTORS_COUNT; ++i)
-	{
-		receive_descriptor_ring[i].buffer_addr = PADDR(&receive_buffers[i]);
-		receive_descriptor_ring[i].status &= ~E1000_TX_DX_STAT_DD;
+		// Initialize ring descriptors
+		for (uint32_t i = 0; i < rx_count; ++i)
+		{
+			if ((q->pages[i] = page_alloc_order(rx_order, ALLOC_ZERO)) == NULL)
+				panic("e1000: out of memory for receive pages");
+			for (int j = 0; j < (1 << rx_order); j++)
+				q->pages[i][j].pp_ref++;
+			rx_recycle(q, i);
+		}
+
+		// Set RDH, RDT to 0
+		q->rdt = E1000_RXQ_REG(E1000_RDT, n);
+		e1000_dma_io[E1000_RXQ_REG(E1000_RDH, n)] = 0;
+		e1000_dma_io[q->rdt] = q->tail = rx_count - 1; // TODO check this, might be pointers?
 	}
 
-	// Set RCTL register for desired operation
-	e1000_dma_io[E1000_RCTL] =
-			((union e1000_rctl_register) {.fields.EN = 1, .fields.BAM=1, .fields.BSIZE = 0b00 /* 2048 */, .fields.SECRC = 1}).raw;
+	// Have the card check IPv4, TCP and UDP checksums
+	e1000_dma_io[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+	if (nrxq > 1)
+		e1000_init_rss();
+
+	// Set RCTL register for desired operation.  BSIZE halves from 2048
+	// bytes, or with BSEX from 16384; frames longer than 1522 bytes
+	// are only taken with LPE.
+	union e1000_rctl_register rctl = {.fields.EN = 1, .fields.BAM = 1, .fields.SECRC = 1};
+	rctl.fields.LPE = MAX_ETHERNET_PACKET_SIZE > 1522;
+	switch (E1000_RX_BUFFER_SIZE)
+	{
+	case 2048:
+		rctl.fields.BSIZE = 0b00;
+		break;
+	case 4096:
+		rctl.fields.BSEX = 1;
+		rctl.fields.BSIZE = 0b11;
+		break;
+	case 8192:
+		rctl.fields.BSEX = 1;
+		rctl.fields.BSIZE = 0b10;
+		break;
+	default:
+		rctl.fields.BSEX = 1;
+		rctl.fields.BSIZE = 0b01;
+		break;
+	}
+	e1000_dma_io[E1000_RCTL] = rctl.raw;
 }
 
 
 int e1000_pci_attach(struct pci_func *pcif)
 {
+	bool multiqueue = PCI_PRODUCT(pcif->dev_id) == E1000_DEVICE_ID_82574;
+	int r;
+
 	pci_func_enable(pcif);
 	e1000_dma_io = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
-	// indicates a full duplex link is up at 1000 MB/s, among other things.
-	assert(e1000_dma_io[E1000_STATUS] == 0x80080783);
+	if (multiqueue)
+		// The 82574 waits to be told to bring the link up
+		e1000_dma_io[E1000_CTRL] |= E1000_CTRL_SLU;
+	else
+		// indicates a full duplex link is up at 1000 MB/s, among other things.
+		assert(e1000_dma_io[E1000_STATUS] == 0x80080783);
 
+	// Ring lengths must be multiples of 128 bytes, and the largest TSO
+	// frame takes a descriptor for each page it touches and a context.
+	static_assert(E1000_TX_RING_SIZE % 8 == 0 && E1000_RX_RING_SIZE % 8 == 0);
+	static_assert(E1000_TX_RING_SIZE > NET_TSO_MAXLEN / PGSIZE + 2);
+	static_assert(MAX_ETHERNET_PACKET_SIZE <= 16384);
+	e1000_alloc_rings(E1000_TX_RING_SIZE, E1000_RX_RING_SIZE,
+					  multiqueue ? E1000_MAX_RXQ : 1);
 	e1000_init_transmit_ring();
 	e1000_init_receive_ring();
+
+	static_assert(E1000_RX_DELAY_USEC <= NET_MOD_DELAY_MAX &&
+				  E1000_RX_ABS_USEC <= NET_MOD_DELAY_MAX &&
+				  E1000_MIN_GAP_USEC <= NET_MOD_GAP_MAX);
+	e1000_moderate(&e1000_moderation, NULL);
+
+	// Mask everything until someone waits, and clear stale causes.
+	e1000_dma_io[E1000_IMC] = ~0;
+	(void) e1000_dma_io[E1000_ICR];
+	e1000_irq = pcif->irq_line;
+	e1000_bus = *pcif->bus;
+	e1000_pcif = *pcif;
+	e1000_pcif.bus = &e1000_bus;
+	if ((r = pci_msi_enable(&e1000_pcif, cpunum())) > 0)
+		e1000_vector = r;
+	else
+	{
+		e1000_vector = IRQ_OFFSET + e1000_irq;
+		irq_enable(e1000_irq);
+	}
 	return 0;
 }
 
@@ -104,64 +359,688 @@ int e1000_try_transmit_packet(const uint8_t *packet_data, uint32_t packet_size)
 	if (packet_size > E1000_TX_BUFFER_SIZE)
 		return -E_INVAL;
 
-	uint32_t tail_index = e1000_dma_io[E1000_TDT];
+	spin_lock(&e1000_tx_lock);
+	uint32_t tail_index = tx_tail;
 	volatile union e1000_tx_desc *current_descriptor = &tx_descriptor_ring[tail_index];
 
-//	cprintf("e1000_try_transmit_packet: *tdt_reg = %x\n", tail_index);
-
 	// DD bit is the 0th bit) - Is it safe to recycle this buffer?
 	// If DD bit is not set
-	if ((tx_descriptor_ring[tail_index].fields.status & E1000_TX_DX_STAT_DD) == 0)
+	// A sent page that nobody has reclaimed yet counts as busy too.
+	if ((tx_descriptor_ring[tail_index].fields.status & E1000_TX_DX_STAT_DD) == 0 ||
+		tx_pages[tail_index] != NULL)
+	{
+		tx_queue_full++;
+		spin_unlock(&e1000_tx_lock);
 		return -E_NET_QUEUE_FULL;
+	}
 
-	// Turn off the DD bit(index 0)
-	current_descriptor->fields.status &= ~E1000_TX_DX_STAT_DD;
+	// Copy packet data to buffer, straight from the user
+	if (copyin(tx_buffer(tail_index), packet_data, packet_size) < 0)
+	{
+		spin_unlock(&e1000_tx_lock);
+		return -E_FAULT;
+	}
 
+	// The slot may last have held a context or extended descriptor,
+	// so rewrite all of it; this also turns off the DD bit.
+	current_descriptor->fields.buffer_addr = PADDR(tx_buffer(tail_index));
 	current_descriptor->fields.length = packet_size;
-	// Copy packet data to buffer
-	memcpy((void *) &tx_buffers[tail_index], packet_data, packet_size);
-
-//	cprintf("e1000_try_transmit_packet: send hex dump -> ");
-//	for (int i = 0; i < current_descriptor->fields.length / sizeof(int); ++i)
-//		cprintf("%x ", ((uint32_t *) tx_buffers[tail_index].data)[i]);
-//	cprintf("\n");
+	current_descriptor->fields.cso = 0;
+	current_descriptor->fields.cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+	current_descriptor->fields.status = 0;
+	current_descriptor->fields.css = 0;
+	current_descriptor->fields.special = 0;
 
 	// Advance the tail
-	e1000_dma_io[E1000_TDT] = (tail_index + 1) % E1000_TX_DESCRIPTORS_COUNT;
+	e1000_dma_io[E1000_TDT] = tx_tail = (tail_index + 1) % tx_count;
+	spin_unlock(&e1000_tx_lock);
 	return 0;
 }
 
-int e1000_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_size)
+// Are any user pages still pinned by zero-copy sends?
+// If so, only callers holding the kernel lock may use the ring.
+bool
+e1000_tx_pinned(void)
+{
+	return tx_npinned != 0;
+}
+
+// Drop the references on user pages the card has finished sending,
+// point their descriptors back at their tx_buffer(), and add one to the
+// owner's env_net_tx_done for each frame.  The caller must hold the kernel
+// lock.  The pages are only let go of after e1000_tx_lock, which
+// syscall_unlocked may be waiting for (see tlb_shootdown_wait).
+void
+e1000_tx_reclaim(void)
 {
-//	cprintf("e1000_try_recv_packet: args %p %x %p\n", buffer, buffer_size, packet_size);
+	struct PageInfo *done[E1000_TX_RING_SIZE];
+	struct Env *e;
+	uint32_t ndone = 0;
+
+	if (tx_npinned == 0)
+		return;
+	spin_lock(&e1000_tx_lock);
+	for (uint32_t i = 0; i < tx_count; ++i)
+	{
+		if (tx_pages[i] == NULL ||
+			(tx_descriptor_ring[i].fields.status & E1000_TX_DX_STAT_DD) == 0)
+			continue;
+		done[ndone++] = tx_pages[i];
+		tx_pages[i] = NULL;
+		tx_descriptor_ring[i].fields.buffer_addr = PADDR(tx_buffer(i));
+		if (tx_owners[i] != 0 && envid2env(tx_owners[i], &e, 0) == 0)
+			e->env_net_tx_done++;
+		tx_npinned--;
+	}
+	spin_unlock(&e1000_tx_lock);
 
-	uint32_t tail_index = (e1000_dma_io[E1000_RDT] + 1) % E1000_RX_DESCRIPTORS_COUNT; // We are checking next in queue
-	volatile struct e1000_rx_desc *current_descriptor = &receive_descriptor_ring[tail_index];
+	while (ndone > 0)
+		page_decref(done[--ndone]);
+}
 
-	// If DD bit is not set, then the recv queue has nothing for us to recv
-	if ((current_descriptor->status & E1000_TX_DX_STAT_DD) == 0)
-		return -E_NET_QUEUE_EMPTY;
+// Is transmit descriptor 'i' free for reuse?
+static bool
+tx_slot_free(uint32_t i)
+{
+	return (tx_descriptor_ring[i].fields.status & E1000_TX_DX_STAT_DD) != 0 &&
+		   tx_pages[i] == NULL;
+}
+
+// Are the 'count' transmit descriptors from 'i' on all free?
+static bool
+tx_slots_free(uint32_t i, uint32_t count)
+{
+	for (; count > 0; count--, i = (i + 1) % tx_count)
+		if (!tx_slot_free(i))
+			return false;
+	return true;
+}
+
+// Find the TCP or UDP header in the 'len' bytes of Ethernet frame at
+// 'frame'.  Returns its offset and stores the IP protocol in *proto,
+// or returns 0 if the frame is not an unfragmented IPv4 TCP or UDP
+// packet whose IPv4 header lies within len.
+static uint32_t
+tx_transport_offset(const uint8_t *frame, uint32_t len, uint8_t *proto)
+{
+	const uint8_t *ip = frame + ETH_HDR_LEN;
+	uint32_t tucss;
+
+	// EtherType IPv4, IP version 4, and neither MF nor a fragment offset
+	if (len < ETH_HDR_LEN + IP_HDR_MINLEN || frame[12] != 0x08 || frame[13] != 0x00 ||
+		(ip[0] >> 4) != 4 || (ip[6] & 0x3f) != 0 || ip[7] != 0)
+		return 0;
+	if (ip[9] != IP_PROTO_TCP && ip[9] != IP_PROTO_UDP)
+		return 0;
+	tucss = ETH_HDR_LEN + (ip[0] & 0xf) * 4;
+	if (tucss < ETH_HDR_LEN + IP_HDR_MINLEN || tucss > len)
+		return 0;
+	*proto = ip[9];
+	return tucss;
+}
+
+// Where the card should checksum the 'len'-byte Ethernet frame at
+// 'frame', as TX_CONTEXT(tucss, tucso), or 0 if it is not an
+// unfragmented IPv4 TCP or UDP packet the card can checksum.
+// UDP packets sent without a checksum return 0 too.
+static uint16_t
+tx_frame_context(const uint8_t *frame, uint32_t len)
+{
+	uint32_t tucss, tucso;
+	uint8_t proto;
+
+	if ((tucss = tx_transport_offset(frame, len, &proto)) == 0)
+		return 0;
+	tucso = tucss + (proto == IP_PROTO_TCP ? TCP_CSUM_OFFSET : UDP_CSUM_OFFSET);
+	if (tucso + 2 > len ||
+		(proto == IP_PROTO_UDP && frame[tucso] == 0 && frame[tucso + 1] == 0))
+		return 0;
+	return TX_CONTEXT(tucss, tucso);
+}
+
+// The length of the Ethernet, IPv4 and TCP headers at the start of the
+// 'len' bytes at 'frame', which the card replicates into each segment
+// of a NETBUF_TX_TSO frame.
+// Returns < 0 if the frame is not an unfragmented IPv4 TCP packet whose
+// headers all lie within len.
+int
+e1000_tso_hdrlen(const uint8_t *frame, uint32_t len)
+{
+	uint32_t tucss, hdrlen;
+	uint8_t proto;
+
+	if ((tucss = tx_transport_offset(frame, len, &proto)) == 0 ||
+		proto != IP_PROTO_TCP || tucss + TCP_HDR_MINLEN > len)
+		return -E_INVAL;
+	hdrlen = tucss + (frame[tucss + 12] >> 4) * 4;
+	if (hdrlen < tucss + TCP_HDR_MINLEN || hdrlen > len)
+		return -E_INVAL;
+	return hdrlen;
+}
+
+// Queue a context descriptor in slot 'i' making the card checksum the
+// following frames as 'context' says.
+static void
+tx_set_context(uint32_t i, uint16_t context)
+{
+	volatile union e1000_tx_desc *d = &tx_descriptor_ring[i];
+	uint8_t tucss = context >> 8, tucso = context & 0xff;
+
+	d->ctx.ipcss = d->ctx.ipcso = 0;
+	d->ctx.ipcse = 0;
+	d->ctx.tucss = tucss;
+	d->ctx.tucso = tucso;
+	d->ctx.tucse = 0;
+	// Report status too, so that the slot's DD bit says when it is free
+	d->ctx.cmd_and_length = E1000_TXD_DTYP_C |
+		E1000_TXD_CMD(E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_CMD_IP |
+					  (tucso - tucss == TCP_CSUM_OFFSET ? E1000_TXD_CMD_TCP : 0));
+	d->ctx.status = 0;
+	d->ctx.hdr_len = 0;
+	d->ctx.mss = 0;
+	tx_context = context;
+}
+
+// Queue a context descriptor in slot 'i' making the card cut the next
+// frame, whose first 'hdrlen' bytes at 'frame' are its headers and
+// which carries 'paylen' bytes of TCP payload after them, into
+// segments of 'mss' payload bytes, with IPv4 and TCP checksums.
+static void
+tx_set_tso_context(uint32_t i, const uint8_t *frame, uint32_t hdrlen,
+				   uint32_t paylen, uint32_t mss)
+{
+	volatile union e1000_tx_desc *d = &tx_descriptor_ring[i];
+	uint8_t tucss = ETH_HDR_LEN + (frame[ETH_HDR_LEN] & 0xf) * 4;
+
+	d->ctx.ipcss = ETH_HDR_LEN;
+	d->ctx.ipcso = ETH_HDR_LEN + IP_CSUM_OFFSET;
+	d->ctx.ipcse = tucss - 1;
+	d->ctx.tucss = tucss;
+	d->ctx.tucso = tucss + TCP_CSUM_OFFSET;
+	d->ctx.tucse = 0;
+	d->ctx.cmd_and_length = paylen | E1000_TXD_DTYP_C |
+		E1000_TXD_CMD(E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_CMD_TSE |
+					  E1000_TXD_CMD_IP | E1000_TXD_CMD_TCP);
+	d->ctx.status = 0;
+	d->ctx.hdr_len = hdrlen;
+	d->ctx.mss = mss;
+	// The next frame that only wants checksums needs a new context
+	tx_context = 0;
+}
+
+// Queue frames for transmission without copying them.  Each piece
+// bufs[i] is bufs[i].len bytes at offset bufs[i].data of page pps[i],
+// which stays referenced on behalf of 'owner' until e1000_tx_reclaim
+// finds it sent.  A frame is a run of pieces, each but the last flagged
+// E1000_TX_MORE, and the first carrying the frame's NETBUF_TX_* flags:
+// NETBUF_TX_L4CSUM has the card fill in its TCP or UDP checksum, and
+// NETBUF_TX_TSO has it cut the frame into TCP segments.  The first
+// piece must hold the frame's headers.  The caller must already have
+// checked the sizes, and that e1000_tso_hdrlen accepts every TSO
+// frame, and must hold the kernel lock.
+// TDT is written once, after the last frame.
+// Returns the number of frames queued, which is less than the number
+// described (maybe 0) if the ring fills up.
+int
+e1000_transmit_pages(struct PageInfo *const *pps, const struct NetBuf *bufs,
+					 size_t n, envid_t owner)
+{
+	volatile union e1000_tx_desc *current_descriptor;
+	uint32_t tail_index, flags, frame_len, eop;
+	const uint8_t *frame;
+	uint16_t context;
+	size_t i, j, end;
+	int hdrlen, nframes = 0;
+
+	spin_lock(&e1000_tx_lock);
+	tail_index = tx_tail;
+	for (i = 0; i < n; i = end)
+	{
+		// The frame is made of pieces i up to end
+		frame_len = 0;
+		for (end = i; end < n && (bufs[end].flags & E1000_TX_MORE); end++)
+			frame_len += bufs[end].len;
+		if (end == n)
+			break;
+		frame_len += bufs[end++].len;
+
+		flags = bufs[i].flags;
+		frame = (const uint8_t *) page_kmap(pps[i], KMAP_SRC) + bufs[i].data;
+		context = hdrlen = 0;
+		if (flags & NETBUF_TX_TSO)
+			hdrlen = e1000_tso_hdrlen(frame, bufs[i].len);
+		else if (flags & NETBUF_TX_L4CSUM)
+			context = tx_frame_context(frame, bufs[i].len);
+
+		// Queue all of a frame or none of it
+		if (!tx_slots_free(tail_index, end - i + (hdrlen > 0 ||
+						   (context != 0 && context != tx_context))))
+		{
+			tx_queue_full++;
+			break;
+		}
+		if (hdrlen > 0)
+		{
+			tx_set_tso_context(tail_index, frame, hdrlen, frame_len - hdrlen,
+							   NETBUF_MSS(flags));
+			tail_index = (tail_index + 1) % tx_count;
+		} else if (context != 0 && context != tx_context)
+		{
+			tx_set_context(tail_index, context);
+			tail_index = (tail_index + 1) % tx_count;
+		}
 
+		for (j = i; j < end; j++)
+		{
+			// Only the last piece of a frame counts towards env_net_tx_done
+			pps[j]->pp_ref++;
+			tx_pages[tail_index] = pps[j];
+			tx_owners[tail_index] = j == end - 1 ? owner : 0;
+			tx_npinned++;
+
+			eop = j == end - 1 ? E1000_TXD_CMD_EOP : 0;
+			current_descriptor = &tx_descriptor_ring[tail_index];
+			current_descriptor->data.buffer_addr = page2pa(pps[j]) + bufs[j].data;
+			if (hdrlen > 0)
+			{
+				current_descriptor->data.cmd_and_length = bufs[j].len | E1000_TXD_DTYP_D |
+					E1000_TXD_CMD(E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_CMD_TSE | eop);
+				current_descriptor->data.popts = E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+			} else if (context != 0)
+			{
+				current_descriptor->data.cmd_and_length = bufs[j].len | E1000_TXD_DTYP_D |
+					E1000_TXD_CMD(E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | eop);
+				current_descriptor->data.popts = E1000_TXD_POPTS_TXSM;
+			} else
+			{
+				current_descriptor->fields.length = bufs[j].len;
+				current_descriptor->fields.cso = 0;
+				current_descriptor->fields.cmd = E1000_TXD_CMD_RS | eop;
+				current_descriptor->fields.css = 0;
+			}
+			current_descriptor->data.status = 0;
+			current_descriptor->data.special = 0;
+			tail_index = (tail_index + 1) % tx_count;
+		}
+		nframes++;
+	}
+
+	// Hand the whole batch to the card at once, along with a context
+	// descriptor queued for a frame that then found the ring full
+	if (tail_index != tx_tail)
+		e1000_dma_io[E1000_TDT] = tx_tail = tail_index;
+	spin_unlock(&e1000_tx_lock);
+	return nframes;
+}
+
+int e1000_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_size)
+{
+	struct NetBuf buf = {(uintptr_t) buffer, buffer_size, 0};
+	int r;
+
+	r = e1000_recv_batch(0, &buf, 1);
 	// Even if the user supplied a small buffer, we will write to him the size of packet needed
-	if (packet_size != NULL)
-		*packet_size = current_descriptor->length;
+	if (packet_size != NULL && (r >= 0 || r == -E_INVAL) &&
+		copyout(packet_size, &buf.len, sizeof(buf.len)) < 0)
+		return -E_FAULT;
+	return r < 0 ? r : 0;
+}
+
+// The status, errors and length the card wrote back to 'd', in the
+// legacy layout whichever layout the card uses: the low byte of the
+// extended status and the high byte of the extended errors match it.
+static uint8_t
+rxd_status(volatile union e1000_rx_desc *d)
+{
+	return rx_extended ? d->ext.status_error & 0xff : d->fields.status;
+}
 
-	if (current_descriptor->length > buffer_size)
+static uint8_t
+rxd_errors(volatile union e1000_rx_desc *d)
+{
+	return rx_extended ? d->ext.status_error >> 24 : d->fields.errors;
+}
+
+static uint16_t
+rxd_length(volatile union e1000_rx_desc *d)
+{
+	return rx_extended ? d->ext.length : d->fields.length;
+}
+
+// The NETBUF_RX_* flags for the frame the card received into 'd'.
+// A check the card did not make, or that failed, is left for software
+// to repeat, so a bad frame is still dropped.
+static uint32_t
+rx_csum_flags(volatile union e1000_rx_desc *d)
+{
+	uint8_t status = rxd_status(d), errors = rxd_errors(d);
+	uint32_t flags = 0;
+
+	if (status & E1000_RXD_STAT_IXSM)
+		return 0;
+	if ((status & E1000_RXD_STAT_IPCS) && !(errors & E1000_RXD_ERR_IPE))
+		flags |= NETBUF_RX_IPCS_OK;
+	if ((status & E1000_RXD_STAT_TCPCS) && !(errors & E1000_RXD_ERR_TCPE))
+		flags |= NETBUF_RX_L4CS_OK;
+	return flags;
+}
+
+// Give back the descriptors of 'q' after 'tail' that hold pieces of
+// frames longer than a receive buffer, which the card only takes with
+// jumbo frames enabled.  Returns the new tail, after which comes either
+// a whole frame or a descriptor the card has not filled yet; the caller
+// must hold q->lock and write RDT if the tail moved.
+static uint32_t
+rx_skip_partial(struct e1000_rxq *q, uint32_t tail)
+{
+	volatile union e1000_rx_desc *d;
+	uint32_t next;
+	uint8_t status;
+
+	for (;; tail = next)
+	{
+		next = (tail + 1) % rx_count;
+		d = &q->ring[next];
+		status = rxd_status(d);
+		if ((status & E1000_TX_DX_STAT_DD) == 0 ||
+			(!q->discard && (status & E1000_RXD_STAT_EOP)))
+			return tail;
+		q->discard = (status & E1000_RXD_STAT_EOP) == 0;
+		if (!q->discard)
+			q->too_long++;
+		rx_recycle(q, next);
+	}
+}
+
+// Copy up to 'n' frames received on 'queue' into the buffers described
+// by 'bufs', one frame per buffer, storing each frame's length in its
+// 'len' and its NETBUF_RX_* flags in its 'flags'.
+// The buffers are the current environment's, written with copyout.
+// Stops early at the first frame that doesn't fit its buffer, or whose
+// buffer the environment cannot write, leaving it on the ring.  RDT is
+// written once, after the last frame.
+// Returns the number of frames received, or < 0 if none was.  Errors are:
+//	-E_NET_QUEUE_EMPTY if no frame has arrived.
+//	-E_INVAL if queue is not a receive queue of the card, or the
+//		first frame doesn't fit bufs[0]; its length is stored in
+//		bufs[0].len anyway.
+//	-E_FAULT if the environment cannot write bufs[0]'s buffer.
+int
+e1000_recv_batch(uint32_t queue, struct NetBuf *bufs, size_t n)
+{
+	struct e1000_rxq *q = &rxqs[queue];
+	uint32_t tail_index;
+	size_t i;
+	int err = -E_NET_QUEUE_EMPTY;
+
+	if (queue >= nrxq)
+		return -E_INVAL;
+
+	spin_lock(&q->lock);
+	tail_index = q->tail;
+	for (i = 0; i < n; i++)
+	{
+		tail_index = rx_skip_partial(q, tail_index);
+		uint32_t next = (tail_index + 1) % rx_count; // We are checking next in queue
+		volatile union e1000_rx_desc *current_descriptor = &q->ring[next];
+		uint16_t length;
+
+		// If DD bit is not set, then the recv queue has nothing for us to recv
+		if ((rxd_status(current_descriptor) & E1000_TX_DX_STAT_DD) == 0)
+			break;
+		length = rxd_length(current_descriptor);
+		if (length > bufs[i].len)
+		{
+			if (i == 0)
+				bufs[0].len = length;
+			err = -E_INVAL;
+			break;
+		}
+
+		// Copy packet data to buffer, straight to the user
+		if (copyout((void *) bufs[i].data,
+					page2kva(q->pages[next]) + E1000_RX_BUFFER_OFFSET, length) < 0)
+		{
+			err = -E_FAULT;
+			break;
+		}
+		bufs[i].len = length;
+		bufs[i].flags = rx_csum_flags(current_descriptor);
+
+		// Mark this entry as done
+		rx_recycle(q, next);
+		tail_index = next;
+	}
+
+	// Give the whole batch of descriptors back to the card at once
+	if (tail_index != q->tail)
+		e1000_dma_io[q->rdt] = q->tail = tail_index;
+	spin_unlock(&q->lock);
+
+	return i > 0 ? (int) i : err;
+}
+
+// Receive the next packet on 'queue' by mapping the page it was DMAed
+// into at 'va' in 'pgdir' with permissions 'perm', and put a fresh
+// zeroed page on the ring in its place.  The frame starts at offset
+// E1000_RX_PAGE_OFFSET of the page; its length is stored in *packet_size
+// and its NETBUF_RX_* flags in *flags.
+// The rest of the page is zero, so nothing stale leaks to the receiver.
+// The caller must hold the kernel lock.  The page is mapped after
+// q->lock is released, since mapping it may free the page it replaces
+// (see tlb_shootdown_wait).
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NET_QUEUE_EMPTY if no packet has arrived.
+//	-E_NO_MEM if there is no replacement page, when the packet stays
+//		on the ring, or no memory for a page table, when it is
+//		dropped.
+//	-E_INVAL if queue is not a receive queue of the card, or if
+//		receive buffers are larger than a page, as they are for
+//		jumbo frames (see E1000_RX_FLIPPABLE).
+int
+e1000_recv_page(uint32_t queue, pde_t *pgdir, void *va, int perm,
+				uint32_t *packet_size, uint32_t *flags)
+{
+	struct e1000_rxq *q = &rxqs[queue];
+	struct PageInfo *pp, *fresh;
+	uint32_t skipped;
+	int r;
+
+	if (!E1000_RX_FLIPPABLE || queue >= nrxq)
 		return -E_INVAL;
 
-//	cprintf("e1000_try_recv_packet: hex dump -> ");
-//	for (int i = 0; i < current_descriptor->length / sizeof(int); ++i)
-//		cprintf("%x ", ((uint32_t *) receive_buffers[tail_index].data)[i]);
-//	cprintf("\n");
-//	cprintf("LOLOLOLO RECV: %d\n", current_descriptor->length);
+	spin_lock(&q->lock);
+	skipped = rx_skip_partial(q, q->tail);
+	if (skipped != q->tail)
+		e1000_dma_io[q->rdt] = q->tail = skipped;
+	uint32_t tail_index = (q->tail + 1) % rx_count;
+	volatile union e1000_rx_desc *current_descriptor = &q->ring[tail_index];
+
+	if ((rxd_status(current_descriptor) & E1000_TX_DX_STAT_DD) == 0)
+	{
+		spin_unlock(&q->lock);
+		return -E_NET_QUEUE_EMPTY;
+	}
 
-	// Copy packet data to buffer
-	memcpy((void *) buffer, (void *) &receive_buffers[tail_index], current_descriptor->length);
+	pp = q->pages[tail_index];
+	if ((fresh = page_alloc(ALLOC_ZERO)) == NULL)
+	{
+		spin_unlock(&q->lock);
+		return -E_NO_MEM;
+	}
+	*packet_size = rxd_length(current_descriptor);
+	*flags = rx_csum_flags(current_descriptor);
 
-	// Mark this entry as done
-	current_descriptor->status &= ~E1000_TX_DX_STAT_DD;
+	// The ring's reference to pp is now ours; it owns the fresh page.
+	fresh->pp_ref++;
+	q->pages[tail_index] = fresh;
+	rx_recycle(q, tail_index);
 
 	// Advance the tail
-	e1000_dma_io[E1000_RDT] = tail_index;
+	e1000_dma_io[q->rdt] = q->tail = tail_index;
+	spin_unlock(&q->lock);
+
+	// The mapping takes over pp, or it is freed if there is none
+	r = page_insert(pgdir, pp, va, perm);
+	page_decref(pp);
+	return r;
+}
+
+// Has the card filled the next receive descriptor of 'q'?
+static bool
+e1000_rx_ready(struct e1000_rxq *q)
+{
+	uint32_t next = (q->tail + 1) % rx_count;
+	return (rxd_status(&q->ring[next]) & E1000_TX_DX_STAT_DD) != 0;
+}
+
+// Arrange for envid to be made runnable by the next receive interrupt
+// once 'queue' is empty.  The caller must hold the kernel lock and, if
+// this returns 0, mark envid not runnable before releasing it.
+// Returns 0 if envid should sleep, > 0 if a packet is already waiting,
+// or -E_INVAL if there is no card or no such queue to wait on.
+int
+e1000_recv_wait(uint32_t queue, envid_t envid)
+{
+	if (queue >= nrxq)
+		return -E_INVAL;
+
+	// Unmask first: a packet that lands after the check below still
+	// raises an interrupt, which is taken once we give up the CPU.
+	e1000_dma_io[E1000_IMS] = E1000_IMS_RX;
+	if (e1000_rx_ready(&rxqs[queue]))
+		return 1;
+	// Take the interrupt on the waiter's CPU
+	if (e1000_pcif.msi_vector)
+		pci_msi_route(&e1000_pcif, cpunum());
+	else
+		irq_route(e1000_irq, cpunum());
+	rxqs[queue].waiter = envid;
 	return 0;
-}
\ No newline at end of file
+}
+
+// Is envid asleep in e1000_recv_wait?  The caller must hold the kernel
+// lock.
+bool
+e1000_recv_waiter(envid_t envid)
+{
+	struct e1000_rxq *q;
+
+	for (q = rxqs; q < rxqs + nrxq; q++)
+		if (q->waiter == envid)
+			return true;
+	return false;
+}
+
+// Program the card's receive interrupt moderation from 'set', if it is
+// not NULL, after storing the settings in force in 'old', if it is not
+// NULL.  The caller must hold the kernel lock.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no card, or a setting is out of range.
+int
+e1000_moderate(const struct NetModeration *set, struct NetModeration *old)
+{
+	struct NetModeration m;
+
+	if (e1000_dma_io == NULL)
+		return -E_INVAL;
+	if (set != NULL)
+	{
+		m = *set;
+		if (m.rx_delay_usec > NET_MOD_DELAY_MAX || m.rx_abs_usec > NET_MOD_DELAY_MAX ||
+			m.min_gap_usec > NET_MOD_GAP_MAX)
+			return -E_INVAL;
+	}
+	if (old != NULL)
+		*old = e1000_moderation;
+	if (set == NULL)
+		return 0;
+
+	// RDTR and RADV count 1.024us ticks, and ITR 256ns ones
+	e1000_dma_io[E1000_RDTR] = m.rx_delay_usec * 1000 / 1024;
+	e1000_dma_io[E1000_RADV] = m.rx_abs_usec * 1000 / 1024;
+	e1000_dma_io[E1000_ITR] = m.min_gap_usec * 1000 / 256;
+	e1000_moderation = m;
+	return 0;
+}
+
+// Store the card's and the driver's statistics in *st.  The caller must
+// hold the kernel lock.
+// Returns 0 on success, or -E_INVAL if there is no card.
+int
+e1000_stats(struct NetStats *st)
+{
+	struct NetStats *t = &e1000_totals;
+	struct e1000_rxq *q;
+	uint32_t i;
+
+	if (e1000_dma_io == NULL)
+		return -E_INVAL;
+
+	// Reading these registers clears them
+	t->rx_good += e1000_dma_io[E1000_GPRC];
+	t->tx_good += e1000_dma_io[E1000_GPTC];
+	t->tx_total += e1000_dma_io[E1000_TPT];
+	t->rx_missed += e1000_dma_io[E1000_MPC];
+	t->rx_crc_errors += e1000_dma_io[E1000_CRCERRS];
+	t->rx_no_buffers += e1000_dma_io[E1000_RNBC];
+	*st = *t;
+
+	spin_lock(&e1000_tx_lock);
+	st->tx_queue_full = tx_queue_full;
+	st->tx_ring_size = tx_count;
+	st->tx_ring_used = 0;
+	for (i = 0; i < tx_count; i++)
+		if (!tx_slot_free(i))
+			st->tx_ring_used++;
+	st->tx_pinned = tx_npinned;
+	spin_unlock(&e1000_tx_lock);
+
+	// The receive fields add up all the queues
+	st->rx_queues = nrxq;
+	st->rx_ring_size = st->rx_ring_used = st->rx_too_long = 0;
+	for (q = rxqs; q < rxqs + nrxq; q++)
+	{
+		spin_lock(&q->lock);
+		st->rx_too_long += q->too_long;
+		st->rx_ring_size += rx_count;
+		for (i = 0; i < rx_count; i++)
+			if (rxd_status(&q->ring[i]) & E1000_TX_DX_STAT_DD)
+				st->rx_ring_used++;
+		spin_unlock(&q->lock);
+	}
+	return 0;
+}
+
+// Handle trap 'trapno' if it is the card's interrupt: acknowledge it
+// and wake the environments waiting for packets, if any.  Without
+// MSI-X both queues raise the same cause, so every waiter rechecks.
+// Returns false if trapno is not ours.
+bool
+e1000_intr(uint32_t trapno)
+{
+	struct e1000_rxq *q;
+	struct Env *e;
+
+	if (e1000_dma_io == NULL || trapno != e1000_vector)
+		return false;
+
+	// Reading ICR clears the causes and lowers the interrupt line.
+	if (e1000_dma_io[E1000_ICR] & E1000_IMS_RX)
+	{
+		e1000_dma_io[E1000_IMC] = E1000_IMS_RX;
+		for (q = rxqs; q < rxqs + nrxq; q++)
+		{
+			if (q->waiter != 0 && envid2env(q->waiter, &e, 0) == 0 &&
+				e->env_status == ENV_NOT_RUNNABLE)
+				sched_enqueue(e);
+			q->waiter = 0;
+		}
+	}
+	// Messages go straight to the LAPIC, past any interrupt controller.
+	if (e1000_pcif.msi_vector)
+		lapic_eoi();
+	else
+		irq_eoi();
+	return true;
+}
@@ -1,16 +1,33 @@
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
 
+#include <inc/env.h>
+#include <inc/memlayout.h>
+#include <inc/syscall.h>
 #include "pci.h"
 
 #define E1000_VENDOR_ID 0x8086
 #define E1000_DEVICE_ID 0x100e
-#define MAX_ETHERNET_PACKET_SIZE 1518
+#define E1000_DEVICE_ID_82574 0x10d3	// Multi-queue; QEMU's e1000e
+#define MAX_ETHERNET_PACKET_SIZE NET_MAXFRAME
 
 
 int e1000_pci_attach(struct pci_func *pcif);
 int e1000_try_transmit_packet(const uint8_t *packet_data, uint32_t packet_size);
+bool e1000_tx_pinned(void);
+void e1000_tx_reclaim(void);
+int e1000_tso_hdrlen(const uint8_t *frame, uint32_t len);
+int e1000_transmit_pages(struct PageInfo *const *pps, const struct NetBuf *bufs,
+						 size_t n, envid_t owner);
 int e1000_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_size);
+int e1000_recv_batch(uint32_t queue, struct NetBuf *bufs, size_t n);
+int e1000_recv_page(uint32_t queue, pde_t *pgdir, void *va, int perm,
+					uint32_t *packet_size, uint32_t *flags);
+int e1000_recv_wait(uint32_t queue, envid_t envid);
+bool e1000_recv_waiter(envid_t envid);
+int e1000_moderate(const struct NetModeration *set, struct NetModeration *old);
+int e1000_stats(struct NetStats *st);
+bool e1000_intr(uint32_t trapno);
 
 
 /* Transmit descriptor */
@@ -25,6 +42,30 @@ union e1000_tx_desc {
 		uint16_t special;
 	} fields;
 
+	/* Context descriptor: sets up checksum offload for the extended
+	 * data descriptors that follow it */
+	struct {
+		uint8_t ipcss;      /* IP checksum start */
+		uint8_t ipcso;      /* IP checksum offset */
+		uint16_t ipcse;     /* IP checksum end */
+		uint8_t tucss;      /* TCP/UDP checksum start */
+		uint8_t tucso;      /* TCP/UDP checksum offset */
+		uint16_t tucse;     /* TCP/UDP checksum end, 0 for end of packet */
+		uint32_t cmd_and_length;    /* PAYLEN, DTYP and TUCMD */
+		uint8_t status;     /* Descriptor status */
+		uint8_t hdr_len;    /* Header length (segmentation only) */
+		uint16_t mss;       /* Maximum segment size (segmentation only) */
+	} ctx;
+
+	/* Extended data descriptor */
+	struct {
+		uint64_t buffer_addr;       /* Address of the descriptor's data buffer */
+		uint32_t cmd_and_length;    /* DTALEN, DTYP and DCMD */
+		uint8_t status;     /* Descriptor status */
+		uint8_t popts;      /* Packet options */
+		uint16_t special;
+	} data;
+
 	uint32_t raw;
 };
 
@@ -60,13 +101,30 @@ union e1000_tipg_register {
 };
 
 /* Receive descriptor */
-struct e1000_rx_desc {
-	uint64_t buffer_addr; /* Address of the descriptor's data buffer */
-	uint16_t length;     /* Length of data DMAed into data buffer */
-	uint16_t csum;       /* Packet checksum */
-	uint8_t status;      /* Descriptor status */
-	uint8_t errors;      /* Descriptor Errors */
-	uint16_t special;
+union e1000_rx_desc {
+	struct {
+		uint64_t buffer_addr; /* Address of the descriptor's data buffer */
+		uint16_t length;     /* Length of data DMAed into data buffer */
+		uint16_t csum;       /* Packet checksum */
+		uint8_t status;      /* Descriptor status */
+		uint8_t errors;      /* Descriptor Errors */
+		uint16_t special;
+	} fields;
+
+	/* Extended descriptor (82574), as software hands it to the card */
+	struct {
+		uint64_t buffer_addr;
+		uint64_t reserved;   /* Must be 0 */
+	} read;
+
+	/* Extended descriptor, as the card writes it back */
+	struct {
+		uint32_t mrq;        /* RSS type */
+		uint32_t rss_hash;   /* RSS hash, with RXCSUM.PCSD */
+		uint32_t status_error; /* Extended status (19:0) and errors (31:20) */
+		uint16_t length;
+		uint16_t vlan;
+	} ext;
 };
 
 union e1000_rctl_register {
@@ -102,19 +160,94 @@ union e1000_rctl_register {
 #define E1000_REG_INDEX(offset) (offset / sizeof(uint32_t))
 
 // Transmit macros
-#define E1000_TX_DESCRIPTORS_COUNT 64
-#define E1000_TX_BUFFER_SIZE 2048
+// Ring sizes in descriptors, which e1000_pci_attach allocates.  Each
+// must be a multiple of 8, and the transmit ring must hold the largest
+// TSO frame that sys_net_transmit_batch passes it.
+#ifndef E1000_TX_RING_SIZE
+#define E1000_TX_RING_SIZE 256
+#endif
+#ifndef E1000_RX_RING_SIZE
+#define E1000_RX_RING_SIZE 256
+#endif
+// Buffers for e1000_try_transmit_packet, which copies the frame
+#define E1000_TX_BUFFER_SIZE ((MAX_ETHERNET_PACKET_SIZE + 2047) & ~2047)
+// A piece of a frame that e1000_transmit_pages sends is followed by
+// another piece of the same frame (the NETBUF_TX_* bits are below it,
+// and the MSS above)
+#define E1000_TX_MORE 0x8000
 // Receive macros
-#define E1000_RX_DESCRIPTORS_COUNT 128
-#define E1000_RX_BUFFER_SIZE 2048
+// The smallest RCTL.BSIZE that holds a whole frame, so that every
+// frame the driver takes lands in a single descriptor
+#define E1000_RX_BUFFER_SIZE \
+	(MAX_ETHERNET_PACKET_SIZE <= 2048 ? 2048 : MAX_ETHERNET_PACKET_SIZE <= 4096 ? 4096 : \
+	 MAX_ETHERNET_PACKET_SIZE <= 8192 ? 8192 : 16384)
+// Default receive interrupt moderation (see struct NetModeration):
+// no packet timer, but at most one interrupt every 50us under load
+#ifndef E1000_RX_DELAY_USEC
+#define E1000_RX_DELAY_USEC 0
+#endif
+#ifndef E1000_RX_ABS_USEC
+#define E1000_RX_ABS_USEC 0
+#endif
+#ifndef E1000_MIN_GAP_USEC
+#define E1000_MIN_GAP_USEC 50
+#endif
+// Receive queues of the 82574; the 82540 has one
+#define E1000_MAX_RXQ 2
+// Register 'reg' of queue 'q' of a multi-queue card
+#define E1000_RXQ_REG(reg, q) ((reg) + (q) * E1000_REG_INDEX(0x100))
+// Where a received frame starts in its page: room for the header of a
+// struct jif_pkt, so a flipped page is ready for the NS server.
+#define E1000_RX_PAGE_OFFSET 8
+// Can e1000_recv_page hand out receive buffers?  Only if each fits in
+// a page after E1000_RX_PAGE_OFFSET; a jumbo buffer instead fills a
+// block of contiguous pages from its start.
+#define E1000_RX_FLIPPABLE (E1000_RX_PAGE_OFFSET + E1000_RX_BUFFER_SIZE <= PGSIZE)
+#define E1000_RX_BUFFER_OFFSET (E1000_RX_FLIPPABLE ? E1000_RX_PAGE_OFFSET : 0)
 
 
 // Descriptor bits for both tx and dx
 #define E1000_TX_DX_STAT_DD    0x01       // Descriptor Done
+#define E1000_RXD_STAT_EOP     0x02       // End of packet
+
+// Interrupt cause bits, shared by ICR, ICS, IMS and IMC
+#define E1000_ICR_RXDMT0     0x10   // Rx descriptor minimum threshold reached
+#define E1000_ICR_RXT0       0x80   // Rx timer interrupt (packet received)
+#define E1000_IMS_RX         (E1000_ICR_RXT0 | E1000_ICR_RXDMT0)
 
 // Tx descriptor bits
+#define E1000_TXD_CMD_DEXT   0x20   // Extended descriptor
 #define E1000_TXD_CMD_RS     0x08   // Report Status
+#define E1000_TXD_CMD_TSE    0x04   // TCP segmentation enable
+#define E1000_TXD_CMD_IP     0x02   // Context: packet is IPv4
+#define E1000_TXD_CMD_TCP    0x01   // Context: packet is TCP, not UDP
 #define E1000_TXD_CMD_EOP    0x01   // End of Packet
+#define E1000_TXD_POPTS_IXSM 0x01   // Insert the IPv4 checksum
+#define E1000_TXD_POPTS_TXSM 0x02   // Insert the TCP/UDP checksum
+// Fields of cmd_and_length in context and extended data descriptors
+#define E1000_TXD_DTYP_C     0x00000000 // Context descriptor
+#define E1000_TXD_DTYP_D     0x00100000 // Data descriptor
+#define E1000_TXD_CMD(cmd)   ((uint32_t) (cmd) << 24)
+
+// Rx descriptor bits
+#define E1000_RXD_STAT_IXSM  0x04   // Ignore checksum indication
+#define E1000_RXD_STAT_TCPCS 0x20   // TCP/UDP checksum calculated
+#define E1000_RXD_STAT_IPCS  0x40   // IP checksum calculated
+#define E1000_RXD_ERR_TCPE   0x20   // TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE    0x40   // IP checksum error
+
+// Receive checksum control
+#define E1000_RXCSUM_IPOFL   0x00000100 // IPv4 checksum offload
+#define E1000_RXCSUM_TUOFL   0x00000200 // TCP/UDP checksum offload
+#define E1000_RXCSUM_PCSD    0x00002000 // Packet checksum disabled (RSS hash instead)
+
+// 82574 link setup and receive-side scaling
+#define E1000_CTRL_SLU       0x00000040 // Set link up
+#define E1000_RFCTL_EXTEN    0x00008000 // Extended receive descriptors
+#define E1000_MRQC_RSS_2Q    0x00000001 // RSS over two queues
+#define E1000_MRQC_RSS_TCPIPV4 0x00010000 // Hash IPv4 TCP addresses and ports
+#define E1000_MRQC_RSS_IPV4  0x00020000 // Hash other IPv4 addresses
+#define E1000_RETA_QUEUE1    0x80       // Redirection entry: use queue 1
 
 /* Register Set. (82543, 82544)
  *
@@ -293,6 +426,9 @@ union e1000_rctl_register {
 #define E1000_ICRXOC   E1000_REG_INDEX(0x04124)  /* Interrupt Cause Receiver Overrun Count */
 #define E1000_RXCSUM   E1000_REG_INDEX(0x05000)  /* RX Checksum Control - RW */
 #define E1000_RFCTL    E1000_REG_INDEX(0x05008)  /* Receive Filter Control*/
+#define E1000_MRQC     E1000_REG_INDEX(0x05818)  /* Multiple Receive Queues Command - RW */
+#define E1000_RETA     E1000_REG_INDEX(0x05C00)  /* Redirection Table - RW Array */
+#define E1000_RSSRK    E1000_REG_INDEX(0x05C80)  /* RSS Random Key - RW Array */
 #define E1000_MTA      E1000_REG_INDEX(0x05200)  /* Multicast Table Array - RW Array */
 #define E1000_RA       E1000_REG_INDEX(0x05400)  /* Receive Address - RW Array */
 #define E1000_VFTA     E1000_REG_INDEX(0x05600)  /* VLAN Filter Table Array - RW Array */
@@ -11,15 +11,28 @@
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/futex.h>
+#include <kern/timerq.h>
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/time.h>
+#include <kern/service.h>
+#include <kern/trace.h>
+#include <kern/sysstat.h>
+#include <kern/console.h>
 
 struct Env *envs = NULL;        // All environments
+uint32_t nenv;            // Slots of envs[] mapped so far
+static uint32_t env_npages;    // Pages they take
 static struct Env *env_free_list;    // Free environment list
 // (linked by Env->env_link)
+static struct spinlock env_lock = SPINLOCK_INIT(env_lock); // Protects the above
 
-#define ENVGENSHIFT    12        // >= LOGNENV
+#define ENVGENSHIFT    14        // >= LOG2NENV
 
 // Global descriptor table.
 //
@@ -36,7 +49,7 @@ static struct Env *env_free_list;    // Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 		{
 				// 0x0 - unused (always faults -- for trapping NULL far pointers)
 				SEG_NULL,
@@ -53,8 +66,9 @@ struct Segdesc gdt[NCPU + 5] =
 				// 0x20 - user data segment
 				[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-				// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
-				// in trap_init_percpu()
+				// Per-CPU TSS descriptors (GD_TSS(i)) are initialized in
+				// trap_init_percpu(), per-CPU data segments (GD_CPU(i)) in
+				// percpu_init()
 				[GD_TSS0 >> 3] = SEG_NULL
 		};
 
@@ -89,6 +103,11 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= nenv)
+	{
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid)
 	{
@@ -111,27 +130,82 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Make sure the environments are in the free list in the same order
-// they are in the envs array (i.e., so that the first call to
-// env_alloc() returns envs[0]).
+#ifdef JOS_SHLIB
+static void shlib_init(void);
+#endif
+
+// Start with an empty envs[] at KENVS; env_alloc grows it.  Both of
+// its views live in page tables of kern_pgdir that every environment's
+// page directory shares, so a page mapped into them later shows up
+// everywhere at once.  The kernel view spans two page tables.
 //
 void
 env_init(void)
 {
-	// Point to first environment
-	env_free_list = envs;
-	for (int i = NENV - 1; i >= 0; --i)
+	static_assert(KENVS + NENV * sizeof(struct Env) <=
+				  KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+	static_assert(NENV * sizeof(struct Env) <= UINFO - UENVS);
+
+	envs = (struct Env *) KENVS;
+	if (!pgdir_walk(kern_pgdir, envs, 1) ||
+		!pgdir_walk(kern_pgdir, envs + NENV - 1, 1) ||
+		!pgdir_walk(kern_pgdir, (void *) UENVS, 1))
+		panic("env_init: out of memory");
+
+#ifdef JOS_SHLIB
+	shlib_init();
+#endif
+
+	// Per-CPU part of the initialization
+	env_init_percpu();
+}
+
+// Map one more page of envs[] and put the slots it completes on
+// env_free_list, lowest first, so that the first call to env_alloc()
+// returns envs[0].  Slots are published in uinfo->nenv only once their
+// pages are mapped, and never unmapped, so lock-free readers of envs[]
+// below nenv are always safe.  Called with env_lock held.
+//
+// Returns 0 on success, < 0 on failure.  Errors are:
+//	-E_NO_FREE_ENV if all NENV slots are in use
+//	-E_NO_MEM on memory exhaustion
+static int
+env_grow(void)
+{
+	struct PageInfo *pp;
+	uintptr_t off;
+	uint32_t n, i;
+
+	if (nenv == NENV)
+		return -E_NO_FREE_ENV;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	off = env_npages * PGSIZE;
+	*pgdir_walk(kern_pgdir, (void *) (KENVS + off), 0) = page2pa(pp) | PTE_W | PTE_P | PTE_G;
+	*pgdir_walk(kern_pgdir, (void *) (UENVS + off), 0) = page2pa(pp) | PTE_U | PTE_P | PTE_G;
+	env_npages++;
+
+	n = MIN(NENV, env_npages * PGSIZE / sizeof(struct Env));
+	for (i = n; i-- > nenv;)
 	{
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_id = 0;
+		envs[i].env_rq_cpu = -1;
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
 	}
+	barrier();
+	nenv = uinfo->nenv = n;
+	return 0;
+}
 
-	// Per-CPU part of the initialization
-	env_init_percpu();
+// The physical address of kernel virtual address va inside envs[], for
+// keying futexes on the fields of an Env (see sys_env_wait).
+physaddr_t
+envs_paddr(const void *va)
+{
+	return PTE_ADDR(*pgdir_walk(kern_pgdir, va, 0)) | PGOFF(va);
 }
 
 // Load GDT and segment descriptors.
@@ -139,9 +213,8 @@ void
 env_init_percpu(void)
 {
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD | 3));
+	// The kernel never uses FS, so we leave that set to the user data
+	// segment.  GS is this CPU's, from percpu_init.
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD | 3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -155,6 +228,25 @@ env_init_percpu(void)
 	lldt(0);
 }
 
+// Make this CPU cpus[i]: load %gs with a segment based at cpus[i], so
+// that thiscpu and cpunum() are a single load through it (see
+// kern/percpu.h).  Runs first on each CPU, before anything that takes
+// a spinlock, so it loads the GDT itself.  _alltraps reloads %gs on
+// every entry from user mode.
+void
+percpu_init(int i)
+{
+	struct CpuInfo *c = &cpus[i];
+
+	static_assert(offsetof(struct CpuInfo, cpu_self) == PERCPU_SELF);
+	static_assert(offsetof(struct CpuInfo, cpu_id) == PERCPU_ID);
+
+	c->cpu_self = c;
+	gdt[GD_CPU(i) >> 3] = SEG16(STA_W, (uintptr_t) c, sizeof(*c) - 1, 0);
+	lgdt(&gdt_pd);
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_CPU(i)));
+}
+
 //
 // Initialize the kernel virtual memory layout for environment e.
 // Allocate a page directory, set e->env_pgdir accordingly,
@@ -170,7 +262,9 @@ env_setup_vm(struct Env *e)
 {
 	struct PageInfo *p = NULL;
 
-	// Allocate a page for the page directory
+	// Allocate a page for the page directory.  Its user half must be
+	// empty, and a zeroed page usually comes ready-made from the pool
+	// idle CPUs fill (see page_zero_refill).
 	if (!(p = page_alloc(ALLOC_ZERO)))
 		return -E_NO_MEM;
 
@@ -191,7 +285,10 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 	e->env_pgdir = page2kva(p);
 	++p->pp_ref;
-	memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
+	// kern_pgdir is the template: everything above UTOP comes from it,
+	// and only those few entries need copying.
+	memcpy(e->env_pgdir + PDX(UTOP), kern_pgdir + PDX(UTOP),
+		   (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
 
 
 	// UVPT maps the env's own page table read-only.
@@ -216,12 +313,25 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	spin_lock(&env_lock);
+	if (!env_free_list && (r = env_grow()) < 0)
+	{
+		spin_unlock(&env_lock);
+		return r;
+	}
+	e = env_free_list;
+	env_free_list = e->env_link;
+	spin_unlock(&env_lock);
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0)
+	{
+		spin_lock(&env_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -232,8 +342,19 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_user_cycles = e->env_kern_cycles = 0;
+	e->env_vol_switches = e->env_invol_switches = 0;
+	e->env_pgfaults = e->env_ipc_sends = e->env_ipc_recvs = 0;
+	e->env_cpunum = cpunum();
+	e->env_pass = 0;
+	e->env_cpumask = ENV_CPUMASK_ALL;
+	e->env_runnable_tsc = 0;
+	memset(&e->env_runwait, 0, sizeof(e->env_runwait));
+	e->env_peer = 0;
+	e->env_peer_score = 0;
+	e->env_binary = 0;
+	sched_set_weight(e, ENV_WEIGHT_DEFAULT);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -262,12 +383,30 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_cow_upcall = false;
+	e->env_xstacktop = UXSTACKTOP;
+	e->env_fpu = NULL;
+	e->env_pmc = NULL;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and the blocked-sender state.
 	e->env_ipc_recving = 0;
+	e->env_ipc_sendq = e->env_ipc_sendq_tail = NULL;
+	e->env_ipc_send_next = NULL;
+	e->env_ipc_send_to = 0;
+	e->env_ring_waiting = false;
+	e->env_wait_page = NULL;
+	e->env_futex_pa = 0;
+	e->env_futex_deadline = 0;
+	e->env_futex_next = NULL;
+	e->env_timer_deadline = 0;
+	e->env_timer_next = NULL;
+	e->env_net_tx_done = 0;
+	e->env_irq_pending = 0;
+	e->env_notify = 0;
+	e->env_notify_mask = 0;
 
 	// commit the allocation
-	env_free_list = e->env_link;
+	sched_enqueue(e);
 	*newenv_store = e;
 
 //	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -293,21 +432,115 @@ region_alloc(struct Env *e, void *va, size_t len)
 
 	void *start_va = ROUNDDOWN(va, PGSIZE);
 	void *end_va = ROUNDUP(va + len, PGSIZE);
+	int ret;
+
+	// A page table at a time, rather than a page_insert per page
+	ret = page_region_alloc(e->env_pgdir, (uintptr_t) start_va,
+							end_va - start_va, PTE_W | PTE_U, ALLOC_HIGH);
+	if (ret < 0)
+		panic("region_alloc: %e\n", ret);
+}
+
+#ifdef JOS_SHLIB
+// The shared libjos (see lib/shlib.ld), which kern/Makefrag embeds.
+// shlib_init loads its read-only segments once, into the pages of
+// shlib_pages, indexed by page from ULIB; its writable segments are
+// copied into fresh pages of each environment.
+extern uint8_t _binary_obj_lib_libjos_shlib_start[];
+static struct PageInfo *shlib_pages[(ULIBTOP - ULIB) / PGSIZE];
+
+static void
+shlib_init(void)
+{
+	struct Elf *elf = (struct Elf *) _binary_obj_lib_libjos_shlib_start;
+	struct Proghdr *ph, *eph;
+	struct PageInfo *pp;
+	uintptr_t va, off;
+	size_t n;
+
+	if (elf->e_magic != ELF_MAGIC)
+		panic("shlib_init: bad e_magic %08x", elf->e_magic);
+	ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	for (eph = ph + elf->e_phnum; ph < eph; ph++)
+	{
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		if (ph->p_va < ULIB || ph->p_memsz > ULIBTOP - ph->p_va ||
+			ph->p_filesz > ph->p_memsz)
+			panic("shlib_init: segment at %08x is outside ULIB", ph->p_va);
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			continue;
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < ph->p_va + ph->p_memsz;
+			 va += PGSIZE)
+		{
+			if (shlib_pages[(va - ULIB) / PGSIZE])
+				panic("shlib_init: segments share page %08x", va);
+			if (!(pp = page_alloc(ALLOC_ZERO)))
+				panic("shlib_init: out of memory");
+			pp->pp_ref++;
+			shlib_pages[(va - ULIB) / PGSIZE] = pp;
+			off = MAX(va, ph->p_va);
+			n = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+			if (n > off)
+				memcpy(page2kva(pp) + off - va,
+					   (uint8_t *) elf + ph->p_offset + off - ph->p_va, n - off);
+		}
+	}
+}
+#endif
 
-	assert((end_va - start_va) % PGSIZE == 0);
-	size_t num_pages = (end_va - start_va) / PGSIZE;
+// Map the shared libjos at ULIB in e's address space: the pages
+// shlib_init loaded, read-only, and a new copy of its data.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if the kernel was not built with SHLIB=1.
+//	-E_NO_MEM if there is no memory for the data or a page table.
+int
+shlib_map(struct Env *e)
+{
+#ifdef JOS_SHLIB
+	struct Elf *elf = (struct Elf *) _binary_obj_lib_libjos_shlib_start;
+	struct Proghdr *ph, *eph;
+	struct PageInfo *pp;
+	uintptr_t va, off;
+	size_t n;
+	int r;
 
-	for (size_t i = 0; i < num_pages; ++i)
+	ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	for (eph = ph + elf->e_phnum; ph < eph; ph++)
 	{
-		void *ith_va = start_va + i * PGSIZE;
-
-		struct PageInfo *page_info = page_alloc(0);
-		if (page_info == NULL)
-			panic("page_alloc returned NULL\n");
-		int ret = page_insert(e->env_pgdir, page_info, ith_va, PTE_W | PTE_U);
-		if (ret < 0)
-			panic("page_insert: %e\n", ret);
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < ph->p_va + ph->p_memsz;
+			 va += PGSIZE)
+		{
+			if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
+			{
+				r = page_insert(e->env_pgdir, shlib_pages[(va - ULIB) / PGSIZE],
+								(void *) va, PTE_P | PTE_U);
+				if (r < 0)
+					return r;
+				continue;
+			}
+			if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGH)))
+				return -E_NO_MEM;
+			if ((r = page_insert(e->env_pgdir, pp, (void *) va,
+								 PTE_P | PTE_U | PTE_W)) < 0)
+			{
+				page_free(pp);
+				return r;
+			}
+			off = MAX(va, ph->p_va);
+			n = MIN(va + PGSIZE, ph->p_va + ph->p_filesz);
+			if (n > off)
+				memcpy((uint8_t *) page_kmap(pp, KMAP_DST) + off - va,
+					   (uint8_t *) elf + ph->p_offset + off - ph->p_va, n - off);
+		}
 	}
+	return 0;
+#else
+	return -E_NOT_SUPP;
+#endif
 }
 
 //
@@ -385,17 +618,33 @@ load_icode(struct Env *e, uint8_t *binary)
 		if (ph->p_filesz > ph->p_memsz)
 			panic("file size is bigger than requested memory size\n");
 
-		// Allocate the needed va
-		region_alloc(e, (void *) ph->p_va, ph->p_memsz);
+		// Allocate the pages the file fills, and map the zero page
+		// over the rest of the bss until it is written
+		uintptr_t fileend = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+		uintptr_t end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+
+		region_alloc(e, (void *) ph->p_va, fileend - ph->p_va);
+		if (end > fileend &&
+			page_region_alloc(e->env_pgdir, fileend, end - fileend,
+							  PTE_W | PTE_U, ALLOC_ZERO) < 0)
+			panic("load_icode: out of memory");
 
 		// Load the elf segment to allocated memory
 		memcpy((uint8_t *) ph->p_va, binary + ph->p_offset, ph->p_filesz);
-		memset((uint8_t *) ph->p_va + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+		memset((uint8_t *) ph->p_va + ph->p_filesz, 0,
+			   MIN(ph->p_memsz, fileend - ph->p_va) - ph->p_filesz);
 	}
 
 	// Switch back to kernel address space
 	lcr3(PADDR(kern_pgdir));
 
+#ifdef JOS_SHLIB
+	// Every program of a SHLIB=1 build calls into it
+	int ret = shlib_map(e);
+	if (ret < 0)
+		panic("load_icode: shlib_map: %e", ret);
+#endif
+
 	// Set entry point
 	e->env_tf.tf_eip = elf_header->e_entry;
 
@@ -420,19 +669,36 @@ env_create(uint8_t *binary, enum EnvType type)
 		panic("All envs allocated: %e\n", ret);
 
 	load_icode(e, binary);
+	e->env_binary = binary;
 	e->env_type = type;
+	// Servers sit on the latency path of every client, so let them
+	// win against CPU-bound user jobs.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		sched_set_weight(e, ENV_WEIGHT_SERVER);
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_3;
+	// The first of each server takes the name its clients look up
+	if (type == ENV_TYPE_FS)
+		service_register(e, SERVICE_FS);
+	else if (type == ENV_TYPE_NS)
+		service_register(e, SERVICE_NS);
 }
 
 //
 // Frees env e and all memory it uses.
 //
+// e goes first from everywhere other CPUs might find it -- its id is
+// retired and it leaves the run queues and every wait -- and only then
+// are its pages freed, with kernel_lock let go between page tables if
+// others wait for it, since nothing can reach e's address space by
+// then.  e stays off the free list until the end.
+//
 void
 env_free(struct Env *e)
 {
+	pde_t *pgdir = e->env_pgdir;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
@@ -443,43 +709,92 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Stop waiting on a page before unmapping it wakes us
+	ring_env_free(e);
+	futex_env_free(e);
+	cons_env_free(e);
+	timerq_cancel(e);
+
 	// Note the environment's demise.
 //	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	fpu_env_free(e);
+	pmc_env_free(e);
+	ipc_env_free(e);
+	service_env_free(e);
+	sched_dequeue(e);
+	e->env_pgdir = 0;
+	e->env_status = ENV_FREE;
+	// Retire e's id at once, rather than when the slot is reused, and
+	// wake those sleeping on it until e exits (see sys_env_wait).
+	e->env_id = (envid_t) ((uint32_t) e->env_id + (1 << ENVGENSHIFT));
+	futex_wake_pa(envs_paddr(&e->env_id), ~0U);
+
+	// Threads (see sys_exofork_shared) leave the address space they
+	// share to the last of them to go
+	if (pa2page(PADDR(pgdir))->pp_ref > 1)
+		goto free_pgdir;
+
+	// Flush all mapped pages in the user portion of the address space.
+	// No CPU has this page directory loaded: a dying curenv has switched
+	// to kern_pgdir above, threads leave it to the last of them and idle
+	// CPUs run on kern_pgdir (see sched_halt).  So the entries can go
+	// straight from the page tables, with no page_remove, and the TLB
+	// needs no invalidating.
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
 	{
 
 		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
+		if (!(pgdir[pdeno] & PTE_P))
+			continue;
+
+		// superpages have no page table
+		if (pgdir[pdeno] & PTE_PS)
+		{
+			pa = PTE_ADDR(pgdir[pdeno]);
+			pgdir[pdeno] = 0;
+			superpage_decref(pa2page(pa));
 			continue;
+		}
 
 		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
+		pa = PTE_ADDR(pgdir[pdeno]);
 		pt = (pte_t *) KADDR(pa);
 
+		// a page table fork left shared keeps its pages for the others
+		if ((pgdir[pdeno] & PTE_COW) && pa2page(pa)->pp_ref > 1)
+		{
+			pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++)
 		{
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+			{
+				page_decref(pa2page(PTE_ADDR(pt[pteno])));
+				pt[pteno] = 0;
+			}
 		}
 
 		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
+		pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
+		kernel_lock_preempt();
 	}
 
 	// free the page directory
-	pa = PADDR(e->env_pgdir);
-	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+free_pgdir:
+	page_decref(pa2page(PADDR(pgdir)));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	spin_lock(&env_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_lock);
 }
 
 //
@@ -521,6 +836,32 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
+	// Leaving the kernel: from now on TLB shootdowns must interrupt
+	// this CPU, so catch up on any that were queued meanwhile.
+	xchg(&thiscpu->cpu_in_kernel, 0);
+	tlb_shootdown_handle();
+
+	// System calls entered with sysenter leave with sysexit, which
+	// takes the user %eip in %edx and %esp in %ecx.  IF is restored
+	// by the sti, whose one-instruction delay covers the sysexit.
+	if (tf->tf_trapno == T_SYSCALL && tf->tf_err == TF_SYSENTER)
+		asm volatile(
+		"\tmovl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\tpushl $0\n" /* iret would clear the kernel's %gs; sysexit won't */
+		"\tpopl %%gs\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tmovl 0(%%esp),%%edx\n" /* tf_eip */
+		"\tmovl 12(%%esp),%%ecx\n" /* tf_esp */
+		"\tpushl 8(%%esp)\n" /* tf_eflags, without IF */
+		"\tandl $~0x200,(%%esp)\n"
+		"\tpopfl\n"
+		"\tsti\n"
+		"\tsysexit\n"
+		: : "g" (tf) : "memory");
+
 	asm volatile(
 	"\tmovl %0,%%esp\n"
 	"\tpopal\n"
@@ -532,6 +873,53 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+// CPU time accounting.  Each CPU remembers in cpu_acct_tsc when it
+// last charged anyone, and charges curenv the cycles since then each
+// time it crosses between user mode and the kernel, so an environment's
+// user and kernel cycles add up to the time it held a CPU.  Cycles a
+// CPU spends with no curenv, idle or on its way out of sched_halt, are
+// nobody's.
+
+// curenv has just trapped in from user mode: charge it the cycles it ran.
+void
+env_charge_user(void)
+{
+	uint64_t now = read_tsc();
+
+	curenv->env_user_cycles += now - thiscpu->cpu_acct_tsc;
+	thiscpu->cpu_acct_tsc = now;
+}
+
+// curenv, if any, is about to return to user mode or leave the CPU:
+// charge it the cycles the kernel spent since it trapped in.
+void
+env_charge_kernel(void)
+{
+	uint64_t now = read_tsc();
+
+	if (curenv)
+		curenv->env_kern_cycles += now - thiscpu->cpu_acct_tsc;
+	thiscpu->cpu_acct_tsc = now;
+}
+
+// This CPU is about to run next, or nothing if next is NULL.  Charge
+// curenv, and count a switch away from it: involuntary if the timer
+// preempted it while it could still run, voluntary if it blocked or
+// yielded.
+void
+env_switch_out(struct Env *next)
+{
+	env_charge_kernel();
+	if (curenv && curenv != next)
+	{
+		if (curenv->env_status == ENV_RUNNING && thiscpu->cpu_preempting)
+			curenv->env_invol_switches++;
+		else
+			curenv->env_vol_switches++;
+	}
+	thiscpu->cpu_preempting = false;
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
@@ -559,16 +947,34 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 	// First environment
 
-	// If were switching to a different env
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
+	uint64_t wait;
 
-	curenv = e;
-	curenv->env_status = ENV_RUNNING;
+	env_switch_out(e);
+	// Resuming the environment that trapped, as after most system
+	// calls and timer ticks that find nothing better to run: it is
+	// on no run queue and its FPU and counter state are still loaded.
+	if (e != curenv || e->env_status != ENV_RUNNING)
+	{
+		// If were switching to a different env
+		if (curenv != NULL && curenv->env_status == ENV_RUNNING)
+			sched_enqueue(curenv);
+		if (thiscpu->cpu_fpu_env != e)
+			fpu_release();
+		pmc_switch(e);
+
+		wait = sysstat_running(e);
+		sched_dequeue(e);
+		if (curenv != e)
+			trace_event(TRACE_SWITCH, e->env_id, MIN(wait, 0xffffffffULL), 0, 0);
+		curenv = e;
+		curenv->env_status = ENV_RUNNING;
+	}
 	curenv->env_runs++;
 
-	// Switch address space
-	lcr3(PADDR(curenv->env_pgdir));
+	// Switch address space, unless we are already in it: reloading
+	// %cr3 would flush every non-global TLB entry for nothing.
+	if (rcr3() != PADDR(curenv->env_pgdir))
+		lcr3(PADDR(curenv->env_pgdir));
 
 	unlock_kernel();
 	env_pop_tf(&e->env_tf);
@@ -7,17 +7,24 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;        // All environments
+extern uint32_t nenv;            // Slots of envs[] mapped so far
 #define curenv (thiscpu->cpu_env)        // Current environment
 extern struct Segdesc gdt[];
 
 void env_init(void);
 void env_init_percpu(void);
+void percpu_init(int i);
 int env_alloc(struct Env **e, envid_t parent_id);
 void env_free(struct Env *e);
 void env_create(uint8_t *binary, enum EnvType type);
+int shlib_map(struct Env *e);
 void env_destroy(struct Env *e);    // Does not return if e == curenv
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+physaddr_t envs_paddr(const void *va);
+void env_charge_user(void);
+void env_charge_kernel(void);
+void env_switch_out(struct Env *next);
 // The following two functions do not return
 void env_run(struct Env *e) __attribute__((noreturn));
 void env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
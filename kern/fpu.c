@@ -0,0 +1,147 @@
+// Lazy FPU and SSE context switching.
+//
+// Environments run with CR0.TS set, so the first x87, MMX or SSE
+// instruction one executes in a time slice raises #NM.  fpu_trap then
+// loads its registers - from its save area, or fresh ones the first
+// time, when the save area is allocated - clears TS and records the
+// environment in cpu_fpu_env.  Environments that never touch the FPU
+// cost nothing.
+//
+// The registers are saved when their owner stops running on the CPU
+// (fpu_release, from env_run and sched_halt), not when the next user
+// traps.  Otherwise an environment that moved to another CPU would
+// find its state still in the old CPU's registers.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/fpu.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+#define CPUID_FXSR  (1 << 24)
+#define CPUID_SSE   (1 << 25)
+
+// Registers as after FNINIT, with every SSE exception masked
+static struct FxSave fpu_initial = {
+	.fx_fcw = 0x037F,
+	.fx_mxcsr = 0x1F80,
+};
+static bool fpu_fxsr;
+
+static inline void
+fxsave(struct FxSave *fx)
+{
+	asm volatile("fxsave %0" : "=m" (*fx));
+}
+
+static inline void
+fxrstor(struct FxSave *fx)
+{
+	asm volatile("fxrstor %0" : : "m" (*fx));
+}
+
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+// Turn on the FPU, and SSE when there is one, on this CPU, leaving TS
+// set.  Without fxsave, EM stays set and every FPU instruction faults.
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx, cr0 = rcr0();
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & CPUID_FXSR) != 0;
+	if (!fpu_fxsr)
+	{
+		lcr0(cr0 | CR0_EM | CR0_TS);
+		return;
+	}
+	if (edx & CPUID_SSE)
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+	thiscpu->cpu_fpu_env = NULL;
+}
+
+// #NM: give curenv the FPU.
+void
+fpu_trap(struct Trapframe *tf)
+{
+	struct Env *e = curenv;
+
+	if ((tf->tf_cs & 3) == 0)
+		panic("FPU used in the kernel");
+	assert(thiscpu->cpu_fpu_env == NULL);
+	if (!fpu_fxsr)
+	{
+		cprintf("[%08x] FPU instruction without FPU support\n", e->env_id);
+		env_destroy(e);
+		return;
+	}
+	if (!e->env_fpu)
+	{
+		// kmalloc's 512-byte objects meet fxsave's 16-byte alignment.
+		static_assert(sizeof(struct FxSave) == 512);
+		if (!(e->env_fpu = kmalloc(sizeof(struct FxSave), 0)))
+		{
+			cprintf("[%08x] out of memory for FPU state\n", e->env_id);
+			env_destroy(e);
+			return;
+		}
+		*e->env_fpu = fpu_initial;
+	}
+	clts();
+	fxrstor(e->env_fpu);
+	thiscpu->cpu_fpu_env = e;
+}
+
+// The environment that owns this CPU's FPU is leaving it: save its
+// registers and set TS again.
+void
+fpu_release(void)
+{
+	struct Env *e = thiscpu->cpu_fpu_env;
+
+	if (!e)
+		return;
+	fxsave(e->env_fpu);
+	lcr0(rcr0() | CR0_TS);
+	thiscpu->cpu_fpu_env = NULL;
+}
+
+// e is being freed: drop its registers, wherever they are.
+void
+fpu_env_free(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_env == e)
+	{
+		lcr0(rcr0() | CR0_TS);
+		thiscpu->cpu_fpu_env = NULL;
+	}
+	kfree(e->env_fpu);
+	e->env_fpu = NULL;
+}
+
+// Give dst, a new child of src, a copy of src's FPU registers.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+int
+fpu_env_copy(struct Env *dst, struct Env *src)
+{
+	if (!src->env_fpu)
+		return 0;
+	if (thiscpu->cpu_fpu_env == src)
+		fxsave(src->env_fpu);
+	if (!(dst->env_fpu = kmalloc(sizeof(struct FxSave), 0)))
+		return -E_NO_MEM;
+	*dst->env_fpu = *src->env_fpu;
+	return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+#include <inc/trap.h>
+
+// The x87, MMX and SSE registers as fxsave stores them
+struct FxSave {
+	uint16_t fx_fcw;            // x87 control word
+	uint16_t fx_fsw;
+	uint8_t fx_ftw;             // abridged tag word: 0 is all empty
+	uint8_t fx_reserved;
+	uint16_t fx_fop;
+	uint32_t fx_fip, fx_fcs, fx_fdp, fx_fds;
+	uint32_t fx_mxcsr;          // SSE control and status
+	uint32_t fx_mxcsr_mask;
+	uint8_t fx_regs[480];       // st0-7/mm0-7, xmm0-7 and reserved
+} __attribute__((aligned(16)));
+
+void fpu_init_percpu(void);
+void fpu_trap(struct Trapframe *tf);
+void fpu_release(void);
+void fpu_env_free(struct Env *e);
+int fpu_env_copy(struct Env *dst, struct Env *src);
+
+#endif /* !JOS_KERN_FPU_H */
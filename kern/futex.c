@@ -0,0 +1,192 @@
+// Futexes: sleeping until a word in memory changes.
+//
+// An environment that finds a word holding a value it must wait out
+// sleeps in futex_wait, and whoever changes the word calls futex_wake.
+// Sleepers are keyed by the word's physical address, so environments
+// that map the same page at different addresses (a PTE_SHARE page, or
+// the read-only envs[] at UENVS, which the kernel itself writes) meet
+// on the same key.  Sleepers hash on that address into a few chains,
+// oldest first, so a wake goes to the longest waiter.
+//
+// The word is compared with the kernel locked, and wakes take the same
+// lock, so a waker that changes the word and then wakes cannot slip in
+// between the check and the sleep.  All of this is protected by the
+// big kernel lock.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/futex.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+
+#define FUTEX_NHASH     64
+
+struct FutexChain {
+	struct Env *fc_head;
+	struct Env *fc_tail;
+};
+
+static struct FutexChain futex_chains[FUTEX_NHASH];
+// Sleepers with a timeout, for futex_tick to look for
+static uint32_t futex_ntimed;
+
+static struct FutexChain *
+futex_chain(physaddr_t pa)
+{
+	return &futex_chains[(pa >> 2) % FUTEX_NHASH];
+}
+
+// The physical address of 'addr' in e's address space, which the caller
+// has checked is mapped.
+static physaddr_t
+futex_key(struct Env *e, const uint32_t *addr)
+{
+	pte_t *pte = pgdir_walk(e->env_pgdir, addr, false);
+
+	if (*pte & PTE_PS)
+		return ROUNDDOWN(*pte, PTSIZE) + ((uintptr_t) addr & (PTSIZE - 1));
+	return PTE_ADDR(*pte) + PGOFF(addr);
+}
+
+// Take e off its chain.
+static void
+futex_unlink(struct Env *e)
+{
+	struct FutexChain *fc = futex_chain(e->env_futex_pa);
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &fc->fc_head; *pp != e; pp = &(*pp)->env_futex_next)
+		prev = *pp;
+	*pp = e->env_futex_next;
+	if (fc->fc_tail == e)
+		fc->fc_tail = prev;
+	e->env_futex_next = NULL;
+	e->env_futex_pa = 0;
+	if (e->env_futex_deadline)
+	{
+		e->env_futex_deadline = 0;
+		futex_ntimed--;
+	}
+}
+
+// Make e runnable again, returning 'ret' from futex_wait.
+static void
+futex_resume(struct Env *e, int ret)
+{
+	futex_unlink(e);
+	e->env_tf.tf_regs.reg_eax = ret;
+	sched_enqueue(e);
+}
+
+// Sleep until futex_wake on 'addr', provided the word there still holds
+// 'expected', for at most 'timeout' milliseconds if that is not 0.
+// Returns 0 once woken, < 0 otherwise.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned.
+//	-E_WOULD_BLOCK if *addr != expected.
+//	-E_NO_MEM if addr's copy-on-write page could not be copied.
+//	-E_TIMEOUT if the timeout passed first.
+// The environment is destroyed if addr is not readable.
+int
+futex_wait(const uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	if ((uintptr_t) addr % sizeof(*addr))
+		return -E_INVAL;
+	user_mem_assert(curenv, addr, sizeof(*addr), PTE_U);
+	if (*(const volatile uint32_t *) addr != expected)
+		return -E_WOULD_BLOCK;
+	// Sleep on the frame the waker will write, not the zero page
+	if (page_cow_break(curenv->env_pgdir, addr) < 0)
+		return -E_NO_MEM;
+	futex_sleep(futex_key(curenv, addr), timeout);
+}
+
+// Put curenv to sleep on physical address pa until futex_wake_pa, or
+// for at most 'timeout' milliseconds if that is not 0.  Returns 0 to
+// curenv once woken, -E_TIMEOUT if the timeout passed first.
+void
+futex_sleep(physaddr_t pa, uint32_t timeout)
+{
+	struct FutexChain *fc;
+
+	curenv->env_futex_pa = pa;
+	fc = futex_chain(pa);
+	curenv->env_futex_next = NULL;
+	if (fc->fc_tail)
+		fc->fc_tail->env_futex_next = curenv;
+	else
+		fc->fc_head = curenv;
+	fc->fc_tail = curenv;
+	if (timeout)
+	{
+		// 0 means no deadline, so a deadline of 0 becomes 1
+		curenv->env_futex_deadline = (time_msec() + timeout) | 1;
+		futex_ntimed++;
+	}
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Wake up to n environments asleep on physical address pa, oldest
+// first.  Returns how many.
+int
+futex_wake_pa(physaddr_t pa, uint32_t n)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	for (e = futex_chain(pa)->fc_head; e && woken < n; e = next)
+	{
+		next = e->env_futex_next;
+		if (e->env_futex_pa == pa)
+		{
+			futex_resume(e, 0);
+			woken++;
+		}
+	}
+	return woken;
+}
+
+// Wake up to n environments asleep on 'addr' in curenv's address space.
+// Returns how many, or < 0 on error.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned.
+// The environment is destroyed if addr is not readable.
+int
+futex_wake(const uint32_t *addr, uint32_t n)
+{
+	if ((uintptr_t) addr % sizeof(*addr))
+		return -E_INVAL;
+	user_mem_assert(curenv, addr, sizeof(*addr), PTE_U);
+	return futex_wake_pa(futex_key(curenv, addr), n);
+}
+
+// Called on every tick of the clock: time out sleepers whose deadline
+// has passed.
+void
+futex_tick(void)
+{
+	struct Env *e, *next;
+	uint32_t now, i;
+
+	if (futex_ntimed == 0)
+		return;
+	now = time_msec();
+	for (i = 0; i < FUTEX_NHASH && futex_ntimed > 0; i++)
+		for (e = futex_chains[i].fc_head; e; e = next)
+		{
+			next = e->env_futex_next;
+			if (e->env_futex_deadline && (int32_t) (now - e->env_futex_deadline) >= 0)
+				futex_resume(e, -E_TIMEOUT);
+		}
+}
+
+// Called when e is freed: take it off its chain if it is asleep.
+void
+futex_env_free(struct Env *e)
+{
+	if (e->env_futex_pa)
+		futex_unlink(e);
+}
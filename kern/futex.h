@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int futex_wait(const uint32_t *addr, uint32_t expected, uint32_t timeout);
+int futex_wake(const uint32_t *addr, uint32_t n);
+int futex_wake_pa(physaddr_t pa, uint32_t n);
+void futex_sleep(physaddr_t pa, uint32_t timeout) __attribute__((noreturn));
+void futex_tick(void);
+void futex_env_free(struct Env *e);
+
+#endif /* !JOS_KERN_FUTEX_H */
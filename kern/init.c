@@ -12,14 +12,21 @@
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/ioapic.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/trace.h>
+#include <kern/sysstat.h>
+#include <kern/kdebug.h>
 #include "e1000.h"
 
 static void boot_aps(void);
 
+// The CR4 that mpentry.S gives the APs before loading kern_pgdir
+uint32_t mpentry_cr4;
+
 // Test the stack backtrace function (lab 1 only)
 void
 test_backtrace(int x)
@@ -35,6 +42,10 @@ test_backtrace(int x)
 void
 i386_init(void)
 {
+	// We are cpus[0] until mp_init tells us otherwise, and thiscpu
+	// (which even spinlocks use) needs %gs set up.
+	percpu_init(0);
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -43,6 +54,7 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kdebug_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -51,9 +63,12 @@ i386_init(void)
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
+	trace_init();
+	sysstat_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
+	ioapic_init();
 
 	// Lab 6 hardware initialization functions
 	time_init();
@@ -84,15 +99,13 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// From here on the serial port's interrupt drains console output
+	cons_start_async();
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
 
-// While boot_aps is booting a given CPU, it communicates the per-core
-// stack pointer that should be loaded by mpentry.S to that CPU in
-// this variable.
-void *mpentry_kstack;
-
 // Start the non-boot (AP) processors.
 static void
 boot_aps(void)
@@ -104,29 +117,28 @@ boot_aps(void)
 	// Write entry code to unused memory at MPENTRY_PADDR
 	code = KADDR(MPENTRY_PADDR);
 	memmove(code, mpentry_start, mpentry_end - mpentry_start);
-
-	// Boot each AP one at a time
+	mpentry_cr4 = rcr4();
+	// Give each AP mp_init found a kernel stack
+	mem_init_mp();
+
+	// Start all the APs at mpentry_start together; mpentry.S finds
+	// each its own stack
+	lapic_startaps(PADDR(code));
+	// Wait for them to finish some basic setup in mp_main()
 	for (c = cpus; c < cpus + ncpu; c++)
-	{
-		if (c == cpus + cpunum())  // We've started already.
-			continue;
-
-		// Tell mpentry.S what stack to use 
-		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
-		// Start the CPU at mpentry_start
-		lapic_startap(c->cpu_id, PADDR(code));
-		// Wait for the CPU to finish some basic setup in mp_main()
-		while (c->cpu_status != CPU_STARTED);
-	}
+		while (c != cpus + cpunum() && c->cpu_status != CPU_STARTED)
+			/* do nothing */;
 }
 
 // Setup code for APs
 void
 mp_main(void)
 {
-	// We are in high EIP now, safe to switch to kern_pgdir 
-	lcr3(PADDR(kern_pgdir));
+	// mpentry.S has put us on kern_pgdir and our own stack.  The
+	// BSP mapped the local APIC, so we can ask it who we are.
+	percpu_init(lapic_id());
 	cprintf("SMP: CPU %d starting\n", cpunum());
+	pat_init_percpu();
 
 	lapic_init();
 	env_init_percpu();
@@ -0,0 +1,146 @@
+// The I/O APIC, which delivers device interrupts to any CPU's local
+// APIC, where the 8259A can only interrupt the boot CPU.
+// See the 82093AA I/O APIC datasheet.
+//
+// Once ioapic_init finds one in the MP tables, it takes over from the
+// 8259A, which is left fully masked: each IRQ the kernel enables is
+// steered to one CPU, the boot CPU unless ioapic_route moves it, and
+// acknowledged at the local APIC (see irq_eoi).  Only the first IOAPIC
+// is used; its first 16 inputs carry the legacy IRQs.
+// All of this is protected by the big kernel lock, or runs before the
+// other CPUs start.
+
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/ioapic.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+// Direct registers, as uint32_t[] indices
+#define IOREGSEL        (0x00/4)        // Register select
+#define IOWIN           (0x10/4)        // Data window
+
+// Indirect registers
+#define IOAPICVER       0x01            // Version; max redirection entry
+#define IOREDTBL        0x10            // Redirection table, 2 per pin
+
+// Redirection table entry, low word
+#define RED_MASKED      0x00010000      // Interrupt masked
+#define RED_LEVEL       0x00008000      // Level-triggered (vs edge)
+#define RED_ACTIVELOW   0x00002000      // Active low (vs high)
+// ... high word: physical destination APIC ID in bits 24-31
+
+physaddr_t ioapicaddr;
+uint8_t ioapicid;
+struct IoapicRoute ioapic_routes[MAX_IRQS];
+
+static volatile uint32_t *ioapic;
+static uint32_t ioapic_npins;
+// The CPU each IRQ is steered to
+static uint8_t ioapic_cpu[MAX_IRQS];
+
+static uint32_t
+ioapic_read(uint32_t reg)
+{
+	ioapic[IOREGSEL] = reg;
+	return ioapic[IOWIN];
+}
+
+static void
+ioapic_write(uint32_t reg, uint32_t val)
+{
+	ioapic[IOREGSEL] = reg;
+	ioapic[IOWIN] = val;
+}
+
+// Program irq's pin: its vector, trigger, polarity and CPU, masked or
+// not.
+static void
+ioapic_program(int irq, bool masked)
+{
+	struct IoapicRoute *r = &ioapic_routes[irq];
+	uint32_t lo = IRQ_OFFSET + irq;
+
+	if (r->ir_level)
+		lo |= RED_LEVEL;
+	if (r->ir_active_low)
+		lo |= RED_ACTIVELOW;
+	if (masked)
+		lo |= RED_MASKED;
+	// Mask first, so the pin never fires half-programmed
+	ioapic_write(IOREDTBL + 2 * r->ir_pin, RED_MASKED);
+	ioapic_write(IOREDTBL + 2 * r->ir_pin + 1, cpus[ioapic_cpu[irq]].cpu_id << 24);
+	ioapic_write(IOREDTBL + 2 * r->ir_pin, lo);
+}
+
+void
+ioapic_init(void)
+{
+	uint32_t pin;
+	int irq;
+	uint16_t enabled = ~irq_mask_8259A & ~(1 << IRQ_SLAVE);
+
+	if (!ioapicaddr)
+		return;
+	ioapic = mmio_map_region(ioapicaddr, PGSIZE);
+	ioapic_npins = ((ioapic_read(IOAPICVER) >> 16) & 0xFF) + 1;
+
+	for (pin = 0; pin < ioapic_npins; pin++)
+		ioapic_write(IOREDTBL + 2 * pin, RED_MASKED);
+	for (irq = 0; irq < MAX_IRQS; irq++)
+	{
+		if (!ioapic_routes[irq].ir_known)
+		{
+			ioapic_routes[irq].ir_pin = irq;
+			ioapic_routes[irq].ir_level = false;
+			ioapic_routes[irq].ir_active_low = false;
+		}
+		ioapic_cpu[irq] = bootcpu - cpus;
+	}
+
+	// Take over the IRQs already enabled at the 8259A, and mask it.
+	irq_setmask_8259A(0xFFFF);
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if (enabled & (1 << irq))
+			ioapic_enable(irq);
+	cprintf("ioapic: %d pins at %p, id %d\n", ioapic_npins, ioapicaddr, ioapicid);
+}
+
+// Is the IOAPIC in charge of device interrupts?
+bool
+ioapic_active(void)
+{
+	return ioapic != NULL;
+}
+
+void
+ioapic_enable(int irq)
+{
+	if (ioapic_routes[irq].ir_pin < ioapic_npins)
+		ioapic_program(irq, false);
+}
+
+void
+ioapic_disable(int irq)
+{
+	if (ioapic_routes[irq].ir_pin < ioapic_npins)
+		ioapic_write(IOREDTBL + 2 * ioapic_routes[irq].ir_pin, RED_MASKED);
+}
+
+// Steer irq to CPU 'cpu' (an index into cpus[]) from now on.  Cheap
+// when it already goes there, so that drivers can call this each time
+// they wait.
+void
+ioapic_route(int irq, int cpu)
+{
+	uint32_t lo;
+
+	if (!ioapic || cpu < 0 || cpu >= ncpu || ioapic_cpu[irq] == cpu)
+		return;
+	ioapic_cpu[irq] = cpu;
+	if (ioapic_routes[irq].ir_pin >= ioapic_npins)
+		return;
+	lo = ioapic_read(IOREDTBL + 2 * ioapic_routes[irq].ir_pin);
+	ioapic_program(irq, (lo & RED_MASKED) != 0);
+}
@@ -0,0 +1,32 @@
+#ifndef JOS_KERN_IOAPIC_H
+#define JOS_KERN_IOAPIC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/picirq.h>
+
+// How IRQ i (numbered as on the 8259A, and taken at IRQ_OFFSET + i)
+// reaches the IOAPIC, as the MP tables describe it.  IRQs they leave
+// out come in on the pin of the same number, edge-triggered and active
+// high, as ISA interrupts do.
+struct IoapicRoute {
+	bool ir_known;          // The MP tables describe this IRQ
+	uint8_t ir_pin;         // IOAPIC input
+	bool ir_level;          // Level-triggered (PCI), not edge (ISA)
+	bool ir_active_low;
+};
+
+// Initialized in mpconfig.c
+extern physaddr_t ioapicaddr;   // Physical MMIO address of the IOAPIC, or 0
+extern uint8_t ioapicid;
+extern struct IoapicRoute ioapic_routes[MAX_IRQS];
+
+void ioapic_init(void);
+bool ioapic_active(void);
+void ioapic_enable(int irq);
+void ioapic_disable(int irq);
+void ioapic_route(int irq, int cpu);
+
+#endif /* !JOS_KERN_IOAPIC_H */
@@ -1,6 +1,9 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/*
+ * Support for reading the NVRAM from the real-time clock, and for
+ * timing short intervals with channel 2 of the PIT.
+ */
 
 #include <inc/x86.h>
 
@@ -20,3 +23,28 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC + 1, datum);
 }
+
+// Start PIT channel 2 counting down 'usec' microseconds (at most about
+// 54ms, the longest interval its 16-bit counter holds).  Channel 2 is
+// the speaker channel: it interrupts nothing, and port B reports
+// when its count runs out, which makes it usable as a stopwatch
+// before the LAPIC timer is calibrated.
+void
+pit_wait_start(unsigned usec)
+{
+	uint32_t count = (uint64_t) TIMER_FREQ * usec / 1000000;
+
+	// Open the gate; keep the speaker disconnected.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+	// Channel 2, low then high byte, mode 0 (interrupt on terminal count)
+	outb(IO_TIMER + 3, 0xb0);
+	outb(IO_TIMER + 2, count & 0xff);
+	outb(IO_TIMER + 2, (count >> 8) & 0xff);
+}
+
+// Has the interval started by pit_wait_start() elapsed?
+bool
+pit_wait_done(void)
+{
+	return (inb(IO_PORTB) & 0x20) != 0;
+}
@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define    IO_RTC        0x070        /* RTC port */
 
 #define    MC_NVRAM_START    0xe    /* start of NVRAM: offset 14 */
@@ -23,7 +25,14 @@
 #define NVRAM_EXT16LO    (MC_NVRAM_START + 38)    /* low byte; RTC off. 0x34 */
 #define NVRAM_EXT16HI    (MC_NVRAM_START + 39)    /* high byte; RTC off. 0x35 */
 
+#define    IO_TIMER      0x040        /* 8253/8254 PIT ports */
+#define    IO_PORTB      0x061        /* Keyboard controller port B */
+#define    TIMER_FREQ    1193182      /* PIT input clock, in Hz */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
+void pit_wait_start(unsigned usec);
+bool pit_wait_done(void);
+
 #endif    // !JOS_KERN_KCLOCK_H
@@ -19,6 +19,18 @@ struct UserStabData {
 	const char *stabstr_end;
 };
 
+// One kernel function in the symbol index (see kdebug_init)
+struct KdebugFn {
+	uintptr_t kf_addr;
+	uint32_t kf_size;           // 0 if the stabs don't say: up to the next
+	uint32_t kf_strx;           // Name, in the stab string table
+	uint16_t kf_namelen;
+	uint16_t kf_narg;
+};
+
+static struct KdebugFn *kfns;
+static uint32_t nkfns;
+
 
 // stab_binsearch(stabs, region_left, region_right, type, addr)
 //
@@ -247,3 +259,95 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 	return 0;
 }
+
+// Build the kernel's symbol index: every N_FUN stab's function, sorted
+// by address, so that debuginfo_fn finds one with a single binary
+// search instead of debuginfo_eip's three.  Without memory for it,
+// debuginfo_fn falls back on debuginfo_eip.
+void
+kdebug_init(void)
+{
+	const struct Stab *st, *p;
+	struct PageInfo *pp;
+	struct KdebugFn *kf, tmp;
+	uint32_t n = 0, i, j, order = 0;
+
+	for (st = __STAB_BEGIN__; st < __STAB_END__; st++)
+		if (st->n_type == N_FUN && __STABSTR_BEGIN__[st->n_strx] != '\0')
+			n++;
+	while (order < BUDDY_MAX_ORDER && (PGSIZE << order) < n * sizeof(struct KdebugFn))
+		order++;
+	if (n == 0 || !(pp = page_alloc_order(order, 0)))
+		return;
+	pp->pp_ref++;
+	kfns = page2kva(pp);
+
+	for (st = __STAB_BEGIN__; st < __STAB_END__ && nkfns < n; st++)
+	{
+		if (st->n_type != N_FUN || __STABSTR_BEGIN__[st->n_strx] == '\0')
+			continue;
+		kf = &kfns[nkfns++];
+		kf->kf_addr = st->n_value;
+		kf->kf_size = 0;
+		kf->kf_strx = st->n_strx;
+		kf->kf_namelen = strfind(__STABSTR_BEGIN__ + st->n_strx, ':') -
+			(__STABSTR_BEGIN__ + st->n_strx);
+		kf->kf_narg = 0;
+		// The parameters follow; newer compilers end the function
+		// with a nameless N_FUN holding its size
+		for (p = st + 1; p < __STAB_END__ && p->n_type != N_FUN; p++)
+			if (p->n_type == N_PSYM && p == st + 1 + kf->kf_narg)
+				kf->kf_narg++;
+		if (p < __STAB_END__ && __STABSTR_BEGIN__[p->n_strx] == '\0')
+			kf->kf_size = p->n_value;
+	}
+
+	// The stabs come in link order, which is nearly sorted already
+	for (i = 1; i < nkfns; i++)
+		for (j = i; j > 0 && kfns[j].kf_addr < kfns[j - 1].kf_addr; j--)
+		{
+			tmp = kfns[j];
+			kfns[j] = kfns[j - 1];
+			kfns[j - 1] = tmp;
+		}
+}
+
+// Fill in the function fields of *info for the kernel address eip,
+// from the symbol index: cheap enough for the profiler's sample path.
+// The file and line are left unknown.  Returns 0 if eip is in a known
+// function, and negative if not, like debuginfo_eip.
+int
+debuginfo_fn(uintptr_t eip, struct Eipdebuginfo *info)
+{
+	const struct KdebugFn *kf;
+	uint32_t lo = 0, hi = nkfns, mid;
+
+	if (!kfns)
+		return debuginfo_eip(eip, info);
+	info->eip_file = "<unknown>";
+	info->eip_line = 0;
+	info->eip_fn_name = "<unknown>";
+	info->eip_fn_namelen = 9;
+	info->eip_fn_addr = eip;
+	info->eip_fn_narg = 0;
+
+	// Find the last function starting at or below eip
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (kfns[mid].kf_addr <= eip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
+	kf = &kfns[lo - 1];
+	if (kf->kf_size && eip >= kf->kf_addr + kf->kf_size)
+		return -1;
+	info->eip_fn_name = __STABSTR_BEGIN__ + kf->kf_strx;
+	info->eip_fn_namelen = kf->kf_namelen;
+	info->eip_fn_addr = kf->kf_addr;
+	info->eip_fn_narg = kf->kf_narg;
+	return 0;
+}
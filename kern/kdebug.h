@@ -16,5 +16,7 @@ struct Eipdebuginfo {
 };
 
 int debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info);
+void kdebug_init(void);
+int debuginfo_fn(uintptr_t eip, struct Eipdebuginfo *info);
 
 #endif
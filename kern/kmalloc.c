@@ -0,0 +1,260 @@
+// Kernel slab allocator.
+//
+// kmalloc hands out objects of KMALLOC_MIN to KMALLOC_MAX bytes from
+// power-of-two size classes.  Each class carves whole pages ("slabs")
+// into equal objects; a slab's header sits at the start of its page,
+// so kfree finds it, and the object's size, by rounding the pointer
+// down.  Objects are aligned to their size, up to the page, so anything
+// of 64 bytes or more starts on a cache line of its own.
+//
+// Like the page allocator's per-CPU page caches, each CPU keeps up to
+// KMCACHE_MAX free objects of each class and moves KMCACHE_BATCH at a
+// time to or from the slabs, so most kmalloc/kfree calls take no lock.
+// The caches are only touched by their own CPU, with interrupts off.
+// kmalloc_lock protects the slabs.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMALLOC_NCLASS  7       // 16, 32, ..., 1024
+#define CLASS_SIZE(c)   (KMALLOC_MIN << (c))
+
+#define KMCACHE_MAX     16
+#define KMCACHE_BATCH   8
+
+// Keep at most this many empty slabs of a class before returning them
+// to the page allocator.
+#define SLAB_EMPTY_MAX  1
+
+struct Slab {
+	struct Slab *sl_next;           // On its class's list of slabs
+	struct Slab **sl_pprev;         //   with free objects
+	void *sl_free;                  // Free objects, linked by first word
+	uint16_t sl_inuse;              // Objects handed out, or cached
+	uint16_t sl_class;
+};
+
+// The header takes the first object's place in classes of 64 bytes and
+// up, and the first 64 bytes of the page in smaller ones.
+#define SLAB_HDRSIZE    64
+
+struct KmClass {
+	struct Slab *kc_partial;        // Slabs with free objects
+	uint32_t kc_nslabs;
+	uint32_t kc_nempty;             // Slabs with no objects in use
+};
+
+struct KmCache {
+	uint32_t kmc_len;
+	void *kmc_objs[KMCACHE_MAX];
+};
+
+static struct KmClass kmclass[KMALLOC_NCLASS];
+static struct KmCache kmcache[NCPU][KMALLOC_NCLASS];
+static struct spinlock kmalloc_lock = SPINLOCK_INIT(kmalloc_lock);
+
+// The size class of a size-byte object
+static int
+kmalloc_class(size_t size)
+{
+	int c = 0;
+
+	while (CLASS_SIZE(c) < size)
+		c++;
+	return c;
+}
+
+// Offset of the first object in a slab of class c
+static size_t
+slab_first(int c)
+{
+	return MAX(SLAB_HDRSIZE, CLASS_SIZE(c));
+}
+
+static void
+slab_link(struct KmClass *kc, struct Slab *sl)
+{
+	sl->sl_next = kc->kc_partial;
+	sl->sl_pprev = &kc->kc_partial;
+	if (kc->kc_partial)
+		kc->kc_partial->sl_pprev = &sl->sl_next;
+	kc->kc_partial = sl;
+}
+
+static void
+slab_unlink(struct Slab *sl)
+{
+	*sl->sl_pprev = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_pprev = sl->sl_pprev;
+	sl->sl_next = NULL;
+	sl->sl_pprev = NULL;
+}
+
+// Carve a fresh page into a slab of class c.  Call with kmalloc_lock.
+static struct Slab *
+slab_new(int c)
+{
+	struct KmClass *kc = &kmclass[c];
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *obj;
+	size_t off;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_ref++;
+	sl = page2kva(pp);
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+	sl->sl_class = c;
+	for (off = PGSIZE - CLASS_SIZE(c); off >= slab_first(c); off -= CLASS_SIZE(c))
+	{
+		obj = (char *) sl + off;
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	kc->kc_nslabs++;
+	kc->kc_nempty++;
+	slab_link(kc, sl);
+	return sl;
+}
+
+// Move up to KMCACHE_BATCH objects of class c from the slabs into kmc.
+static void
+kmcache_refill(struct KmCache *kmc, int c)
+{
+	struct KmClass *kc = &kmclass[c];
+	struct Slab *sl;
+
+	spin_lock(&kmalloc_lock);
+	while (kmc->kmc_len < KMCACHE_BATCH)
+	{
+		if (!(sl = kc->kc_partial) && !(sl = slab_new(c)))
+			break;
+		if (sl->sl_inuse++ == 0)
+			kc->kc_nempty--;
+		kmc->kmc_objs[kmc->kmc_len++] = sl->sl_free;
+		sl->sl_free = *(void **) sl->sl_free;
+		if (!sl->sl_free)
+			slab_unlink(sl);
+	}
+	spin_unlock(&kmalloc_lock);
+}
+
+// Return the object p to its slab.  Call with kmalloc_lock.
+static void
+slab_put(void *p)
+{
+	struct Slab *sl = ROUNDDOWN(p, PGSIZE);
+	struct KmClass *kc = &kmclass[sl->sl_class];
+
+	if (!sl->sl_free)
+		slab_link(kc, sl);
+	*(void **) p = sl->sl_free;
+	sl->sl_free = p;
+	if (--sl->sl_inuse == 0 && ++kc->kc_nempty > SLAB_EMPTY_MAX)
+	{
+		slab_unlink(sl);
+		kc->kc_nslabs--;
+		kc->kc_nempty--;
+		page_decref(pa2page(PADDR(sl)));
+	}
+}
+
+// Return KMCACHE_BATCH objects from kmc to their slabs.
+static void
+kmcache_drain(struct KmCache *kmc)
+{
+	uint32_t n;
+
+	spin_lock(&kmalloc_lock);
+	for (n = 0; n < KMCACHE_BATCH && kmc->kmc_len > 0; n++)
+		slab_put(kmc->kmc_objs[--kmc->kmc_len]);
+	spin_unlock(&kmalloc_lock);
+}
+
+//
+// Allocate size bytes of kernel memory, aligned to size rounded up to
+// a power of two (and at most to PGSIZE).  alloc_flags are page_alloc's;
+// ALLOC_ZERO clears the object and ALLOC_HIGH is ignored.
+//
+// Returns NULL if out of memory, or if size is 0 or over KMALLOC_MAX.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmCache *kmc;
+	void *p;
+	int c;
+
+	if (size == 0 || size > KMALLOC_MAX)
+		return NULL;
+	c = kmalloc_class(size);
+	kmc = &kmcache[cpunum()][c];
+	if (kmc->kmc_len == 0)
+		kmcache_refill(kmc, c);
+	if (kmc->kmc_len == 0)
+		return NULL;
+	p = kmc->kmc_objs[--kmc->kmc_len];
+	if (alloc_flags & ALLOC_ZERO)
+		memset(p, 0, CLASS_SIZE(c));
+	return p;
+}
+
+//
+// Free p, which came from kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct Slab *sl;
+	struct KmCache *kmc;
+
+	if (p == NULL)
+		return;
+	sl = ROUNDDOWN(p, PGSIZE);
+	assert(sl->sl_class < KMALLOC_NCLASS &&
+		   PGOFF(p) >= slab_first(sl->sl_class) &&
+		   PGOFF(p) % CLASS_SIZE(sl->sl_class) == 0);
+	kmc = &kmcache[cpunum()][sl->sl_class];
+	if (kmc->kmc_len >= KMCACHE_MAX)
+		kmcache_drain(kmc);
+	kmc->kmc_objs[kmc->kmc_len++] = p;
+}
+
+void
+kmalloc_print_stats(void)
+{
+	uint32_t cached;
+	int c, i;
+
+	static_assert(KMALLOC_MAX == CLASS_SIZE(KMALLOC_NCLASS - 1));
+	static_assert(sizeof(struct Slab) <= SLAB_HDRSIZE);
+	cprintf("%6s %6s %6s %6s %6s\n", "size", "slabs", "empty", "inuse", "cached");
+	spin_lock(&kmalloc_lock);
+	for (c = 0; c < KMALLOC_NCLASS; c++)
+	{
+		struct KmClass *kc = &kmclass[c];
+		uint32_t free = 0;
+		struct Slab *sl;
+		void *p;
+
+		for (sl = kc->kc_partial; sl; sl = sl->sl_next)
+			for (p = sl->sl_free; p; p = *(void **) p)
+				free++;
+		for (cached = 0, i = 0; i < ncpu; i++)
+			cached += kmcache[i][c].kmc_len;
+		cprintf("%6u %6u %6u %6u %6u\n", CLASS_SIZE(c), kc->kc_nslabs,
+				kc->kc_nempty,
+				kc->kc_nslabs * ((PGSIZE - slab_first(c)) / CLASS_SIZE(c)) - free - cached,
+				cached);
+	}
+	spin_unlock(&kmalloc_lock);
+}
@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Smallest and largest kmalloc sizes.  Bigger objects take whole pages
+// from page_alloc_order.
+#define KMALLOC_MIN	16
+#define KMALLOC_MAX	1024
+
+void *kmalloc(size_t size, int alloc_flags);
+void kfree(void *p);
+void kmalloc_print_stats(void);
+
+#endif /* !JOS_KERN_KMALLOC_H */
@@ -0,0 +1,306 @@
+// Same-page merging.
+//
+// When enabled (sys_ksm), idle CPUs scan the user pages of environments
+// that are not running, a batch at a time, looking for pages with the
+// same contents.  Each match is merged: every mapping is pointed at
+// one frame, read-only and PTE_COW if it was writable, and the copies
+// are freed.  A write to a merged page faults and page_cow_resolve
+// gives the writer a copy of its own again.
+//
+// Pages are found by a hash of their contents, and merged only after a
+// memcmp says they really are equal.  Two tables hold the hashes:
+//
+// - The stable table holds frames already merged.  It keeps a reference
+//   to each, so a frame stays put until every mapping of it is gone;
+//   the start of each pass drops the frames no one else maps any more.
+// - The unstable table remembers, by environment and address, pages
+//   seen once this pass and not yet matched.  It is only a hint: its
+//   pages are looked up and compared again on a match, and it is
+//   cleared at the start of each pass.
+//
+// A page written since the last pass is not worth merging, since it is
+// likely to be written again; the scanner clears PTE_D on each page it
+// passes and skips those it finds dirty.
+//
+// Everything here runs under the kernel lock, which keeps environments
+// that are not ENV_RUNNING from starting while their pages move.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/error.h>
+
+#include <kern/ksm.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/time.h>
+
+// Pages hashed, and page table entries looked at, per ksm_scan call,
+// and the least time between calls
+#define KSM_BATCH       32
+#define KSM_STEPS       4096
+#define KSM_INTERVAL_MS 10
+
+#define KSM_STABLE_BUCKETS  256
+#define KSM_UNSTABLE_SIZE   1024
+
+struct KsmNode {
+	struct KsmNode *kn_next;
+	uint32_t kn_hash;
+	struct PageInfo *kn_page;
+};
+
+struct KsmHint {
+	uint32_t kh_hash;
+	envid_t kh_envid;               // 0 if the slot is empty
+	uintptr_t kh_va;
+};
+
+static bool ksm_enabled;
+static struct KsmNode *ksm_stable[KSM_STABLE_BUCKETS];
+static struct KsmHint ksm_unstable[KSM_UNSTABLE_SIZE];
+static uint32_t ksm_stable_count;
+static uint32_t ksm_full_scans;
+static uint64_t ksm_scanned;
+static unsigned ksm_last_msec;
+
+// Where the scan goes on from: an index into envs[] and a user address
+static uint32_t ksm_env;
+static uintptr_t ksm_va;
+
+static uint32_t
+ksm_hash(struct PageInfo *pp)
+{
+	const uint32_t *w = page_kmap(pp, KMAP_SRC);
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ w[i]) * 16777619U;
+	return h;
+}
+
+static bool
+ksm_same(struct PageInfo *a, struct PageInfo *b)
+{
+	return memcmp(page_kmap(a, KMAP_SRC), page_kmap(b, KMAP_DST), PGSIZE) == 0;
+}
+
+// The permissions a mapping gets once its frame is shared
+static int
+ksm_perm(pte_t pte)
+{
+	int perm = pte & PTE_SYSCALL & ~PTE_D;
+
+	if (perm & (PTE_W | PTE_COW))
+		perm = (perm & ~PTE_W) | PTE_COW;
+	return perm;
+}
+
+// Can env e's pages be moved?  Not while it runs, and not if threads
+// share its page directory, since one of them may be running.  Nor
+// if it has I/O privilege: such a driver may have handed a frame's
+// physical address to a device (see sys_page_paddr), which goes on
+// reading or writing that frame with nothing holding a reference.
+static bool
+ksm_env_ok(struct Env *e)
+{
+	return e->env_status != ENV_FREE && e->env_status != ENV_DYING &&
+		   e->env_status != ENV_RUNNING && e->env_pgdir != NULL &&
+		   (e->env_tf.tf_eflags & FL_IOPL_MASK) == 0 &&
+		   pa2page(PADDR(e->env_pgdir))->pp_ref == 1;
+}
+
+// The frame at va in pgdir, if it may be merged: a user page that is
+// private, not pinned by anyone else or waited on, and not written
+// since the last look.  Clears PTE_D for the next look.
+static struct PageInfo *
+ksm_candidate(pde_t *pgdir, uintptr_t va, pte_t **pte_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS | PTE_COW)) != PTE_P)
+		return NULL;
+	if (!(pp = page_lookup(pgdir, (void *) va, &pte)) ||
+		(*pte & (PTE_U | PTE_SHARE)) != PTE_U ||
+		pp == zero_page || pp->pp_ref != 1 || pp->pp_waiters != 0)
+		return NULL;
+	if (*pte & PTE_D)
+	{
+		*pte &= ~PTE_D;
+		tlb_invalidate(pgdir, (void *) va);
+		return NULL;
+	}
+	*pte_store = pte;
+	return pp;
+}
+
+// Point va in pgdir at the shared frame pp.
+static void
+ksm_merge(pde_t *pgdir, uintptr_t va, pte_t pte, struct PageInfo *pp)
+{
+	// page_insert only fails allocating a page table, which is present
+	if (page_insert(pgdir, pp, (void *) va, ksm_perm(pte)) < 0)
+		panic("ksm_merge: page_insert");
+}
+
+// Look for pp's contents among the merged frames, and merge with one.
+static bool
+ksm_stable_merge(pde_t *pgdir, uintptr_t va, pte_t *pte, struct PageInfo *pp,
+				 uint32_t hash)
+{
+	struct KsmNode *kn;
+
+	for (kn = ksm_stable[hash % KSM_STABLE_BUCKETS]; kn; kn = kn->kn_next)
+		if (kn->kn_hash == hash && ksm_same(kn->kn_page, pp))
+		{
+			ksm_merge(pgdir, va, *pte, kn->kn_page);
+			return true;
+		}
+	return false;
+}
+
+// Look for pp's contents among the pages seen once this pass.  On a
+// match, make that page the shared frame, then merge pp with it.
+// Otherwise, remember pp.
+static void
+ksm_unstable_merge(struct Env *e, uintptr_t va, pte_t *pte,
+				   struct PageInfo *pp, uint32_t hash)
+{
+	struct KsmHint *kh = &ksm_unstable[hash % KSM_UNSTABLE_SIZE];
+	struct PageInfo *other;
+	struct KsmNode *kn;
+	struct Env *oe;
+	pte_t *opte;
+
+	if (kh->kh_envid == 0 || kh->kh_hash != hash ||
+		(kh->kh_envid == e->env_id && kh->kh_va == va) ||
+		envid2env(kh->kh_envid, &oe, false) < 0 || !ksm_env_ok(oe) ||
+		!(other = ksm_candidate(oe->env_pgdir, kh->kh_va, &opte)) ||
+		!ksm_same(other, pp) ||
+		!(kn = kmalloc(sizeof(*kn), 0)))
+	{
+		kh->kh_hash = hash;
+		kh->kh_envid = e->env_id;
+		kh->kh_va = va;
+		return;
+	}
+
+	kh->kh_envid = 0;
+	*opte = PTE_ADDR(*opte) | ksm_perm(*opte) | PTE_P;
+	tlb_invalidate(oe->env_pgdir, (void *) kh->kh_va);
+	other->pp_ref++;
+	kn->kn_hash = hash;
+	kn->kn_page = other;
+	kn->kn_next = ksm_stable[hash % KSM_STABLE_BUCKETS];
+	ksm_stable[hash % KSM_STABLE_BUCKETS] = kn;
+	ksm_stable_count++;
+	ksm_merge(e->env_pgdir, va, *pte, other);
+}
+
+// Start a new pass: forget the unstable table, and let go of merged
+// frames that only the stable table still holds.
+static void
+ksm_new_pass(void)
+{
+	struct KsmNode **pkn, *kn;
+	int i;
+
+	memset(ksm_unstable, 0, sizeof(ksm_unstable));
+	for (i = 0; i < KSM_STABLE_BUCKETS; i++)
+		for (pkn = &ksm_stable[i]; (kn = *pkn) != NULL; )
+		{
+			if (kn->kn_page->pp_ref > 1)
+			{
+				pkn = &kn->kn_next;
+				continue;
+			}
+			*pkn = kn->kn_next;
+			page_decref(kn->kn_page);
+			kfree(kn);
+			ksm_stable_count--;
+		}
+}
+
+//
+// Scan the next batch of pages, if merging is on and the last batch was
+// long enough ago.  sched_halt calls this, with the kernel lock held,
+// before the CPU goes idle.
+//
+void
+ksm_scan(void)
+{
+	struct PageInfo *pp;
+	struct Env *e;
+	pte_t *pte;
+	unsigned now;
+	int n = 0, steps = 0;
+
+	if (!ksm_enabled || (now = time_msec()) - ksm_last_msec < KSM_INTERVAL_MS)
+		return;
+	ksm_last_msec = now;
+
+	while (n < KSM_BATCH && steps++ < KSM_STEPS)
+	{
+		if (ksm_env >= nenv)
+		{
+			ksm_env = 0;
+			ksm_va = 0;
+			ksm_full_scans++;
+			ksm_new_pass();
+			break;
+		}
+		e = &envs[ksm_env];
+		// Stop short of the exception stacks, which the kernel writes
+		// on a fault
+		if (!ksm_env_ok(e) || ksm_va >= UTHREADS)
+		{
+			ksm_env++;
+			ksm_va = 0;
+			continue;
+		}
+		if (!(e->env_pgdir[PDX(ksm_va)] & PTE_P))
+		{
+			ksm_va = ROUNDDOWN(ksm_va, PTSIZE) + PTSIZE;
+			continue;
+		}
+
+		if ((pp = ksm_candidate(e->env_pgdir, ksm_va, &pte)) != NULL)
+		{
+			uint32_t hash = ksm_hash(pp);
+
+			if (!ksm_stable_merge(e->env_pgdir, ksm_va, pte, pp, hash))
+				ksm_unstable_merge(e, ksm_va, pte, pp, hash);
+			ksm_scanned++;
+			n++;
+		}
+		ksm_va += PGSIZE;
+	}
+}
+
+//
+// Turn merging on (enable > 0) or off (enable == 0), or leave it
+// (enable < 0), and fill in *st if st is not NULL.  Turning it off
+// leaves merged pages merged.
+//
+void
+ksm_control(int enable, struct KsmStats *st)
+{
+	struct KsmNode *kn;
+	int i;
+
+	if (enable >= 0)
+		ksm_enabled = enable;
+	if (st == NULL)
+		return;
+
+	memset(st, 0, sizeof(*st));
+	st->ks_enabled = ksm_enabled;
+	st->ks_pages_shared = ksm_stable_count;
+	for (i = 0; i < KSM_STABLE_BUCKETS; i++)
+		for (kn = ksm_stable[i]; kn; kn = kn->kn_next)
+			st->ks_pages_sharing += kn->kn_page->pp_ref - 1;
+	st->ks_full_scans = ksm_full_scans;
+	st->ks_pages_scanned = ksm_scanned;
+}
@@ -0,0 +1,12 @@
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/syscall.h>
+
+void ksm_scan(void);
+void ksm_control(int enable, struct KsmStats *st);
+
+#endif /* !JOS_KERN_KSM_H */
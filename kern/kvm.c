@@ -0,0 +1,226 @@
+// Paravirtual features of KVM.
+//
+// Under KVM the kernel finds the hypervisor's CPUID leaves and, on each
+// CPU, hands the hypervisor three pieces of memory to keep up to date:
+//
+// - kvmclock: a pvclock time record, from which kvm_clock_ns reads
+//   nanoseconds with one rdtsc and no exit, and which gives the TSC
+//   rate exactly rather than the PIT's estimate of it.
+// - PV EOI: a flag the hypervisor sets when the interrupt it injected
+//   needs no EOI, which saves lapic_eoi the exit an APIC write costs.
+// - steal time: the nanoseconds this virtual CPU was ready to run but
+//   the host ran something else, which time_tick uses so that a tick
+//   the hypervisor took away does not cost curenv its quantum.
+//
+// Each record is only written by the hypervisor for its own virtual
+// CPU, and only read by that CPU here, so none of it needs a lock.
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/kvm.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+#define CPUID_HYPERVISOR        (1U << 31)      // CPUID.1:ECX
+#define KVM_CPUID_SIGNATURE     0x40000000
+#define KVM_CPUID_FEATURES      0x40000001
+#define KVM_FEATURE_CLOCKSOURCE2 (1 << 3)
+#define KVM_FEATURE_STEAL_TIME  (1 << 5)
+#define KVM_FEATURE_PV_EOI      (1 << 6)
+
+#define MSR_KVM_SYSTEM_TIME_NEW 0x4b564d01
+#define MSR_KVM_STEAL_TIME      0x4b564d03
+#define MSR_KVM_PV_EOI_EN       0x4b564d04
+#define KVM_MSR_ENABLED         1
+
+// The hypervisor's time record.  It makes 'version' odd while it
+// rewrites the rest, like the seq of struct Uinfo.
+struct PvclockTime {
+	volatile uint32_t version;
+	uint32_t pad0;
+	uint64_t tsc_timestamp;
+	uint64_t system_time;           // Nanoseconds at tsc_timestamp
+	uint32_t tsc_to_system_mul;     // 32.32 fixed point ns per cycle,
+	int8_t tsc_shift;               // ... after shifting the cycles
+	uint8_t flags;
+	uint8_t pad[2];
+} __attribute__((packed));
+
+// The hypervisor's steal time record; it must be 64-byte aligned.
+struct KvmStealTime {
+	uint64_t steal;                 // Nanoseconds stolen, ever
+	volatile uint32_t version;
+	uint32_t flags;
+	uint8_t preempted;
+	uint8_t pad0[3];
+	uint32_t pad[11];
+};
+
+// One per CPU, aligned so that every steal record is.
+struct KvmCpu {
+	struct KvmStealTime steal;
+	struct PvclockTime clock;
+	uint32_t pv_eoi;                // Bit 0: the next EOI may be skipped
+	uint64_t steal_seen;            // Steal kvm_steal_ns has reported
+} __attribute__((aligned(64)));
+
+static struct KvmCpu kvm_cpu[NCPU];
+
+static uint32_t kvm_features;
+static bool kvm_clock_on, kvm_steal_on, kvm_pv_eoi_on;
+
+// Is this a KVM guest?  Then return its paravirtual feature bits.
+static uint32_t
+kvm_detect(void)
+{
+	uint32_t ecx, max, sig[3], eax;
+
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (!(ecx & CPUID_HYPERVISOR))
+		return 0;
+	cpuid(KVM_CPUID_SIGNATURE, &max, &sig[0], &sig[1], &sig[2]);
+	if (memcmp(sig, "KVMKVMKVM\0\0\0", sizeof(sig)) != 0 ||
+		max < KVM_CPUID_FEATURES)
+		return 0;
+	cpuid(KVM_CPUID_FEATURES, &eax, NULL, NULL, NULL);
+	return eax;
+}
+
+// Register this CPU's records with the hypervisor.  The boot CPU, which
+// gets here before the others start, decides which features every CPU
+// uses.
+void
+kvm_init_percpu(void)
+{
+	static bool detected;
+	struct KvmCpu *kc = &kvm_cpu[cpunum()];
+
+	static_assert(sizeof(struct KvmStealTime) == 64);
+	static_assert(sizeof(struct PvclockTime) == 32);
+	if (!detected)
+	{
+		detected = true;
+		kvm_features = kvm_detect();
+		kvm_clock_on = (kvm_features & KVM_FEATURE_CLOCKSOURCE2) != 0;
+		kvm_steal_on = (kvm_features & KVM_FEATURE_STEAL_TIME) != 0;
+		kvm_pv_eoi_on = (kvm_features & KVM_FEATURE_PV_EOI) != 0;
+		if (kvm_features)
+			cprintf("kvm: features %x:%s%s%s\n", kvm_features,
+					kvm_clock_on ? " kvmclock" : "",
+					kvm_steal_on ? " steal-time" : "",
+					kvm_pv_eoi_on ? " pv-eoi" : "");
+	}
+
+	if (kvm_clock_on)
+		wrmsr(MSR_KVM_SYSTEM_TIME_NEW, PADDR(&kc->clock) | KVM_MSR_ENABLED);
+	if (kvm_steal_on)
+	{
+		kc->steal_seen = kc->steal.steal;
+		wrmsr(MSR_KVM_STEAL_TIME, PADDR(&kc->steal) | KVM_MSR_ENABLED);
+	}
+	if (kvm_pv_eoi_on)
+	{
+		kc->pv_eoi = 0;
+		wrmsr(MSR_KVM_PV_EOI_EN, PADDR(&kc->pv_eoi) | KVM_MSR_ENABLED);
+	}
+}
+
+// Does kvm_clock_ns work?
+bool
+kvm_clock_ok(void)
+{
+	return kvm_clock_on;
+}
+
+// Scale TSC cycles to nanoseconds the way pvclock record ti says.
+static uint64_t
+pvclock_scale(uint64_t delta, const struct PvclockTime *ti)
+{
+	uint32_t mul = ti->tsc_to_system_mul;
+
+	if (ti->tsc_shift < 0)
+		delta >>= -ti->tsc_shift;
+	else
+		delta <<= ti->tsc_shift;
+	// (delta * mul) >> 32, without a 96-bit product
+	return ((delta & 0xFFFFFFFF) * mul >> 32) + (delta >> 32) * mul;
+}
+
+// The hypervisor's clock, in nanoseconds since it started, as seen by
+// this CPU.  Only meaningful if kvm_clock_ok().
+uint64_t
+kvm_clock_ns(void)
+{
+	struct PvclockTime *ti = &kvm_cpu[cpunum()].clock;
+	uint32_t version;
+	uint64_t ns;
+
+	do
+	{
+		version = ti->version;
+		barrier();
+		ns = ti->system_time + pvclock_scale(read_tsc() - ti->tsc_timestamp, ti);
+		barrier();
+	} while ((version & 1) || version != ti->version);
+	return ns;
+}
+
+// The TSC rate in kHz according to kvmclock, or 0 if there is none.
+uint32_t
+kvm_tsc_khz(void)
+{
+	struct PvclockTime *ti = &kvm_cpu[cpunum()].clock;
+	uint64_t khz = 1000000ULL << 32;
+
+	if (!kvm_clock_on || ti->tsc_to_system_mul == 0)
+		return 0;
+	if (ti->tsc_shift < 0)
+		khz <<= -ti->tsc_shift;
+	else
+		khz >>= ti->tsc_shift;
+	return khz / ti->tsc_to_system_mul;
+}
+
+// The hypervisor marked the interrupt being handled as needing no EOI:
+// clear the mark and return true, so that lapic_eoi can skip the APIC
+// write.  btr is a single instruction, so the hypervisor, which only
+// looks between instructions, cannot set the bit again half way.
+bool
+kvm_pv_eoi(void)
+{
+	uint8_t skip;
+
+	if (!kvm_pv_eoi_on)
+		return false;
+	asm volatile("btrl $0,%0; setc %1"
+				 : "+m" (kvm_cpu[cpunum()].pv_eoi), "=qm" (skip)
+				 : : "cc");
+	return skip;
+}
+
+// Nanoseconds the hypervisor has taken from this CPU since the last
+// call on it; 0 without steal time.
+uint64_t
+kvm_steal_ns(void)
+{
+	struct KvmCpu *kc = &kvm_cpu[cpunum()];
+	uint32_t version;
+	uint64_t steal, delta;
+
+	if (!kvm_steal_on)
+		return 0;
+	do
+	{
+		version = kc->steal.version;
+		barrier();
+		steal = kc->steal.steal;
+		barrier();
+	} while ((version & 1) || version != kc->steal.version);
+
+	delta = steal - kc->steal_seen;
+	kc->steal_seen = steal;
+	return delta;
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_KVM_H
+#define JOS_KERN_KVM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+void kvm_init_percpu(void);
+bool kvm_clock_ok(void);
+uint64_t kvm_clock_ns(void);
+uint32_t kvm_tsc_khz(void);
+bool kvm_pv_eoi(void);
+uint64_t kvm_steal_ns(void);
+
+#endif /* !JOS_KERN_KVM_H */
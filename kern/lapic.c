@@ -9,6 +9,9 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/time.h>
+#include <kern/kvm.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -42,16 +45,117 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// In x2APIC mode the same registers are MSRs, one per 16 bytes of the
+// MMIO window, and ICR is a single 64-bit MSR with a 32-bit destination.
+#define MSR_APIC_BASE  0x01B
+#define APIC_BASE_EN       0x00000800   // xAPIC global enable
+#define APIC_BASE_EXTD     0x00000400   // x2APIC mode
+#define MSR_X2APIC(index)  (0x800 + ((index) >> 2))
+#define CPUID_X2APIC   (1 << 21)        // CPUID.1:ECX
+
+// Give up on the PIT after this many polls of port B.
+#define CALIBRATE_SPINS	10000000
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
+// Whether the LAPICs run in x2APIC mode; decided by the boot CPU's
+// lapic_init, before the others start, and followed by all of them.
+static bool x2apic;
+
+// LAPIC timer count for one tick; all CPUs share the BSP's bus clock.
+static uint32_t lapic_tick_count;
 
 static void
 lapicw(int index, int value)
 {
+	if (x2apic)
+	{
+		// MSR writes need no read back to take effect.
+		wrmsr(MSR_X2APIC(index), (uint32_t) value);
+		return;
+	}
 	lapic[index] = value;
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+static uint32_t
+lapicr(int index)
+{
+	if (x2apic)
+		return rdmsr(MSR_X2APIC(index));
+	return lapic[index];
+}
+
+// Send the IPI 'icrlo' to APIC ID 'apicid', or to the shorthand
+// destination in icrlo, and wait for it to leave.  x2APIC has no
+// delivery status to wait on: the write returns once it is sent.
+static void
+lapic_icr(uint32_t apicid, uint32_t icrlo)
+{
+	if (x2apic)
+	{
+		wrmsr(MSR_X2APIC(ICRLO), (uint64_t) apicid << 32 | icrlo);
+		return;
+	}
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, icrlo);
+	while (lapic[ICRLO] & DELIVS);
+}
+
+// Switch this CPU's LAPIC into x2APIC mode, if the boot CPU chose it.
+// xAPIC -> x2APIC is the one transition allowed while enabled.
+static void
+lapic_x2apic_enable(void)
+{
+	uint32_t ecx;
+
+	if (thiscpu == bootcpu)
+	{
+		cpuid(1, NULL, NULL, &ecx, NULL);
+		x2apic = (ecx & CPUID_X2APIC) != 0;
+		if (x2apic)
+			cprintf("lapic: x2APIC mode\n");
+	}
+	if (x2apic)
+		wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) |
+			  APIC_BASE_EN | APIC_BASE_EXTD);
+}
+
+// Time one tick of PIT channel 2 with both the TSC and the LAPIC
+// timer, so that the LAPIC timer fires exactly every tick and tsc_khz
+// can turn TSC readings into time.  If the PIT never answers, keep the
+// old uncalibrated count and leave tsc_khz zero.
+static void
+lapic_calibrate(void)
+{
+	uint64_t tsc;
+	uint32_t count;
+	int i;
+
+	lapic_tick_count = 10000000;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	pit_wait_start(UINFO_TICK_USEC);
+	lapicw(TICR, 0xffffffff);
+	tsc = read_tsc();
+	for (i = 0; i < CALIBRATE_SPINS && !pit_wait_done(); i++)
+		;
+	count = 0xffffffff - lapicr(TCCR);
+	tsc = read_tsc() - tsc;
+	lapicw(TICR, 0);
+
+	if (i == CALIBRATE_SPINS || count == 0)
+	{
+		cprintf("lapic: PIT calibration failed\n");
+		return;
+	}
+	lapic_tick_count = count;
+	tsc_khz = tsc * 1000 / UINFO_TICK_USEC;
+	cprintf("lapic: TSC %u.%03u MHz, timer %u per tick\n",
+		tsc_khz / 1000, tsc_khz % 1000, lapic_tick_count);
+}
+
 void
 lapic_init(void)
 {
@@ -60,18 +164,24 @@ lapic_init(void)
 
 	// lapicaddr is the physical address of the LAPIC's 4K MMIO
 	// region.  Map it in to virtual memory so we can access it.
-	lapic = mmio_map_region(lapicaddr, 4096);
+	// Every CPU sees its own LAPIC there, so the APs, which start up
+	// side by side, use the BSP's mapping.  APs still need it in
+	// x2APIC mode, to read their ID in xAPIC mode before they switch.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
+	lapic_x2apic_enable();
 
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// from lapic[TICR] and then issues an interrupt.
+	// TICR is calibrated against the PIT by the BSP, so
+	// that interrupts arrive every UINFO_TICK_USEC.
+	if (thiscpu == bootcpu)
+		lapic_calibrate();
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000);
+	lapic_timer_start();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -88,7 +198,7 @@ lapic_init(void)
 
 	// Disable performance counter overflow interrupts
 	// on machines that provide that interrupt entry.
-	if (((lapic[VER] >> 16) & 0xFF) >= 4)
+	if (((lapicr(VER) >> 16) & 0xFF) >= 4)
 		lapicw(PCINT, MASKED);
 
 	// Map error interrupt to IRQ_ERROR.
@@ -102,44 +212,61 @@ lapic_init(void)
 	lapicw(EOI, 0);
 
 	// Send an Init Level De-Assert to synchronize arbitration ID's.
-	lapicw(ICRHI, 0);
-	lapicw(ICRLO, BCAST | INIT | LEVEL);
-	while (lapic[ICRLO] & DELIVS);
+	// x2APIC does not support (or need) it.
+	if (!x2apic)
+		lapic_icr(0, BCAST | INIT | LEVEL);
 
 	// Enable interrupts on the APIC (but not on the processor).
 	lapicw(TPR, 0);
 }
 
+// This CPU's local APIC ID, from the hardware.  Everything after
+// percpu_init should use cpunum(), which is much cheaper.
 int
-cpunum(void)
+lapic_id(void)
 {
+	// An AP that has not run lapic_init yet is still in xAPIC mode.
+	if (x2apic && (rdmsr(MSR_APIC_BASE) & APIC_BASE_EXTD))
+		return rdmsr(MSR_X2APIC(ID));
 	if (lapic)
 		return lapic[ID] >> 24;
 	return 0;
 }
 
-// Acknowledge interrupt.
+// Acknowledge interrupt.  In x2APIC mode this is one wrmsr, and
+// under KVM often nothing at all (see kvm_pv_eoi).
 void
 lapic_eoi(void)
 {
-	if (lapic)
+	if (kvm_pv_eoi())
+		return;
+	if (x2apic)
+		wrmsr(MSR_X2APIC(EOI), 0);
+	else if (lapic)
 		lapicw(EOI, 0);
 }
 
 // Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
+// Does nothing if the TSC could not be calibrated.
 static void
 microdelay(int us)
 {
-}
+	uint64_t end = read_tsc() + (uint64_t) us * tsc_khz / 1000;
 
-#define IO_RTC  0x70
+	while (read_tsc() < end)
+		;
+}
 
-// Start additional processor running entry code at addr.
+// Start all the additional processors in cpus[] running entry code at
+// addr.  Each step of the startup sequence goes to all of them before
+// its delay, rather than taking the delays once per CPU.  The IPIs are
+// sent to each CPU by its ID, not broadcast, so that processors the
+// MP tables leave out (or past NCPU) stay halted.
 // See Appendix B of MultiProcessor Specification.
 void
-lapic_startap(uint8_t apicid, uint32_t addr)
+lapic_startaps(uint32_t addr)
 {
+	struct CpuInfo *c, *self = thiscpu;
 	int i;
 	uint16_t *wrv;
 
@@ -153,11 +280,15 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	wrv[1] = addr >> 4;
 
 	// "Universal startup algorithm."
-	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid << 24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	// Send INIT (level-triggered) interrupt to reset other CPUs.
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != self)
+			lapic_icr(c->cpu_id, INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
+	// x2APIC has no INIT level de-assert.
+	for (c = cpus; c < cpus + ncpu && !x2apic; c++)
+		if (c != self)
+			lapic_icr(c->cpu_id, INIT | LEVEL);
 	microdelay(100);    // should be 10ms, but too slow in Bochs!
 
 	// Send startup IPI (twice!) to enter code.
@@ -167,8 +298,9 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	// Bochs complains about the second one.  Too bad for Bochs.
 	for (i = 0; i < 2; i++)
 	{
-		lapicw(ICRHI, apicid << 24);
-		lapicw(ICRLO, STARTUP | (addr >> 12));
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c != self)
+				lapic_icr(c->cpu_id, STARTUP | (addr >> 12));
 		microdelay(200);
 	}
 }
@@ -176,6 +308,29 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 void
 lapic_ipi(int vector)
 {
-	lapicw(ICRLO, OTHERS | FIXED | vector);
-	while (lapic[ICRLO] & DELIVS);
+	lapic_icr(0, OTHERS | FIXED | vector);
+}
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapic_icr(apicid, FIXED | vector);
+}
+
+// Start (or restart) this CPU's periodic timer, one interrupt per tick.
+void
+lapic_timer_start(void)
+{
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_tick_count);
+}
+
+// Stop this CPU's timer until the next lapic_timer_start().
+// Writing a zero initial count disarms the timer.
+void
+lapic_timer_stop(void)
+{
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
 }
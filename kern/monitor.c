@@ -11,6 +11,13 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/prof.h>
+#include <kern/sysstat.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/e1000.h>
+#include <kern/kmalloc.h>
 #include "pmap.h"
 #include "env.h"
 
@@ -30,6 +37,15 @@ static struct Command commands[] = {
 		{"backtrace", "Print backtrace",                      mon_backtrace},
 		{"shutdown",  "QEMU SPECIFIC SHUTDOWN",               mon_qemu_shutdown},
 		{"ppm",       "print page mappings",                  mon_print_page_mappings},
+		{"locks",     "Show spinlock contention [reset]",     mon_lockstat},
+		{"superpages", "Show superpage use per environment",  mon_superpages},
+		{"prof",      "Show the sampling profile [start|stop]", mon_prof},
+		{"sysstat",   "Show system call statistics [cpu|reset [envid]]", mon_sysstat},
+		{"mem",       "Show free pages and fragmentation",    mon_mem},
+		{"sched",     "Show per-CPU run queues and load",     mon_sched},
+		{"runwait",   "Show run queue wait times [envid]",    mon_runwait},
+		{"net",       "Show e1000 counters and ring state",   mon_net},
+		{"envmem",    "Show resident pages per environment",  mon_envmem},
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -111,6 +127,203 @@ mon_print_page_mappings(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+	{
+		spin_reset_stats();
+		return 0;
+	}
+	spin_print_stats();
+	return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	int r;
+
+	if (argc > 1 && strcmp(argv[1], "start") == 0)
+	{
+		if ((r = prof_start()) < 0)
+			cprintf("prof: %e\n", r);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "stop") == 0)
+		prof_stop();
+	prof_print();
+	return 0;
+}
+
+int
+mon_sysstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+	{
+		sysstat_reset(argc > 2 ? strtol(argv[2], NULL, 16) : 0);
+		return 0;
+	}
+	sysstat_print(argc > 1 ? strtol(argv[1], NULL, 0) : -1);
+	return 0;
+}
+
+int
+mon_runwait(int argc, char **argv, struct Trapframe *tf)
+{
+	sysstat_runwait_print(argc > 1 ? strtol(argv[1], NULL, 16) : 0);
+	return 0;
+}
+
+int
+mon_superpages(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t pdeno, pteno;
+	size_t small, super;
+	pte_t *pt;
+	int i;
+
+	cprintf("4MB pages are %s\n", superpages_enabled ? "enabled" : "not supported");
+	cprintf("%-8s %10s %10s %8s\n", "env", "4KB", "4MB", "super%");
+	for (i = 0; i < nenv; i++)
+	{
+		if (envs[i].env_status == ENV_FREE || !envs[i].env_pgdir)
+			continue;
+		small = super = 0;
+		for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+		{
+			pde_t pde = envs[i].env_pgdir[pdeno];
+			if (!(pde & PTE_P))
+				continue;
+			if (pde & PTE_PS)
+			{
+				super++;
+				continue;
+			}
+			pt = (pte_t *) KADDR(PTE_ADDR(pde));
+			for (pteno = 0; pteno < NPTENTRIES; pteno++)
+				if (pt[pteno] & PTE_P)
+					small++;
+		}
+		cprintf("%08x %9uK %9uK %7u%%\n", envs[i].env_id,
+				small * (PGSIZE / 1024), super * (PTSIZE / 1024),
+				(small + super) ? super * NPTENTRIES * 100 / (small + super * NPTENTRIES) : 0);
+	}
+	return 0;
+}
+
+int
+mon_mem(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	kmalloc_print_stats();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char *const status[] = {"unused", "started", "halted"};
+	uint32_t nstatus[ENV_NOT_RUNNABLE + 1] = {0};
+	struct CpuInfo *c;
+	int i;
+
+	cprintf("%3s %-8s %-8s %6s %10s %10s\n", "cpu", "status", "env", "runq",
+			"busy", "idle");
+	for (c = cpus; c < cpus + ncpu; c++)
+	{
+		cprintf("%3d %-8s ", c->cpu_id,
+				c->cpu_status < ARRAY_SIZE(status) ? status[c->cpu_status] : "?");
+		if (c->cpu_env)
+			cprintf("%08x ", c->cpu_env->env_id);
+		else
+			cprintf("%-8s ", c->cpu_tickless ? "tickless" : "-");
+		cprintf("%6u %10u %10u\n", c->cpu_runq_len,
+				uinfo->cpus[c->cpu_id].busy_ticks, uinfo->cpus[c->cpu_id].idle_ticks);
+	}
+	for (i = 0; i < nenv; i++)
+		if (envs[i].env_status <= ENV_NOT_RUNNABLE)
+			nstatus[envs[i].env_status]++;
+	cprintf("envs: %u running, %u runnable, %u blocked, %u dying, %u free of %u\n",
+			nstatus[ENV_RUNNING], nstatus[ENV_RUNNABLE], nstatus[ENV_NOT_RUNNABLE],
+			nstatus[ENV_DYING], nstatus[ENV_FREE], nenv);
+	return 0;
+}
+
+int
+mon_net(int argc, char **argv, struct Trapframe *tf)
+{
+	struct NetStats st;
+
+	if (e1000_stats(&st) < 0)
+	{
+		cprintf("no e1000\n");
+		return 0;
+	}
+	cprintf("rx %llu good, %u missed, %u bad CRC, %u out of buffers, %u too long\n",
+			st.rx_good, st.rx_missed, st.rx_crc_errors, st.rx_no_buffers,
+			st.rx_too_long);
+	cprintf("tx %llu good of %llu, %u refused with the queue full\n",
+			st.tx_good, st.tx_total, st.tx_queue_full);
+	cprintf("rx ring %u/%u filled in %u queues, tx ring %u/%u busy (%u pinned)\n",
+			st.rx_ring_used, st.rx_ring_size, st.rx_queues, st.tx_ring_used,
+			st.tx_ring_size, st.tx_pinned);
+	return 0;
+}
+
+// Resident pages are the present user PTEs below UTOP, a 4MB page
+// counting as 1024; shared ones map a page something else maps too.
+// Kernel pages are the page directory, page tables and the FPU and
+// counter save areas.
+int
+mon_envmem(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t pdeno, pteno, resident, shared, kernel, total = 0;
+	struct Env *e;
+	pte_t *pt;
+	int i;
+
+	cprintf("%-8s %10s %10s %8s\n", "env", "resident", "shared", "kernel");
+	for (i = 0; i < nenv; i++)
+	{
+		e = &envs[i];
+		if (e->env_status == ENV_FREE || !e->env_pgdir)
+			continue;
+		resident = shared = 0;
+		// The page directory and tables; FPU and counter state are
+		// kmalloc objects well under a page.
+		kernel = 1;
+		for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+		{
+			pde_t pde = e->env_pgdir[pdeno];
+			if (!(pde & PTE_P))
+				continue;
+			if (pde & PTE_PS)
+			{
+				resident += NPTENTRIES;
+				if (PGNUM(pde) < npages && pa2page(PTE_ADDR(pde))->pp_ref > 1)
+					shared += NPTENTRIES;
+				continue;
+			}
+			kernel++;
+			pt = (pte_t *) KADDR(PTE_ADDR(pde));
+			for (pteno = 0; pteno < NPTENTRIES; pteno++)
+			{
+				if (!(pt[pteno] & PTE_P))
+					continue;
+				resident++;
+				if (PGNUM(pt[pteno]) < npages && pa2page(PTE_ADDR(pt[pteno]))->pp_ref > 1)
+					shared++;
+			}
+		}
+		total += resident + kernel;
+		cprintf("%08x %9uK %9uK %7uK\n", e->env_id, resident * (PGSIZE / 1024),
+				shared * (PGSIZE / 1024), kernel * (PGSIZE / 1024));
+	}
+	cprintf("total %uK, shared pages counted once per mapping\n", total * (PGSIZE / 1024));
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
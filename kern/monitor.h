@@ -17,5 +17,14 @@ int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_qemu_shutdown(int argc, char **argv, struct Trapframe *tf);
 int mon_print_page_mappings(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_superpages(int argc, char **argv, struct Trapframe *tf);
+int mon_prof(int argc, char **argv, struct Trapframe *tf);
+int mon_sysstat(int argc, char **argv, struct Trapframe *tf);
+int mon_mem(int argc, char **argv, struct Trapframe *tf);
+int mon_sched(int argc, char **argv, struct Trapframe *tf);
+int mon_runwait(int argc, char **argv, struct Trapframe *tf);
+int mon_net(int argc, char **argv, struct Trapframe *tf);
+int mon_envmem(int argc, char **argv, struct Trapframe *tf);
 
 #endif    // !JOS_KERN_MONITOR_H
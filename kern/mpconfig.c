@@ -9,16 +9,13 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 #include <kern/pmap.h>
+#include <kern/ioapic.h>
 
 struct CpuInfo cpus[NCPU];
 struct CpuInfo *bootcpu;
 int ismp;
 int ncpu;
 
-// Per-CPU kernel stacks
-unsigned char percpu_kstacks[NCPU][KSTKSIZE]
-		__attribute__ ((aligned(PGSIZE)));
-
 
 // See MultiProcessor Specification Version 1.[14]
 
@@ -62,6 +59,42 @@ struct mpproc {         // processor table entry [MP 4.3.1]
 // mpproc flags
 #define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
 
+struct mpbus {          // bus table entry [MP 4.3.2]
+	uint8_t type;                   // entry type (1)
+	uint8_t busid;
+	uint8_t bustype[6];             // "ISA   ", "PCI   ", ...
+} __attribute__((__packed__));
+
+struct mpioapic {       // I/O APIC table entry [MP 4.3.3]
+	uint8_t type;                   // entry type (2)
+	uint8_t apicno;                 // I/O APIC id
+	uint8_t version;                // I/O APIC version
+	uint8_t flags;                  // I/O APIC flags
+	physaddr_t addr;                // I/O APIC address
+} __attribute__((__packed__));
+
+// mpioapic flags
+#define MPIOAPIC_EN 0x01                // This I/O APIC is usable
+
+struct mpiointr {       // I/O interrupt table entry [MP 4.3.4]
+	uint8_t type;                   // entry type (3)
+	uint8_t intrtype;               // 0: vectored interrupt
+	uint16_t flags;                 // polarity and trigger mode
+	uint8_t srcbus;                 // bus id
+	uint8_t srcbusirq;              // ISA: IRQ; PCI: device << 2 | pin
+	uint8_t dstapic;                // I/O APIC id
+	uint8_t dstirq;                 // I/O APIC input
+} __attribute__((__packed__));
+
+// mpiointr flags; 0 in either field means what the bus does
+#define MPINTR_POL_MASK  0x03
+#define MPINTR_POL_LOW   0x03
+#define MPINTR_TRIG_MASK 0x0C
+#define MPINTR_TRIG_LEVEL 0x0C
+
+// Buses that are PCI, by bus id, to tell their interrupts from ISA's
+static uint32_t mp_pcibus[256 / 32];
+
 // Table entry types
 #define MPPROC    0x00  // One per processor
 #define MPBUS     0x01  // One per bus
@@ -169,6 +202,47 @@ mpconfig(struct mp **pmp)
 	return conf;
 }
 
+static void
+mp_bus(struct mpbus *bus)
+{
+	if (memcmp(bus->bustype, "PCI", 3) == 0)
+		mp_pcibus[bus->busid / 32] |= 1 << (bus->busid % 32);
+}
+
+// Use the first usable I/O APIC.
+static void
+mp_ioapic(struct mpioapic *io)
+{
+	if ((io->flags & MPIOAPIC_EN) && !ioapicaddr)
+	{
+		ioapicaddr = io->addr;
+		ioapicid = io->apicno;
+	}
+}
+
+// Record which input of the I/O APIC an IRQ arrives at, and how.  An
+// ISA interrupt is known by its IRQ.  A PCI one is known by its input,
+// which the BIOS gives the number of the IRQ it put in the device's
+// interrupt line register.  Entries come after the buses and I/O APICs
+// they name.
+static void
+mp_iointr(struct mpiointr *intr)
+{
+	struct IoapicRoute *r;
+	bool pci = mp_pcibus[intr->srcbus / 32] & (1 << (intr->srcbus % 32));
+	uint8_t irq = pci ? intr->dstirq : intr->srcbusirq;
+	uint16_t pol = intr->flags & MPINTR_POL_MASK;
+	uint16_t trig = intr->flags & MPINTR_TRIG_MASK;
+
+	if (intr->intrtype != 0 || intr->dstapic != ioapicid || irq >= MAX_IRQS)
+		return;
+	r = &ioapic_routes[irq];
+	r->ir_known = true;
+	r->ir_pin = intr->dstirq;
+	r->ir_active_low = pol ? pol == MPINTR_POL_LOW : pci;
+	r->ir_level = trig ? trig == MPINTR_TRIG_LEVEL : pci;
+}
+
 void
 mp_init(void)
 {
@@ -204,8 +278,17 @@ mp_init(void)
 				p += sizeof(struct mpproc);
 				continue;
 			case MPBUS:
+				mp_bus((struct mpbus *) p);
+				p += 8;
+				continue;
 			case MPIOAPIC:
+				mp_ioapic((struct mpioapic *) p);
+				p += 8;
+				continue;
 			case MPIOINTR:
+				mp_iointr((struct mpiointr *) p);
+				p += 8;
+				continue;
 			case MPLINTR:
 				p += 8;
 				continue;
@@ -222,6 +305,7 @@ mp_init(void)
 		// Didn't like what we found; fall back to no MP.
 		ncpu = 1;
 		lapicaddr = 0;
+		ioapicaddr = 0;
 		cprintf("SMP: configuration not found, SMP disabled\n");
 		return;
 	}
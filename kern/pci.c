@@ -1,14 +1,21 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
+#include <inc/trap.h>
 #include <kern/pci.h>
 #include <kern/pcireg.h>
+#include <kern/cpu.h>
 #include <kern/e1000.h>
+#include <kern/virtio_blk.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 1;
 static int pci_show_addrs = 0;
 
+// MSI vectors handed out so far, from T_MSI up
+static int pci_msi_nvec;
+
 // PCI "configuration mechanism one"
 static uint32_t pci_conf1_addr_ioport = 0x0cf8;
 static uint32_t pci_conf1_data_ioport = 0x0cfc;
@@ -32,6 +39,8 @@ struct pci_driver pci_attach_class[] = {
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
 		{E1000_VENDOR_ID, E1000_DEVICE_ID, &e1000_pci_attach},
+		{E1000_VENDOR_ID, E1000_DEVICE_ID_82574, &e1000_pci_attach},
+		{VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &vblk_pci_attach},
 		{0, 0,                             0},
 };
 
@@ -254,6 +263,95 @@ pci_func_enable(struct pci_func *f)
 			PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id));
 }
 
+// Walk f's capability list looking for capability capid.
+// Returns its offset in configuration space, or 0 if f does not have one.
+int
+pci_find_cap(struct pci_func *f, uint8_t capid)
+{
+	uint32_t off, cr;
+	int n;
+
+	if (!(pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_STATUS_CAPLIST_SUPPORT))
+		return 0;
+
+	// Bound the walk in case the list loops on broken hardware.
+	off = PCI_CAPLIST_PTR(pci_conf_read(f, PCI_CAPLISTPTR_REG));
+	for (n = 0; off >= 0x40 && n < 48; n++)
+	{
+		off &= ~3;
+		cr = pci_conf_read(f, off);
+		if (PCI_CAPLIST_CAP(cr) == capid)
+			return off;
+		off = PCI_CAPLIST_NEXT(cr);
+	}
+	return 0;
+}
+
+// Point f's MSI message at the LAPIC of CPU cpu.
+static void
+pci_msi_target(struct pci_func *f, int cpu)
+{
+	pci_conf_write(f, f->msi_cap + PCI_MSI_ADDR_LO,
+				   PCI_MSI_ADDR_BASE | PCI_MSI_ADDR_DEST(cpus[cpu].cpu_id));
+}
+
+// Switch f from its INTx line to a single edge-triggered message
+// interrupt, delivered to CPU cpu on a vector of its own.
+// Returns the vector on success, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if f has no MSI capability.
+//	-E_NO_MEM if every MSI vector is taken.
+int
+pci_msi_enable(struct pci_func *f, int cpu)
+{
+	uint32_t ctrl;
+	int cap;
+
+	if (f->msi_vector)
+		return f->msi_vector;
+	if ((cap = pci_find_cap(f, PCI_CAP_MSI)) == 0)
+		return -E_NOT_SUPP;
+	if (pci_msi_nvec >= NMSI)
+		return -E_NO_MEM;
+
+	f->msi_cap = cap;
+	f->msi_vector = T_MSI + pci_msi_nvec++;
+
+	// One message only (MME = 0), with a 64-bit address if the
+	// function insists on it; the upper half is always 0 on x86.
+	ctrl = pci_conf_read(f, cap);
+	ctrl &= ~(PCI_MSI_CTRL_ENABLE | PCI_MSI_CTRL_MME_MASK);
+	pci_conf_write(f, cap, ctrl);
+	pci_msi_target(f, cpu);
+	if (ctrl & PCI_MSI_CTRL_64BIT)
+	{
+		pci_conf_write(f, cap + PCI_MSI_ADDR_HI, 0);
+		pci_conf_write(f, cap + PCI_MSI_DATA_64,
+					   PCI_MSI_DATA_VECTOR(f->msi_vector));
+	} else
+		pci_conf_write(f, cap + PCI_MSI_DATA_32,
+					   PCI_MSI_DATA_VECTOR(f->msi_vector));
+	pci_conf_write(f, cap, ctrl | PCI_MSI_CTRL_ENABLE);
+
+	// Messages replace the pin; keep it from firing as well.
+	pci_conf_write(f, PCI_COMMAND_STATUS_REG,
+				   (pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_COMMAND_MASK) |
+				   PCI_COMMAND_INTX_DISABLE);
+
+	if (pci_show_devs)
+		cprintf("PCI function %02x:%02x.%d: MSI vector %d\n",
+				f->bus->busno, f->dev, f->func, f->msi_vector);
+	return f->msi_vector;
+}
+
+// Deliver f's message interrupts to CPU cpu from now on.
+void
+pci_msi_route(struct pci_func *f, int cpu)
+{
+	static_assert(NCPU <= 256);
+	if (f->msi_vector && cpu >= 0 && cpu < ncpu)
+		pci_msi_target(f, cpu);
+}
+
 int
 pci_init(void)
 {
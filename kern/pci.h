@@ -22,6 +22,8 @@ struct pci_func {
 	uint32_t reg_base[6];
 	uint32_t reg_size[6];
 	uint8_t irq_line;
+	uint8_t msi_cap;        // MSI capability offset, once enabled
+	uint8_t msi_vector;     // Vector its messages raise, or 0
 };
 
 struct pci_bus {
@@ -31,5 +33,8 @@ struct pci_bus {
 
 int pci_init(void);
 void pci_func_enable(struct pci_func *f);
+int pci_find_cap(struct pci_func *f, uint8_t capid);
+int pci_msi_enable(struct pci_func *f, int cpu);
+void pci_msi_route(struct pci_func *f, int cpu);
 
 #endif
@@ -87,6 +87,7 @@ typedef uint16_t pci_product_id_t;
 #define    PCI_COMMAND_STEPPING_ENABLE        0x00000080
 #define    PCI_COMMAND_SERR_ENABLE            0x00000100
 #define    PCI_COMMAND_BACKTOBACK_ENABLE        0x00000200
+#define    PCI_COMMAND_INTX_DISABLE        0x00000400
 
 #define    PCI_STATUS_CAPLIST_SUPPORT        0x00100000
 #define    PCI_STATUS_66MHZ_SUPPORT        0x00200000
@@ -461,6 +462,25 @@ typedef uint8_t pci_revision_t;
 #define PCI_PMCSR_STATE_D2      0x02
 #define PCI_PMCSR_STATE_D3      0x03
 
+/*
+ * Message Signaled Interrupts capability; access via capability pointer.
+ */
+
+/* Message Control, in the upper 16 bits of the capability's first word */
+#define PCI_MSI_CTRL_ENABLE    0x00010000
+#define PCI_MSI_CTRL_MME_MASK  0x00700000    /* Messages enabled (log2) */
+#define PCI_MSI_CTRL_64BIT     0x00800000
+#define PCI_MSI_CTRL_PVMASK    0x01000000    /* Per-vector masking */
+#define PCI_MSI_ADDR_LO        0x04
+#define PCI_MSI_ADDR_HI        0x08          /* 64-bit capable only */
+#define PCI_MSI_DATA_32        0x08
+#define PCI_MSI_DATA_64        0x0c
+
+/* x86 message address and data: fixed delivery to one LAPIC */
+#define PCI_MSI_ADDR_BASE      0xfee00000
+#define PCI_MSI_ADDR_DEST(apicid)    (((apicid) & 0xff) << 12)
+#define PCI_MSI_DATA_VECTOR(v)       ((v) & 0xff)    /* Edge, fixed */
+
 /*
  * PCI-X capability.
  */
@@ -0,0 +1,30 @@
+#ifndef JOS_KERN_PERCPU_H
+#define JOS_KERN_PERCPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Each CPU keeps %gs loaded with a segment based at its own struct
+// CpuInfo (see percpu_init in kern/env.c), so reading one of its fields
+// is a single load, without asking the local APIC which CPU we are on.
+// The fields read this way head struct CpuInfo, at these offsets, so
+// that headers kern/cpu.h itself includes can use them.
+#define PERCPU_SELF	0	// cpu_self, the struct's own address
+#define PERCPU_ID	4	// cpu_id
+
+#define percpu_read(off) ({						\
+	uint32_t __v;							\
+	asm("movl %%gs:%c1,%0" : "=r" (__v) : "i" (off));		\
+	__v;								\
+})
+
+// This CPU's index in cpus[].
+static inline int
+cpunum(void)
+{
+	return percpu_read(PERCPU_ID);
+}
+
+#endif
@@ -4,6 +4,8 @@
 #include <inc/trap.h>
 
 #include <kern/picirq.h>
+#include <kern/ioapic.h>
+#include <kern/cpu.h>
 
 
 // Current IRQ mask.
@@ -84,9 +86,44 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+// Let 'irq' interrupt: at the IOAPIC once it has taken over, at the
+// 8259A before that.
+void
+irq_enable(int irq)
+{
+	if (ioapic_active())
+		ioapic_enable(irq);
+	else
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+}
+
+void
+irq_disable(int irq)
+{
+	if (ioapic_active())
+		ioapic_disable(irq);
+	else
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+}
+
+// Deliver 'irq' to CPU 'cpu' (an index into cpus[]) from now on, if
+// the IOAPIC is in charge; the 8259A only ever interrupts the boot CPU.
+void
+irq_route(int irq, int cpu)
+{
+	ioapic_route(irq, cpu);
+}
+
+// Acknowledge a device interrupt.
 void
 irq_eoi(void)
 {
+	if (ioapic_active())
+	{
+		lapic_eoi();
+		return;
+	}
+
 	// OCW2: rse00xxx
 	//   r: rotate
 	//   s: specific
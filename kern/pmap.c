@@ -10,15 +10,79 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/syscall.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;            // Amount of physical memory (in pages)
+size_t npages_low;        // Of those, the ones mapped at KERNBASE
 static size_t npages_basemem;    // Amount of base memory (in pages)
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;        // Kernel's initial page directory
 struct PageInfo *pages;        // Physical page state array
 static struct PageInfo *page_free_list;    // Free list of physical pages
+struct PageInfo *zero_page;    // See page_insert_zero
+static struct spinlock page_lock = SPINLOCK_INIT(page_lock); // Protects page_free_list and buddy_free
+
+// Once mem_init's checks, which inspect page_free_list directly, are
+// done, every free page moves into a binary buddy allocator:
+// buddy_free[k] holds free, naturally aligned blocks of 2^k pages,
+// doubly linked through pp_link/pp_prev.  Freed blocks merge with
+// their buddy whenever it is free too.
+static struct PageInfo *buddy_free[BUDDY_MAX_ORDER + 1];
+static bool buddy_ready;
+
+// Set when the CPU supports 4MB pages and CR4.PSE is enabled.
+bool superpages_enabled;
+bool globalpages_enabled;
+// Set when the CPU has a PAT, which pat_init_percpu programs.
+static bool pat_enabled;
+
+// The PAT's eight memory types, chosen by a PTE's PAT, PCD and PWT
+// bits.  Entries 0-3 keep their power-on types, so that PCD and PWT
+// alone mean what they always have; entry 5 (PAT|PWT) is write-combining.
+#define MSR_PAT         0x277
+#define PAT_UC          0x00
+#define PAT_WC          0x01
+#define PAT_WT          0x04
+#define PAT_WB          0x06
+#define PAT_UCMINUS     0x07
+#define PAT_ENTRY(i, type)	((uint64_t) (type) << ((i) * 8))
+#define PAT_VALUE	(PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) |	\
+			 PAT_ENTRY(2, PAT_UCMINUS) | PAT_ENTRY(3, PAT_UC) |	\
+			 PAT_ENTRY(4, PAT_WB) | PAT_ENTRY(5, PAT_WC) |	\
+			 PAT_ENTRY(6, PAT_UCMINUS) | PAT_ENTRY(7, PAT_UC))
+
+// Each CPU keeps up to PGCACHE_MAX free pages in thiscpu->cpu_pgcache
+// and moves PGCACHE_BATCH pages at a time to or from the buddy
+// allocator, so most page_alloc/page_free calls never take page_lock.
+// A cache's lock, which only its own CPU takes until memory runs out
+// (see pgcache_steal), is taken before page_lock, and never with
+// another cache's.
+#define PGCACHE_MAX   64
+#define PGCACHE_BATCH 32
+
+// Pool of free pages that are already zero, refilled by idle CPUs
+// (see page_zero_refill) so ALLOC_ZERO allocations rarely memset.
+#define PGZERO_MAX    256
+#define PGZERO_BATCH  16
+static struct PageInfo *pgzero_list;
+static unsigned pgzero_len;
+static struct spinlock pgzero_lock = SPINLOCK_INIT(pgzero_lock);
+
+// Pages above the KERNBASE map ("high memory") have no kernel address,
+// so they only back user memory: page_alloc hands them out to callers
+// that pass ALLOC_HIGH, and the kernel reaches their contents through
+// page_kmap.  They sit on their own free list, under page_lock, and
+// never enter the buddy allocator.
+static struct PageInfo *highmem_free;
+static size_t highmem_nfree;
+
+// page_kmap's windows: KMAP_NSLOTS pages per CPU at the top of the MMIO
+// region, which mmio_map_region leaves alone
+#define KMAPBASE (MMIOLIM - NCPU * KMAP_NSLOTS * PGSIZE)
 
 
 // --------------------------------------------------------------
@@ -53,6 +117,9 @@ i386_detect_memory(void)
 
 	npages = totalmem / (PGSIZE / 1024);
 	npages_basemem = basemem / (PGSIZE / 1024);
+	// pages[] must fit the PTSIZE mapped at UPAGES
+	npages = MIN(npages, PTSIZE / sizeof(struct PageInfo));
+	npages_low = MIN(npages, (size_t) (0x100000000ULL - KERNBASE) / PGSIZE);
 
 	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
 			totalmem, basemem, totalmem - basemem);
@@ -63,7 +130,7 @@ i386_detect_memory(void)
 // Set up memory mappings above UTOP.
 // --------------------------------------------------------------
 
-static void mem_init_mp(void);
+static void buddy_init(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -134,7 +201,9 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
+	size_t n;
+	int i;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -159,13 +228,24 @@ mem_init(void)
 	// each physical page, there is a corresponding struct PageInfo in this
 	// array.  'npages' is the number of physical pages in memory.  Use memset
 	// to initialize all fields of each struct PageInfo to 0.
+	// It has to fit in the 4MB that entry_pgdir maps, along with uinfo
+	// below, so memory past what it can describe goes unused.
+	n = (KERNBASE + PTSIZE - (uintptr_t) boot_alloc(0) - 2 * PGSIZE) /
+		sizeof(struct PageInfo);
+	if (npages > n)
+	{
+		cprintf("Physical memory: using only the first %uK\n", n * (PGSIZE / 1024));
+		npages = n;
+		npages_low = MIN(npages_low, npages);
+	}
 	pages = boot_alloc(npages * sizeof(struct PageInfo));
 	memset(pages, 0, npages * sizeof(struct PageInfo));
 
 	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	envs = boot_alloc(NENV * sizeof(struct Env));
-	memset(envs, 0, NENV * sizeof(struct Env));
+	// Allocate the page that is shared read-only with every environment
+	// at UINFO (see kern/time.c).
+	uinfo = boot_alloc(PGSIZE);
+	memset(uinfo, 0, PGSIZE);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -193,12 +273,13 @@ mem_init(void)
 	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
-	// Permissions:
-	//    - the new image at UENVS  -- kernel R, user R
-	//    - envs itself -- kernel RW, user NONE
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	// The 'envs' array is mapped at KENVS, and read-only by the user at
+	// UENVS, a page at a time as env_alloc needs more (see env_grow).
+
+	//////////////////////////////////////////////////////////////////////
+	// Map the kernel info page read-only by the user at UINFO.
+	static_assert(sizeof(struct Uinfo) <= PGSIZE);
+	boot_map_region(kern_pgdir, UINFO, PGSIZE, PADDR(uinfo), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -213,6 +294,11 @@ mem_init(void)
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
 
+	// page_kmap's windows share the MMIO region's page table, which every
+	// environment's page directory shares in turn
+	if (!pgdir_walk(kern_pgdir, (void *) KMAPBASE, true))
+		panic("mem_init: no page table for the kmap windows");
+
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
 	// Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -220,11 +306,16 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
+	// Turn on 4MB pages first, for this map and user superpage
+	// mappings, if available.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_PSE)
+	{
+		lcr4(rcr4() | CR4_PSE);
+		superpages_enabled = 1;
+	}
 	boot_map_region(kern_pgdir, KERNBASE, 0xffffffff - KERNBASE + 1, 0, PTE_W);
 
-	// Initialize the SMP-related parts of the memory map
-	mem_init_mp();
-
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
 
@@ -246,36 +337,66 @@ mem_init(void)
 	cr0 &= ~(CR0_TS | CR0_EM);
 	lcr0(cr0);
 
+	// boot_map_region marks the kernel's mappings PTE_G, so with
+	// CR4.PGE they survive the lcr3 on every context switch.
+	if (edx & CPUID_PGE)
+	{
+		lcr4(rcr4() | CR4_PGE);
+		globalpages_enabled = 1;
+	}
+	pat_enabled = (edx & CPUID_PAT) != 0;
+	pat_init_percpu();
+
+	for (i = 0; i < NCPU; i++)
+	{
+		spin_initlock(&cpus[i].cpu_tlb_lock);
+		spin_initlock(&cpus[i].cpu_pgcache_lock);
+	}
+
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	buddy_init();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref++;
 }
 
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
-static void
+// Map the kernel stacks of the APs mp_init found.  mem_init gave the
+// BSP (CPU 0) bootstack; the rest are allocated now, so CPUs that
+// are not there cost no memory.
+//
+// CPU i's kernel stack grows down from virtual address
+// kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is divided
+// into two pieces, just like the single stack mem_init set up:
+//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+//          -- backed by physical memory
+//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+//          -- not backed; so if the kernel overflows its stack,
+//             it will fault rather than overwrite another CPU's stack.
+//             Known as a "guard page".
+//     Permissions: kernel RW, user NONE
+void
 mem_init_mp(void)
 {
-	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
-	//
-	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
-	// to as its kernel stack. CPU i's kernel stack grows down from virtual
-	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
-	// divided into two pieces, just like the single stack you set up in
-	// mem_init:
-	//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
-	//          -- backed by physical memory
-	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
-	//          -- not backed; so if the kernel overflows its stack,
-	//             it will fault rather than overwrite another CPU's stack.
-	//             Known as a "guard page".
-	//     Permissions: kernel RW, user NONE
-	//
-	// LAB 4: Your code here:
-	for (int i = 0; i < NCPU; ++i)
+	struct PageInfo *pp;
+	uintptr_t kstacktop_i;
+	int i, j;
+
+	for (i = 1; i < ncpu; i++)
 	{
-		uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
-		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+		kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		for (j = PGSIZE; j <= KSTKSIZE; j += PGSIZE)
+		{
+			if (!(pp = page_alloc(ALLOC_ZERO)))
+				panic("mem_init_mp: out of memory");
+			pp->pp_ref++;
+			boot_map_region(kern_pgdir, kstacktop_i - j, PGSIZE, page2pa(pp), PTE_W);
+		}
 	}
 }
 
@@ -347,17 +468,336 @@ page_init(void)
 	}
 
 	// Extended memory
-	for (i = free_pa_pg_index; i < npages; i++)
+	for (i = free_pa_pg_index; i < npages_low; i++)
 	{
 		pages[i].pp_ref = 0;
 		pages[i].pp_link = page_free_list;
 		page_free_list = &pages[i];
 	}
+
+	// High memory, for user pages only
+	for (i = npages_low; i < npages; i++)
+	{
+		pages[i].pp_ref = 0;
+		pages[i].pp_link = highmem_free;
+		highmem_free = &pages[i];
+		highmem_nfree++;
+	}
+}
+
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = buddy_free[order];
+	if (buddy_free[order])
+		buddy_free[order]->pp_prev = pp;
+	buddy_free[order] = pp;
+}
+
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		buddy_free[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_order = -1;
+	pp->pp_link = pp->pp_prev = NULL;
+}
+
+//
+// Remove a free block of 2^order pages, splitting a larger block if
+// necessary.  Returns NULL if no block is large enough.
+// The caller must hold page_lock.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= BUDDY_MAX_ORDER && !buddy_free[k]; k++)
+		/* do nothing */;
+	if (k > BUDDY_MAX_ORDER)
+		return NULL;
+
+	pp = buddy_free[k];
+	buddy_unlink(pp);
+	// Give back the upper halves we don't need.
+	while (k > order)
+	{
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages starting at pp, merging it with its
+// buddy as long as the buddy is free and of the same order.
+// The caller must hold page_lock.
+//
+static void
+buddy_release(struct PageInfo *pp, int order)
+{
+	size_t pn = pp - pages;
+	struct PageInfo *buddy;
+
+	while (order < BUDDY_MAX_ORDER)
+	{
+		size_t bn = pn ^ (1 << order);
+		if (bn + (1 << order) > npages_low)
+			break;
+		buddy = &pages[bn];
+		if (buddy->pp_order != order)
+			break;
+		buddy_unlink(buddy);
+		pn &= ~(size_t) (1 << order);
+		order++;
+	}
+	buddy_push(&pages[pn], order);
+}
+
+//
+// Hand every page on page_free_list over to the buddy allocator.
+//
+static void
+buddy_init(void)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	for (i = 0; i < npages; i++)
+		pages[i].pp_order = -1;
+
+	spin_lock(&page_lock);
+	while ((pp = page_free_list))
+	{
+		page_free_list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_release(pp, 0);
+	}
+	buddy_ready = 1;
+	spin_unlock(&page_lock);
+}
+
+//
+// Move up to PGCACHE_BATCH pages from the buddy allocator into c's cache.
+// The caller holds c->cpu_pgcache_lock.
+//
+static void
+pgcache_refill(struct CpuInfo *c)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (c->cpu_pgcache_len < PGCACHE_BATCH && (pp = buddy_alloc(0)))
+	{
+		pp->pp_link = c->cpu_pgcache;
+		c->cpu_pgcache = pp;
+		c->cpu_pgcache_len++;
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Return up to 'max' pages from c's cache to the buddy allocator.
+// The caller holds c->cpu_pgcache_lock.
+//
+static void
+pgcache_drain(struct CpuInfo *c, unsigned max)
+{
+	struct PageInfo *pp;
+	unsigned n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < max && c->cpu_pgcache; n++)
+	{
+		pp = c->cpu_pgcache;
+		c->cpu_pgcache = pp->pp_link;
+		c->cpu_pgcache_len--;
+		buddy_release(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Take a page from c's cache, refilling it from the buddy allocator
+// first if it is empty.  Returns NULL if both are empty.
+//
+static struct PageInfo *
+pgcache_pop(struct CpuInfo *c)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&c->cpu_pgcache_lock);
+	if (!c->cpu_pgcache)
+		pgcache_refill(c);
+	if ((pp = c->cpu_pgcache))
+	{
+		c->cpu_pgcache = pp->pp_link;
+		c->cpu_pgcache_len--;
+	}
+	spin_unlock(&c->cpu_pgcache_lock);
+	return pp;
+}
+
+//
+// This CPU's cache and the buddy allocator are empty: give the buddy
+// allocator every page the other CPUs' caches hold.  Each cache's lock
+// is held alone, so two CPUs stealing at once cannot deadlock.
+//
+static void
+pgcache_steal(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+	{
+		if (c == thiscpu || !c->cpu_pgcache)
+			continue;
+		spin_lock(&c->cpu_pgcache_lock);
+		pgcache_drain(c, c->cpu_pgcache_len);
+		spin_unlock(&c->cpu_pgcache_lock);
+	}
+}
+
+//
+// Take a page from the pre-zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+pgzero_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!pgzero_list)
+		return NULL;
+	spin_lock(&pgzero_lock);
+	if ((pp = pgzero_list))
+	{
+		pgzero_list = pp->pp_link;
+		pgzero_len--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&pgzero_lock);
+	return pp;
+}
+
+//
+// Zero up to PGZERO_BATCH free pages and add them to the pre-zeroed
+// pool.  Called by idle CPUs in sched_halt, without kernel_lock.
+//
+void
+page_zero_refill(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < PGZERO_BATCH && pgzero_len < PGZERO_MAX; i++)
+	{
+		if (!(pp = page_alloc(0)))
+			return;
+		// Pooled pages wait a while before use: keep them out of the cache
+		memset_nt(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&pgzero_lock);
+		pp->pp_link = pgzero_list;
+		pgzero_list = pp;
+		pgzero_len++;
+		spin_unlock(&pgzero_lock);
+	}
+}
+
+//
+// Take a page off the high memory free list, or return NULL if it is
+// empty.
+//
+static struct PageInfo *
+highmem_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!highmem_free)
+		return NULL;
+	spin_lock(&page_lock);
+	if ((pp = highmem_free))
+	{
+		highmem_free = pp->pp_link;
+		highmem_nfree--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&page_lock);
+	return pp;
+}
+
+//
+// A kernel address for the contents of page 'pp': page2kva(pp) if pp is
+// in the KERNBASE map, otherwise this CPU's window 'slot' (a KMAP_*),
+// pointed at pp.  The window stays valid until the next page_kmap of
+// the same slot on this CPU, so callers use it before doing anything
+// that might take the slot (or move them to another CPU).
+//
+void *
+page_kmap(struct PageInfo *pp, int slot)
+{
+	uintptr_t va;
+
+	if (PGNUM(page2pa(pp)) < npages_low)
+		return page2kva(pp);
+	va = KMAPBASE + (cpunum() * KMAP_NSLOTS + slot) * PGSIZE;
+	*pgdir_walk(kern_pgdir, (void *) va, false) = page2pa(pp) | PTE_W | PTE_P;
+	invlpg((void *) va);
+	return (void *) va;
+}
+
+// Print where the free pages are, for the monitor's "mem" command:
+// the buddy allocator's free blocks by order, the per-CPU caches and
+// the zeroed pool.  For each order, "usable" is the share of the
+// buddy's free pages in blocks at least that big, so a low figure at
+// high orders means memory is too fragmented for large allocations.
+// Walks the free lists under page_lock, one step per free block.
+void
+page_print_stats(void)
+{
+	uint32_t nblocks[BUDDY_MAX_ORDER + 1], free = 0, above = 0, cached = 0;
+	struct PageInfo *pp;
+	int k, i;
+
+	spin_lock(&page_lock);
+	for (k = 0; k <= BUDDY_MAX_ORDER; k++)
+	{
+		nblocks[k] = 0;
+		for (pp = buddy_free[k]; pp; pp = pp->pp_link)
+			nblocks[k]++;
+		free += nblocks[k] << k;
+	}
+	spin_unlock(&page_lock);
+	for (i = 0; i < ncpu; i++)
+		cached += cpus[i].cpu_pgcache_len;
+
+	cprintf("%u pages: %u free in the buddy allocator, %u in CPU caches, %u zeroed\n",
+			npages, free, cached, pgzero_len);
+	if (npages > npages_low)
+		cprintf("%u in high memory, %u of them free\n", npages - npages_low,
+				highmem_nfree);
+	cprintf("%5s %8s %8s %8s %7s\n", "order", "block", "blocks", "pages", "usable");
+	for (k = BUDDY_MAX_ORDER; k >= 0; k--)
+	{
+		above += nblocks[k] << k;
+		cprintf("%5d %7uK %8u %8u %6u%%\n", k, (PGSIZE >> 10) << k, nblocks[k],
+				nblocks[k] << k, free ? above * 100 / free : 0);
+	}
 }
 
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
+// returned physical page with '\0' bytes.  With ALLOC_HIGH, the page
+// may be one in high memory, which page2kva cannot reach (see
+// page_kmap); high memory is used up first.  Does NOT increment the reference
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
@@ -370,12 +810,42 @@ page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	if (page_free_list == NULL)
-		return NULL;
+	struct PageInfo *free_page;
+	struct CpuInfo *c = thiscpu;
+
+	if ((alloc_flags & ALLOC_HIGH) && (free_page = highmem_pop()))
+	{
+		if (alloc_flags & ALLOC_ZERO)
+			memset(page_kmap(free_page, KMAP_DST), 0, PGSIZE);
+		return free_page;
+	}
+	if ((alloc_flags & ALLOC_ZERO) && (free_page = pgzero_pop()))
+		return free_page;
+
+	if (buddy_ready)
+	{
+		if (!(free_page = pgcache_pop(c)))
+		{
+			pgcache_steal();
+			free_page = pgcache_pop(c);
+		}
+		// Out of memory, except perhaps for pre-zeroed pages.
+		if (!free_page)
+			return pgzero_pop();
+	} else
+	{
+		spin_lock(&page_lock);
+		if (page_free_list == NULL)
+		{
+			spin_unlock(&page_lock);
+			return NULL;
+		}
 
-	// Remove entry from the list
-	struct PageInfo *free_page = page_free_list;
-	page_free_list = free_page->pp_link;
+		// Remove entry from the list
+		free_page = page_free_list;
+		page_free_list = free_page->pp_link;
+		spin_unlock(&page_lock);
+	}
 	free_page->pp_link = NULL;
 
 	// Memset page to zero if ALLOC_ZERO flag is set
@@ -392,11 +862,90 @@ page_alloc(int alloc_flags)
 void
 page_free(struct PageInfo *pp)
 {
+	struct CpuInfo *c = thiscpu;
+
 	assert(pp->pp_ref == 0);
 	assert(pp->pp_link == NULL);
 
+	tlb_shootdown_wait();
+
+	if (PGNUM(page2pa(pp)) >= npages_low)
+	{
+		spin_lock(&page_lock);
+		pp->pp_link = highmem_free;
+		highmem_free = pp;
+		highmem_nfree++;
+		spin_unlock(&page_lock);
+		return;
+	}
+
+	if (buddy_ready)
+	{
+		spin_lock(&c->cpu_pgcache_lock);
+		if (c->cpu_pgcache_len >= PGCACHE_MAX)
+			pgcache_drain(c, PGCACHE_BATCH);
+		pp->pp_link = c->cpu_pgcache;
+		c->cpu_pgcache = pp;
+		c->cpu_pgcache_len++;
+		spin_unlock(&c->cpu_pgcache_lock);
+		return;
+	}
+
+	spin_lock(&page_lock);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocates 2^order physically contiguous pages, naturally aligned to
+// their size, and returns the PageInfo of the first one.  Order 0 is
+// the same as page_alloc.  Each page's pp_ref is left at 0.
+//
+// Returns NULL if no large enough block is free, or if the buddy
+// allocator is not set up yet.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > BUDDY_MAX_ORDER || !buddy_ready)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset_nt(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block obtained from page_alloc_order.  Every page in it must
+// have pp_ref 0.  The pages may also be freed one at a time with
+// page_free; the buddy allocator merges them back together.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	if (order == 0)
+	{
+		page_free(pp);
+		return;
+	}
+	assert(buddy_ready && order > 0 && order <= BUDDY_MAX_ORDER);
+	for (i = 0; i < (1 << order); i++)
+		assert(pp[i].pp_ref == 0 && pp[i].pp_link == NULL);
+	tlb_shootdown_wait();
+
+	spin_lock(&page_lock);
+	buddy_release(pp, order);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -406,6 +955,11 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo *pp)
 {
+	// Someone sleeping on the page learns it lost a mapping
+	if (pp->pp_waiters)
+		page_wait_wake(pp);
+	if (pp == zero_page)
+		return;
 	if (--pp->pp_ref == 0)
 		page_free(pp);
 }
@@ -432,12 +986,25 @@ page_decref(struct PageInfo *pp)
 // Hint 3: look at inc/mmu.h for useful macros that manipulate page
 // table and page directory entries.
 //
+// If va is mapped by a 4MB superpage, there is no page table and
+// pgdir_walk returns a pointer to the page directory entry itself,
+// which has PTE_PS set.
+//
+// A page table that fork left shared (see pgdir_dup_cow) is first given
+// a copy of its own if 'create', since the caller is about to change it.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
+	if (create && pgdir_unshare(pgdir, va) < 0)
+		return NULL;
+
 	pde_t pg_dir_entry = pgdir[PDX(va)];
 	physaddr_t pg_table_phys_addr = (physaddr_t) PDE_ADDR(pg_dir_entry);
 
+	if ((pg_dir_entry & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return &pgdir[PDX(va)];
+
 	// Relevant page table is not created yet and we don't wish to create it right now
 	if (pg_table_phys_addr == 0 && !create)
 		return NULL;
@@ -474,11 +1041,17 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
 // va and pa are both page-aligned.
-// Use permission bits perm|PTE_P for the entries.
+// Use permission bits perm|PTE_P|PTE_G for the entries.
 //
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+// mapped pages.  They are the same in every address space, hence
+// global; PTE_G is ignored until CR4.PGE is set.
+//
+// Once CR4.PSE is on, every PTSIZE-aligned 4MB of the region that is
+// PTSIZE-aligned in physical memory too, and has no page table yet, is
+// one 4MB page instead: the KERNBASE map of all physical memory then
+// takes no page tables and far fewer TLB entries.
 //
 // Hint: the TA solution uses pgdir_walk
 static void
@@ -488,14 +1061,83 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	assert(va % PGSIZE == 0);
 	assert(pa % PGSIZE == 0);
 
-	const size_t num_pages = size / PGSIZE;
-	for (size_t i = 0; i < num_pages; ++i)
+	for (size_t off = 0; off < size;)
 	{
-		const void *ith_va = (const void *) va + i * PGSIZE;
+		const void *ith_va = (const void *) va + off;
+		if (superpages_enabled && (uintptr_t) ith_va % PTSIZE == 0 &&
+			(pa + off) % PTSIZE == 0 && size - off >= PTSIZE &&
+			!(pgdir[PDX(ith_va)] & PTE_P))
+		{
+			// A 4MB page keeps its PAT bit where PTE_PS would be.
+			int pdperm = perm & PTE_PAT ? (perm & ~PTE_PAT) | PTE_PAT_PS : perm;
+			pgdir[PDX(ith_va)] = (pa + off) | pdperm | PTE_PS | PTE_P | PTE_G;
+			off += PTSIZE;
+			continue;
+		}
 		pte_t *pg_table_entry = pgdir_walk(pgdir, ith_va, true);
 		assert(pg_table_entry != NULL);
-		*pg_table_entry = (pa + i * PGSIZE) | perm | PTE_P;
+		*pg_table_entry = (pa + off) | perm | PTE_P | PTE_G;
+		off += PGSIZE;
+	}
+}
+
+//
+// Replace the superpage holding user address 'va' in pgdir with a page
+// table mapping the same 4MB, 4KB at a time, with the same permissions.
+// If pgdir alone maps the block, the table maps its own frames, which
+// from then on count their references one by one (page_free_order
+// lets them be freed singly).  A copy-on-write block that others still
+// map is copied instead, into writable pages of pgdir's own.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM if there's no memory for the page table or the copy
+//   -E_INVAL if others map the block and it is not copy-on-write
+//
+static int
+superpage_split(pde_t *pgdir, void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *block = pa2page(ROUNDDOWN(pde, PTSIZE));
+	struct PageInfo *table, *pp;
+	bool copy = block->pp_ref > 1;
+	int perm = pde & PTE_SYSCALL;
+	pte_t *pt;
+	int i;
+
+	if (copy && !(pde & PTE_COW))
+		return -E_INVAL;
+	if (copy)
+		perm = (perm & ~PTE_COW) | PTE_W;
+	if (!(table = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pt = page2kva(table);
+	for (i = 0; i < NPTENTRIES; i++)
+	{
+		pp = block + i;
+		if (copy)
+		{
+			if (!(pp = page_alloc(ALLOC_HIGH)))
+			{
+				while (--i >= 0)
+					page_decref(pa2page(PTE_ADDR(pt[i])));
+				page_free(table);
+				return -E_NO_MEM;
+			}
+			memcpy(page_kmap(pp, KMAP_DST), page_kmap(block + i, KMAP_SRC), PGSIZE);
+		}
+		// The first page keeps the reference the block had
+		if (pp != block)
+			pp->pp_ref++;
+		pt[i] = page2pa(pp) | perm | PTE_P;
 	}
+
+	table->pp_ref++;
+	pgdir[PDX(va)] = page2pa(table) | PTE_P | PTE_W | PTE_U;
+	tlb_flush(pgdir);
+	if (copy)
+		superpage_decref(block);
+	return 0;
 }
 
 //
@@ -516,9 +1158,14 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// If a superpage covers 'va', it is split into 4KB pages first (see
+// superpage_split), so the rest of its 4MB stays mapped.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is in a superpage others map that is not
+//     copy-on-write
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -526,46 +1173,309 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+	int ret;
 	pte_t *pg_table_entry = pgdir_walk(pgdir, va, true);
 	if (pg_table_entry == NULL)
 		return -E_NO_MEM;
 
+	if (*pg_table_entry & PTE_PS)
+	{
+		if ((ret = superpage_split(pgdir, va)) < 0)
+			return ret;
+		pg_table_entry = pgdir_walk(pgdir, va, false);
+	}
+
 	// Increment here to avoid page_remove freeing pp
 	pp->pp_ref++;
 
 	if ((*pg_table_entry & PTE_P) != 0)
 		page_remove(pgdir, va);
 
-	// Add relevant permissions to page table, as well as to the page dir
+	// Add relevant permissions to page table, as well as to the page dir,
+	// whose PTE_COW means a page table fork left shared
 	*pg_table_entry = page2pa(pp) | perm | PTE_P;
-	pgdir[PDX(va)] |= perm;
+	pgdir[PDX(va)] |= perm & (PTE_U | PTE_W);
 	return 0;
 }
 
 //
-// Return the page mapped at virtual address 'va'.
-// If pte_store is not zero, then we store in it the address
-// of the pte for this page.  This is used by page_remove and
-// can be used to verify page permissions for syscall arguments,
-// but should not be used by most callers.
-//
-// Return NULL if there is no page mapped at va.
+// Map a page of zeros at 'va' in pgdir with permissions 'perm|PTE_P',
+// as page_insert would map a fresh page from page_alloc(ALLOC_ZERO).
+// Unless perm has PTE_SHARE, that page is the zero page: one frame of
+// zeros that every such mapping shares, read-only and, if perm has
+// PTE_W, PTE_COW.  The first write gets a frame of its own
+// (page_cow_resolve), so memory that is never written costs neither a
+// frame nor a memset.  Mappings come and go too often for its pp_ref
+// to mean anything: page_decref never frees it.
 //
-// Hint: the TA solution uses pgdir_walk and pa2page.
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM if there's no memory for the page or a page table
 //
-struct PageInfo *
-page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+int
+page_insert_zero(pde_t *pgdir, void *va, int perm)
 {
-	pte_t *pg_table_entry = pgdir_walk(pgdir, va, false);
-	if (pg_table_entry == NULL || (*pg_table_entry & PTE_P) == 0)
-		return NULL;
+	struct PageInfo *pp;
+	int ret;
+
+	if (!(perm & PTE_SHARE))
+		return page_insert(pgdir, zero_page, va,
+						   perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm);
+	if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGH)))
+		return -E_NO_MEM;
+	if ((ret = page_insert(pgdir, pp, va, perm)) < 0)
+		page_free(pp);
+	return ret;
+}
+
+//
+// Map fresh pages, from page_alloc(alloc_flags), over the page-aligned
+// range [va, va+len) of pgdir with permissions 'perm|PTE_P'.  With
+// ALLOC_ZERO, they are the zero page instead, as in page_insert_zero,
+// unless perm has PTE_SHARE.  Pages
+// already mapped in the range are left alone.  Unlike page_insert
+// page by page, this walks to each page table once and fills its
+// entries in a row; nothing was mapped there, so the TLB holds nothing
+// to invalidate.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM if out of memory; what was mapped so far stays mapped
+//
+int
+page_region_alloc(pde_t *pgdir, uintptr_t va, size_t len, int perm,
+				  int alloc_flags)
+{
+	uintptr_t end = va + len, ptend;
+	struct PageInfo *pp;
+	pte_t *pte;
+	bool zero = (alloc_flags & ALLOC_ZERO) && !(perm & PTE_SHARE);
+	int zperm = perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm;
+
+	assert(va % PGSIZE == 0 && len % PGSIZE == 0 && end <= UTOP);
+	for (; va < end; va = ptend)
+	{
+		ptend = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+		if (!(pte = pgdir_walk(pgdir, (void *) va, true)))
+			return -E_NO_MEM;
+		if (*pte & PTE_PS)
+			continue;       // A superpage already maps it all
+		for (; va < ptend; va += PGSIZE, pte++)
+		{
+			if (*pte & PTE_P)
+				continue;
+			if (zero)
+			{
+				zero_page->pp_ref++;
+				*pte = page2pa(zero_page) | zperm | PTE_P;
+				continue;
+			}
+			if (!(pp = page_alloc(alloc_flags)))
+				return -E_NO_MEM;
+			pp->pp_ref++;
+			*pte = page2pa(pp) | perm | PTE_P;
+		}
+		pgdir[PDX(ptend - 1)] |= perm & (PTE_U | PTE_W);
+	}
+	return 0;
+}
+
+//
+// Map the 2^SUPERPAGE_ORDER page block starting at 'pp' (from
+// page_alloc_order) as one 4MB page at the PTSIZE-aligned 'va',
+// with permissions 'perm|PTE_PS|PTE_P'.  Whatever was mapped in
+// [va, va+PTSIZE) before is removed, including its page table.
+// Only pp->pp_ref counts references to the whole block.
+//
+// RETURNS:
+//   0 on success
+//   -E_NOT_SUPP if the CPU has no PSE support
+//
+int
+superpage_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t pde = pgdir[PDX(va)];
+	physaddr_t pt_pa;
+	int i;
+
+	assert((uintptr_t) va % PTSIZE == 0);
+	if (!superpages_enabled)
+		return -E_NOT_SUPP;
+
+	// Increment here to avoid page_remove freeing pp
+	pp->pp_ref++;
+
+	if ((pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		page_remove(pgdir, va);
+	else if (pde & PTE_P)
+	{
+		// A page table still shared with another address space keeps
+		// its pages for the others
+		pt_pa = PDE_ADDR(pde);
+		if (!(pde & PTE_COW) || pa2page(pt_pa)->pp_ref == 1)
+			for (i = 0; i < NPTENTRIES; i++)
+				page_remove(pgdir, va + i * PGSIZE);
+		pgdir[PDX(va)] = 0;
+		tlb_flush(pgdir);
+		page_decref(pa2page(pt_pa));
+	}
+
+	pgdir[PDX(va)] = page2pa(pp) | perm | PTE_PS | PTE_P;
+	return 0;
+}
+
+//
+// Drop a reference to a superpage block, freeing the whole
+// block when the last one goes away.
+//
+void
+superpage_decref(struct PageInfo *pp)
+{
+	// Someone sleeping on the page learns it lost a mapping
+	if (pp->pp_waiters)
+		page_wait_wake(pp);
+	if (--pp->pp_ref == 0)
+		page_free_order(pp, SUPERPAGE_ORDER);
+}
+
+//
+// Return the page mapped at virtual address 'va'.
+// If pte_store is not zero, then we store in it the address
+// of the pte for this page.  This is used by page_remove and
+// can be used to verify page permissions for syscall arguments,
+// but should not be used by most callers.
+//
+// If va is inside a superpage, this returns the block's page at va and
+// *pte_store is the page directory entry (check for PTE_PS).  Only the
+// block's first page counts references to it (see superpage_insert).
+//
+// Return NULL if there is no page mapped at va.
+//
+// Hint: the TA solution uses pgdir_walk and pa2page.
+//
+struct PageInfo *
+page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+	pte_t *pg_table_entry = pgdir_walk(pgdir, va, false);
+	if (pg_table_entry == NULL || (*pg_table_entry & PTE_P) == 0)
+		return NULL;
 
 	if (pte_store != NULL)
 		*pte_store = pg_table_entry;
 
+	// A 4MB page keeps its PAT bit in bit 12, below its address
+	if (*pg_table_entry & PTE_PS)
+		return pa2page(ROUNDDOWN(*pg_table_entry, PTSIZE) +
+					   ((uintptr_t) va & (PTSIZE - 1)));
 	return pa2page(PTE_ADDR(*pg_table_entry));
 }
 
+//
+// page_cow_resolve for the superpage holding user address 'va' in
+// pgdir: the block itself made writable if no one else maps it any
+// more, or else a copy, of the whole block if there is a free one, or
+// else 4KB at a time (see superpage_split).
+//
+static int
+superpage_cow_resolve(pde_t *pgdir, void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *block = pa2page(ROUNDDOWN(pde, PTSIZE)), *copy;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	if (!(pde & PTE_U))
+		return -E_INVAL;
+	if (!(pde & PTE_COW))
+		return (pde & PTE_W) ? 0 : -E_INVAL;
+
+	if (block->pp_ref == 1)
+	{
+		pgdir[PDX(va)] = (pde & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc_order(SUPERPAGE_ORDER, 0)))
+		return superpage_split(pgdir, va);
+	memcpy(page2kva(copy), page2kva(block), PTSIZE);
+	return superpage_insert(pgdir, copy, va,
+							(pde & PTE_SYSCALL & ~PTE_COW) | PTE_W);
+}
+
+//
+// Give pgdir a writable page of its own in place of the copy-on-write
+// page holding user address 'va': a copy, or, if no one else holds the
+// page any more, the page itself made writable.  The zero page is never
+// made writable, and needs no copy: a page from page_alloc(ALLOC_ZERO)
+// replaces it.  Its page table comes first, if fork left that shared
+// (see pgdir_unshare).  A page already made writable by another
+// environment sharing pgdir (see sys_exofork_shared) is left alone.
+// A copy-on-write superpage is resolved whole (superpage_cow_resolve).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or is not in a mapped copy-on-write page.
+//	-E_NO_MEM if there's no memory for the copy.
+//
+int
+page_cow_resolve(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm, ret;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	if ((ret = pgdir_unshare(pgdir, va)) < 0)
+		return ret;
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return superpage_cow_resolve(pgdir, va);
+	if (!(pp = page_lookup(pgdir, va, &pte)) || (*pte & (PTE_U | PTE_PS)) != PTE_U)
+		return -E_INVAL;
+	if (!(*pte & PTE_COW))
+		return (*pte & PTE_W) ? 0 : -E_INVAL;
+
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1 && pp != zero_page)
+	{
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (pp == zero_page)
+	{
+		if (!(copy = page_alloc(ALLOC_ZERO | ALLOC_HIGH)))
+			return -E_NO_MEM;
+	}
+	else
+	{
+		if (!(copy = page_alloc(ALLOC_HIGH)))
+			return -E_NO_MEM;
+		memcpy(page_kmap(copy, KMAP_DST), page_kmap(pp, KMAP_SRC), PGSIZE);
+	}
+	if ((ret = page_insert(pgdir, copy, va, perm)) < 0)
+		page_free(copy);
+	return ret;
+}
+
+//
+// If user address 'va' in pgdir maps a copy-on-write page, give pgdir
+// its own now, as a write would.  Call this before the page's frame
+// is written other than through pgdir, or named by physical address
+// (by a device, say, or a futex), which must not change under it.
+// Other pages are left alone.
+//
+// Returns 0 on success, -E_NO_MEM if there's no memory for the copy.
+//
+int
+page_cow_break(pde_t *pgdir, const void *va)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, false);
+
+	if (!pte || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	return page_cow_resolve(pgdir, (void *) va);
+}
+
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
@@ -588,19 +1498,142 @@ page_remove(pde_t *pgdir, void *va)
 	struct PageInfo *pg_info = page_lookup(pgdir, va, &pg_entry);
 	if (pg_info == NULL)
 		return;
-	// Decrement pp_ref and free if needed
-	page_decref(pg_info);
-	// Unmap the page table entry corresponding to va
+
+	// A page table fork left shared is copied first.  Callers that can
+	// fail have seen to that already (see sys_page_unmap).
+	if (pgdir[PDX(va)] & PTE_COW)
+	{
+		if (pgdir_unshare(pgdir, va) < 0)
+			panic("page_remove: cannot unshare the page table of %p", va);
+		page_lookup(pgdir, va, &pg_entry);
+	}
+	bool super = *pg_entry & PTE_PS;
+
+	// Unmap the page table entry corresponding to va, and make
+	// sure no CPU still caches it before the page can be freed.
 	*pg_entry = 0;
-	// If pp pg_info was freed
-	if (pg_info->pp_ref == 0)
-		// Unmap the page table entry
-		tlb_invalidate(pgdir, va);
+	tlb_invalidate(pgdir, va);
+	// Decrement pp_ref and free if needed
+	if (super)
+		superpage_decref(pa2page(ROUNDDOWN((uintptr_t) page2pa(pg_info), PTSIZE)));
+	else
+		page_decref(pg_info);
+}
+
+//
+// TLB shootdown.  A CPU that changes a mapping in 'pgdir' queues the
+// invalidation on every other CPU running an environment with that
+// page directory and interrupts it with T_TLBSHOOT.  Requests queued
+// before the target gets to them are carried out together, and more
+// than TLB_BATCH of them become a single full flush.
+//
+// Only CPUs running user code need the interrupt: a CPU that entered
+// the kernel (cpu_in_kernel) runs tlb_shootdown_handle in env_pop_tf
+// before returning to user mode, and in trap once it holds kernel_lock,
+// before it touches user memory.  Before a page goes back to the free
+// list, tlb_shootdown_wait makes sure every outstanding request has
+// been carried out or will be before user code runs again.
+//
+// A system call handled without kernel_lock (see syscall_unlocked)
+// touches user memory all the same, so it counts as user code: it
+// carries out what was queued when it starts, and pages are not freed
+// under it until it returns to user mode.  Code that frees pages must
+// therefore not hold a lock such a call takes (the e1000 ring locks,
+// say), or each CPU would wait for the other.
+//
+
+static void
+tlb_shootdown(pde_t *pgdir, void *va, bool all)
+{
+	struct CpuInfo *c;
+	bool need_ipi;
+
+	// Order the PTE store before the cpu_env loads below.
+	asm volatile("lock; addl $0, 0(%%esp)" : : : "memory", "cc");
+
+	for (c = cpus; c < cpus + ncpu; c++)
+	{
+		if (c == thiscpu || !c->cpu_env || c->cpu_env->env_pgdir != pgdir)
+			continue;
+
+		spin_lock(&c->cpu_tlb_lock);
+		if (all || c->cpu_tlb_nva >= TLB_BATCH)
+			c->cpu_tlb_nva = TLB_BATCH + 1;
+		else
+			c->cpu_tlb_va[c->cpu_tlb_nva++] = (uintptr_t) va;
+		// One interrupt covers everything queued until it is handled.
+		need_ipi = c->cpu_tlb_req == c->cpu_tlb_ack;
+		c->cpu_tlb_req++;
+		spin_unlock(&c->cpu_tlb_lock);
+
+		if (need_ipi)
+			lapic_ipi_cpu(c->cpu_id, T_TLBSHOOT);
+	}
+}
+
+//
+// Carry out the invalidations other CPUs queued for this one.
+//
+void
+tlb_shootdown_handle(void)
+{
+	struct CpuInfo *c = thiscpu;
+	unsigned i;
+
+	if (c->cpu_tlb_req == c->cpu_tlb_ack)
+		return;
+
+	spin_lock(&c->cpu_tlb_lock);
+	if (c->cpu_tlb_nva > TLB_BATCH)
+		lcr3(rcr3());
+	else
+		for (i = 0; i < c->cpu_tlb_nva; i++)
+			invlpg((void *) c->cpu_tlb_va[i]);
+	c->cpu_tlb_nva = 0;
+	c->cpu_tlb_ack = c->cpu_tlb_req;
+	spin_unlock(&c->cpu_tlb_lock);
+}
+
+//
+// Wait until no CPU can still be using a mapping we removed.
+//
+void
+tlb_shootdown_wait(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c != thiscpu && c->cpu_tlb_req != c->cpu_tlb_ack && !c->cpu_in_kernel)
+			asm volatile("pause");
+}
+
+//
+// This CPU, which trapped from user mode, is about to handle a system
+// call without kernel_lock: count it as running user code again, and
+// catch up on the shootdowns queued meanwhile, before it touches user
+// memory.
+//
+void
+tlb_shootdown_unlocked_enter(void)
+{
+	xchg(&thiscpu->cpu_in_kernel, 0);
+	tlb_shootdown_handle();
+}
+
+//
+// The system call needs kernel_lock after all: stop counting this CPU
+// as running user code, or a CPU holding the lock could wait for it.
+//
+void
+tlb_shootdown_unlocked_exit(void)
+{
+	xchg(&thiscpu->cpu_in_kernel, 1);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Invalidate a TLB entry on this CPU, if the page tables being edited
+// are the ones currently in use by the processor, and on every other
+// CPU that is using them.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
@@ -608,15 +1641,227 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir, va, 0);
+}
+
+//
+// Like tlb_invalidate, for every non-global mapping in pgdir.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(rcr3());
+	tlb_shootdown(pgdir, NULL, 1);
+}
+
+//
+// Copy every user mapping below UTOP in 'src' into 'dst' for a
+// copy-on-write fork, except the exception stacks: UXSTACKTOP's and
+// those of the thread slots, which the other threads sharing 'src' may
+// be using and so must stay writable there.  Page tables in
+// 'src' that are not present are skipped entirely.
+//
+// A page table with no PTE_SHARE page and no exception stack in it is
+// not copied at all: both page directories map it, read-only and
+// marked PTE_COW, and do not touch its pages' reference counts.  Only
+// a write under it, by either side, copies it (see pgdir_unshare), so
+// forking a large address space costs about one step per 4MB.  In a
+// table that is copied, writable pages that aren't PTE_SHARE become
+// read-only PTE_COW in both page directories, and so do superpages
+// that aren't PTE_SHARE; shared pages keep their permissions.
+// Flushes the TLBs using 'src' once at the end.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+// Is the page at va a user exception stack?
+static bool
+is_xstack(uintptr_t va)
+{
+	if (va == UXSTACKTOP - PGSIZE)
+		return true;
+	return va >= UTHREADS && va < UTHREADTOP &&
+		   (va - UTHREADS) % THREADSLOT == THREAD_XSTACKTOP - PGSIZE;
+}
+
+// Can the page table 'pt', for the 4MB at 'pdeno', be shared by fork?
+static bool
+pgtable_shareable(uint32_t pdeno, const pte_t *pt)
+{
+	uint32_t pteno;
+
+	for (pteno = 0; pteno < NPTENTRIES; pteno++)
+		if ((pt[pteno] & PTE_P) &&
+			((pt[pteno] & PTE_SHARE) || is_xstack((uintptr_t) PGADDR(pdeno, pteno, 0))))
+			return false;
+	return true;
+}
+
+//
+// Give pgdir a page table of its own for the 4MB holding va, if fork
+// left it sharing one (see pgdir_dup_cow).  If others still map the
+// shared table, pgdir gets a copy, and the writable pages in the two
+// become PTE_COW, each now referenced from both; otherwise the shared
+// table simply becomes pgdir's, writable again.
+//
+// RETURNS:
+//   0 on success, including when the table is not shared
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *table, *copy;
+	pte_t *pt, *npt;
+	uint32_t i;
+
+	if ((pde & (PTE_P | PTE_PS | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+
+	table = pa2page(PDE_ADDR(pde));
+	if (table->pp_ref > 1)
+	{
+		if (!(copy = page_alloc(0)))
+			return -E_NO_MEM;
+		pt = page2kva(table);
+		npt = page2kva(copy);
+		for (i = 0; i < NPTENTRIES; i++)
+		{
+			if ((pt[i] & (PTE_P | PTE_W)) == (PTE_P | PTE_W))
+				pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+			if (pt[i] & PTE_P)
+				pa2page(PTE_ADDR(pt[i]))->pp_ref++;
+			npt[i] = pt[i];
+		}
+		copy->pp_ref++;
+		table->pp_ref--;
+		table = copy;
+	}
+	pgdir[PDX(va)] = page2pa(table) | (pde & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	tlb_flush(pgdir);
+	return 0;
+}
+
+//
+// Can user code write to va in pgdir?  Not under a page table fork
+// left shared, whatever the page table entry says.
+//
+bool
+page_writable(pde_t *pgdir, const void *va)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, false);
+
+	return pte && (*pte & (PTE_P | PTE_U | PTE_W)) == (PTE_P | PTE_U | PTE_W) &&
+		   (pgdir[PDX(va)] & PTE_W);
+}
+
+int
+pgdir_dup_cow(pde_t *dst, pde_t *src)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *pt, pte;
+	int perm, ret = 0;
+
+	for (pdeno = 0; pdeno < PDX(UTOP) && ret == 0; pdeno++)
+	{
+		if (!(src[pdeno] & PTE_P))
+			continue;
+
+		// Superpages are copy-on-write as pages are, but whole
+		if (src[pdeno] & PTE_PS)
+		{
+			perm = src[pdeno] & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW)))
+			{
+				perm = (perm & ~PTE_W) | PTE_COW;
+				src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			}
+			ret = superpage_insert(dst, pa2page(ROUNDDOWN(src[pdeno], PTSIZE)),
+								   PGADDR(pdeno, 0, 0), perm);
+			continue;
+		}
+
+		pt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+		if ((src[pdeno] & PTE_COW) || pgtable_shareable(pdeno, pt))
+		{
+			src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			dst[pdeno] = src[pdeno];
+			pa2page(PDE_ADDR(src[pdeno]))->pp_ref++;
+			continue;
+		}
+
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+		{
+			pte = pt[pteno];
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if (!(pte & PTE_P) || is_xstack(va))
+				continue;
+
+			perm = pte & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW)))
+			{
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[pteno] = PTE_ADDR(pte) | perm;
+			}
+			if ((ret = page_insert(dst, pa2page(PTE_ADDR(pte)), (void *) va, perm)) < 0)
+				break;
+		}
+	}
+
+	tlb_flush(src);
+	return ret;
+}
+
+// Load this CPU's PAT.  Every CPU must agree on it, so the boot CPU
+// does this in mem_init and the others in mp_main.  No existing mapping
+// changes type, so nothing needs flushing.
+void
+pat_init_percpu(void)
+{
+	if (pat_enabled)
+		wrmsr(MSR_PAT, PAT_VALUE);
+}
+
+// Page table bits selecting memory type 'type' (see PAT_VALUE).
+// Without a PAT, write-combining falls back to uncached.
+static int
+mem_type_bits(int type)
+{
+	switch (type)
+	{
+		case MEM_WB:
+			return 0;
+		case MEM_WT:
+			return PTE_PWT;
+		case MEM_WC:
+			if (pat_enabled)
+				return PTE_PAT | PTE_PWT;
+			return PTE_PCD | PTE_PWT;
+		case MEM_UC:
+		default:
+			return PTE_PCD | PTE_PWT;
+	}
 }
 
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
-// location.  Return the base of the reserved region.  size does *not*
-// have to be multiple of PGSIZE.
+// location, uncached.  Return the base of the reserved region.  size
+// does *not* have to be multiple of PGSIZE.
 //
 void *
 mmio_map_region(physaddr_t pa, size_t size)
+{
+	return mmio_map_type(pa, size, MEM_UC);
+}
+
+// Like mmio_map_region, but the mapping has memory type 'type', one of
+// the MEM_* constants in kern/pmap.h.
+void *
+mmio_map_type(physaddr_t pa, size_t size, int type)
 {
 	// Where to start the next region.  Initially, this is the
 	// beginning of the MMIO region.  Because this is static, its
@@ -646,7 +1891,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 
 	size = ROUNDUP(size, PGSIZE);
 
-	if (base + size > MMIOLIM)
+	if (base + size > KMAPBASE)
 		panic("MMIO region overflow");
 
 	boot_map_region(
@@ -654,7 +1899,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 			base,
 			size,
 			pa,
-			PTE_W | PTE_PCD | PTE_PWT
+			PTE_W | mem_type_bits(type)
 	);
 
 	base += size;
@@ -663,6 +1908,45 @@ mmio_map_region(physaddr_t pa, size_t size)
 
 static uintptr_t user_mem_check_addr;
 
+// Do both va's page directory entry and its page table entry grant perm?
+static bool
+user_page_ok(pde_t *pgdir, const void *va, int perm)
+{
+	pte_t *p = pgdir_walk(pgdir, va, false);
+
+	return p && (*p & perm) == perm && (pgdir[PDX(va)] & perm) == perm;
+}
+
+// Like user_page_ok for every page in [begin, end), both page-aligned
+// and below ULIM, looking each page directory entry up once for all
+// the pages of its table.  Returns the first page that fails, or end
+// (begin, if that is already past end).
+static const void *
+user_range_ok(pde_t *pgdir, const void *begin, const void *end, int perm)
+{
+	const void *next;
+	pte_t *pt;
+	pde_t pde;
+
+	while (begin < end)
+	{
+		pde = pgdir[PDX(begin)];
+		if ((pde & perm) != perm)
+			return begin;
+		next = MIN(ROUNDDOWN(begin, PTSIZE) + PTSIZE, end);
+		if (pde & PTE_PS)
+		{
+			begin = next;
+			continue;
+		}
+		pt = (pte_t *) KADDR(PDE_ADDR(pde));
+		for (; begin < next; begin += PGSIZE)
+			if ((pt[PTX(begin)] & perm) != perm)
+				return begin;
+	}
+	return begin;
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -678,6 +1962,12 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// Both the page directory and the page table entry must grant 'perm'.
+// A writable range the user would have to take a copy-on-write fault
+// on, page or page table, is first made the environment's own, as the
+// fault would -- provided we hold the big kernel lock, which guards
+// page tables.  Without it (see syscall_unlocked) such a range fails.
+//
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
@@ -687,16 +1977,34 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	perm |= PTE_P;
 
 	const void *begin = ROUNDDOWN(va, PGSIZE);
-	const void *end = ROUNDUP(va + len, PGSIZE);
-
-	for (; begin < end; begin += PGSIZE)
+	uintptr_t end = (uintptr_t) va + len;
+	const void *lim;
+	bool above;
+
+	// A range that wraps around the address space, or ends above ULIM,
+	// fails; its part below ULIM is still walked for an earlier bad
+	// address.  This is checked before rounding, as an end in the last
+	// page rounds up to 0.
+	above = end < (uintptr_t) va || end > ULIM;
+	lim = above ? (const void *) ULIM : ROUNDUP((const void *) end, PGSIZE);
+
+	while ((begin = user_range_ok(env->env_pgdir, begin, lim, perm)) < lim)
 	{
-		pte_t *p = pgdir_walk(env->env_pgdir, (void *) begin, false);
-		if (p == NULL || !(*p & perm) || (unsigned int) begin >= ULIM)
+		if ((perm & PTE_W) && (uintptr_t) begin < UTOP &&
+			kernel_lock_held() &&
+			page_cow_resolve(env->env_pgdir, (void *) begin) == 0 &&
+			user_page_ok(env->env_pgdir, begin, perm))
 		{
-			user_mem_check_addr = (uintptr_t) ((begin < va) ? va : begin);
-			return -E_FAULT;
+			begin += PGSIZE;
+			continue;
 		}
+		user_mem_check_addr = (uintptr_t) ((begin < va) ? va : begin);
+		return -E_FAULT;
+	}
+	if (above)
+	{
+		user_mem_check_addr = MAX((uintptr_t) va, ULIM);
+		return -E_FAULT;
 	}
 	return 0;
 }
@@ -719,6 +2027,97 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	}
 }
 
+// kern/uaccess.S
+uint32_t copy_user(void *dst, const void *src, size_t len);
+
+struct extable_entry {
+	uintptr_t insn;
+	uintptr_t fixup;
+};
+
+extern const struct extable_entry __EX_TABLE_BEGIN__[], __EX_TABLE_END__[];
+
+//
+// Where to resume after a page fault at kernel instruction 'eip' that
+// page_fault_handler cannot resolve, or 0 if 'eip' is not allowed to
+// fault.
+//
+uintptr_t
+extable_fixup(uintptr_t eip)
+{
+	const struct extable_entry *x;
+
+	for (x = __EX_TABLE_BEGIN__; x < __EX_TABLE_END__; x++)
+		if (x->insn == eip)
+			return x->fixup;
+	return 0;
+}
+
+// Is [uva, uva+len) below ULIM, without wrapping around?
+static bool
+user_range_below_ulim(const void *uva, size_t len)
+{
+	return (uintptr_t) uva + len >= (uintptr_t) uva &&
+		(uintptr_t) uva + len <= ULIM;
+}
+
+//
+// Copy len bytes from the current environment's address 'usrc' to the
+// kernel's 'dst', with no user_mem_check before: a page the environment
+// cannot read makes the copy fail part way through.
+//
+// Returns 0 on success, -E_FAULT if the environment cannot read some
+// of [usrc, usrc+len).
+//
+int
+copyin(void *dst, const void *usrc, size_t len)
+{
+	if (!user_range_below_ulim(usrc, len) || copy_user(dst, usrc, len) != 0)
+		return -E_FAULT;
+	return 0;
+}
+
+//
+// Copy the NUL-terminated string at the current environment's address
+// 'usrc', NUL and all, to the kernel's 'dst', which has room for 'max'
+// bytes.
+//
+// Returns the string's length on success, < 0 on error.  Errors are:
+//	-E_FAULT if the environment cannot read some of the string.
+//	-E_NO_MEM if the string does not fit in 'max' bytes.
+//
+int
+copyinstr(char *dst, const char *usrc, size_t max)
+{
+	size_t i;
+
+	for (i = 0; i < max; i++)
+	{
+		if (copyin(&dst[i], &usrc[i], 1) < 0)
+			return -E_FAULT;
+		if (dst[i] == '\0')
+			return i;
+	}
+	return -E_NO_MEM;
+}
+
+//
+// Copy len bytes from the kernel's 'src' to the current environment's
+// address 'udst'.  A copy-on-write page is made the environment's own
+// on the way, as a user write would, provided we hold the big kernel
+// lock (see user_mem_check).
+//
+// Returns 0 on success, -E_FAULT if the environment cannot write some
+// of [udst, udst+len).
+//
+int
+copyout(void *udst, const void *src, size_t len)
+{
+	if (!user_range_below_ulim(udst, len) || copy_user(udst, src, len) != 0)
+		return -E_FAULT;
+	return 0;
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
@@ -889,22 +2288,25 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
 	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV * sizeof(struct Env), PGSIZE);
+	n = ROUNDUP(nenv * sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+		assert(check_va2pa(pgdir, UENVS + i) == check_va2pa(pgdir, KENVS + i));
+
+	// check kernel info page
+	assert(check_va2pa(pgdir, UINFO) == PADDR(uinfo));
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	for (i = 0; i < npages_low * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	// (updated in lab 4 to check per-CPU kernel stacks)
+	// check kernel stack: CPU 0's is bootstack, and the other CPUs'
+	// slots stay empty until mem_init_mp
 	for (n = 0; n < NCPU; n++)
 	{
 		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
 		for (i = 0; i < KSTKSIZE; i += PGSIZE)
 			assert(check_va2pa(pgdir, base + KSTKGAP + i)
-				   == PADDR(percpu_kstacks[n]) + i);
+				   == (n == 0 ? PADDR(bootstack) + i : ~0));
 		for (i = 0; i < KSTKGAP; i += PGSIZE)
 			assert(check_va2pa(pgdir, base + i) == ~0);
 	}
@@ -947,6 +2349,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) | (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	p = (pte_t *) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -15,8 +15,10 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern size_t npages_low;
 
 extern pde_t *kern_pgdir;
+extern struct PageInfo *zero_page;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -41,7 +43,7 @@ _paddr(const char *file, int line, void *kva)
 static inline void *
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages_low)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *) (pa + KERNBASE);
 }
@@ -50,24 +52,77 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1 << 0,
+	// The page may come from high memory, above the KERNBASE map.
+	ALLOC_HIGH = 1 << 1,
+};
+
+// page_kmap's windows onto high memory pages, per CPU
+enum {
+	KMAP_DST,
+	KMAP_SRC,
+	KMAP_RING,      // sys_enter_ring's, held across the calls it runs
+	KMAP_NSLOTS
 };
 
 void mem_init(void);
+void mem_init_mp(void);
+
+// Largest buddy block: 2^BUDDY_MAX_ORDER pages (4MB)
+#define BUDDY_MAX_ORDER 10
+// Pages in a 4MB superpage, as a buddy order
+#define SUPERPAGE_ORDER (PTSHIFT - PGSHIFT)
+
+extern bool superpages_enabled;
+extern bool globalpages_enabled;
 
 void page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void page_free_order(struct PageInfo *pp, int order);
+void page_zero_refill(void);
+void page_print_stats(void);
 int page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int page_insert_zero(pde_t *pgdir, void *va, int perm);
+int page_region_alloc(pde_t *pgdir, uintptr_t va, size_t len, int perm,
+					  int alloc_flags);
+int superpage_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+void superpage_decref(struct PageInfo *pp);
+int pgdir_dup_cow(pde_t *dst, pde_t *src);
+int pgdir_unshare(pde_t *pgdir, const void *va);
+bool page_writable(pde_t *pgdir, const void *va);
 void page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+int page_cow_resolve(pde_t *pgdir, void *va);
+int page_cow_break(pde_t *pgdir, const void *va);
 void page_decref(struct PageInfo *pp);
 
 void tlb_invalidate(pde_t *pgdir, void *va);
+void tlb_flush(pde_t *pgdir);
+void tlb_shootdown_handle(void);
+void tlb_shootdown_wait(void);
+void tlb_shootdown_unlocked_enter(void);
+void tlb_shootdown_unlocked_exit(void);
+
+// Memory types for mmio_map_type
+enum {
+	MEM_UC,         // Uncached: device registers
+	MEM_WC,         // Write-combining: frame buffers, posted write buffers
+	MEM_WT,         // Write-through
+	MEM_WB,         // Write-back, like ordinary memory
+};
 
+void pat_init_percpu(void);
 void *mmio_map_region(physaddr_t pa, size_t size);
+void *mmio_map_type(physaddr_t pa, size_t size, int type);
 
 int user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int copyin(void *dst, const void *usrc, size_t len);
+int copyinstr(char *dst, const char *usrc, size_t max);
+int copyout(void *udst, const void *src, size_t len);
+uintptr_t extable_fixup(uintptr_t eip);
+void *page_kmap(struct PageInfo *pp, int slot);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
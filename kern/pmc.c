@@ -0,0 +1,194 @@
+// Hardware performance counters, per environment.
+//
+// sys_pmc_set gives an environment up to PMC_MAX of Intel's
+// general-purpose counters, each counting one event.  CR4.PCE is set on
+// every CPU, so the environment reads them itself with rdpmc (read_pmc
+// in inc/x86.h), without trapping into the kernel.
+//
+// The counters move with the environment: env_run calls pmc_switch,
+// which saves the counts of the environment that last ran on this CPU
+// and loads those of the next one, and sched_halt stops them.  So a
+// count covers only the time its environment ran - in the kernel too,
+// with PMC_OS - whichever CPUs it ran on.  Environments that never ask
+// for counters cost a compare per switch.
+//
+// Counts are restored with full-width writes where the CPU has them.
+// Older ones only take a sign-extended 32-bit write, so there a count
+// is restored to its low 31 bits and wraps at 2^31 across switches.
+// Everything here is protected by the big kernel lock.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/pmc.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+#define CPUID_PDCM              (1 << 15)       // CPUID.1:ECX, PERF_CAPABILITIES
+
+#define MSR_PMC0                0x0C1
+#define MSR_PERFEVTSEL0         0x186
+#define MSR_PERF_CAPABILITIES   0x345
+#define MSR_PERF_GLOBAL_CTRL    0x38F
+#define MSR_A_PMC0              0x4C1           // full-width writes to PMC0
+
+#define PERFCAP_FW_WRITE        (1 << 13)
+#define EVTSEL_EN               (1 << 22)
+
+uint32_t pmc_ncounters;         // Counters we use, 0..PMC_MAX
+uint32_t pmc_width;             // Their width in bits
+static bool pmc_fw_write;
+
+// Find the counters and let user code read them, on this CPU, leaving
+// every counter stopped.
+void
+pmc_init_percpu(void)
+{
+	uint32_t max, vendor[3], eax, ecx, ver, n, i;
+
+	thiscpu->cpu_pmc_env = NULL;
+	cpuid(0, &max, &vendor[0], &vendor[2], &vendor[1]);
+	if (max < 0xA || memcmp(vendor, "GenuineIntel", sizeof(vendor)) != 0)
+		return;
+	cpuid(0xA, &eax, NULL, NULL, NULL);
+	ver = eax & 0xFF;
+	n = MIN((eax >> 8) & 0xFF, PMC_MAX);
+	if (ver == 0 || n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+	// From version 2 on, a counter counts only if its bit here is set too
+	if (ver >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, (1 << n) - 1);
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	pmc_fw_write = (ecx & CPUID_PDCM) &&
+		(rdmsr(MSR_PERF_CAPABILITIES) & PERFCAP_FW_WRITE);
+	lcr4(rcr4() | CR4_PCE);
+	pmc_width = (eax >> 16) & 0xFF;
+	pmc_ncounters = n;
+}
+
+static void
+pmc_write(uint32_t i, uint64_t count)
+{
+	if (pmc_fw_write)
+		wrmsr(MSR_A_PMC0 + i, count);
+	else
+		wrmsr(MSR_PMC0 + i, count & 0x7FFFFFFF);
+}
+
+// Stop this CPU's counters, saving their counts for e, and clear them
+// so that the next environment can't read them.
+static void
+pmc_save(struct Env *e)
+{
+	struct PmcState *ps = e->env_pmc;
+	uint64_t mask = pmc_width < 64 ? (1ULL << pmc_width) - 1 : ~0ULL;
+	uint32_t i;
+
+	for (i = 0; i < ps->pmc_n; i++)
+	{
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		ps->pmc_count[i] = read_pmc(i) & mask;
+		pmc_write(i, 0);
+	}
+}
+
+// Load e's counts into this CPU's counters and start them.
+static void
+pmc_load(struct Env *e)
+{
+	struct PmcState *ps = e->env_pmc;
+	uint32_t i;
+
+	for (i = 0; i < ps->pmc_n; i++)
+	{
+		pmc_write(i, ps->pmc_count[i]);
+		wrmsr(MSR_PERFEVTSEL0 + i, ps->pmc_evtsel[i] | EVTSEL_EN);
+	}
+}
+
+// e is about to run on this CPU, or nothing is if e is NULL: give it
+// its counters.
+void
+pmc_switch(struct Env *e)
+{
+	struct Env *old = thiscpu->cpu_pmc_env;
+
+	if (old == e)
+		return;
+	if (old)
+		pmc_save(old);
+	thiscpu->cpu_pmc_env = NULL;
+	if (e && e->env_pmc)
+	{
+		pmc_load(e);
+		thiscpu->cpu_pmc_env = e;
+	}
+}
+
+// Make e count the n events evtsel[0..n-1], from 0, in counters 0..n-1;
+// n == 0 stops its counters.  e must be curenv or not running.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if the CPU has no counters we can use.
+//	-E_INVAL if n is more than the CPU has, or an event select has
+//		bits outside PMC_VALID.
+//	-E_BAD_ENV if e is running on another CPU.
+//	-E_NO_MEM if there is no memory for the counts.
+int
+pmc_set(struct Env *e, const uint32_t *evtsel, uint32_t n)
+{
+	struct PmcState *ps;
+	uint32_t i;
+
+	if (pmc_ncounters == 0)
+		return -E_NOT_SUPP;
+	if (n > pmc_ncounters)
+		return -E_INVAL;
+	for (i = 0; i < n; i++)
+		if (evtsel[i] & ~PMC_VALID)
+			return -E_INVAL;
+	if (e != curenv && e->env_status == ENV_RUNNING)
+		return -E_BAD_ENV;
+
+	if (thiscpu->cpu_pmc_env == e)
+		pmc_switch(NULL);
+	if (n == 0)
+	{
+		pmc_env_free(e);
+		return 0;
+	}
+	if (!e->env_pmc)
+	{
+		static_assert(sizeof(struct PmcState) <= KMALLOC_MAX);
+		if (!(e->env_pmc = kmalloc(sizeof(struct PmcState), 0)))
+			return -E_NO_MEM;
+	}
+	ps = e->env_pmc;
+	ps->pmc_n = n;
+	for (i = 0; i < n; i++)
+	{
+		ps->pmc_evtsel[i] = evtsel[i];
+		ps->pmc_count[i] = 0;
+	}
+	if (e == curenv)
+		pmc_switch(e);
+	return 0;
+}
+
+// e is being freed: stop its counters, if they are this CPU's, and
+// drop its counts.
+void
+pmc_env_free(struct Env *e)
+{
+	if (thiscpu->cpu_pmc_env == e)
+		pmc_switch(NULL);
+	kfree(e->env_pmc);
+	e->env_pmc = NULL;
+}
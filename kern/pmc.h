@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_PMC_H
+#define JOS_KERN_PMC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/pmc.h>
+#include <inc/env.h>
+
+// An environment's counters while they are not in the hardware
+struct PmcState {
+	uint32_t pmc_n;                 // Counters in use, 1..PMC_MAX
+	uint32_t pmc_evtsel[PMC_MAX];   // Event selects, without the enable bit
+	uint64_t pmc_count[PMC_MAX];
+};
+
+extern uint32_t pmc_ncounters, pmc_width;
+
+void pmc_init_percpu(void);
+void pmc_switch(struct Env *e);
+int pmc_set(struct Env *e, const uint32_t *evtsel, uint32_t n);
+void pmc_env_free(struct Env *e);
+
+#endif /* !JOS_KERN_PMC_H */
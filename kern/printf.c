@@ -4,7 +4,12 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/spinlock.h>
+#include <kern/console.h>
 
+// Keeps output from different CPUs from interleaving (and from racing
+// on the console state), now that sys_cputs runs without kernel_lock.
+static struct spinlock cons_lock = SPINLOCK_INIT(cons_lock);
 
 static void
 putch(int ch, int *cnt)
@@ -16,12 +21,35 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	// Once the kernel has panicked, a CPU may have died holding the
+	// lock; print regardless.
+	bool locked = !panicstr;
 
+	if (locked)
+		spin_lock(&cons_lock);
 	vprintfmt((void *) putch, &cnt, fmt, ap);
+	if (locked)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
+// Write the len bytes at s to the console, for sys_cputs, without
+// waiting for the serial port to send them (see cons_write).
+void
+cputs_async(const char *s, size_t len)
+{
+	extern const char *panicstr;
+	bool locked = !panicstr;
+
+	if (locked)
+		spin_lock(&cons_lock);
+	cons_write(s, len);
+	if (locked)
+		spin_unlock(&cons_lock);
+}
+
 int
 cprintf(const char *fmt, ...)
 {
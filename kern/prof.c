@@ -0,0 +1,275 @@
+// Sampling profiler.  While profiling is on, every timer interrupt
+// records the EIP it interrupted, and the environment if that was user
+// code, in a buffer of the CPU's own.  prof_report adds the samples up
+// by function: kernel EIPs are looked up in the kernel's symbol index
+// (see debuginfo_fn in kern/kdebug.c), and user EIPs in the ELF symbol
+// table of the image env_create loaded the environment from, which
+// covers the FS and NS servers and the environments they fork.  Other
+// user code has no symbols the kernel can see, and counts against its
+// environment as a whole.
+//
+// Samples come at the timer's rate (UINFO_TICK_USEC), and a CPU whose
+// timer is stopped while it idles (see sched_halt) takes none.  All of
+// this is protected by the big kernel lock, which the timer interrupt
+// takes before it gets here.
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/elf.h>
+
+#include <kern/prof.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kdebug.h>
+
+#define PROF_NSAMPLES   4096    // samples each CPU's buffer holds
+#define PROF_ORDER      3       // its size, as a page_alloc_order order
+#define PROF_NHITS      4096    // distinct EIPs prof_report tells apart
+#define PROF_NFNS       256     // functions it tells apart
+#define PROF_SCRATCH    4       // order of the pages it works in
+
+struct ProfSample {
+	uintptr_t ps_eip;
+	envid_t ps_env;             // 0 in the kernel
+};
+
+// Samples that fell on one EIP, while prof_report counts them
+struct ProfHit {
+	uintptr_t ph_eip;
+	envid_t ph_env;
+	uint32_t ph_count;          // 0 for an empty slot
+};
+
+static struct ProfBuf {
+	struct ProfSample *pb_samples;
+	uint32_t pb_n;
+	uint32_t pb_dropped;        // samples that found the buffer full
+} bufs[NCPU];
+
+static bool prof_on;
+
+// Start profiling afresh, giving each CPU a buffer the first time.
+// Returns 0 on success, -E_NO_MEM if a buffer can't be allocated.
+int
+prof_start(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	static_assert(PROF_NSAMPLES * sizeof(struct ProfSample) <= PGSIZE << PROF_ORDER);
+	for (i = 0; i < ncpu; i++)
+	{
+		if (!bufs[i].pb_samples)
+		{
+			if (!(pp = page_alloc_order(PROF_ORDER, 0)))
+				return -E_NO_MEM;
+			pp->pp_ref++;
+			bufs[i].pb_samples = page2kva(pp);
+		}
+		bufs[i].pb_n = bufs[i].pb_dropped = 0;
+	}
+	prof_on = true;
+	return 0;
+}
+
+// Stop profiling, keeping the samples for prof_report.
+void
+prof_stop(void)
+{
+	prof_on = false;
+}
+
+// Take a sample of the timer interrupt tf.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfBuf *b = &bufs[cpunum()];
+
+	if (!prof_on)
+		return;
+	if (b->pb_n == PROF_NSAMPLES)
+	{
+		b->pb_dropped++;
+		return;
+	}
+	b->pb_samples[b->pb_n].ps_eip = tf->tf_eip;
+	b->pb_samples[b->pb_n].ps_env = (tf->tf_cs & 3) && curenv ? curenv->env_id : 0;
+	b->pb_n++;
+}
+
+// Find the function containing va in the ELF image at binary, from its
+// symbol table.  Returns the symbol, or 0 if there is none.
+static const struct Elfsym *
+elf_symbol(const uint8_t *binary, uintptr_t va, const char **strtab)
+{
+	const struct Elf *elf = (const struct Elf *) binary;
+	const struct Secthdr *sh = (const struct Secthdr *) (binary + elf->e_shoff);
+	const struct Elfsym *sym, *best = 0;
+	size_t i, j, nsym;
+
+	if (elf->e_magic != ELF_MAGIC || elf->e_shoff == 0)
+		return 0;
+	for (i = 0; i < elf->e_shnum && !best; i++)
+	{
+		if (sh[i].sh_type != ELF_SHT_SYMTAB)
+			continue;
+		sym = (const struct Elfsym *) (binary + sh[i].sh_offset);
+		nsym = sh[i].sh_size / sizeof(*sym);
+		for (j = 0; j < nsym; j++)
+			if (ELF_ST_TYPE(sym[j].st_info) == ELF_STT_FUNC && sym[j].st_value <= va &&
+				(!best || sym[j].st_value > best->st_value))
+				best = &sym[j];
+		*strtab = (const char *) (binary + sh[sh[i].sh_link].sh_offset);
+	}
+	return best;
+}
+
+// Fill in pe's function and name for a sample of envid at eip.
+static void
+prof_symbol(struct ProfEntry *pe, envid_t envid, uintptr_t eip)
+{
+	struct Eipdebuginfo info;
+	const struct Elfsym *sym;
+	const char *strtab;
+	struct Env *e;
+
+	pe->pe_env = envid;
+	pe->pe_fn = 0;
+	pe->pe_name[0] = '\0';
+	if (envid == 0)
+	{
+		if (debuginfo_fn(eip, &info) < 0)
+			return;
+		pe->pe_fn = info.eip_fn_addr;
+		memmove(pe->pe_name, info.eip_fn_name, MIN(info.eip_fn_namelen, PROF_NAMELEN - 1));
+		pe->pe_name[MIN(info.eip_fn_namelen, PROF_NAMELEN - 1)] = '\0';
+		return;
+	}
+	e = &envs[ENVX(envid)];
+	if (ENVX(envid) >= nenv || e->env_id != envid || !e->env_binary ||
+		!(sym = elf_symbol(e->env_binary, eip, &strtab)))
+		return;
+	pe->pe_fn = sym->st_value;
+	strlcpy(pe->pe_name, strtab + sym->st_name, PROF_NAMELEN);
+}
+
+// Count one sample of envid at eip in the hash table hits.
+// Returns false if the table is full.
+static bool
+prof_hit(struct ProfHit *hits, envid_t envid, uintptr_t eip)
+{
+	uint32_t h = (eip * 2654435761U) ^ envid, i;
+	struct ProfHit *ph;
+
+	for (i = 0; i < PROF_NHITS; i++)
+	{
+		ph = &hits[(h + i) % PROF_NHITS];
+		if (ph->ph_count == 0)
+		{
+			ph->ph_eip = eip;
+			ph->ph_env = envid;
+		} else if (ph->ph_eip != eip || ph->ph_env != envid)
+			continue;
+		ph->ph_count++;
+		return true;
+	}
+	return false;
+}
+
+// Add up the samples taken since prof_start by function, into *r.
+// The samples are counted by EIP first, so that each EIP is looked up
+// only once.  Samples that overflow prof_report's own tables count as
+// dropped.
+// Returns 0 on success, -E_NO_MEM if there is no memory to work in.
+int
+prof_report(struct ProfReport *r)
+{
+	struct PageInfo *pp;
+	struct ProfHit *hits, *ph;
+	struct ProfEntry *fns, *pe, sym, tmp;
+	struct ProfBuf *b;
+	uint32_t nfns = 0, i, j;
+
+	static_assert(PROF_NHITS * sizeof(struct ProfHit) +
+				  PROF_NFNS * sizeof(struct ProfEntry) <= PGSIZE << PROF_SCRATCH);
+	if (!(pp = page_alloc_order(PROF_SCRATCH, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	hits = page2kva(pp);
+	fns = (struct ProfEntry *) (hits + PROF_NHITS);
+
+	memset(r, 0, sizeof(*r));
+	for (b = bufs; b < bufs + ncpu; b++)
+	{
+		r->pr_samples += b->pb_n + b->pb_dropped;
+		r->pr_dropped += b->pb_dropped;
+		for (i = 0; i < b->pb_n; i++)
+			if (!prof_hit(hits, b->pb_samples[i].ps_env, b->pb_samples[i].ps_eip))
+				r->pr_dropped++;
+	}
+
+	for (ph = hits; ph < hits + PROF_NHITS; ph++)
+	{
+		if (ph->ph_count == 0)
+			continue;
+		prof_symbol(&sym, ph->ph_env, ph->ph_eip);
+		for (pe = fns; pe < fns + nfns; pe++)
+			if (pe->pe_env == sym.pe_env && pe->pe_fn == sym.pe_fn)
+				break;
+		if (pe == fns + nfns)
+		{
+			if (nfns == PROF_NFNS)
+			{
+				r->pr_dropped += ph->ph_count;
+				continue;
+			}
+			*pe = sym;
+			nfns++;
+		}
+		pe->pe_samples += ph->ph_count;
+	}
+
+	// Most samples first
+	for (i = 1; i < nfns; i++)
+		for (j = i; j > 0 && fns[j].pe_samples > fns[j - 1].pe_samples; j--)
+		{
+			tmp = fns[j];
+			fns[j] = fns[j - 1];
+			fns[j - 1] = tmp;
+		}
+	r->pr_nfns = nfns;
+	memmove(r->pr_fns, fns, MIN(nfns, PROF_NREPORT) * sizeof(fns[0]));
+	page_free_order(pp, PROF_SCRATCH);
+	return 0;
+}
+
+// Print the profile so far, for the monitor's "prof" command.
+void
+prof_print(void)
+{
+	static struct ProfReport r;
+	struct ProfEntry *pe;
+	int ret;
+
+	if ((ret = prof_report(&r)) < 0)
+	{
+		cprintf("prof: %e\n", ret);
+		return;
+	}
+	cprintf("%u samples, %u dropped, in %u functions%s\n", r.pr_samples,
+			r.pr_dropped, r.pr_nfns, prof_on ? " (still profiling)" : "");
+	if (r.pr_samples == 0)
+		return;
+	cprintf("%8s %6s %-8s %-8s %s\n", "samples", "%", "env", "addr", "function");
+	for (pe = r.pr_fns; pe < r.pr_fns + MIN(r.pr_nfns, PROF_NREPORT); pe++)
+	{
+		cprintf("%8u %3u.%u%% ", pe->pe_samples, pe->pe_samples * 100 / r.pr_samples,
+				pe->pe_samples * 1000 / r.pr_samples % 10);
+		if (pe->pe_env)
+			cprintf("%08x ", pe->pe_env);
+		else
+			cprintf("%-8s ", "kernel");
+		cprintf("%08x %s\n", pe->pe_fn, pe->pe_name[0] ? pe->pe_name : "?");
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/prof.h>
+#include <inc/trap.h>
+
+int prof_start(void);
+void prof_stop(void);
+void prof_tick(struct Trapframe *tf);
+int prof_report(struct ProfReport *r);
+void prof_print(void);
+
+#endif /* !JOS_KERN_PROF_H */
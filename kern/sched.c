@@ -1,74 +1,547 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/error.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/time.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/ksm.h>
+#include <kern/sysstat.h>
+#include <kern/syscall.h>
+#include <kern/e1000.h>
+
+// How often (in timer ticks) each CPU rebalances its run queue
+#define SCHED_BALANCE_TICKS    10
+
+// Stride scheduling: an environment's stride is SCHED_STRIDE1 divided
+// by its weight, and its pass advances by one stride per quantum run.
+#define SCHED_STRIDE1          (1 << 20)
+
+#define CPUID_MONITOR          (1 << 3)        // CPUID.1:ECX, monitor/mwait
+
+// Two environments that each have the other as peer with at least
+// SCHED_PEER_MIN are kept on one CPU (see sched_note_peer); scores stop
+// at SCHED_PEER_MAX, so that a new peer can take over soon enough.
+#define SCHED_PEER_MIN         4
+#define SCHED_PEER_MAX         64
+
+// Protects the run queues and the scheduling fields of struct Env.
+// Scheduling decisions themselves are still made under kernel_lock.
+static struct spinlock sched_lock = SPINLOCK_INIT_TYPE(sched_lock, SPINLOCK_MCS);
 
 void sched_halt(void);
 
-// Choose a user environment to run and run it.
+// Set e's scheduling weight, clamped to [ENV_WEIGHT_MIN, ENV_WEIGHT_MAX].
 void
-sched_yield(void)
+sched_set_weight(struct Env *e, uint32_t weight)
+{
+	if (weight < ENV_WEIGHT_MIN)
+		weight = ENV_WEIGHT_MIN;
+	if (weight > ENV_WEIGHT_MAX)
+		weight = ENV_WEIGHT_MAX;
+	e->env_weight = weight;
+	e->env_stride = SCHED_STRIDE1 / weight;
+}
+
+// May e run on CPU number cpu?
+static bool
+sched_cpu_allowed(struct Env *e, int cpu)
+{
+	return cpu >= 0 && cpu < ncpu && cpus[cpu].cpu_status != CPU_UNUSED &&
+		   (e->env_cpumask & (1U << cpu));
+}
+
+// Insert e into the run queue of CPU e->env_cpunum and mark it runnable.
+// Each run queue is kept sorted by env_pass, so the head is always the
+// environment that is furthest behind its fair share.
+// The caller must hold sched_lock.
+static void
+runq_insert(struct Env *e)
+{
+	struct CpuInfo *c;
+	struct Env *prev;
+	int i;
+
+	e->env_status = ENV_RUNNABLE;
+	sysstat_runnable(e);
+	if (e->env_rq_cpu >= 0)
+		return;
+
+	// Prefer the CPU e last ran on, whose caches and TLB are still
+	// warm.  Environments that never ran (or may not run there) go to
+	// the CPU that made them runnable, or else any CPU they allow.
+	if (!sched_cpu_allowed(e, e->env_cpunum))
+	{
+		e->env_cpunum = cpunum();
+		for (i = 0; i < ncpu && !sched_cpu_allowed(e, e->env_cpunum); i++)
+			e->env_cpunum = i;
+		if (!sched_cpu_allowed(e, e->env_cpunum))
+			e->env_cpunum = cpunum();
+	}
+	c = &cpus[e->env_cpunum];
+
+	// An environment that slept (or arrives from another CPU) must
+	// not be able to run ahead of the queue for as long as it was
+	// away, so bring its pass up to this CPU's virtual time.
+	if (e->env_pass < c->cpu_sched_pass)
+		e->env_pass = c->cpu_sched_pass;
+
+	// Most insertions belong near the tail, so search from there.
+	for (prev = c->cpu_runq_tail; prev && prev->env_pass > e->env_pass;
+		 prev = prev->env_rq_prev)
+		;
+
+	e->env_rq_prev = prev;
+	e->env_rq_next = prev ? prev->env_rq_next : c->cpu_runq_head;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e;
+	else
+		c->cpu_runq_tail = e;
+	if (prev)
+		prev->env_rq_next = e;
+	else
+		c->cpu_runq_head = e;
+	c->cpu_runq_len++;
+	e->env_rq_cpu = e->env_cpunum;
+}
+
+// Remove e from whatever run queue holds it.
+// The caller must hold sched_lock.
+static void
+runq_remove(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	c = &cpus[e->env_rq_cpu];
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		c->cpu_runq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		c->cpu_runq_tail = e->env_rq_prev;
+	c->cpu_runq_len--;
+
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+}
+
+// Wake a halted CPU to run e, which was just queued: the CPU e is
+// queued on if that one is halted, or else any halted CPU e may run
+// on, which will steal it.  Idle CPUs other than the boot CPU stop
+// their timers (see sched_halt), so without this they would sleep
+// until some unrelated interrupt.  A CPU halted in mwait is woken by
+// a store to its cpu_wake; others take an IPI.
+// The caller must hold sched_lock.
+static void
+sched_kick(struct Env *e)
+{
+	struct CpuInfo *c;
+	int i;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	c = &cpus[e->env_rq_cpu];
+	for (i = 0; i < ncpu && c->cpu_status != CPU_HALTED; i++)
+		if (cpus[i].cpu_status == CPU_HALTED && sched_cpu_allowed(e, i))
+			c = &cpus[i];
+	if (c == thiscpu || c->cpu_status != CPU_HALTED)
+		return;
+	if (c->cpu_mwait)
+		c->cpu_wake = 1;
+	else
+		lapic_ipi_cpu(c->cpu_id, T_WAKEUP);
+}
+
+// Count one exchange with b towards e's peer: e's peer is the
+// environment e has exchanged with most, by a majority vote that
+// other partners wear down one exchange at a time.
+// The caller must hold sched_lock.
+static void
+peer_count(struct Env *e, struct Env *b)
+{
+	if (e->env_peer == b->env_id)
+	{
+		if (e->env_peer_score < SCHED_PEER_MAX)
+			e->env_peer_score++;
+	} else if (e->env_peer_score > 0)
+		e->env_peer_score--;
+	else
+	{
+		e->env_peer = b->env_id;
+		e->env_peer_score = 1;
+	}
+}
+
+// Note that a and b just exchanged an IPC or shared a page.  Pairs
+// that do so often, such as a client and its server or the two ends
+// of a pipe, are then queued on one CPU, so that the pages and buffers
+// they pass stay in that CPU's cache.
+void
+sched_note_peer(struct Env *a, struct Env *b)
+{
+	if (a == b)
+		return;
+	spin_lock(&sched_lock);
+	peer_count(a, b);
+	peer_count(b, a);
+	spin_unlock(&sched_lock);
+}
+
+// e's peer, if the two of them have each other as peers clearly
+// enough to be kept together, or else NULL.
+// The caller must hold sched_lock.
+static struct Env *
+sched_peer(struct Env *e)
+{
+	struct Env *p;
+
+	if (e->env_peer_score < SCHED_PEER_MIN)
+		return NULL;
+	p = &envs[ENVX(e->env_peer)];
+	if (p->env_id != e->env_peer || p->env_status == ENV_FREE ||
+		p->env_peer != e->env_id || p->env_peer_score < SCHED_PEER_MIN)
+		return NULL;
+	return p;
+}
+
+// Is e kept together with a peer on CPU c?
+// The caller must hold sched_lock.
+static bool
+sched_peer_on(struct Env *e, struct CpuInfo *c)
+{
+	struct Env *p = sched_peer(e);
+
+	return p && p->env_cpunum == c - cpus;
+}
+
+// Mark e runnable and put it on a run queue.
+// An environment sits on a run queue exactly when it is ENV_RUNNABLE,
+// so every transition into ENV_RUNNABLE must go through here.
+// Enqueueing an environment that is already queued is a no-op.
+void
+sched_enqueue(struct Env *e)
+{
+	struct Env *p;
+	int cpu;
+
+	spin_lock(&sched_lock);
+	// A waking environment goes where its peer is, or will run next,
+	// unless that queue is the longer one: groups that keep to
+	// themselves still spread over the CPUs.
+	if (e->env_rq_cpu < 0 && e->env_status != ENV_RUNNING &&
+		(p = sched_peer(e)) != NULL)
+	{
+		cpu = p->env_cpunum;
+		if (cpu != e->env_cpunum && sched_cpu_allowed(e, cpu) &&
+			(!sched_cpu_allowed(e, e->env_cpunum) ||
+			 cpus[cpu].cpu_runq_len <= cpus[e->env_cpunum].cpu_runq_len))
+			e->env_cpunum = cpu;
+	}
+	runq_insert(e);
+	sched_kick(e);
+	spin_unlock(&sched_lock);
+}
+
+// Take e off its run queue, if it is on one.
+// The caller is responsible for e's new env_status.
+void
+sched_dequeue(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	runq_remove(e);
+	e->env_runnable_tsc = 0;
+	spin_unlock(&sched_lock);
+}
+
+// Restrict e to the CPUs in cpumask (bit i stands for CPU i).
+// A queued environment that is no longer allowed where it sits is
+// moved right away; a running one moves when it is next descheduled.
+//
+// Returns 0 on success, -E_INVAL if cpumask names no started CPU.
+int
+sched_set_affinity(struct Env *e, uint32_t cpumask)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if ((cpumask & (1U << i)) && cpus[i].cpu_status != CPU_UNUSED)
+			break;
+	if (i == ncpu)
+		return -E_INVAL;
+
+	spin_lock(&sched_lock);
+	e->env_cpumask = cpumask;
+	if (e->env_rq_cpu >= 0 && !sched_cpu_allowed(e, e->env_rq_cpu))
+	{
+		runq_remove(e);
+		runq_insert(e);
+		sched_kick(e);
+	}
+	spin_unlock(&sched_lock);
+	return 0;
+}
+
+// Move queued environment e onto CPU c's run queue.
+// The caller must hold sched_lock.
+static void
+sched_migrate(struct Env *e, struct CpuInfo *c)
 {
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-
-	size_t env_i = 0;
-	if (curenv != NULL)
+	runq_remove(e);
+	e->env_cpunum = c - cpus;
+	runq_insert(e);
+}
+
+// Return the started CPU other than this one with the longest run
+// queue, or NULL if every other queue is empty.
+static struct CpuInfo *
+sched_busiest_cpu(void)
+{
+	struct CpuInfo *c, *busiest = NULL;
+
+	for (c = cpus; c < cpus + ncpu; c++)
 	{
+		if (c == thiscpu || c->cpu_status == CPU_UNUSED)
+			continue;
+		if (c->cpu_runq_len > 0 &&
+			(!busiest || c->cpu_runq_len > busiest->cpu_runq_len))
+			busiest = c;
+	}
+	return busiest;
+}
 
-		env_i = ENVX(curenv->env_id);
+// Return the environment nearest the tail of c's run queue that may
+// run on this CPU, or NULL if there is none.  Taking from the tail
+// leaves alone the head, which c is about to run with a warm cache.
+// Environments kept on c with a peer are taken only if there is no
+// other.
+static struct Env *
+sched_movable(struct CpuInfo *c)
+{
+	struct Env *e, *paired = NULL;
 
-		// Make sure current environment's status is runnable
-		if (envs[env_i].env_status == ENV_RUNNING)
-			envs[env_i].env_status = ENV_RUNNABLE;
+	for (e = c->cpu_runq_tail; e; e = e->env_rq_prev)
+		if (sched_cpu_allowed(e, cpunum()))
+		{
+			if (!sched_peer_on(e, c))
+				return e;
+			if (!paired)
+				paired = e;
+		}
+	return paired;
+}
+
+// Take one runnable environment from the busiest other CPU's run queue
+// for this CPU to run.
+// Returns the stolen environment, or NULL if there was nothing to steal.
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *victim;
+	struct Env *e = NULL;
 
-		env_i++;
+	spin_lock(&sched_lock);
+	if ((victim = sched_busiest_cpu()) && (e = sched_movable(victim)))
+	{
+		runq_remove(e);
+		e->env_cpunum = cpunum();
 	}
+	spin_unlock(&sched_lock);
+	return e;
+}
+
+// Periodic load balancing, called from the timer interrupt.
+// Every SCHED_BALANCE_TICKS ticks, pull environments from the busiest
+// CPU until the two run queues differ in length by at most one.
+void
+sched_balance(void)
+{
+	struct CpuInfo *busiest;
+	struct Env *e;
+
+	if (++thiscpu->cpu_sched_ticks % SCHED_BALANCE_TICKS != 0)
+		return;
+	spin_lock(&sched_lock);
+	if ((busiest = sched_busiest_cpu()) != NULL)
+		while (busiest->cpu_runq_len > thiscpu->cpu_runq_len + 1 &&
+			   (e = sched_movable(busiest)) != NULL)
+			sched_migrate(e, thiscpu);
+	spin_unlock(&sched_lock);
+}
+
+// Is there work for this CPU, queued on it or stealable from another?
+static bool
+sched_has_work(void)
+{
+	struct CpuInfo *victim;
+	bool work;
+
+	spin_lock(&sched_lock);
+	work = thiscpu->cpu_runq_head != NULL ||
+		   ((victim = sched_busiest_cpu()) && sched_movable(victim));
+	spin_unlock(&sched_lock);
+	return work;
+}
+
+// Called by trap() when an interrupt wakes this CPU from sched_halt.
+// Restarts the timer if the CPU went idle without it.
+void
+sched_idle_exit(void)
+{
+	if (!thiscpu->cpu_tickless)
+		return;
+	thiscpu->cpu_tickless = false;
+	time_idle(thiscpu->cpu_halt_tsc);
+	lapic_timer_start();
+}
+
+// Whether CPUs can idle in mwait rather than hlt; checked the first
+// time, since cpuid is slow and traps to a hypervisor.
+static bool
+sched_mwait_ok(void)
+{
+	static int ok = -1;
+	uint32_t ecx;
+
+	if (ok < 0)
+	{
+		cpuid(1, NULL, NULL, &ecx, NULL);
+		ok = (ecx & CPUID_MONITOR) != 0;
+	}
+	return ok;
+}
 
-	for (size_t count = 0; count < NENV; count++)
-		if (envs[(env_i + count) % NENV].env_status == ENV_RUNNABLE)
-			env_run(&envs[(env_i + count) % NENV]);
+// Run e, which was just picked from this CPU's run queue, charging
+// it one quantum of virtual time.
+static void
+sched_run(struct Env *e)
+{
+	thiscpu->cpu_sched_pass = e->env_pass;
+	e->env_pass += e->env_stride;
+	env_run(e);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	// Stride scheduling over this CPU's run queue: the current
+	// environment (if still running) is requeued by its pass, and the
+	// head -- the lowest pass -- runs next.  Equal weights give plain
+	// round-robin.
+	// Environments running on other CPUs are never on a run queue,
+	// so they cannot be picked here.  If the queue is empty, drop
+	// through to the code below to halt the cpu.
+	struct Env *e;
+
+	spin_lock(&sched_lock);
+	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
+		runq_insert(curenv);
+	if ((e = thiscpu->cpu_runq_head) != NULL)
+		runq_remove(e);
+	spin_unlock(&sched_lock);
+
+	if (e != NULL)
+		sched_run(e);
 
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Run e, which is waking up, on this CPU right now instead of queueing
+// it, for the rest of the current quantum.  curenv must already have
+// left ENV_RUNNING.  e is not charged a quantum of its own: it is
+// spending the one curenv was charged for.  If e may not run here, it
+// is queued as usual and this CPU schedules normally.
+void
+sched_handoff(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (!sched_cpu_allowed(e, cpunum()))
+	{
+		runq_insert(e);
+		sched_kick(e);
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+	e->env_cpunum = cpunum();
+	if (e->env_pass < thiscpu->cpu_sched_pass)
+		e->env_pass = thiscpu->cpu_sched_pass;
+	// It waits for no CPU, but count the wakeup like any other
+	sysstat_runnable(e);
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
+// Called by sched_halt's mwait loop when a sched_kick() store, rather
+// than an interrupt, woke this CPU: leave the halted state as trap()
+// does, and look for the work.
+static void __attribute__((used))
+sched_mwait_exit(void)
+{
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+	lock_kernel();
+	sched_idle_exit();
+	sched_yield();
+}
+
+// Will e run again without another environment's help?  It will if
+// it can run now, or sleeps until a deadline (kern/timerq.c,
+// kern/futex.c), an interrupt routed to it, or a line of console
+// input (kern/console.c).
+static bool
+sched_env_live(struct Env *e)
+{
+	switch (e->env_status)
+	{
+	case ENV_RUNNABLE:
+	case ENV_RUNNING:
+	case ENV_DYING:
+		return true;
+	case ENV_NOT_RUNNABLE:
+		return e->env_timer_deadline || e->env_futex_deadline ||
+			   e->env_cons_reading || irq_ipc_waiter(e) ||
+			   e1000_recv_waiter(e->env_id);
+	default:
+		return false;
+	}
+}
+
+// Halt this CPU when there is nothing to do. Wait until an
+// interrupt wakes it up. This function never returns.
+//
+// The boot CPU keeps ticking, since its timer drives the clock and
+// times out futex waits and timed sleeps (kern/futex.c, kern/timerq.c).
+// Other CPUs have no deadline of their own to wake for: they stop their
+// timers and sleep until sched_kick() sends them T_WAKEUP, instead of
+// waking every tick to find nothing to do.
 //
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
-	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++)
+	// Before going idle, look for work queued on other CPUs.
+	if ((e = sched_steal()) != NULL)
+		sched_run(e);
+
+	// For debugging and testing purposes, if no environment in the
+	// system can ever run again, then drop into the kernel monitor.
+	for (i = 0; i < nenv; i++)
 	{
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-			 envs[i].env_status == ENV_RUNNING ||
-			 envs[i].env_status == ENV_DYING))
+		if (sched_env_live(&envs[i]))
 			break;
 	}
 
-	if (i == NENV)
+	if (i == nenv)
 	{
 		cprintf("No runnable environments in the system!\n");
 		while (1)
@@ -76,17 +549,73 @@ sched_halt(void)
 	}
 
 	// Mark that no environment is running on this CPU
+	env_switch_out(NULL);
+	fpu_release();
+	pmc_switch(NULL);
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// Look for pages to merge while we still hold the kernel lock.
+	ksm_scan();
+
+	// Arm the wakeup store before sched_kick() can see us halted.
+	thiscpu->cpu_mwait = sched_mwait_ok();
+	thiscpu->cpu_wake = 0;
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
+	// Work queued before we were marked halted sent no wakeup, so look
+	// once more.  sched_lock orders this against sched_kick(): anything
+	// queued after this check sees CPU_HALTED and interrupts us.
+	if (sched_has_work())
+	{
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		sched_yield();
+	}
+
+	if (thiscpu != bootcpu && !thiscpu->cpu_tickless)
+	{
+		thiscpu->cpu_tickless = true;
+		thiscpu->cpu_halt_tsc = read_tsc();
+		lapic_timer_stop();
+	}
+
 	// Release the big kernel lock as if we were "leaving" the kernel
 	unlock_kernel();
 
+	// Use the idle time to top up the pool of pre-zeroed pages.
+	page_zero_refill();
+
+	// Reset stack pointer, then wait in mwait for a store to cpu_wake
+	// or an interrupt.  The flag is checked after arming the monitor,
+	// so a store that came first is not missed, and sti holds off
+	// interrupts until mwait has begun.
+	if (thiscpu->cpu_mwait)
+		asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"1:\n"
+		"movl %%ebx, %%eax\n"
+		"xorl %%ecx, %%ecx\n"
+		"xorl %%edx, %%edx\n"
+		"monitor\n"
+		"cmpl $0, (%%ebx)\n"
+		"jne 2f\n"
+		"xorl %%eax, %%eax\n"
+		"sti\n"
+		"mwait\n"
+		"cli\n"
+		"cmpl $0, (%%ebx)\n"
+		"je 1b\n"
+		"2:\n"
+		"call sched_mwait_exit\n"
+		: : "a" (thiscpu->cpu_ts.ts_esp0), "b" (&thiscpu->cpu_wake));
+
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 	"movl $0, %%ebp\n"
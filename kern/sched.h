@@ -6,7 +6,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/types.h>
+
+struct Env;
+
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_balance(void);
+void sched_idle_exit(void);
+void sched_set_weight(struct Env *e, uint32_t weight);
+int sched_set_affinity(struct Env *e, uint32_t cpumask);
+void sched_note_peer(struct Env *a, struct Env *b);
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_handoff(struct Env *e) __attribute__((noreturn));
 
 #endif    // !JOS_KERN_SCHED_H
@@ -0,0 +1,76 @@
+// The service registry: names servers register under, so clients can
+// find them without scanning envs[] for an env_type.  The table lives in
+// the kernel info page (see inc/uinfo.h), so a lookup is a few reads of
+// read-only memory, with no system call; ipc_find_service does it.
+//
+// The kernel registers the file and network servers it starts as
+// SERVICE_FS and SERVICE_NS.  Others register with sys_service_register.
+// A name stays taken until its environment is freed.  The registry is
+// protected by the big kernel lock; readers use uinfo->service_seq.
+
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/service.h>
+#include <kern/time.h>
+
+// Register e as the service 'name', a NUL-terminated string shorter
+// than SERVICE_NAMELEN.  Freed slots on the way to the end of the probe
+// sequence are reused, so the table holds UINFO_NSERVICE names at once.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the name is empty, too long, or taken by another
+//		environment.
+//	-E_NO_MEM if the registry is full.
+int
+service_register(struct Env *e, const char *name)
+{
+	struct UinfoService *s, *slot = 0;
+	uint32_t h, i;
+
+	if (name[0] == '\0' || strnlen(name, SERVICE_NAMELEN) == SERVICE_NAMELEN)
+		return -E_INVAL;
+	h = uinfo_service_hash(name);
+	for (i = 0; i < UINFO_NSERVICE; i++)
+	{
+		s = &uinfo->services[(h + i) & (UINFO_NSERVICE - 1)];
+		if (s->name[0] == '\0' || strcmp(s->name, name) == 0)
+		{
+			if (s->name[0] != '\0' && s->envid != 0)
+				return s->envid == e->env_id ? 0 : -E_INVAL;
+			if (!slot)
+				slot = s;
+			break;
+		}
+		if (s->envid == 0 && !slot)
+			slot = s;
+	}
+	if (!slot)
+		return -E_NO_MEM;
+
+	uinfo->service_seq++;
+	barrier();
+	strcpy(slot->name, name);
+	slot->envid = e->env_id;
+	barrier();
+	uinfo->service_seq++;
+	return 0;
+}
+
+// Called when e is freed: its names become free for others.  The slots
+// keep the names, so probe sequences through them stay unbroken.
+void
+service_env_free(struct Env *e)
+{
+	uint32_t i;
+
+	for (i = 0; i < UINFO_NSERVICE; i++)
+		if (uinfo->services[i].envid == e->env_id)
+		{
+			uinfo->service_seq++;
+			barrier();
+			uinfo->services[i].envid = 0;
+			barrier();
+			uinfo->service_seq++;
+		}
+}
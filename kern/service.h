@@ -0,0 +1,12 @@
+#ifndef JOS_KERN_SERVICE_H
+#define JOS_KERN_SERVICE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int service_register(struct Env *e, const char *name);
+void service_env_free(struct Env *e);
+
+#endif /* !JOS_KERN_SERVICE_H */
@@ -8,13 +8,37 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/trace.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
+// The big kernel lock.  A ticket lock, so CPUs queued on it are
+// served in arrival order.
+struct spinlock kernel_lock = SPINLOCK_INIT_TYPE(kernel_lock, SPINLOCK_TICKET);
+volatile int kernel_lock_cpu = -1;
+
+#ifdef TIME_KERNEL_LOCK
+
+uint64_t kernel_lock_tsc;
+// The longest kernel_lock hold seen, in TSC cycles, and where the lock
+// was taken for it
+static uint64_t kernel_lock_max_hold;
+static uintptr_t kernel_lock_max_pc;
+
+// Called by unlock_kernel: note how long the lock was held, for
+// spin_print_stats to report the longest.
+void
+kernel_lock_check_hold(void)
+{
+	uint64_t held = read_tsc() - kernel_lock_tsc;
+
+	if (held <= kernel_lock_max_hold)
+		return;
+	kernel_lock_max_hold = held;
 #ifdef DEBUG_SPINLOCK
-		.name = "kernel_lock"
+	kernel_lock_max_pc = kernel_lock.pcs[0];
+#endif
+}
+
 #endif
-};
 
 #ifdef DEBUG_SPINLOCK
 
@@ -46,10 +70,50 @@ holding(struct spinlock *lock)
 
 #endif
 
+// Locks that have been acquired at least once, for spin_print_stats().
+static struct spinlock *volatile spin_stats_list;
+
+// MCS queue nodes.  A CPU needs one node for every MCS lock it holds
+// or waits on at the same time.
+#define MCS_NODES_PER_CPU 4
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES_PER_CPU];
+
+static struct mcs_node *
+mcs_node_alloc(void)
+{
+	struct mcs_node *n = mcs_nodes[cpunum()];
+	int i;
+
+	for (i = 0; i < MCS_NODES_PER_CPU; i++)
+		if (!n[i].in_use)
+		{
+			n[i].in_use = 1;
+			return &n[i];
+		}
+	panic("CPU %d: out of MCS lock nodes", cpunum());
+}
+
+// Add lk to spin_stats_list the first time it is acquired.
+static void
+spin_stats_link(struct spinlock *lk)
+{
+	struct spinlock *head;
+
+	if (lk->stats_linked || xchg(&lk->stats_linked, 1) != 0)
+		return;
+	do
+	{
+		head = spin_stats_list;
+		lk->stats_next = head;
+	} while (cmpxchg((volatile uint32_t *) &spin_stats_list,
+					 (uint32_t) head, (uint32_t) lk) != (uint32_t) head);
+}
+
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int type)
 {
-	lk->locked = 0;
+	memset(lk, 0, sizeof(*lk));
+	lk->type = type;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
@@ -68,11 +132,65 @@ spin_lock(struct spinlock *lk)
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-			asm volatile ("pause");
+	uint64_t start = 0;
+	struct mcs_node *node, *prev;
+	uint32_t ticket;
+
+	switch (lk->type)
+	{
+	case SPINLOCK_TICKET:
+		// Take a ticket and wait for it to be served, so waiters
+		// acquire the lock in FIFO order.
+		ticket = xadd(&lk->ticket_next, 1);
+		if (lk->ticket_owner != ticket)
+		{
+			start = read_tsc();
+			while (lk->ticket_owner != ticket)
+				asm volatile ("pause");
+		}
+		break;
+
+	case SPINLOCK_MCS:
+		// Join the queue and spin on our own node until the
+		// previous holder hands the lock over.
+		node = mcs_node_alloc();
+		node->next = 0;
+		node->waiting = 1;
+		prev = (struct mcs_node *) xchg((volatile uint32_t *) &lk->mcs_tail,
+										(uint32_t) node);
+		if (prev)
+		{
+			start = read_tsc();
+			prev->next = node;
+			while (node->waiting)
+				asm volatile ("pause");
+		}
+		lk->mcs_holder = node;
+		break;
+
+	default:
+		// The xchg is atomic.
+		// It also serializes, so that reads after acquire are not
+		// reordered before it.
+		if (xchg(&lk->locked, 1) != 0)
+		{
+			start = read_tsc();
+			while (xchg(&lk->locked, 1) != 0)
+				asm volatile ("pause");
+		}
+		break;
+	}
+	lk->locked = 1;
+
+	lk->nacquire++;
+	if (start)
+	{
+		start = read_tsc() - start;
+		lk->ncontended++;
+		lk->spin_cycles += start;
+		trace_event(TRACE_LOCK_CONTEND, (uintptr_t) lk, start, 0, 0);
+	}
+	spin_stats_link(lk);
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -112,10 +230,94 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	struct mcs_node *node;
+
+	switch (lk->type)
+	{
+	case SPINLOCK_TICKET:
+		lk->locked = 0;
+		// Only the holder writes ticket_owner; the barrier keeps the
+		// critical section's stores ahead of the hand-off.
+		asm volatile ("" ::: "memory");
+		lk->ticket_owner = lk->ticket_owner + 1;
+		break;
+
+	case SPINLOCK_MCS:
+		node = lk->mcs_holder;
+		lk->mcs_holder = 0;
+		lk->locked = 0;
+		if (!node->next)
+		{
+			// No known successor: try to empty the queue.
+			if (cmpxchg((volatile uint32_t *) &lk->mcs_tail,
+						(uint32_t) node, 0) == (uint32_t) node)
+			{
+				node->in_use = 0;
+				break;
+			}
+			// A new waiter is between its xchg and linking in.
+			while (!node->next)
+				asm volatile ("pause");
+		}
+		node->next->waiting = 0;
+		node->in_use = 0;
+		break;
+
+	default:
+		// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
+		// respect to any other instruction which references the same memory.
+		// x86 CPUs will not reorder loads/stores across locked instructions
+		// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
+		// gcc will not reorder C statements across the xchg.
+		xchg(&lk->locked, 0);
+		break;
+	}
+}
+
+static const char *const spin_type_names[] = {
+	[SPINLOCK_TAS] = "tas",
+	[SPINLOCK_TICKET] = "ticket",
+	[SPINLOCK_MCS] = "mcs",
+};
+
+// Print the contention statistics of every lock acquired so far.
+void
+spin_print_stats(void)
+{
+	struct spinlock *lk;
+
+	cprintf("%-16s %-6s %10s %10s %16s\n",
+			"lock", "type", "acquire", "contended", "spin cycles");
+	for (lk = spin_stats_list; lk; lk = lk->stats_next)
+	{
+#ifdef DEBUG_SPINLOCK
+		cprintf("%-16s ", lk->name);
+#else
+		cprintf("%08x         ", lk);
+#endif
+		cprintf("%-6s %10u %10u %16llu\n", spin_type_names[lk->type],
+				lk->nacquire, lk->ncontended, lk->spin_cycles);
+	}
+#ifdef TIME_KERNEL_LOCK
+	cprintf("kernel_lock held at most %llu cycles, taken at %08x\n",
+			kernel_lock_max_hold, kernel_lock_max_pc);
+#endif
+}
+
+// Zero the statistics of every lock.  Racy against concurrent
+// acquisitions, which is fine for counters.
+void
+spin_reset_stats(void)
+{
+	struct spinlock *lk;
+
+	for (lk = spin_stats_list; lk; lk = lk->stats_next)
+	{
+		lk->nacquire = 0;
+		lk->ncontended = 0;
+		lk->spin_cycles = 0;
+	}
+#ifdef TIME_KERNEL_LOCK
+	kernel_lock_max_hold = 0;
+#endif
 }
@@ -2,13 +2,48 @@
 #define JOS_INC_SPINLOCK_H
 
 #include <inc/types.h>
+#include <inc/x86.h>
+#include <kern/percpu.h>
 
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Uncomment this to time kernel_lock holds (see spin_print_stats)
+// #define TIME_KERNEL_LOCK
+
+// Lock algorithms.  All types share the spin_lock()/spin_unlock() API.
+enum {
+	SPINLOCK_TAS = 0,      // Test-and-set xchg loop
+	SPINLOCK_TICKET,       // FIFO ticket lock
+	SPINLOCK_MCS,          // MCS queue lock; each waiter spins locally
+};
+
+// Per-CPU queue node for MCS locks.
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile uint32_t waiting;
+	bool in_use;
+};
+
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	int type;              // SPINLOCK_TAS, SPINLOCK_TICKET or SPINLOCK_MCS
+
+	// SPINLOCK_TICKET
+	volatile uint32_t ticket_next;    // Next ticket to hand out
+	volatile uint32_t ticket_owner;   // Ticket now being served
+
+	// SPINLOCK_MCS
+	struct mcs_node *volatile mcs_tail;  // Last waiter in the queue
+	struct mcs_node *mcs_holder;         // Node of the current holder
+
+	// Contention statistics, updated while the lock is held.
+	uint32_t nacquire;     // Total acquisitions
+	uint32_t ncontended;   // Acquisitions that had to wait
+	uint64_t spin_cycles;  // TSC cycles spent waiting
+	struct spinlock *stats_next;  // Link in the list of used locks
+	uint32_t stats_linked;
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -19,23 +54,48 @@ struct spinlock {
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, char *name, int type);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_print_stats(void);
+void spin_reset_stats(void);
+
+#define spin_initlock(lock)             __spin_initlock(lock, #lock, SPINLOCK_TAS)
+#define spin_initlock_type(lock, type)  __spin_initlock(lock, #lock, type)
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+// Static initializers, e.g. struct spinlock foo_lock = SPINLOCK_INIT(foo_lock);
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INIT_TYPE(lock, t)   { .locked = 0, .type = (t), .name = #lock }
+#else
+#define SPINLOCK_INIT_TYPE(lock, t)   { .locked = 0, .type = (t) }
+#endif
+#define SPINLOCK_INIT(lock)           SPINLOCK_INIT_TYPE(lock, SPINLOCK_TAS)
 
 extern struct spinlock kernel_lock;
+extern volatile int kernel_lock_cpu;    // cpunum() of its holder, or -1
+
+#ifdef TIME_KERNEL_LOCK
+extern uint64_t kernel_lock_tsc;        // when its holder took it
+void kernel_lock_check_hold(void);
+#endif
 
 static inline void
 lock_kernel(void)
 {
 	spin_lock(&kernel_lock);
+	kernel_lock_cpu = cpunum();
+#ifdef TIME_KERNEL_LOCK
+	kernel_lock_tsc = read_tsc();
+#endif
 }
 
 static inline void
 unlock_kernel(void)
 {
+#ifdef TIME_KERNEL_LOCK
+	kernel_lock_check_hold();
+#endif
+	kernel_lock_cpu = -1;
 	spin_unlock(&kernel_lock);
 
 	// Normally we wouldn't need to do this, but QEMU only runs
@@ -45,4 +105,27 @@ unlock_kernel(void)
 	asm volatile("pause");
 }
 
+// A preemption point for long loops under kernel_lock: if other CPUs
+// wait for it, let them have it in turn, then take it back.  Only for
+// where nothing the loop has yet to do depends on state that those
+// CPUs may change meanwhile.  Returns whether the lock was let go.
+static inline bool
+kernel_lock_preempt(void)
+{
+	// Tickets taken beyond the one being served are CPUs waiting
+	if (kernel_lock.ticket_next - kernel_lock.ticket_owner <= 1)
+		return false;
+	unlock_kernel();
+	lock_kernel();
+	return true;
+}
+
+// Does this CPU hold the big kernel lock?  Only code that may run
+// without it (see syscall_unlocked) needs to ask.
+static inline bool
+kernel_lock_held(void)
+{
+	return kernel_lock_cpu == cpunum();
+}
+
 #endif
@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/elf.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -12,7 +13,18 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/picirq.h>
+#include <kern/fpu.h>
+#include <kern/futex.h>
+#include <kern/timerq.h>
+#include <kern/service.h>
+#include <kern/trace.h>
+#include <kern/sysstat.h>
+#include <kern/prof.h>
+#include <kern/pmc.h>
+#include <kern/ksm.h>
 #include "e1000.h"
+#include "virtio_blk.h"
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -24,8 +36,29 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	user_mem_assert(curenv, s, len, PTE_U);
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user, without waiting for the
+	// serial port.
+	cputs_async(s, len);
+}
+
+// sys_cputs for syscall_unlocked, where another CPU may unmap the string
+// after its user_mem_check: copy it in a piece at a time instead of
+// handing the console the user's address.
+// Returns 0, or -E_FAULT if the string went away part way.
+static int
+cputs_user(const char *s, size_t len)
+{
+	char buf[128];
+	size_t n;
+
+	for (; len > 0; s += n, len -= n)
+	{
+		n = MIN(len, sizeof(buf));
+		if (copyin(buf, s, n) < 0)
+			return -E_FAULT;
+		cputs_async(buf, n);
+	}
+	return 0;
 }
 
 // Read a character from the system console without blocking.
@@ -36,6 +69,24 @@ sys_cgetc(void)
 	return cons_getc();
 }
 
+// Read up to n bytes of the console's cooked input into buf: the rest
+// of the line being read, which ends in a newline (see cons_read in
+// kern/console.c).  If no line has been finished yet, fail with
+// -E_WOULD_BLOCK if 'wait' is false; otherwise sleep until one is, and
+// return -E_WOULD_BLOCK once woken, to be asked again.
+// Returns the number of bytes read, 0 at end of file, < 0 on error.
+// The environment is destroyed if buf is not writable.
+static int
+sys_cons_read(void *buf, size_t n, bool wait)
+{
+	int r;
+
+	user_mem_assert(curenv, buf, n, PTE_W);
+	if ((r = cons_read(buf, n)) != -E_WOULD_BLOCK || !wait)
+		return r;
+	cons_read_sleep();
+}
+
 // Returns the current environment's envid.
 static envid_t
 sys_getenvid(void)
@@ -65,6 +116,24 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Sleep until environment 'envid' has been freed.  env_free gives its
+// slot a new id and wakes those sleeping on the old one.
+//
+// Returns 0 once envid is gone, at once if it already is, < 0 on error.
+// Errors are:
+//	-E_INVAL if envid is 0 or the caller itself.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e = &envs[ENVX(envid)];
+
+	if (envid == 0 || envid == curenv->env_id)
+		return -E_INVAL;
+	if (ENVX(envid) >= nenv || e->env_id != envid || e->env_status == ENV_FREE)
+		return 0;
+	futex_sleep(envs_paddr(&e->env_id), 0);
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -93,12 +162,371 @@ sys_exofork(void)
 		return ret;
 
 	env->env_tf = curenv->env_tf;
+	if ((ret = fpu_env_copy(env, curenv)) < 0)
+	{
+		env_free(env);
+		return ret;
+	}
+	sched_set_weight(env, curenv->env_weight);
+	env->env_cpumask = curenv->env_cpumask;
+	env->env_binary = curenv->env_binary;
+	sched_dequeue(env);
 	env->env_status = ENV_NOT_RUNNABLE;
 	env->env_tf.tf_regs.reg_eax = 0;
 
 	return env->env_id;
 }
 
+// Fork the current environment with copy-on-write in one system call.
+// The child gets the caller's registers (with sys_fork_cow returning 0),
+// page fault upcall, scheduling parameters and a copy of its address
+// space below UTOP, in which:
+//	- PTE_SHARE pages and superpages are shared,
+//	- writable and PTE_COW pages and superpages become read-only
+//	  PTE_COW ones in both environments,
+//	- other pages are mapped read-only in both,
+//	- the caller's exception stack, if it has a page fault upcall,
+//	  is a fresh zeroed page, and those of other threads sharing its
+//	  address space are left out.
+// The kernel resolves write faults on PTE_COW pages, unless the caller
+// has them sent to its upcall (see sys_env_set_cow_upcall), in which
+// case the child does the same.  The child is runnable on return.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_INVAL if the caller has copy-on-write faults sent to an upcall
+//		it does not have.
+static envid_t
+sys_fork_cow(void)
+{
+	struct Env *env;
+	struct PageInfo *xstack;
+	int ret;
+
+	if (curenv->env_cow_upcall && !curenv->env_pgfault_upcall)
+		return -E_INVAL;
+
+	ret = sys_exofork();
+	if (ret < 0)
+		return ret;
+	if ((ret = envid2env(ret, &env, false)) < 0)
+		return ret;
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env->env_cow_upcall = curenv->env_cow_upcall;
+	env->env_xstacktop = curenv->env_xstacktop;
+
+	if ((ret = pgdir_dup_cow(env->env_pgdir, curenv->env_pgdir)) < 0)
+		goto fail;
+	if (env->env_pgfault_upcall)
+	{
+		if (!(xstack = page_alloc(ALLOC_ZERO)))
+		{
+			ret = -E_NO_MEM;
+			goto fail;
+		}
+		if ((ret = page_insert(env->env_pgdir, xstack, (void *) (env->env_xstacktop - PGSIZE),
+							   PTE_P | PTE_U | PTE_W)) < 0)
+		{
+			page_free(xstack);
+			goto fail;
+		}
+	}
+
+	sched_enqueue(env);
+	return env->env_id;
+
+fail:
+	env_free(env);
+	return ret;
+}
+
+// Create a thread: a new environment sharing the caller's page
+// directory, and with it all of its address space, as well as its page
+// fault upcall and scheduling parameters.  The thread starts running at
+// 'eip' with its stack pointer at 'esp' and takes page faults on the
+// exception stack whose top is 'xstacktop', all of which the caller
+// must have set up.  The address space goes away with the last
+// environment sharing it (see env_free).  The thread is runnable on
+// return.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_INVAL if eip, esp or xstacktop is not below UTOP, or xstacktop
+//		is not page-aligned.
+static envid_t
+sys_exofork_shared(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	struct Env *env;
+	int ret;
+
+	if (eip >= UTOP || esp > UTOP || xstacktop > UTOP || xstacktop % PGSIZE)
+		return -E_INVAL;
+	if ((ret = env_alloc(&env, curenv->env_id)) < 0)
+		return ret;
+	sched_dequeue(env);
+
+	// Trade the fresh page directory for ours
+	page_decref(pa2page(PADDR(env->env_pgdir)));
+	env->env_pgdir = curenv->env_pgdir;
+	pa2page(PADDR(env->env_pgdir))->pp_ref++;
+
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env->env_cow_upcall = curenv->env_cow_upcall;
+	env->env_xstacktop = xstacktop;
+	sched_set_weight(env, curenv->env_weight);
+	env->env_cpumask = curenv->env_cpumask;
+	env->env_binary = curenv->env_binary;
+	env->env_tf.tf_eip = eip;
+	env->env_tf.tf_esp = esp;
+	sched_enqueue(env);
+	return env->env_id;
+}
+
+// Build env's initial stack page from the caller's NULL-terminated
+// 'argv': the strings at the top, below them the argv array, then the
+// argc and argv that lib/entry.S passes to libmain, where the stack
+// pointer starts.
+static int
+spawn_stack(struct Env *env, const char *const *argv)
+{
+	const uintptr_t ustack = USTACKTOP - PGSIZE;
+	struct PageInfo *pp;
+	const char *arg;
+	uintptr_t *args;
+	size_t len = 0;
+	char *kva, *str;
+	int argc, i, r;
+
+	if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGH)))
+		return -E_NO_MEM;
+	kva = page_kmap(pp, KMAP_DST);
+
+	// Gather the strings at the bottom of the page, then move them up
+	for (argc = 0;; argc++)
+	{
+		if (copyin(&arg, &argv[argc], sizeof(arg)) < 0)
+		{
+			r = -E_FAULT;
+			goto fail;
+		}
+		if (!arg)
+			break;
+		if ((r = copyinstr(kva + len, arg, PGSIZE - len)) < 0)
+			goto fail;
+		len += r + 1;
+	}
+	str = kva + PGSIZE - len;
+	args = (uintptr_t *) (ROUNDDOWN((uintptr_t) str, 4) - 4 * (argc + 1));
+	if ((char *) (args - 2) < kva)
+	{
+		r = -E_NO_MEM;
+		goto fail;
+	}
+	memmove(str, kva, len);
+	memset(kva, 0, str - kva);
+
+	for (i = 0; i < argc; i++)
+	{
+		args[i] = ustack + (str - kva);
+		str += strlen(str) + 1;
+	}
+	args[argc] = 0;
+	args[-1] = ustack + ((char *) args - kva);
+	args[-2] = argc;
+	env->env_tf.tf_esp = ustack + ((char *) &args[-2] - kva);
+
+	if ((r = page_insert(env->env_pgdir, pp, (void *) ustack,
+						 PTE_P | PTE_U | PTE_W)) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	page_free(pp);
+	return r;
+}
+
+// Load the ELF segment 'ph' of the caller's image at 'image', 'size'
+// bytes long, into env.  Pages that hold nothing but the file, when
+// the segment lies on the file's pages and the caller cannot write
+// them, are the image's own pages, read-only or, in a writable segment,
+// copy-on-write; the rest are fresh pages the file's bytes are copied
+// into.
+static int
+spawn_segment(struct Env *env, const uint8_t *image, size_t size,
+			  const struct Proghdr *ph)
+{
+	uintptr_t va, start, end, fileend, off, n;
+	struct PageInfo *pp;
+	pte_t *pte;
+	bool aligned;
+	int perm, r;
+
+	if (ph->p_filesz > ph->p_memsz || ph->p_offset > size ||
+		ph->p_filesz > size - ph->p_offset ||
+		ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va)
+		return -E_NOT_EXEC;
+
+	perm = PTE_P | PTE_U;
+	if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+		perm |= PTE_W;
+	start = ROUNDDOWN(ph->p_va, PGSIZE);
+	end = ph->p_va + ph->p_memsz;
+	fileend = ph->p_va + ph->p_filesz;
+	aligned = PGOFF(ph->p_va) == PGOFF(ph->p_offset);
+
+	for (va = start; va < end; va += PGSIZE)
+	{
+		// Pages past the file's are all zero-fill: map them in bulk.
+		if (va >= ROUNDUP(fileend, PGSIZE))
+			return page_region_alloc(env->env_pgdir, va,
+									 ROUNDUP(end, PGSIZE) - va, perm,
+									 ALLOC_ZERO | ALLOC_HIGH);
+
+		// The file offset of the page at va, if the segment is aligned.
+		// A page the caller may write is copied, not shared, or the
+		// caller's writes would show through in env.
+		off = ROUNDDOWN(ph->p_offset, PGSIZE) + (va - start);
+		if (aligned && off < ROUNDUP(size, PGSIZE) &&
+			(va + PGSIZE <= fileend || end <= fileend) &&
+			(pp = page_lookup(curenv->env_pgdir, (void *) (image + off), &pte)) != NULL &&
+			!(*pte & (PTE_W | PTE_PS)))
+		{
+			if ((r = page_insert(env->env_pgdir, pp, (void *) va,
+								 perm & PTE_W ? (perm & ~PTE_W) | PTE_COW : perm)) < 0)
+				return r;
+			continue;
+		}
+
+		if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGH)))
+			return -E_NO_MEM;
+		off = MAX(va, ph->p_va);
+		n = MIN(va + PGSIZE, fileend);
+		if (n > off &&
+			copyin((uint8_t *) page_kmap(pp, KMAP_DST) + off - va,
+				   image + ph->p_offset + off - ph->p_va, n - off) < 0)
+		{
+			page_free(pp);
+			return -E_FAULT;
+		}
+		if ((r = page_insert(env->env_pgdir, pp, (void *) va, perm)) < 0)
+		{
+			page_free(pp);
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Give env the caller's PTE_SHARE pages and superpages below UTOP,
+// except for the image being loaded, [image, image + size), and the
+// exception stack.
+static int
+spawn_share(struct Env *env, uintptr_t image, size_t size)
+{
+	pde_t *pgdir = curenv->env_pgdir;
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *pt;
+	int r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+	{
+		if (!(pgdir[pdeno] & PTE_P))
+			continue;
+		if (pgdir[pdeno] & PTE_PS)
+		{
+			if ((pgdir[pdeno] & PTE_SHARE) &&
+				(r = superpage_insert(env->env_pgdir, pa2page(PTE_ADDR(pgdir[pdeno])),
+									  PGADDR(pdeno, 0, 0), pgdir[pdeno] & PTE_SYSCALL)) < 0)
+				return r;
+			continue;
+		}
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+		{
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if ((pt[pteno] & (PTE_P | PTE_SHARE)) != (PTE_P | PTE_SHARE) ||
+				va == UXSTACKTOP - PGSIZE || (va >= image && va - image < size))
+				continue;
+			if ((r = page_insert(env->env_pgdir, pa2page(PTE_ADDR(pt[pteno])),
+								 (void *) va, pt[pteno] & PTE_SYSCALL)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+// Create a child running the program whose ELF image the caller has
+// mapped at 'image', 'size' bytes from a page boundary -- typically the
+// file server's pages of the file, as mmap maps them -- with the
+// NULL-terminated argument list 'argv': everything spawn used to do
+// with a system call or more per page, in one.  The child shares the caller's
+// PTE_SHARE pages, such as its file descriptors, and the image's pages
+// that hold nothing but the file; its other memory is its own, and it
+// is runnable on return.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion, or if argv does not fit in the
+//		stack page.
+//	-E_NOT_EXEC if the image is not an ELF executable that fits below
+//		UTOP.
+//	-E_INVAL if image is not page-aligned or does not lie below UTOP.
+//	-E_FAULT if the image or argv cannot be read.
+static envid_t
+sys_spawn(const void *image, size_t size, const char *const *argv)
+{
+	struct Env *env;
+	struct Proghdr ph;
+	struct Elf elf;
+	int i, ret;
+
+	if ((uintptr_t) image % PGSIZE != 0 || (uintptr_t) image >= UTOP ||
+		size > UTOP - (uintptr_t) image)
+		return -E_INVAL;
+	if (size < sizeof(elf) || copyin(&elf, image, sizeof(elf)) < 0)
+		return -E_FAULT;
+	if (elf.e_magic != ELF_MAGIC || elf.e_phoff > size ||
+		elf.e_phnum > (size - elf.e_phoff) / sizeof(ph))
+		return -E_NOT_EXEC;
+
+	if ((ret = env_alloc(&env, curenv->env_id)) < 0)
+		return ret;
+	sched_dequeue(env);
+	sched_set_weight(env, curenv->env_weight);
+	env->env_cpumask = curenv->env_cpumask;
+
+	for (i = 0; i < elf.e_phnum; i++)
+	{
+		if (copyin(&ph, (const uint8_t *) image + elf.e_phoff + i * sizeof(ph),
+				   sizeof(ph)) < 0)
+		{
+			ret = -E_FAULT;
+			goto fail;
+		}
+		if (ph.p_type == ELF_PROG_LOAD &&
+			(ret = spawn_segment(env, image, size, &ph)) < 0)
+			goto fail;
+	}
+#ifdef JOS_SHLIB
+	if ((ret = shlib_map(env)) < 0)
+		goto fail;
+#endif
+	if ((ret = spawn_stack(env, argv)) < 0 ||
+		(ret = spawn_share(env, (uintptr_t) image, ROUNDUP(size, PGSIZE))) < 0)
+		goto fail;
+
+	env->env_tf.tf_eip = elf.e_entry;
+	sched_enqueue(env);
+	return env->env_id;
+
+fail:
+	env_free(env);
+	return ret;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -121,7 +549,68 @@ sys_env_set_status(envid_t envid, int status)
 	int ret = envid2env(envid, &env, true);
 	if (ret < 0)
 		return ret;
-	env->env_status = status;
+	// A running environment, the caller itself included, or one dying
+	// on another CPU, is not ours to queue: queueing it could run it on
+	// two CPUs at once.  It is rescheduled when it next traps.
+	if (status == ENV_RUNNABLE)
+	{
+		if (env->env_status != ENV_RUNNING && env->env_status != ENV_DYING)
+			sched_enqueue(env);
+	} else
+	{
+		sched_dequeue(env);
+		env->env_status = status;
+	}
+	return 0;
+}
+
+// Set envid's scheduling weight.  Runnable environments get CPU time
+// in proportion to their weights; out-of-range weights are clamped to
+// [ENV_WEIGHT_MIN, ENV_WEIGHT_MAX].  Children inherit their parent's
+// weight at sys_exofork.  Unless the caller is a file or network
+// server, weights above its own are clamped to its own, so it can give
+// neither itself nor its children more than its share.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_weight(envid_t envid, uint32_t weight)
+{
+	struct Env *env;
+	int ret = envid2env(envid, &env, true);
+	if (ret < 0)
+		return ret;
+	if (curenv->env_type != ENV_TYPE_FS && curenv->env_type != ENV_TYPE_NS)
+		weight = MIN(weight, curenv->env_weight);
+	sched_set_weight(env, weight);
+	return 0;
+}
+
+// Restrict envid to the CPUs in 'cpumask' (bit i stands for CPU i).
+// The scheduler otherwise prefers the CPU an environment last ran on.
+// If the caller restricts itself away from the CPU it is running on,
+// it is descheduled immediately.  Children inherit the mask at
+// sys_exofork.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains no running CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *env;
+	int ret = envid2env(envid, &env, true);
+	if (ret < 0)
+		return ret;
+	if ((ret = sched_set_affinity(env, cpumask)) < 0)
+		return ret;
+	if (env == curenv && !(cpumask & (1U << cpunum())))
+	{
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
 	return 0;
 }
 
@@ -132,28 +621,53 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf is not readable.
 static int
-sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
+sys_env_set_trapframe(envid_t envid, struct Trapframe *utf)
 {
 	// LAB 5: Your code here.
 	// Remember to check whether the user has supplied us with a good
 	// address!
+	struct Trapframe tf;
 	struct Env *env;
 	int ret = envid2env(envid, &env, true);
 	if (ret < 0)
 		return ret;
 
-	user_mem_assert(curenv, tf, sizeof(*tf), PTE_U);
+	if (copyin(&tf, utf, sizeof(tf)) < 0)
+		return -E_FAULT;
 
-	tf->tf_cs = curenv->env_tf.tf_cs;
-	tf->tf_ds = curenv->env_tf.tf_ds;
-	tf->tf_eflags &= ~FL_IOPL_MASK;
-	tf->tf_eflags |= FL_IF;
+	tf.tf_cs = curenv->env_tf.tf_cs;
+	tf.tf_ds = curenv->env_tf.tf_ds;
+	tf.tf_eflags &= ~FL_IOPL_MASK;
+	tf.tf_eflags |= FL_IF;
 
-	env->env_tf = *tf;
+	env->env_tf = tf;
+	// Only spawn sets a whole new trapframe, having loaded some other
+	// program than the one env_binary holds
+	env->env_binary = 0;
 	return 0;
 }
 
+// Map the shared libjos of a SHLIB=1 build into envid, as the kernel
+// does into the environments it loads itself: for spawn.  Its text is
+// the same read-only pages in every environment; its data is a new copy.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_NOT_SUPP if the kernel was not built with SHLIB=1.
+//	-E_NO_MEM on memory exhaustion.
+static int
+sys_shlib_map(envid_t envid)
+{
+	struct Env *env;
+
+	if (envid2env(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
+	return shlib_map(env);
+}
+
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
@@ -174,81 +688,262 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
-// Allocate a page of memory and map it at 'va' with permission
-// 'perm' in the address space of 'envid'.
-// The page's contents are set to 0.
-// If a page is already mapped at 'va', that page is unmapped as a
-// side effect.
+// Have envid's write faults on copy-on-write pages go to its page
+// fault upcall, like any other fault, if 'on'; otherwise, as they do
+// to begin with, the kernel resolves them (see page_fault_handler)
+// without the upcall ever hearing of them.  Forked children and
+// threads inherit the setting.
 //
-// perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
-//         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
-//
-// Return 0 on success, < 0 on error.  Errors are:
+// Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
-//	-E_INVAL if perm is inappropriate (see above).
-//	-E_NO_MEM if there's no memory to allocate the new page,
-//		or to allocate any necessary page tables.
 static int
-sys_page_alloc(envid_t envid, void *va, int perm)
+sys_env_set_cow_upcall(envid_t envid, bool on)
 {
-	// Hint: This function is a wrapper around page_alloc() and
-	//   page_insert() from kern/pmap.c.
-	//   Most of the new code you write should be to check the
-	//   parameters for correctness.
-	//   If page_insert() fails, remember to free the page you
-	//   allocated!
+	struct Env *env;
+	int ret;
 
+	if ((ret = envid2env(envid, &env, true)) < 0)
+		return ret;
+	env->env_cow_upcall = on;
+	return 0;
+}
 
-	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE != 0)
-		return -E_INVAL;
+// Register envid as the service 'name', 'len' characters long, so that
+// clients find it with ipc_find_service.  The name stays taken until
+// envid is freed.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the name is empty, SERVICE_NAMELEN or more characters
+//		long, or taken by another environment.
+//	-E_NO_MEM if the registry is full.
+// Destroys the environment on memory errors.
+static int
+sys_service_register(envid_t envid, const char *name, size_t len)
+{
+	char buf[SERVICE_NAMELEN];
+	struct Env *env;
+	int ret;
 
-	// Make sure perm consist only of flags in PTE_SYSCALl
-	// and make sure U,P are set
-	if ((perm & ~PTE_SYSCALL) || !(perm & (PTE_U | PTE_P)))
-	{
-		cprintf("sys_page_alloc bad permissions \n");
+	if ((ret = envid2env(envid, &env, true)) < 0)
+		return ret;
+	if (len == 0 || len >= SERVICE_NAMELEN)
 		return -E_INVAL;
-	}
+	user_mem_assert(curenv, name, len, PTE_U);
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+	if (strlen(buf) != len)
+		return -E_INVAL;
+	return service_register(env, buf);
+}
 
-	struct PageInfo *page_info = page_alloc(ALLOC_ZERO);
-	if (page_info == NULL)
-		return -E_NO_MEM;
+// Copy up to n events from CPU 'cpu's trace ring into buf, starting at
+// event number *pos, and advance *pos past them (see trace_read).
+// Returns how many were copied, or < 0 on error.  Errors are:
+//	-E_INVAL if there is no such CPU, or it is not tracing.
+// The environment is destroyed if pos or buf are not writable.
+static int
+sys_trace_read(int cpu, uint32_t *pos, struct TraceEvent *buf, size_t n)
+{
+	n = MIN(n, TRACE_NEVENTS);
+	user_mem_assert(curenv, pos, sizeof(*pos), PTE_P | PTE_U | PTE_W);
+	user_mem_assert(curenv, buf, n * sizeof(*buf), PTE_P | PTE_U | PTE_W);
+	return trace_read(cpu, pos, buf, n);
+}
 
-	struct Env *env;
-	int ret = envid2env(envid, &env, true);
-	if (ret < 0)
-		return ret;
-	ret = page_insert(env->env_pgdir, page_info, va, perm);
-	if (ret < 0)
-		return ret;
+// Start the sampling profiler afresh if 'on', else stop it, keeping
+// its samples for sys_prof_report.
+// Returns 0 on success, -E_NO_MEM if there is no memory for samples.
+static int
+sys_prof_ctl(bool on)
+{
+	if (on)
+		return prof_start();
+	prof_stop();
 	return 0;
 }
 
-// Map the page of memory at 'srcva' in srcenvid's address space
-// at 'dstva' in dstenvid's address space with permission 'perm'.
-// Perm has the same restrictions as in sys_page_alloc, except
-// that it also must not grant write access to a read-only
-// page.
-//
-// Return 0 on success, < 0 on error.  Errors are:
-//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
-//		or the caller doesn't have permission to change one of them.
-//	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
-//		or dstva >= UTOP or dstva is not page-aligned.
-//	-E_INVAL is srcva is not mapped in srcenvid's address space.
-//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
-//		address space.
-//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+// Add up the profiler's samples by function into *r (see prof_report).
+// Returns 0 on success, -E_NO_MEM if the kernel has no room to do so.
+// The environment is destroyed if r is not writable.
 static int
-sys_page_map(envid_t srcenvid, void *srcva,
-			 envid_t dstenvid, void *dstva, int perm)
+sys_prof_report(struct ProfReport *r)
 {
-	// Hint: This function is a wrapper around page_lookup() and
-	//   page_insert() from kern/pmap.c.
-	//   Again, most of the new code you write should be to check the
+	user_mem_assert(curenv, r, sizeof(*r), PTE_P | PTE_U | PTE_W);
+	return prof_report(r);
+}
+
+// Make envid count the n events in evtsel[] in its performance
+// counters 0..n-1, starting from 0; n == 0 stops them.  The
+// environment reads its counts with read_pmc (see kern/pmc.c).
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid,
+//		or envid is running on another CPU.
+//	-E_NOT_SUPP if the CPU has no counters the kernel can use.
+//	-E_INVAL if n is more than uinfo.pmc_ncounters, or an event select
+//		has bits outside PMC_VALID.
+//	-E_NO_MEM if there is no memory for the counts.
+// The environment is destroyed if evtsel is not readable.
+static int
+sys_pmc_set(envid_t envid, const uint32_t *evtsel, uint32_t n)
+{
+	uint32_t sel[PMC_MAX];
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, true)) < 0)
+		return r;
+	if (n > PMC_MAX)
+		return -E_INVAL;
+	user_mem_assert(curenv, evtsel, n * sizeof(*evtsel), PTE_U);
+	memmove(sel, evtsel, n * sizeof(*evtsel));
+	return pmc_set(e, sel, n);
+}
+
+// Start counting system calls afresh, only envid's, or everyone's if
+// envid is 0 (see kern/sysstat.c).
+// Returns 0 on success, -E_BAD_ENV if environment envid doesn't
+// currently exist.
+static int
+sys_sysstat_reset(envid_t envid)
+{
+	struct Env *e;
+	int r;
+
+	if (envid && (r = envid2env(envid, &e, false)) < 0)
+		return r;
+	sysstat_reset(envid ? e->env_id : 0);
+	return 0;
+}
+
+// Fill in *r with CPU cpu's system call statistics, or every CPU's
+// added up if cpu is -1.
+// Returns 0 on success, -E_INVAL if there is no such CPU.
+// The environment is destroyed if r is not writable.
+static int
+sys_sysstat_read(int cpu, struct SysStatReport *r)
+{
+	user_mem_assert(curenv, r, sizeof(*r), PTE_P | PTE_U | PTE_W);
+	return sysstat_read(cpu, r);
+}
+
+static void mem_pressure(void);
+
+// The PTE_PS case of sys_page_alloc.
+static int
+sys_superpage_alloc(envid_t envid, void *va, int perm)
+{
+	struct Env *env;
+	struct PageInfo *pp;
+	int ret;
+
+	if ((uintptr_t) va % PTSIZE != 0)
+		return -E_INVAL;
+	if (!superpages_enabled)
+		return -E_NOT_SUPP;
+	if ((ret = envid2env(envid, &env, true)) < 0)
+		return ret;
+	if (!(pp = page_alloc_order(SUPERPAGE_ORDER, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((ret = superpage_insert(env->env_pgdir, pp, va, perm & ~PTE_PS)) < 0)
+	{
+		page_free_order(pp, SUPERPAGE_ORDER);
+		return ret;
+	}
+	return 0;
+}
+
+// Allocate a page of memory and map it at 'va' with permission
+// 'perm' in the address space of 'envid'.
+// The page's contents are set to 0.  Unless perm has PTE_SHARE, it is
+// the zero page until first written (see page_insert_zero).
+// If a page is already mapped at 'va', that page is unmapped as a
+// side effect.  A superpage holding 'va' is split, keeping the rest of
+// its 4MB mapped (see page_insert).
+//
+// perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
+//         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may also be set to allocate one 4MB superpage at the
+//         PTSIZE-aligned 'va', replacing everything mapped there.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned
+//		(PTSIZE-aligned with PTE_PS).
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if va is in a superpage others map too, unless it is
+//		copy-on-write.
+//	-E_NOT_SUPP if PTE_PS is set but the CPU has no 4MB pages.
+//	-E_NO_MEM if there's no memory to allocate the new page,
+//		or to allocate any necessary page tables.
+static int
+sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	// Hint: This function is a wrapper around page_alloc() and
+	//   page_insert() from kern/pmap.c.
+	//   Most of the new code you write should be to check the
+	//   parameters for correctness.
+	//   If page_insert() fails, remember to free the page you
+	//   allocated!
+
+
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE != 0)
+		return -E_INVAL;
+
+	// Make sure perm consist only of flags in PTE_SYSCALl
+	// and make sure U,P are set
+	if ((perm & ~(PTE_SYSCALL | PTE_PS)) || !(perm & (PTE_U | PTE_P)))
+	{
+		cprintf("sys_page_alloc bad permissions \n");
+		return -E_INVAL;
+	}
+
+	if (perm & PTE_PS)
+		return sys_superpage_alloc(envid, va, perm);
+
+	struct Env *env;
+	int ret = envid2env(envid, &env, true);
+	if (ret < 0)
+		return ret;
+	ret = page_insert_zero(env->env_pgdir, va, perm);
+	if (ret < 0)
+	{
+		mem_pressure();
+		return ret;
+	}
+	return 0;
+}
+
+// Map the page of memory at 'srcva' in srcenvid's address space
+// at 'dstva' in dstenvid's address space with permission 'perm'.
+// Perm has the same restrictions as in sys_page_alloc, except
+// that it also must not grant write access to a read-only
+// page.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
+//		or dstva >= UTOP or dstva is not page-aligned.
+//	-E_INVAL is srcva is not mapped in srcenvid's address space.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
+//		address space.
+//	-E_INVAL if srcva is in a superpage and PTE_PS is not in perm,
+//		or PTE_PS is in perm and srcva is not a superpage or
+//		srcva/dstva are not PTSIZE-aligned.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_map(envid_t srcenvid, void *srcva,
+			 envid_t dstenvid, void *dstva, int perm)
+{
+	// Hint: This function is a wrapper around page_lookup() and
+	//   page_insert() from kern/pmap.c.
+	//   Again, most of the new code you write should be to check the
 	//   parameters for correctness.
 	//   Use the third argument to page_lookup() to
 	//   check the current permissions on the page.
@@ -273,9 +968,14 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	// Make sure perm consist only of flags in PTE_SYSCALl
 	// and make sure U,P are set
-	if ((perm & ~PTE_SYSCALL) || !(perm & (PTE_U | PTE_P)))
+	if ((perm & ~(PTE_SYSCALL | PTE_PS)) || !(perm & (PTE_U | PTE_P)))
 		return -E_INVAL;
 
+	// Granting write access to a copy-on-write page grants it to a
+	// copy of the sender's own
+	if ((perm & PTE_W) && (ret = page_cow_break(src_env->env_pgdir, srcva)) < 0)
+		return ret;
+
 	pte_t *pte_entry;
 	struct PageInfo *page_info = page_lookup(src_env->env_pgdir, srcva, &pte_entry);
 	// Page is not mapped
@@ -283,12 +983,25 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 
 	// The user requested write permissions when the page is read only
-	if ((perm & PTE_W) && !(*pte_entry & PTE_W))
+	if ((perm & PTE_W) && !page_writable(src_env->env_pgdir, srcva))
+		return -E_INVAL;
+
+	// Superpages are only ever mapped whole.
+	if ((perm & PTE_PS) != (*pte_entry & PTE_PS))
 		return -E_INVAL;
+	if (perm & PTE_PS)
+	{
+		if ((uintptr_t) srcva % PTSIZE != 0 || (uintptr_t) dstva % PTSIZE != 0)
+			return -E_INVAL;
+		return superpage_insert(dst_env->env_pgdir, page_info, dstva, perm & ~PTE_PS);
+	}
 
 	ret = page_insert(dst_env->env_pgdir, page_info, dstva, perm);
 	if (ret < 0)
 		return ret;
+	// Environments sharing a page, such as a pipe's, talk through it
+	if (perm & PTE_SHARE)
+		sched_note_peer(src_env, dst_env);
 	return 0;
 }
 
@@ -299,6 +1012,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if va's page table, which fork left shared, couldn't be
+//		copied.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -308,10 +1023,479 @@ sys_page_unmap(envid_t envid, void *va)
 		return ret;
 	if ((uint32_t) va >= UTOP || (uint32_t) va % PGSIZE != 0)
 		return -E_INVAL;
+	if (page_lookup(env->env_pgdir, va, NULL) &&
+		(ret = pgdir_unshare(env->env_pgdir, va)) < 0)
+		return ret;
 	page_remove(env->env_pgdir, va);
 	return 0;
 }
 
+// Store in pa[i] the physical address of the page mapped at
+// va + i * PGSIZE in the caller, for each of 'npages' pages, so that
+// a user-level driver can point a device's DMA at them.  Only an
+// environment with I/O privileges may ask: it can already program the
+// devices that would use the addresses.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges, va is not
+//		page-aligned, or the pages do not lie below UTOP.
+//	-E_FAULT if one of the pages is not mapped user-accessible.
+//	-E_NO_MEM if a copy-on-write page could not be copied.
+// The environment is destroyed if pa is not writable.
+static int
+sys_page_paddr(const void *va, size_t npages, physaddr_t *pa)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t i;
+	int r;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0 ||
+		(uintptr_t) va % PGSIZE != 0 || (uintptr_t) va >= UTOP ||
+		npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	user_mem_assert(curenv, pa, npages * sizeof(*pa), PTE_P | PTE_U | PTE_W);
+	for (i = 0; i < npages; i++)
+	{
+		// A device writing the frame must not write the zero page, or
+		// another environment's copy-on-write page
+		if ((r = page_cow_break(curenv->env_pgdir, (char *) va + i * PGSIZE)) < 0)
+			return r;
+		pp = page_lookup(curenv->env_pgdir, (char *) va + i * PGSIZE, &pte);
+		if (!pp || !(*pte & PTE_U))
+			return -E_FAULT;
+		pa[i] = page2pa(pp);
+	}
+	return 0;
+}
+
+// Notifications: a word of bits per environment, which other
+// environments (sys_notify) and IRQs (sys_irq_notify) set and the
+// environment takes with sys_wait_notify, sleeping until one it wants
+// is set.  A notification carries no more than its bit, and several
+// before the environment looks count as one, so it is much lighter
+// than an IPC: nobody need be waiting to receive it.
+//
+// The sleep is a futex sleep on the word itself, so that sys_wait_notify
+// can time out as futex_wait does.  Protected by the big kernel lock.
+
+// Set 'bits' in e's notifications, and if e is asleep on any of them,
+// take them and wake it.
+static void
+notify_post(struct Env *e, uint32_t bits)
+{
+	physaddr_t key = envs_paddr(&e->env_notify);
+	uint32_t taken;
+
+	e->env_notify |= bits;
+	if (e->env_futex_pa != key || !(taken = e->env_notify & e->env_notify_mask))
+		return;
+	e->env_notify &= ~taken;
+	futex_wake_pa(key, ~0U);
+	e->env_tf.tf_regs.reg_eax = taken;
+}
+
+// Set notification 'bits' of environment 'envid', waking it if it is
+// asleep in sys_wait_notify on any of them.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if bits is 0 or not within NOTIFY_MASK.
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	struct Env *e;
+
+	if (bits == 0 || (bits & ~NOTIFY_MASK))
+		return -E_INVAL;
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	notify_post(e, bits);
+	return 0;
+}
+
+// Take the caller's notifications among 'mask', sleeping until one is
+// set if none is, for at most 'timeout' milliseconds if that is not 0.
+//
+// Returns the bits taken, which are clear again afterwards, or < 0 on
+// error.  Errors are:
+//	-E_INVAL if mask is 0 or not within NOTIFY_MASK.
+//	-E_TIMEOUT if the timeout passed first.
+// Returns 0 if woken otherwise, by a futex_wake on the word at UENVS.
+static int
+sys_wait_notify(uint32_t mask, uint32_t timeout)
+{
+	uint32_t taken;
+
+	if (mask == 0 || (mask & ~NOTIFY_MASK))
+		return -E_INVAL;
+	if ((taken = curenv->env_notify & mask))
+	{
+		curenv->env_notify &= ~taken;
+		return taken;
+	}
+	curenv->env_notify_mask = mask;
+	futex_sleep(envs_paddr(&curenv->env_notify), timeout);
+}
+
+// The environment each IRQ is routed to by sys_irq_ipc or
+// sys_irq_notify, or 0, and the value it receives or the notification
+// bits set.  Protected by the big kernel lock.
+static struct {
+	envid_t envid;
+	uint32_t value;
+	bool notify;
+} irq_ipc[16];
+
+// Route IRQ 'irq' to the caller as IPC: from now on, each time the IRQ
+// is raised the caller receives 'value' from envid 0 with no page, in
+// whatever receive it makes next (including the reply wait of an IPC
+// call).  This replaces any earlier route of the IRQ.  With an IOAPIC,
+// the IRQ is taken on the caller's CPU, and then on whichever CPU the
+// caller last ran on.  Only an environment with I/O privileges may ask, for the IDE channels' IRQs,
+// which it must acknowledge at the device itself, or the virtio-blk
+// disk's, which the kernel acknowledges.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges or irq is not
+//		IRQ_IDE, IRQ_IDE + 1 or the virtio-blk disk's IRQ.
+static int
+sys_irq_ipc(uint32_t irq, uint32_t value)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0 ||
+		(irq != IRQ_IDE && irq != IRQ_IDE + 1 && !vblk_irq(irq)))
+		return -E_INVAL;
+	irq_ipc[irq].envid = curenv->env_id;
+	irq_ipc[irq].value = value;
+	irq_ipc[irq].notify = false;
+	curenv->env_irq_pending &= ~(1 << irq);
+	irq_enable(irq);
+	irq_route(irq, cpunum());
+	return 0;
+}
+
+// Route IRQ 'irq' to the caller as a notification: from now on, each
+// time the IRQ is raised the caller's notification 'bits' are set (see
+// sys_wait_notify).  Otherwise as sys_irq_ipc, whose route this
+// replaces, as it does this one.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges, irq is not one
+//		sys_irq_ipc takes, or bits is 0 or not within NOTIFY_MASK.
+static int
+sys_irq_notify(uint32_t irq, uint32_t bits)
+{
+	int ret;
+
+	if (bits == 0 || (bits & ~NOTIFY_MASK))
+		return -E_INVAL;
+	if ((ret = sys_irq_ipc(irq, bits)) < 0)
+		return ret;
+	irq_ipc[irq].notify = true;
+	return 0;
+}
+
+// The environments that have asked with sys_reclaim_notify to hear when
+// memory runs out, and the notification bits each is sent.  Protected
+// by the big kernel lock.
+#define RECLAIM_NWATCH 4
+static struct {
+	envid_t envid;
+	uint32_t bits;
+} reclaim_watch[RECLAIM_NWATCH];
+
+// A page allocation for user space just failed: tell each environment
+// watching for that, so that it can give memory back before the
+// allocation is retried.  Notifications coalesce, so a burst of
+// failures costs each watcher one wakeup.
+static void
+mem_pressure(void)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < RECLAIM_NWATCH; i++)
+		if (reclaim_watch[i].envid &&
+			envid2env(reclaim_watch[i].envid, &e, 0) == 0)
+			notify_post(e, reclaim_watch[i].bits);
+}
+
+// Have the caller's notification 'bits' set (see sys_wait_notify) each
+// time the kernel runs out of pages for an allocation from user space,
+// or if bits is 0, stop.  The file server asks, to give back clean
+// blocks of its cache.  Only an environment with I/O privileges may
+// ask, as for sys_irq_notify.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges, or bits is not
+//		within NOTIFY_MASK.
+//	-E_NO_MEM if RECLAIM_NWATCH live environments are watching already.
+static int
+sys_reclaim_notify(uint32_t bits)
+{
+	struct Env *e;
+	int i, free = -1;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0 || (bits & ~NOTIFY_MASK))
+		return -E_INVAL;
+	for (i = 0; i < RECLAIM_NWATCH; i++)
+	{
+		if (reclaim_watch[i].envid == curenv->env_id)
+			break;
+		if (free < 0 && (reclaim_watch[i].envid == 0 ||
+						 envid2env(reclaim_watch[i].envid, &e, 0) < 0))
+			free = i;
+	}
+	if (i == RECLAIM_NWATCH && (i = free) < 0)
+		return bits ? -E_NO_MEM : 0;
+	reclaim_watch[i].envid = bits ? curenv->env_id : 0;
+	reclaim_watch[i].bits = bits;
+	return 0;
+}
+
+// Store the size and IRQ of virtio-blk disk number 'disk', and how many
+// there are, in *info.  Only an environment with I/O privileges may
+// ask, as for the calls below.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges or there is no such
+//		virtio-blk disk.
+// The environment is destroyed if info is not writable.
+static int
+sys_blk_info(uint32_t disk, struct BlkInfo *info)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_INVAL;
+	user_mem_assert(curenv, info, sizeof(*info), PTE_P | PTE_U | PTE_W);
+	return vblk_info(disk, info);
+}
+
+// Start a transfer of nsecs sectors between sector secno of the
+// virtio-blk disk BLK_FLAGS_DISK(flags) and the caller's buffer at buf;
+// the disk reads from the buffer when flags has BLK_WRITE and writes
+// into it otherwise.  The buffer's pages stay referenced until the
+// transfer is reaped with sys_blk_reap, which reports it by 'tag'.
+// Several transfers may be in flight at once, on any of the disks, and
+// complete in any order.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges, there is no such
+//		disk, or the transfer is empty, too long or past the end of
+//		the disk.
+//	-E_FAULT if the buffer is not mapped (writable, for a read).
+//	-E_WOULD_BLOCK if there is no room for the transfer until some
+//		in flight are reaped.
+static int
+sys_blk_submit(uint32_t tag, uint32_t secno, const void *buf, size_t nsecs,
+			   uint32_t flags)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_INVAL;
+	return vblk_submit(curenv, BLK_FLAGS_DISK(flags), tag, secno, buf, nsecs,
+					   flags & BLK_WRITE);
+}
+
+// Store up to n completed transfers of the virtio-blk disks in done[],
+// in the order they completed on each disk, each with 0 or the error
+// it failed with.
+//
+// Returns the number stored on success, < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no I/O privileges.
+// The environment is destroyed if done is not writable.
+static int
+sys_blk_reap(struct BlkDone *done, size_t n)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_INVAL;
+	user_mem_assert(curenv, done, n * sizeof(*done), PTE_P | PTE_U | PTE_W);
+	return vblk_reap(done, n);
+}
+
+// Resolve a write fault on the copy-on-write page holding 'va' in the
+// caller's address space, as the kernel does itself unless the caller
+// asked to see such faults (see page_cow_resolve and
+// sys_env_set_cow_upcall).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or is not in a mapped copy-on-write page.
+//	-E_NO_MEM if there's no memory for the copy.
+static int
+sys_page_cow_resolve(void *va)
+{
+	return page_cow_resolve(curenv->env_pgdir, va);
+}
+
+// Apply the 'n' operations in 'ops' with a single kernel entry.  Each
+// one maps, allocates (srcva == PAGEMAP_ALLOC) or unmaps (perm == 0)
+// its pages exactly like sys_page_map, sys_page_alloc or sys_page_unmap,
+// from srcenvid's address space into dstenvid's.
+//
+// Operations are applied in order, stopping at the first error.  The
+// number of operations fully applied is stored in *done; the failing
+// operation may have been applied to some of its pages.  Other CPUs
+// may take the kernel between pages, so a batch is not atomic, and an
+// environment destroyed meanwhile fails the rest with -E_BAD_ENV.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_FAULT if ops or done is not accessible.
+//	Any error of sys_page_map, sys_page_alloc or sys_page_unmap.
+static int
+sys_page_map_batch(envid_t srcenvid, envid_t dstenvid,
+				   const struct PageMapOp *ops, size_t n, size_t *done)
+{
+	struct Env *env;
+	struct PageMapOp op;
+	uintptr_t step;
+	size_t i;
+	uint32_t j;
+	int ret;
+
+	if ((ret = envid2env(srcenvid, &env, true)) < 0 ||
+		(ret = envid2env(dstenvid, &env, true)) < 0)
+		return ret;
+	if (n > UTOP / sizeof(*ops))
+		return -E_INVAL;
+
+	for (i = 0, ret = 0; i < n; i++)
+	{
+		// Re-checked per operation: an earlier one may unmap the array.
+		if (user_mem_check(curenv, &ops[i], sizeof(op), PTE_U) < 0)
+		{
+			ret = -E_FAULT;
+			break;
+		}
+		op = ops[i];
+		step = (op.perm & PTE_PS) ? PTSIZE : PGSIZE;
+
+		for (j = 0; j < op.npages && ret == 0; j++)
+		{
+			void *dstva = (void *) (op.dstva + j * step);
+			if (op.perm == 0)
+				ret = sys_page_unmap(dstenvid, dstva);
+			else if (op.srcva == PAGEMAP_ALLOC)
+				ret = sys_page_alloc(dstenvid, dstva, op.perm);
+			else
+				ret = sys_page_map(srcenvid, (void *) (op.srcva + j * step),
+								   dstenvid, dstva, op.perm);
+			// Each page looks both environments up afresh
+			kernel_lock_preempt();
+		}
+		if (ret < 0)
+			break;
+	}
+
+	if (user_mem_check(curenv, done, sizeof(*done), PTE_U | PTE_W) < 0)
+		return -E_FAULT;
+	*done = i;
+	return ret;
+}
+
+// Deliver an IPC from 'src' to the environment 'envid' (see
+// sys_ipc_try_send), without making the receiver runnable.  The
+// receiver is stored in *dstp whenever it exists, even if it turns
+// out not to be receiving.
+//
+// The upper bits of 'perm' may ask for IPC_PERM_SENDPAGES(perm)
+// consecutive pages from srcva to be sent.  The receiver gets as many
+// of them as it asked for, mapped all together or not at all.  The
+// receiver also gets the IPC_NWORDS words at 'words', or zeroes if it
+// is NULL.
+static int
+ipc_deliver(struct Env *src, envid_t envid, uint32_t value, void *srcva,
+			unsigned perm, const uint32_t *words, struct Env **dstp)
+{
+	struct Env *dstenv;
+	struct PageInfo *pp[IPC_MAXPAGES];
+	pte_t *srcva_pte;
+	unsigned npages = 0, i;
+	int ret;
+
+	// Check that the env exists
+	if ((ret = envid2env(envid, &dstenv, false)) < 0)
+		return ret;
+	*dstp = dstenv;
+
+	// If caller sent pages
+	if ((size_t) srcva < UTOP)
+	{
+		npages = IPC_PERM_SENDPAGES(perm);
+		perm &= IPC_PERM_PTE;
+
+		// Check pages are aligned and below UTOP
+		if ((size_t) srcva % PGSIZE != 0 || npages > IPC_MAXPAGES ||
+			(size_t) srcva + npages * PGSIZE > UTOP)
+			return -E_INVAL;
+		// Inappropriate permissions
+		if ((perm & ~PTE_SYSCALL) || !(perm & (PTE_U | PTE_P)))
+			return -E_INVAL;
+
+		for (i = 0; i < npages; i++)
+		{
+			if ((perm & PTE_W) &&
+				(ret = page_cow_break(src->env_pgdir, srcva + i * PGSIZE)) < 0)
+				return ret;
+
+			// Srcva not mapped
+			pp[i] = page_lookup(src->env_pgdir, srcva + i * PGSIZE, &srcva_pte);
+			if (pp[i] == NULL)
+				return -E_INVAL;
+
+			// Write permission, but src address is not writable
+			if ((perm & PTE_W) && !page_writable(src->env_pgdir, srcva + i * PGSIZE))
+				return -E_INVAL;
+
+			// Superpages cannot be sent over IPC
+			if (*srcva_pte & PTE_PS)
+				return -E_INVAL;
+		}
+	}
+
+	// If target env is not blocking right now, or not for us
+	if (!dstenv->env_ipc_recving ||
+		(dstenv->env_ipc_recv_from && dstenv->env_ipc_recv_from != src->env_id))
+		return -E_IPC_NOT_RECV;
+
+	// Send page mappings if dest environment is recieving them
+	dstenv->env_ipc_perm = 0;
+	dstenv->env_ipc_npages = 0;
+	if ((uintptr_t) dstenv->env_ipc_dstva >= UTOP)
+		npages = 0;
+	if (npages > dstenv->env_ipc_dstnpages)
+		npages = dstenv->env_ipc_dstnpages;
+	for (i = 0; i < npages; i++)
+	{
+		ret = page_insert(dstenv->env_pgdir, pp[i],
+						  dstenv->env_ipc_dstva + i * PGSIZE, perm);
+		if (ret < 0)
+		{
+			while (i-- > 0)
+				page_remove(dstenv->env_pgdir, dstenv->env_ipc_dstva + i * PGSIZE);
+			return ret;
+		}
+	}
+	if (npages > 0)
+	{
+		dstenv->env_ipc_perm = perm;
+		dstenv->env_ipc_npages = npages;
+	}
+
+	dstenv->env_ipc_recving = false;
+	timerq_cancel(dstenv);
+	dstenv->env_ipc_from = src->env_id;
+	dstenv->env_ipc_value = value;
+	for (i = 0; i < IPC_NWORDS; i++)
+		dstenv->env_ipc_words[i] = words ? words[i] : 0;
+
+	dstenv->env_tf.tf_regs.reg_eax = 0; // target env syscall returns with value 0
+	trace_event(TRACE_IPC_SEND, dstenv->env_id, value, npages, src->env_id);
+	src->env_ipc_sends++;
+	dstenv->env_ipc_recvs++;
+	sched_note_peer(src, dstenv);
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -326,13 +1510,16 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
+// then no page mapping is transferred, but no error occurs.  Likewise,
+// if the upper bits of perm ask to send more pages than the receiver
+// asked for (see IPC_SENDPAGES), the extra pages are not transferred.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
@@ -340,104 +1527,668 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//		or is receiving only from another environment (see
+//		sys_ipc_recv_from), or another environment managed to send
+//		first.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, or the
+//		pages to send do not fit below UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if srcva is in a superpage.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *dstenv;
+	int ret;
+
+	if ((ret = ipc_deliver(curenv, envid, value, srcva, perm, NULL, &dstenv)) < 0)
+		return ret;
+	sched_enqueue(dstenv);
+	return 0;
+}
+
+// Block curenv on dstenv's queue of senders until dstenv receives.
+// The send's arguments wait in curenv.  If 'call' is set, curenv goes
+// on to wait for a reply of up to 'dstnpages' pages at 'dstva' once
+// its message is delivered.
+static void
+ipc_sendq_push(struct Env *dstenv, uint32_t value, void *srcva,
+			   unsigned perm, const uint32_t *words, bool call, void *dstva,
+			   unsigned dstnpages)
+{
+	int i;
+
+	curenv->env_ipc_send_to = dstenv->env_id;
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	for (i = 0; i < IPC_NWORDS; i++)
+		curenv->env_ipc_send_words[i] = words ? words[i] : 0;
+	curenv->env_ipc_send_call = call;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = dstnpages;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+
+	curenv->env_ipc_send_next = NULL;
+	if (dstenv->env_ipc_sendq_tail)
+		dstenv->env_ipc_sendq_tail->env_ipc_send_next = curenv;
+	else
+		dstenv->env_ipc_sendq = curenv;
+	dstenv->env_ipc_sendq_tail = curenv;
+}
+
+// Take the oldest blocked sender off e's queue, counting only 'from'
+// if that is not 0, or return NULL.
+static struct Env *
+ipc_sendq_pop(struct Env *e, envid_t from)
+{
+	struct Env *s, *prev = NULL;
+
+	for (s = e->env_ipc_sendq; s && from && s->env_id != from; s = s->env_ipc_send_next)
+		prev = s;
+	if (s == NULL)
+		return NULL;
+	if (prev)
+		prev->env_ipc_send_next = s->env_ipc_send_next;
+	else
+		e->env_ipc_sendq = s->env_ipc_send_next;
+	if (e->env_ipc_sendq_tail == s)
+		e->env_ipc_sendq_tail = prev;
+	s->env_ipc_send_next = NULL;
+	s->env_ipc_send_to = 0;
+	return s;
+}
+
+static bool ipc_recv_start(struct Env *e, void *dstva, unsigned npages,
+						   envid_t from, struct Env **sp);
+
+// If one of the IRQs routed to e is pending, deliver it to e, which is
+// receiving from anyone, as an IPC from envid 0 carrying no page.
+// Returns true if it did.
+static bool
+ipc_deliver_irq(struct Env *e)
+{
+	int irq;
+
+	if (e->env_irq_pending == 0 || e->env_ipc_recv_from)
+		return false;
+	for (irq = 0; !(e->env_irq_pending & (1 << irq)); irq++)
+		/* do nothing */;
+	e->env_irq_pending &= ~(1 << irq);
+
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	e->env_ipc_recving = false;
+	timerq_cancel(e);
+	e->env_ipc_from = 0;
+	e->env_ipc_value = irq_ipc[irq].value;
+	memset(e->env_ipc_words, 0, sizeof(e->env_ipc_words));
+	e->env_tf.tf_regs.reg_eax = 0;
+	return true;
+}
+
+// Handle trap 'trapno' if it is an IRQ that sys_irq_ipc routed to an
+// environment: deliver it if the environment is waiting to receive,
+// or else leave it pending until its next receive.  Several
+// interrupts before that receive count as one.  An IRQ routed by
+// sys_irq_notify just posts its notification.
+// Returns false if trapno is not such an IRQ.
+bool
+irq_ipc_intr(uint32_t trapno)
+{
+	uint32_t irq = trapno - IRQ_OFFSET;
+	struct Env *e;
+
+	if (trapno < IRQ_OFFSET || irq >= ARRAY_SIZE(irq_ipc) ||
+		irq_ipc[irq].envid == 0)
+		return false;
+
+	if (envid2env(irq_ipc[irq].envid, &e, 0) < 0)
+	{
+		// It exited: nobody is left to take the interrupt
+		irq_ipc[irq].envid = 0;
+		irq_disable(irq);
+	} else if (irq_ipc[irq].notify)
+		notify_post(e, irq_ipc[irq].value);
+	else
+	{
+		e->env_irq_pending |= 1 << irq;
+		if (e->env_ipc_recving && e->env_status == ENV_NOT_RUNNABLE &&
+			ipc_deliver_irq(e))
+			sched_enqueue(e);
+	}
+	// Send the next one to where its taker last ran
+	if (irq_ipc[irq].envid)
+		irq_route(irq, e->env_cpunum);
+	irq_eoi();
+	return true;
+}
+
+// Is any IRQ routed to e by sys_irq_ipc or sys_irq_notify?
+bool
+irq_ipc_waiter(struct Env *e)
+{
+	uint32_t irq;
+
+	for (irq = 0; irq < ARRAY_SIZE(irq_ipc); irq++)
+		if (irq_ipc[irq].envid == e->env_id)
+			return true;
+	return false;
+}
+
+// Finish the blocked send of s, which was popped off its receiver's
+// queue, with result 'ret'.  A successful ipc_call sender goes on to
+// wait for its reply, which may come at once from a sender blocked on
+// it, itself perhaps an ipc_call sender; such chains are finished in
+// a loop rather than by recursion, however long they are.
+static void
+ipc_send_done(struct Env *s, int ret)
+{
+	struct Env *next;
+
+	for (; s != NULL; s = next)
+	{
+		next = NULL;
+		s->env_tf.tf_regs.reg_eax = ret;
+		if (ret == 0 && s->env_ipc_send_call &&
+			!ipc_recv_start(s, s->env_ipc_dstva, s->env_ipc_dstnpages, 0,
+							&next))
+			continue;   // s now waits for its reply
+		sched_enqueue(s);
+	}
+}
+
+// Make e start receiving an IPC of up to 'npages' pages at 'dstva',
+// which ipc_check_dstva has approved, from 'from' only if that is not
+// 0.  If senders are blocked on e, the oldest one's message is
+// delivered at once and e does not block; a sender whose message can
+// no longer be delivered (say, its page was unmapped meanwhile) gets
+// the error and the next one is tried.  Senders other than 'from' stay
+// queued.  The sender delivered from, if any, is stored in *sp for the
+// caller to finish with ipc_send_done(*sp, 0); *sp is NULL otherwise.
+// Returns true if e received a message, false if e is now
+// ENV_NOT_RUNNABLE, waiting.
+static bool
+ipc_recv_start(struct Env *e, void *dstva, unsigned npages, envid_t from,
+			   struct Env **sp)
+{
+	struct Env *s, *dstenv;
+	int ret;
+
+	*sp = NULL;
+	trace_event(TRACE_IPC_RECV, (uintptr_t) dstva, npages, from, 0);
+	e->env_ipc_recving = true;
+	e->env_ipc_recv_from = from;
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_dstnpages = npages;
+	if (ipc_deliver_irq(e))
+		return true;
+	while ((s = ipc_sendq_pop(e, from)) != NULL)
+	{
+		ret = ipc_deliver(s, e->env_id, s->env_ipc_send_value,
+						  s->env_ipc_send_srcva, s->env_ipc_send_perm,
+						  s->env_ipc_send_words, &dstenv);
+		if (ret == 0)
+		{
+			*sp = s;
+			return true;
+		}
+		s->env_tf.tf_regs.reg_eax = ret;
+		sched_enqueue(s);
+	}
+	e->env_status = ENV_NOT_RUNNABLE;
+	return false;
+}
+
+// Make e wait to receive an IPC as ipc_recv_start does, and finish the
+// send of whichever blocked sender it received from.
+// Returns true if e received a message, false if e is now
+// ENV_NOT_RUNNABLE, waiting.
+static bool
+ipc_wait(struct Env *e, void *dstva, unsigned npages, envid_t from)
+{
+	struct Env *s;
+	bool received;
+
+	received = ipc_recv_start(e, dstva, npages, from, &s);
+	if (s != NULL)
+		ipc_send_done(s, 0);
+	return received;
+}
+
+// May an environment receive 'npages' pages at 'dstva'?
+// Returns 0 if so, -E_INVAL if dstva < UTOP but is not page-aligned,
+// or the pages do not fit below UTOP.
+static int
+ipc_check_dstva(void *dstva, unsigned npages)
+{
+	if ((size_t) dstva >= UTOP)
+		return 0;
+	if ((size_t) dstva % PGSIZE != 0 || npages > IPC_MAXPAGES ||
+		(size_t) dstva + npages * PGSIZE > UTOP)
+		return -E_INVAL;
+	return 0;
+}
+
+// Called when e is freed: take e off the queue it is blocked sending
+// on, and fail every send blocked on e with -E_BAD_ENV.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s;
+
+	if (e->env_ipc_send_to != 0)
+	{
+		ipc_sendq_pop(&envs[ENVX(e->env_ipc_send_to)], e->env_id);
+		e->env_ipc_send_next = NULL;
+		e->env_ipc_send_to = 0;
+	}
+
+	while ((s = ipc_sendq_pop(e, 0)) != NULL)
+		ipc_send_done(s, -E_BAD_ENV);
+}
+
+// The body of sys_ipc_send, also sending 'words' (see ipc_deliver).
+static int
+ipc_send_blocking(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+				  const uint32_t *words)
+{
+	struct Env *dstenv;
+	int ret;
+
+	ret = ipc_deliver(curenv, envid, value, srcva, perm, words, &dstenv);
+	if (ret == -E_IPC_NOT_RECV && dstenv != curenv)
+	{
+		ipc_sendq_push(dstenv, value, srcva, perm, words, false, NULL, 0);
+		sched_yield();
+	}
+	if (ret < 0)
+		return ret;
+	sched_enqueue(dstenv);
+	return 0;
+}
+
+// Send 'value' (and the page at 'srcva') to 'envid' like
+// sys_ipc_try_send, but if 'envid' is not receiving, block until it
+// is instead of failing with -E_IPC_NOT_RECV.  Blocked senders are
+// served in the order they arrived, one per sys_ipc_recv.
+//
+// Like sys_ipc_recv, this may not return; the system call returns 0
+// once the message is delivered, or the error that kept it from being
+// delivered: the errors of sys_ipc_try_send other than
+// -E_IPC_NOT_RECV, and -E_BAD_ENV if the receiver exits first.
+// Sending to yourself fails with -E_IPC_NOT_RECV, since you could
+// never receive it.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return ipc_send_blocking(envid, value, srcva, perm, NULL);
+}
+
+// Receive as sys_ipc_recv does, but only from 'from' if that is not 0,
+// and give up after 'msec' milliseconds if that is not 0.  Other
+// senders block in their sys_ipc_send or sys_ipc_call, in order, until
+// a receive that accepts them; IRQs routed to us by sys_irq_ipc stay
+// pending likewise.
+//
+// Returns as sys_ipc_recv does, with its errors, and also
+//	-E_TIMEOUT if no message came in time.
+static int
+sys_ipc_recv_from(void *dstva, unsigned npages, envid_t from, uint32_t msec)
+{
+	if (npages == 0)
+		npages = 1;
+	if (ipc_check_dstva(dstva, npages) < 0)
+		return -E_INVAL;
+	if (ipc_wait(curenv, dstva, npages, from))
+		return 0;
+	if (msec)
+		timerq_add(curenv, msec);
+	sched_yield();
+}
+
+// Receive as sys_ipc_recv does, but give up after 'msec' milliseconds
+// if that is not 0.
+//
+// Returns as sys_ipc_recv does, with its errors, and also
+//	-E_TIMEOUT if no message came in time.
+static int
+sys_ipc_recv_timeout(void *dstva, unsigned npages, uint32_t msec)
+{
+	return sys_ipc_recv_from(dstva, npages, 0, msec);
+}
+
+// Block until a value is ready.  Record that you want to receive
+// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
+// mark yourself not runnable, and then give up the CPU.
+//
+// If 'dstva' is < UTOP, then you are willing to receive 'npages' pages
+// of data (one if 'npages' is 0).  'dstva' is the virtual address at
+// which the first sent page should be mapped.
+//
+// If a sender is already blocked in sys_ipc_send or sys_ipc_call
+// waiting for us, its message is delivered at once and this returns 0.
+// Otherwise this function only returns on error, but the system call
+// will eventually return 0 on success.
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or the pages
+//		do not fit below UTOP.
+static int
+sys_ipc_recv(void *dstva, unsigned npages)
+{
+	return sys_ipc_recv_timeout(dstva, npages, 0);
+}
+
+// Sleep for 'msec' milliseconds, to within a clock tick, or just yield
+// the CPU if msec is 0.
+//
+// Returns 0.
+static int
+sys_sleep(uint32_t msec)
+{
+	if (msec)
+	{
+		timerq_add(curenv, msec);
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Having just delivered a message to dstenv, wait for one of up to
+// 'npages' pages at 'dstva'.
+// If nothing is queued for us, give dstenv the rest of this CPU's
+// quantum.  Returns 0 if a message was already queued.
+static int
+ipc_switch(struct Env *dstenv, void *dstva, unsigned npages)
 {
-	// LAB 4: Your code here.
+	if (ipc_wait(curenv, dstva, npages, 0))
+	{
+		sched_enqueue(dstenv);
+		return 0;
+	}
+	sched_handoff(dstenv);
+}
+
+// The body of sys_ipc_call, also sending 'words' (see ipc_deliver).
+static int
+ipc_call_blocking(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+				  const uint32_t *words, void *dstva)
+{
+	unsigned npages = IPC_PERM_RECVPAGES(perm);
 	struct Env *dstenv;
-	// Check that the env exists
-	int ret = envid2env(envid, &dstenv, false);
+	int ret;
+
+	if (ipc_check_dstva(dstva, npages) < 0)
+		return -E_INVAL;
+	ret = ipc_deliver(curenv, envid, value, srcva, perm, words, &dstenv);
+	if (ret == -E_IPC_NOT_RECV && dstenv != curenv)
+	{
+		ipc_sendq_push(dstenv, value, srcva, perm, words, true, dstva, npages);
+		sched_yield();
+	}
 	if (ret < 0)
 		return ret;
+	return ipc_switch(dstenv, dstva, npages);
+}
 
-	// If target env is not blocking right now
-	if (!dstenv->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
-//	if (dstenv->env_ipc_from != 0 && dstenv->env_ipc_from != curenv->env_id)
-//		return -E_IPC_NOT_RECV;
+// Send 'value' (and the page at 'srcva') to 'envid' as sys_ipc_send
+// does, then wait for a reply as sys_ipc_recv(dstva) does.  Rather
+// than queueing the receiver behind everything else on its run queue,
+// hand it the rest of this CPU's quantum: for a request to a server
+// that is waiting for one, the server runs next.
+//
+// The reply may carry up to IPC_PERM_RECVPAGES(perm) pages.
+//
+// Like sys_ipc_recv, this only returns on error; the system call
+// returns 0 when the reply arrives.
+// Errors are those of sys_ipc_send and sys_ipc_recv.  On error
+// nothing has been sent.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+			 void *dstva)
+{
+	return ipc_call_blocking(envid, value, srcva, perm, NULL, dstva);
+}
 
-	// This is asserted because env_ipc_receiving is true
-//	assert(dstenv->env_status == ENV_NOT_RUNNABLE);
 
+// Small messages: send 'value' and the words w0 and w1, but no page, to
+// 'envid' as sys_ipc_send does.  The receiver finds the words in
+// env_ipc_words, which every other IPC zeroes, so a small request needs
+// no argument page to be filled in and mapped.  (They go through the
+// receiver's struct Env rather than its registers, where it already
+// finds the value, since sysexit takes %edx and %ecx.)
+//
+// Returns as sys_ipc_send does, with its errors.
+static int
+sys_ipc_send_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1 };
 
-	// If caller sent a page
-	pte_t *srcva_pte;
-	if ((size_t) srcva < UTOP)
-	{
-		// Check page is aligned
-		if ((size_t) srcva % PGSIZE != 0)
-			return -E_INVAL;
-		// Inappropriate permissions
-		if ((perm & ~PTE_SYSCALL) || !(perm & (PTE_U | PTE_P)))
-			return -E_INVAL;
+	return ipc_send_blocking(envid, value, (void *) UTOP, 0, words);
+}
 
-		// Srcva not mapped
-		if (page_lookup(curenv->env_pgdir, srcva, &srcva_pte) == NULL)
-			return -E_INVAL;
+// Send 'value' and the words w0 and w1 to 'envid' as
+// sys_ipc_send_words does, then wait for a reply without pages as
+// sys_ipc_call does: one round trip of a small request.
+//
+// Returns as sys_ipc_call does, with its errors.
+static int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1 };
 
-		// Write permission, but src address is not writable
-		if ((perm & PTE_W) && !(*srcva_pte & PTE_W))
-			return -E_INVAL;
+	return ipc_call_blocking(envid, value, (void *) UTOP, 0, words, (void *) UTOP);
+}
 
-		// Send page
-		// Send page mapping if dest environment is recieving one
-		if ((uintptr_t) (dstenv->env_ipc_dstva) < UTOP)
-		{
-			ret = page_insert(dstenv->env_pgdir, pa2page(PTE_ADDR(*srcva_pte)), dstenv->env_ipc_dstva, perm);
-			if (ret < 0)
-				return ret;
-			dstenv->env_ipc_perm = perm;
-		}
-	} else
+// Reply to 'envid' and wait for the next request: the server's half of
+// sys_ipc_call, so that one round trip takes two system calls.
+// The reply is sent as sys_ipc_try_send sends, never blocking on a
+// client that is not waiting for it.  Then the caller waits as
+// sys_ipc_recv(dstva) does, handing the CPU to the client if no other
+// request is already queued.  As with sys_ipc_call, the request may
+// carry up to IPC_PERM_RECVPAGES(perm) pages.
+//
+// This only returns on error, or with 0 if a request was queued.
+// Errors are those of sys_ipc_try_send and sys_ipc_recv.  On error the
+// reply has not been sent and the caller is not waiting.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+				   void *dstva)
+{
+	unsigned npages = IPC_PERM_RECVPAGES(perm);
+	struct Env *dstenv;
+	int ret;
+
+	if (ipc_check_dstva(dstva, npages) < 0)
+		return -E_INVAL;
+	if ((ret = ipc_deliver(curenv, envid, value, srcva, perm, NULL, &dstenv)) < 0)
+		return ret;
+	return ipc_switch(dstenv, dstva, npages);
+}
+
+// Sleep until another environment rings our doorbell with
+// sys_ring_notify, provided the 32-bit word at 'addr' still holds 'val'.
+// This is the consumer half of a shared-memory ring (see lib/ring.c):
+// 'addr' is the ring's producer index and 'val' the value the consumer
+// last saw there.  The word is checked with the kernel locked, and
+// sys_ring_notify takes the same lock, so a producer that advances the
+// index and then rings cannot slip in between the check and the sleep.
+//
+// Returns 0 at once if *addr != val, otherwise 0 once woken.
+// The environment is destroyed if addr is not readable.
+static int
+sys_ring_wait(const uint32_t *addr, uint32_t val)
+{
+	user_mem_assert(curenv, addr, sizeof(*addr), PTE_U);
+	if (*(const volatile uint32_t *) addr != val)
+		return 0;
+	curenv->env_ring_waiting = true;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Take e off any page it is asleep on in sys_page_wait.
+static void
+ring_unwait(struct Env *e)
+{
+	if (e->env_wait_page)
 	{
-		dstenv->env_ipc_perm = 0;
+		e->env_wait_page->pp_waiters--;
+		e->env_wait_page = NULL;
 	}
+	e->env_ring_waiting = false;
+}
 
-	dstenv->env_ipc_recving = false;
-	dstenv->env_ipc_from = curenv->env_id;
-	dstenv->env_ipc_value = value;
+// Make e, asleep in sys_ring_wait or sys_page_wait, runnable again.
+static void
+ring_wake(struct Env *e)
+{
+	ring_unwait(e);
+	sched_enqueue(e);
+}
 
-	dstenv->env_tf.tf_regs.reg_eax = 0; // target env syscall returns with value 0
-	dstenv->env_status = ENV_RUNNABLE;
+// Wake 'envid' if it is sleeping in sys_ring_wait or sys_page_wait;
+// otherwise do nothing.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_ring_notify(envid_t envid)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	if (e->env_ring_waiting)
+	{
+		sched_note_peer(curenv, e);
+		ring_wake(e);
+	}
 	return 0;
 }
 
-// Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
-//
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// Sleep as in sys_ring_wait, but also until the page holding 'addr'
+// loses a mapping, provided it still has 'ref' of them.  A peer that
+// goes away, however it dies, unmaps the pages it shared, so a sleeper
+// that counts its peers by page references (lib/pipe.c) cannot miss
+// the last one leaving: one that left since it looked changes the
+// count, and one that leaves afterwards wakes it.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
-// Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+// Returns 0 at once if *addr != val or the page does not have 'ref'
+// references, otherwise 0 once woken.
+// The environment is destroyed if addr is not readable.
 static int
-sys_ipc_recv(void *dstva)
+sys_page_wait(const uint32_t *addr, uint32_t val, uint32_t ref)
 {
-	if ((size_t) dstva < UTOP && (size_t) dstva % PGSIZE != 0)
-		return -E_INVAL;
-	// Block until a value os ready
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	user_mem_assert(curenv, addr, sizeof(*addr), PTE_U);
+	pp = page_lookup(curenv->env_pgdir, (void *) addr, &pte);
+	// A superpage's mappings are not counted page by page: poll
+	if (*(const volatile uint32_t *) addr != val || (*pte & PTE_PS) ||
+		pp->pp_ref != ref)
+		return 0;
+	// Too many sleepers to count: let this one poll
+	if (pp->pp_waiters == 0xFF)
+		return 0;
+	pp->pp_waiters++;
+	curenv->env_wait_page = pp;
+	curenv->env_ring_waiting = true;
 	curenv->env_status = ENV_NOT_RUNNABLE;
-	curenv->env_ipc_recving = true;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Wake every environment asleep in sys_page_wait on page pp, which is
+// about to lose a reference.
+void
+page_wait_wake(struct PageInfo *pp)
+{
+	struct Env *e;
+
+	for (e = envs; e < envs + nenv && pp->pp_waiters > 0; e++)
+		if (e->env_wait_page == pp)
+			ring_wake(e);
+}
+
+// Called when e is freed, before its pages are unmapped.
+void
+ring_env_free(struct Env *e)
+{
+	ring_unwait(e);
+}
+
+// Block until receive queue 'queue' of the network card has a packet.
+// Returns 0 at once if one is already waiting, otherwise 0 once the
+// card's receive interrupt wakes us.  The packet may still have been
+// taken by someone else meanwhile, so callers must retry the receive.
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if there is no network card, or no such queue.
+static int
+sys_net_recv_wait(uint32_t queue)
+{
+	int r;
 
-	if ((size_t) dstva < UTOP)
-		curenv->env_ipc_dstva = dstva;
-//	cprintf("Sched yeilding!\n");
+	if ((r = e1000_recv_wait(queue, curenv->env_id)) != 0)
+		return r < 0 ? r : 0;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
 	sched_yield();
 }
 
+// Set and/or get the card's receive interrupt moderation.  If 'set' is
+// not NULL the card uses its settings from now on; if 'old' is not
+// NULL the settings in force before the call are stored there.
+// Latency-sensitive receivers want zeroes; a busy link wants longer
+// delays, so that ns_input finds many frames per wakeup.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no network card, or a setting is too large.
+// The environment is destroyed if 'set' is not readable or 'old' not
+// writable.
+static int
+sys_net_moderate(const struct NetModeration *set, struct NetModeration *old)
+{
+	if (set != NULL)
+		user_mem_assert(curenv, set, sizeof(*set), PTE_P | PTE_U);
+	if (old != NULL)
+		user_mem_assert(curenv, old, sizeof(*old), PTE_P | PTE_U | PTE_W);
+	return e1000_moderate(set, old);
+}
+
+// Store the network card's statistics counters and the state of its
+// rings in *st (see struct NetStats).
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no network card.
+// The environment is destroyed if st is not writable.
+static int
+sys_net_stats(struct NetStats *st)
+{
+	user_mem_assert(curenv, st, sizeof(*st), PTE_P | PTE_U | PTE_W);
+	return e1000_stats(st);
+}
+
+// Turn same-page merging on (enable > 0) or off (enable == 0), or
+// leave it as it is (enable < 0), and store its counters in *st unless
+// st is NULL (see kern/ksm.c).
+// Returns 0.  The environment is destroyed if st is not writable.
+static int
+sys_ksm(int enable, struct KsmStats *st)
+{
+	if (st != NULL)
+		user_mem_assert(curenv, st, sizeof(*st), PTE_P | PTE_U | PTE_W);
+	ksm_control(enable, st);
+	return 0;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -446,13 +2197,135 @@ sys_time_msec(void)
 	return time_msec();
 }
 
-// try transmit a packet
+// Store the number of microseconds since boot in *usec.
+// The TSC resolves time between timer ticks (see kern/time.c).
+//
+// Returns 0 on success, -E_FAULT if usec is not writable.
+static int
+sys_time_usec(uint64_t *usec)
+{
+	uint64_t now = time_usec();
+
+	return copyout(usec, &now, sizeof(now));
+}
+
+// try transmit a packet; -E_FAULT if the packet is not readable
 static int sys_try_transmit_packet(const uint8_t *packet_data, uint32_t packet_size)
 {
-	user_mem_assert(curenv, packet_data, packet_size, PTE_P | PTE_U);
+	e1000_tx_reclaim();
 	return e1000_try_transmit_packet(packet_data, packet_size);
 }
 
+// Most page-sized pieces of frames one zero-copy send hands the card;
+// room for a few TSO frames without a large kernel stack frame
+#define NET_MAXPIECES	64
+
+// Queue the frames in 'bufs' for a zero-copy send, cutting each into
+// one piece per page it touches; see sys_net_transmit_batch.
+static int
+net_transmit(const struct NetBuf *bufs, size_t n, uint32_t *ndone)
+{
+	struct PageInfo *pps[NET_MAXPIECES];
+	struct NetBuf pieces[NET_MAXPIECES];
+	uintptr_t va, end;
+	size_t i, np, first;
+	pte_t *pte;
+	int r;
+
+	user_mem_assert(curenv, ndone, sizeof(uint32_t), PTE_P | PTE_U | PTE_W);
+	e1000_tx_reclaim();
+	*ndone = curenv->env_net_tx_done;
+	curenv->env_net_tx_done = 0;
+	if (n == 0)
+		return 0;
+
+	for (i = np = 0; i < n; i++)
+	{
+		uint32_t maxlen = (bufs[i].flags & NETBUF_TX_TSO) ?
+						  NET_TSO_MAXLEN : MAX_ETHERNET_PACKET_SIZE;
+
+		if (bufs[i].len == 0 || bufs[i].len > maxlen || bufs[i].data >= UTOP ||
+			UTOP - bufs[i].data < bufs[i].len)
+			return -E_INVAL;
+		// Leave frames that don't fit for the next call
+		if (np + ROUNDUP(PGOFF(bufs[i].data) + bufs[i].len, PGSIZE) / PGSIZE > NET_MAXPIECES)
+			break;
+
+		first = np;
+		for (va = bufs[i].data, end = va + bufs[i].len; va < end;
+			 va = ROUNDDOWN(va, PGSIZE) + PGSIZE, np++)
+		{
+			pps[np] = page_lookup(curenv->env_pgdir, (void *) va, &pte);
+			if (pps[np] == NULL || (*pte & (PTE_U | PTE_PS)) != PTE_U)
+				return -E_INVAL;
+			pieces[np].data = PGOFF(va);
+			pieces[np].len = MIN(end, ROUNDDOWN(va, PGSIZE) + PGSIZE) - va;
+			pieces[np].flags = E1000_TX_MORE;
+		}
+		pieces[first].flags |= bufs[i].flags & ~E1000_TX_MORE;
+		pieces[np - 1].flags &= ~E1000_TX_MORE;
+
+		if ((bufs[i].flags & NETBUF_TX_TSO) &&
+			(NETBUF_MSS(bufs[i].flags) == 0 ||
+			 (r = e1000_tso_hdrlen((uint8_t *) page_kmap(pps[first], KMAP_SRC) +
+								   pieces[first].data,
+								   pieces[first].len)) < 0 ||
+			 (uint32_t) r >= bufs[i].len))
+			return -E_INVAL;
+	}
+	if ((r = e1000_transmit_pages(pps, pieces, np, curenv->env_id)) == 0)
+		return -E_NET_QUEUE_FULL;
+	return r;
+}
+
+// Transmit the 'packet_size' bytes at 'packet_data' straight from the
+// caller's pages: the card reads them by DMA, so the pages stay pinned
+// (and must not be rewritten) until the card is done.  Whether or not it sends a frame,
+// this stores in *ndone how many of the caller's earlier zero-copy
+// frames have completed since the last call; they complete in the
+// order they were sent.  A packet_size of 0 only collects *ndone.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the frame is empty or too large, or is not in user
+//		pages of the caller's (superpages are not supported).
+//	-E_NET_QUEUE_FULL if the transmit ring is full.
+// The environment is destroyed if ndone is not writable.
+static int
+sys_net_transmit_page(const void *packet_data, uint32_t packet_size, uint32_t *ndone)
+{
+	struct NetBuf buf = {(uintptr_t) packet_data, packet_size, 0};
+	int r;
+
+	r = net_transmit(&buf, packet_size != 0, ndone);
+	return r < 0 ? r : 0;
+}
+
+// Like sys_net_transmit_page, but for the 'n' frames described by
+// 'bufs', all queued under one write of the card's TDT register.
+// Frames are queued in order until the transmit ring fills.  The card
+// fills in the TCP or UDP checksum of frames flagged NETBUF_TX_L4CSUM,
+// and cuts frames flagged NETBUF_TX_TSO, which may be as large as
+// NET_TSO_MAXLEN, into TCP segments.
+//
+// Returns the number of frames queued, or < 0 on error.  Errors are:
+//	-E_INVAL if n > NET_MAXBATCH, or any frame is unusable as for
+//		sys_net_transmit_page or is a TSO frame without an MSS or
+//		IPv4 and TCP headers in its first page (then none is queued).
+//	-E_FAULT if bufs is not readable.
+//	-E_NET_QUEUE_FULL if the transmit ring is full.
+// The environment is destroyed if ndone is not writable.
+static int
+sys_net_transmit_batch(const struct NetBuf *bufs, size_t n, uint32_t *ndone)
+{
+	struct NetBuf kbufs[NET_MAXBATCH];
+
+	if (n > NET_MAXBATCH)
+		return -E_INVAL;
+	if (copyin(kbufs, bufs, n * sizeof(*bufs)) < 0)
+		return -E_FAULT;
+	return net_transmit(kbufs, n, ndone);
+}
+
 // try recv a packet
 static int sys_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_size)
 {
@@ -463,6 +2336,216 @@ static int sys_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *
 }
 
 
+// Receive up to 'n' frames from receive queue 'queue' (see struct
+// NetStats for how many the card has) with one system call, copying frame i into
+// the buffer of bufs[i].len bytes at bufs[i].data and storing its
+// length in bufs[i].len and its NETBUF_RX_* flags in bufs[i].flags.  The descriptors are handed back to the card
+// with a single write of its RDT register.  This touches nothing but
+// the caller and the receive ring, so it also runs without the kernel
+// lock (see syscall_unlocked).
+//
+// Returns the number of frames received, or < 0 on error.  Errors are:
+//	-E_INVAL if n > NET_MAXBATCH, there is no such queue, or the first
+//		frame doesn't fit bufs[0] (whose len is then set to the
+//		frame's length).
+//	-E_FAULT if bufs or the first buffer is not writable; a later
+//		buffer that is not ends the batch before its frame.
+//	-E_NET_QUEUE_EMPTY if no frame has arrived.
+static int
+sys_net_recv_batch(struct NetBuf *bufs, size_t n, uint32_t queue)
+{
+	struct NetBuf kbufs[NET_MAXBATCH];
+	size_t i;
+	int r;
+
+	if (n > NET_MAXBATCH)
+		return -E_INVAL;
+	// Writing bufs back as it is proves it writable before any frame
+	// is taken off the ring; another CPU may still unmap it after, but
+	// then the copyout below just fails.
+	if (copyin(kbufs, bufs, n * sizeof(*bufs)) < 0 ||
+		copyout(bufs, kbufs, n * sizeof(*bufs)) < 0)
+		return -E_FAULT;
+
+	r = e1000_recv_batch(queue, kbufs, n);
+	if (r > 0 || r == -E_INVAL)
+		for (i = 0; i < (r > 0 ? (size_t) r : 1); i++)
+		{
+			kbufs[i].flags = r > 0 ? kbufs[i].flags : 0;
+			if (copyout(&bufs[i].len, &kbufs[i].len, sizeof(kbufs[i].len)) < 0 ||
+				copyout(&bufs[i].flags, &kbufs[i].flags, sizeof(kbufs[i].flags)) < 0)
+				return -E_FAULT;
+		}
+	return r;
+}
+
+// Receive a packet from receive queue 'queue' without copying it: the
+// page the card received it into is mapped at 'va' with PTE_P | PTE_U | PTE_W, replacing whatever
+// was there.  The frame starts E1000_RX_PAGE_OFFSET bytes into the page;
+// its address, length and NETBUF_RX_* flags are stored in *buf.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP or va is not page-aligned, there is no such
+//		queue, or the card takes frames too big for a page (NET_MTU
+//		is a jumbo MTU).
+//	-E_NET_QUEUE_EMPTY if no packet has arrived.
+//	-E_NO_MEM if there's no memory to replace the page or for a page table.
+// The environment is destroyed if buf is not writable.
+static int
+sys_net_recv_page(void *va, struct NetBuf *buf, uint32_t queue)
+{
+	int r;
+
+	user_mem_assert(curenv, buf, sizeof(*buf), PTE_P | PTE_U | PTE_W);
+	if ((uintptr_t) va >= UTOP || PGOFF(va) != 0)
+		return -E_INVAL;
+	r = e1000_recv_page(queue, curenv->env_pgdir, va, PTE_P | PTE_U | PTE_W,
+						&buf->len, &buf->flags);
+	if (r == 0)
+		buf->data = (uintptr_t) va + E1000_RX_PAGE_OFFSET;
+	return r;
+}
+
+// Handle the system call in 'tf' without kernel_lock, if it is one of the
+// calls that touch nothing but the caller, the console and the e1000
+// rings (each of which has its own lock).  These dominate the NS
+// helpers' polling loops, so they must not serialize with other CPUs.
+//
+// Returns true if the call was handled and tf holds its return value.
+// Returns false if it must take the locked path through syscall(),
+// e.g. because a user buffer failed its check -- syscall() will then
+// repeat the check and destroy the caller.  Nothing here has side
+// effects before its checks pass, so repeating is safe.
+bool
+syscall_unlocked(struct Trapframe *tf)
+{
+	uint32_t a1 = tf->tf_regs.reg_edx;
+	uint32_t a2 = tf->tf_regs.reg_ecx;
+	uint32_t a3 = tf->tf_regs.reg_ebx;
+	uint32_t syscallno = tf->tf_regs.reg_eax;
+	uint32_t size;
+	int32_t ret;
+
+	switch (syscallno)
+	{
+		case SYS_getenvid:
+			ret = sys_getenvid();
+			break;
+		case SYS_time_msec:
+			ret = sys_time_msec();
+			break;
+		case SYS_time_usec:
+			// A copy-on-write usec fails here, with no kernel lock
+			if ((ret = sys_time_usec((uint64_t *) a1)) == -E_FAULT)
+				return false;
+			break;
+		case SYS_cputs:
+			if (user_mem_check(curenv, (const void *) a1, a2, PTE_U) < 0)
+				return false;
+			ret = cputs_user((const char *) a1, a2);
+			break;
+		case SYS_try_transmit_packet:
+			if (e1000_tx_pinned())
+				return false;
+			ret = e1000_try_transmit_packet((const uint8_t *) a1, a2);
+			break;
+		case SYS_try_recv_packet:
+			// As in sys_net_recv_batch, prove the size writable before
+			// a frame is taken; a buffer still copy-on-write fails
+			// here, and the frame stays on the ring
+			if (copyin(&size, (const void *) a3, sizeof(size)) < 0 ||
+				copyout((void *) a3, &size, sizeof(size)) < 0 ||
+				(ret = e1000_try_recv_packet((uint8_t *) a1, a2, (uint32_t *) a3)) == -E_FAULT)
+				return false;
+			break;
+		case SYS_net_recv_batch:
+			// A buffer still copy-on-write fails its check here
+			if ((ret = sys_net_recv_batch((struct NetBuf *) a1, a2, a3)) == -E_FAULT)
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	tf->tf_regs.reg_eax = ret;
+	trace_event(TRACE_SYSCALL_EXIT, syscallno, ret, 0, 0);
+	sysstat_exit(syscallno);
+	return true;
+}
+
+// The system calls a ring may queue: those that never block or switch
+// environments, so a batch always runs to its end.
+static const bool sysring_ok[NSYSCALLS] = {
+	[SYS_getenvid] = true,
+	[SYS_page_alloc] = true,
+	[SYS_page_map] = true,
+	[SYS_page_unmap] = true,
+	[SYS_page_map_batch] = true,
+	[SYS_ipc_try_send] = true,
+	[SYS_ring_notify] = true,
+	[SYS_futex_wake] = true,
+	[SYS_notify] = true,
+	[SYS_time_msec] = true,
+	[SYS_time_usec] = true,
+	[SYS_try_transmit_packet] = true,
+	[SYS_try_recv_packet] = true,
+	[SYS_net_transmit_batch] = true,
+	[SYS_net_recv_batch] = true,
+};
+
+// Run the system calls queued on the ring at 'ring' in order, posting
+// each one's result, until the submission queue is empty or the
+// completion queue full.  A call sysring_ok does not list completes
+// with -E_INVAL.  One trap thus pays for a whole batch of the small
+// calls the servers make per request.
+//
+// The ring is written through the kernel's mapping of its page, which
+// it holds a reference to meanwhile, so a queued call that unmaps it
+// does no harm.
+//
+// Returns the number of calls run, < 0 on error.  Errors are:
+//	-E_INVAL if ring is not page-aligned, or is not mapped writable in
+//		a 4KB page (a copy-on-write page must be written to first).
+static int
+sys_enter_ring(struct SysRing *uring)
+{
+	struct SysRing *ring;
+	struct SysRingEntry sqe;
+	struct SysRingResult *cqe;
+	struct PageInfo *pp;
+	pte_t *pte;
+	uint32_t head, tail;
+	int n = 0;
+
+	static_assert(sizeof(struct SysRing) <= PGSIZE);
+	if ((uintptr_t) uring >= UTOP || PGOFF(uring) != 0 ||
+		page_cow_break(curenv->env_pgdir, uring) < 0 ||
+		!(pp = page_lookup(curenv->env_pgdir, uring, &pte)) ||
+		(*pte & (PTE_U | PTE_W | PTE_PS)) != (PTE_U | PTE_W))
+		return -E_INVAL;
+	pp->pp_ref++;
+	ring = page_kmap(pp, KMAP_RING);
+
+	head = ring->sq_head;
+	tail = ring->sq_tail;
+	while (head != tail && ring->cq_tail - ring->cq_head < SYSRING_SIZE)
+	{
+		sqe = ring->sq[head % SYSRING_SIZE];
+		cqe = &ring->cq[ring->cq_tail % SYSRING_SIZE];
+		if (sqe.sqe_syscall < NSYSCALLS && sysring_ok[sqe.sqe_syscall])
+			cqe->cqe_result = syscall(sqe.sqe_syscall, sqe.sqe_arg[0], sqe.sqe_arg[1],
+									  sqe.sqe_arg[2], sqe.sqe_arg[3], sqe.sqe_arg[4]);
+		else
+			cqe->cqe_result = -E_INVAL;
+		cqe->cqe_user = sqe.sqe_user;
+		ring->cq_tail++;
+		ring->sq_head = ++head;
+		n++;
+	}
+
+	page_decref(pp);
+	return n;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -516,8 +2599,17 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_ipc_try_send:
 			retvalue = (uint32_t) sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned int) a4);
 			break;
+		case SYS_ipc_send:
+			retvalue = (uint32_t) sys_ipc_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned int) a4);
+			break;
 		case SYS_ipc_recv:
-			retvalue = (uint32_t) sys_ipc_recv((void *) a1);
+			retvalue = (uint32_t) sys_ipc_recv((void *) a1, a2);
+			break;
+		case SYS_ipc_call:
+			retvalue = (uint32_t) sys_ipc_call((envid_t) a1, a2, (void *) a3, (unsigned) a4, (void *) a5);
+			break;
+		case SYS_ipc_reply_wait:
+			retvalue = (uint32_t) sys_ipc_reply_wait((envid_t) a1, a2, (void *) a3, (unsigned) a4, (void *) a5);
 			break;
 		case SYS_time_msec:
 			retvalue = sys_time_msec();
@@ -528,6 +2620,150 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_try_recv_packet:
 			retvalue = sys_try_recv_packet((uint8_t *) a1, a2, (uint32_t *) a3);
 			break;
+		case SYS_env_set_weight:
+			retvalue = (uint32_t) sys_env_set_weight((envid_t) a1, a2);
+			break;
+		case SYS_env_set_affinity:
+			retvalue = (uint32_t) sys_env_set_affinity((envid_t) a1, a2);
+			break;
+		case SYS_fork_cow:
+			retvalue = (uint32_t) sys_fork_cow();
+			break;
+		case SYS_page_map_batch:
+			retvalue = (uint32_t) sys_page_map_batch((envid_t) a1, (envid_t) a2,
+													 (const struct PageMapOp *) a3, a4, (size_t *) a5);
+			break;
+		case SYS_time_usec:
+			retvalue = (uint32_t) sys_time_usec((uint64_t *) a1);
+			break;
+		case SYS_ring_wait:
+			retvalue = (uint32_t) sys_ring_wait((const uint32_t *) a1, a2);
+			break;
+		case SYS_ring_notify:
+			retvalue = (uint32_t) sys_ring_notify((envid_t) a1);
+			break;
+		case SYS_net_recv_wait:
+			retvalue = (uint32_t) sys_net_recv_wait(a1);
+			break;
+		case SYS_net_recv_page:
+			retvalue = (uint32_t) sys_net_recv_page((void *) a1, (struct NetBuf *) a2, a3);
+			break;
+		case SYS_net_transmit_page:
+			retvalue = (uint32_t) sys_net_transmit_page((const void *) a1, a2, (uint32_t *) a3);
+			break;
+		case SYS_net_recv_batch:
+			retvalue = (uint32_t) sys_net_recv_batch((struct NetBuf *) a1, a2, a3);
+			break;
+		case SYS_net_transmit_batch:
+			retvalue = (uint32_t) sys_net_transmit_batch((const struct NetBuf *) a1, a2, (uint32_t *) a3);
+			break;
+		case SYS_net_moderate:
+			retvalue = (uint32_t) sys_net_moderate((const struct NetModeration *) a1,
+												   (struct NetModeration *) a2);
+			break;
+		case SYS_net_stats:
+			retvalue = (uint32_t) sys_net_stats((struct NetStats *) a1);
+			break;
+		case SYS_page_paddr:
+			retvalue = (uint32_t) sys_page_paddr((const void *) a1, a2, (physaddr_t *) a3);
+			break;
+		case SYS_irq_ipc:
+			retvalue = (uint32_t) sys_irq_ipc(a1, a2);
+			break;
+		case SYS_blk_info:
+			retvalue = (uint32_t) sys_blk_info(a1, (struct BlkInfo *) a2);
+			break;
+		case SYS_blk_submit:
+			retvalue = (uint32_t) sys_blk_submit(a1, a2, (const void *) a3, a4, a5);
+			break;
+		case SYS_blk_reap:
+			retvalue = (uint32_t) sys_blk_reap((struct BlkDone *) a1, a2);
+			break;
+		case SYS_page_wait:
+			retvalue = (uint32_t) sys_page_wait((const uint32_t *) a1, a2, a3);
+			break;
+		case SYS_futex_wait:
+			retvalue = (uint32_t) futex_wait((const uint32_t *) a1, a2, a3);
+			break;
+		case SYS_futex_wake:
+			retvalue = (uint32_t) futex_wake((const uint32_t *) a1, a2);
+			break;
+		case SYS_env_wait:
+			retvalue = (uint32_t) sys_env_wait((envid_t) a1);
+			break;
+		case SYS_exofork_shared:
+			retvalue = (uint32_t) sys_exofork_shared(a1, a2, a3);
+			break;
+		case SYS_page_cow_resolve:
+			retvalue = (uint32_t) sys_page_cow_resolve((void *) a1);
+			break;
+		case SYS_env_set_cow_upcall:
+			retvalue = (uint32_t) sys_env_set_cow_upcall((envid_t) a1, a2);
+			break;
+		case SYS_service_register:
+			retvalue = (uint32_t) sys_service_register((envid_t) a1, (const char *) a2, a3);
+			break;
+		case SYS_trace_read:
+			retvalue = (uint32_t) sys_trace_read(a1, (uint32_t *) a2, (struct TraceEvent *) a3, a4);
+			break;
+		case SYS_prof_ctl:
+			retvalue = (uint32_t) sys_prof_ctl(a1);
+			break;
+		case SYS_prof_report:
+			retvalue = (uint32_t) sys_prof_report((struct ProfReport *) a1);
+			break;
+		case SYS_pmc_set:
+			retvalue = (uint32_t) sys_pmc_set(a1, (const uint32_t *) a2, a3);
+			break;
+		case SYS_sysstat_reset:
+			retvalue = (uint32_t) sys_sysstat_reset(a1);
+			break;
+		case SYS_sysstat_read:
+			retvalue = (uint32_t) sys_sysstat_read(a1, (struct SysStatReport *) a2);
+			break;
+		case SYS_enter_ring:
+			retvalue = (uint32_t) sys_enter_ring((struct SysRing *) a1);
+			break;
+		case SYS_notify:
+			retvalue = (uint32_t) sys_notify((envid_t) a1, a2);
+			break;
+		case SYS_wait_notify:
+			retvalue = (uint32_t) sys_wait_notify(a1, a2);
+			break;
+		case SYS_irq_notify:
+			retvalue = (uint32_t) sys_irq_notify(a1, a2);
+			break;
+		case SYS_ipc_send_words:
+			retvalue = (uint32_t) sys_ipc_send_words((envid_t) a1, a2, a3, a4);
+			break;
+		case SYS_ipc_call_words:
+			retvalue = (uint32_t) sys_ipc_call_words((envid_t) a1, a2, a3, a4);
+			break;
+		case SYS_ipc_recv_timeout:
+			retvalue = (uint32_t) sys_ipc_recv_timeout((void *) a1, a2, a3);
+			break;
+		case SYS_sleep:
+			retvalue = (uint32_t) sys_sleep(a1);
+			break;
+		case SYS_ipc_recv_from:
+			retvalue = (uint32_t) sys_ipc_recv_from((void *) a1, a2, (envid_t) a3, a4);
+			break;
+		case SYS_reclaim_notify:
+			retvalue = (uint32_t) sys_reclaim_notify(a1);
+			break;
+		case SYS_shlib_map:
+			retvalue = (uint32_t) sys_shlib_map((envid_t) a1);
+			break;
+		case SYS_spawn:
+			retvalue = (uint32_t) sys_spawn((const void *) a1, a2,
+											(const char *const *) a3);
+			break;
+		case SYS_cons_read:
+			retvalue = (uint32_t) sys_cons_read((void *) a1, a2, a3);
+			break;
+		case SYS_ksm:
+			retvalue = (uint32_t) sys_ksm(a1, (struct KsmStats *) a2);
+			break;
 
 		default:
 			return -E_INVAL;
@@ -5,7 +5,17 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/trap.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+bool syscall_unlocked(struct Trapframe *tf);
+
+struct Env;
+struct PageInfo;
+void ipc_env_free(struct Env *e);
+void ring_env_free(struct Env *e);
+void page_wait_wake(struct PageInfo *pp);
+bool irq_ipc_intr(uint32_t trapno);
+bool irq_ipc_waiter(struct Env *e);
 
 #endif /* !JOS_KERN_SYSCALL_H */
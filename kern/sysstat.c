@@ -0,0 +1,241 @@
+// System call statistics: how often each system call is made, and a
+// histogram of how many TSC cycles it takes, from the kernel's entry
+// in trap() to its return to the caller.  Each CPU counts into a table
+// of its own, thiscpu->cpu_sysstat, with interrupts off, so counting
+// takes no lock - system calls that run without the big kernel lock
+// (see syscall_unlocked) are counted too.  Readers add the tables up,
+// and may race a CPU that is counting; the totals are statistics.
+//
+// sysstat_reset can narrow the counting down to one environment.
+//
+// The same histograms time how long environments wait on a run queue:
+// the scheduler calls sysstat_runnable when an environment becomes
+// runnable and env_run calls sysstat_running when it gets a CPU.  Each
+// environment keeps its own waits in env_runwait, and each CPU those
+// that ended on it in cpu_runwait.
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+
+#include <kern/sysstat.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+
+#define SYSSTAT_ORDER   1       // each CPU's table is 2^SYSSTAT_ORDER pages
+
+static envid_t sysstat_env;     // Environment counted, or 0 for all
+
+// Give each CPU mp_init found a table.
+void
+sysstat_init(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	static_assert(NSYSCALLS <= SYSSTAT_NSYSCALL);
+	static_assert(SYSSTAT_NSYSCALL * sizeof(struct SysStat) <= PGSIZE << SYSSTAT_ORDER);
+	for (i = 0; i < ncpu; i++)
+	{
+		if (!(pp = page_alloc_order(SYSSTAT_ORDER, ALLOC_ZERO)))
+		{
+			cprintf("sysstat: no memory for CPU %d's table\n", i);
+			continue;
+		}
+		pp->pp_ref++;
+		cpus[i].cpu_sysstat = page2kva(pp);
+	}
+}
+
+// curenv is entering system call syscallno on this CPU.
+void
+sysstat_enter(uint32_t syscallno)
+{
+	struct CpuInfo *c = thiscpu;
+
+	c->cpu_sysstat_tsc = 0;
+	if (!c->cpu_sysstat || syscallno >= SYSSTAT_NSYSCALL ||
+		(sysstat_env && curenv->env_id != sysstat_env))
+		return;
+	c->cpu_sysstat[syscallno].ss_calls++;
+	c->cpu_sysstat_tsc = read_tsc();
+}
+
+// The system call sysstat_enter saw is returning to curenv.
+void
+sysstat_exit(uint32_t syscallno)
+{
+	struct CpuInfo *c = thiscpu;
+	uint64_t cycles;
+
+	if (c->cpu_sysstat_tsc == 0 || syscallno >= SYSSTAT_NSYSCALL)
+		return;
+	cycles = read_tsc() - c->cpu_sysstat_tsc;
+	c->cpu_sysstat_tsc = 0;
+	sysstat_count(&c->cpu_sysstat[syscallno], cycles);
+}
+
+// e is becoming runnable: start timing its wait for a CPU, unless it
+// is already waiting.
+void
+sysstat_runnable(struct Env *e)
+{
+	if (e->env_runnable_tsc != 0)
+		return;
+	e->env_runnable_tsc = read_tsc();
+	e->env_runwait.ss_calls++;
+	if (!sysstat_env || e->env_id == sysstat_env)
+		thiscpu->cpu_runwait.ss_calls++;
+}
+
+// e is about to run on this CPU.  Count the wait sysstat_runnable
+// started, if any, and return its length in TSC cycles.
+uint64_t
+sysstat_running(struct Env *e)
+{
+	uint64_t cycles;
+
+	if (e->env_runnable_tsc == 0)
+		return 0;
+	cycles = read_tsc() - e->env_runnable_tsc;
+	e->env_runnable_tsc = 0;
+	sysstat_count(&e->env_runwait, cycles);
+	if (!sysstat_env || e->env_id == sysstat_env)
+		sysstat_count(&thiscpu->cpu_runwait, cycles);
+	return cycles;
+}
+
+// Start counting afresh, only envid's system calls, or everyone's if
+// envid is 0.
+void
+sysstat_reset(envid_t envid)
+{
+	int i;
+
+	sysstat_env = envid;
+	for (i = 0; i < ncpu; i++)
+	{
+		if (cpus[i].cpu_sysstat)
+			memset(cpus[i].cpu_sysstat, 0, SYSSTAT_NSYSCALL * sizeof(struct SysStat));
+		memset(&cpus[i].cpu_runwait, 0, sizeof(cpus[i].cpu_runwait));
+	}
+}
+
+// Add the counts in src to dst.
+static void
+sysstat_add(struct SysStat *dst, const struct SysStat *src)
+{
+	uint32_t b;
+
+	dst->ss_calls += src->ss_calls;
+	dst->ss_returns += src->ss_returns;
+	dst->ss_cycles += src->ss_cycles;
+	for (b = 0; b < SYSSTAT_NBUCKET; b++)
+		dst->ss_hist[b] += src->ss_hist[b];
+}
+
+// Fill in *r with CPU cpu's statistics, or every CPU's added up if cpu
+// is -1.  Returns 0 on success, -E_INVAL if there is no such CPU.
+int
+sysstat_read(int cpu, struct SysStatReport *r)
+{
+	struct SysStat *src;
+	int i, lo = cpu, hi = cpu + 1;
+	uint32_t j;
+
+	if (cpu == -1)
+	{
+		lo = 0;
+		hi = ncpu;
+	} else if (cpu < 0 || cpu >= ncpu)
+		return -E_INVAL;
+
+	memset(r, 0, sizeof(*r));
+	r->sr_env = sysstat_env;
+	for (i = lo; i < hi; i++)
+	{
+		sysstat_add(&r->sr_runwait, &cpus[i].cpu_runwait);
+		if (!(src = cpus[i].cpu_sysstat))
+			continue;
+		r->sr_ncpu++;
+		for (j = 0; j < SYSSTAT_NSYSCALL; j++)
+			sysstat_add(&r->sr_calls[j], &src[j]);
+	}
+	return 0;
+}
+
+// Print the statistics of CPU cpu, or of all of them if cpu is -1, for
+// the monitor's "sysstat" command.
+void
+sysstat_print(int cpu)
+{
+	static struct SysStatReport r;
+	struct SysStat *ss;
+	int ret;
+	uint32_t i;
+
+	if ((ret = sysstat_read(cpu, &r)) < 0)
+	{
+		cprintf("sysstat: %e\n", ret);
+		return;
+	}
+	if (r.sr_env)
+		cprintf("environment %08x only\n", r.sr_env);
+	cprintf("%4s %10s %10s %10s %10s %10s\n", "sys", "calls", "returns", "avg", "p50<", "p99<");
+	for (i = 0; i < SYSSTAT_NSYSCALL; i++)
+	{
+		ss = &r.sr_calls[i];
+		if (ss->ss_calls == 0)
+			continue;
+		cprintf("%4u %10u %10u %10llu %10llu %10llu\n", i, ss->ss_calls, ss->ss_returns,
+				ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0,
+				sysstat_percentile(ss, 50), sysstat_percentile(ss, 99));
+	}
+}
+
+// Print the rest of a line of run queue waits for sysstat_runwait_print.
+static void
+sysstat_runwait_line(const struct SysStat *ss)
+{
+	cprintf(" %10u %10u %10llu %10llu %10llu\n", ss->ss_calls, ss->ss_returns,
+			ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0,
+			sysstat_percentile(ss, 50), sysstat_percentile(ss, 99));
+}
+
+// Print how long environments waited on run queues, for the monitor's
+// "runwait" command: each CPU's waits and their total, or environment
+// envid's alone if envid is not 0.
+void
+sysstat_runwait_print(envid_t envid)
+{
+	static struct SysStat total;
+	struct Env *e = NULL;
+	int i;
+
+	if (envid && envid2env(envid, &e, false) < 0)
+	{
+		cprintf("runwait: no environment %08x\n", envid);
+		return;
+	}
+	cprintf("%-8s %10s %10s %10s %10s %10s\n", "", "runnable", "ran", "avg", "p50<", "p99<");
+	if (e)
+	{
+		cprintf("%08x", e->env_id);
+		sysstat_runwait_line(&e->env_runwait);
+		return;
+	}
+	if (sysstat_env)
+		cprintf("environment %08x only\n", sysstat_env);
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < ncpu; i++)
+	{
+		cprintf("cpu %-4d", i);
+		sysstat_runwait_line(&cpus[i].cpu_runwait);
+		sysstat_add(&total, &cpus[i].cpu_runwait);
+	}
+	cprintf("%-8s", "all");
+	sysstat_runwait_line(&total);
+}
@@ -0,0 +1,20 @@
+#ifndef JOS_KERN_SYSSTAT_H
+#define JOS_KERN_SYSSTAT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/sysstat.h>
+#include <inc/env.h>
+
+void sysstat_init(void);
+void sysstat_enter(uint32_t syscallno);
+void sysstat_exit(uint32_t syscallno);
+void sysstat_runnable(struct Env *e);
+uint64_t sysstat_running(struct Env *e);
+void sysstat_reset(envid_t envid);
+int sysstat_read(int cpu, struct SysStatReport *r);
+void sysstat_print(int cpu);
+void sysstat_runwait_print(envid_t envid);
+
+#endif /* !JOS_KERN_SYSSTAT_H */
@@ -1,22 +1,82 @@
-#include <kern/time.h>
+#include <inc/x86.h>
 #include <inc/assert.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/pmc.h>
+#include <kern/kvm.h>
 
 static unsigned int ticks;
+static uint64_t boot_ns;	// kvm_clock_ns() at time_init
+
+struct Uinfo *uinfo;
+uint32_t tsc_khz;	// Set by lapic_init() on the boot CPU
 
 void
 time_init(void)
 {
+	uint32_t khz;
+
+	static_assert(UINFO_NCPU >= NCPU);
+
+	// kvmclock knows the TSC rate exactly; the PIT only estimates it.
+	if ((khz = kvm_tsc_khz()) != 0)
+		tsc_khz = khz;
+	if (kvm_clock_ok())
+		boot_ns = kvm_clock_ns();
+
 	ticks = 0;
+	uinfo->ncpu = ncpu;
+	uinfo->tsc_khz = tsc_khz;
+	uinfo->tick_tsc = read_tsc();
+	uinfo->pmc_ncounters = pmc_ncounters;
+	uinfo->pmc_width = pmc_width;
 }
 
 // This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// fires every 10 ms on every CPU, but only the boot CPU advances the
+// clock.  'busy' says whether the interrupt found an environment running.
+// Returns true if the hypervisor ran something else for most of the
+// tick, so whatever was running here hardly got it.
+bool
+time_tick(bool busy)
 {
+	struct UinfoCpu *uc = &uinfo->cpus[cpunum()];
+	bool stolen = kvm_steal_ns() >= UINFO_TICK_USEC * 1000 / 2;
+
+	uc->runq_len = thiscpu->cpu_runq_len;
+	if (busy)
+		uc->busy_ticks++;
+	else
+		uc->idle_ticks++;
+	if (stolen)
+		uc->steal_ticks++;
+
+	if (thiscpu != bootcpu)
+		return stolen;
+
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+
+	uinfo->seq++;
+	barrier();
+	uinfo->tick_tsc = read_tsc();
+	uinfo->ticks = ticks;
+	barrier();
+	uinfo->seq++;
+	return stolen;
+}
+
+// Account for the ticks this CPU slept through with its timer stopped,
+// which began when the TSC read halt_tsc.
+void
+time_idle(uint64_t halt_tsc)
+{
+	uint64_t tsc_per_tick = (uint64_t) tsc_khz * (UINFO_TICK_USEC / 1000);
+
+	if (tsc_per_tick != 0)
+		uinfo->cpus[cpunum()].idle_ticks +=
+			(read_tsc() - halt_tsc) / tsc_per_tick;
 }
 
 unsigned int
@@ -24,3 +84,13 @@ time_msec(void)
 {
 	return ticks * 10;
 }
+
+// Microseconds since time_init: from kvmclock where there is one, which
+// is not bound to the tick, else from the info page.
+uint64_t
+time_usec(void)
+{
+	if (kvm_clock_ok())
+		return (kvm_clock_ns() - boot_ns) / 1000;
+	return uinfo_usec(uinfo);
+}
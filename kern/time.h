@@ -4,8 +4,17 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/uinfo.h>
+
+// Kernel info page, mapped read-only for users at UINFO
+extern struct Uinfo *uinfo;
+// TSC cycles per millisecond, or 0 if the TSC could not be calibrated
+extern uint32_t tsc_khz;
+
 void time_init(void);
-void time_tick(void);
+bool time_tick(bool busy);
+void time_idle(uint64_t halt_tsc);
 unsigned int time_msec(void);
+uint64_t time_usec(void);
 
 #endif /* JOS_KERN_TIME_H */
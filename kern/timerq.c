@@ -0,0 +1,77 @@
+// The timer queue: environments blocked until a deadline, in
+// sys_sleep or a timed sys_ipc_recv_timeout, soonest deadline first.
+// The boot CPU, whose timer keeps ticking while it idles, looks at the
+// head of the queue on every tick and wakes whoever is due, so a
+// deadline is met to within a tick.  Anything else that wakes a
+// sleeper first (a message for a timed receive, its own death) takes
+// it off the queue.  All of this is protected by the big kernel lock.
+//
+// Futex waits keep their own deadlines (see kern/futex.c).
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/timerq.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+
+static struct Env *timerq;
+
+// Block e, which is ENV_NOT_RUNNABLE or about to be, until 'msec'
+// milliseconds from now at the latest.
+void
+timerq_add(struct Env *e, uint32_t msec)
+{
+	struct Env **pp;
+
+	assert(!e->env_timer_deadline);
+	// 0 means no deadline, so a deadline of 0 becomes 1
+	e->env_timer_deadline = (time_msec() + msec) | 1;
+	for (pp = &timerq; *pp; pp = &(*pp)->env_timer_next)
+		if ((int32_t) (e->env_timer_deadline - (*pp)->env_timer_deadline) < 0)
+			break;
+	e->env_timer_next = *pp;
+	*pp = e;
+}
+
+// Take e off the queue, if it is on it.
+void
+timerq_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_timer_deadline)
+		return;
+	for (pp = &timerq; *pp != e; pp = &(*pp)->env_timer_next)
+		/* do nothing */;
+	*pp = e->env_timer_next;
+	e->env_timer_next = NULL;
+	e->env_timer_deadline = 0;
+}
+
+// Called on every tick of the boot CPU's clock: wake the environments
+// whose deadline has passed.  A receive that times out fails with
+// -E_TIMEOUT; a sleep returns 0.
+void
+timerq_tick(void)
+{
+	struct Env *e;
+	uint32_t now;
+
+	if (!timerq)
+		return;
+	now = time_msec();
+	while ((e = timerq) && (int32_t) (now - e->env_timer_deadline) >= 0)
+	{
+		timerq = e->env_timer_next;
+		e->env_timer_next = NULL;
+		e->env_timer_deadline = 0;
+		if (e->env_ipc_recving)
+		{
+			e->env_ipc_recving = false;
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		} else
+			e->env_tf.tf_regs.reg_eax = 0;
+		sched_enqueue(e);
+	}
+}
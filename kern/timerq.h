@@ -0,0 +1,13 @@
+#ifndef JOS_KERN_TIMERQ_H
+#define JOS_KERN_TIMERQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void timerq_add(struct Env *e, uint32_t msec);
+void timerq_cancel(struct Env *e);
+void timerq_tick(void);
+
+#endif /* !JOS_KERN_TIMERQ_H */
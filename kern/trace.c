@@ -0,0 +1,111 @@
+// Kernel event tracing: each CPU logs timestamped binary events (see
+// inc/trace.h) into a ring of its own, thiscpu->cpu_trace, overwriting
+// the oldest.  Only that CPU writes its ring, with interrupts off, so
+// logging takes no lock and costs a TSC read and a few stores.
+// sys_trace_read copies a ring out from any CPU.
+//
+// cpu_trace_head counts the events the CPU has ever logged.  Event h
+// sits in slot h % TRACE_NEVENTS, and the head only moves past h once
+// the slot is written, so a reader racing the writer trusts the events
+// that the head, read again after copying, shows were not reused.
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/trace.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+
+#define TRACE_ORDER     3       // each ring is 2^TRACE_ORDER pages
+
+// Give each CPU mp_init found a ring.  The BSP logs nothing until then.
+void
+trace_init(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	static_assert(TRACE_NEVENTS * sizeof(struct TraceEvent) == PGSIZE << TRACE_ORDER);
+	for (i = 0; i < ncpu; i++)
+	{
+		if (!(pp = page_alloc_order(TRACE_ORDER, ALLOC_ZERO)))
+		{
+			cprintf("trace: no memory for CPU %d's ring\n", i);
+			continue;
+		}
+		pp->pp_ref++;
+		cpus[i].cpu_trace = page2kva(pp);
+	}
+}
+
+// Log an event of 'type' with arguments a0..a3 on this CPU.
+void
+trace_event(uint16_t type, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	struct CpuInfo *c = thiscpu;
+	struct TraceEvent *te;
+
+	if (!c->cpu_trace)
+		return;
+	te = &c->cpu_trace[c->cpu_trace_head % TRACE_NEVENTS];
+	te->te_tsc = read_tsc();
+	te->te_type = type;
+	te->te_cpu = c->cpu_id;
+	te->te_env = c->cpu_env ? c->cpu_env->env_id : 0;
+	te->te_arg[0] = a0;
+	te->te_arg[1] = a1;
+	te->te_arg[2] = a2;
+	te->te_arg[3] = a3;
+	// x86 keeps the stores in order; keep the compiler from moving
+	// the head past the event too
+	barrier();
+	c->cpu_trace_head++;
+}
+
+// Copy up to n of CPU 'cpu's events into buf, oldest first, starting
+// with event number *pos, or with the oldest the ring still holds if
+// that one is gone.  Sets *pos to the number of the event after the
+// last one copied, for the next call.
+// Returns how many were copied, or -E_INVAL if there is no such CPU or
+// it has no ring.
+int
+trace_read(int cpu, uint32_t *pos, struct TraceEvent *buf, size_t n)
+{
+	struct CpuInfo *c;
+	uint32_t head, from, k, i;
+	int32_t lost;
+
+	if (cpu < 0 || cpu >= ncpu || !cpus[cpu].cpu_trace)
+		return -E_INVAL;
+	c = &cpus[cpu];
+	for (;;)
+	{
+		head = c->cpu_trace_head;
+		from = *pos;
+		if (head - from > TRACE_NEVENTS)
+			from = head - TRACE_NEVENTS;
+		k = MIN(head - from, n);
+		for (i = 0; i < k; i++)
+			buf[i] = c->cpu_trace[(from + i) % TRACE_NEVENTS];
+		barrier();
+
+		// Meanwhile the writer may have reused the slots of the
+		// events before head + 1 - TRACE_NEVENTS
+		head = c->cpu_trace_head;
+		lost = head + 1 - TRACE_NEVENTS - from;
+		if (lost <= 0)
+			break;
+		if (lost < k)
+		{
+			memmove(buf, buf + lost, (k - lost) * sizeof(buf[0]));
+			from += lost;
+			k -= lost;
+			break;
+		}
+	}
+	*pos = from + k;
+	return k;
+}
@@ -0,0 +1,13 @@
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/trace.h>
+
+void trace_init(void);
+void trace_event(uint16_t type, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+int trace_read(int cpu, uint32_t *pos, struct TraceEvent *buf, size_t n);
+
+#endif /* !JOS_KERN_TRACE_H */
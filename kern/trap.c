@@ -12,8 +12,18 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
+#include <kern/futex.h>
+#include <kern/timerq.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
+#include <kern/virtio_blk.h>
+#include <kern/fpu.h>
+#include <kern/pmc.h>
+#include <kern/kvm.h>
+#include <kern/trace.h>
+#include <kern/sysstat.h>
+#include <kern/prof.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -29,6 +39,15 @@ struct Pseudodesc idt_pd = {
 		sizeof(idt) - 1, (uint32_t) idt
 };
 
+// sysenter model-specific registers
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
+// Set if the CPU supports sysenter; see sysenter_handler in trapentry.S.
+static bool sysenter_enabled;
+void sysenter_handler(void);
+
 
 static const char *trapname(int trapno)
 {
@@ -61,6 +80,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno >= T_MSI && trapno < T_MSI + NMSI)
+		return "Message Signaled Interrupt";
 	return "(unknown trap)";
 }
 
@@ -111,6 +132,14 @@ trap_init(void)
 
 	// Syscall
 	extern void TRAPNAME(T_SYSCALL)(void);
+	extern void TRAPNAME(T_TLBSHOOT)(void);
+	extern void TRAPNAME(T_WAKEUP)(void);
+
+	// MSI
+	extern void TRAPNAME(52)(void);
+	extern void TRAPNAME(53)(void);
+	extern void TRAPNAME(54)(void);
+	extern void TRAPNAME(55)(void);
 
 
 	SETGATE(idt[T_DIVIDE], false, GD_KT, TRAPNAME(T_DIVIDE), 0);
@@ -153,6 +182,19 @@ trap_init(void)
 
 	// Syscall
 	SETGATE(idt[T_SYSCALL], false, GD_KT, TRAPNAME(T_SYSCALL), 3);
+	SETGATE(idt[T_TLBSHOOT], false, GD_KT, TRAPNAME(T_TLBSHOOT), 0);
+	SETGATE(idt[T_WAKEUP], false, GD_KT, TRAPNAME(T_WAKEUP), 0);
+
+	// MSI
+	static_assert(T_MSI == 52 && NMSI == 4);
+	SETGATE(idt[52], false, GD_KT, TRAPNAME(52), 0);
+	SETGATE(idt[53], false, GD_KT, TRAPNAME(53), 0);
+	SETGATE(idt[54], false, GD_KT, TRAPNAME(54), 0);
+	SETGATE(idt[55], false, GD_KT, TRAPNAME(55), 0);
+
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	sysenter_enabled = (edx & CPUID_SEP) != 0;
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -174,8 +216,8 @@ trap_init_percpu(void)
 	//     thiscpu->cpu_id;
 	//   - Use "thiscpu->cpu_ts" as the TSS for the current CPU,
 	//     rather than the global "ts" variable;
-	//   - Use gdt[(GD_TSS0 >> 3) + i] for CPU i's TSS descriptor;
-	//   - You mapped the per-CPU kernel stacks in mem_init_mp()
+	//   - Use gdt[GD_TSS(i) >> 3] for CPU i's TSS descriptor;
+	//   - The per-CPU kernel stacks are mapped in mem_init_mp()
 	//   - Initialize cpu_ts.ts_iomb to prevent unauthorized environments
 	//     from doing IO (0 is not the correct value!)
 	//
@@ -191,20 +233,34 @@ trap_init_percpu(void)
 	// when we trap to the kernel.
 	size_t i = cpunum();
 
-	thiscpu->cpu_ts.ts_esp0 = (uintptr_t) percpu_kstacks[i];
+	// _alltraps finds i again from where in here it lands
+	static_assert(KSTKSIZE + KSTKGAP == 1 << KSTKSHIFT);
+	thiscpu->cpu_ts.ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 	thiscpu->cpu_ts.ts_ss0 = GD_KD;
 	thiscpu->cpu_ts.ts_iomb = sizeof(struct Taskstate);
 
 	// Initialize the TSS slot of the gdt.
-	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uintptr_t) (&thiscpu->cpu_ts),
-									sizeof(struct Taskstate) - 1, 0);
-	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
+	gdt[GD_TSS(i) >> 3] = SEG16(STS_T32A, (uintptr_t) (&thiscpu->cpu_ts),
+								sizeof(struct Taskstate) - 1, 0);
+	gdt[GD_TSS(i) >> 3].sd_s = 0;
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0 + i * 8);
+	ltr(GD_TSS(i));
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	fpu_init_percpu();
+	pmc_init_percpu();
+	kvm_init_percpu();
+
+	// Enable the sysenter fast system call path.
+	if (sysenter_enabled)
+	{
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uintptr_t) sysenter_handler);
+	}
 }
 
 void
@@ -259,22 +315,43 @@ trap_dispatch(struct Trapframe *tf)
 {
 	assert(tf != NULL);
 	pte_t *pte;
+	uint32_t syscallno;
+	bool stolen;
+
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + 16)
+		trace_event(TRACE_IRQ, tf->tf_trapno - IRQ_OFFSET, 0, 0, 0);
+
+	// The e1000's IRQ line is whatever PCI assigned it.
+	if (e1000_intr(tf->tf_trapno))
+		return;
+	// So is the virtio-blk disk's, which it then routes on
+	if (vblk_intr(tf->tf_trapno))
+		return;
+	// IRQs that sys_irq_ipc routed to user space
+	if (irq_ipc_intr(tf->tf_trapno))
+		return;
 
 	// Handle processor exceptions.
 	switch (tf->tf_trapno)
 	{
+		case T_DEVICE:
+			fpu_trap(tf);
+			return;
 		case T_SYSCALL:
 			// Generic system call: pass system call number in AX,
 			// up to five parameters in DX, CX, BX, DI, SI.
 			// Interrupt kernel with T_SYSCALL.
+			syscallno = tf->tf_regs.reg_eax;
 			tf->tf_regs.reg_eax = syscall(
-					tf->tf_regs.reg_eax,
+					syscallno,
 					tf->tf_regs.reg_edx,
 					tf->tf_regs.reg_ecx,
 					tf->tf_regs.reg_ebx,
 					tf->tf_regs.reg_edi,
 					tf->tf_regs.reg_esi
 			);
+			trace_event(TRACE_SYSCALL_EXIT, syscallno, tf->tf_regs.reg_eax, 0, 0);
+			sysstat_exit(syscallno);
 			break;
 
 		case T_PGFLT:
@@ -293,7 +370,19 @@ trap_dispatch(struct Trapframe *tf)
 			// LAB 6: Your code here.
 		case IRQ_OFFSET + IRQ_TIMER:
 			lapic_eoi();
-			time_tick();
+			prof_tick(tf);
+			stolen = time_tick((tf->tf_cs & 3) == 3);
+			if (thiscpu == bootcpu)
+			{
+				futex_tick();
+				timerq_tick();
+			}
+			sched_balance();
+			// A quantum the hypervisor mostly took away does not
+			// count: curenv, if any, keeps the CPU for another.
+			if (stolen)
+				break;
+			thiscpu->cpu_preempting = true;
 			sched_yield();
 
 			// Handle spurious interrupts
@@ -307,9 +396,19 @@ trap_dispatch(struct Trapframe *tf)
 			// LAB 5: Your code here.
 		case IRQ_OFFSET + IRQ_KBD:
 			kbd_intr();
+			irq_eoi();
 			break;
 		case IRQ_OFFSET + IRQ_SERIAL:
 			serial_intr();
+			irq_eoi();
+			break;
+		case T_TLBSHOOT:
+			tlb_shootdown_handle();
+			break;
+		case T_WAKEUP:
+			// Nothing to do: returning into the scheduler picks up
+			// whatever work the waker queued.
+			lapic_eoi();
 			break;
 
 		default:
@@ -340,10 +439,27 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 			asm volatile("hlt");
 
+	if ((tf->tf_cs & 3) == 3)
+		xchg(&thiscpu->cpu_in_kernel, 1);
+
+	// A TLB shootdown of a user-mode CPU needs no lock: env_pop_tf
+	// carries it out on the way back.  Neither does a wakeup that
+	// arrives after the CPU already found work.
+	if (tf->tf_trapno == T_TLBSHOOT ||
+		(tf->tf_trapno == T_WAKEUP && (tf->tf_cs & 3) == 3))
+	{
+		lapic_eoi();
+		if ((tf->tf_cs & 3) == 3)
+			env_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+	{
 		lock_kernel();
+		sched_idle_exit();
+	}
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -352,10 +468,34 @@ trap(struct Trapframe *tf)
 	if ((tf->tf_cs & 3) == 3)
 	{
 		// Trapped from user mode.
+		env_charge_user();
+		if (tf->tf_trapno == T_SYSCALL)
+		{
+			trace_event(TRACE_SYSCALL_ENTER, tf->tf_regs.reg_eax, tf->tf_regs.reg_edx,
+						tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx);
+			sysstat_enter(tf->tf_regs.reg_eax);
+		}
+
+		// System calls that only need their own subsystem's lock
+		// return straight to the caller without kernel_lock, so
+		// they run in parallel on different CPUs.
+		if (tf->tf_trapno == T_SYSCALL && curenv->env_status == ENV_RUNNING)
+		{
+			tlb_shootdown_unlocked_enter();
+			if (syscall_unlocked(tf))
+			{
+				env_charge_kernel();
+				env_pop_tf(tf);
+			}
+			tlb_shootdown_unlocked_exit();
+		}
+
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
 		lock_kernel();
+		// Pages may have been unmapped and freed while we waited
+		tlb_shootdown_handle();
 
 		assert(curenv);
 
@@ -392,10 +532,27 @@ trap(struct Trapframe *tf)
 }
 
 
+// Return from a trap taken in the kernel to the trapping code, which
+// the same-privilege iret leaves on its own stack.
+static void
+trap_resume_kernel(struct Trapframe *tf)
+{
+	asm volatile(
+	"\tmovl %0,%%esp\n"
+	"\tpopal\n"
+	"\tpopl %%es\n"
+	"\tpopl %%ds\n"
+	"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+	"\tiret\n"
+	: : "g" (tf) : "memory");
+	panic("iret failed");  /* mostly to placate the compiler */
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	uintptr_t fixup;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -404,9 +561,23 @@ page_fault_handler(struct Trapframe *tf)
 	// LAB 3: Your code here.
 	if ((tf->tf_cs & 3) == 0)
 	{
+		// A copyin or copyout faulted on a user address.  Make a
+		// copy-on-write page the environment's own and retry, as for
+		// a user write; otherwise resume at the copy's fixup, which
+		// fails it.
+		if (fault_va < ULIM && (fixup = extable_fixup(tf->tf_eip)) != 0)
+		{
+			if (!((tf->tf_err & FEC_WR) && fault_va < UTOP && curenv &&
+				  kernel_lock_held() &&
+				  page_cow_resolve(curenv->env_pgdir, (void *) fault_va) == 0))
+				tf->tf_eip = fixup;
+			trap_resume_kernel(tf);
+		}
 		print_trapframe(tf);
 		panic("A Page Fault in Kernel! fault_va = %p", fault_va);
 	}
+	trace_event(TRACE_PGFLT, fault_va, tf->tf_eip, tf->tf_err, 0);
+	curenv->env_pgfaults++;
 
 
 	// We've already handled kernel-mode exceptions, so if we get here,
@@ -443,6 +614,21 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 4: Your code here.
 
+	// Writes to copy-on-write pages are resolved right here, with no
+	// trip through the upcall, unless the environment asked for them
+	// (see sys_env_set_cow_upcall).  A page table fork left shared, a
+	// superpage and the zero page are the kernel's business either way.
+	if ((tf->tf_err & FEC_WR) && fault_va < UTOP)
+	{
+		if (!curenv->env_cow_upcall ||
+			(curenv->env_pgdir[PDX(fault_va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS) ||
+			page_lookup(curenv->env_pgdir, (void *) fault_va, NULL) == zero_page ?
+			page_cow_resolve(curenv->env_pgdir, (void *) fault_va) == 0 :
+			pgdir_unshare(curenv->env_pgdir, (void *) fault_va) == 0 &&
+			page_writable(curenv->env_pgdir, (void *) fault_va))
+			return;
+	}
+
 	// If the user registered a page fault handler
 	if (curenv->env_pgfault_upcall == NULL)
 	{
@@ -451,12 +637,12 @@ page_fault_handler(struct Trapframe *tf)
 	}
 
 	// This is the default value if this is the first time
-	uint8_t *exception_stack = (uint8_t *) UXSTACKTOP;
+	uint8_t *exception_stack = (uint8_t *) curenv->env_xstacktop;
 
 	// Check if this is the first time an exception occurs
 	// Set up the stack, if this is not the first time
-	if (curenv->env_tf.tf_esp >= UXSTACKTOP - PGSIZE &&
-		curenv->env_tf.tf_esp <= UXSTACKTOP - 1)
+	if (curenv->env_tf.tf_esp >= curenv->env_xstacktop - PGSIZE &&
+		curenv->env_tf.tf_esp <= curenv->env_xstacktop - 1)
 		exception_stack = (uint8_t *) tf->tf_esp;
 
 	struct UTrapframe user_tf = {
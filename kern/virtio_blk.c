@@ -0,0 +1,377 @@
+// Driver for virtio-blk disks, up to VBLK_MAXDISKS of them, through the
+// legacy virtio PCI interface, with one split virtqueue each.  The file
+// server hands them transfers straight from its own pages with
+// sys_blk_submit, several at a time and on any disk, and collects them
+// with sys_blk_reap, from all the disks at once, when a device's
+// interrupt (routed to it with sys_irq_ipc) says some are done.
+
+#include <inc/x86.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/trap.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
+#include <kern/syscall.h>
+#include <kern/virtio_blk.h>
+
+// Legacy virtio PCI registers, in the I/O space of BAR 0
+#define VIRTIO_HOST_FEATURES    0x00
+#define VIRTIO_GUEST_FEATURES   0x04
+#define VIRTIO_QUEUE_PFN        0x08
+#define VIRTIO_QUEUE_SIZE       0x0C
+#define VIRTIO_QUEUE_SEL        0x0E
+#define VIRTIO_QUEUE_NOTIFY     0x10
+#define VIRTIO_STATUS           0x12
+#define VIRTIO_ISR              0x13
+#define VIRTIO_BLK_CAPACITY     0x14    // 64 bits, in sectors
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+
+#define VIRTIO_BLK_T_IN         0       // read from the disk
+#define VIRTIO_BLK_T_OUT        1       // write to the disk
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2       // the device writes the buffer
+
+#define SECTSIZE                512
+#define VBLK_MAXSECTS           256     // sectors in one transfer
+#define VBLK_MAXPAGES           (VBLK_MAXSECTS * SECTSIZE / PGSIZE + 1)
+#define VBLK_MAXREQ             16      // transfers in flight at once
+#define VBLK_QMAX               256     // largest queue we can drive
+#define VBLK_MAXDISKS           4
+
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct vring_used_elem {
+	uint32_t id;        // head of the completed descriptor chain
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+struct vblk_req_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+// A transfer in flight: its header and status byte, which the device
+// reads and writes in place, and the user pages it holds referenced
+// until it completes.
+struct vblk_req {
+	bool busy;
+	uint32_t tag;
+	struct vblk_req_hdr hdr;
+	volatile uint8_t status;
+	struct PageInfo *pages[VBLK_MAXPAGES];
+	uint32_t npages;
+};
+
+// One disk.  All protected by the big kernel lock.
+struct vblk {
+	uint16_t iobase;
+	uint8_t irq_line;
+	uint32_t nsectors;
+	struct vblk_req reqs[VBLK_MAXREQ];
+
+	// The virtqueue: the descriptor table with its free list, the
+	// available ring we post chains on and the used ring the device
+	// returns them on.
+	uint16_t qsz;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	volatile struct vring_used *used;
+	uint16_t free_head, nfree;
+	uint16_t last_used;
+	uint8_t head_req[VBLK_QMAX];
+};
+
+// The disks, in the order they were found, and which one vblk_reap
+// looks at first
+static struct vblk vblks[VBLK_MAXDISKS];
+static uint32_t nvblk;
+static uint32_t vblk_next_reap;
+
+// Bytes the legacy layout of a queue of n descriptors takes: the
+// descriptors and available ring, then the used ring on its own page.
+static size_t
+vring_size(uint16_t n)
+{
+	return ROUNDUP(sizeof(struct vring_desc) * n + sizeof(uint16_t) * (3 + n), PGSIZE) +
+		   ROUNDUP(sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * n, PGSIZE);
+}
+
+// Set up the disk pcif as the next of vblks.
+int
+vblk_pci_attach(struct pci_func *pcif)
+{
+	struct vblk *v;
+	struct PageInfo *pp;
+	int order = 0;
+	uint16_t i;
+
+	if (nvblk == VBLK_MAXDISKS)
+	{
+		cprintf("virtio-blk: more than %d disks\n", VBLK_MAXDISKS);
+		return -E_NO_MEM;
+	}
+	v = &vblks[nvblk];
+	pci_func_enable(pcif);
+	v->iobase = pcif->reg_base[0];
+
+	// Reset, then tell the device we know how to drive it.  We take
+	// none of its optional features.
+	outb(v->iobase + VIRTIO_STATUS, 0);
+	outb(v->iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(v->iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	outl(v->iobase + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(v->iobase + VIRTIO_QUEUE_SEL, 0);
+	v->qsz = inw(v->iobase + VIRTIO_QUEUE_SIZE);
+	if (v->qsz == 0 || v->qsz > VBLK_QMAX)
+	{
+		cprintf("virtio-blk: unusable queue size %d\n", v->qsz);
+		v->iobase = 0;
+		return -E_INVAL;
+	}
+	while ((size_t) PGSIZE << order < vring_size(v->qsz))
+		order++;
+	if (!(pp = page_alloc_order(order, ALLOC_ZERO)))
+	{
+		v->iobase = 0;
+		return -E_NO_MEM;
+	}
+	v->desc = page2kva(pp);
+	v->avail = (struct vring_avail *) (v->desc + v->qsz);
+	v->used = (struct vring_used *) ROUNDUP((uintptr_t) &v->avail->ring[v->qsz + 1],
+											PGSIZE);
+	for (i = 0; i < v->qsz; i++)
+		v->desc[i].next = i + 1;
+	v->free_head = 0;
+	v->nfree = v->qsz;
+	outl(v->iobase + VIRTIO_QUEUE_PFN, page2pa(pp) / PGSIZE);
+
+	// Disks we can address fit in 32 bits of sectors
+	v->nsectors = inl(v->iobase + VIRTIO_BLK_CAPACITY);
+	v->irq_line = pcif->irq_line;
+	outb(v->iobase + VIRTIO_STATUS,
+		 VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	cprintf("virtio-blk %d: %u sectors, queue of %d, irq %d\n",
+			nvblk, v->nsectors, v->qsz, v->irq_line);
+	nvblk++;
+	return 0;
+}
+
+// Store the size and IRQ of disk number 'disk' in *info, and how many
+// disks there are.
+// Returns 0 on success, -E_INVAL if there is no such virtio-blk disk.
+int
+vblk_info(uint32_t disk, struct BlkInfo *info)
+{
+	if (disk >= nvblk)
+		return -E_INVAL;
+	info->bi_nsectors = vblks[disk].nsectors;
+	info->bi_irq = vblks[disk].irq_line;
+	info->bi_ndisks = nvblk;
+	return 0;
+}
+
+// Take a descriptor of v off the free list, filled in.
+static uint16_t
+vblk_desc(struct vblk *v, uint64_t addr, uint32_t len, uint16_t flags)
+{
+	uint16_t d = v->free_head;
+
+	v->free_head = v->desc[d].next;
+	v->nfree--;
+	v->desc[d].addr = addr;
+	v->desc[d].len = len;
+	v->desc[d].flags = flags;
+	return d;
+}
+
+// Start moving nsecs sectors between disk number 'disk' at secno and
+// the buffer at va in e's address space, which the device reads or
+// writes in place, one descriptor per page.  The transfer completes in
+// the background; sys_blk_reap reports it, by 'tag'.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no such disk, or the transfer is empty, longer
+//		than VBLK_MAXSECTS, past the end of the disk or not below UTOP.
+//	-E_FAULT if the buffer is not mapped user-accessible (and writable,
+//		for a read) in 4KB pages.
+//	-E_NO_MEM if a copy-on-write page of the buffer could not be copied.
+//	-E_WOULD_BLOCK if the queue has no room for the transfer just now.
+int
+vblk_submit(struct Env *e, uint32_t disk, uint32_t tag, uint32_t secno,
+			const void *va, size_t nsecs, bool write)
+{
+	uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	size_t len = nsecs * SECTSIZE, off = (uintptr_t) va - start, n;
+	struct vblk *v = &vblks[disk];
+	struct vblk_req *req;
+	struct PageInfo *pp;
+	uint16_t prev, d;
+	pte_t *pte;
+	uint32_t i;
+
+	if (disk >= nvblk || nsecs == 0 || nsecs > VBLK_MAXSECTS ||
+		secno >= v->nsectors || nsecs > v->nsectors - secno ||
+		(uintptr_t) va >= UTOP || len > UTOP - (uintptr_t) va)
+		return -E_INVAL;
+	for (req = v->reqs; req < v->reqs + VBLK_MAXREQ && req->busy; req++)
+		/* do nothing */;
+	if (req == v->reqs + VBLK_MAXREQ)
+		return -E_WOULD_BLOCK;
+
+	req->npages = (ROUNDUP((uintptr_t) va + len, PGSIZE) - start) / PGSIZE;
+	if (v->nfree < req->npages + 2)
+		return -E_WOULD_BLOCK;
+	for (i = 0; i < req->npages; i++)
+	{
+		if (!write && page_cow_break(e->env_pgdir, (void *) (start + i * PGSIZE)) < 0)
+			return -E_NO_MEM;
+		pp = page_lookup(e->env_pgdir, (void *) (start + i * PGSIZE), &pte);
+		if (!pp || (*pte & (PTE_U | PTE_PS)) != PTE_U ||
+			(!write && !page_writable(e->env_pgdir, (void *) (start + i * PGSIZE))))
+			return -E_FAULT;
+		req->pages[i] = pp;
+	}
+
+	req->busy = true;
+	req->tag = tag;
+	req->status = 0xFF;
+	req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	req->hdr.reserved = 0;
+	req->hdr.sector = secno;
+
+	d = prev = vblk_desc(v, PADDR(&req->hdr), sizeof(req->hdr), VRING_DESC_F_NEXT);
+	v->head_req[d] = req - v->reqs;
+	for (i = 0; len > 0; i++, off = 0)
+	{
+		req->pages[i]->pp_ref++;
+		n = MIN(PGSIZE - off, len);
+		v->desc[prev].next = vblk_desc(v, page2pa(req->pages[i]) + off, n,
+									   VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE));
+		prev = v->desc[prev].next;
+		len -= n;
+	}
+	v->desc[prev].next = vblk_desc(v, PADDR((void *) &req->status), 1, VRING_DESC_F_WRITE);
+
+	v->avail->ring[v->avail->idx % v->qsz] = d;
+	barrier();
+	v->avail->idx++;
+	mfence();
+	outw(v->iobase + VIRTIO_QUEUE_NOTIFY, 0);
+	return 0;
+}
+
+// Collect up to n completed transfers of disk v into done[], oldest
+// first, releasing their descriptors and pages.  Returns how many.
+static size_t
+vblk_reap_disk(struct vblk *v, struct BlkDone *done, size_t n)
+{
+	struct vblk_req *req;
+	uint16_t d;
+	uint32_t i;
+	size_t k;
+
+	for (k = 0; k < n && v->last_used != v->used->idx; k++, v->last_used++)
+	{
+		barrier();
+		d = v->used->ring[v->last_used % v->qsz].id;
+		req = &v->reqs[v->head_req[d]];
+
+		// Back on the free list with the whole chain
+		for (;;)
+		{
+			v->nfree++;
+			if (!(v->desc[d].flags & VRING_DESC_F_NEXT))
+				break;
+			d = v->desc[d].next;
+		}
+		v->desc[d].next = v->free_head;
+		v->free_head = v->used->ring[v->last_used % v->qsz].id;
+
+		for (i = 0; i < req->npages; i++)
+			page_decref(req->pages[i]);
+		done[k].bd_tag = req->tag;
+		done[k].bd_status = req->status == VIRTIO_BLK_S_OK ? 0 :
+							req->status == VIRTIO_BLK_S_UNSUPP ? -E_NOT_SUPP :
+							-E_UNSPECIFIED;
+		req->busy = false;
+	}
+	return k;
+}
+
+// Collect up to n completed transfers of any of the disks into done[],
+// oldest first on each disk, starting with a different disk each time
+// so that none is starved.  Returns how many.
+int
+vblk_reap(struct BlkDone *done, size_t n)
+{
+	uint32_t i, first = vblk_next_reap;
+	size_t k = 0;
+
+	if (nvblk == 0)
+		return 0;
+	vblk_next_reap = (first + 1) % nvblk;
+	for (i = 0; i < nvblk; i++)
+		k += vblk_reap_disk(&vblks[(first + i) % nvblk], done + k, n - k);
+	return k;
+}
+
+// Is irq some disk's interrupt line?
+bool
+vblk_irq(uint32_t irq)
+{
+	uint32_t i;
+
+	for (i = 0; i < nvblk; i++)
+		if (irq == vblks[i].irq_line)
+			return true;
+	return false;
+}
+
+// Handle trap 'trapno' if it is a disk's interrupt: acknowledge it at
+// every disk on that line, which may be shared, and pass it on to the
+// environment it is routed to (see sys_irq_ipc).
+// Returns false if trapno is not ours.
+bool
+vblk_intr(uint32_t trapno)
+{
+	bool ours = false;
+	uint32_t i;
+
+	for (i = 0; i < nvblk; i++)
+		if (trapno == IRQ_OFFSET + vblks[i].irq_line)
+		{
+			// Reading the ISR lowers the interrupt line
+			(void) inb(vblks[i].iobase + VIRTIO_ISR);
+			ours = true;
+		}
+	if (!ours)
+		return false;
+	if (!irq_ipc_intr(trapno))
+		irq_eoi();
+	return true;
+}
@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_VIRTIO_BLK_H
+#define JOS_KERN_VIRTIO_BLK_H
+
+#include <inc/env.h>
+#include <inc/syscall.h>
+#include "pci.h"
+
+#define VIRTIO_VENDOR_ID        0x1af4
+#define VIRTIO_BLK_DEVICE_ID    0x1001    // Transitional (legacy) virtio-blk
+
+int vblk_pci_attach(struct pci_func *pcif);
+int vblk_info(uint32_t disk, struct BlkInfo *info);
+int vblk_submit(struct Env *e, uint32_t disk, uint32_t tag, uint32_t secno, const void *va,
+				size_t nsecs, bool write);
+int vblk_reap(struct BlkDone *done, size_t n);
+bool vblk_irq(uint32_t irq);
+bool vblk_intr(uint32_t trapno);
+
+#endif // !JOS_KERN_VIRTIO_BLK_H
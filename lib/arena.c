@@ -0,0 +1,116 @@
+// Arenas, for data that lives exactly as long as one request.
+//
+// arena_alloc carves memory off the end of the arena's current chunk,
+// a pointer bump, and arena_reset frees all of it at once.  A request
+// the current chunk has no room for gets a new chunk, at least as large
+// as the first; arena_reset keeps the first chunk and frees the others,
+// so an arena that fits its usual request never calls malloc again.
+
+#include <inc/lib.h>
+
+#define ARENA_ALIGN 8
+
+struct ArenaChunk {
+	struct ArenaChunk *ac_next;     // the chunk filled before this one
+	size_t ac_size;                 // bytes after the header
+	size_t ac_used;
+};
+
+struct Arena {
+	struct ArenaChunk *a_chunk;     // the chunk being filled
+	struct ArenaChunk *a_first;     // the one arena_reset keeps
+};
+
+static struct ArenaChunk *
+chunk_new(size_t size)
+{
+	struct ArenaChunk *c;
+
+	if (size > (size_t) -1 - sizeof(*c) || !(c = malloc(sizeof(*c) + size)))
+		return 0;
+	c->ac_next = 0;
+	c->ac_size = size;
+	c->ac_used = 0;
+	return c;
+}
+
+// Create an arena whose first chunk holds 'size' bytes.
+// Returns the arena, or 0 if out of memory.
+struct Arena *
+arena_create(size_t size)
+{
+	struct Arena *a;
+
+	if (!(a = malloc(sizeof(*a))))
+		return 0;
+	if (!(a->a_first = chunk_new(ROUNDUP(size, ARENA_ALIGN))))
+	{
+		free(a);
+		return 0;
+	}
+	a->a_chunk = a->a_first;
+	return a;
+}
+
+// Allocate n bytes, 8-byte aligned, that last until the next
+// arena_reset or arena_destroy.  Returns 0 if out of memory.
+void *
+arena_alloc(struct Arena *a, size_t n)
+{
+	struct ArenaChunk *c = a->a_chunk;
+	void *v;
+
+	if (n > (size_t) -1 - ARENA_ALIGN)
+		return 0;
+	n = ROUNDUP(n, ARENA_ALIGN);
+	if (n > c->ac_size - c->ac_used)
+	{
+		if (!(c = chunk_new(MAX(n, a->a_first->ac_size))))
+			return 0;
+		c->ac_next = a->a_chunk;
+		a->a_chunk = c;
+	}
+	v = (char *) (c + 1) + c->ac_used;
+	c->ac_used += n;
+	return v;
+}
+
+// Copy the first n bytes of s into the arena, as a string.
+// Returns the copy, or 0 if out of memory.
+char *
+arena_strndup(struct Arena *a, const char *s, size_t n)
+{
+	char *d;
+
+	if ((d = arena_alloc(a, n + 1)) != 0)
+	{
+		memmove(d, s, n);
+		d[n] = '\0';
+	}
+	return d;
+}
+
+// Free everything allocated from the arena, keeping it for reuse.
+void
+arena_reset(struct Arena *a)
+{
+	struct ArenaChunk *c, *next;
+
+	for (c = a->a_chunk; c != a->a_first; c = next)
+	{
+		next = c->ac_next;
+		free(c);
+	}
+	a->a_chunk = a->a_first;
+	a->a_first->ac_used = 0;
+}
+
+void
+arena_destroy(struct Arena *a)
+{
+	if (!a)
+		return;
+	arena_reset(a);
+	free(a->a_first);
+	free(a);
+}
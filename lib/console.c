@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd *, void *, size_t);
 static ssize_t devcons_write(struct Fd *, const void *, size_t);
 static int devcons_close(struct Fd *);
 static int devcons_stat(struct Fd *, struct Stat *);
+static int devcons_poll(struct Fd *);
 
 struct Dev devcons =
 		{
@@ -46,7 +47,8 @@ struct Dev devcons =
 				.dev_read =    devcons_read,
 				.dev_write =    devcons_write,
 				.dev_close =    devcons_close,
-				.dev_stat =    devcons_stat
+				.dev_stat =    devcons_stat,
+				.dev_poll =    devcons_poll
 		};
 
 int
@@ -75,22 +77,21 @@ opencons(void)
 	return fd2num(fd);
 }
 
+// Read from the kernel's line discipline, which edits and echoes a
+// line as it is typed and hands it over once it is finished, so a read
+// returns at most one line, newline included, and sleeps until there
+// is one.
 static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	int c;
+	bool wait = !(fd->fd_omode & O_NONBLOCK);
+	int r;
 
 	if (n == 0)
 		return 0;
-
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
-	if (c < 0)
-		return c;
-	if (c == 0x04)    // ctl-d is eof
-		return 0;
-	*(char *) vbuf = c;
-	return 1;
+	while ((r = sys_cons_read(vbuf, n, wait)) == -E_WOULD_BLOCK && wait)
+		;
+	return r;
 }
 
 static ssize_t
@@ -120,6 +121,15 @@ devcons_close(struct Fd *fd)
 	return 0;
 }
 
+// A read of nothing asks whether a line is ready.
+static int
+devcons_poll(struct Fd *fd)
+{
+	char c;
+
+	return POLLOUT | (sys_cons_read(&c, 0, 0) == 0 ? POLLIN : 0);
+}
+
 static int
 devcons_stat(struct Fd *fd, struct Stat *stat)
 {
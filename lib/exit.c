@@ -1,9 +1,15 @@
 
 #include <inc/lib.h>
 
+// Set once a stream has been written to, to flush them all (see
+// lib/stdio.c)
+void (*exit_flush)(void);
+
 void
 exit(void)
 {
+	if (exit_flush)
+		exit_flush();
 	close_all();
 	sys_env_destroy(0);
 }
@@ -2,8 +2,6 @@
 
 #define debug        0
 
-// Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD        32
 // Bottom of file descriptor area
 #define FDTABLE        0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -15,6 +13,87 @@
 // Return the file data page for file descriptor index i
 #define INDEX2DATA(i)    ((char*) (FILEDATA + (i)*PGSIZE))
 
+// Which fd pages are mapped, so that fd_alloc and close_all don't walk
+// the page tables one fd at a time.  A set bit in fdmap means the fd's
+// page is mapped; a set bit in fdfull means that word of fdmap is all
+// ones.  The map is kept by fd_close, dup and fd_lookup, and fd_alloc
+// marks pages its callers mapped as it comes across them: fd_alloc
+// does not map the page it returns, so it can't mark it right away.
+// fdmap_pgdir is the page directory the map describes, which is not
+// ours in a forked child, nor in a spawned one, whose map is all zero:
+// those rebuild it from their page tables the first time they look.
+#define FDMAP_WORDS    (MAXFD / 32)
+
+static uint32_t fdmap[FDMAP_WORDS];
+static uint32_t fdfull[(FDMAP_WORDS + 31) / 32];
+static physaddr_t fdmap_pgdir;
+
+static bool
+fd_is_mapped(int i)
+{
+	struct Fd *fd = INDEX2FD(i);
+
+	return (uvpd[PDX(fd)] & PTE_P) && (uvpt[PGNUM(fd)] & PTE_P);
+}
+
+static void
+fdmap_set(int i)
+{
+	fdmap[i / 32] |= 1 << (i % 32);
+	if (fdmap[i / 32] == ~0U)
+		fdfull[i / 1024] |= 1 << (i / 32 % 32);
+}
+
+static void
+fdmap_clear(int i)
+{
+	fdmap[i / 32] &= ~(1 << (i % 32));
+	fdfull[i / 1024] &= ~(1 << (i / 32 % 32));
+}
+
+// Rebuild the map from the page tables, skipping whole page tables
+// that aren't there.
+static void
+fdmap_rebuild(void)
+{
+	int i;
+
+	memset(fdmap, 0, sizeof(fdmap));
+	memset(fdfull, 0, sizeof(fdfull));
+	for (i = 0; i < MAXFD; i++)
+	{
+		if (!(uvpd[PDX(INDEX2FD(i))] & PTE_P))
+			i |= NPTENTRIES - 1;
+		else if (uvpt[PGNUM(INDEX2FD(i))] & PTE_P)
+			fdmap_set(i);
+	}
+	fdmap_pgdir = PTE_ADDR(uvpd[PDX(UVPT)]);
+}
+
+static void
+fdmap_sync(void)
+{
+	if (fdmap_pgdir != PTE_ADDR(uvpd[PDX(UVPT)]))
+		fdmap_rebuild();
+}
+
+// The lowest fd whose bit is clear, or -1 if all are set.
+static int
+fdmap_first_clear(void)
+{
+	int i, w;
+
+	for (i = 0; i < ARRAY_SIZE(fdfull); i++)
+		if (~fdfull[i] != 0)
+		{
+			w = i * 32 + bsf(~fdfull[i]);
+			if (w >= FDMAP_WORDS)
+				return -1;
+			return w * 32 + bsf(~fdmap[w]);
+		}
+	return -1;
+}
+
 
 // --------------------------------------------------------------
 // File descriptor manipulators
@@ -42,7 +121,8 @@ fd2data(struct Fd *fd)
 // without allocating the first page we return, we'll return the same
 // page the second time.
 //
-// Hint: Use INDEX2FD.
+// Each fd found mapped is marked in fdmap on the way, so this takes
+// constant time apart from the fds mapped since the last call.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_MAX_FD: no more file descriptors
@@ -51,16 +131,28 @@ int
 fd_alloc(struct Fd **fd_store)
 {
 	int i;
-	struct Fd *fd;
+	bool rebuilt = 0;
 
-	for (i = 0; i < MAXFD; i++)
+	fdmap_sync();
+	while (1)
 	{
-		fd = INDEX2FD(i);
-		if ((uvpd[PDX(fd)] & PTE_P) == 0 || (uvpt[PGNUM(fd)] & PTE_P) == 0)
+		if ((i = fdmap_first_clear()) < 0)
+		{
+			// A page unmapped behind fd_close's back leaves its
+			// bit set; look at the page tables once before
+			// giving up.
+			if (rebuilt)
+				break;
+			fdmap_rebuild();
+			rebuilt = 1;
+			continue;
+		}
+		if (!fd_is_mapped(i))
 		{
-			*fd_store = fd;
+			*fd_store = INDEX2FD(i);
 			return 0;
 		}
+		fdmap_set(i);
 	}
 	*fd_store = 0;
 	return -E_MAX_OPEN;
@@ -75,22 +167,20 @@ fd_alloc(struct Fd **fd_store)
 int
 fd_lookup(int fdnum, struct Fd **fd_store)
 {
-	struct Fd *fd;
-
 	if (fdnum < 0 || fdnum >= MAXFD)
 	{
 		if (debug)
 			cprintf("[%08x] bad fd %d\n", thisenv->env_id, fdnum);
 		return -E_INVAL;
 	}
-	fd = INDEX2FD(fdnum);
-	if (!(uvpd[PDX(fd)] & PTE_P) || !(uvpt[PGNUM(fd)] & PTE_P))
+	if (!fd_is_mapped(fdnum))
 	{
 		if (debug)
 			cprintf("[%08x] closed fd %d\n", thisenv->env_id, fdnum);
+		fdmap_clear(fdnum);
 		return -E_INVAL;
 	}
-	*fd_store = fd;
+	*fd_store = INDEX2FD(fdnum);
 	return 0;
 }
 
@@ -120,6 +210,7 @@ fd_close(struct Fd *fd, bool must_exist)
 	// Make sure fd is unmapped.  Might be a no-op if
 	// (*dev->dev_close)(fd) already unmapped it.
 	(void) sys_page_unmap(0, fd);
+	fdmap_clear(fd2num(fd));
 	return r;
 }
 
@@ -132,6 +223,7 @@ static struct Dev *devtab[] =
 		{
 				&devfile,
 				&devsock,
+				&devepoll,
 				&devpipe,
 				&devcons,
 				0
@@ -164,12 +256,17 @@ close(int fdnum)
 		return fd_close(fd, 1);
 }
 
+// Close every open fd, visiting only those marked in fdmap.
 void
 close_all(void)
 {
-	int i;
-	for (i = 0; i < MAXFD; i++)
-		close(i);
+	int i, w;
+	uint32_t bits;
+
+	fdmap_sync();
+	for (w = 0; w < FDMAP_WORDS; w++)
+		for (bits = fdmap[w]; bits; bits &= bits - 1)
+			close(w * 32 + bsf(bits));
 }
 
 // Make file descriptor 'newfdnum' a duplicate of file descriptor 'oldfdnum'.
@@ -187,6 +284,8 @@ dup(int oldfdnum, int newfdnum)
 
 	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0)
 		return r;
+	if (newfdnum < 0 || newfdnum >= MAXFD)
+		return -E_INVAL;
 	close(newfdnum);
 
 	newfd = INDEX2FD(newfdnum);
@@ -198,6 +297,8 @@ dup(int oldfdnum, int newfdnum)
 			goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
+	fdmap_sync();
+	fdmap_set(newfdnum);
 
 	return newfdnum;
 
@@ -266,18 +367,217 @@ write(int fdnum, const void *buf, size_t n)
 	return (*dev->dev_write)(fd, buf, n);
 }
 
+// Read the pieces iov[0] through iov[iovcnt - 1], each from its own
+// offset in the file, without moving fdnum's seek position.  Stops at
+// the first piece that comes up short, at the end of the file.
+// Returns the number of bytes read, < 0 on error.
+ssize_t
+preadv(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+		|| (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY)
+	{
+		cprintf("[%08x] preadv %d -- bad mode\n", thisenv->env_id, fdnum);
+		return -E_INVAL;
+	}
+	if (iovcnt < 0)
+		return -E_INVAL;
+	if (!dev->dev_preadv)
+		return -E_NOT_SUPP;
+	return (*dev->dev_preadv)(fd, iov, iovcnt);
+}
+
+// Write the pieces iov[0] through iov[iovcnt - 1], each at its own
+// offset in the file, without moving fdnum's seek position.
+// Returns the number of bytes written, < 0 on error.
+ssize_t
+pwritev(int fdnum, const struct iovec *iov, int iovcnt)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+		|| (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY)
+	{
+		cprintf("[%08x] pwritev %d -- bad mode\n", thisenv->env_id, fdnum);
+		return -E_INVAL;
+	}
+	if (iovcnt < 0)
+		return -E_INVAL;
+	if (!dev->dev_pwritev)
+		return -E_NOT_SUPP;
+	return (*dev->dev_pwritev)(fd, iov, iovcnt);
+}
+
+// Read at most n bytes from fdnum at 'offset', leaving its seek
+// position alone.
+ssize_t
+pread(int fdnum, void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { buf, n, offset };
+
+	return preadv(fdnum, &iov, 1);
+}
+
+// Write n bytes to fdnum at 'offset', leaving its seek position alone.
+ssize_t
+pwrite(int fdnum, const void *buf, size_t n, off_t offset)
+{
+	struct iovec iov = { (void *) buf, n, offset };
+
+	return pwritev(fdnum, &iov, 1);
+}
+
+// Where splice stages data that cannot go from one server straight to
+// the other: file server cache pages mapped here, or bytes read in.
+#define SPLICE_NPAGES    FSIPC_MAXPAGES
+
+static char splice_buf[SPLICE_NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+// splice_buf holds pages we may not write: the file server's, mapped
+// read-only, or pages donated to it, which are copy-on-write
+static bool splice_buf_stale;
+
+// Write all n bytes at buf to fdnum, unless that fails or fdnum's other
+// end has gone.  Returns the number written, < 0 if none could be.
+static ssize_t
+write_all(int fdnum, const char *buf, size_t n)
+{
+	size_t tot;
+	ssize_t r;
+
+	for (tot = 0; tot < n; tot += r)
+		if ((r = write(fdnum, buf + tot, n - tot)) <= 0)
+			return tot > 0 ? tot : r;
+	return tot;
+}
+
+// Move up to len bytes from fdin to fdout through splice_buf: the
+// pages of a file are mapped there, anything else is read into it.
+static ssize_t
+splice_staged(struct Fd *in, int fdin, struct Fd *out, int fdout, size_t len)
+{
+	struct PageMapOp op;
+	size_t skip, done;
+	ssize_t n, r;
+
+	if (in->fd_dev_id == devfile.dev_id)
+	{
+		skip = PGOFF(in->fd_offset);
+		splice_buf_stale = true;
+		n = file_map(fdin, in->fd_offset - skip,
+					 skip + MIN(len, sizeof(splice_buf) - skip), splice_buf);
+		if (n <= (ssize_t) skip)
+			return MIN(n, 0);
+		if ((r = write_all(fdout, splice_buf + skip, n - skip)) > 0)
+			in->fd_offset += r;
+		return r;
+	}
+
+	if (splice_buf_stale)
+	{
+		op.srcva = PAGEMAP_ALLOC;
+		op.dstva = (uintptr_t) splice_buf;
+		op.npages = SPLICE_NPAGES;
+		op.perm = PTE_P | PTE_U | PTE_W;
+		if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+			return r;
+		splice_buf_stale = false;
+	}
+	if ((n = read(fdin, splice_buf, MIN(len, sizeof(splice_buf)))) <= 0)
+		return n;
+	// A file takes whole pages as they are (see devfile_write)
+	if (out->fd_dev_id == devfile.dev_id)
+		splice_buf_stale = true;
+	return write_all(fdout, splice_buf, n);
+}
+
+//
+// Move up to len bytes from fdin's seek position to fdout's, as a read
+// and a write through a buffer would, but moving pages rather than
+// copying bytes wherever both devices allow:
+//	file to file: the file server copies the data itself (see fsplice);
+//	file to socket: the file server's cache pages go to the network
+//	server as they are (see sendfile);
+//	from a file otherwise: the cache pages are mapped here, and only
+//	the write copies them;
+//	to a file otherwise: whole pages go to the file server donated,
+//	not copied.
+// Pipes and the console hold bytes rather than pages, so data to or
+// from them is copied once on the way.
+//
+// Returns the number of bytes moved, which like a read's may be fewer
+// than len; 0 at the end of fdin; < 0 on error.
+//
+ssize_t
+splice(int fdin, int fdout, size_t len)
+{
+	struct Fd *in, *out;
+	ssize_t r;
+
+	if ((r = fd_lookup(fdin, &in)) < 0 || (r = fd_lookup(fdout, &out)) < 0)
+		return r;
+	if ((in->fd_omode & O_ACCMODE) == O_WRONLY ||
+		(out->fd_omode & O_ACCMODE) == O_RDONLY)
+	{
+		cprintf("[%08x] splice %d %d -- bad mode\n", thisenv->env_id, fdin, fdout);
+		return -E_INVAL;
+	}
+	if (len == 0)
+		return 0;
+
+	if (in->fd_dev_id == devfile.dev_id && out->fd_dev_id == devfile.dev_id)
+		return fsplice(fdin, fdout, len);
+	if (in->fd_dev_id == devfile.dev_id && out->fd_dev_id == devsock.dev_id)
+	{
+		if ((r = sendfile(fdout, fdin, in->fd_offset, len)) > 0)
+			in->fd_offset += r;
+		return r;
+	}
+	return splice_staged(in, fdin, out, fdout, len);
+}
+
 int
 seek(int fdnum, off_t offset)
 {
 	int r;
+	struct Dev *dev;
 	struct Fd *fd;
 
-	if ((r = fd_lookup(fdnum, &fd)) < 0)
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+		|| (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if (dev->dev_fsync && (r = (*dev->dev_fsync)(fd)) < 0)
 		return r;
 	fd->fd_offset = offset;
 	return 0;
 }
 
+// Write out the writes to fdnum that its device holds back, so that
+// others see them.  Returns 0 on success, < 0 on error.
+int
+fsync(int fdnum)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+		|| (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if (!dev->dev_fsync)
+		return 0;
+	return (*dev->dev_fsync)(fd);
+}
+
 int
 ftruncate(int fdnum, off_t newsize)
 {
@@ -313,6 +613,7 @@ fstat(int fdnum, struct Stat *stat)
 	stat->st_name[0] = 0;
 	stat->st_size = 0;
 	stat->st_isdir = 0;
+	stat->st_version = 0;
 	stat->st_dev = dev;
 	return (*dev->dev_stat)(fd, stat);
 }
@@ -329,3 +630,92 @@ stat(const char *path, struct Stat *stat)
 	return r;
 }
 
+
+// Get (F_GETFL) or set (F_SETFL) the open mode of 'fdnum'.  Only
+// O_NONBLOCK can be changed; like the offset, it is shared by every
+// duplicate of the file descriptor.
+// Returns the open mode for F_GETFL, 0 for F_SETFL, < 0 on error.
+// Errors are:
+//	-E_INVAL if fdnum is not open or cmd is unknown.
+int
+fcntl(int fdnum, int cmd, int arg)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	switch (cmd)
+	{
+		case F_GETFL:
+			return fd->fd_omode;
+		case F_SETFL:
+			fd->fd_omode = (fd->fd_omode & ~O_NONBLOCK) | (arg & O_NONBLOCK);
+			return 0;
+		default:
+			return -E_INVAL;
+	}
+}
+
+// Wait up to 'timeout' msec (forever if < 0, not at all if 0) for one
+// of the nfds file descriptors in 'fds' to be ready (see struct pollfd).
+// Sockets are all asked about with one request to the network server,
+// which sleeps until one is ready when nothing but sockets is polled;
+// other devices are checked by spinning with sys_yield.
+// Returns the number of fds with revents set, 0 on timeout, or < 0 on
+// error.  Errors are:
+//	-E_INVAL if more than NSIPC_MAXPOLL sockets are polled.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	uint32_t start = time_msec();
+	int i, n, r, nsock, nother, wait, waited;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	while (1)
+	{
+		n = nsock = nother = 0;
+		for (i = 0; i < nfds; i++)
+		{
+			fds[i].revents = 0;
+			if (fds[i].fd < 0)
+				continue;
+			if (fd_lookup(fds[i].fd, &fd) < 0
+				|| dev_lookup(fd->fd_dev_id, &dev) < 0)
+				fds[i].revents = POLLNVAL;
+			else if (dev == &devsock)
+				nsock++;
+			else
+			{
+				nother++;
+				if (dev->dev_poll)
+					fds[i].revents = dev->dev_poll(fd) & (fds[i].events | POLLHUP);
+				else
+					fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+			}
+			if (fds[i].revents)
+				n++;
+		}
+
+		waited = time_msec() - start;
+		if (timeout >= 0 && waited > timeout)
+			waited = timeout;
+		if (nsock > 0)
+		{
+			// Let the network server do the waiting if it can.
+			wait = 0;
+			if (n == 0 && nother == 0)
+				wait = timeout < 0 ? -1 : timeout - waited;
+			if ((r = sock_poll(fds, nfds, wait)) < 0)
+				return r;
+			n += r;
+			if (wait != 0)
+				return n;
+		}
+
+		if (n > 0 || (timeout >= 0 && waited >= timeout))
+			return n;
+		sys_yield();
+	}
+}
@@ -6,6 +6,60 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Large reads and writes move their data in whole pages mapped here:
+// a request page followed by FSIPC_MAXPAGES data pages.
+#define FSIPCDATA    0xE0000000
+
+static int fsipc_pages(unsigned type, void *req, int perm, void *dstva);
+static uint32_t fsipc_session(void);
+static bool page_is_mapped(uintptr_t va);
+
+// Each file descriptor keeps a window of FCACHE_NPAGES pages of its
+// file that it last read through, the file server's block-cache pages
+// mapped read-only at FCACHE + fdnum * FCACHE_NPAGES * PGSIZE, so that
+// small reads are served without an IPC.  A read outside the window
+// maps the window that starts at its page; sequential reads thus run
+// a window at a time, and the server reads ahead for them.  The window
+// is good while the file's entry in the server's version table, mapped
+// at FSVERSIONS, holds what it held when the window was mapped.
+#define FCACHE_NPAGES    8
+#define FCACHE        0xD2000000
+#define FSVERSIONS    (FCACHE - PGSIZE)
+
+struct FileCache {
+	int fc_fileid;        // the Fd's file id when mapped
+	uint32_t fc_version;    // its version table entry then
+	off_t fc_offset;    // file offset of the window, a page boundary
+	size_t fc_len;        // bytes of the file in it
+};
+
+static struct FileCache fcache[MAXFD];
+
+// Each file descriptor also holds back small writes, up to the end of
+// the page of the file they start in, and sends them in one request
+// when that page fills, or before anything that must see them: a read,
+// stat, truncate, seek, fsync, close or fork, or a write elsewhere.
+// The seek position moves on at once; wbuf_flush writes the bytes at
+// the offset they were written at.
+struct WriteBuf {
+	int wb_fileid;        // the Fd's file id when written
+	off_t wb_offset;    // file offset of the first byte held
+	size_t wb_len;        // bytes held, from wb_offset
+};
+
+static struct WriteBuf wbuf[MAXFD];
+static char wbuf_data[MAXFD][PGSIZE];
+
+// The file server, looked up the first time.
+static envid_t
+fsipc_env(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_service(SERVICE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,24 +69,79 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	uint32_t slot;
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
+	if (!dstva && (slot = fsipc_session()) != 0)
+	{
+		if (debug)
+			cprintf("[%08x] fsipc %d %08x (session %u)\n", thisenv->env_id,
+					type, *(uint32_t *) &fsipcbuf, slot - 1);
+		return ipc_call_words(fsipc_env(), type, 0, slot);
+	}
+	return fsipc_pages(type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva);
+}
+
+// The file server keeps fsipcbuf's page as our session page once we
+// have lent it (see FSREQ_SESSION), so that a request whose reply needs
+// no page of its own moves no page at all.  Returns the session's slot
+// plus one, or 0 if there is no session and the request must bring
+// fsipcbuf.  The page changes under us when a fork makes it
+// copy-on-write and we write to it, and a forked child has none of its
+// own: either way the server needs to be lent the page again.
+static uint32_t
+fsipc_session(void)
+{
+	static envid_t session_env;
+	static physaddr_t session_pa;
+	static uint32_t session_slot;
+	physaddr_t pa = PTE_ADDR(uvpt[PGNUM(&fsipcbuf)]);
+	int r;
+
+	if (session_env == thisenv->env_id && session_pa == pa)
+		return session_slot;
+	// If the server has no slot for us, don't keep asking
+	session_env = thisenv->env_id;
+	session_pa = pa;
+	session_slot = 0;
+	if ((r = fsipc_pages(FSREQ_SESSION, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL)) >= 0)
+		session_slot = r + 1;
+	return session_slot;
+}
+
+// Like fsipc, but send the request at 'req' with 'perm', whose upper
+// bits may say how many pages to send and to accept in reply (see
+// IPC_SENDPAGES and IPC_RECVPAGES).
+static int
+fsipc_pages(unsigned type, void *req, int perm, void *dstva)
+{
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *) req);
+
+	return ipc_call(fsipc_env(), type, req, perm, dstva, NULL);
+}
+
+// Send a request whose only argument is 'arg' to the file server
+// without an argument page (see sys_ipc_call_words): the handful the
+// server takes that way, FSREQ_FLUSH, FSREQ_SYNC and FSREQ_DROP_CACHE.
+static int
+fsipc_small(unsigned type, uint32_t arg)
+{
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *) &fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x (small)\n", thisenv->env_id, type, arg);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call_words(fsipc_env(), type, arg, 0);
 }
 
 static int devfile_flush(struct Fd *fd);
+static int devfile_fsync(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static ssize_t devfile_preadv(struct Fd *fd, const struct iovec *iov, int iovcnt);
+static ssize_t devfile_pwritev(struct Fd *fd, const struct iovec *iov, int iovcnt);
 
 struct Dev devfile =
 		{
@@ -42,7 +151,10 @@ struct Dev devfile =
 				.dev_close =    devfile_flush,
 				.dev_stat =    devfile_stat,
 				.dev_write =    devfile_write,
-				.dev_trunc =    devfile_trunc
+				.dev_trunc =    devfile_trunc,
+				.dev_preadv =    devfile_preadv,
+				.dev_pwritev =    devfile_pwritev,
+				.dev_fsync =    devfile_fsync
 		};
 
 // Open a file (or directory).
@@ -89,6 +201,140 @@ open(const char *path, int mode)
 	return fd2num(fd);
 }
 
+static char *
+fcache_va(struct Fd *fd)
+{
+	return (char *) FCACHE + fd2num(fd) * FCACHE_NPAGES * PGSIZE;
+}
+
+// Unmap fd's window.
+static void
+fcache_drop(struct Fd *fd)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	fcache[fd2num(fd)].fc_len = 0;
+	op.srcva = 0;
+	op.dstva = (uintptr_t) fcache_va(fd);
+	op.npages = FCACHE_NPAGES;
+	op.perm = 0;
+	sys_page_map_batch(0, 0, &op, 1, &done);
+}
+
+// Read up to n bytes at fd's position from its window, mapping the
+// window that holds the position first if the current one does not or
+// is out of date.
+// Returns the number of bytes read, 0 at the end of the file, < 0 on
+// error.
+static ssize_t
+fcache_read(struct Fd *fd, void *buf, size_t n)
+{
+	volatile uint32_t *versions = (volatile uint32_t *) FSVERSIONS;
+	struct FileCache *fc = &fcache[fd2num(fd)];
+	off_t pos = fd->fd_offset;
+	ssize_t r;
+
+	if (!page_is_mapped(FSVERSIONS) &&
+		(r = fsipc(FSREQ_VERSIONS, (void *) FSVERSIONS)) < 0)
+		return r;
+	if (fc->fc_len == 0 || fc->fc_fileid != fd->fd_file.id ||
+		fc->fc_version != versions[fd->fd_file.vslot] ||
+		pos < fc->fc_offset || pos >= fc->fc_offset + fc->fc_len)
+	{
+		// The version before the pages, so that a change meanwhile
+		// shows up as a stale window next time
+		fc->fc_len = 0;
+		fc->fc_fileid = fd->fd_file.id;
+		fc->fc_version = versions[fd->fd_file.vslot];
+		fc->fc_offset = ROUNDDOWN(pos, PGSIZE);
+		if ((r = file_map(fd2num(fd), fc->fc_offset, FCACHE_NPAGES * PGSIZE,
+						  fcache_va(fd))) < 0)
+			return r;
+		fc->fc_len = r;
+		if (pos >= fc->fc_offset + fc->fc_len)
+			return 0;
+	}
+
+	n = MIN(n, fc->fc_offset + fc->fc_len - pos);
+	memmove(buf, fcache_va(fd) + (pos - fc->fc_offset), n);
+	fd->fd_offset += n;
+	return n;
+}
+
+// Send the writes fd holds back.  They are forgotten even if that
+// fails, so that a full disk does not fail every later call too.
+static int
+wbuf_flush(struct Fd *fd)
+{
+	struct WriteBuf *wb = &wbuf[fd2num(fd)];
+	struct iovec iov;
+	ssize_t r;
+
+	if (wb->wb_len == 0)
+		return 0;
+	iov.iov_base = wbuf_data[fd2num(fd)] + PGOFF(wb->wb_offset);
+	iov.iov_len = wb->wb_len;
+	iov.iov_offset = wb->wb_offset;
+	wb->wb_len = 0;
+	if (wb->wb_fileid != fd->fd_file.id)
+		return 0;
+	if ((r = devfile_pwritev(fd, &iov, 1)) < 0)
+		return r;
+	return r < iov.iov_len ? -E_NO_DISK : 0;
+}
+
+static void
+wbuf_flush_all(void)
+{
+	struct Fd *fd;
+	int i;
+
+	for (i = 0; i < MAXFD; i++)
+		if (wbuf[i].wb_len > 0 && fd_lookup(i, &fd) == 0 &&
+			fd->fd_dev_id == devfile.dev_id)
+			wbuf_flush(fd);
+}
+
+// Hold back the first bytes of the n at 'buf' for fd, as many as fit
+// before the end of the page they start in, sending those held first
+// if the new ones do not follow on from them.
+// Returns the number of bytes taken, < 0 on error.
+static ssize_t
+wbuf_write(struct Fd *fd, const void *buf, size_t n)
+{
+	struct WriteBuf *wb = &wbuf[fd2num(fd)];
+	int r;
+
+	if (wb->wb_len > 0 && (wb->wb_fileid != fd->fd_file.id ||
+						   wb->wb_offset + wb->wb_len != fd->fd_offset) &&
+		(r = wbuf_flush(fd)) < 0)
+		return r;
+	if (wb->wb_len == 0)
+	{
+		wb->wb_fileid = fd->fd_file.id;
+		wb->wb_offset = fd->fd_offset;
+		fork_flush = wbuf_flush_all;
+	}
+
+	n = MIN(n, PGSIZE - PGOFF(wb->wb_offset) - wb->wb_len);
+	memcpy(wbuf_data[fd2num(fd)] + PGOFF(wb->wb_offset) + wb->wb_len, buf, n);
+	wb->wb_len += n;
+	fd->fd_offset += n;
+	if (PGOFF(wb->wb_offset + wb->wb_len) == 0 && (r = wbuf_flush(fd)) < 0)
+	{
+		fd->fd_offset -= n;
+		return r;
+	}
+	return n;
+}
+
+static int
+devfile_fsync(struct Fd *fd)
+{
+	return wbuf_flush(fd);
+}
+
 // Flush the file descriptor.  After this the fileid is invalid.
 //
 // This function is called by fd_close.  fd_close will take care of
@@ -100,8 +346,11 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	int r = wbuf_flush(fd), r2;
+
+	fcache_drop(fd);
+	r2 = fsipc_small(FSREQ_FLUSH, fd->fd_file.id);
+	return r < 0 ? r : r2;
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -116,19 +365,91 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
+	// Reads smaller than a window come from fd's window instead
+	// (see fcache_read); larger ones get their data back in up to
+	// FSIPC_MAXPAGES pages mapped at FSIPCDATA.
 	int r;
 
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+	if (n < FCACHE_NPAGES * PGSIZE)
+		return fcache_read(fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	r = fsipc_pages(FSREQ_READ, &fsipcbuf,
+					PTE_P | PTE_W | PTE_U | IPC_RECVPAGES(FSIPC_MAXPAGES),
+					(void *) FSIPCDATA);
+	if (r < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	assert(ROUNDUP(r, PGSIZE) / PGSIZE <= thisenv->env_ipc_npages);
+	memmove(buf, (void *) FSIPCDATA, r);
 	return r;
 }
 
 
+// How many of the npages pages at the page-aligned 'buf' can be
+// donated to the file server: those mapped with 4K pages that are not
+// PTE_SHARE, which the server could see change under it.
+static size_t
+donatable_pages(const void *buf, size_t npages)
+{
+	uintptr_t va = (uintptr_t) buf;
+	size_t i;
+
+	for (i = 0; i < npages; i++, va += PGSIZE)
+		if ((uvpd[PDX(va)] & (PTE_P | PTE_PS)) != PTE_P ||
+			(uvpt[PGNUM(va)] & (PTE_P | PTE_U | PTE_SHARE)) != (PTE_P | PTE_U))
+			break;
+	return i;
+}
+
+// Write the first npages pages at the page-aligned 'buf' with
+// FSREQ_WRITE_PAGES.  The pages follow the request page at FSIPCDATA
+// mapped copy-on-write, as fork shares pages: our own mappings become
+// copy-on-write first, so that neither side sees the other's later
+// writes, and the server takes those holding whole blocks into its
+// cache as they are.
+static ssize_t
+devfile_write_pages(struct Fd *fd, const void *buf, size_t npages)
+{
+	struct PageMapOp op[2 + FSIPC_MAXPAGES];
+	struct Fsreq_write *req;
+	uintptr_t va = (uintptr_t) buf;
+	size_t i, nops = 0, done;
+	ssize_t r;
+
+	op[nops].srcva = PAGEMAP_ALLOC;
+	op[nops].dstva = FSIPCDATA;
+	op[nops].npages = 1;
+	op[nops++].perm = PTE_P | PTE_W | PTE_U;
+	for (i = 0; i < npages; i++, va += PGSIZE)
+		if (uvpt[PGNUM(va)] & PTE_W)
+		{
+			op[nops].srcva = op[nops].dstva = va;
+			op[nops].npages = 1;
+			op[nops++].perm = PTE_P | PTE_U | PTE_COW;
+		}
+	op[nops].srcva = (uintptr_t) buf;
+	op[nops].dstva = FSIPCDATA + PGSIZE;
+	op[nops].npages = npages;
+	op[nops++].perm = PTE_P | PTE_U | PTE_COW;
+	if ((r = sys_page_map_batch(0, 0, op, nops, &done)) < 0)
+		return r;
+
+	req = (struct Fsreq_write *) FSIPCDATA;
+	req->req_fileid = fd->fd_file.id;
+	req->req_n = npages * PGSIZE;
+	r = fsipc_pages(FSREQ_WRITE_PAGES, req,
+					PTE_P | PTE_U | IPC_SENDPAGES(1 + npages), NULL);
+	if (r < 0)
+		return r;
+	assert(r <= npages * PGSIZE);
+	return r;
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -142,33 +463,232 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 	// LAB 5: Your code here
+	// Writes larger than req_buf send the request page and up to
+	// FSIPC_MAXPAGES data pages from FSIPCDATA instead, or, from a
+	// page-aligned buffer, the buffer's own pages.
+	// Writes smaller than a page are held back and coalesced (see
+	// wbuf_write).
+	struct Fsreq_write *req;
+	struct PageMapOp op;
+	size_t npages, done;
+	ssize_t r;
 
-	fsipcbuf.write.req_fileid = fd->fd_file.id;
-	fsipcbuf.write.req_n = n;
-	if (n > sizeof(fsipcbuf.write.req_buf))
-		n = sizeof(fsipcbuf.write.req_buf);
+	if (n < PGSIZE)
+		return wbuf_write(fd, buf, n);
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+	if (PGOFF(buf) == 0 && n >= PGSIZE &&
+		(npages = donatable_pages(buf, MIN(n / PGSIZE, FSIPC_MAXPAGES))) > 0)
+		return devfile_write_pages(fd, buf, npages);
 
-	memcpy(fsipcbuf.write.req_buf, buf, n);
+	if (n <= sizeof(fsipcbuf.write.req_buf))
+	{
+		fsipcbuf.write.req_fileid = fd->fd_file.id;
+		fsipcbuf.write.req_n = n;
+		memcpy(fsipcbuf.write.req_buf, buf, n);
+		if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		return r;
+	}
 
-	ssize_t r = fsipc(FSREQ_WRITE, NULL);
+	// Fresh pages: those at FSIPCDATA may be a read reply's, which
+	// are read-only and still shared with the server.
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+	npages = 1 + ROUNDUP(n, PGSIZE) / PGSIZE;
+	op.srcva = PAGEMAP_ALLOC;
+	op.dstva = FSIPCDATA;
+	op.npages = npages;
+	op.perm = PTE_P | PTE_W | PTE_U;
+	if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+		return r;
+
+	req = (struct Fsreq_write *) FSIPCDATA;
+	req->req_fileid = fd->fd_file.id;
+	req->req_n = n;
+	memcpy((void *) (FSIPCDATA + PGSIZE), buf, n);
+	r = fsipc_pages(FSREQ_WRITE, req,
+					PTE_P | PTE_U | IPC_SENDPAGES(npages), NULL);
 	if (r < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
 	return r;
 }
 
+// Describe the pieces of iov in the ranges of a vectored request,
+// starting 'skip' bytes into iov[0]: up to FSIPC_MAXIOV of them, with
+// at most 'max' bytes in all, the last cut short if need be.  Stores
+// how many ranges in *niov.  Returns the number of bytes.
+static size_t
+fsiov_fill(const struct iovec *iov, int iovcnt, size_t skip, size_t max,
+		   struct Fsiov *fiov, uint32_t *niov)
+{
+	size_t n = 0;
+	uint32_t i;
+
+	for (i = 0; i < iovcnt && i < FSIPC_MAXIOV && n < max; i++, skip = 0)
+	{
+		fiov[i].iov_offset = iov[i].iov_offset + skip;
+		fiov[i].iov_len = MIN(iov[i].iov_len - skip, max - n);
+		n += fiov[i].iov_len;
+	}
+	*niov = i;
+	return n;
+}
+
+// Copy n bytes between 'data' and the pieces of iov, into them if
+// to_iov is set and out of them otherwise, starting *skip bytes into
+// iov[*k], and move *k and *skip past them.
+static void
+fsiov_copy(const struct iovec *iov, int *k, size_t *skip, char *data,
+		   size_t n, bool to_iov)
+{
+	size_t len;
+
+	while (n > 0)
+	{
+		len = MIN(iov[*k].iov_len - *skip, n);
+		if (to_iov)
+			memmove((char *) iov[*k].iov_base + *skip, data, len);
+		else
+			memmove(data, (char *) iov[*k].iov_base + *skip, len);
+		data += len;
+		n -= len;
+		if ((*skip += len) == iov[*k].iov_len)
+		{
+			++*k;
+			*skip = 0;
+		}
+	}
+}
+
+// Read the pieces of iov with FSREQ_READV, as many at once as one
+// request and reply hold.
+//
+// Returns:
+//	The number of bytes read, short at the end of the file.
+//	< 0 on error.
+static ssize_t
+devfile_preadv(struct Fd *fd, const struct iovec *iov, int iovcnt)
+{
+	struct Fsreq_readv *req = &fsipcbuf.readv;
+	size_t total = 0, skip = 0, n;
+	char *data;
+	int k = 0;
+	ssize_t r;
+
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+	for (;;)
+	{
+		while (k < iovcnt && skip == iov[k].iov_len)
+		{
+			k++;
+			skip = 0;
+		}
+		if (k == iovcnt)
+			return total;
+
+		req->req_fileid = fd->fd_file.id;
+		n = fsiov_fill(iov + k, iovcnt - k, skip, FSIPC_MAXPAGES * PGSIZE,
+					   req->req_iov, &req->req_niov);
+		if (n <= sizeof(fsipcbuf.readRet.ret_buf))
+		{
+			r = fsipc(FSREQ_READV, NULL);
+			data = fsipcbuf.readRet.ret_buf;
+		} else
+		{
+			r = fsipc_pages(FSREQ_READV, &fsipcbuf,
+							PTE_P | PTE_W | PTE_U | IPC_RECVPAGES(FSIPC_MAXPAGES),
+							(void *) FSIPCDATA);
+			data = (char *) FSIPCDATA;
+		}
+		if (r < 0)
+			return total > 0 ? total : r;
+		assert(r <= n);
+		fsiov_copy(iov, &k, &skip, data, r, true);
+		total += r;
+		if (r < n)
+			return total;
+	}
+}
+
+// Write the pieces of iov with FSREQ_WRITEV, as many at once as one
+// request holds: their data in req_buf, or in up to FSIPC_MAXPAGES
+// pages following the request page.
+//
+// Returns:
+//	The number of bytes written.
+//	< 0 on error.
+static ssize_t
+devfile_pwritev(struct Fd *fd, const struct iovec *iov, int iovcnt)
+{
+	struct Fsreq_writev *req;
+	struct PageMapOp op;
+	size_t total = 0, skip = 0, n, npages, done;
+	int k = 0;
+	ssize_t r;
+
+	// wbuf_flush sends its bytes through here, with none held
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+	for (;;)
+	{
+		while (k < iovcnt && skip == iov[k].iov_len)
+		{
+			k++;
+			skip = 0;
+		}
+		if (k == iovcnt)
+			return total;
+
+		req = &fsipcbuf.writev;
+		req->req_fileid = fd->fd_file.id;
+		n = fsiov_fill(iov + k, iovcnt - k, skip, FSIPC_MAXPAGES * PGSIZE,
+					   req->req_iov, &req->req_niov);
+		if (n <= sizeof(req->req_buf))
+		{
+			fsiov_copy(iov, &k, &skip, req->req_buf, n, false);
+			r = fsipc(FSREQ_WRITEV, NULL);
+		} else
+		{
+			// Fresh pages, as for devfile_write
+			npages = 1 + ROUNDUP(n, PGSIZE) / PGSIZE;
+			op.srcva = PAGEMAP_ALLOC;
+			op.dstva = FSIPCDATA;
+			op.npages = npages;
+			op.perm = PTE_P | PTE_W | PTE_U;
+			if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+				return total > 0 ? total : r;
+			memcpy((void *) FSIPCDATA, req, offsetof(struct Fsreq_writev, req_buf));
+			req = (struct Fsreq_writev *) FSIPCDATA;
+			fsiov_copy(iov, &k, &skip, (char *) (FSIPCDATA + PGSIZE), n, false);
+			r = fsipc_pages(FSREQ_WRITEV, req,
+							PTE_P | PTE_U | IPC_SENDPAGES(npages), NULL);
+		}
+		if (r < 0)
+			return total > 0 ? total : r;
+		assert(r <= n);
+		total += r;
+		if (r < n)
+			return total;
+	}
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
 	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
 	st->st_size = fsipcbuf.statRet.ret_size;
 	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	st->st_version = fsipcbuf.statRet.ret_version;
 	return 0;
 }
 
@@ -176,12 +696,175 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
+	int r;
+
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
 
+// Give open file 'fdnum' disk blocks for the 'len' bytes from 'offset'
+// that have none, in long runs, growing it to cover them if it is
+// shorter; the new blocks read as zeros.  Like posix_fallocate, so
+// that later writes there neither allocate nor scatter the file.
+int
+fallocate(int fdnum, off_t offset, off_t len)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+	fsipcbuf.fallocate.req_fileid = fd->fd_file.id;
+	fsipcbuf.fallocate.req_offset = offset;
+	fsipcbuf.fallocate.req_len = len;
+	return fsipc(FSREQ_FALLOCATE, NULL);
+}
+
+// Map the file server's block-cache pages holding up to 'n' bytes of
+// file 'fdnum' from 'offset', a multiple of PGSIZE, read-only at
+// 'dstva'.  At most FSIPC_MAXPAGES pages are mapped at once.
+//
+// Returns:
+//	The number of bytes mapped, 0 at the end of the file.
+//	< 0 on error.
+ssize_t
+file_map(int fdnum, off_t offset, size_t n, void *dstva)
+{
+	struct Fd *fd;
+	size_t npages;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = wbuf_flush(fd)) < 0)
+		return r;
+
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+	npages = MAX(ROUNDUP(n, PGSIZE) / PGSIZE, 1);
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	fsipcbuf.map.req_n = n;
+	r = fsipc_pages(FSREQ_MAP, &fsipcbuf,
+					PTE_P | PTE_W | PTE_U | IPC_RECVPAGES(npages), dstva);
+	if (r < 0)
+		return r;
+	assert(r <= n);
+	assert(ROUNDUP(r, PGSIZE) / PGSIZE <= thisenv->env_ipc_npages);
+	return r;
+}
+
+// Read as many entries of directory 'fdnum' from its seek position as
+// fit in 'n' bytes of 'buf', in one request, packed as struct Dirents
+// (each d_reclen bytes after the last), and move the seek position
+// past them.  Free entries are left out.
+//
+// Returns:
+//	The bytes of entries read, 0 at the end of the directory.
+//	< 0 on error.
+ssize_t
+readdir(int fdnum, void *buf, size_t n)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+	fsipcbuf.readdir.req_offset = fd->fd_offset;
+	fsipcbuf.readdir.req_n = MIN(n, sizeof(fsipcbuf.readdirRet.ret_buf));
+	if ((r = fsipc(FSREQ_READDIR, NULL)) < 0)
+		return r;
+	assert(r <= n);
+	memmove(buf, fsipcbuf.readdirRet.ret_buf, r);
+	fd->fd_offset = fsipcbuf.readdirRet.ret_offset;
+	return r;
+}
+
+// Where mmap places files: the pages from MMAPBASE up to FDTABLE.
+#define MMAPBASE    0xC0000000
+#define MMAPTOP     0xD0000000
+
+// Is the page at va mapped?
+static bool
+page_is_mapped(uintptr_t va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Map 'len' bytes of file 'fdnum' from 'offset', a multiple of PGSIZE,
+// read-only at the lowest free stretch of the mmap area, straight from
+// the file server's block cache: no data is copied.  The pages are
+// marked PTE_SHARE, so children share them too.  They are the block
+// cache's own, so may or may not show later writes to the file.  Pages
+// past the end of the file are left unmapped.
+//
+// Returns the address of the mapping, or NULL on error.
+void *
+mmap(int fdnum, off_t offset, size_t len)
+{
+	uintptr_t va, start = MMAPBASE;
+	size_t npages = ROUNDUP(len, PGSIZE) / PGSIZE, off;
+	ssize_t r;
+
+	if (len == 0 || offset < 0 || offset % PGSIZE != 0 ||
+		npages > (MMAPTOP - MMAPBASE) / PGSIZE)
+		return NULL;
+	for (va = MMAPBASE; va - start < npages * PGSIZE; va += PGSIZE)
+	{
+		if (va + (npages * PGSIZE - (va - start)) > MMAPTOP)
+			return NULL;
+		if (page_is_mapped(va))
+			start = va + PGSIZE;
+	}
+
+	for (off = 0; off < len; off += ROUNDUP(r, PGSIZE))
+	{
+		r = file_map(fdnum, offset + off, len - off, (void *) (start + off));
+		if (r < 0)
+		{
+			munmap((void *) start, off);
+			return NULL;
+		}
+		if (r == 0)
+			break;
+	}
+	return (void *) start;
+}
+
+// Unmap the 'len' bytes at 'addr' that mmap mapped.
+int
+munmap(void *addr, size_t len)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	if ((uintptr_t) addr % PGSIZE != 0 || (uintptr_t) addr < MMAPBASE ||
+		(uintptr_t) addr + len > MMAPTOP || (uintptr_t) addr + len < (uintptr_t) addr)
+		return -E_INVAL;
+	if (len == 0)
+		return 0;
+	op.srcva = 0;
+	op.dstva = (uintptr_t) addr;
+	op.npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+	op.perm = 0;
+	return sys_page_map_batch(0, 0, &op, 1, &done);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -189,6 +872,51 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_small(FSREQ_SYNC, 0);
+}
+
+// Have the file server write back and drop every block it caches, so
+// that the next accesses go to the disk (see user/fsbench.c).
+int
+drop_caches(void)
+{
+	return fsipc_small(FSREQ_DROP_CACHE, 0);
+}
+
+// Copy up to n bytes from file fdin's seek position to file fdout's in
+// the file server, without the data coming through this environment,
+// and move both positions on (see FSREQ_SPLICE).  Returns the number
+// of bytes copied, 0 at the end of fdin, < 0 on error.
+ssize_t
+fsplice(int fdin, int fdout, size_t n)
+{
+	struct Fd *in, *out;
+	int r;
+
+	if ((r = fd_lookup(fdin, &in)) < 0 || (r = fd_lookup(fdout, &out)) < 0)
+		return r;
+	if (in->fd_dev_id != devfile.dev_id || out->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = wbuf_flush(in)) < 0 || (r = wbuf_flush(out)) < 0)
+		return r;
+
+	fsipcbuf.splice.req_in = in->fd_file.id;
+	fsipcbuf.splice.req_out = out->fd_file.id;
+	fsipcbuf.splice.req_n = n;
+	return fsipc(FSREQ_SPLICE, NULL);
+}
+
+// Fill in *st with the file server's counters (see struct FsStats), and
+// have it count afresh if reset is set.
+int
+fs_stats(struct FsStats *st, bool reset)
+{
+	int r;
+
+	fsipcbuf.stats.req_reset = reset;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet.ret_stats;
+	return 0;
 }
 
@@ -1,172 +1,115 @@
 // implement fork from user space
 
 #include <inc/string.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW        0x800
-
-//
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
-//
-static void
-pgfault(struct UTrapframe *utf)
-{
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	// Hint:
-	//   Use the read-only page table mappings at uvpt
-	//   (see <inc/memlayout.h>).
-	// LAB 4: Your code here.
-
-	pde_t pde_addr = uvpd[PDX(addr)];
-	pte_t pte_addr = uvpt[PGNUM(addr)];
-
-	// if not write or not cow
-	if ((err & FEC_WR) == 0 ||
-		(pde_addr & PTE_P) == 0 ||
-		(~pte_addr & (PTE_P | PTE_COW)) != 0)
-		panic("pgfault: not write or not COW, %p\n", addr);
-
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	// Hint:
-	//   You should make three system calls.
-	// LAB 4: Your code here.
-	addr = (void *) ROUNDDOWN(addr, PGSIZE);
-
-	int ret = sys_page_alloc(0, PFTEMP, PTE_P | PTE_U | PTE_W);
-	if (ret < 0)
-		panic("sys page alloc: %e\n", ret);
-
-	memcpy(PFTEMP, addr, PGSIZE);
-	ret = sys_page_map(0, PFTEMP, 0, addr, PTE_P | PTE_U | PTE_W);
-	if (ret < 0)
-		panic("sys page map: %e\n", ret);
-
-	ret = sys_page_unmap(0, PFTEMP);
-	if (ret < 0)
-		panic("sys page unmap: %e\n", ret);
-}
-
-//
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	// LAB 4: Your code here.
-
-	void *addr = (void *) (pn * PGSIZE);
-	uint32_t perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
-	int r;
-
-	// Make a page copy on write if its writable and not shared
-	if (((perm & PTE_W) && !(perm & PTE_SHARE)) || (perm & PTE_COW))
-	{
-		perm |= PTE_COW;
-		perm &= ~PTE_W;
-	}
-
-	r = sys_page_map(0, addr, envid, addr, perm);
-	if (r < 0)
-		return r;
-
-	// Change source environment page permissions
-	r = sys_page_map(0, addr, 0, addr, perm);
-	if (r < 0)
-		return r;
-
-	return 0;
-}
-
-extern void _pgfault_upcall(void);
+// Set once a file has writes held back, to write them out before a
+// fork, so that the child does not write them again (see lib/file.c)
+void (*fork_flush)(void);
 
 //
 // User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Let the kernel create the child and copy our address space
+// copy-on-write in one system call (see sys_fork_cow).  The kernel
+// also resolves the copy-on-write faults that follow in both, without
+// a trip through our page fault upcall, if we have one.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
-//
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
 fork(void)
 {
-	// This will be set for both father and child
-	set_pgfault_handler(pgfault);
+	envid_t child_envid;
 
+	if (fork_flush)
+		fork_flush();
 	// Fork!
-	envid_t child_envid = sys_exofork();
+	child_envid = sys_fork_cow();
 	if (child_envid < 0)
 		return child_envid;
 
 	// Child
 	if (child_envid == 0)
-	{
 		thisenv = &envs[ENVX(sys_getenvid())];
-		return child_envid;
-	}
-	/* father: */
-
-	// Set upcall for child
-	sys_env_set_pgfault_upcall(child_envid, _pgfault_upcall);
-	// Allocate new exception stack for child
-	sys_page_alloc(child_envid, (void *) (UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W);
-
-	unsigned int num_pages = PGNUM(UTOP);
-	for (size_t i = 0; i < num_pages; ++i)
-	{
-		uintptr_t addr = i * PGSIZE;
-		if (addr == UXSTACKTOP - PGSIZE)
-			continue;
-
-		pde_t pde_addr = uvpd[PDX(addr)];
+	return child_envid;
+}
 
-		if ((pde_addr & PTE_P) == 0)
-			continue;
+// The thread using each thread slot (see inc/memlayout.h), or
+// SLOT_CLAIMED while sfork sets it up, or 0.  A slot whose thread has
+// exited is free again: env_free retires its id at once.
+#define SLOT_CLAIMED    1
+static volatile uint32_t slot_owner[NTHREADS];
 
-		pte_t pte_addr = uvpt[i];
-		if ((pte_addr & PTE_P) == 0)
-			continue;
+static bool
+slot_free(uint32_t owner)
+{
+	return owner == 0 ||
+		   (owner != SLOT_CLAIMED && envs[ENVX(owner)].env_id != (envid_t) owner);
+}
 
-		int ret = duppage(child_envid, i);
-		if (ret < 0)
-		{
-			panic("duppage bad %d\n", ret);
-//			return ret;
-		}
-	}
-	sys_env_set_status(child_envid, ENV_RUNNABLE);
-	return child_envid;
+// Where a thread starts, on its own stack.  Returning from fn ends the
+// thread alone: the address space and open files live on in the others.
+static void
+thread_start(void (*fn)(void *), void *arg)
+{
+	thisenv = &envs[ENVX(sys_getenvid())];
+	fn(arg);
+	sys_env_destroy(0);
 }
 
-// Challenge!
-int
-sfork(void)
+//
+// Start a thread running fn(arg): an environment that shares all of our
+// address space (see sys_exofork_shared), with a stack, exception stack
+// and thisenv of its own in a free thread slot.  Threads run in
+// parallel on as many CPUs as there are.
+//
+// Returns: the thread's envid, < 0 on error.
+//
+envid_t
+sfork(void (*fn)(void *), void *arg)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	struct PageMapOp ops[3];
+	uintptr_t slot;
+	uint32_t owner, *sp;
+	size_t done;
+	envid_t id;
+	int i, r;
+
+	// The thread inherits our page fault upcall
+	pgfault_init();
+
+	for (i = 0; i < NTHREADS; i++)
+		if (slot_free(owner = slot_owner[i]) &&
+			cmpxchg(&slot_owner[i], owner, SLOT_CLAIMED) == owner)
+			break;
+	if (i == NTHREADS)
+		return -E_NO_FREE_ENV;
+	slot = UTHREADS + i * THREADSLOT;
+
+	// Fresh pages for its thisenv, exception stack and stack
+	ops[0] = (struct PageMapOp) {PAGEMAP_ALLOC, slot, 1, PTE_P | PTE_U | PTE_W};
+	ops[1] = (struct PageMapOp) {PAGEMAP_ALLOC, slot + THREAD_XSTACKTOP - PGSIZE, 1,
+								 PTE_P | PTE_U | PTE_W};
+	ops[2] = (struct PageMapOp) {PAGEMAP_ALLOC, slot + THREAD_STACK,
+								 (THREADSLOT - THREAD_STACK) / PGSIZE, PTE_P | PTE_U | PTE_W};
+	if ((r = sys_page_map_batch(0, 0, ops, ARRAY_SIZE(ops), &done)) < 0)
+		goto fail;
+
+	// thread_start's arguments, above a return address it never uses
+	sp = (uint32_t *) (slot + THREADSLOT) - 3;
+	sp[0] = 0;
+	sp[1] = (uint32_t) fn;
+	sp[2] = (uint32_t) arg;
+	if ((id = sys_exofork_shared(thread_start, sp, (void *) (slot + THREAD_XSTACKTOP))) < 0)
+	{
+		r = id;
+		goto fail;
+	}
+	slot_owner[i] = id;
+	return id;
+
+fail:
+	slot_owner[i] = 0;
+	return r;
 }
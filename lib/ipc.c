@@ -21,10 +21,19 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_pages(from_env_store, pg, 1, perm_store);
+}
+
+// The body of the ipc_recv family: receive from 'from', or anyone if
+// that is 0, giving up after 'msec' milliseconds if that is not 0.
+static int32_t
+ipc_recv_select(envid_t from, envid_t *from_env_store, void *pg,
+				unsigned npages, int *perm_store, uint32_t msec)
 {
 	if (pg == NULL)
 		pg = (void *) (UTOP + PGSIZE); // addresses above UTOP are not valid
-	int ret = sys_ipc_recv(pg);
+	int ret = sys_ipc_recv_from(pg, npages, from, msec);
 	if (ret < 0)
 	{
 		if (from_env_store != NULL)
@@ -41,30 +50,123 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return thisenv->env_ipc_value;
 }
 
+// Like ipc_recv, but accept up to 'npages' consecutive pages at 'pg'.
+// thisenv->env_ipc_npages says how many arrived.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, unsigned npages,
+			   int *perm_store)
+{
+	return ipc_recv_timeout(from_env_store, pg, npages, perm_store, 0);
+}
+
+// Like ipc_recv_pages, but give up after 'msec' milliseconds, returning
+// -E_TIMEOUT, if that is not 0.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, unsigned npages,
+				 int *perm_store, uint32_t msec)
+{
+	return ipc_recv_select(0, from_env_store, pg, npages, perm_store, msec);
+}
+
+// Like ipc_recv_timeout, but accept a message only from 'from'.  Other
+// senders stay blocked until a receive that takes them, so a client
+// can wait for one server's reply while others' are still coming.
+int32_t
+ipc_recv_from(envid_t from, void *pg, unsigned npages, int *perm_store,
+			  uint32_t msec)
+{
+	return ipc_recv_select(from, NULL, pg, npages, perm_store, msec);
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// This function blocks in the kernel until 'toenv' receives it.
+// It panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	if (pg == NULL)
 		pg = (void *) (UTOP + PGSIZE); // addresses above UTOP are not valid
 
+	int ret = sys_ipc_send(to_env, val, pg, perm);
+	if (ret < 0)
+		panic("ipc_send error: %e\n", ret);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' as
+// ipc_send does, then receive its reply as ipc_recv(NULL, rcv_pg,
+// perm_store) does, and return the reply's value.  The kernel switches
+// straight to 'to_env', so a request to a waiting server is served
+// without waiting for the scheduler.  The reply need not come from
+// 'to_env'.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+		 void *rcv_pg, int *perm_store)
+{
 	int ret;
-	while (1)
-	{
-		ret = sys_ipc_try_send(to_env, val, pg, perm);
-		if (ret == 0)
-			break;
-		if (ret != -E_IPC_NOT_RECV)
-			panic("try_send error: %e\n", ret);
-		sys_yield();
-	}
+
+	if (pg == NULL)
+		pg = (void *) (UTOP + PGSIZE);
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) (UTOP + PGSIZE);
+
+	if ((ret = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0)
+		panic("ipc_call error: %e\n", ret);
+
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' and the words w0 and w1 to 'to_env', with no page; the
+// receiver finds the words in thisenv->env_ipc_words.  Blocks and
+// panics as ipc_send does.
+void
+ipc_send_words(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1)
+{
+	int ret = sys_ipc_send_words(to_env, val, w0, w1);
+	if (ret < 0)
+		panic("ipc_send_words error: %e\n", ret);
+}
+
+// Send 'val' and the words w0 and w1 to 'to_env' as ipc_send_words
+// does, then receive a reply with no page and return its value: a
+// small request that needs no argument page.  Panics as ipc_call does.
+int32_t
+ipc_call_words(envid_t to_env, uint32_t val, uint32_t w0, uint32_t w1)
+{
+	int ret;
+
+	if ((ret = sys_ipc_call_words(to_env, val, w0, w1)) < 0)
+		panic("ipc_call_words error: %e\n", ret);
+	return thisenv->env_ipc_value;
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then receive the next request as ipc_recv(from_env_store, rcv_pg,
+// perm_store) does and return its value: one system call for a
+// server's reply and its wait for the next request.  A reply that
+// cannot be delivered, say because the client gave up waiting, is
+// dropped.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+			   envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	void *dstva = rcv_pg;
+
+	if (pg == NULL)
+		pg = (void *) (UTOP + PGSIZE);
+	if (dstva == NULL)
+		dstva = (void *) (UTOP + PGSIZE);
+
+	if (sys_ipc_reply_wait(to_env, val, pg, perm, dstva) < 0)
+		return ipc_recv_pages(from_env_store, rcv_pg,
+							  IPC_PERM_RECVPAGES(perm), perm_store);
+
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -74,8 +176,42 @@ envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
+	for (i = 0; i < uinfo.nenv; i++)
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
 	return 0;
 }
+
+// Find the environment registered as service 'name' (see
+// sys_service_register), straight from the registry in the kernel info
+// page: no scan of envs[], no system call.
+// Returns 0 if no such service exists.
+envid_t
+ipc_find_service(const char *name)
+{
+	const volatile struct UinfoService *s;
+	uint32_t seq, h, i;
+	envid_t envid;
+
+	h = uinfo_service_hash(name);
+	do
+	{
+		while ((seq = uinfo.service_seq) & 1)
+			;
+		barrier();
+		envid = 0;
+		for (i = 0; i < UINFO_NSERVICE; i++)
+		{
+			s = &uinfo.services[(h + i) & (UINFO_NSERVICE - 1)];
+			if (s->name[0] == '\0')
+				break;
+			if (strncmp((const char *) s->name, name, SERVICE_NAMELEN) == 0)
+			{
+				envid = s->envid;
+				break;
+			}
+		}
+		barrier();
+	} while (uinfo.service_seq != seq);
+	return envid;
+}
@@ -1,15 +1,13 @@
-// Called from entry.S to get us going.
-// entry.S already took care of defining envs, pages, uvpd, and uvpt.
+// Called from entry.S to get us going, with the program's umain.
+// uvars.S already took care of defining envs, pages, uvpd, and uvpt.
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
-
-const volatile struct Env *thisenv;
+const volatile struct Env *thisenv_main;
 const char *binaryname = "<unknown>";
 
 void
-libmain(int argc, char **argv)
+libmain(void (*main)(int argc, char **argv), int argc, char **argv)
 {
 	// set thisenv to point at our Env structure in envs[].
 	thisenv = &envs[ENVX(sys_getenvid())];
@@ -19,7 +17,7 @@ libmain(int argc, char **argv)
 		binaryname = argv[0];
 
 	// call user main routine
-	umain(argc, argv);
+	main(argc, argv);
 
 	// exit gracefully
 	exit();
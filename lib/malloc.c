@@ -2,145 +2,456 @@
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Size-class slab malloc/free.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * Requests of up to SLAB_MAXOBJ bytes are rounded up to one of
+ * NCLASSES size classes and carved out of slab pages.  A slab page
+ * holds objects of one class after its header (struct Slab).  Freed
+ * objects go on their slab's free list and are handed out again first;
+ * a slab with free objects sits on its class's list of partial slabs.
+ * A slab that empties is unmapped, except that each class keeps one
+ * spare, so a malloc/free pair at the edge of a slab does not map and
+ * unmap a page each time.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Larger requests get whole pages of their own, page-aligned, with no
+ * header.  Which heap pages are in use, which start a large block and
+ * which run on into the next page of one are kept in bitmaps, one page
+ * each, at the bottom of the heap, mapped by the first malloc.
+ *
+ * User-level threads (net/lwip/jos/arch/thread.c) switch only in
+ * thread_yield, which nothing here calls, so they can all share this
+ * heap without a lock.
  */
-enum {
-	MAXMALLOC = 1024 * 1024    /* max size of one allocated chunk */
+
+#define HEAPBASE    0x08000000
+#define HEAPTOP     0x10000000
+#define HEAPSIZE    (HEAPTOP - HEAPBASE)
+#define HEAPPAGES   (HEAPSIZE / PGSIZE)
+#define NMAPPAGES   3       // heap_used, heap_large and heap_more
+
+struct Slab {
+	uint16_t s_class;       // index in classes[]
+	uint16_t s_nfree;       // objects on s_free
+	void *s_free;           // free objects, each holding the next
+	struct Slab *s_next;    // on the class's partial list
+	struct Slab *s_prev;
+};
+
+// Multiples of 16, so every object is 16-byte aligned, chosen to leave
+// little of a page unused.
+static const uint16_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 816, 1360, 2032
 };
+#define NCLASSES    ARRAY_SIZE(class_size)
+#define SLAB_MAXOBJ 2032
+#define SLAB_OBJS(c) ((PGSIZE - sizeof(struct Slab)) / class_size[c])
+
+// The class of each request size, by 16-byte steps, so that lwIP's
+// mem_malloc and every other caller find one with a lookup rather than
+// a walk of class_size.  Filled in by heap_init.
+static uint8_t size_classes[SLAB_MAXOBJ / 16 + 1];
 
-#define PTE_CONTINUED 0x200
+struct SizeClass {
+	struct Slab *sc_partial;    // slabs with free objects, in use
+	struct Slab *sc_spare;      // an empty slab kept mapped, or 0
+	size_t sc_nslabs;           // slabs mapped, the spare included
+	size_t sc_ninuse;           // objects handed out
+};
+static struct SizeClass classes[NCLASSES];
 
-static uint8_t *mbegin = (uint8_t *) 0x08000000;
-static uint8_t *mend = (uint8_t *) 0x10000000;
-static uint8_t *mptr;
+static uint32_t *heap_used;     // page mapped
+static uint32_t *heap_large;    // page starts a large block
+static uint32_t *heap_more;     // next page is in the same large block
+static uint32_t heap_next;      // where the next search for pages starts
+static size_t nlarge, nlarge_pages;
+static size_t inuse, peak, nfailed;
 
-static int
-isfree(void *v, size_t n)
+// Count 'n' more bytes handed out, for malloc_stats.
+static void
+account(size_t n)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	inuse += n;
+	peak = MAX(peak, inuse);
+}
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-			|| ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
-			return 0;
-	return 1;
+static bool
+bit_test(const uint32_t *map, uint32_t i)
+{
+	return map[i / 32] & (1 << (i % 32));
 }
 
-void *
-malloc(size_t n)
+static void
+bit_set(uint32_t *map, uint32_t i)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
-	void *v;
+	map[i / 32] |= 1 << (i % 32);
+}
 
-	if (mptr == 0)
-		mptr = mbegin;
+static void
+bit_clear(uint32_t *map, uint32_t i)
+{
+	map[i / 32] &= ~(1 << (i % 32));
+}
+
+static void *
+heap_va(uint32_t pg)
+{
+	return (void *) (HEAPBASE + pg * PGSIZE);
+}
 
-	n = ROUNDUP(n, 4);
+static uint32_t
+heap_pg(void *va)
+{
+	return ((uintptr_t) va - HEAPBASE) / PGSIZE;
+}
 
-	if (n >= MAXMALLOC)
-		return 0;
+// Map the bitmaps and fill in size_classes.  Returns 0 on success,
+// < 0 on error.
+static int
+heap_init(void)
+{
+	uint32_t i;
+	int r, c;
+
+	for (i = 0; i < NMAPPAGES; i++)
+		if ((r = sys_page_alloc(0, heap_va(i), PTE_P | PTE_U | PTE_W)) < 0)
+		{
+			while (i-- > 0)
+				sys_page_unmap(0, heap_va(i));
+			return r;
+		}
+	heap_large = heap_va(1);
+	heap_more = heap_va(2);
+	heap_used = heap_va(0);
+	for (i = 0; i < NMAPPAGES; i++)
+		bit_set(heap_used, i);
+	heap_next = NMAPPAGES;
+	for (i = 0, c = 0; i < ARRAY_SIZE(size_classes); i++)
+	{
+		while (class_size[c] < i * 16)
+			c++;
+		size_classes[i] = c;
+	}
+	return 0;
+}
+
+// Find n free pages in a row, from heap_next on, wrapping around once.
+// Returns the first one's number, or -1 if there are none.
+static int
+heap_find(uint32_t n)
+{
+	uint32_t i, run = 0, scanned;
 
-	if ((uintptr_t) mptr % PGSIZE)
+	for (i = heap_next, scanned = 0; scanned < HEAPPAGES + n; i++, scanned++)
 	{
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t *) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE)
+		if (i == HEAPPAGES)
 		{
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
+			i = 0;
+			run = 0;
 		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);    /* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
+		// Skip 32 pages in use at a time
+		if (run == 0 && i % 32 == 0 && heap_used[i / 32] == ~0U)
+		{
+			i += 31;
+			scanned += 31;
+		} else if (bit_test(heap_used, i))
+			run = 0;
+		else if (++run == n)
+			return i + 1 - n;
 	}
+	return -1;
+}
+
+// Map n pages in a row.  Returns the first one's number, or -1 if we are
+// out of heap or of memory.
+static int
+heap_map(uint32_t n)
+{
+	uint32_t i;
+	int first;
+
+	if ((first = heap_find(n)) < 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (sys_page_alloc(0, heap_va(first + i), PTE_P | PTE_U | PTE_W) < 0)
+		{
+			while (i-- > 0)
+				sys_page_unmap(0, heap_va(first + i));
+			return -1;
+		}
+	for (i = 0; i < n; i++)
+		bit_set(heap_used, first + i);
+	heap_next = first + n;
+	return first;
+}
+
+static void
+heap_unmap(uint32_t first, uint32_t n)
+{
+	uint32_t i;
 
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1)
+	for (i = 0; i < n; i++)
 	{
-		if (isfree(mptr, n + 4))
-			break;
-		mptr += PGSIZE;
-		if (mptr == mend)
+		sys_page_unmap(0, heap_va(first + i));
+		bit_clear(heap_used, first + i);
+	}
+}
+
+// The size class for an n-byte request, n <= SLAB_MAXOBJ.
+static int
+size_class(size_t n)
+{
+	return size_classes[(n + 15) / 16];
+}
+
+// Bytes an n-byte request actually gets.
+static size_t
+chunk_size(size_t n)
+{
+	if (n > SLAB_MAXOBJ)
+		return ROUNDUP(n, PGSIZE);
+	return class_size[size_class(n)];
+}
+
+static void
+partial_push(struct SizeClass *sc, struct Slab *s)
+{
+	s->s_prev = 0;
+	s->s_next = sc->sc_partial;
+	if (sc->sc_partial)
+		sc->sc_partial->s_prev = s;
+	sc->sc_partial = s;
+}
+
+static void
+partial_remove(struct SizeClass *sc, struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		sc->sc_partial = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+}
+
+// Put an empty slab of class c on its partial list: the spare, or a
+// newly mapped page.  Returns it, or 0 if out of memory.
+static struct Slab *
+slab_new(int c)
+{
+	struct SizeClass *sc = &classes[c];
+	struct Slab *s;
+	char *obj;
+	uint32_t i;
+	int pg;
+
+	if ((s = sc->sc_spare) != 0)
+		sc->sc_spare = 0;
+	else
+	{
+		if ((pg = heap_map(1)) < 0)
+			return 0;
+		s = heap_va(pg);
+		s->s_class = c;
+		s->s_nfree = SLAB_OBJS(c);
+		s->s_free = 0;
+		obj = (char *) (s + 1) + (s->s_nfree - 1) * class_size[c];
+		for (i = 0; i < s->s_nfree; i++, obj -= class_size[c])
 		{
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;    /* out of address space */
+			*(void **) obj = s->s_free;
+			s->s_free = obj;
 		}
+		sc->sc_nslabs++;
 	}
+	partial_push(sc, s);
+	return s;
+}
+
+static void *
+slab_alloc(int c)
+{
+	struct SizeClass *sc = &classes[c];
+	struct Slab *s;
+	void *obj;
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE)
+	if (!(s = sc->sc_partial) && !(s = slab_new(c)))
+		return 0;
+	obj = s->s_free;
+	s->s_free = *(void **) obj;
+	if (--s->s_nfree == 0)
+		partial_remove(sc, s);
+	sc->sc_ninuse++;
+	account(class_size[c]);
+	return obj;
+}
+
+static void
+slab_free(struct Slab *s, void *obj)
+{
+	struct SizeClass *sc = &classes[s->s_class];
+
+	assert(((char *) obj - (char *) (s + 1)) % class_size[s->s_class] == 0);
+	*(void **) obj = s->s_free;
+	s->s_free = obj;
+	if (s->s_nfree++ == 0)
+		partial_push(sc, s);
+	sc->sc_ninuse--;
+	inuse -= class_size[s->s_class];
+
+	if (s->s_nfree == SLAB_OBJS(s->s_class))
 	{
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P | PTE_U | PTE_W | cont) < 0)
+		partial_remove(sc, s);
+		if (!sc->sc_spare)
+			sc->sc_spare = s;
+		else
 		{
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;    /* out of physical memory */
+			heap_unmap(heap_pg(s), 1);
+			sc->sc_nslabs--;
 		}
 	}
+}
+
+static void *
+large_alloc(size_t n)
+{
+	uint32_t npages = ROUNDUP(n, PGSIZE) / PGSIZE, i;
+	int first;
+
+	if ((first = heap_map(npages)) < 0)
+		return 0;
+	bit_set(heap_large, first);
+	for (i = 0; i + 1 < npages; i++)
+		bit_set(heap_more, first + i);
+	nlarge++;
+	nlarge_pages += npages;
+	account(npages * PGSIZE);
+	return heap_va(first);
+}
+
+// Pages in the large block starting at page 'first'.
+static uint32_t
+large_npages(uint32_t first)
+{
+	uint32_t n = 1;
+
+	while (bit_test(heap_more, first + n - 1))
+		n++;
+	return n;
+}
+
+static void
+large_free(uint32_t first)
+{
+	uint32_t npages = large_npages(first), i;
+
+	bit_clear(heap_large, first);
+	for (i = 0; i + 1 < npages; i++)
+		bit_clear(heap_more, first + i);
+	heap_unmap(first, npages);
+	nlarge--;
+	nlarge_pages -= npages;
+	inuse -= npages * PGSIZE;
+}
+
+// The page number of v, which malloc returned.
+static uint32_t
+chunk_pg(void *v)
+{
+	uint32_t pg;
 
-	ref = (uint32_t *) (mptr + i - 4);
-	*ref = 2;    /* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
+	assert((uintptr_t) heap_va(NMAPPAGES) <= (uintptr_t) v && (uintptr_t) v < HEAPTOP);
+	pg = heap_pg(v);
+	assert(bit_test(heap_used, pg) && !bit_test(heap_more, pg - 1));
+	return pg;
+}
+
+void *
+malloc(size_t n)
+{
+	void *v = 0;
+
+	if ((heap_used || heap_init() >= 0) && n <= HEAPSIZE)
+		v = n > SLAB_MAXOBJ ? large_alloc(n) : slab_alloc(size_class(n));
+	if (!v)
+		nfailed++;
 	return v;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	uint32_t pg;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t *) v && (uint8_t *) v < mend);
+	pg = chunk_pg(v);
+	if (bit_test(heap_large, pg))
+	{
+		assert(v == heap_va(pg));
+		large_free(pg);
+	} else
+		slab_free(heap_va(pg), v);
+}
 
-	c = ROUNDDOWN(v, PGSIZE);
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
+
+	if (size != 0 && nmemb > (size_t) -1 / size)
+		return 0;
+	if ((v = malloc(nmemb * size)) != 0)
+		memset(v, 0, nmemb * size);
+	return v;
+}
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED)
+void *
+realloc(void *v, size_t n)
+{
+	size_t old;
+	uint32_t pg;
+	void *nv;
+
+	if (v == 0)
+		return malloc(n);
+	if (n == 0)
 	{
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+		free(v);
+		return 0;
 	}
+	if (n > HEAPSIZE)
+		return 0;
+
+	pg = chunk_pg(v);
+	if (bit_test(heap_large, pg))
+		old = large_npages(pg) * PGSIZE;
+	else
+		old = class_size[((struct Slab *) heap_va(pg))->s_class];
+	if (chunk_size(n) == old)
+		return v;
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t *) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	if ((nv = malloc(n)) == 0)
+		return 0;
+	memmove(nv, v, MIN(old, n));
+	free(v);
+	return nv;
 }
 
+void
+malloc_stats(struct MallocStats *ms)
+{
+	int c;
+
+	memset(ms, 0, sizeof(*ms));
+	for (c = 0; c < NCLASSES; c++)
+	{
+		ms->ms_slab_pages += classes[c].sc_nslabs;
+		ms->ms_small += classes[c].sc_ninuse;
+		ms->ms_small_bytes += classes[c].sc_ninuse * class_size[c];
+	}
+	ms->ms_slab_free = ms->ms_slab_pages * PGSIZE - ms->ms_small_bytes;
+	ms->ms_large = nlarge;
+	ms->ms_large_pages = nlarge_pages;
+	ms->ms_inuse = inuse;
+	ms->ms_peak = peak;
+	ms->ms_failed = nfailed;
+}
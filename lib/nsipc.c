@@ -8,39 +8,123 @@
 #define REQVA        0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
-// The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
+// Requests that carry data pages are laid out here: a request page
+// followed by up to NSIPC_MAXPAGES data pages.
+#define NSIPCDATA    0xE0100000
+
+// The network server's shards (see inc/ns.h), found on first use, and
+// its own address
+static envid_t nsenvs[NS_MAX_SHARDS];
+static uint32_t nshards;
+static struct in_addr nsaddr;
+
+static int nsipc_pages(envid_t ns, unsigned type, void *req, int perm);
+
+// Send an IP request to the network server shard 'ns', and wait for a
+// reply.  The request body should be in nsipcbuf, and parts of the
+// response may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc(envid_t ns, unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
-
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
+	return nsipc_pages(ns, type, &nsipcbuf, PTE_P | PTE_W | PTE_U);
+}
+
+// Like nsipc, but send the request at 'req' with 'perm', whose upper
+// bits may say how many pages to send (see IPC_SENDPAGES).
+static int
+nsipc_pages(envid_t ns, unsigned type, void *req, int perm)
+{
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
+		cprintf("[%08x] nsipc %d to %08x\n", thisenv->env_id, type, ns);
+
+	return ipc_call(ns, type, req, perm, NULL, NULL);
+}
+
+// Find the shards, asking shard 0 how many there are.  This uses
+// nsipcbuf, so it must come before a request is laid out there.
+static void
+ns_find(void)
+{
+	char name[SERVICE_NAMELEN];
+	int r;
+
+	nsenvs[0] = ipc_find_service(SERVICE_NS);
+	nshards = 1;
+	if ((r = nsipc(nsenvs[0], NSREQ_SHARDS)) < 0)
+		return;
+	nsaddr = nsipcbuf.shardsRet.ret_addr;
+	for (; nshards < (uint32_t) MIN(r, NS_MAX_SHARDS); nshards++)
+	{
+		snprintf(name, sizeof(name), "%s%u", SERVICE_NS, nshards);
+		if ((nsenvs[nshards] = ipc_find_service(name)) == 0)
+			panic("nsipc: network server shard %u not found", nshards);
+	}
+}
+
+// The shard where this environment's sockets start out, before they
+// have a local address: one per environment, so that the sockets of
+// each can be polled together, and so that environments spread over
+// the shards.
+static uint32_t
+home_shard(void)
+{
+	if (nshards == 0)
+		ns_find();
+	return ENVX(thisenv->env_id) % nshards;
+}
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+// The shard that serves socket or event queue 'id'
+static envid_t
+nsenv(int id)
+{
+	if (nshards == 0)
+		ns_find();
+	return nsenvs[NSSOCK_SHARD(id) % nshards];
 }
 
+// The shard a socket must be in, before it has a local address, to be
+// bound to 'name', or connected to it if 'connect': the shard that owns
+// the port to bind, or the one that owns the port connected to on this
+// host itself, so that the connection stays in one shard.  Returns -1
+// if any shard will do.
 int
-nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+nsipc_shard(const struct sockaddr *name, socklen_t namelen, bool connect)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *) name;
+	// Both in network byte order; libjos has no ntohs of its own
+	const uint8_t *port = (const uint8_t *) &sin->sin_port;
+	const uint8_t *addr = (const uint8_t *) &sin->sin_addr;
+
+	if (nshards == 0)
+		ns_find();
+	if (nshards == 1 || namelen < sizeof(*sin) || sin->sin_family != AF_INET ||
+		sin->sin_port == 0)
+		return -1;
+	if (connect && sin->sin_addr.s_addr != nsaddr.s_addr && addr[0] != 127)
+		return -1;
+	return ns_port_shard((port[0] << 8) | port[1], nshards);
+}
+
+int
+nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
 {
 	int r;
+	envid_t ns = nsenv(s);
 
-	nsipcbuf.accept.req_s = s;
+	nsipcbuf.accept.req_s = NSSOCK_NUM(s);
 	nsipcbuf.accept.req_addrlen = *addrlen;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0)
+	nsipcbuf.accept.req_flags = flags;
+	if ((r = nsipc(ns, NSREQ_ACCEPT)) >= 0)
 	{
 		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
+		// The connection is in the listening socket's shard
+		r = NSSOCK_ID(NSSOCK_SHARD(s), r);
 	}
 	return r;
 }
@@ -48,78 +132,487 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 int
 nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.bind.req_s = s;
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.bind.req_s = NSSOCK_NUM(s);
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc(ns, NSREQ_BIND);
 }
 
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.shutdown.req_s = NSSOCK_NUM(s);
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc(ns, NSREQ_SHUTDOWN);
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.close.req_s = NSSOCK_NUM(s);
+	return nsipc(ns, NSREQ_CLOSE);
 }
 
 int
 nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.connect.req_s = s;
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.connect.req_s = NSSOCK_NUM(s);
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc(ns, NSREQ_CONNECT);
 }
 
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.listen.req_s = NSSOCK_NUM(s);
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	return nsipc(ns, NSREQ_LISTEN);
 }
 
+// Can the 'npages' pages at 'va' be lent to the network server as they
+// are, instead of copying their contents?  They must be page-aligned
+// and mapped, and writable (so not copy-on-write) if the server is to
+// write them.
+static bool
+can_lend(const void *va, size_t npages, bool write)
+{
+	uintptr_t a = (uintptr_t) va;
+	size_t i;
+
+	if (a % PGSIZE != 0)
+		return false;
+	for (i = 0; i < npages; i++, a += PGSIZE)
+	{
+		if (!(uvpd[PDX(a)] & PTE_P) || !(uvpt[PGNUM(a)] & PTE_P))
+			return false;
+		if (write && !(uvpt[PGNUM(a)] & PTE_W))
+			return false;
+	}
+	return true;
+}
+
+// Lay out a request with 'npages' data pages at NSIPCDATA: a fresh
+// request page, then the pages at 'va' if they can be lent, or else
+// fresh pages.  Returns 1 if the pages were lent, 0 if not, or < 0 on
+// error.
+static int
+map_data(const void *va, size_t npages, bool write)
+{
+	struct PageMapOp ops[2];
+	size_t done;
+	int lend, r;
+
+	lend = can_lend(va, npages, write);
+	ops[0].srcva = PAGEMAP_ALLOC;
+	ops[0].dstva = NSIPCDATA;
+	ops[0].npages = 1;
+	ops[0].perm = PTE_P | PTE_W | PTE_U;
+	ops[1].srcva = lend ? (uintptr_t) va : PAGEMAP_ALLOC;
+	ops[1].dstva = NSIPCDATA + PGSIZE;
+	ops[1].npages = npages;
+	ops[1].perm = PTE_P | PTE_U | (lend && !write ? 0 : PTE_W);
+	if ((r = sys_page_map_batch(0, 0, ops, 2, &done)) < 0)
+		return r;
+	return lend;
+}
+
+// Receive at most 'len' bytes into 'mem'.  More than fits in the
+// request page is received, up to NSIPC_MAXPAGES pages at a time, into
+// data pages that follow it: 'mem' itself when it is page-aligned, so
+// that the server writes it directly.
 int
 nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
+	struct Nsreq_recv *req = (struct Nsreq_recv *) NSIPCDATA;
+	size_t npages;
+	int lend, r;
+	envid_t ns = nsenv(s);
+
+	if (len <= (int) sizeof(nsipcbuf))
+	{
+		nsipcbuf.recv.req_s = NSSOCK_NUM(s);
+		nsipcbuf.recv.req_len = len;
+		nsipcbuf.recv.req_flags = flags;
+
+		if ((r = nsipc(ns, NSREQ_RECV)) >= 0)
+		{
+			assert(r <= len);
+			memmove(mem, nsipcbuf.recvRet.ret_buf, r);
+		}
+		return r;
+	}
+
+	len = MIN(len, NSIPC_MAXPAGES * PGSIZE);
+	npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+	if ((lend = map_data(mem, npages, true)) < 0)
+		return lend;
+	req->req_s = NSSOCK_NUM(s);
+	req->req_len = len;
+	req->req_flags = flags;
+	r = nsipc_pages(ns, NSREQ_RECV, req,
+					PTE_P | PTE_W | PTE_U | IPC_SENDPAGES(1 + npages));
+	if (r > 0)
+	{
+		assert(r <= len);
+		if (!lend)
+			memmove(mem, (void *) (NSIPCDATA + PGSIZE), r);
+	}
+	return r;
+}
+
+// Send at most 'size' bytes from 'buf'.  More than fits in the request
+// page is sent, up to NSIPC_MAXPAGES pages at a time, in data pages
+// that follow it: the pages of 'buf' itself when it is page-aligned.
+int
+nsipc_send(int s, const void *buf, int size, unsigned int flags)
+{
+	struct Nsreq_send *req = (struct Nsreq_send *) NSIPCDATA;
+	size_t npages;
+	int lend;
+	envid_t ns = nsenv(s);
+
+	if (size <= (int) sizeof(nsipcbuf.send.req_buf))
+	{
+		nsipcbuf.send.req_s = NSSOCK_NUM(s);
+		memmove(&nsipcbuf.send.req_buf, buf, size);
+		nsipcbuf.send.req_size = size;
+		nsipcbuf.send.req_flags = flags;
+		return nsipc(ns, NSREQ_SEND);
+	}
+
+	size = MIN(size, NSIPC_MAXPAGES * PGSIZE);
+	npages = ROUNDUP(size, PGSIZE) / PGSIZE;
+	if ((lend = map_data(buf, npages, false)) < 0)
+		return lend;
+	if (!lend)
+		memmove((void *) (NSIPCDATA + PGSIZE), buf, size);
+	req->req_s = NSSOCK_NUM(s);
+	req->req_size = size;
+	req->req_flags = flags;
+	return nsipc_pages(ns, NSREQ_SEND, req, PTE_P | PTE_U | IPC_SENDPAGES(1 + npages));
+}
+
+// Send the datagram of 'size' bytes at 'buf' to 'to', or to the
+// connected peer if 'tolen' is 0.  It must fit in the request page.
+int
+nsipc_sendto(int s, const void *buf, int size, unsigned int flags,
+			 const struct sockaddr *to, socklen_t tolen)
+{
+	struct Nsreq_sendto *req = &nsipcbuf.sendto;
+	envid_t ns = nsenv(s);
+
+	if (size < 0 || size > (int) (sizeof(nsipcbuf) - sizeof(*req)) ||
+		tolen > sizeof(req->req_to))
+		return -E_INVAL;
+	req->req_s = NSSOCK_NUM(s);
+	req->req_size = size;
+	req->req_flags = flags;
+	if (tolen)
+		memmove(&req->req_to, to, tolen);
+	req->req_tolen = tolen;
+	memmove(req->req_buf, buf, size);
+	return nsipc(ns, NSREQ_SENDTO);
+}
+
+// Receive a datagram into the 'len' bytes at 'mem', truncating it to
+// what fits in the request page, and its sender's address into 'from'
+// if it is not NULL.
+int
+nsipc_recvfrom(int s, void *mem, int len, unsigned int flags,
+			   struct sockaddr *from, socklen_t *fromlen)
+{
+	struct Nsret_recvfrom *ret = &nsipcbuf.recvfromRet;
 	int r;
+	envid_t ns = nsenv(s);
+
+	nsipcbuf.recvfrom.req_s = NSSOCK_NUM(s);
+	nsipcbuf.recvfrom.req_len = MIN(len, (int) (sizeof(nsipcbuf) - sizeof(*ret)));
+	nsipcbuf.recvfrom.req_flags = flags;
+	if ((r = nsipc(ns, NSREQ_RECVFROM)) >= 0)
+	{
+		assert(r <= len);
+		memmove(mem, ret->ret_buf, r);
+		if (from && fromlen)
+		{
+			memmove(from, &ret->ret_from, MIN(*fromlen, ret->ret_fromlen));
+			*fromlen = ret->ret_fromlen;
+		}
+	}
+	return r;
+}
+
+// How many of the 'n' datagrams in 'msgs' fit in one NSREQ_SENDMMSG or
+// NSREQ_RECVMMSG page?  'room' gets the room each takes there; the
+// first is cut to what fits, so that at least one always does.
+static int
+mmsg_fit(const struct mmsg *msgs, int n, int *room)
+{
+	size_t off = offsetof(struct Nsreq_mmsg, req_msgs[0]);
+	int i;
+
+	for (i = 0; i < MIN(n, NSIPC_MAXMSGS); i++)
+	{
+		off += sizeof(struct Nsmsg);
+		if (off > PGSIZE)
+			break;
+		room[i] = MIN(msgs[i].msg_len, PGSIZE - off);
+		if (i > 0 && room[i] < msgs[i].msg_len)
+			break;
+		off += room[i];
+	}
+	return i;
+}
 
-	nsipcbuf.recv.req_s = s;
-	nsipcbuf.recv.req_len = len;
-	nsipcbuf.recv.req_flags = flags;
+// Send up to NSIPC_MAXMSGS of the 'n' datagrams in 'msgs' with one
+// request, as many as fit in its page.  Returns how many were sent.
+int
+nsipc_sendmmsg(int s, const struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Nsreq_mmsg *req = &nsipcbuf.mmsg;
+	int room[NSIPC_MAXMSGS];
+	char *data;
+	int i;
+	envid_t ns = nsenv(s);
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0)
+	static_assert(sizeof(req->req_msgs[0].addr) == sizeof(msgs[0].msg_addr));
+	if ((n = mmsg_fit(msgs, n, room)) == 0 || room[0] < msgs[0].msg_len)
+		return -E_INVAL;
+	req->req_s = NSSOCK_NUM(s);
+	req->req_flags = flags;
+	req->req_nmsgs = n;
+	data = (char *) &req->req_msgs[n];
+	for (i = 0; i < n; i++)
 	{
-		assert(r < 1600 && r <= len);
-		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
+		memmove(&req->req_msgs[i].addr, &msgs[i].msg_addr, sizeof(msgs[i].msg_addr));
+		req->req_msgs[i].len = room[i];
+		memmove(data, msgs[i].msg_buf, room[i]);
+		data += room[i];
 	}
+	return nsipc(ns, NSREQ_SENDMMSG);
+}
 
+// Receive up to as many datagrams into 'msgs' as fit in one request's
+// page, waiting (unless 'flags' says not to) only for the first.
+// Returns how many were received.
+int
+nsipc_recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Nsreq_mmsg *req = &nsipcbuf.mmsg;
+	int room[NSIPC_MAXMSGS];
+	char *data;
+	int i, r;
+	envid_t ns = nsenv(s);
+
+	if ((n = mmsg_fit(msgs, n, room)) == 0)
+		return -E_INVAL;
+	req->req_s = NSSOCK_NUM(s);
+	req->req_flags = flags;
+	req->req_nmsgs = n;
+	for (i = 0; i < n; i++)
+		req->req_msgs[i].len = room[i];
+	if ((r = nsipc(ns, NSREQ_RECVMMSG)) <= 0)
+		return r;
+	assert(r <= n);
+	data = (char *) &req->req_msgs[n];
+	for (i = 0; i < r; i++)
+	{
+		msgs[i].msg_len = MIN(req->req_msgs[i].len, room[i]);
+		memmove(msgs[i].msg_buf, data, msgs[i].msg_len);
+		memmove(&msgs[i].msg_addr, &req->req_msgs[i].addr, sizeof(msgs[i].msg_addr));
+		data += room[i];
+	}
 	return r;
 }
 
 int
-nsipc_send(int s, const void *buf, int size, unsigned int flags)
+nsipc_gethostbyname(const char *name, struct in_addr *addr)
 {
-	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
-	memmove(&nsipcbuf.send.req_buf, buf, size);
-	nsipcbuf.send.req_size = size;
-	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	envid_t ns;
+	int r;
+
+	if (strlen(name) >= NSIPC_MAXNAME)
+		return -E_INVAL;
+	ns = nsenv(NSSOCK_ID(home_shard(), 0));
+	strcpy(nsipcbuf.gethostbyname.req_name, name);
+	if ((r = nsipc(ns, NSREQ_GETHOSTBYNAME)) >= 0)
+		*addr = nsipcbuf.gethostbynameRet.ret_addr;
+	return r;
 }
 
+// Make a socket in shard 'shard', or in this environment's own shard
+// if 'shard' is < 0.
 int
-nsipc_socket(int domain, int type, int protocol)
+nsipc_socket(int shard, int domain, int type, int protocol)
 {
+	envid_t ns;
+	int r;
+
+	if (shard < 0)
+		shard = home_shard();
+	ns = nsenv(NSSOCK_ID(shard, 0));
 	nsipcbuf.socket.req_domain = domain;
 	nsipcbuf.socket.req_type = type;
 	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	if ((r = nsipc(ns, NSREQ_SOCKET)) >= 0)
+		r = NSSOCK_ID(shard, r);
+	return r;
+}
+
+// The counters of all the shards added up
+int
+nsipc_stats(struct Nsret_stats *stats)
+{
+	uint32_t *sum = (uint32_t *) stats, *w = (uint32_t *) &nsipcbuf.statsRet;
+	uint32_t shard, i;
+	int r;
+
+	static_assert(sizeof(*stats) % sizeof(uint32_t) == 0);
+	if (nshards == 0)
+		ns_find();
+	memset(stats, 0, sizeof(*stats));
+	for (shard = 0; shard < nshards; shard++)
+	{
+		if ((r = nsipc(nsenvs[shard], NSREQ_STATS)) < 0)
+			return r;
+		for (i = 0; i < sizeof(*stats) / sizeof(uint32_t); i++)
+			sum[i] += w[i];
+	}
+	return 0;
+}
+
+// Poll sockets that are all in one shard.
+int
+nsipc_poll(struct Nspollfd *fds, int nfds, int timeout)
+{
+	envid_t ns;
+	int i, r;
+
+	if (nfds < 1 || nfds > NSIPC_MAXPOLL)
+		return -E_INVAL;
+	ns = nsenv(fds[0].s);
+	nsipcbuf.poll.req_nfds = nfds;
+	nsipcbuf.poll.req_timeout = timeout;
+	for (i = 0; i < nfds; i++)
+	{
+		if (NSSOCK_SHARD(fds[i].s) != NSSOCK_SHARD(fds[0].s))
+			return -E_INVAL;
+		nsipcbuf.poll.req_fds[i] = fds[i];
+		nsipcbuf.poll.req_fds[i].s = NSSOCK_NUM(fds[i].s);
+	}
+	if ((r = nsipc(ns, NSREQ_POLL)) >= 0)
+		for (i = 0; i < nfds; i++)
+			fds[i].revents = nsipcbuf.poll.req_fds[i].revents;
+	return r;
+}
+
+// Make an event queue in shard 'shard', or in this environment's own
+// shard if 'shard' is < 0.  It can only watch sockets in that shard.
+int
+nsipc_epoll_create(int shard)
+{
+	int r;
+
+	if (shard < 0)
+		shard = home_shard();
+	if ((r = nsipc(nsenv(NSSOCK_ID(shard, 0)), NSREQ_EPOLL_CREATE)) >= 0)
+		r = NSSOCK_ID(shard, r);
+	return r;
+}
+
+int
+nsipc_epoll_ctl(int q, int op, int s, uint32_t events, uint32_t data)
+{
+	envid_t ns = nsenv(q);
+
+	if (NSSOCK_SHARD(s) != NSSOCK_SHARD(q))
+		return -E_INVAL;
+	nsipcbuf.epollCtl.req_q = NSSOCK_NUM(q);
+	nsipcbuf.epollCtl.req_op = op;
+	nsipcbuf.epollCtl.req_s = NSSOCK_NUM(s);
+	nsipcbuf.epollCtl.req_events = events;
+	nsipcbuf.epollCtl.req_data = data;
+	return nsipc(ns, NSREQ_EPOLL_CTL);
+}
+
+int
+nsipc_epoll_wait(int q, struct epoll_event *events, int maxevents, int timeout)
+{
+	envid_t ns = nsenv(q);
+	int i, r;
+
+	nsipcbuf.epollWait.req_q = NSSOCK_NUM(q);
+	nsipcbuf.epollWait.req_maxevents = MIN(maxevents, NSIPC_MAXEVENTS);
+	nsipcbuf.epollWait.req_timeout = timeout;
+	if ((r = nsipc(ns, NSREQ_EPOLL_WAIT)) > 0)
+		for (i = 0; i < r; i++)
+		{
+			events[i].events = nsipcbuf.epollWaitRet.ret_events[i].events;
+			events[i].data = nsipcbuf.epollWaitRet.ret_events[i].data;
+		}
+	return r;
+}
+
+int
+nsipc_epoll_close(int q)
+{
+	envid_t ns = nsenv(q);
+
+	nsipcbuf.epollClose.req_q = NSSOCK_NUM(q);
+	return nsipc(ns, NSREQ_EPOLL_CLOSE);
+}
+
+// Send 'count' bytes of file 'fd' from 'offset' on socket 's'.  The
+// file server's block-cache pages are mapped here and passed on to the
+// network server as they are, so the data is never copied on the way.
+// Returns the number of bytes sent, short at the end of the file, or
+// < 0 if none could be.
+ssize_t
+nsipc_sendfile(int s, int fd, off_t offset, size_t count)
+{
+	struct Nsreq_sendfile *req = (struct Nsreq_sendfile *) NSIPCDATA;
+	size_t sent = 0, skip, npages;
+	ssize_t n;
+	int r;
+	envid_t ns = nsenv(s);
+
+	if ((r = sys_page_alloc(0, req, PTE_P | PTE_W | PTE_U)) < 0)
+		return r;
+	while (sent < count)
+	{
+		// Only whole pages can be mapped, so the request says where
+		// in the first one the data starts.
+		skip = (offset + sent) % PGSIZE;
+		n = file_map(fd, offset + sent - skip,
+					 MIN(count - sent + skip, NSIPC_MAXPAGES * PGSIZE),
+					 (void *) (NSIPCDATA + PGSIZE));
+		if (n <= (ssize_t) skip)
+		{
+			r = n;
+			break;
+		}
+
+		req->req_s = NSSOCK_NUM(s);
+		req->req_offset = skip;
+		req->req_size = n - skip;
+		npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+		r = nsipc_pages(ns, NSREQ_SENDFILE, req,
+						PTE_P | PTE_U | IPC_SENDPAGES(1 + npages));
+		if (r < 0)
+			break;
+		sent += r;
+		if (r < req->req_size)
+			break;
+	}
+	return sent > 0 || r >= 0 ? sent : r;
 }
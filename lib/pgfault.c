@@ -2,7 +2,10 @@
 // Rather than register the C page fault handler directly with the
 // kernel as the page fault handler, we register the assembly language
 // wrapper in pfentry.S, which in turns calls the registered C
-// function.
+// function.  Write faults on copy-on-write pages, which fork and spawn
+// leave behind, are resolved by the kernel; an environment that has them
+// sent to its upcall (sys_env_set_cow_upcall) resolves them here, before
+// any registered handler sees them.
 
 #include <inc/lib.h>
 
@@ -10,32 +13,76 @@
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
 extern void _pgfault_upcall(void);
 
-// Pointer to currently installed C-language pgfault handler.
+// Pointer to the C function the assembly calls: pgfault_dispatch, once
+// pgfault_init has run, or 0.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
+// The handler set_pgfault_handler registered, for all other faults.
+static void (*user_handler)(struct UTrapframe *utf);
+
+//
+// If the fault is a write to a copy-on-write page, have the kernel map
+// in our own private writable copy and return true.
+//
+static bool
+cow_fault(struct UTrapframe *utf)
+{
+	void *addr = (void *) ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	int r;
+
+	// Check that the faulting access was (1) a write, and (2) to a
+	// copy-on-write page, or to one another thread of ours has just
+	// made writable.
+	if ((utf->utf_err & FEC_WR) == 0 || (uvpd[PDX(addr)] & PTE_P) == 0 ||
+		(uvpt[PGNUM(addr)] & PTE_P) == 0 ||
+		(uvpt[PGNUM(addr)] & (PTE_COW | PTE_W)) == 0)
+		return false;
+
+	// The kernel copies the page, or just makes it writable if no one
+	// else has it any more
+	if ((r = sys_page_cow_resolve(addr)) < 0)
+		panic("sys page cow resolve: %e\n", r);
+	return true;
+}
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
+{
+	if (cow_fault(utf))
+		return;
+	if (!user_handler)
+		panic("page fault: not write or not COW, eip %08x, va %08x, err %04x",
+			  utf->utf_eip, utf->utf_fault_va, utf->utf_err);
+	user_handler(utf);
+}
+
 //
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
-// The first time we register a handler, we need to
-// allocate an exception stack (one page of memory with its top
-// at UXSTACKTOP), and tell the kernel to call the assembly-language
-// _pgfault_upcall routine when a page fault occurs.
+// Have page faults delivered to us.  The first time through, allocate an exception
+// stack (one page of memory with its top at UXSTACKTOP), and tell the
+// kernel to call the assembly-language _pgfault_upcall routine when a
+// page fault occurs.
 //
 void
-set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+pgfault_init(void)
 {
 	int r;
 
-	if (_pgfault_handler == 0)
-	{
-		// First time through!
-		// LAB 4: Your code here.
-		int ret = sys_page_alloc(0, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_P | PTE_W);
-		if (ret < 0)
-			panic("set_pgfault_handler %e", ret);
-		sys_env_set_pgfault_upcall(0, _pgfault_upcall);
-	}
-
-	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	if (_pgfault_handler != 0)
+		return;
+	// First time through!
+	if ((r = sys_page_alloc(0, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_P | PTE_W)) < 0)
+		panic("set_pgfault_handler %e", r);
+	sys_env_set_pgfault_upcall(0, _pgfault_upcall);
+	_pgfault_handler = pgfault_dispatch;
+}
+
+//
+// Set the page fault handler function, for every fault but writes to
+// copy-on-write pages.
+//
+void
+set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
+{
+	pgfault_init();
+	user_handler = handler;
 }
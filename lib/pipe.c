@@ -6,6 +6,7 @@ static ssize_t devpipe_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devpipe_write(struct Fd *fd, const void *buf, size_t n);
 static int devpipe_stat(struct Fd *fd, struct Stat *stat);
 static int devpipe_close(struct Fd *fd);
+static int devpipe_poll(struct Fd *fd);
 
 struct Dev devpipe =
 		{
@@ -15,13 +16,19 @@ struct Dev devpipe =
 				.dev_write =    devpipe_write,
 				.dev_close =    devpipe_close,
 				.dev_stat =    devpipe_stat,
+				.dev_poll =    devpipe_poll,
 		};
 
-#define PIPEBUFSIZ 32        // small to provoke races
+// The rest of the page.  Positions run from 0 to 2 * PIPEBUFSIZ, so a
+// full ring (wpos - rpos == PIPEBUFSIZ) differs from an empty one.
+#define PIPEBUFSIZ (PGSIZE - 4 * sizeof(uint32_t))
+#define PIPEPOSMOD (2 * PIPEBUFSIZ)
 
 struct Pipe {
-	off_t p_rpos;        // read position
-	off_t p_wpos;        // write position
+	volatile uint32_t p_rpos;    // read position
+	volatile uint32_t p_wpos;    // write position
+	volatile envid_t p_rwaiter;    // reader asleep until data comes, or 0
+	volatile envid_t p_wwaiter;    // writer asleep until room frees, or 0
 	uint8_t p_buf[PIPEBUFSIZ];    // data buffer
 };
 
@@ -32,6 +39,8 @@ pipe(int pfd[2])
 	struct Fd *fd0, *fd1;
 	void *va;
 
+	static_assert(sizeof(struct Pipe) == PGSIZE);
+
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
 		|| (r = sys_page_alloc(0, fd0, PTE_P | PTE_W | PTE_U | PTE_SHARE)) < 0)
@@ -102,49 +111,109 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Bytes in the pipe, for positions rpos and wpos.
+static uint32_t
+pipe_used(uint32_t rpos, uint32_t wpos)
+{
+	return (wpos + PIPEPOSMOD - rpos) % PIPEPOSMOD;
+}
+
+// Copy n bytes between the ring at position pos and buf, in at most
+// two spans.
+static void
+pipe_copy(struct Pipe *p, uint32_t pos, void *buf, size_t n, bool in)
+{
+	uint32_t off = pos % PIPEBUFSIZ;
+	size_t m = MIN(n, PIPEBUFSIZ - off);
+
+	if (in)
+	{
+		memcpy(p->p_buf + off, buf, m);
+		memcpy(p->p_buf, (uint8_t *) buf + m, n - m);
+	} else
+	{
+		memcpy(buf, p->p_buf + off, m);
+		memcpy((uint8_t *) buf + m, p->p_buf, n - m);
+	}
+}
+
+// Sleep until *pos moves off val, our peer wakes us through *waiter, or
+// the pipe page no longer has the 'ref' references it had when we last
+// looked for a closed peer (see sys_page_wait).  If someone else
+// already sleeps on *waiter, just yield.
+static void
+pipe_sleep(struct Pipe *p, volatile envid_t *waiter, volatile uint32_t *pos,
+		   uint32_t val, uint32_t ref)
+{
+	envid_t me = thisenv->env_id;
+
+	if (cmpxchg((volatile uint32_t *) waiter, 0, me) != 0)
+	{
+		sys_yield();
+		return;
+	}
+	// Publish *waiter before the kernel looks at *pos; pairs with
+	// the mfence in pipe_wake.
+	mfence();
+	sys_page_wait(pos, val, ref);
+	cmpxchg((volatile uint32_t *) waiter, me, 0);
+}
+
+// Wake the env asleep on *waiter, once we have moved our position.
+static void
+pipe_wake(volatile envid_t *waiter)
+{
+	envid_t e;
+
+	mfence();
+	if ((e = *waiter) != 0 && cmpxchg((volatile uint32_t *) waiter, e, 0) == e)
+		sys_ring_notify(e);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	uint8_t *buf;
-	size_t i;
 	struct Pipe *p;
+	uint32_t rpos, used, ref;
 
 	p = (struct Pipe *) fd2data(fd);
 	if (debug)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 				thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++)
+	if (n == 0)
+		return 0;
+	rpos = p->p_rpos;
+	while ((used = pipe_used(rpos, p->p_wpos)) == 0)
 	{
-		while (p->p_rpos == p->p_wpos)
-		{
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
-		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+		// pipe is empty
+		// if all the writers are gone, note eof
+		ref = pageref(p);
+		if (_pipeisclosed(fd, p))
+			return 0;
+		if (fd->fd_omode & O_NONBLOCK)
+			return -E_WOULD_BLOCK;
+		// until wpos moves off rpos, where it is now
+		if (debug)
+			cprintf("devpipe_read sleep\n");
+		pipe_sleep(p, &p->p_rwaiter, &p->p_wpos, rpos, ref);
 	}
-	return i;
+	// take what is there, up to n.
+	// wait to advance rpos until the bytes are taken!
+	n = MIN(n, used);
+	pipe_copy(p, rpos, vbuf, n, false);
+	p->p_rpos = (rpos + n) % PIPEPOSMOD;
+	pipe_wake(&p->p_wwaiter);
+	return n;
 }
 
 static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, m;
 	struct Pipe *p;
+	uint32_t wpos, rpos, ref;
 
 	p = (struct Pipe *) fd2data(fd);
 	if (debug)
@@ -152,25 +221,31 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 				thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++)
+	wpos = p->p_wpos;
+	for (i = 0; i < n; i += m)
 	{
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf))
+		while (pipe_used(rpos = p->p_rpos, wpos) == PIPEBUFSIZ)
 		{
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
+			ref = pageref(p);
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// a non-blocking writer takes what fit
+			if (fd->fd_omode & O_NONBLOCK)
+				return i > 0 ? i : -E_WOULD_BLOCK;
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_sleep(p, &p->p_wwaiter, &p->p_rpos, rpos, ref);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// store as much as there is room for.
+		// wait to advance wpos until the bytes are stored!
+		m = MIN(n - i, PIPEBUFSIZ - pipe_used(rpos, wpos));
+		pipe_copy(p, wpos, (void *) (buf + i), m, true);
+		p->p_wpos = wpos = (wpos + m) % PIPEPOSMOD;
+		pipe_wake(&p->p_rwaiter);
 	}
 
 	return i;
@@ -181,12 +256,29 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 {
 	struct Pipe *p = (struct Pipe *) fd2data(fd);
 	strcpy(stat->st_name, "<pipe>");
-	stat->st_size = p->p_wpos - p->p_rpos;
+	stat->st_size = pipe_used(p->p_rpos, p->p_wpos);
 	stat->st_isdir = 0;
 	stat->st_dev = &devpipe;
 	return 0;
 }
 
+static int
+devpipe_poll(struct Fd *fd)
+{
+	struct Pipe *p = (struct Pipe *) fd2data(fd);
+	uint32_t used = pipe_used(p->p_rpos, p->p_wpos);
+	int events = 0;
+
+	if (used != 0)
+		events |= POLLIN;
+	if (used < PIPEBUFSIZ)
+		events |= POLLOUT;
+	// a reader at eof doesn't wait either
+	if (_pipeisclosed(fd, p))
+		events |= POLLHUP | POLLIN;
+	return events;
+}
+
 static int
 devpipe_close(struct Fd *fd)
 {
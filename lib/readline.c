@@ -1,9 +1,33 @@
 #include <inc/stdio.h>
 #include <inc/error.h>
+#if !JOS_KERNEL
+#include <inc/lib.h>
+#endif
 
 #define BUFLEN 1024
 static char buf[BUFLEN];
 
+#if !JOS_KERNEL
+// Read a line from the console.  The line discipline keeps lines short
+// enough to fit in buf; one that ctl-d finished has no newline.
+static char *
+readline_cons(void)
+{
+	int r;
+
+	if ((r = read(0, buf, BUFLEN - 1)) <= 0)
+	{
+		if (r < 0)
+			cprintf("read error: %e\n", r);
+		return NULL;
+	}
+	if (buf[r - 1] == '\n')
+		r--;
+	buf[r] = 0;
+	return buf;
+}
+#endif
+
 char *
 readline(const char *prompt)
 {
@@ -17,6 +41,13 @@ readline(const char *prompt)
 		fprintf(1, "%s", prompt);
 #endif
 
+#if !JOS_KERNEL
+	// The console's line discipline edits and echoes the line itself
+	// and hands it over whole.
+	if (iscons(0) > 0)
+		return readline_cons();
+#endif
+
 	i = 0;
 	echoing = iscons(0);
 	while (1)
@@ -0,0 +1,183 @@
+// Single-producer, single-consumer rings in shared memory.
+//
+// A ring lets one environment stream fixed-size items to another
+// without a system call per item: the producer fills the slot at
+// 'head' and bumps 'head', the consumer reads the slot at 'tail' and
+// bumps 'tail'.  The pages are PTE_SHARE, so a ring created before
+// fork() is shared with the child rather than copied on write.
+//
+// Only a consumer that has run out of items sleeps.  It sets 'waiting'
+// and looks at 'head' once more before it blocks; a producer sets
+// 'head' and then looks at 'waiting', ringing the consumer's doorbell
+// if it is set.  With a fence between each side's store and load, at
+// least one of them sees the other's store, so no wakeup is lost.
+// The doorbell is sys_ring_notify unless the consumer also serves IPC
+// and asked for an IPC instead (see ring_set_consumer).
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+static void *
+ring_slot(struct Ring *r, uint32_t i)
+{
+	return (char *) r + PGSIZE + (i & (r->nslots - 1)) * r->slotsize;
+}
+
+// Allocate and initialize a ring of 'nslots' slots of 'slotsize' bytes
+// at the page-aligned address 'r', which must leave room for
+// RING_NPAGES(nslots, slotsize) pages.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if r is not page-aligned or nslots is not a power of two.
+//	-E_NO_MEM if the pages could not be allocated.
+int
+ring_create(struct Ring *r, uint32_t nslots, uint32_t slotsize)
+{
+	uint32_t i, npages;
+	int ret;
+
+	if ((uintptr_t) r % PGSIZE != 0 || nslots == 0 ||
+		(nslots & (nslots - 1)) != 0)
+		return -E_INVAL;
+
+	npages = RING_NPAGES(nslots, slotsize);
+	for (i = 0; i < npages; i++)
+	{
+		ret = sys_page_alloc(0, (char *) r + i * PGSIZE,
+							 PTE_P | PTE_U | PTE_W | PTE_SHARE);
+		if (ret < 0)
+		{
+			while (i-- > 0)
+				sys_page_unmap(0, (char *) r + i * PGSIZE);
+			return ret;
+		}
+	}
+
+	r->head = r->tail = 0;
+	r->waiting = 0;
+	r->consumer = 0;
+	r->ipc_value = 0;
+	r->nslots = nslots;
+	r->slotsize = slotsize;
+	return 0;
+}
+
+// Name the environment that consumes from 'r'.  If 'ipc_value' is
+// nonzero, the producer wakes it by sending it an IPC with that value
+// (and no page), for consumers that sleep in ipc_recv; otherwise the
+// consumer must sleep in ring_wait.
+void
+ring_set_consumer(struct Ring *r, envid_t consumer, int32_t ipc_value)
+{
+	r->consumer = consumer;
+	r->ipc_value = ipc_value;
+}
+
+// Producer: return the next free slot, or NULL if the ring is full.
+// The slot is not visible to the consumer until ring_publish.
+void *
+ring_reserve(struct Ring *r)
+{
+	return ring_reserve_nth(r, 0);
+}
+
+// Producer: return the n-th next free slot, counting from 0, or NULL
+// if no more than n are free, so that several can be filled at once
+// and then published together with ring_publish_n.
+void *
+ring_reserve_nth(struct Ring *r, uint32_t n)
+{
+	if (r->head - r->tail + n >= r->nslots)
+		return NULL;
+	return ring_slot(r, r->head + n);
+}
+
+// Producer: hand the slot returned by ring_reserve to the consumer,
+// waking it if it is asleep.
+void
+ring_publish(struct Ring *r)
+{
+	ring_publish_n(r, 1);
+}
+
+// Producer: hand the next n reserved slots to the consumer at once,
+// ringing its doorbell at most once.
+void
+ring_publish_n(struct Ring *r, uint32_t n)
+{
+	barrier();
+	r->head += n;
+	mfence();
+	if (r->waiting && xchg(&r->waiting, 0))
+	{
+		if (r->ipc_value != 0)
+			ipc_send(r->consumer, r->ipc_value, 0, 0);
+		else
+			sys_ring_notify(r->consumer);
+	}
+}
+
+// Consumer: return the oldest published slot, or NULL if the ring is
+// empty.  The slot stays valid until ring_release.
+void *
+ring_peek(struct Ring *r)
+{
+	return ring_peek_nth(r, 0);
+}
+
+// Consumer: return the n-th oldest published slot, counting from 0,
+// or NULL if no more than n are published.  This lets a consumer work
+// ahead of slots it cannot release yet.
+void *
+ring_peek_nth(struct Ring *r, uint32_t n)
+{
+	if (r->head - r->tail <= n)
+		return NULL;
+	barrier();
+	return ring_slot(r, r->tail + n);
+}
+
+// Consumer: give the slot returned by ring_peek back to the producer.
+void
+ring_release(struct Ring *r)
+{
+	ring_release_n(r, 1);
+}
+
+// Consumer: give the n oldest published slots back at once, touching
+// the producer's view of 'tail' only once.
+void
+ring_release_n(struct Ring *r, uint32_t n)
+{
+	barrier();
+	r->tail += n;
+}
+
+// Consumer: announce that we are about to sleep.  Returns true if the
+// ring is still empty, in which case the producer will ring our
+// doorbell on its next publish; false if an item arrived meanwhile.
+bool
+ring_arm(struct Ring *r)
+{
+	r->waiting = 1;
+	mfence();
+	if (r->head != r->tail)
+	{
+		r->waiting = 0;
+		return false;
+	}
+	return true;
+}
+
+// Consumer: block until the ring is not empty.
+void
+ring_wait(struct Ring *r)
+{
+	uint32_t head;
+
+	while ((head = r->head) == r->tail)
+	{
+		if (ring_arm(r))
+			sys_ring_wait(&r->head, head);
+		r->waiting = 0;
+	}
+}
@@ -16,6 +16,18 @@ struct Dev devsock =
 				.dev_stat =    devsock_stat,
 		};
 
+static int devepoll_close(struct Fd *fd);
+static int devepoll_stat(struct Fd *fd, struct Stat *stat);
+
+// An event queue in the network server, named by fd_sock.sockid
+struct Dev devepoll =
+		{
+				.dev_id =    'e',
+				.dev_name =    "epoll",
+				.dev_close =    devepoll_close,
+				.dev_stat =    devepoll_stat,
+		};
+
 static int
 fd2sockid(int fd)
 {
@@ -45,16 +57,59 @@ alloc_sockfd(int sockid)
 	sfd->fd_dev_id = devsock.dev_id;
 	sfd->fd_omode = O_RDWR;
 	sfd->fd_sock.sockid = sockid;
+	sfd->fd_sock.placed = true;
 	return fd2num(sfd);
 }
 
+// Before binding or connecting socket 'sfd' to 'name', move it to the
+// network server shard that takes (see nsipc_shard), unless it already
+// has a local address: it is made anew there, and the old one closed.
+static int
+sock_place(struct Fd *sfd, const struct sockaddr *name, socklen_t namelen,
+		   bool connect)
+{
+	int shard, r;
+
+	if (sfd->fd_sock.placed ||
+		(shard = nsipc_shard(name, namelen, connect)) < 0 ||
+		shard == NSSOCK_SHARD(sfd->fd_sock.sockid))
+		return 0;
+	if ((r = nsipc_socket(shard, sfd->fd_sock.domain, sfd->fd_sock.type,
+						  sfd->fd_sock.protocol)) < 0)
+		return r;
+	nsipc_close(sfd->fd_sock.sockid);
+	sfd->fd_sock.sockid = r;
+	return 0;
+}
+
+// A socket that did something that gives it a local address stays in
+// its shard.
+static int
+sock_placed(int s, int r)
+{
+	struct Fd *sfd;
+
+	if (r >= 0 && fd_lookup(s, &sfd) == 0)
+		sfd->fd_sock.placed = true;
+	return r;
+}
+
+// MSG_DONTWAIT if 'fd' is non-blocking, else 0
+static int
+sock_flags(struct Fd *fd)
+{
+	return (fd->fd_omode & O_NONBLOCK) ? MSG_DONTWAIT : 0;
+}
+
 int
 accept(int s, struct sockaddr *addr, socklen_t * addrlen)
 {
+	struct Fd *sfd;
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
+	fd_lookup(s, &sfd);
+	if ((r = nsipc_accept(r, addr, addrlen, sock_flags(sfd))) < 0)
 		return r;
 	return alloc_sockfd(r);
 }
@@ -62,10 +117,14 @@ accept(int s, struct sockaddr *addr, socklen_t * addrlen)
 int
 bind(int s, struct sockaddr *name, socklen_t namelen)
 {
+	struct Fd *sfd;
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_bind(r, name, namelen);
+	fd_lookup(s, &sfd);
+	if ((r = sock_place(sfd, name, namelen, false)) < 0)
+		return r;
+	return sock_placed(s, nsipc_bind(sfd->fd_sock.sockid, name, namelen));
 }
 
 int
@@ -89,10 +148,14 @@ devsock_close(struct Fd *fd)
 int
 connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
+	struct Fd *sfd;
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_connect(r, name, namelen);
+	fd_lookup(s, &sfd);
+	if ((r = sock_place(sfd, name, namelen, true)) < 0)
+		return r;
+	return sock_placed(s, nsipc_connect(sfd->fd_sock.sockid, name, namelen));
 }
 
 int
@@ -101,19 +164,19 @@ listen(int s, int backlog)
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	return nsipc_listen(r, backlog);
+	return sock_placed(s, nsipc_listen(r, backlog));
 }
 
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_recv(fd->fd_sock.sockid, buf, n, sock_flags(fd));
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_send(fd->fd_sock.sockid, buf, n, sock_flags(fd));
 }
 
 static int
@@ -123,11 +186,238 @@ devsock_stat(struct Fd *fd, struct Stat *stat)
 	return 0;
 }
 
+// Make a socket in this environment's network server shard, where it
+// stays unless binding or connecting it moves it (see sock_place).
 int
 socket(int domain, int type, int protocol)
 {
+	struct Fd *sfd;
 	int r;
-	if ((r = nsipc_socket(domain, type, protocol)) < 0)
+	if ((r = nsipc_socket(-1, domain, type, protocol)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	if ((r = alloc_sockfd(r)) < 0)
+		return r;
+	fd_lookup(r, &sfd);
+	sfd->fd_sock.domain = domain;
+	sfd->fd_sock.type = type;
+	sfd->fd_sock.protocol = protocol;
+	sfd->fd_sock.placed = false;
+	return r;
+}
+
+// Send the datagram of 'len' bytes at 'buf' on socket 's' to 'to', or
+// to the connected peer if 'to' is NULL.  Returns the number of bytes
+// sent, or < 0 on error.
+ssize_t
+sendto(int s, const void *buf, size_t len, unsigned int flags,
+	   const struct sockaddr *to, socklen_t tolen)
+{
+	struct Fd *sfd;
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	fd_lookup(s, &sfd);
+	return sock_placed(s, nsipc_sendto(r, buf, len, flags | sock_flags(sfd),
+									   to, to ? tolen : 0));
+}
+
+// Receive a datagram on socket 's' into the 'len' bytes at 'buf', and
+// its sender's address into 'from' if it is not NULL.  Returns the
+// datagram's length, cut to 'len', or < 0 on error.
+ssize_t
+recvfrom(int s, void *buf, size_t len, unsigned int flags,
+		 struct sockaddr *from, socklen_t *fromlen)
+{
+	struct Fd *sfd;
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	fd_lookup(s, &sfd);
+	return nsipc_recvfrom(r, buf, len, flags | sock_flags(sfd), from, fromlen);
+}
+
+// Send the 'n' datagrams in 'msgs' on socket 's', as few requests to
+// the network server as fit them (see nsipc_sendmmsg).  A msg_addr of
+// family 0 sends to the connected peer.  Returns the number sent,
+// short if one failed, or < 0 if the first did.
+int
+sendmmsg(int s, const struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Fd *sfd;
+	int sent = 0, r, id;
+
+	if ((id = fd2sockid(s)) < 0)
+		return id;
+	fd_lookup(s, &sfd);
+	while (sent < n)
+	{
+		if ((r = nsipc_sendmmsg(id, msgs + sent, n - sent, flags | sock_flags(sfd))) <= 0)
+			return sock_placed(s, sent > 0 ? sent : r);
+		sent += r;
+	}
+	return sock_placed(s, sent);
+}
+
+// Receive up to 'n' datagrams on socket 's' into 'msgs' with one
+// request to the network server, waiting only for the first of them.
+// Returns the number received, or < 0 on error.
+int
+recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Fd *sfd;
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	fd_lookup(s, &sfd);
+	return nsipc_recvmmsg(r, msgs, n, flags | sock_flags(sfd));
+}
+
+// Set *addr to the IPv4 address of 'name', a host name or a dotted
+// quad.  The network server keeps each DNS answer for its TTL, so
+// repeated lookups don't go to the DNS server.  Returns 0 on success,
+// or < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the name does not resolve.
+//	-E_INVAL if it is empty or too long.
+int
+gethostaddr(const char *name, struct in_addr *addr)
+{
+	return nsipc_gethostbyname(name, addr);
+}
+
+// Send 'count' bytes of the file open as 'fd', starting at 'offset',
+// on socket 's', without copying them through this environment (see
+// nsipc_sendfile).  The file's seek position is left alone.  Returns
+// the number of bytes sent, or < 0 on error.
+ssize_t
+sendfile(int s, int fd, off_t offset, size_t count)
+{
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	return nsipc_sendfile(r, fd, offset, count);
+}
+
+// Poll the sockets among fds[0..nfds) with a single request to the
+// network server, waiting up to 'timeout' msec (forever if < 0) for
+// one of them to be ready, and set their revents; other fds are left
+// alone.  The sockets must all be in one network server shard.
+// Returns the number of sockets ready, or < 0 on error.
+int
+sock_poll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct Nspollfd sfds[NSIPC_MAXPOLL];
+	int idx[NSIPC_MAXPOLL];
+	struct Fd *fd;
+	int i, n, r;
+
+	for (i = n = 0; i < nfds; i++)
+	{
+		if (fds[i].fd < 0 || fd_lookup(fds[i].fd, &fd) < 0 ||
+			fd->fd_dev_id != devsock.dev_id)
+			continue;
+		if (n == NSIPC_MAXPOLL)
+			return -E_INVAL;
+		sfds[n].s = fd->fd_sock.sockid;
+		sfds[n].events = fds[i].events;
+		idx[n++] = i;
+	}
+	if (n == 0)
+		return 0;
+
+	if ((r = nsipc_poll(sfds, n, timeout)) < 0)
+		return r;
+	for (i = 0; i < n; i++)
+		fds[idx[i]].revents = sfds[i].revents;
+	return r;
+}
+
+int
+epoll_create(void)
+{
+	struct Fd *efd;
+	int q, r;
+
+	if ((q = nsipc_epoll_create(-1)) < 0)
+		return q;
+	if ((r = fd_alloc(&efd)) < 0
+		|| (r = sys_page_alloc(0, efd, PTE_P | PTE_W | PTE_U | PTE_SHARE)) < 0)
+	{
+		nsipc_epoll_close(q);
+		return r;
+	}
+
+	efd->fd_dev_id = devepoll.dev_id;
+	efd->fd_omode = O_RDWR;
+	efd->fd_sock.sockid = q;
+	return fd2num(efd);
+}
+
+// Start, change or stop (op EPOLL_CTL_ADD, _MOD, _DEL) watching socket
+// 'fd' for event->events in the event queue 'epfd'.  An event that is
+// already true when watching starts is reported by the next wait.
+// The sockets a queue watches must all be in one network server shard;
+// a queue watching none yet moves to the shard of the next one.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if epfd is not an event queue, or fd is in another shard.
+//	-E_NOT_SUPP if fd is not a socket.
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct Fd *efd;
+	int r, s, q;
+
+	if ((r = fd_lookup(epfd, &efd)) < 0)
+		return r;
+	if (efd->fd_dev_id != devepoll.dev_id)
+		return -E_INVAL;
+	if ((s = fd2sockid(fd)) < 0)
+		return s;
+	if (op == EPOLL_CTL_ADD && efd->fd_sock.nwatch == 0 &&
+		NSSOCK_SHARD(s) != NSSOCK_SHARD(efd->fd_sock.sockid))
+	{
+		if ((q = nsipc_epoll_create(NSSOCK_SHARD(s))) < 0)
+			return q;
+		nsipc_epoll_close(efd->fd_sock.sockid);
+		efd->fd_sock.sockid = q;
+	}
+	r = nsipc_epoll_ctl(efd->fd_sock.sockid, op, s,
+						event ? event->events : 0, event ? event->data : 0);
+	if (r >= 0 && op == EPOLL_CTL_ADD)
+		efd->fd_sock.nwatch++;
+	else if (r >= 0 && op == EPOLL_CTL_DEL && efd->fd_sock.nwatch > 0)
+		efd->fd_sock.nwatch--;
+	return r;
+}
+
+// Return up to 'maxevents' events from the event queue 'epfd', waiting
+// up to 'timeout' msec (forever if < 0) if there are none yet, all with
+// one request to the network server.
+// Returns the number of events, 0 on timeout, or < 0 on error.
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	struct Fd *efd;
+	int r;
+
+	if ((r = fd_lookup(epfd, &efd)) < 0)
+		return r;
+	if (efd->fd_dev_id != devepoll.dev_id)
+		return -E_INVAL;
+	return nsipc_epoll_wait(efd->fd_sock.sockid, events, maxevents, timeout);
+}
+
+static int
+devepoll_close(struct Fd *fd)
+{
+	if (pageref(fd) == 1)
+		return nsipc_epoll_close(fd->fd_sock.sockid);
+	else
+		return 0;
+}
+
+static int
+devepoll_stat(struct Fd *fd, struct Stat *stat)
+{
+	strcpy(stat->st_name, "<epoll>");
+	return 0;
 }
@@ -0,0 +1,471 @@
+// Buffered streams over file descriptors.  A FILE collects small reads
+// and writes in a buffer and moves it with one read or write of the
+// whole buffer, so that programs working a line or a character at a
+// time still make buffer-sized file server and pipe requests.
+//
+// A stream's buffer comes from malloc at its first read or write, unless
+// setvbuf gave it one; if malloc fails, the stream is unbuffered.
+// stdout is line buffered on the console and fully buffered otherwise,
+// and stderr is unbuffered.  Streams with output still in their buffers
+// are flushed by exit().
+
+#include <inc/lib.h>
+
+// f_flags
+#define F_READ     0x1    // opened for reading
+#define F_WRITE    0x2    // opened for writing
+#define F_OUT      0x4    // the buffer holds output, not input
+#define F_EOF      0x8    // a read found the end of the file
+#define F_ERR      0x10   // a read or write failed
+#define F_MYBUF    0x20   // f_buf is ours to free
+
+struct FILE {
+	int f_fd;
+	int f_flags;        // 0 if the slot is free
+	int f_mode;         // _IOFBF, _IOLBF, _IONBF or 0 for the default
+	char *f_buf;
+	size_t f_size;      // bytes of f_buf, or to malloc for it
+	size_t f_pos;       // reading: the unread bytes are [f_pos, f_len)
+	size_t f_len;       // writing: the output is [0, f_len)
+	char f_ch;          // the buffer of an unbuffered stream
+};
+
+static FILE files[FOPEN_MAX] = {
+	{ .f_fd = 0, .f_flags = F_READ },
+	{ .f_fd = 1, .f_flags = F_WRITE },
+	{ .f_fd = 2, .f_flags = F_WRITE, .f_mode = _IONBF },
+};
+
+FILE *stdin = &files[0];
+FILE *stdout = &files[1];
+FILE *stderr = &files[2];
+
+static void
+flush_all(void)
+{
+	fflush(NULL);
+}
+
+// Give f its buffer, before its first read or write.
+static void
+stream_setup(FILE *f)
+{
+	if (f->f_flags & F_WRITE)
+		exit_flush = flush_all;
+	if (f->f_buf)
+		return;
+	if (f->f_mode == 0)
+		f->f_mode = f == stdout && iscons(f->f_fd) ? _IOLBF : _IOFBF;
+	if (f->f_mode != _IONBF)
+	{
+		if (f->f_size == 0)
+			f->f_size = STDIO_BUFSIZ;
+		if ((f->f_buf = malloc(f->f_size)) != NULL)
+		{
+			f->f_flags |= F_MYBUF;
+			return;
+		}
+		f->f_mode = _IONBF;
+	}
+	f->f_buf = &f->f_ch;
+	f->f_size = 1;
+}
+
+// Write out f's buffered output.  Returns 0 on success, < 0 on error,
+// leaving what could not be written in the buffer.
+static int
+flush_out(FILE *f)
+{
+	size_t done = 0;
+	ssize_t r = 0;
+
+	while (done < f->f_len && (r = write(f->f_fd, f->f_buf + done, f->f_len - done)) > 0)
+		done += r;
+	memmove(f->f_buf, f->f_buf + done, f->f_len - done);
+	f->f_len -= done;
+	if (f->f_len == 0)
+		return 0;
+	f->f_flags |= F_ERR;
+	return r < 0 ? r : -E_EOF;
+}
+
+// Make f's buffer hold input, writing out any output first.
+static int
+to_read(FILE *f)
+{
+	int r;
+
+	if (!(f->f_flags & F_READ))
+		return -E_INVAL;
+	stream_setup(f);
+	if (f->f_flags & F_OUT)
+	{
+		if ((r = flush_out(f)) < 0)
+			return r;
+		f->f_flags &= ~F_OUT;
+		f->f_pos = f->f_len = 0;
+	}
+	return 0;
+}
+
+// Make f's buffer hold output.  Input read ahead but not consumed is
+// dropped, moving the seek position back to just after what was.
+static int
+to_write(FILE *f)
+{
+	struct Fd *fd;
+
+	if (!(f->f_flags & F_WRITE))
+		return -E_INVAL;
+	stream_setup(f);
+	if (!(f->f_flags & F_OUT))
+	{
+		if (f->f_pos < f->f_len && fd_lookup(f->f_fd, &fd) == 0)
+			seek(f->f_fd, fd->fd_offset - (f->f_len - f->f_pos));
+		f->f_flags |= F_OUT;
+		f->f_pos = f->f_len = 0;
+	}
+	return 0;
+}
+
+// Read f's next buffer full.  Returns the bytes read, 0 at the end of
+// the file or < 0 on error.  A prompt waiting in a line-buffered
+// stdout goes out first, as the reader will want to see it.
+static ssize_t
+fill(FILE *f)
+{
+	ssize_t r;
+
+	if (f->f_flags & (F_EOF | F_ERR))
+		return 0;
+	if (stdout->f_mode == _IOLBF && (stdout->f_flags & F_OUT) && stdout->f_len)
+		flush_out(stdout);
+	f->f_pos = f->f_len = 0;
+	if ((r = read(f->f_fd, f->f_buf, f->f_size)) > 0)
+		f->f_len = r;
+	else
+		f->f_flags |= r < 0 ? F_ERR : F_EOF;
+	return r;
+}
+
+static FILE *
+stream_alloc(int fd, int flags)
+{
+	int i;
+
+	for (i = 0; i < FOPEN_MAX; i++)
+		if (files[i].f_flags == 0)
+		{
+			memset(&files[i], 0, sizeof(files[i]));
+			files[i].f_fd = fd;
+			files[i].f_flags = flags;
+			return &files[i];
+		}
+	return NULL;
+}
+
+// The open mode and stream flags for fopen's 'mode': "r", "w" or "a",
+// each optionally followed by "+" for both reading and writing.
+static int
+stream_mode(const char *mode, int *flags)
+{
+	bool plus = strchr(mode, '+') != NULL;
+
+	*flags = plus ? F_READ | F_WRITE : 0;
+	switch (mode[0])
+	{
+		case 'r':
+			*flags |= F_READ;
+			return plus ? O_RDWR : O_RDONLY;
+		case 'w':
+			*flags |= F_WRITE;
+			return (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+		case 'a':
+			*flags |= F_WRITE;
+			return (plus ? O_RDWR : O_WRONLY) | O_CREAT;
+		default:
+			return -E_INVAL;
+	}
+}
+
+// Open the file 'path' as a stream, with 'mode' as for fopen in C
+// ("a" streams start at the end of the file rather than always write
+// there).  Returns NULL on error.
+FILE *
+fopen(const char *path, const char *mode)
+{
+	struct Stat st;
+	int omode, flags, fd;
+	FILE *f;
+
+	if ((omode = stream_mode(mode, &flags)) < 0 ||
+		(fd = open(path, omode)) < 0)
+		return NULL;
+	if (mode[0] == 'a' && fstat(fd, &st) == 0)
+		seek(fd, st.st_size);
+	if ((f = stream_alloc(fd, flags)) == NULL)
+		close(fd);
+	return f;
+}
+
+// A stream over the open file descriptor 'fd'.  Returns NULL if 'mode'
+// is not one fopen takes or every stream is in use.
+FILE *
+fdopen(int fd, const char *mode)
+{
+	int flags;
+
+	if (stream_mode(mode, &flags) < 0)
+		return NULL;
+	return stream_alloc(fd, flags);
+}
+
+// Flush and close f, and its file descriptor.  Returns 0 on success,
+// < 0 on error.
+int
+fclose(FILE *f)
+{
+	int r, r2;
+
+	r = fflush(f);
+	r2 = close(f->f_fd);
+	if (f->f_flags & F_MYBUF)
+		free(f->f_buf);
+	memset(f, 0, sizeof(*f));
+	return r < 0 ? r : r2;
+}
+
+// Write out f's buffered output, or every stream's if f is NULL.
+// Returns 0 on success, < 0 on error.
+int
+fflush(FILE *f)
+{
+	int i, r = 0, r2;
+
+	if (f == NULL)
+	{
+		for (i = 0; i < FOPEN_MAX; i++)
+			if (files[i].f_flags && (r2 = fflush(&files[i])) < 0)
+				r = r2;
+		return r;
+	}
+	if (!(f->f_flags & F_OUT))
+		return 0;
+	return flush_out(f);
+}
+
+// Set f's buffering: 'mode' is _IOFBF, _IOLBF or _IONBF, and 'buf', if
+// not NULL, the 'size' bytes to buffer in; with no 'buf', 'size' says
+// how much to malloc.  Only before f's first read or write.  Returns 0
+// on success, < 0 on error.
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (f->f_buf || (mode != _IOFBF && mode != _IOLBF && mode != _IONBF))
+		return -E_INVAL;
+	f->f_mode = mode;
+	if (mode != _IONBF && buf)
+	{
+		if (size == 0)
+			return -E_INVAL;
+		f->f_buf = buf;
+	}
+	f->f_size = size;
+	return 0;
+}
+
+// Read 'n' items of 'size' bytes from f into 'buf', less only at the
+// end of the file or on an error.  Reads of at least a buffer full go
+// straight into 'buf'.  Returns the items read.
+size_t
+fread(void *buf, size_t size, size_t n, FILE *f)
+{
+	size_t len = size * n, done = 0, k;
+	ssize_t r;
+
+	if (len == 0 || to_read(f) < 0)
+		return 0;
+	while (done < len)
+	{
+		if (f->f_pos < f->f_len)
+		{
+			k = MIN(f->f_len - f->f_pos, len - done);
+			memcpy((char *) buf + done, f->f_buf + f->f_pos, k);
+			f->f_pos += k;
+			done += k;
+		} else if (len - done >= f->f_size && !(f->f_flags & (F_EOF | F_ERR)))
+		{
+			if ((r = read(f->f_fd, (char *) buf + done, len - done)) <= 0)
+			{
+				f->f_flags |= r < 0 ? F_ERR : F_EOF;
+				break;
+			}
+			done += r;
+		} else if (fill(f) <= 0)
+			break;
+	}
+	return done / size;
+}
+
+// Write 'n' items of 'size' bytes from 'buf' to f.  Writes of at least
+// a buffer full, when nothing is buffered, go straight out.  Returns
+// the items written, fewer only on an error.
+size_t
+fwrite(const void *buf, size_t size, size_t n, FILE *f)
+{
+	const char *p = buf;
+	size_t len = size * n, done = 0, k;
+	ssize_t r;
+
+	if (len == 0 || to_write(f) < 0)
+		return 0;
+	while (done < len)
+	{
+		if (f->f_len == 0 && len - done >= f->f_size)
+		{
+			if ((r = write(f->f_fd, p + done, len - done)) <= 0)
+			{
+				f->f_flags |= F_ERR;
+				break;
+			}
+			done += r;
+			continue;
+		}
+		k = MIN(f->f_size - f->f_len, len - done);
+		memcpy(f->f_buf + f->f_len, p + done, k);
+		f->f_len += k;
+		done += k;
+		if (f->f_len == f->f_size && flush_out(f) < 0)
+			break;
+	}
+	if (f->f_mode == _IOLBF && memfind(p, '\n', done) != p + done)
+		flush_out(f);
+	return done / size;
+}
+
+// Read a line from f into 's', newline and all, stopping short after
+// size - 1 bytes or at the end of the file, and NUL-terminate it.
+// Returns 's', or NULL if nothing could be read.
+char *
+fgets(char *s, int size, FILE *f)
+{
+	size_t n = 0, k;
+	char *p, *nl;
+
+	if (size <= 0 || to_read(f) < 0)
+		return NULL;
+	while (n < size - 1)
+	{
+		if (f->f_pos == f->f_len && fill(f) <= 0)
+			break;
+		p = f->f_buf + f->f_pos;
+		k = MIN(f->f_len - f->f_pos, size - 1 - n);
+		if ((nl = memfind(p, '\n', k)) != p + k)
+			k = nl - p + 1;
+		memcpy(s + n, p, k);
+		f->f_pos += k;
+		n += k;
+		if (s[n - 1] == '\n')
+			break;
+	}
+	if (n == 0)
+		return NULL;
+	s[n] = '\0';
+	return s;
+}
+
+// Returns the next byte of f, or EOF at the end of the file or on error.
+int
+fgetc(FILE *f)
+{
+	unsigned char c;
+
+	return fread(&c, 1, 1, f) == 1 ? c : EOF;
+}
+
+// Returns 'c', or EOF on error.
+int
+fputc(int c, FILE *f)
+{
+	unsigned char ch = c;
+
+	return fwrite(&ch, 1, 1, f) == 1 ? ch : EOF;
+}
+
+// Returns 0 on success, EOF on error.
+int
+fputs(const char *s, FILE *f)
+{
+	size_t len = strlen(s);
+
+	return fwrite(s, 1, len, f) == len ? 0 : EOF;
+}
+
+int
+feof(FILE *f)
+{
+	return (f->f_flags & F_EOF) != 0;
+}
+
+int
+ferror(FILE *f)
+{
+	return (f->f_flags & F_ERR) != 0;
+}
+
+int
+fileno(FILE *f)
+{
+	return f->f_fd;
+}
+
+// vfsprintf collects its output in chunks, so that even an unbuffered
+// stream takes it in a write or two.
+struct streambuf {
+	FILE *f;
+	int idx;
+	int count;
+	char buf[128];
+};
+
+static void
+putch(int ch, void *thunk)
+{
+	struct streambuf *b = thunk;
+
+	b->buf[b->idx++] = ch;
+	if (b->idx == sizeof(b->buf))
+	{
+		b->count += fwrite(b->buf, 1, b->idx, b->f);
+		b->idx = 0;
+	}
+}
+
+// printf to a stream (fprintf writes to a file descriptor).  Returns
+// the bytes written.
+int
+vfsprintf(FILE *f, const char *fmt, va_list ap)
+{
+	struct streambuf b;
+
+	b.f = f;
+	b.idx = 0;
+	b.count = 0;
+	vprintfmt(putch, &b, fmt, ap);
+	if (b.idx > 0)
+		b.count += fwrite(b.buf, 1, b.idx, f);
+	return b.count;
+}
+
+int
+fsprintf(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+	int cnt;
+
+	va_start(ap, fmt);
+	cnt = vfsprintf(f, fmt, ap);
+	va_end(ap);
+
+	return cnt;
+}
@@ -1,6 +1,7 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/x86.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -8,14 +9,27 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// The string routines look at a word at a time once the pointer is
+// aligned.  An aligned word never straddles a page, so reading all of
+// the one holding a string's terminating null is safe.  HASZERO(w) is
+// nonzero iff some byte of w is zero.
+#define ONES        0x01010101U
+#define HASZERO(w)  (((w) - ONES) & ~(w) & (ONES << 7))
+
 int
 strlen(const char *s)
 {
-	int n;
+	const char *p;
+	const uint32_t *w;
 
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	for (p = s; (uintptr_t) p % 4 != 0; p++)
+		if (*p == '\0')
+			return p - s;
+	for (w = (const uint32_t *) p; !HASZERO(*w); w++)
+		/* do nothing */;
+	for (p = (const char *) w; *p != '\0'; p++)
+		/* do nothing */;
+	return p - s;
 }
 
 int
@@ -82,6 +96,21 @@ strlcpy(char *dst, const char *src, size_t size)
 int
 strcmp(const char *p, const char *q)
 {
+	const uint32_t *wp, *wq;
+
+	// Words only when both strings reach alignment together
+	if ((uintptr_t) p % 4 == (uintptr_t) q % 4)
+	{
+		for (; (uintptr_t) p % 4 != 0; p++, q++)
+			if (!*p || *p != *q)
+				return (int) ((unsigned char) *p - (unsigned char) *q);
+		wp = (const uint32_t *) p;
+		wq = (const uint32_t *) q;
+		while (*wp == *wq && !HASZERO(*wp))
+			wp++, wq++;
+		p = (const char *) wp;
+		q = (const char *) wq;
+	}
 	while (*p && *p == *q)
 		p++, q++;
 	return (int) ((unsigned char) *p - (unsigned char) *q);
@@ -103,7 +132,15 @@ strncmp(const char *p, const char *q, size_t n)
 char *
 strchr(const char *s, char c)
 {
-	for (; *s; s++)
+	const uint32_t *w;
+	uint32_t cs = (uint8_t) c * ONES;
+
+	for (; (uintptr_t) s % 4 != 0; s++)
+		if (!*s || *s == c)
+			return *s ? (char *) s : 0;
+	for (w = (const uint32_t *) s; !HASZERO(*w) && !HASZERO(*w ^ cs); w++)
+		/* do nothing */;
+	for (s = (const char *) w; *s; s++)
 		if (*s == c)
 			return (char *) s;
 	return 0;
@@ -122,24 +159,53 @@ strfind(const char *s, char c)
 
 #if ASM
 
+// Below this many bytes, aligning first costs more than it saves.
+#define ALIGN_MIN 16
+
+// Copy n bytes forward, from the lowest address up.
+static void
+copy_fwd(char *d, const char *s, size_t n)
+{
+	size_t m;
+
+	if (n >= ALIGN_MIN)
+	{
+		// Align the destination, then move words: x86 reads an
+		// unaligned source almost as fast as an aligned one.
+		m = -(uintptr_t) d % 4;
+		n -= m;
+		asm volatile("cld; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (m) :: "cc", "memory");
+		m = n / 4;
+		n %= 4;
+		asm volatile("rep movsl\n"
+		: "+D" (d), "+S" (s), "+c" (m) :: "cc", "memory");
+	}
+	asm volatile("cld; rep movsb\n"
+	: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
+}
+
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
+	char *p = v;
+	size_t m;
 
-	if (n == 0)
-		return v;
-	if ((int) v % 4 == 0 && n % 4 == 0)
+	c &= 0xFF;
+	if (n >= ALIGN_MIN)
 	{
-		c &= 0xFF;
-		c = (c << 24) | (c << 16) | (c << 8) | c;
-		asm volatile("cld; rep stosl\n"
-		::"D" (v), "a" (c), "c" (n / 4)
+		m = -(uintptr_t) p % 4;
+		n -= m;
+		asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (m) : "a" (c) : "cc", "memory");
+		m = n / 4;
+		n %= 4;
+		asm volatile("rep stosl\n"
+		: "+D" (p), "+c" (m) : "a" ((c << 24) | (c << 16) | (c << 8) | c)
 		: "cc", "memory");
-	} else
-			asm volatile("cld; rep stosb\n"
-			::"D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+	}
+	asm volatile("cld; rep stosb\n"
+	: "+D" (p), "+c" (n) : "a" (c) : "cc", "memory");
 	return v;
 }
 
@@ -148,33 +214,103 @@ memmove(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
+	size_t m;
 
 	s = src;
 	d = dst;
 	if (s < d && s + n > d)
 	{
-		s += n;
-		d += n;
-		if ((int) s % 4 == 0 && (int) d % 4 == 0 && n % 4 == 0)
-				asm volatile("std; rep movsl\n"
-				::"D" (d - 4), "S" (s - 4), "c" (n / 4) : "cc", "memory");
-		else
-				asm volatile("std; rep movsb\n"
-				::"D" (d - 1), "S" (s - 1), "c" (n) : "cc", "memory");
+		// Backward, from the last byte down, aligning the end of
+		// the destination
+		s += n - 1;
+		d += n - 1;
+		if (n >= ALIGN_MIN)
+		{
+			m = ((uintptr_t) d + 1) % 4;
+			n -= m;
+			asm volatile("std; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (m) :: "cc", "memory");
+			m = n / 4;
+			n %= 4;
+			d -= 3;
+			s -= 3;
+			asm volatile("rep movsl\n"
+			: "+D" (d), "+S" (s), "+c" (m) :: "cc", "memory");
+			d += 3;
+			s += 3;
+		}
+		asm volatile("std; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld":: : "cc");
 	} else
+		copy_fwd(d, s, n);
+	return dst;
+}
+
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+	copy_fwd(dst, src, n);
+	return dst;
+}
+
+// Can we use movnti, which needs SSE2?  Its stores go around the cache,
+// so filling a page with them does not evict what the caller's working
+// set keeps there.  They use no SSE registers, whose state nothing
+// saves across context switches.
+static bool
+nt_ok(void)
+{
+	static int ok = -1;
+	uint32_t edx;
+
+	if (ok < 0)
 	{
-		if ((int) s % 4 == 0 && (int) d % 4 == 0 && n % 4 == 0)
-				asm volatile("cld; rep movsl\n"
-				::"D" (d), "S" (s), "c" (n / 4) : "cc", "memory");
-		else
-				asm volatile("cld; rep movsb\n"
-				::"D" (d), "S" (s), "c" (n) : "cc", "memory");
+		cpuid(1, NULL, NULL, NULL, &edx);
+		ok = (edx & CPUID_SSE2) != 0;
 	}
+	return ok;
+}
+
+// memcpy for large copies whose destination will not be read soon,
+// such as whole pages.  Non-temporal when dst, src and n are all
+// 4-byte aligned and the CPU can; memcpy otherwise.
+void *
+memcpy_nt(void *dst, const void *src, size_t n)
+{
+	uint32_t *d = dst, w;
+	const uint32_t *s = src;
+	size_t i;
+
+	if (((uintptr_t) dst | (uintptr_t) src | n) % 4 != 0 || !nt_ok())
+		return memcpy(dst, src, n);
+	for (i = 0; i < n / 4; i++)
+	{
+		w = s[i];
+		asm volatile("movnti %1, %0" : "=m" (d[i]) : "r" (w));
+	}
+	asm volatile("sfence" ::: "memory");
 	return dst;
 }
 
+// memset, non-temporal, on the same terms as memcpy_nt.
+void *
+memset_nt(void *v, int c, size_t n)
+{
+	uint32_t *d = v, w;
+	size_t i;
+
+	if (((uintptr_t) v | n) % 4 != 0 || !nt_ok())
+		return memset(v, c, n);
+	c &= 0xFF;
+	w = (c << 24) | (c << 16) | (c << 8) | c;
+	for (i = 0; i < n / 4; i++)
+		asm volatile("movnti %1, %0" : "=m" (d[i]) : "r" (w));
+	asm volatile("sfence" ::: "memory");
+	return v;
+}
+
 #else
 
 void *
@@ -210,7 +346,6 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
@@ -218,12 +353,33 @@ memcpy(void *dst, const void *src, size_t n)
 	return memmove(dst, src, n);
 }
 
+void *
+memcpy_nt(void *dst, const void *src, size_t n)
+{
+	return memcpy(dst, src, n);
+}
+
+void *
+memset_nt(void *v, int c, size_t n)
+{
+	return memset(v, c, n);
+}
+#endif
+
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+	// Skip the equal words.  Both buffers are n bytes long, so
+	// unaligned reads of v2 stay inside it.
+	for (; n > 0 && (uintptr_t) s1 % 4 != 0; n--, s1++, s2++)
+		if (*s1 != *s2)
+			return (int) *s1 - (int) *s2;
+	for (; n >= 4 && *(const uint32_t *) s1 == *(const uint32_t *) s2; n -= 4)
+		s1 += 4, s2 += 4;
+
 	while (n-- > 0)
 	{
 		if (*s1 != *s2)
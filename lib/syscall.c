@@ -2,11 +2,60 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether the CPU has sysenter; -1 until checked.
+static int sysenter_ok = -1;
+
+static inline bool
+use_sysenter(int num)
+{
+	uint32_t edx;
+
+	// sysenter leaves only four argument registers free.
+	if (num == SYS_page_map || num == SYS_page_map_batch ||
+		num == SYS_ipc_call || num == SYS_ipc_reply_wait ||
+		num == SYS_blk_submit)
+		return 0;
+	if (sysenter_ok < 0)
+	{
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sysenter_ok = (edx & CPUID_SEP) != 0;
+	}
+	return sysenter_ok;
+}
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t edx, ecx;
+
+	// Fast path: sysenter with the same argument registers as below,
+	// the return %eip in %esi and the user %esp in %ebp.  The kernel
+	// comes back with sysexit, which clobbers %edx and %ecx.  With no
+	// register left for a5, only calls whose a5 is a constant 0 may go
+	// this way: a stub with a fifth argument that use_sysenter does not
+	// know of still traps, rather than pass its return %eip as a5.
+	if (__builtin_constant_p(a5) && a5 == 0 && use_sysenter(num))
+	{
+		asm volatile("pushl %%ebp\n"
+		"movl %%esp, %%ebp\n"
+		"leal 1f, %%esi\n"
+		"sysenter\n"
+		"1: popl %%ebp\n"
+		: "=a" (ret), "=d" (edx), "=c" (ecx)
+		: "a" (num),
+		"1" (a1),
+		"2" (a2),
+		"b" (a3),
+		"D" (a4)
+		: "esi", "cc", "memory");
+
+		if (check && ret > 0)
+			panic("syscall %d returned %d (> 0)\n", num, ret);
+		return ret;
+	}
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
@@ -67,8 +116,31 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+// How often, and how many milliseconds apart, sys_page_alloc tries
+// again when the kernel is out of memory.  The kernel has told the
+// file server by the first failure, which gives clean cache blocks
+// back meanwhile.
+#define PAGE_ALLOC_TRIES    8
+#define PAGE_ALLOC_BACKOFF  10
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	int r, i;
+
+	for (i = 0; ; i++)
+	{
+		r = sys_page_alloc_nowait(envid, va, perm);
+		if (r != -E_NO_MEM || i == PAGE_ALLOC_TRIES - 1)
+			return r;
+		sys_sleep(PAGE_ALLOC_BACKOFF * (i + 1));
+	}
+}
+
+// sys_page_alloc, failing at once when the kernel is out of memory:
+// for the file server, which is what gives memory back meanwhile.
+int
+sys_page_alloc_nowait(envid_t envid, void *va, int perm)
 {
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
@@ -111,12 +183,24 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t) dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_pages(void *dstva, unsigned npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -132,3 +216,299 @@ int sys_try_recv_packet(uint8_t *buffer, uint32_t buffer_size, uint32_t *packet_
 {
 	return syscall(SYS_try_recv_packet, 0, (uint32_t) buffer, buffer_size, (uint32_t) packet_size, 0, 0);
 }
+
+int
+sys_env_set_weight(envid_t envid, uint32_t weight)
+{
+	return syscall(SYS_env_set_weight, 1, envid, weight, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
+envid_t
+sys_fork_cow(void)
+{
+	return syscall(SYS_fork_cow, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_map_batch(envid_t src_env, envid_t dst_env,
+				   const struct PageMapOp *ops, size_t n, size_t *done)
+{
+	return syscall(SYS_page_map_batch, 1, src_env, dst_env, (uint32_t) ops, n, (uint32_t) done);
+}
+
+int
+sys_ipc_call(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, to_env, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, to_env, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_time_usec(uint64_t *usec)
+{
+	return syscall(SYS_time_usec, 0, (uint32_t) usec, 0, 0, 0, 0);
+}
+
+int
+sys_ring_wait(const volatile uint32_t *addr, uint32_t val)
+{
+	return syscall(SYS_ring_wait, 0, (uint32_t) addr, val, 0, 0, 0);
+}
+
+int
+sys_ring_notify(envid_t env)
+{
+	return syscall(SYS_ring_notify, 0, env, 0, 0, 0, 0);
+}
+
+int
+sys_net_recv_wait(uint32_t queue)
+{
+	return syscall(SYS_net_recv_wait, 0, queue, 0, 0, 0, 0);
+}
+
+int
+sys_net_recv_page(void *va, struct NetBuf *buf, uint32_t queue)
+{
+	return syscall(SYS_net_recv_page, 0, (uint32_t) va, (uint32_t) buf, queue, 0, 0);
+}
+
+int
+sys_net_transmit_page(const void *packet_data, uint32_t packet_size, uint32_t *ndone)
+{
+	return syscall(SYS_net_transmit_page, 0, (uint32_t) packet_data, packet_size, (uint32_t) ndone, 0, 0);
+}
+
+int
+sys_net_recv_batch(struct NetBuf *bufs, size_t n, uint32_t queue)
+{
+	return syscall(SYS_net_recv_batch, 0, (uint32_t) bufs, n, queue, 0, 0);
+}
+
+int
+sys_net_transmit_batch(const struct NetBuf *bufs, size_t n, uint32_t *ndone)
+{
+	return syscall(SYS_net_transmit_batch, 0, (uint32_t) bufs, n, (uint32_t) ndone, 0, 0);
+}
+
+int
+sys_net_moderate(const struct NetModeration *set, struct NetModeration *old)
+{
+	return syscall(SYS_net_moderate, 0, (uint32_t) set, (uint32_t) old, 0, 0, 0);
+}
+
+int
+sys_net_stats(struct NetStats *st)
+{
+	return syscall(SYS_net_stats, 0, (uint32_t) st, 0, 0, 0, 0);
+}
+
+int
+sys_page_paddr(const void *va, size_t npages, physaddr_t *pa)
+{
+	return syscall(SYS_page_paddr, 0, (uint32_t) va, npages, (uint32_t) pa, 0, 0);
+}
+
+int
+sys_irq_ipc(uint32_t irq, uint32_t value)
+{
+	return syscall(SYS_irq_ipc, 1, irq, value, 0, 0, 0);
+}
+
+int
+sys_blk_info(uint32_t disk, struct BlkInfo *info)
+{
+	return syscall(SYS_blk_info, 0, disk, (uint32_t) info, 0, 0, 0);
+}
+
+int
+sys_blk_submit(uint32_t tag, uint32_t secno, const void *buf, size_t nsecs, uint32_t flags)
+{
+	return syscall(SYS_blk_submit, 0, tag, secno, (uint32_t) buf, nsecs, flags);
+}
+
+int
+sys_blk_reap(struct BlkDone *done, size_t n)
+{
+	return syscall(SYS_blk_reap, 0, (uint32_t) done, n, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(const volatile uint32_t *addr, uint32_t n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+envid_t
+sys_exofork_shared(void *eip, void *esp, void *xstacktop)
+{
+	return syscall(SYS_exofork_shared, 0, (uint32_t) eip, (uint32_t) esp,
+				   (uint32_t) xstacktop, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_page_cow_resolve(void *va)
+{
+	return syscall(SYS_page_cow_resolve, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_cow_upcall(envid_t envid, bool on)
+{
+	return syscall(SYS_env_set_cow_upcall, 1, envid, on, 0, 0, 0);
+}
+
+int
+sys_service_register(envid_t envid, const char *name)
+{
+	return syscall(SYS_service_register, 0, envid, (uint32_t) name, strlen(name), 0, 0);
+}
+
+int
+sys_trace_read(int cpu, uint32_t *pos, struct TraceEvent *buf, size_t n)
+{
+	return syscall(SYS_trace_read, 0, cpu, (uint32_t) pos, (uint32_t) buf, n, 0);
+}
+
+int
+sys_prof_ctl(bool on)
+{
+	return syscall(SYS_prof_ctl, 0, on, 0, 0, 0, 0);
+}
+
+int
+sys_prof_report(struct ProfReport *r)
+{
+	return syscall(SYS_prof_report, 0, (uint32_t) r, 0, 0, 0, 0);
+}
+
+int
+sys_pmc_set(envid_t envid, const uint32_t *evtsel, uint32_t n)
+{
+	return syscall(SYS_pmc_set, 1, envid, (uint32_t) evtsel, n, 0, 0);
+}
+
+int
+sys_sysstat_reset(envid_t envid)
+{
+	return syscall(SYS_sysstat_reset, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_sysstat_read(int cpu, struct SysStatReport *r)
+{
+	return syscall(SYS_sysstat_read, 0, cpu, (uint32_t) r, 0, 0, 0);
+}
+
+int
+sys_enter_ring(struct SysRing *ring)
+{
+	return syscall(SYS_enter_ring, 0, (uint32_t) ring, 0, 0, 0, 0);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_wait_notify(uint32_t mask, uint32_t timeout)
+{
+	return syscall(SYS_wait_notify, 0, mask, timeout, 0, 0, 0);
+}
+
+int
+sys_irq_notify(uint32_t irq, uint32_t bits)
+{
+	return syscall(SYS_irq_notify, 0, irq, bits, 0, 0, 0);
+}
+
+int
+sys_reclaim_notify(uint32_t bits)
+{
+	return syscall(SYS_reclaim_notify, 0, bits, 0, 0, 0, 0);
+}
+
+int
+sys_shlib_map(envid_t envid)
+{
+	return syscall(SYS_shlib_map, 0, envid, 0, 0, 0, 0);
+}
+
+envid_t
+sys_spawn(const void *image, size_t size, const char **argv)
+{
+	return syscall(SYS_spawn, 0, (uint32_t) image, size, (uint32_t) argv, 0, 0);
+}
+
+int
+sys_cons_read(void *buf, size_t n, bool wait)
+{
+	return syscall(SYS_cons_read, 0, (uint32_t) buf, n, wait, 0, 0);
+}
+
+int
+sys_ksm(int enable, struct KsmStats *st)
+{
+	return syscall(SYS_ksm, 0, enable, (uint32_t) st, 0, 0, 0);
+}
+
+int
+sys_ipc_send_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1)
+{
+	return syscall(SYS_ipc_send_words, 0, to_env, value, w0, w1, 0);
+}
+
+int
+sys_ipc_call_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1)
+{
+	return syscall(SYS_ipc_call_words, 0, to_env, value, w0, w1, 0);
+}
+
+int
+sys_ipc_recv_timeout(void *dstva, unsigned npages, uint32_t msec)
+{
+	return syscall(SYS_ipc_recv_timeout, 0, (uint32_t) dstva, npages, msec, 0, 0);
+}
+
+int
+sys_ipc_recv_from(void *dstva, unsigned npages, envid_t from, uint32_t msec)
+{
+	return syscall(SYS_ipc_recv_from, 0, (uint32_t) dstva, npages, from, msec, 0);
+}
+
+int
+sys_sleep(uint32_t msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_page_wait(const volatile uint32_t *addr, uint32_t val, uint32_t ref)
+{
+	return syscall(SYS_page_wait, 0, (uint32_t) addr, val, ref, 0, 0);
+}
@@ -0,0 +1,73 @@
+// Batched system calls through a submission ring (see sys_enter_ring).
+//
+// Queue calls with sysring_queue, run them all with sysring_enter, then
+// take their results with sysring_result in the order they were queued.
+// Only calls that never block can be queued; the kernel fails others
+// with -E_INVAL.  For example, to map a run of pages:
+//
+//	for (i = 0; i < n; i++)
+//		sysring_queue(r, SYS_page_alloc, i, 0, va + i * PGSIZE, perm, 0, 0);
+//	sysring_enter(r);
+//	while ((res = sysring_result(r)))
+//		...
+
+#include <inc/lib.h>
+
+// Set up the ring at the page-aligned address 'r', allocating its page.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if r is not page-aligned.
+//	-E_NO_MEM if the page could not be allocated.
+int
+sysring_init(struct SysRing *r)
+{
+	int ret;
+
+	if ((uintptr_t) r % PGSIZE != 0)
+		return -E_INVAL;
+	if ((ret = sys_page_alloc(0, r, PTE_P | PTE_U | PTE_W)) < 0)
+		return ret;
+	r->sq_head = r->sq_tail = 0;
+	r->cq_head = r->cq_tail = 0;
+	return 0;
+}
+
+// Queue system call 'syscallno' with arguments a1 to a5, tagged 'user'.
+// Returns 0 on success, -E_NO_MEM if the submission queue is full, or
+// would leave its calls no room for their results.
+int
+sysring_queue(struct SysRing *r, uint32_t syscallno, uint32_t user,
+			  uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SysRingEntry *sqe;
+
+	if (r->sq_tail - r->cq_head >= SYSRING_SIZE)
+		return -E_NO_MEM;
+	sqe = &r->sq[r->sq_tail % SYSRING_SIZE];
+	sqe->sqe_syscall = syscallno;
+	sqe->sqe_arg[0] = a1;
+	sqe->sqe_arg[1] = a2;
+	sqe->sqe_arg[2] = a3;
+	sqe->sqe_arg[3] = a4;
+	sqe->sqe_arg[4] = a5;
+	sqe->sqe_user = user;
+	r->sq_tail++;
+	return 0;
+}
+
+// Run every call queued, in one trap.
+// Returns the number run, or < 0 on error (see sys_enter_ring).
+int
+sysring_enter(struct SysRing *r)
+{
+	return sys_enter_ring(r);
+}
+
+// Take the oldest result not yet taken, or return NULL if there is
+// none.  It stays valid until the next sysring_queue.
+const struct SysRingResult *
+sysring_result(struct SysRing *r)
+{
+	if (r->cq_head == r->cq_tail)
+		return NULL;
+	return &r->cq[r->cq_head++ % SYSRING_SIZE];
+}
@@ -0,0 +1,18 @@
+// Clock reads through the kernel info page mapped at UINFO.
+// None of these functions enter the kernel.
+
+#include <inc/lib.h>
+
+// Milliseconds since boot, at timer tick (10ms) resolution.
+unsigned int
+time_msec(void)
+{
+	return uinfo.ticks * (UINFO_TICK_USEC / 1000);
+}
+
+// Microseconds since boot, interpolated between ticks with the TSC.
+uint64_t
+time_usec(void)
+{
+	return uinfo_usec(&uinfo);
+}
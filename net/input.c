@@ -1,50 +1,194 @@
+#include <kern/e1000.h>
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+// How long, in microseconds, to spin on an empty receive queue before
+// sleeping in sys_net_recv_wait.  The window adapts between 0 and this
+// bound: it halves each time it runs out with no packet and doubles
+// each time a packet turns up while spinning, so an idle link costs no
+// CPU while a busy one is served without an interrupt per packet.
+// Low-latency setups can raise the bound; 0 always sleeps at once.
+#ifndef INPUT_POLL_USEC
+#define INPUT_POLL_USEC 128
+#endif
 
+uint32_t ns_nshards = 1;
+
+static uint32_t poll_usec = INPUT_POLL_USEC;
+// The card's receive queue this environment drains
+static uint32_t rxq;
+
+// Receive at least one packet, and return how many were received.
+// In page-flip mode that is always one, mapped at the page-aligned
+// pkt in place of whatever was there, and described by bufs[0].  Otherwise up to n packets are copied into the buffers
+// described by bufs, all in one system call.
+static int
+recv_packets(struct jif_pkt *pkt, struct NetBuf *bufs, size_t n)
+{
+	uint64_t deadline = 0;
+	int r;
+
+	while (1)
+	{
+		if (INPUT_PAGEFLIP)
+			r = sys_net_recv_page(pkt, &bufs[0], rxq);
+		else
+			r = sys_net_recv_batch(bufs, n, rxq);
+		if (r >= 0)
+			break;
+		else if (r == -E_INVAL)
+			panic("ns_input: INVALID parameters");
+		else if (r == -E_NO_MEM)
+		{
+			// Out of replacement pages; the packet waits for us.
+			sys_yield();
+			continue;
+		}
+		else if (r != -E_NET_QUEUE_EMPTY)
+			panic("ns_input: unknown error %e\n", r);
+
+		if (deadline == 0)
+			deadline = time_usec() + poll_usec;
+		else if (time_usec() >= deadline)
+		{
+			poll_usec /= 2;
+			if ((r = sys_net_recv_wait(rxq)) < 0)
+				panic("ns_input: sys_net_recv_wait: %e", r);
+			deadline = 0;
+		}
+	}
+
+	if (deadline != 0)
+		poll_usec = MIN(INPUT_POLL_USEC, 2 * poll_usec + 1);
+	return INPUT_PAGEFLIP ? 1 : r;
+}
+
+// The shard that the packet of 'len' bytes at 'p' belongs to (see
+// inc/ns.h): the one that owns its destination port if it is TCP or
+// UDP, or -1 for an ARP reply, which every shard learns from.  ARP
+// requests, ICMP and the like go to shard 0, and so do IP fragments,
+// which only shard 0 reassembles: a datagram too big for one frame is
+// lost if another shard owns its port.
+static int
+packet_shard(const uint8_t *p, size_t len)
+{
+	const uint8_t *ip = p + 14;
+	uint32_t ihl;
+
+	if (len < 14)
+		return 0;
+	if (p[12] == 0x08 && p[13] == 0x06)
+		return len >= 22 && p[20] == 0 && p[21] == 2 ? -1 : 0;
+	if (p[12] != 0x08 || p[13] != 0x00 || len < 14 + 20)
+		return 0;
+	ihl = (ip[0] & 0xf) * 4;
+	if ((ip[6] & 0x3f) != 0 || ip[7] != 0 || (ip[9] != 6 && ip[9] != 17) ||
+		len < 14 + ihl + 4)
+		return 0;
+	return ns_port_shard((ip[ihl + 2] << 8) | ip[ihl + 3], ns_nshards);
+}
+
+// With several shards, receive each batch into a buffer of our own and
+// copy every packet into the ring to the shard it belongs to, all of
+// each ring's at once.  A packet whose ring is full is dropped rather
+// than hold up the other shards; TCP sends it again.
+static void __attribute__((noreturn))
+input_sharded(uint32_t queue)
+{
+	static char stage[NET_MAXBATCH][NS_RING_SLOTSIZE - sizeof(struct jif_pkt)];
+	struct NetBuf bufs[NET_MAXBATCH];
+	uint32_t npub[NS_MAX_SHARDS];
+	struct jif_pkt *pkt;
+	struct Ring *ring;
+	int i, n, s, first, last;
+
+	while (1)
+	{
+		for (i = 0; i < NET_MAXBATCH; i++)
+		{
+			bufs[i].data = (uintptr_t) stage[i];
+			bufs[i].len = sizeof(stage[i]);
+		}
+		n = recv_packets(NULL, bufs, NET_MAXBATCH);
+
+		memset(npub, 0, sizeof(npub));
+		for (i = 0; i < n; i++)
+		{
+			s = packet_shard((const uint8_t *) stage[i], bufs[i].len);
+			first = s < 0 ? 0 : s;
+			last = s < 0 ? (int) ns_nshards - 1 : s;
+			for (s = first; s <= last; s++)
+			{
+				ring = NS_SHARD_INRING(queue, s);
+				if ((pkt = ring_reserve_nth(ring, npub[s])) == NULL)
+					continue;
+				memmove(pkt->jp_data, stage[i], bufs[i].len);
+				pkt->jp_len = bufs[i].len;
+				pkt->jp_flags = bufs[i].flags;
+				npub[s]++;
+			}
+		}
+		for (s = 0; s < (int) ns_nshards; s++)
+			if (npub[s] > 0)
+				ring_publish_n(NS_SHARD_INRING(queue, s), npub[s]);
+	}
+}
+
+// Feed the network server the packets from receive queue 'queue' of
+// the card, through 'ring', or through the rings from that queue to
+// every shard if there are several.
 void
-input(envid_t ns_envid)
+input(struct Ring *ring, uint32_t queue)
 {
+	struct NetBuf bufs[NET_MAXBATCH];
+	struct jif_pkt *pkt;
+	int i, n;
+
 	binaryname = "ns_input";
+	rxq = queue;
+
+	static_assert(offsetof(struct jif_pkt, jp_data) == E1000_RX_PAGE_OFFSET);
+	// Jumbo frames don't fit in a page
+	static_assert(!INPUT_PAGEFLIP || E1000_RX_FLIPPABLE);
 
-	// LAB 6: Your code here:
-	// 	- read a packet from the device driver
-	//	- send it to the network server
-	// Hint: When you IPC a page to the network server, it will be
-	// reading from it for a while, so don't immediately receive
-	// another packet in to the same physical page.
-	void *pg = &nsipcbuf;
+	// Hand each flipped page to the network server, which got our
+	// envid as the ring's consumer.  Mapping the next page at the same
+	// address drops our reference to this one.
+	while (INPUT_PAGEFLIP)
+	{
+		pkt = (struct jif_pkt *) REQVA;
+		recv_packets(pkt, bufs, 1);
+		pkt->jp_len = bufs[0].len;
+		pkt->jp_flags = bufs[0].flags;
+		ipc_send(ring->consumer, NSREQ_INPUT, pkt, PTE_P | PTE_U | PTE_W);
+	}
 
-	int r = sys_page_unmap(0, pg);
-	if (r < 0)
-		panic("ns_input: unmap failed %e\n", r);
+	if (ns_nshards > 1)
+		input_sharded(queue);
 
+	// Receive packets straight into the free slots of the ring to the
+	// network server, as many per system call as there are slots, and
+	// publish each batch at once.
 	while (1)
 	{
-		sys_page_alloc(0, pg, PTE_P | PTE_U | PTE_W);
-
-		struct jif_pkt *pkt = (struct jif_pkt *) &nsipcbuf.pkt;
+		for (n = 0; n < NET_MAXBATCH && (pkt = ring_reserve_nth(ring, n)) != NULL; n++)
+		{
+			bufs[n].data = (uintptr_t) pkt->jp_data;
+			bufs[n].len = NS_RING_SLOTSIZE - sizeof(*pkt);
+		}
+		if (n == 0)
+		{
+			sys_yield();
+			continue;
+		}
 
-		uint32_t recv_packet_size;
-		while (1)
+		n = recv_packets(NULL, bufs, n);
+		// Save received packet lengths and checksum flags
+		for (i = 0; i < n; i++)
 		{
-			r = sys_try_recv_packet((uint8_t *) pkt->jp_data, PGSIZE - sizeof(uint32_t), &recv_packet_size);
-			if (r == 0)
-				break;
-			else if (r == -E_INVAL)
-				panic("ns_input: INVALID parameters");
-			else if (r == -E_NET_QUEUE_EMPTY)
-				sys_yield();
-			else
-				panic("ns_input: unknown error %e\n", r);
+			pkt = ring_reserve_nth(ring, i);
+			pkt->jp_len = bufs[i].len;
+			pkt->jp_flags = bufs[i].flags;
 		}
-//		cprintf("ns_input: received packet of length: %x\n", recv_packet_size);
-//		for (int i = 0; i < 15; ++i)
-//			cprintf("%x ", pkt->jp_data[i]);
-
-		// Save received packet length
-		pkt->jp_len = recv_packet_size;
-		ipc_send(ns_envid, NSREQ_INPUT, pg, PTE_P | PTE_U | PTE_W);
-		sys_page_unmap(0, pg);
+		ring_publish_n(ring, n);
 	}
 }
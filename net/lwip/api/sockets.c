@@ -74,6 +74,9 @@ struct lwip_socket {
 	u16_t flags;
 	/** last error that occurred on this socket */
 	int err;
+	/** signalled on every event while lwip_send_ref waits for its
+		data to be acknowledged, else SYS_SEM_NULL */
+	sys_sem_t sentsem;
 };
 
 /** Description for a task waiting in select */
@@ -112,8 +115,29 @@ struct lwip_setgetsockopt_data {
 	err_t err;
 };
 
+#define EVQ_WORDS ((NUM_SOCKETS + 31) / 32)
+#define EVQ_BIT(s) (1U << ((s) & 31))
+
+/** An edge-triggered event queue: bitmaps, one bit per socket, of the
+	sockets watched for each event and of those for which the event has
+	happened since the last lwip_evq_wait. Protected by selectsem. */
+struct lwip_evq {
+	int used;
+	u32_t watch_in[EVQ_WORDS];
+	u32_t watch_out[EVQ_WORDS];
+	u32_t ready_in[EVQ_WORDS];
+	u32_t ready_out[EVQ_WORDS];
+	u32_t data[NUM_SOCKETS];
+	/** a task is sleeping in lwip_evq_wait, and has been signalled */
+	int waiting;
+	int signalled;
+	sys_sem_t sem;
+};
+
 /** The global array of available sockets */
 static struct lwip_socket sockets[NUM_SOCKETS];
+/** The global array of event queues */
+static struct lwip_evq evqs[LWIP_NUM_EVQ];
 /** The global list of tasks waiting for select */
 static struct lwip_select_cb *select_cb_list;
 
@@ -161,6 +185,7 @@ static const int err_to_errno_table[] = {
 } while (0)
 
 /* Forward delcaration of some functions */
+static void evq_forget(int s);
 static void event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len);
 static void lwip_getsockopt_internal(void *arg);
 static void lwip_setsockopt_internal(void *arg);
@@ -232,6 +257,7 @@ alloc_socket(struct netconn *newconn)
 			sockets[i].sendevent = 1; /* TCP send buf is empty */
 			sockets[i].flags = 0;
 			sockets[i].err = 0;
+			sockets[i].sentsem = SYS_SEM_NULL;
 			sys_sem_signal(socksem);
 			return i;
 		}
@@ -370,6 +396,10 @@ lwip_close(int s)
 		return -1;
 	}
 
+	/* lwip_send_ref's data must not outlive its wait */
+	while (sock->sentsem != SYS_SEM_NULL)
+		sys_msleep(TCP_TMR_INTERVAL);
+
 	netconn_delete(sock->conn);
 
 	sys_sem_wait(socksem);
@@ -382,6 +412,10 @@ lwip_close(int s)
 	sock->conn = NULL;
 	sock_set_errno(sock, 0);
 	sys_sem_signal(socksem);
+
+	sys_sem_wait(selectsem);
+	evq_forget(s);
+	sys_sem_signal(selectsem);
 	return 0;
 }
 
@@ -672,6 +706,46 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
 	return (err == ERR_OK ? size : -1);
 }
 
+/**
+ * Like lwip_send, but the queued segments reference 'data' (as PBUF_ROM
+ * pbufs, see tcp_enqueue) instead of a copy of it.  Since lwIP keeps
+ * them until the peer acknowledges them, this waits for that, or for
+ * the connection to fail, before returning: only then may the caller
+ * reuse 'data'.  Sockets other than TCP ones fall back to lwip_send.
+ */
+int
+lwip_send_ref(int s, const void *data, int size, unsigned int flags)
+{
+	struct lwip_socket *sock;
+	struct tcp_pcb *pcb;
+	u32_t end;
+	err_t err;
+
+	sock = get_socket(s);
+	if (!sock)
+		return -1;
+	if (sock->conn->type != NETCONN_TCP || sock->sentsem != SYS_SEM_NULL ||
+		(sock->sentsem = sys_sem_new(0)) == SYS_SEM_NULL)
+		return lwip_send(s, data, size, flags);
+
+	err = netconn_write(sock->conn, data, size, (flags & MSG_MORE) ? NETCONN_MORE : 0);
+	/* sent_tcp and err_tcp both raise an event on the socket */
+	if ((pcb = sock->conn->pcb.tcp) != NULL)
+	{
+		end = pcb->snd_lbb;
+		while ((pcb = sock->conn->pcb.tcp) != NULL && TCP_SEQ_LT(pcb->lastack, end))
+			sys_sem_wait(sock->sentsem);
+	}
+	sys_sem_free(sock->sentsem);
+	sock->sentsem = SYS_SEM_NULL;
+	if (err == ERR_OK && sock->conn->err != ERR_OK)
+		err = sock->conn->err;
+
+	LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send_ref(%d) err=%d size=%d\n", s, err, size));
+	sock_set_errno(sock, err_to_errno(err));
+	return (err == ERR_OK ? size : -1);
+}
+
 int
 lwip_sendto(int s, const void *data, int size, unsigned int flags,
 			struct sockaddr *to, socklen_t tolen)
@@ -1044,6 +1118,241 @@ lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
 	return nready;
 }
 
+/**
+ * Record that 'events' just became true of socket s in every event queue
+ * watching for them, waking the queue's waiter. Call with selectsem held.
+ */
+static void
+evq_event(int s, u32_t events)
+{
+	struct lwip_evq *q;
+	int w = s / 32, ready;
+
+	for (q = evqs; q < evqs + LWIP_NUM_EVQ; q++)
+	{
+		if (!q->used)
+			continue;
+		ready = 0;
+		if ((events & LWIP_EVQ_IN) && (q->watch_in[w] & EVQ_BIT(s)))
+		{
+			q->ready_in[w] |= EVQ_BIT(s);
+			ready = 1;
+		}
+		if ((events & LWIP_EVQ_OUT) && (q->watch_out[w] & EVQ_BIT(s)))
+		{
+			q->ready_out[w] |= EVQ_BIT(s);
+			ready = 1;
+		}
+		if (ready && q->waiting && !q->signalled)
+		{
+			q->signalled = 1;
+			sys_sem_signal(q->sem);
+		}
+	}
+}
+
+/**
+ * Stop every event queue from watching socket s. Call with selectsem held.
+ */
+static void
+evq_forget(int s)
+{
+	struct lwip_evq *q;
+	int w = s / 32;
+
+	for (q = evqs; q < evqs + LWIP_NUM_EVQ; q++)
+	{
+		q->watch_in[w] &= ~EVQ_BIT(s);
+		q->watch_out[w] &= ~EVQ_BIT(s);
+		q->ready_in[w] &= ~EVQ_BIT(s);
+		q->ready_out[w] &= ~EVQ_BIT(s);
+	}
+}
+
+static struct lwip_evq *
+get_evq(int q)
+{
+	if (q < 0 || q >= LWIP_NUM_EVQ || !evqs[q].used)
+	{
+		set_errno(EBADF);
+		return NULL;
+	}
+	return &evqs[q];
+}
+
+/**
+ * Create an event queue watching no sockets.
+ *
+ * @return the queue's number, or -1 if all LWIP_NUM_EVQ are in use
+ */
+int
+lwip_evq_create(void)
+{
+	struct lwip_evq *q;
+
+	sys_sem_wait(selectsem);
+	/* A closed queue's last waiter frees its semaphore on its way out */
+	for (q = evqs; q < evqs + LWIP_NUM_EVQ; q++)
+		if (!q->used && !q->waiting)
+			break;
+	if (q == evqs + LWIP_NUM_EVQ)
+	{
+		sys_sem_signal(selectsem);
+		set_errno(ENFILE);
+		return -1;
+	}
+	memset(q, 0, sizeof(*q));
+	q->sem = sys_sem_new(0);
+	q->used = 1;
+	sys_sem_signal(selectsem);
+	set_errno(0);
+	return q - evqs;
+}
+
+/**
+ * Start (LWIP_EVQ_ADD), change (LWIP_EVQ_MOD) or stop (LWIP_EVQ_DEL)
+ * watching socket s for 'events' in queue q; 'data' comes back with
+ * each of its events. An event that is already true when watching
+ * starts is reported by the next wait, so none is missed.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+lwip_evq_ctl(int q, int op, int s, u32_t events, u32_t data)
+{
+	struct lwip_evq *evq;
+	struct lwip_socket *sock;
+	int w = s / 32, watched, err = 0;
+
+	if ((sock = get_socket(s)) == NULL)
+		return -1;
+	sys_sem_wait(selectsem);
+	if ((evq = get_evq(q)) == NULL)
+	{
+		sys_sem_signal(selectsem);
+		return -1;
+	}
+	watched = ((evq->watch_in[w] | evq->watch_out[w]) & EVQ_BIT(s)) != 0;
+	if (op == LWIP_EVQ_ADD && watched)
+		err = EEXIST;
+	else if ((op == LWIP_EVQ_MOD || op == LWIP_EVQ_DEL) && !watched)
+		err = ENOENT;
+	else if (op != LWIP_EVQ_ADD && op != LWIP_EVQ_MOD && op != LWIP_EVQ_DEL)
+		err = EINVAL;
+	if (err)
+	{
+		sys_sem_signal(selectsem);
+		set_errno(err);
+		return -1;
+	}
+
+	evq->watch_in[w] &= ~EVQ_BIT(s);
+	evq->watch_out[w] &= ~EVQ_BIT(s);
+	evq->ready_in[w] &= ~EVQ_BIT(s);
+	evq->ready_out[w] &= ~EVQ_BIT(s);
+	if (op != LWIP_EVQ_DEL)
+	{
+		if (events & LWIP_EVQ_IN)
+			evq->watch_in[w] |= EVQ_BIT(s);
+		if (events & LWIP_EVQ_OUT)
+			evq->watch_out[w] |= EVQ_BIT(s);
+		evq->data[s] = data;
+		evq_event(s, ((sock->lastdata || sock->rcvevent) ? LWIP_EVQ_IN : 0) |
+					 (sock->sendevent ? LWIP_EVQ_OUT : 0));
+	}
+	sys_sem_signal(selectsem);
+	set_errno(0);
+	return 0;
+}
+
+/**
+ * Move up to 'maxevents' of the events queue q has collected to
+ * 'events', waiting up to 'timeout' msec (forever if < 0) for one if
+ * there are none yet.
+ *
+ * @return the number of events returned (0 on timeout), -1 on error
+ */
+int
+lwip_evq_wait(int q, struct lwip_event *events, int maxevents, int timeout)
+{
+	struct lwip_evq *evq;
+	u32_t in, out;
+	int s, n, waited = 0;
+
+	sys_sem_wait(selectsem);
+	while (1)
+	{
+		if ((evq = get_evq(q)) == NULL)
+		{
+			sys_sem_signal(selectsem);
+			return -1;
+		}
+		for (s = n = 0; s < NUM_SOCKETS && n < maxevents; s++)
+		{
+			in = evq->ready_in[s / 32] & EVQ_BIT(s);
+			out = evq->ready_out[s / 32] & EVQ_BIT(s);
+			if (!in && !out)
+				continue;
+			evq->ready_in[s / 32] &= ~in;
+			evq->ready_out[s / 32] &= ~out;
+			events[n].events = (in ? LWIP_EVQ_IN : 0) | (out ? LWIP_EVQ_OUT : 0);
+			events[n].data = evq->data[s];
+			n++;
+		}
+		if (n > 0 || timeout == 0 || waited)
+			break;
+
+		/* Sleep until evq_event signals us or the timeout runs out */
+		evq->waiting = 1;
+		sys_sem_signal(selectsem);
+		sys_sem_wait_timeout(evq->sem, timeout < 0 ? 0 : timeout);
+		waited = 1;
+		sys_sem_wait(selectsem);
+		evq->waiting = 0;
+		evq->signalled = 0;
+		if (!evq->used)
+		{
+			/* lwip_evq_close ran meanwhile and left this to us */
+			sys_sem_free(evq->sem);
+			sys_sem_signal(selectsem);
+			set_errno(EBADF);
+			return -1;
+		}
+	}
+	sys_sem_signal(selectsem);
+	set_errno(0);
+	return n;
+}
+
+/**
+ * Free event queue q, waking any task still waiting on it.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+lwip_evq_close(int q)
+{
+	struct lwip_evq *evq;
+
+	sys_sem_wait(selectsem);
+	if ((evq = get_evq(q)) == NULL)
+	{
+		sys_sem_signal(selectsem);
+		return -1;
+	}
+	evq->used = 0;
+	if (!evq->waiting)
+		sys_sem_free(evq->sem);
+	else if (!evq->signalled)
+	{
+		evq->signalled = 1;
+		sys_sem_signal(evq->sem);
+	}
+	sys_sem_signal(selectsem);
+	set_errno(0);
+	return 0;
+}
+
 /**
  * Callback registered in the netconn layer for each socket-netconn.
  * Processes recvevent (data available) and wakes up tasks waiting for select.
@@ -1111,6 +1420,10 @@ event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
 			LWIP_ASSERT("unknown event", 0);
 			break;
 	}
+	if (evt == NETCONN_EVT_RCVPLUS || evt == NETCONN_EVT_SENDPLUS)
+		evq_event(s, evt == NETCONN_EVT_RCVPLUS ? LWIP_EVQ_IN : LWIP_EVQ_OUT);
+	if (sock->sentsem != SYS_SEM_NULL)
+		sys_sem_signal(sock->sentsem);
 	sys_sem_signal(selectsem);
 
 	/* Now decide if anyone is waiting for this socket */
@@ -183,6 +183,7 @@ struct dns_table_entry {
   u8_t  seqno;
   u8_t  err;
   u32_t ttl;
+  u32_t hash;  /* dns_hash(name), to skip most strcmps in dns_lookup */
   char name[DNS_MAX_NAME_LENGTH];
   struct ip_addr ipaddr;
   /* pointer to callback on DNS query done */
@@ -301,14 +302,27 @@ dns_tmr(void)
  *         better check for failure: != 0) or 0 if the hostname was not found
  *         in the cached dns_table.
  */
+static u32_t
+dns_hash(const char *name)
+{
+  u32_t h = 2166136261UL;
+
+  /* FNV-1a */
+  while (*name) {
+	h = (h ^ (u8_t)*name++) * 16777619UL;
+  }
+  return h;
+}
+
 static u32_t
 dns_lookup(const char *name)
 {
   u8_t i;
+  u32_t h = dns_hash(name);
 
   /* Walk through name list, return entry if found. If not, return NULL. */
   for (i = 0; i < DNS_TABLE_SIZE; ++i) {
-	if ((dns_table[i].state == DNS_STATE_DONE) &&
+	if ((dns_table[i].state == DNS_STATE_DONE) && (dns_table[i].hash == h) &&
 		(strcmp(name, dns_table[i].name) == 0)) {
 	  LWIP_DEBUGF(DNS_DEBUG, ("dns_lookup: \"%s\": found = ", name));
 	  ip_addr_debug_print(DNS_DEBUG, &(dns_table[i].ipaddr));
@@ -663,6 +677,11 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr, u
 			if (pEntry->found) {
 			  (*pEntry->found)(pEntry->name, &pEntry->ipaddr, pEntry->arg);
 			}
+			/* a TTL of 0 means the answer must not be cached */
+			if (pEntry->ttl == 0) {
+			  pEntry->state = DNS_STATE_UNUSED;
+			  pEntry->found = NULL;
+			}
 			/* deallocate memory and return */
 			goto memerr2;
 		  } else {
@@ -754,6 +773,7 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
   pEntry->seqno = dns_seqno++;
   pEntry->found = found;
   pEntry->arg   = callback_arg;
+  pEntry->hash  = dns_hash(name);
   strcpy(pEntry->name, name);
 
   /* force to send query without waiting timer */
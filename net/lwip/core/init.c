@@ -79,8 +79,14 @@
 #if (!LWIP_UDP && LWIP_DNS)
 #error "If you want to use DNS, you have to define LWIP_UDP=1 in your lwipopts.h"
 #endif
-#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7f))
-#error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s8_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7fff))
+#error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s16_t, so, you have to reduce it in your lwipopts.h"
+#endif
+#if (LWIP_ARP && LWIP_NETIF_HWADDRHINT && (ARP_TABLE_SIZE > 0xff))
+#error "If you want to use ARP with LWIP_NETIF_HWADDRHINT, ARP_TABLE_SIZE must fit in the u8_t hint, so, you have to reduce it in your lwipopts.h"
+#endif
+#if (LWIP_ARP && ((ARP_HASH_BITS < 1) || (ARP_HASH_BITS > 15)))
+#error "If you want to use ARP, ARP_HASH_BITS must be from 1 to 15, so, you have to change it in your lwipopts.h"
 #endif
 #if (LWIP_ARP && ARP_QUEUEING && (MEMP_NUM_ARP_QUEUE <= 0))
 #error "If you want to use ARP Queueing, you have to define MEMP_NUM_ARP_QUEUE>=1 in your lwipopts.h"
@@ -94,9 +100,21 @@
 #if (LWIP_TCP && (MEMP_NUM_TCP_PCB <= 0))
 #error "If you want to use TCP, you have to define MEMP_NUM_TCP_PCB>=1 in your lwipopts.h"
 #endif
-#if (LWIP_TCP && (TCP_WND > 0xffff))
+#if (LWIP_TCP && !LWIP_WND_SCALE && (TCP_WND > 0xffff))
 #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
 #endif
+#if (LWIP_TCP && LWIP_WND_SCALE && (TCP_RCV_SCALE > 14))
+#error "TCP_RCV_SCALE must be at most 14 (RFC 7323), so, you have to reduce it in your lwipopts.h"
+#endif
+#if (LWIP_TCP && LWIP_WND_SCALE && (TCP_WND > (0xffffUL << TCP_RCV_SCALE)))
+#error "If you want to use TCP, TCP_WND must fit in 0xffff << TCP_RCV_SCALE, so, you have to reduce it or raise TCP_RCV_SCALE in your lwipopts.h"
+#endif
+#if (LWIP_DNS && (DNS_TABLE_SIZE > 0xff))
+#error "If you want to use DNS, DNS_TABLE_SIZE must fit in an u8_t (it is the query id), so, you have to reduce it in your lwipopts.h"
+#endif
+#if (LWIP_TCP && ((TCP_ACK_SEGS < 1) || (TCP_ACK_SEGS > 0xff)))
+#error "If you want to use TCP, TCP_ACK_SEGS must be between 1 and 255 (it is counted in an u8_t), so, you have to change it in your lwipopts.h"
+#endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
 #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
 #endif
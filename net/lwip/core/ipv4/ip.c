@@ -231,6 +231,7 @@ ip_input(struct pbuf *p, struct netif *inp)
 
 	/* verify checksum */
 #if CHECKSUM_CHECK_IP
+	IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_IP)
 	if (inet_chksum(iphdr, iphdr_hlen) != 0)
 	{
 
@@ -542,6 +543,7 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
 
 		IPH_CHKSUM_SET(iphdr, 0);
 #if CHECKSUM_GEN_IP
+		IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_IP)
 		IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
 #endif
 	} else
@@ -96,6 +96,7 @@ netif_add(struct netif *netif, struct ip_addr *ipaddr, struct ip_addr *netmask,
 	netif->netmask.addr = 0;
 	netif->gw.addr = 0;
 	netif->flags = 0;
+	NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL);
 #if LWIP_DHCP
 	/* netif not under DHCP control by default */
 	netif->dhcp = NULL;
@@ -600,7 +601,7 @@ netif_loop_output(struct netif *netif, struct pbuf *p,
 
 #if LWIP_NETIF_LOOPBACK_MULTITHREADING
   /* For multithreading environment, schedule a call to netif_poll */
-  tcpip_callback(netif_poll, netif);
+  tcpip_callback((void (*)(void *)) netif_poll, netif);
 #endif /* LWIP_NETIF_LOOPBACK_MULTITHREADING */
 
   return ERR_OK;
@@ -650,6 +651,11 @@ netif_poll(struct netif *netif)
 	SYS_ARCH_UNPROTECT(lev);
 
 	if(in != NULL) {
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+	  /* nothing filled in the checksums that netif left to its card,
+	     and nothing on a wire can have corrupted the packet */
+	  netif->chksum_flags &= ~(NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP);
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
 	  /* loopback packets are always IP packets! */
 	  if(ip_input(in, netif) != ERR_OK) {
 		pbuf_free(in);
@@ -70,6 +70,8 @@ union tcp_listen_pcbs_t tcp_listen_pcbs;
 struct tcp_pcb *tcp_active_pcbs;
 /** List of all TCP PCBs in TIME-WAIT state */
 struct tcp_pcb *tcp_tw_pcbs;
+/** Hash chains of the active and TIME-WAIT PCBs, for tcp_input */
+struct tcp_pcb *tcp_pcb_hash[1 << TCP_PCB_HASH_BITS];
 
 struct tcp_pcb *tcp_tmp_pcb;
 
@@ -421,10 +423,10 @@ tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
 void
 tcp_recved(struct tcp_pcb *pcb, u16_t len)
 {
-	if ((u32_t) pcb->rcv_wnd + len > TCP_WND)
+	if ((u32_t) pcb->rcv_wnd + len > TCP_WND_MAX(pcb))
 	{
-		pcb->rcv_wnd = TCP_WND;
-		pcb->rcv_ann_wnd = TCP_WND;
+		pcb->rcv_wnd = TCP_WND_MAX(pcb);
+		pcb->rcv_ann_wnd = TCP_WND_MAX(pcb);
 	} else
 	{
 		pcb->rcv_wnd += len;
@@ -445,10 +447,11 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
 		 * two ACKs being sent for each received packet in some limited cases
 		 * (where the application is only receiving data, and is slow to
 		 * process it) but it is necessary to guarantee that the sender can
-		 * continue to transmit.
+		 * continue to transmit.  This is no segment, so it does not
+		 * count towards TCP_ACK_SEGS.
 		 */
-		tcp_ack(pcb);
-	} else if (pcb->flags & TF_ACK_DELAY && pcb->rcv_wnd >= TCP_WND / 2)
+		pcb->flags |= TF_ACK_DELAY;
+	} else if (pcb->flags & TF_ACK_DELAY && pcb->rcv_wnd >= TCP_WND_MAX(pcb) / 2)
 	{
 		/* If we can send a window update such that there is a full
 		 * segment available in the window, do so now.  This is sort of
@@ -460,8 +463,8 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
 		tcp_ack_now(pcb);
 	}
 
-	LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: recveived %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
-			len, pcb->rcv_wnd, TCP_WND - pcb->rcv_wnd));
+	LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: recveived %"U16_F" bytes, wnd %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F").\n",
+			len, pcb->rcv_wnd, TCP_WND_MAX(pcb) - pcb->rcv_wnd));
 }
 
 /**
@@ -485,6 +488,10 @@ tcp_new_port(void)
 	{
 		port = TCP_LOCAL_PORT_RANGE_START;
 	}
+	if (!LWIP_PORT_OWNED(port))
+	{
+		goto again;
+	}
 
 	for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next)
 	{
@@ -526,7 +533,7 @@ err_t
 tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
 			err_t (*connected)(void *arg, struct tcp_pcb *tpcb, err_t err))
 {
-	u32_t optdata;
+	u32_t optdata[2];
 	err_t ret;
 	u32_t iss;
 
@@ -550,9 +557,11 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
 	pcb->snd_nxt = iss;
 	pcb->lastack = iss - 1;
 	pcb->snd_lbb = iss - 1;
-	pcb->rcv_wnd = TCP_WND;
-	pcb->rcv_ann_wnd = TCP_WND;
-	pcb->snd_wnd = TCP_WND;
+	/* Only a window that fits in 16 bits until the SYN|ACK agrees to
+	   window scaling */
+	pcb->rcv_wnd = TCPWND16(TCP_WND);
+	pcb->rcv_ann_wnd = TCPWND16(TCP_WND);
+	pcb->snd_wnd = TCPWND16(TCP_WND);
 	/* As initial send MSS, we use TCP_MSS but limit it to 536.
 	   The send MSS is updated when an MSS option is received. */
 	pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
@@ -567,13 +576,16 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
 #endif /* LWIP_CALLBACK_API */
 	TCP_RMV(&tcp_bound_pcbs, pcb);
 	TCP_REG(&tcp_active_pcbs, pcb);
+	tcp_pcb_hash_insert(pcb);
 
 	snmp_inc_tcpactiveopens();
 
-	/* Build an MSS option */
-	optdata = TCP_BUILD_MSS_OPTION();
+	/* Build an MSS option, and offer window scaling */
+	optdata[0] = TCP_BUILD_MSS_OPTION();
+	optdata[1] = TCP_BUILD_WND_SCALE_OPTION();
 
-	ret = tcp_enqueue(pcb, NULL, 0, TCP_SYN, 0, (u8_t * ) & optdata, 4);
+	ret = tcp_enqueue(pcb, NULL, 0, TCP_SYN, 0, (u8_t * ) optdata,
+					  LWIP_WND_SCALE ? 8 : 4);
 	if (ret == ERR_OK)
 	{
 		tcp_output(pcb);
@@ -592,7 +604,7 @@ void
 tcp_slowtmr(void)
 {
 	struct tcp_pcb *pcb, *pcb2, *prev;
-	u16_t eff_wnd;
+	tcpwnd_size_t eff_wnd;
 	u8_t pcb_remove;      /* flag if a PCB should be removed */
 	err_t err;
 
@@ -671,8 +683,8 @@ tcp_slowtmr(void)
 						pcb->ssthresh = pcb->mss * 2;
 					}
 					pcb->cwnd = pcb->mss;
-					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"U16_F
-							" ssthresh %"U16_F"\n",
+					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"TCPWNDSIZE_F
+							" ssthresh %"TCPWNDSIZE_F"\n",
 									pcb->cwnd, pcb->ssthresh));
 
 					/* The following needs to be called AFTER cwnd is set to one
@@ -766,6 +778,7 @@ tcp_slowtmr(void)
 		if (pcb_remove)
 		{
 			tcp_pcb_purge(pcb);
+			tcp_pcb_hash_remove(pcb);
 			/* Remove PCB from tcp_active_pcbs list. */
 			if (prev != NULL)
 			{
@@ -825,6 +838,7 @@ tcp_slowtmr(void)
 		if (pcb_remove)
 		{
 			tcp_pcb_purge(pcb);
+			tcp_pcb_hash_remove(pcb);
 			/* Remove PCB from tcp_tw_pcbs list. */
 			if (prev != NULL)
 			{
@@ -879,6 +893,7 @@ tcp_fasttmr(void)
 			LWIP_DEBUGF(TCP_DEBUG, ("tcp_fasttmr: delayed ACK\n"));
 			tcp_ack_now(pcb);
 			pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+			pcb->ack_pend = 0;
 		}
 	}
 }
@@ -1088,8 +1103,8 @@ tcp_alloc(u8_t prio)
 		pcb->prio = TCP_PRIO_NORMAL;
 		pcb->snd_buf = TCP_SND_BUF;
 		pcb->snd_queuelen = 0;
-		pcb->rcv_wnd = TCP_WND;
-		pcb->rcv_ann_wnd = TCP_WND;
+		pcb->rcv_wnd = TCPWND16(TCP_WND);
+		pcb->rcv_ann_wnd = TCPWND16(TCP_WND);
 		pcb->tos = 0;
 		pcb->ttl = TCP_TTL;
 		/* As initial send MSS, we use TCP_MSS but limit it to 536.
@@ -1296,6 +1311,10 @@ void
 tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 {
 	TCP_RMV(pcblist, pcb);
+	if (pcblist == &tcp_active_pcbs || pcblist == &tcp_tw_pcbs)
+	{
+		tcp_pcb_hash_remove(pcb);
+	}
 
 	tcp_pcb_purge(pcb);
 
@@ -1322,6 +1341,51 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 	LWIP_ASSERT("tcp_pcb_remove: tcp_pcbs_sane()", tcp_pcbs_sane());
 }
 
+/**
+ * Adds a PCB that has just gone into tcp_active_pcbs to the hash chain
+ * for its remote address and port and local port.  It stays there,
+ * through TIME-WAIT, until tcp_pcb_hash_remove.
+ *
+ * @param pcb tcp_pcb to hash
+ */
+void
+tcp_pcb_hash_insert(struct tcp_pcb *pcb)
+{
+	struct tcp_pcb **head;
+
+	LWIP_ASSERT("tcp_pcb_hash_insert: already hashed", pcb->hprev == NULL);
+	head = &tcp_pcb_hash[TCP_PCB_HASH(pcb->remote_ip.addr, pcb->remote_port,
+									  pcb->local_port)];
+	pcb->hnext = *head;
+	if (pcb->hnext != NULL)
+	{
+		pcb->hnext->hprev = &pcb->hnext;
+	}
+	pcb->hprev = head;
+	*head = pcb;
+}
+
+/**
+ * Takes a PCB out of its hash chain, if it is in one.
+ *
+ * @param pcb tcp_pcb to unhash
+ */
+void
+tcp_pcb_hash_remove(struct tcp_pcb *pcb)
+{
+	if (pcb->hprev == NULL)
+	{
+		return;
+	}
+	if (pcb->hnext != NULL)
+	{
+		pcb->hnext->hprev = pcb->hprev;
+	}
+	*pcb->hprev = pcb->hnext;
+	pcb->hnext = NULL;
+	pcb->hprev = NULL;
+}
+
 /**
  * Calculates a new initial sequence number for new connections.
  *
@@ -75,6 +75,10 @@ struct tcp_pcb *tcp_input_pcb;
 /* Forward declarations. */
 static err_t tcp_process(struct tcp_pcb *pcb);
 static u8_t tcp_receive(struct tcp_pcb *pcb);
+#if TCP_HEADER_PREDICTION
+static u8_t tcp_predict(struct tcp_pcb *pcb);
+#endif /* TCP_HEADER_PREDICTION */
+static void tcp_free_acked(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
 
 static err_t tcp_listen_input(struct tcp_pcb_listen *pcb);
@@ -134,6 +138,7 @@ tcp_input(struct pbuf *p, struct netif *inp)
 
 #if CHECKSUM_CHECK_TCP
 	/* Verify TCP checksum. */
+	IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_TCP)
 	if (inet_chksum_pseudo(p, (struct ip_addr *) &(iphdr->src),
 						   (struct ip_addr *) &(iphdr->dest),
 						   IP_PROTO_TCP, p->tot_len) != 0)
@@ -177,59 +182,33 @@ tcp_input(struct pbuf *p, struct netif *inp)
 	tcplen = p->tot_len + ((flags & TCP_FIN || flags & TCP_SYN) ? 1 : 0);
 
 	/* Demultiplex an incoming segment. First, we check if it is destined
-	   for an active connection. */
-	prev = NULL;
-
-
-	for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next)
+	   for an active connection or one in TIME-WAIT: they are all in
+	   tcp_pcb_hash. */
+	for (pcb = tcp_pcb_hash[TCP_PCB_HASH(iphdr->src.addr, tcphdr->src, tcphdr->dest)];
+		 pcb != NULL; pcb = pcb->hnext)
 	{
-		LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
-		LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
-		LWIP_ASSERT("tcp_input: active pcb->state != LISTEN", pcb->state != LISTEN);
+		LWIP_ASSERT("tcp_input: hashed pcb->state != CLOSED", pcb->state != CLOSED);
+		LWIP_ASSERT("tcp_input: hashed pcb->state != LISTEN", pcb->state != LISTEN);
+		LWIP_ASSERT("tcp_input: pcb->hnext != pcb", pcb->hnext != pcb);
 		if (pcb->remote_port == tcphdr->src &&
 			pcb->local_port == tcphdr->dest &&
 			ip_addr_cmp(&(pcb->remote_ip), &(iphdr->src)) &&
 			ip_addr_cmp(&(pcb->local_ip), &(iphdr->dest)))
 		{
-
-			/* Move this PCB to the front of the list so that subsequent
-			   lookups will be faster (we exploit locality in TCP segment
-			   arrivals). */
-			LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
-			if (prev != NULL)
-			{
-				prev->next = pcb->next;
-				pcb->next = tcp_active_pcbs;
-				tcp_active_pcbs = pcb;
-			}
-			LWIP_ASSERT("tcp_input: pcb->next != pcb (after cache)", pcb->next != pcb);
 			break;
 		}
-		prev = pcb;
 	}
 
-	if (pcb == NULL)
+	if (pcb != NULL && pcb->state == TIME_WAIT)
 	{
-		/* If it did not go to an active connection, we check the connections
-		   in the TIME-WAIT state. */
-		for (pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next)
-		{
-			LWIP_ASSERT("tcp_input: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-			if (pcb->remote_port == tcphdr->src &&
-				pcb->local_port == tcphdr->dest &&
-				ip_addr_cmp(&(pcb->remote_ip), &(iphdr->src)) &&
-				ip_addr_cmp(&(pcb->local_ip), &(iphdr->dest)))
-			{
-				/* We don't really care enough to move this PCB to the front
-				   of the list since we are not very likely to receive that
-				   many segments for connections in TIME-WAIT. */
-				LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
-				tcp_timewait_input(pcb);
-				pbuf_free(p);
-				return;
-			}
-		}
+		LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+		tcp_timewait_input(pcb);
+		pbuf_free(p);
+		return;
+	}
 
+	if (pcb == NULL)
+	{
 		/* Finally, if we still did not get a match, we check all PCBs that
 		   are LISTENing for incoming connections. */
 		prev = NULL;
@@ -307,7 +286,15 @@ tcp_input(struct pbuf *p, struct netif *inp)
 		}
 
 		tcp_input_pcb = pcb;
-		err = tcp_process(pcb);
+#if TCP_HEADER_PREDICTION
+		if (tcp_predict(pcb))
+		{
+			err = ERR_OK;
+		} else
+#endif /* TCP_HEADER_PREDICTION */
+		{
+			err = tcp_process(pcb);
+		}
 		tcp_input_pcb = NULL;
 		/* A return value of ERR_ABRT means that tcp_abort() was called
 		   and that the pcb has been freed. If so, we don't do anything. */
@@ -422,7 +409,8 @@ static err_t
 tcp_listen_input(struct tcp_pcb_listen *pcb)
 {
 	struct tcp_pcb *npcb;
-	u32_t optdata;
+	u32_t optdata[2];
+	u8_t optlen;
 
 	/* In the LISTEN state, we check for incoming SYN segments,
 	   creates a new PCB, and responds with a SYN|ACK. */
@@ -474,6 +462,7 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 		/* Register the new PCB so that we can begin receiving segments
 		   for it. */
 		TCP_REG(&tcp_active_pcbs, npcb);
+		tcp_pcb_hash_insert(npcb);
 
 		/* Parse any options in the SYN. */
 		tcp_parseopt(npcb);
@@ -483,10 +472,13 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
 
 		snmp_inc_tcppassiveopens();
 
-		/* Build an MSS option. */
-		optdata = TCP_BUILD_MSS_OPTION();
-		/* Send a SYN|ACK together with the MSS option. */
-		tcp_enqueue(npcb, NULL, 0, TCP_SYN | TCP_ACK, 0, (u8_t * ) & optdata, 4);
+		/* Build an MSS option, and agree to window scaling only if the
+		   SYN offered it. */
+		optdata[0] = TCP_BUILD_MSS_OPTION();
+		optdata[1] = TCP_BUILD_WND_SCALE_OPTION();
+		optlen = (npcb->flags & TF_WND_SCALE) ? 8 : 4;
+		/* Send a SYN|ACK together with the options. */
+		tcp_enqueue(npcb, NULL, 0, TCP_SYN | TCP_ACK, 0, (u8_t * ) optdata, optlen);
 		return tcp_output(npcb);
 	}
 	return ERR_OK;
@@ -643,7 +635,7 @@ tcp_process(struct tcp_pcb *pcb)
 				/* expected ACK number? */
 				if (TCP_SEQ_BETWEEN(ackno, pcb->lastack + 1, pcb->snd_nxt))
 				{
-					u16_t old_cwnd;
+					tcpwnd_size_t old_cwnd;
 					pcb->state = ESTABLISHED;
 					LWIP_DEBUGF(TCP_DEBUG,
 								("TCP connection established %"U16_F" -> %"U16_F".\n", inseg.tcphdr->src, inseg.tcphdr->dest));
@@ -756,6 +748,146 @@ tcp_process(struct tcp_pcb *pcb)
 	return ERR_OK;
 }
 
+#if TCP_HEADER_PREDICTION
+/**
+ * Header prediction (Van Jacobson): handles the two commonest segments
+ * on an established connection, a pure ACK for new data while sending
+ * and the next in-sequence data while receiving, with a few checks
+ * instead of tcp_process() and tcp_receive().  Anything else, and
+ * anything that would need the window, fast retransmit, congestion
+ * window, RTT or out-of-sequence code, is left to them.
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ * @return 1 if the segment was handled, 0 if tcp_process() must be called
+ *
+ * @note the segment which arrived is saved in global variables, therefore only the pcb
+ *       involved is passed as a parameter to this function
+ */
+static u8_t
+tcp_predict(struct tcp_pcb *pcb)
+{
+	if (pcb->state != ESTABLISHED ||
+		(flags & (TCP_SYN | TCP_FIN | TCP_RST | TCP_URG | TCP_ACK)) != TCP_ACK ||
+		seqno != pcb->rcv_nxt ||
+		SND_WND_SCALE(pcb, tcphdr->wnd) != pcb->snd_wnd ||
+		(pcb->flags & TF_INFR))
+	{
+		return 0;
+	}
+
+	if (tcplen == 0)
+	{
+		/* A pure ACK for new data, with nothing for the unsent list, the
+		   RTT estimate or the congestion window (past the send window,
+		   which limits us instead) to do. */
+		if (!TCP_SEQ_BETWEEN(ackno, pcb->lastack + 1, pcb->snd_max) ||
+			pcb->cwnd < pcb->snd_wnd ||
+			(pcb->rttest && TCP_SEQ_LT(pcb->rtseq, ackno)) ||
+			(pcb->unsent != NULL &&
+			 TCP_SEQ_GEQ(ackno, ntohl(pcb->unsent->tcphdr->seqno) + TCP_TCPLEN(pcb->unsent))))
+		{
+			return 0;
+		}
+	} else
+	{
+		/* The next in-sequence data, acknowledging nothing new, fitting the
+		   window and not meeting queued out-of-sequence data. */
+		if (ackno != pcb->lastack ||
+			!TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
+			tcplen > pcb->rcv_wnd ||
+#if TCP_QUEUE_OOSEQ
+			pcb->ooseq != NULL ||
+#endif /* TCP_QUEUE_OOSEQ */
+			pcb->refused_data != NULL)
+		{
+			return 0;
+		}
+	}
+
+	/* As tcp_process() */
+	pcb->tmr = tcp_ticks;
+	pcb->keep_cnt_sent = 0;
+
+	/* As tcp_receive()'s window update, with the window unchanged */
+	if (TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
+		(pcb->snd_wl1 == seqno && TCP_SEQ_LT(pcb->snd_wl2, ackno)))
+	{
+		pcb->snd_wl1 = seqno;
+		pcb->snd_wl2 = ackno;
+	}
+
+	if (tcplen == 0)
+	{
+		LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_predict: ACK for %"U32_F"\n", ackno));
+		pcb->nrtx = 0;
+		pcb->rto = (pcb->sa >> 3) + pcb->sv;
+		pcb->acked = (u16_t)(ackno - pcb->lastack);
+		pcb->snd_buf += pcb->acked;
+		pcb->dupacks = 0;
+		pcb->lastack = ackno;
+		tcp_free_acked(pcb);
+		pcb->rtime = (pcb->unacked == NULL) ? -1 : 0;
+		pcb->polltmr = 0;
+	} else
+	{
+		LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_predict: data %"U32_F":%"U32_F"\n",
+				seqno, seqno + tcplen));
+		pcb->acked = 0;
+		pcb->rcv_nxt += tcplen;
+		pcb->rcv_wnd -= tcplen;
+		if (pcb->rcv_ann_wnd < tcplen)
+		{
+			pcb->rcv_ann_wnd = 0;
+		} else
+		{
+			pcb->rcv_ann_wnd -= tcplen;
+		}
+		/* The application's pbuf now, as in tcp_receive() */
+		recv_data = inseg.p;
+		inseg.p = NULL;
+		tcp_ack(pcb);
+	}
+	return 1;
+}
+#endif /* TCP_HEADER_PREDICTION */
+
+/**
+ * Frees the segments on the unacknowledged list that the incoming ACK
+ * acknowledges, for tcp_receive() and tcp_predict().
+ *
+ * @param pcb the tcp_pcb for which a segment arrived
+ */
+static void
+tcp_free_acked(struct tcp_pcb *pcb)
+{
+	struct tcp_seg *next;
+
+	while (pcb->unacked != NULL &&
+		   TCP_SEQ_LEQ(ntohl(pcb->unacked->tcphdr->seqno) +
+					   TCP_TCPLEN(pcb->unacked), ackno))
+	{
+		LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: removing %"U32_F":%"U32_F" from pcb->unacked\n",
+				ntohl(pcb->unacked->tcphdr->seqno),
+				ntohl(pcb->unacked->tcphdr->seqno) +
+				TCP_TCPLEN(pcb->unacked)));
+
+		next = pcb->unacked;
+		pcb->unacked = pcb->unacked->next;
+
+		LWIP_DEBUGF(TCP_QLEN_DEBUG, ("tcp_receive: queuelen %"U16_F" ... ", (u16_t) pcb->snd_queuelen));
+		LWIP_ASSERT("pcb->snd_queuelen >= pbuf_clen(next->p)", (pcb->snd_queuelen >= pbuf_clen(next->p)));
+		pcb->snd_queuelen -= pbuf_clen(next->p);
+		tcp_seg_free(next);
+
+		LWIP_DEBUGF(TCP_QLEN_DEBUG, ("%"U16_F" (after freeing unacked)\n", (u16_t) pcb->snd_queuelen));
+		if (pcb->snd_queuelen != 0)
+		{
+			LWIP_ASSERT("tcp_receive: valid queue length", pcb->unacked != NULL ||
+														   pcb->unsent != NULL);
+		}
+	}
+}
+
 /**
  * Called by tcp_process. Checks if the given segment is an ACK for outstanding
  * data, and if so frees the memory of the buffered data. Next, is places the
@@ -791,19 +923,19 @@ tcp_receive(struct tcp_pcb *pcb)
 		/* Update window. */
 		if (TCP_SEQ_LT(pcb->snd_wl1, seqno) ||
 			(pcb->snd_wl1 == seqno && TCP_SEQ_LT(pcb->snd_wl2, ackno)) ||
-			(pcb->snd_wl2 == ackno && tcphdr->wnd > pcb->snd_wnd))
+			(pcb->snd_wl2 == ackno && SND_WND_SCALE(pcb, tcphdr->wnd) > pcb->snd_wnd))
 		{
-			pcb->snd_wnd = tcphdr->wnd;
+			pcb->snd_wnd = SND_WND_SCALE(pcb, tcphdr->wnd);
 			pcb->snd_wl1 = seqno;
 			pcb->snd_wl2 = ackno;
 			if (pcb->snd_wnd > 0 && pcb->persist_backoff > 0)
 			{
 				pcb->persist_backoff = 0;
 			}
-			LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"U16_F"\n", pcb->snd_wnd));
+			LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"TCPWNDSIZE_F"\n", pcb->snd_wnd));
 #if TCP_WND_DEBUG
 			} else {
-			  if (pcb->snd_wnd != tcphdr->wnd) {
+			  if (pcb->snd_wnd != SND_WND_SCALE(pcb, tcphdr->wnd)) {
 				LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: no window update lastack %"U32_F" snd_max %"U32_F" ackno %"U32_F" wl1 %"U32_F" seqno %"U32_F" wl2 %"U32_F"\n",
 									   pcb->lastack, pcb->snd_max, ackno, pcb->snd_wl1, seqno, pcb->snd_wl2));
 			  }
@@ -841,7 +973,7 @@ tcp_receive(struct tcp_pcb *pcb)
 						if (pcb->ssthresh < 2 * pcb->mss)
 						{
 							LWIP_DEBUGF(TCP_FR_DEBUG,
-										("tcp_receive: The minimum value for ssthresh %"U16_F" should be min 2 mss %"U16_F"...\n", pcb->ssthresh,
+										("tcp_receive: The minimum value for ssthresh %"TCPWNDSIZE_F" should be min 2 mss %"U16_F"...\n", pcb->ssthresh,
 												2 * pcb->mss));
 							pcb->ssthresh = 2 * pcb->mss;
 						}
@@ -852,7 +984,7 @@ tcp_receive(struct tcp_pcb *pcb)
 					{
 						/* Inflate the congestion window, but not if it means that
 						   the value overflows. */
-						if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd)
+						if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd)
 						{
 							pcb->cwnd += pcb->mss;
 						}
@@ -897,19 +1029,19 @@ tcp_receive(struct tcp_pcb *pcb)
 			{
 				if (pcb->cwnd < pcb->ssthresh)
 				{
-					if ((u16_t)(pcb->cwnd + pcb->mss) > pcb->cwnd)
+					if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd)
 					{
 						pcb->cwnd += pcb->mss;
 					}
-					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"U16_F"\n", pcb->cwnd));
+					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
 				} else
 				{
-					u16_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+					tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
 					if (new_cwnd > pcb->cwnd)
 					{
 						pcb->cwnd = new_cwnd;
 					}
-					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"U16_F"\n", pcb->cwnd));
+					LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
 				}
 			}
 			LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
@@ -921,30 +1053,7 @@ tcp_receive(struct tcp_pcb *pcb)
 
 			/* Remove segment from the unacknowledged list if the incoming
 			   ACK acknowlegdes them. */
-			while (pcb->unacked != NULL &&
-				   TCP_SEQ_LEQ(ntohl(pcb->unacked->tcphdr->seqno) +
-							   TCP_TCPLEN(pcb->unacked), ackno))
-			{
-				LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: removing %"U32_F":%"U32_F" from pcb->unacked\n",
-						ntohl(pcb->unacked->tcphdr->seqno),
-						ntohl(pcb->unacked->tcphdr->seqno) +
-						TCP_TCPLEN(pcb->unacked)));
-
-				next = pcb->unacked;
-				pcb->unacked = pcb->unacked->next;
-
-				LWIP_DEBUGF(TCP_QLEN_DEBUG, ("tcp_receive: queuelen %"U16_F" ... ", (u16_t) pcb->snd_queuelen));
-				LWIP_ASSERT("pcb->snd_queuelen >= pbuf_clen(next->p)", (pcb->snd_queuelen >= pbuf_clen(next->p)));
-				pcb->snd_queuelen -= pbuf_clen(next->p);
-				tcp_seg_free(next);
-
-				LWIP_DEBUGF(TCP_QLEN_DEBUG, ("%"U16_F" (after freeing unacked)\n", (u16_t) pcb->snd_queuelen));
-				if (pcb->snd_queuelen != 0)
-				{
-					LWIP_ASSERT("tcp_receive: valid queue length", pcb->unacked != NULL ||
-																   pcb->unsent != NULL);
-				}
-			}
+			tcp_free_acked(pcb);
 
 			/* If there's nothing left to acknowledge, stop the retransmit
 			   timer, otherwise reset it to start again */
@@ -1484,9 +1593,22 @@ tcp_parseopt(struct tcp_pcb *pcb)
 				mss = (opts[c + 2] << 8) | opts[c + 3];
 				/* Limit the mss to the configured TCP_MSS and prevent division by zero */
 				pcb->mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
-
-				/* And we are done processing options. */
-				break;
+				c += 4;
+#if LWIP_WND_SCALE
+			} else if (opt == 0x03 &&
+					   opts[c + 1] == 0x03)
+			{
+				/* A window scale option with the right option length: we
+				   only ever parse SYNs, where it may appear.  Its window
+				   field is not scaled, and both ends scale from the next
+				   segment on.  RFC 7323 limits the shift to 14. */
+				pcb->snd_scale = LWIP_MIN(opts[c + 2], 14);
+				pcb->rcv_scale = TCP_RCV_SCALE;
+				pcb->flags |= TF_WND_SCALE;
+				/* Now we can offer the whole receive window */
+				pcb->rcv_wnd = pcb->rcv_ann_wnd = TCP_WND;
+				c += 3;
+#endif /* LWIP_WND_SCALE */
 			} else
 			{
 				if (opts[c + 1] == 0)
@@ -59,6 +59,30 @@
 /* Forward declarations.*/
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
 
+#if CHECKSUM_GEN_TCP
+/**
+ * Compute the checksum of an outgoing TCP segment.  If the interface
+ * the segment will leave by has its hardware compute TCP checksums,
+ * return only the pseudo-header sum for the hardware to finish.
+ *
+ * @param p the segment, starting at the TCP header
+ * @param src source address of the segment
+ * @param dest destination address of the segment
+ * @return the value for the checksum field of the TCP header
+ */
+static u16_t
+tcp_chksum(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest)
+{
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+	struct netif *netif = ip_route(dest);
+
+	if ((netif != NULL) && ((netif->chksum_flags & NETIF_CHECKSUM_GEN_TCP) == 0))
+		return ~inet_chksum_pseudo_partial(p, src, dest, IP_PROTO_TCP, p->tot_len, 0);
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+	return inet_chksum_pseudo(p, src, dest, IP_PROTO_TCP, p->tot_len);
+}
+#endif /* CHECKSUM_GEN_TCP */
+
 /**
  * Called by tcp_close() to send a segment including flags but not data.
  *
@@ -496,6 +520,7 @@ tcp_output(struct tcp_pcb *pcb)
 		LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
 		/* remove ACK flags from the PCB, as we send an empty ACK now */
 		pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+		pcb->ack_pend = 0;
 
 		tcphdr = p->payload;
 		tcphdr->src = htons(pcb->local_port);
@@ -503,14 +528,13 @@ tcp_output(struct tcp_pcb *pcb)
 		tcphdr->seqno = htonl(pcb->snd_nxt);
 		tcphdr->ackno = htonl(pcb->rcv_nxt);
 		TCPH_FLAGS_SET(tcphdr, TCP_ACK);
-		tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+		tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
 		tcphdr->urgp = 0;
 		TCPH_HDRLEN_SET(tcphdr, 5);
 
 		tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
-		tcphdr->chksum = inet_chksum_pseudo(p, &(pcb->local_ip), &(pcb->remote_ip),
-											IP_PROTO_TCP, p->tot_len);
+		tcphdr->chksum = tcp_chksum(p, &(pcb->local_ip), &(pcb->remote_ip));
 #endif
 #if LWIP_NETIF_HWADDRHINT
 		{
@@ -540,13 +564,13 @@ tcp_output(struct tcp_pcb *pcb)
 #endif /* TCP_OUTPUT_DEBUG */
 #if TCP_CWND_DEBUG
 	if (seg == NULL) {
-	  LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F
-								   ", cwnd %"U16_F", wnd %"U32_F
+	  LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F
+								   ", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
 								   ", seg == NULL, ack %"U32_F"\n",
 								   pcb->snd_wnd, pcb->cwnd, wnd, pcb->lastack));
 	} else {
 	  LWIP_DEBUGF(TCP_CWND_DEBUG,
-				  ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F
+				  ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
 				   ", effwnd %"U32_F", seq %"U32_F", ack %"U32_F"\n",
 				   pcb->snd_wnd, pcb->cwnd, wnd,
 				   ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len,
@@ -572,7 +596,7 @@ tcp_output(struct tcp_pcb *pcb)
 			break;
 		}
 #if TCP_CWND_DEBUG
-		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
+		LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
 								pcb->snd_wnd, pcb->cwnd, wnd,
 								ntohl(seg->tcphdr->seqno) + seg->len -
 								pcb->lastack,
@@ -586,6 +610,7 @@ tcp_output(struct tcp_pcb *pcb)
 		{
 			TCPH_SET_FLAG(seg->tcphdr, TCP_ACK);
 			pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+			pcb->ack_pend = 0;
 		}
 
 		tcp_output_segment(seg, pcb);
@@ -660,8 +685,15 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 	 wnd fields remain. */
 	seg->tcphdr->ackno = htonl(pcb->rcv_nxt);
 
-	/* advertise our receive window size in this TCP segment */
-	seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+	/* advertise our receive window size in this TCP segment: the window
+	   in a SYN, which offers scaling, is never scaled itself */
+	if (TCPH_FLAGS(seg->tcphdr) & TCP_SYN)
+	{
+		seg->tcphdr->wnd = htons(TCPWND16(pcb->rcv_ann_wnd));
+	} else
+	{
+		seg->tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
+	}
 
 	/* If we don't have a local IP address, we get one by
 	   calling ip_route(). */
@@ -699,10 +731,7 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 
 	seg->tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
-	seg->tcphdr->chksum = inet_chksum_pseudo(seg->p,
-											 &(pcb->local_ip),
-											 &(pcb->remote_ip),
-											 IP_PROTO_TCP, seg->p->tot_len);
+	seg->tcphdr->chksum = tcp_chksum(seg->p, &(pcb->local_ip), &(pcb->remote_ip));
 #endif
 	TCP_STATS_INC(tcp.xmit);
 
@@ -765,14 +794,13 @@ tcp_rst(u32_t seqno, u32_t ackno,
 	tcphdr->seqno = htonl(seqno);
 	tcphdr->ackno = htonl(ackno);
 	TCPH_FLAGS_SET(tcphdr, TCP_RST | TCP_ACK);
-	tcphdr->wnd = htons(TCP_WND);
+	tcphdr->wnd = htons(TCPWND16(TCP_WND));
 	tcphdr->urgp = 0;
 	TCPH_HDRLEN_SET(tcphdr, 5);
 
 	tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
-	tcphdr->chksum = inet_chksum_pseudo(p, local_ip, remote_ip,
-										IP_PROTO_TCP, p->tot_len);
+	tcphdr->chksum = tcp_chksum(p, local_ip, remote_ip);
 #endif
 	TCP_STATS_INC(tcp.xmit);
 	snmp_inc_tcpoutrsts();
@@ -892,14 +920,13 @@ tcp_keepalive(struct tcp_pcb *pcb)
 	tcphdr->seqno = htonl(pcb->snd_nxt - 1);
 	tcphdr->ackno = htonl(pcb->rcv_nxt);
 	TCPH_FLAGS_SET(tcphdr, 0);
-	tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+	tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
 	tcphdr->urgp = 0;
 	TCPH_HDRLEN_SET(tcphdr, 5);
 
 	tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
-	tcphdr->chksum = inet_chksum_pseudo(p, &pcb->local_ip, &pcb->remote_ip,
-										IP_PROTO_TCP, p->tot_len);
+	tcphdr->chksum = tcp_chksum(p, &pcb->local_ip, &pcb->remote_ip);
 #endif
 	TCP_STATS_INC(tcp.xmit);
 
@@ -976,7 +1003,7 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
 	tcphdr->seqno = seg->tcphdr->seqno;
 	tcphdr->ackno = htonl(pcb->rcv_nxt);
 	TCPH_FLAGS_SET(tcphdr, 0);
-	tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+	tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
 	tcphdr->urgp = 0;
 	TCPH_HDRLEN_SET(tcphdr, 5);
 
@@ -985,8 +1012,7 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
 
 	tcphdr->chksum = 0;
 #if CHECKSUM_GEN_TCP
-	tcphdr->chksum = inet_chksum_pseudo(p, &pcb->local_ip, &pcb->remote_ip,
-										IP_PROTO_TCP, p->tot_len);
+	tcphdr->chksum = tcp_chksum(p, &pcb->local_ip, &pcb->remote_ip);
 #endif
 	TCP_STATS_INC(tcp.xmit);
 
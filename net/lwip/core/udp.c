@@ -239,6 +239,7 @@ udp_input(struct pbuf *p, struct netif *inp)
 			  goto end;
 			}
 		  }
+		  IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_UDP)
 		  if (inet_chksum_pseudo_partial(p, (struct ip_addr *)&(iphdr->src),
 								 (struct ip_addr *)&(iphdr->dest),
 								 IP_PROTO_UDPLITE, p->tot_len, chklen) != 0) {
@@ -255,6 +256,7 @@ udp_input(struct pbuf *p, struct netif *inp)
 #endif /* LWIP_UDPLITE */
 		{
 #if CHECKSUM_CHECK_UDP
+			IF__NETIF_CHECKSUM_ENABLED(inp, NETIF_CHECKSUM_CHECK_UDP)
 			if (udphdr->chksum != 0)
 			{
 				if (inet_chksum_pseudo(p, (struct ip_addr *) &(iphdr->src),
@@ -537,9 +539,20 @@ udp_sendto_if(struct udp_pcb *pcb, struct pbuf *p,
 #if CHECKSUM_GEN_UDP
 		if ((pcb->flags & UDP_FLAGS_NOCHKSUM) == 0)
 		{
-			udphdr->chksum = inet_chksum_pseudo(q, src_ip, dst_ip, IP_PROTO_UDP, q->tot_len);
-			/* chksum zero must become 0xffff, as zero means 'no checksum' */
-			if (udphdr->chksum == 0x0000) udphdr->chksum = 0xffff;
+			IF__NETIF_CHECKSUM_ENABLED(netif, NETIF_CHECKSUM_GEN_UDP)
+			{
+				udphdr->chksum = inet_chksum_pseudo(q, src_ip, dst_ip, IP_PROTO_UDP, q->tot_len);
+				/* chksum zero must become 0xffff, as zero means 'no checksum' */
+				if (udphdr->chksum == 0x0000) udphdr->chksum = 0xffff;
+			}
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+			else
+			{
+				/* leave the pseudo-header sum for the hardware to finish */
+				udphdr->chksum = ~inet_chksum_pseudo_partial(q, src_ip, dst_ip,
+															 IP_PROTO_UDP, q->tot_len, 0);
+			}
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
 		}
 #endif /* CHECKSUM_CHECK_UDP */
 		LWIP_DEBUGF(UDP_DEBUG, ("udp_send: UDP checksum 0x%04"X16_F"\n", udphdr->chksum));
@@ -641,13 +654,15 @@ udp_bind(struct udp_pcb *pcb, struct ip_addr *ipaddr, u16_t port)
 #define UDP_LOCAL_PORT_RANGE_END   0x7fff
 #endif
 		port = UDP_LOCAL_PORT_RANGE_START;
+		while (!LWIP_PORT_OWNED(port))
+			port++;
 		ipcb = udp_pcbs;
-		while ((ipcb != NULL) && (port != UDP_LOCAL_PORT_RANGE_END))
+		while ((ipcb != NULL) && (port < UDP_LOCAL_PORT_RANGE_END))
 		{
 			if (ipcb->local_port == port)
 			{
 				/* port is already used by another udp_pcb */
-				port++;
+				port += lwip_nshards;
 				/* restart scanning all udp pcbs */
 				ipcb = udp_pcbs;
 			} else
@@ -82,6 +82,30 @@ extern "C" {
 /** if set, the netif has IGMP capability */
 #define NETIF_FLAG_IGMP         0x40U
 
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+/** Checksum control flags: lwIP computes a checksum in software only
+ *  while its flag is set in netif->chksum_flags.  With NETIF_CHECKSUM_GEN_UDP
+ *  or _TCP clear, the checksum field of an outgoing segment is left holding
+ *  the pseudo-header sum, which the hardware folds the payload into; a
+ *  UDP datagram sent without a checksum still has 0 there. */
+#define NETIF_CHECKSUM_GEN_IP     0x0001U
+#define NETIF_CHECKSUM_GEN_UDP    0x0002U
+#define NETIF_CHECKSUM_GEN_TCP    0x0004U
+#define NETIF_CHECKSUM_CHECK_IP   0x0008U
+#define NETIF_CHECKSUM_CHECK_UDP  0x0010U
+#define NETIF_CHECKSUM_CHECK_TCP  0x0020U
+#define NETIF_CHECKSUM_ENABLE_ALL 0x003FU
+#define NETIF_CHECKSUM_DISABLE_ALL 0x0000U
+
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags) \
+  ((netif)->chksum_flags = (chksumflags))
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag) \
+  if (((netif) == NULL) || (((netif)->chksum_flags & (chksumflag)) != 0))
+#else /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+#define NETIF_SET_CHECKSUM_CTRL(netif, chksumflags)
+#define IF__NETIF_CHECKSUM_ENABLED(netif, chksumflag)
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
+
 /** Generic data structure used for all lwIP network interfaces.
  *  The following fields should be filled in by the initialization
  *  function for the device driver: hwaddr_len, hwaddr[], mtu, flags */
@@ -140,6 +164,10 @@ struct netif {
 	u16_t mtu;
 	/** flags (see NETIF_FLAG_ above) */
 	u8_t flags;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+	/** checksums done in software (see NETIF_CHECKSUM_ above) */
+	u16_t chksum_flags;
+#endif /* LWIP_CHECKSUM_CTRL_PER_NETIF */
 	/** descriptive abbreviation */
 	char name[2];
 	/** number of this interface */
@@ -328,6 +328,14 @@
 #define ARP_TABLE_SIZE                  10
 #endif
 
+/**
+ * ARP_HASH_BITS: log2 of the number of hash chains the ARP table's
+ * entries are found through (at least 1).
+ */
+#ifndef ARP_HASH_BITS
+#define ARP_HASH_BITS                   4
+#endif
+
 /**
  * ARP_QUEUEING==1: Outgoing packets are queued during hardware address
  * resolution.
@@ -336,6 +344,16 @@
 #define ARP_QUEUEING                    1
 #endif
 
+/**
+ * ARP_QUEUE_LEN: The most packets queued on one pending ARP entry; the
+ * oldest is dropped to make room for another, so that one unresolved
+ * host can't take all of MEMP_NUM_ARP_QUEUE.
+ * (requires the ARP_QUEUEING option)
+ */
+#ifndef ARP_QUEUE_LEN
+#define ARP_QUEUE_LEN                   3
+#endif
+
 /**
  * ETHARP_TRUST_IP_MAC==1: Incoming IP packets cause the ARP table to be
  * updated with the source MAC and IP addresses supplied in the packet.
@@ -664,6 +682,19 @@
 #define TCP_WND                         2048
 #endif
 
+/**
+ * LWIP_WND_SCALE and TCP_RCV_SCALE: Set LWIP_WND_SCALE to 1 to enable
+ * window scaling (RFC 7323), which lets TCP_WND be larger than 0xffff
+ * (TCP_SND_BUF still has to fit in an u16_t).  TCP_RCV_SCALE is the shift count we offer the
+ * remote end (0..14); TCP_WND must fit in 0xffff << TCP_RCV_SCALE.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  0
+#endif
+#ifndef TCP_RCV_SCALE
+#define TCP_RCV_SCALE                   0
+#endif
+
 /**
  * TCP_MAXRTX: Maximum number of retransmissions of data segments.
  */
@@ -734,6 +765,32 @@
 #define TCP_SNDLOWAT                    (TCP_SND_BUF/2)
 #endif
 
+/**
+ * TCP_PCB_HASH_BITS: log2 of the number of chains in the hash table
+ * tcp_input uses to find the PCB of a segment for a connection.
+ */
+#ifndef TCP_PCB_HASH_BITS
+#define TCP_PCB_HASH_BITS               8
+#endif
+
+/**
+ * TCP_HEADER_PREDICTION==1: Handle pure ACKs for new data and the next
+ * in-sequence data on an established connection without going through
+ * tcp_process() and tcp_receive().
+ */
+#ifndef TCP_HEADER_PREDICTION
+#define TCP_HEADER_PREDICTION           0
+#endif
+
+/**
+ * TCP_ACK_SEGS: Send an ACK once this many in-sequence segments have
+ * arrived since the last one; fewer wait for tcp_fasttmr.  The default
+ * of 2 is RFC 1122's every other segment.
+ */
+#ifndef TCP_ACK_SEGS
+#define TCP_ACK_SEGS                    2
+#endif
+
 /**
  * TCP_LISTEN_BACKLOG: Enable the backlog option for tcp listen pcb.
  */
@@ -780,6 +837,15 @@
 #define PBUF_LINK_HLEN                  14
 #endif
 
+/**
+ * LWIP_SUPPORT_CUSTOM_PBUF==1: Support pbufs whose owner frees them,
+ * through a function pointer (see pbuf_alloced_custom), as lwIP 1.4
+ * does.  Lets a driver hand lwIP its receive buffers without a copy.
+ */
+#ifndef LWIP_SUPPORT_CUSTOM_PBUF
+#define LWIP_SUPPORT_CUSTOM_PBUF        0
+#endif
+
 /**
  * PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. The default is
  * designed to accomodate single full size TCP frame in one pbuf, including
@@ -1447,6 +1513,15 @@
 #define CHECKSUM_CHECK_TCP              1
 #endif
 
+/**
+ * LWIP_CHECKSUM_CTRL_PER_NETIF==1: Let a netif driver turn off the
+ * checksums above for its own interface (see NETIF_SET_CHECKSUM_CTRL),
+ * when the hardware generates or checks them instead.
+ */
+#ifndef LWIP_CHECKSUM_CTRL_PER_NETIF
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    0
+#endif
+
 /*
    ---------------------------------------
    ---------- Debugging options ----------
@@ -297,6 +297,23 @@ struct timeval {
 };
 #endif /* LWIP_TIMEVAL_PRIVATE */
 
+/* Edge-triggered event queues (lwip_evq_*): a queue reports each socket
+ * it watches once per transition to readable or writable, rather than
+ * being rescanned on every wait like lwip_select. */
+#ifndef LWIP_NUM_EVQ
+#define LWIP_NUM_EVQ      8
+#endif
+#define LWIP_EVQ_IN       0x01    /* Data, a connection, or EOF arrived */
+#define LWIP_EVQ_OUT      0x04    /* Send buffer space became free */
+#define LWIP_EVQ_ADD      1
+#define LWIP_EVQ_MOD      2
+#define LWIP_EVQ_DEL      3
+
+struct lwip_event {
+	u32_t events;             /* LWIP_EVQ_* bits that became true */
+	u32_t data;               /* As given to lwip_evq_ctl */
+};
+
 void lwip_socket_init(void);
 
 int lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
@@ -314,6 +331,7 @@ int lwip_read(int s, void *mem, int len);
 int lwip_recvfrom(int s, void *mem, int len, unsigned int flags,
 				  struct sockaddr *from, socklen_t *fromlen);
 int lwip_send(int s, const void *dataptr, int size, unsigned int flags);
+int lwip_send_ref(int s, const void *dataptr, int size, unsigned int flags);
 int lwip_sendto(int s, const void *dataptr, int size, unsigned int flags,
 				struct sockaddr *to, socklen_t tolen);
 int lwip_socket(int domain, int type, int protocol);
@@ -321,6 +339,10 @@ int lwip_write(int s, const void *dataptr, int size);
 int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
 				struct timeval *timeout);
 int lwip_ioctl(int s, long cmd, void *argp);
+int lwip_evq_create(void);
+int lwip_evq_ctl(int q, int op, int s, u32_t events, u32_t data);
+int lwip_evq_wait(int q, struct lwip_event *events, int maxevents, int timeout);
+int lwip_evq_close(int q);
 
 #if LWIP_COMPAT_SOCKETS
 #define accept(a, b, c)         lwip_accept(a,b,c)
@@ -144,6 +144,33 @@ void tcp_rexmit_rto(struct tcp_pcb *pcb);
                                 (((u32_t)TCP_MSS / 256) << 8) | \
                                 (TCP_MSS & 255))
 
+/** This returns a NOP and a TCP header window scale option (RFC 7323)
+ * offering TCP_RCV_SCALE in an u32_t */
+#define TCP_BUILD_WND_SCALE_OPTION()  htonl(((u32_t)1 << 24) | \
+                                ((u32_t)3 << 16) | \
+                                ((u32_t)3 << 8) | \
+                                (TCP_RCV_SCALE & 255))
+
+#if LWIP_WND_SCALE
+typedef u32_t tcpwnd_size_t;
+#define TCPWNDSIZE_F U32_F
+/* The window field of any segment but a SYN is scaled (RFC 7323) */
+#define RCV_WND_SCALE(pcb, wnd) ((wnd) >> (pcb)->rcv_scale)
+#define SND_WND_SCALE(pcb, wnd) ((tcpwnd_size_t)(wnd) << (pcb)->snd_scale)
+/* The receive window we can offer: the whole of TCP_WND only once the
+ * remote end has agreed to scaling */
+#define TCP_WND_MAX(pcb) ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? \
+                                TCP_WND : TCPWND16(TCP_WND)))
+#else
+typedef u16_t tcpwnd_size_t;
+#define TCPWNDSIZE_F U16_F
+#define RCV_WND_SCALE(pcb, wnd) (wnd)
+#define SND_WND_SCALE(pcb, wnd) (wnd)
+#define TCP_WND_MAX(pcb) TCP_WND
+#endif
+/** Clamps a window to what fits in the header's 16 bits */
+#define TCPWND16(x) ((u16_t)LWIP_MIN((x), 0xffff))
+
 #define TCP_SEQ_LT(a, b)     ((s32_t)((a)-(b)) < 0)
 #define TCP_SEQ_LEQ(a, b)    ((s32_t)((a)-(b)) <= 0)
 #define TCP_SEQ_GT(a, b)     ((s32_t)((a)-(b)) > 0)
@@ -279,6 +306,9 @@ struct tcp_pcb {
 	/* ports are in host byte order */
 	u16_t remote_port;
 
+	/* chain in tcp_pcb_hash, while in tcp_active_pcbs or tcp_tw_pcbs */
+	struct tcp_pcb *hnext, **hprev;
+
 	u8_t flags;
 #define TF_ACK_DELAY   (u8_t)0x01U   /* Delayed ACK. */
 #define TF_ACK_NOW     (u8_t)0x02U   /* Immediate ACK. */
@@ -286,13 +316,20 @@ struct tcp_pcb {
 #define TF_FIN         (u8_t)0x20U   /* Connection was closed locally (FIN segment enqueued). */
 #define TF_NODELAY     (u8_t)0x40U   /* Disable Nagle algorithm */
 #define TF_NAGLEMEMERR (u8_t)0x80U /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
+#define TF_WND_SCALE   (u8_t)0x10U   /* Window scaling agreed in the SYNs (RFC 7323). */
+
+#if LWIP_WND_SCALE
+	u8_t snd_scale;  /* shift for the window the remote end sends */
+	u8_t rcv_scale;  /* shift for the window we send */
+#endif
 
 	/* the rest of the fields are in host byte order
 	   as we have to do some math with them */
 	/* receiver variables */
 	u32_t rcv_nxt;   /* next seqno expected */
-	u16_t rcv_wnd;   /* receiver window */
-	u16_t rcv_ann_wnd; /* announced receive window */
+	tcpwnd_size_t rcv_wnd;   /* receiver window */
+	tcpwnd_size_t rcv_ann_wnd; /* announced receive window */
+	u8_t ack_pend;   /* in-sequence segments received since our last ACK */
 
 	/* Timers */
 	u32_t tmr;
@@ -316,13 +353,13 @@ struct tcp_pcb {
 	u8_t dupacks;
 
 	/* congestion avoidance/control variables */
-	u16_t cwnd;
-	u16_t ssthresh;
+	tcpwnd_size_t cwnd;
+	tcpwnd_size_t ssthresh;
 
 	/* sender variables */
 	u32_t snd_nxt,   /* next seqno to be sent */
 	snd_max;       /* Highest seqno sent. */
-	u16_t snd_wnd;   /* sender window */
+	tcpwnd_size_t snd_wnd;   /* sender window */
 	u32_t snd_wl1, snd_wl2, /* Sequence and acknowledgement numbers of last
                              window update. */
 	snd_lbb;       /* Sequence number of next byte to be buffered. */
@@ -501,12 +538,16 @@ struct tcp_seg {
 struct tcp_pcb *tcp_pcb_copy(struct tcp_pcb *pcb);
 void tcp_pcb_purge(struct tcp_pcb *pcb);
 void tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb);
+void tcp_pcb_hash_insert(struct tcp_pcb *pcb);
+void tcp_pcb_hash_remove(struct tcp_pcb *pcb);
 
 u8_t tcp_segs_free(struct tcp_seg *seg);
 u8_t tcp_seg_free(struct tcp_seg *seg);
 struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
 
-#define tcp_ack(pcb)     if((pcb)->flags & TF_ACK_DELAY) { \
+/* ACK every TCP_ACK_SEGS in-sequence segments, and any fewer on the
+   fast timer */
+#define tcp_ack(pcb)     if(++(pcb)->ack_pend >= TCP_ACK_SEGS) { \
                             (pcb)->flags &= ~TF_ACK_DELAY; \
                             (pcb)->flags |= TF_ACK_NOW; \
                             tcp_output(pcb); \
@@ -573,11 +614,21 @@ extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. *
 
 extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
+/* The PCBs in tcp_active_pcbs and tcp_tw_pcbs, chained by remote address
+   and port and local port.  The local address is not part of the key:
+   tcp_output fills it in after tcp_connect has registered the PCB. */
+extern struct tcp_pcb *tcp_pcb_hash[1 << TCP_PCB_HASH_BITS];
+#define TCP_PCB_HASH(rip, rport, lport) \
+	((((rip) ^ (((u32_t)(rport) << 16) | (lport))) * 0x9e3779b1UL) >> \
+	 (32 - TCP_PCB_HASH_BITS))
+
 /* Axioms about the above lists:   
    1) Every TCP PCB that is not CLOSED is in one of the lists.
    2) A PCB is only in one of the lists.
    3) All PCBs in the tcp_listen_pcbs list is in LISTEN state.
    4) All PCBs in the tcp_tw_pcbs list is in TIME-WAIT state.
+   5) A PCB is in tcp_pcb_hash exactly when it is in tcp_active_pcbs
+      or tcp_tw_pcbs.
 */
 
 /* Define two macros, TCP_REG and TCP_RMV that registers a TCP PCB
@@ -143,7 +143,7 @@ struct etharp_q_entry {
 
 #define etharp_init() /* Compatibility define, not init needed. */
 void etharp_tmr(void);
-s8_t etharp_find_addr(struct netif *netif, struct ip_addr *ipaddr,
+s16_t etharp_find_addr(struct netif *netif, struct ip_addr *ipaddr,
 					  struct eth_addr **eth_ret, struct ip_addr **ip_ret);
 void etharp_ip_input(struct netif *netif, struct pbuf *p);
 void etharp_arp_input(struct netif *netif, struct eth_addr *ethaddr,
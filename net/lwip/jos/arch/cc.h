@@ -38,4 +38,8 @@ typedef uintptr_t mem_ptr_t;
 #define BYTE_ORDER LITTLE_ENDIAN
 #endif
 
+// Sum words a time, and with SSE2 (arch/chksum.c)
+u16_t jos_chksum(void *dataptr, u16_t len);
+#define LWIP_CHKSUM    jos_chksum
+
 #endif
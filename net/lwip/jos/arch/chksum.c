@@ -0,0 +1,113 @@
+// The Internet checksum, for lwIP's LWIP_CHKSUM (see arch/cc.h).
+//
+// Like lwIP's own versions, jos_chksum returns the ones'-complement sum
+// of the 16-bit words at dataptr in the byte order they have in memory,
+// not inverted: summing in either byte order gives the same bytes
+// (RFC 1071), so the words can be loaded natively, 4 or 16 bytes at a
+// time.  With SSE2, large buffers are summed in XMM registers, which
+// the kernel saves lazily (kern/fpu.c): the first such sum in a time
+// slice costs a trap, so small buffers stay on the integer loop.
+
+#include <inc/x86.h>
+#include <lwip/opt.h>
+#include <arch/cc.h>
+
+// Bytes below which the SSE2 loop does not pay for loading the FPU
+#define SSE2_MIN    512
+
+static int sse2_ok = -1;
+
+// Sum nvec 16-byte blocks at p as 16-bit words into 32-bit lanes.  A
+// buffer of at most 64KB adds at most 8192 words to each lane, so the
+// lanes cannot overflow, nor can their total.
+static u32_t
+sum_sse2(const u8_t *p, u32_t nvec)
+{
+	u32_t lanes[4] __attribute__((aligned(16)));
+
+	asm volatile(
+		"pxor %%xmm0, %%xmm0\n"
+		"pxor %%xmm1, %%xmm1\n"
+		"pxor %%xmm7, %%xmm7\n"
+		"1:\n"
+		"movdqu (%0), %%xmm2\n"
+		"movdqa %%xmm2, %%xmm3\n"
+		"punpcklwd %%xmm7, %%xmm2\n"
+		"punpckhwd %%xmm7, %%xmm3\n"
+		"paddd %%xmm2, %%xmm0\n"
+		"paddd %%xmm3, %%xmm1\n"
+		"addl $16, %0\n"
+		"decl %1\n"
+		"jnz 1b\n"
+		"paddd %%xmm1, %%xmm0\n"
+		"movdqa %%xmm0, %2\n"
+		: "+r" (p), "+r" (nvec), "=m" (lanes)
+		// No XMM clobbers: we build without -msse, so the compiler
+		// keeps nothing there (and does not accept their names)
+		: : "cc", "memory");
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+u16_t
+jos_chksum(void *dataptr, u16_t len)
+{
+	u8_t *p = dataptr;
+	u32_t edx, n;
+	u64_t sum = 0;
+	bool odd = (uintptr_t) p & 1;
+
+	if (sse2_ok < 0)
+	{
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sse2_ok = (edx & CPUID_SSE2) != 0;
+	}
+
+	// From an odd address, sum the words that start at the next
+	// byte, then swap the result's bytes back.  The first byte is
+	// the high half of a word in that order.
+	if (odd && len > 0)
+	{
+		sum = (u32_t) *p++ << 8;
+		len--;
+	}
+	if (((uintptr_t) p & 2) && len >= 2)
+	{
+		sum += *(u16_t *) p;
+		p += 2;
+		len -= 2;
+	}
+
+	if (sse2_ok && len >= SSE2_MIN)
+	{
+		n = len / 16;
+		sum += sum_sse2(p, n);
+		p += n * 16;
+		len -= n * 16;
+	}
+
+	// Eight words a time, carries collected in the upper half
+	for (; len >= 32; p += 32, len -= 32)
+		sum += (u64_t) ((u32_t *) p)[0] + ((u32_t *) p)[1] +
+			   ((u32_t *) p)[2] + ((u32_t *) p)[3] +
+			   ((u32_t *) p)[4] + ((u32_t *) p)[5] +
+			   ((u32_t *) p)[6] + ((u32_t *) p)[7];
+	for (; len >= 4; p += 4, len -= 4)
+		sum += *(u32_t *) p;
+	if (len >= 2)
+	{
+		sum += *(u16_t *) p;
+		p += 2;
+		len -= 2;
+	}
+	if (len > 0)
+		sum += *p;
+
+	// Fold to 16 bits
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	if (odd)
+		sum = ((sum & 0xFF) << 8) | ((sum >> 8) & 0xFF);
+	return sum;
+}
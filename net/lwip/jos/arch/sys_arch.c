@@ -13,6 +13,9 @@
 #define NMBOX        128
 #define MBOXSLOTS    32
 
+// This network server's shard, of how many (see LWIP_PORT_OWNED)
+unsigned lwip_shard = 0, lwip_nshards = 1;
+
 struct sys_sem_entry {
 	int freed;
 	int gen;
@@ -200,7 +203,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 			return SYS_ARCH_TIMEOUT;
 		} else
 		{
-			uint32_t a = sys_time_msec();
+			uint32_t a = time_msec();
 			uint32_t sleep_until = tm_msec ? a + (tm_msec - waited) : ~0;
 			sems[sem].waiters = 1;
 			uint32_t cur_v = sems[sem].v;
@@ -212,7 +215,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 				cprintf("sys_arch_sem_wait: sem freed under waiter!\n");
 				return SYS_ARCH_TIMEOUT;
 			}
-			uint32_t b = sys_time_msec();
+			uint32_t b = time_msec();
 			waited += (b - a);
 		}
 	}
@@ -272,14 +275,12 @@ sys_thread_new(char *name, void (*thread)(void *arg), void *arg,
 	if (lt == 0)
 		panic("sys_thread_new: cannot allocate thread struct");
 
-	if (stacksize > PGSIZE)
-		panic("large stack %d", stacksize);
-
 	lt->func = thread;
 	lt->arg = arg;
 
 	thread_id_t tid;
-	int r = thread_create(&tid, name, lwip_thread_entry, (uint32_t) lt);
+	int r = thread_create_stack(&tid, name, lwip_thread_entry, (uint32_t) lt,
+								stacksize);
 
 	if (r < 0)
 		panic("lwip: sys_thread_new: cannot create: %s\n", e2s(r));
@@ -311,9 +312,9 @@ sys_arch_timeouts(void)
 {
 	thread_id_t tid = thread_id();
 
-	struct sys_thread *t;
-	LIST_FOREACH(t, &threads[tid % thread_hash_size], link)
-	if (t->tid == tid)
+	// The thread keeps its own; the hash is for timeout_cleanup
+	struct sys_thread *t = thread_data();
+	if (t)
 		goto out;
 
 	t = malloc(sizeof(*t));
@@ -327,6 +328,7 @@ sys_arch_timeouts(void)
 	t->tid = tid;
 	memset(&t->tmo, 0, sizeof(t->tmo));
 	LIST_INSERT_HEAD(&threads[tid % thread_hash_size], t, link);
+	thread_set_data(t);
 
 	out:
 	return &t->tmo;
@@ -2,7 +2,36 @@
 
 #include <arch/thread.h>
 #include <arch/threadq.h>
-#include <arch/setjmp.h>
+
+// Threads asleep in thread_wait are off the run queue.  Those waiting
+// for a thread_wakeup sit on a hash of the addresses they wait on;
+// those with a deadline also sit on a hierarchical timer wheel, driven
+// by time_msec (the kernel's info page), so arming, cancelling and
+// firing a timeout are all O(1) however many there are.
+//
+// Level 0 of the wheel has a slot per millisecond.  A slot of each
+// level above spans a whole turn of the one below, and is emptied into
+// it, as its time comes, each time the level below wraps around.
+// Deadlines past the top level are parked in its furthest slot and
+// placed again each time they come round.
+
+#define WAIT_HASH_BITS  10
+#define WAIT_HASH       (1 << WAIT_HASH_BITS)
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+#define WHEEL_SPAN(l)   (1U << (WHEEL_BITS * (l)))
+
+// Thread stacks come from a pool of STACKSLOT-sized slots from
+// STACKBASE on, not from malloc.  A thread's context sits at the top of
+// its slot with its stack below, mapped as deep as it asked for; the
+// rest of the slot, a page at least, stays unmapped as a guard.  Freed
+// slots go on a LIFO list, and up to STACK_CACHE of them keep their
+// pages, so a thread per connection costs no system call to start.
+#define STACKBASE       0xE8000000
+#define STACKSLOT       (16 * PGSIZE)
+#define NSTACKS         1024
+#define STACK_CACHE     32
 
 static thread_id_t max_tid;
 static struct thread_context *cur_tc;
@@ -10,11 +39,27 @@ static struct thread_context *cur_tc;
 static struct thread_queue thread_queue;
 static struct thread_queue kill_queue;
 
+static struct thread_context *wait_hash[WAIT_HASH];
+static struct thread_context *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t wheel_now;      // every deadline up to this has fired
+static uint32_t nasleep;        // threads in thread_wait
+static uint32_t ntimers;        // of which on the wheel
+static uint32_t nwoken;         // woken by thread_wakeup, not yet running
+
+static int stack_next[NSTACKS]; // the free list, through slot numbers
+static uint8_t stack_pages[NSTACKS];    // pages mapped at each slot's top
+static int stack_free = -1;     // most recently freed slot, or -1
+static int stack_unused;        // slots from here on never handed out
+static int nstack_cached;       // free slots still holding pages
+
+void thread_ctx_switch(uint32_t *save_esp, uint32_t esp);
+
 void
 thread_init(void)
 {
 	threadq_init(&thread_queue);
 	max_tid = 0;
+	wheel_now = time_msec();
 }
 
 uint32_t
@@ -23,40 +68,195 @@ thread_id(void)
 	return cur_tc->tc_tid;
 }
 
+// A word of the running thread's own, for its user to keep what it
+// would otherwise look up by thread_id.
+void *
+thread_data(void)
+{
+	return cur_tc->tc_data;
+}
+
+void
+thread_set_data(void *data)
+{
+	cur_tc->tc_data = data;
+}
+
+// Fibonacci hashing: the top bits of the address times 2^32 / phi
+// spread the evenly strided words threads wait on (semaphores in an
+// array, say) over every bucket.
+static struct thread_context **
+wait_bucket(volatile uint32_t *addr)
+{
+	return &wait_hash[((uint32_t) addr * 0x9E3779B9U) >> (32 - WAIT_HASH_BITS)];
+}
+
+// Put tc on the list at *head, through its link fields next and pprev.
+#define SLEEP_LINK(head, tc, next, pprev) do { \
+	(tc)->next = *(head); \
+	if (*(head)) \
+		(*(head))->pprev = &(tc)->next; \
+	*(head) = (tc); \
+	(tc)->pprev = (head); \
+} while (0)
+
+#define SLEEP_UNLINK(tc, next, pprev) do { \
+	*(tc)->pprev = (tc)->next; \
+	if ((tc)->next) \
+		(tc)->next->pprev = (tc)->pprev; \
+	(tc)->pprev = 0; \
+} while (0)
+
+// Put tc on the wheel, in the slot its deadline falls in.
+static void
+timer_insert(struct thread_context *tc)
+{
+	uint32_t delta = tc->tc_deadline - wheel_now, when = tc->tc_deadline;
+	int l;
+
+	for (l = 0; l < WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(l + 1); l++)
+		/* do nothing */;
+	if (delta >= WHEEL_SPAN(WHEEL_LEVELS))
+		when = wheel_now + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+	SLEEP_LINK(&wheel[l][(when >> (WHEEL_BITS * l)) % WHEEL_SLOTS], tc,
+			   tc_timer_next, tc_timer_pprev);
+}
+
+// Take tc off the wait hash and the wheel and make it runnable.
+static void
+thread_ready(struct thread_context *tc)
+{
+	if (tc->tc_wait_pprev)
+		SLEEP_UNLINK(tc, tc_wait_next, tc_wait_pprev);
+	if (tc->tc_timer_pprev)
+	{
+		SLEEP_UNLINK(tc, tc_timer_next, tc_timer_pprev);
+		ntimers--;
+	}
+	nasleep--;
+	threadq_push(&thread_queue, tc);
+}
+
+// Place again every timer in slot 'slot' of level l, one level down or
+// more.  Returns whether that slot is the level's first, so that the
+// level above is due for the same.
+static bool
+wheel_cascade(int l, uint32_t slot)
+{
+	struct thread_context *tc, *next;
+
+	tc = wheel[l][slot];
+	wheel[l][slot] = 0;
+	for (; tc; tc = next)
+	{
+		next = tc->tc_timer_next;
+		tc->tc_timer_pprev = 0;
+		timer_insert(tc);
+	}
+	return slot == 0;
+}
+
+// Wake every thread whose deadline has passed.
+static void
+wheel_advance(void)
+{
+	uint32_t now = time_msec(), slot;
+	int l;
+
+	if (ntimers == 0)
+	{
+		wheel_now = now;
+		return;
+	}
+	while ((int32_t) (now - wheel_now) > 0)
+	{
+		wheel_now++;
+		slot = wheel_now % WHEEL_SLOTS;
+		for (l = 1; slot == 0 && l < WHEEL_LEVELS; l++)
+			if (!wheel_cascade(l, (wheel_now >> (WHEEL_BITS * l)) % WHEEL_SLOTS))
+				break;
+		while (wheel[0][slot])
+			thread_ready(wheel[0][slot]);
+		if (ntimers == 0)
+			wheel_now = now;
+	}
+}
+
 void
 thread_wakeup(volatile uint32_t *addr)
 {
-	struct thread_context *tc = thread_queue.tq_first;
-	while (tc)
+	struct thread_context *tc, *next;
+
+	for (tc = *wait_bucket(addr); tc; tc = next)
 	{
+		next = tc->tc_wait_next;
 		if (tc->tc_wait_addr == addr)
+		{
 			tc->tc_wakeup = 1;
-		tc = tc->tc_queue_link;
+			nwoken++;
+			thread_ready(tc);
+		}
+	}
+}
+
+// Run the next runnable thread, putting the current one back on the
+// run queue if 'requeue', or leaving it asleep.  With no thread to run,
+// a yield just returns; otherwise we wait for a timer to wake someone.
+static void
+thread_switch(bool requeue)
+{
+	static struct thread_context dead_tc;   // where a halted thread's esp goes
+	struct thread_context *next_tc, *prev_tc;
+	uint32_t dummy = 0;
+
+	wheel_advance();
+	while (!(next_tc = threadq_pop(&thread_queue)))
+	{
+		if (requeue || nasleep == 0)
+			return;
+		// Only a timer can wake anyone: sleep for a tick if one is
+		// armed, or else give the CPU away and look again.
+		if (ntimers > 0)
+			sys_futex_wait(&dummy, 0, UINFO_TICK_USEC / 1000);
+		else
+			sys_yield();
+		wheel_advance();
 	}
+
+	if (!(prev_tc = cur_tc))
+		prev_tc = &dead_tc;
+	else if (requeue)
+		threadq_push(&thread_queue, cur_tc);
+	cur_tc = next_tc;
+	thread_ctx_switch(&prev_tc->tc_esp, next_tc->tc_esp);
 }
 
+// Sleep until thread_wakeup(addr), if *addr still holds val, or until
+// time_msec() reaches msec, unless that is ~0.  addr may be 0 to wait
+// for the time alone.
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec)
 {
-	uint32_t s = sys_time_msec();
-	uint32_t p = s;
+	if (addr && *addr != val)
+		return;
+	if (msec != (uint32_t) ~0 && (int32_t) (msec - time_msec()) <= 0)
+		return;
 
 	cur_tc->tc_wait_addr = addr;
 	cur_tc->tc_wakeup = 0;
-
-	while (p < msec)
+	if (addr)
+		SLEEP_LINK(wait_bucket(addr), cur_tc, tc_wait_next, tc_wait_pprev);
+	if (msec != (uint32_t) ~0)
 	{
-		if (p < s)
-			break;
-		if (addr && *addr != val)
-			break;
-		if (cur_tc->tc_wakeup)
-			break;
-
-		thread_yield();
-		p = sys_time_msec();
+		cur_tc->tc_deadline = msec;
+		timer_insert(cur_tc);
+		ntimers++;
 	}
+	nasleep++;
+	thread_switch(false);
 
+	if (cur_tc->tc_wakeup)
+		nwoken--;
 	cur_tc->tc_wait_addr = 0;
 	cur_tc->tc_wakeup = 0;
 }
@@ -64,15 +264,7 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec)
 int
 thread_wakeups_pending(void)
 {
-	struct thread_context *tc = thread_queue.tq_first;
-	int n = 0;
-	while (tc)
-	{
-		if (tc->tc_wakeup)
-			++n;
-		tc = tc->tc_queue_link;
-	}
-	return n;
+	return nwoken;
 }
 
 int
@@ -101,6 +293,76 @@ thread_set_name(struct thread_context *tc, const char *name)
 	tc->tc_name[name_size - 1] = 0;
 }
 
+static uintptr_t
+stack_top(int slot)
+{
+	return STACKBASE + (slot + 1) * STACKSLOT;
+}
+
+// Take a slot off the pool with at least npages mapped at its top.
+// Returns its number, or < 0 on error.
+static int
+stack_alloc(uint32_t npages)
+{
+	struct PageMapOp op;
+	size_t done;
+	int slot, r;
+
+	if ((slot = stack_free) >= 0)
+	{
+		stack_free = stack_next[slot];
+		if (stack_pages[slot] > 0)
+			nstack_cached--;
+	} else if (stack_unused < NSTACKS)
+		slot = stack_unused++;
+	else
+		return -E_NO_MEM;
+
+	if (stack_pages[slot] < npages)
+	{
+		op.srcva = PAGEMAP_ALLOC;
+		op.dstva = stack_top(slot) - npages * PGSIZE;
+		op.npages = npages - stack_pages[slot];
+		op.perm = PTE_P | PTE_U | PTE_W;
+		if ((r = sys_page_map_batch(0, 0, &op, 1, &done)) < 0)
+		{
+			// Some of them may be mapped: drop back to none
+			op.dstva = stack_top(slot) - npages * PGSIZE;
+			op.npages = npages;
+			op.perm = 0;
+			sys_page_map_batch(0, 0, &op, 1, &done);
+			stack_pages[slot] = 0;
+			stack_next[slot] = stack_free;
+			stack_free = slot;
+			return r;
+		}
+		stack_pages[slot] = npages;
+	}
+	return slot;
+}
+
+// Give a slot back, unmapping its pages if enough free ones have theirs.
+static void
+stack_release(int slot)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	if (nstack_cached < STACK_CACHE)
+		nstack_cached++;
+	else
+	{
+		op.srcva = 0;
+		op.dstva = stack_top(slot) - stack_pages[slot] * PGSIZE;
+		op.npages = stack_pages[slot];
+		op.perm = 0;
+		sys_page_map_batch(0, 0, &op, 1, &done);
+		stack_pages[slot] = 0;
+	}
+	stack_next[slot] = stack_free;
+	stack_free = slot;
+}
+
 static void
 thread_entry(void)
 {
@@ -112,33 +374,44 @@ int
 thread_create(thread_id_t *tid, const char *name,
 			  void (*entry)(uint32_t), uint32_t arg)
 {
-	struct thread_context *tc = malloc(sizeof(struct thread_context));
-	if (!tc)
-		return -E_NO_MEM;
-
-	memset(tc, 0, sizeof(struct thread_context));
+	return thread_create_stack(tid, name, entry, arg, THREAD_STACK_DEFAULT);
+}
 
+// Start a thread running entry(arg) with room for stacksize bytes of
+// stack, at most THREAD_STACK_MAX; 0 means THREAD_STACK_DEFAULT.
+int
+thread_create_stack(thread_id_t *tid, const char *name,
+					void (*entry)(uint32_t), uint32_t arg, size_t stacksize)
+{
+	struct thread_context *tc;
+	uint32_t *sp;
+	int slot;
+
+	static_assert(THREAD_STACK_MAX + sizeof(*tc) + PGSIZE <= STACKSLOT);
+	if (stacksize == 0)
+		stacksize = THREAD_STACK_DEFAULT;
+	if (stacksize > THREAD_STACK_MAX)
+		return -E_INVAL;
+	stacksize += ROUNDUP(sizeof(*tc), 16);
+	if ((slot = stack_alloc(ROUNDUP(stacksize, PGSIZE) / PGSIZE)) < 0)
+		return slot;
+
+	tc = (struct thread_context *) (stack_top(slot) - ROUNDUP(sizeof(*tc), 16));
+	memset(tc, 0, sizeof(*tc));
 	thread_set_name(tc, name);
 	tc->tc_tid = alloc_tid();
-
-	tc->tc_stack_bottom = malloc(stack_size);
-	if (!tc->tc_stack_bottom)
-	{
-		free(tc);
-		return -E_NO_MEM;
-	}
-
-	void *stacktop = tc->tc_stack_bottom + stack_size;
-	// Terminate stack unwinding
-	stacktop = stacktop - 4;
-	memset(stacktop, 0, 4);
-
-	memset(&tc->tc_jb, 0, sizeof(tc->tc_jb));
-	tc->tc_jb.jb_esp = (uint32_t) stacktop;
-	tc->tc_jb.jb_eip = (uint32_t) &thread_entry;
+	tc->tc_stack = slot;
 	tc->tc_entry = entry;
 	tc->tc_arg = arg;
 
+	// What thread_ctx_switch pops: %edi, %esi, %ebx, %ebp and a return
+	// into thread_entry, above which a null return address ends stack
+	// unwinding.
+	sp = (uint32_t *) tc - 6;
+	memset(sp, 0, 6 * sizeof(*sp));
+	sp[4] = (uint32_t) &thread_entry;
+	tc->tc_esp = (uint32_t) sp;
+
 	threadq_push(&thread_queue, tc);
 
 	if (tid)
@@ -154,8 +427,7 @@ thread_clean(struct thread_context *tc)
 	int i;
 	for (i = 0; i < tc->tc_nonhalt; i++)
 		tc->tc_onhalt[i](tc->tc_tid);
-	free(tc->tc_stack_bottom);
-	free(tc);
+	stack_release(tc->tc_stack);
 }
 
 void
@@ -167,7 +439,7 @@ thread_halt()
 
 	threadq_push(&kill_queue, cur_tc);
 	cur_tc = NULL;
-	thread_yield();
+	thread_switch(false);
 	// WHAT IF THERE ARE NO MORE THREADS? HOW DO WE STOP?
 	// when yield has no thread to run, it will return here!
 	exit();
@@ -176,30 +448,19 @@ thread_halt()
 void
 thread_yield(void)
 {
-	struct thread_context *next_tc = threadq_pop(&thread_queue);
-
-	if (!next_tc)
-		return;
-
-	if (cur_tc)
-	{
-		if (jos_setjmp(&cur_tc->tc_jb) != 0)
-			return;
-		threadq_push(&thread_queue, cur_tc);
-	}
-
-	cur_tc = next_tc;
-	jos_longjmp(&cur_tc->tc_jb, 1);
+	thread_switch(true);
 }
 
 static void
 print_jb(struct thread_context *tc)
 {
-	cprintf("jump buffer for thread %s:\n", tc->tc_name);
-	cprintf("\teip: %x\n", tc->tc_jb.jb_eip);
-	cprintf("\tesp: %x\n", tc->tc_jb.jb_esp);
-	cprintf("\tebp: %x\n", tc->tc_jb.jb_ebp);
-	cprintf("\tebx: %x\n", tc->tc_jb.jb_ebx);
-	cprintf("\tesi: %x\n", tc->tc_jb.jb_esi);
-	cprintf("\tedi: %x\n", tc->tc_jb.jb_edi);
+	uint32_t *sp = (uint32_t *) tc->tc_esp;
+
+	cprintf("saved context for thread %s:\n", tc->tc_name);
+	cprintf("\teip: %x\n", sp[4]);
+	cprintf("\tesp: %x\n", tc->tc_esp + 5 * sizeof(*sp));
+	cprintf("\tebp: %x\n", sp[3]);
+	cprintf("\tebx: %x\n", sp[2]);
+	cprintf("\tesi: %x\n", sp[1]);
+	cprintf("\tedi: %x\n", sp[0]);
 }
@@ -5,14 +5,24 @@
 
 typedef uint32_t thread_id_t;
 
+// Stack sizes thread_create_stack takes: a stack is carved out of a
+// slot of the stack pool, below the thread's own bookkeeping, and
+// overflowing it faults on the unmapped rest of the slot.
+#define THREAD_STACK_DEFAULT    PGSIZE
+#define THREAD_STACK_MAX        (14 * PGSIZE)
+
 void thread_init(void);
 thread_id_t thread_id(void);
+void *thread_data(void);
+void thread_set_data(void *data);
 void thread_wakeup(volatile uint32_t *addr);
 void thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec);
 int thread_wakeups_pending(void);
 int thread_onhalt(void (*fun)(thread_id_t));
 int thread_create(thread_id_t *tid, const char *name,
 				  void (*entry)(uint32_t), uint32_t arg);
+int thread_create_stack(thread_id_t *tid, const char *name,
+						void (*entry)(uint32_t), uint32_t arg, size_t stacksize);
 void thread_yield(void);
 void thread_halt(void);
 
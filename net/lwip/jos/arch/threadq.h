@@ -2,15 +2,11 @@
 #define JOS_INC_THREADQ_H
 
 #include <arch/thread.h>
-#include <arch/setjmp.h>
 
 #define THREAD_NUM_ONHALT 4
 enum {
 	name_size = 32
 };
-enum {
-	stack_size = PGSIZE
-};
 
 struct thread_context;
 
@@ -21,13 +17,19 @@ struct thread_queue {
 
 struct thread_context {
 	thread_id_t tc_tid;
-	void *tc_stack_bottom;
+	int tc_stack;               // its slot in the stack pool
 	char tc_name[name_size];
 	void (*tc_entry)(uint32_t);
 	uint32_t tc_arg;
-	struct jos_jmp_buf tc_jb;
+	uint32_t tc_esp;            // saved by thread_ctx_switch
 	volatile uint32_t *tc_wait_addr;
 	volatile char tc_wakeup;
+	// Asleep in thread_wait: on the wait hash, if tc_wait_addr is set,
+	// and on the timer wheel until tc_deadline, if it has one
+	struct thread_context *tc_wait_next, **tc_wait_pprev;
+	struct thread_context *tc_timer_next, **tc_timer_pprev;
+	uint32_t tc_deadline;
+	void *tc_data;
 	void (*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
 	int tc_nonhalt;
 	struct thread_context *tc_queue_link;
@@ -41,25 +41,164 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include <lwip/stats.h>
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
+#include "lwip/inet_chksum.h"
 
 #include <netif/etharp.h>
 
-#define PKTMAP        0x10000000
+#define JIF_CHECKSUM_CHECK_ALL \
+	(NETIF_CHECKSUM_CHECK_IP | NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP)
 
 struct jif {
 	struct eth_addr *ethaddr;
-	envid_t envid;
+	struct Ring *ring;	// Packets for the output environment
+	u32_t pending;		// Ready slots not yet published to it
+
+	// TCP super-segment being built in a reserved but unpublished
+	// ring slot, or NULL; see jif_tso_join
+	struct jif_pkt *tso;
+	u32_t tso_seqno;	// Sequence number the next segment must have
+	u16_t tso_mss;		// Payload of each segment so far
+	u16_t tso_nsegs;
 };
 
+/*
+ * Output slots are filled and then published to the output environment
+ * in batches: once the ring fills up, or at jif_flush, which the
+ * network server calls before it sleeps.  The output environment then
+ * wakes once per batch and hands it all to the card in one system call.
+ */
+static void
+jif_publish(struct jif *jif)
+{
+	if (jif->pending == 0)
+		return;
+	ring_publish_n(jif->ring, jif->pending);
+	jif->pending = 0;
+}
+
+/*
+ * TCP segmentation offload: lwIP still cuts a bulk send into MSS-sized
+ * segments, but consecutive full-sized data segments of one connection
+ * are glued back together in a single output slot, and the card cuts
+ * them apart again (see NETBUF_TX_TSO).  The super-segment is held
+ * back until a segment arrives that cannot join it, or jif_flush.
+ */
+#define JIF_TSO_HDRLEN	(sizeof(struct eth_hdr) + IP_HLEN + TCP_HLEN)
+
+struct jif_tso_hdr {
+	struct eth_hdr eth;
+	struct ip_hdr ip;
+	struct tcp_hdr tcp;
+};
+
+/*
+ * If 'h' heads a plain TCP data segment of 'len' bytes, with no IP or
+ * TCP options and no flags but ACK and PSH, return its payload length;
+ * otherwise return 0.
+ */
+static u16_t
+jif_tso_payload(const struct jif_tso_hdr *h, int len)
+{
+	if (len <= JIF_TSO_HDRLEN || h->eth.type != htons(ETHTYPE_IP) ||
+		IPH_V(&h->ip) != 4 || IPH_HL(&h->ip) != 5 ||
+		IPH_PROTO(&h->ip) != IP_PROTO_TCP ||
+		ntohs(IPH_LEN(&h->ip)) + sizeof(struct eth_hdr) != len ||
+		(ntohs(IPH_OFFSET(&h->ip)) & (IP_MF | IP_OFFMASK)) != 0 ||
+		TCPH_HDRLEN(&h->tcp) != 5 || (TCPH_FLAGS(&h->tcp) & ~TCP_PSH) != TCP_ACK)
+		return 0;
+	return len - JIF_TSO_HDRLEN;
+}
+
+/*
+ * Hand the super-segment being built, if any, to the output environment.
+ * A lone segment goes as it is.  For more, the first one's headers are
+ * the template the card replicates: it fills in the IP length and
+ * checksum, and adds each segment's length to the TCP checksum field,
+ * which is left holding the rest of the pseudo-header sum.
+ */
+static void
+jif_tso_flush(struct jif *jif)
+{
+	struct jif_tso_hdr *t;
+	struct ip_addr src, dest;
+
+	if (jif->tso == NULL)
+		return;
+	if (jif->tso_nsegs > 1)
+	{
+		t = (struct jif_tso_hdr *) jif->tso->jp_data;
+		ip_addr_set(&src, &t->ip.src);
+		ip_addr_set(&dest, &t->ip.dest);
+		IPH_LEN_SET(&t->ip, 0);
+		IPH_CHKSUM_SET(&t->ip, 0);
+		t->tcp.chksum = ~inet_chksum_pseudo_partial(NULL, &src, &dest, IP_PROTO_TCP, 0, 0);
+		jif->tso->jp_flags = NETBUF_TX_L4CSUM | NETBUF_TX_TSO | NETBUF_TX_MSS(jif->tso_mss);
+	}
+	jif->tso = NULL;
+	jif->pending++;
+}
+
+/*
+ * Append the segment in p to the super-segment being built, if it is
+ * the next full-sized piece of the same connection, carries the same
+ * header fields, and fits.  Returns 1 if it was appended.
+ */
+static int
+jif_tso_join(struct jif *jif, struct pbuf *p)
+{
+	struct jif_tso_hdr h;
+	struct jif_tso_hdr *t = (struct jif_tso_hdr *) jif->tso->jp_data;
+	u16_t payload;
+
+	if (p->tot_len < JIF_TSO_HDRLEN ||
+		pbuf_copy_partial(p, &h, JIF_TSO_HDRLEN, 0) != JIF_TSO_HDRLEN)
+		return 0;
+	payload = jif_tso_payload(&h, p->tot_len);
+	if (payload == 0 || payload > jif->tso_mss ||
+		jif->tso->jp_len + payload > jif->ring->slotsize - sizeof(*jif->tso) ||
+		jif->tso->jp_len + payload > NET_TSO_MAXLEN ||
+		ntohl(h.tcp.seqno) != jif->tso_seqno ||
+		ntohs(IPH_ID(&h.ip)) != (u16_t) (ntohs(IPH_ID(&t->ip)) + jif->tso_nsegs))
+		return 0;
+	// The card copies everything but these from the first segment
+	if (memcmp(&h.eth, &t->eth, sizeof(h.eth)) != 0 ||
+		h.ip._v_hl_tos != t->ip._v_hl_tos || h.ip._offset != t->ip._offset ||
+		h.ip._ttl_proto != t->ip._ttl_proto ||
+		!ip_addr_cmp(&h.ip.src, &t->ip.src) || !ip_addr_cmp(&h.ip.dest, &t->ip.dest) ||
+		h.tcp.src != t->tcp.src || h.tcp.dest != t->tcp.dest ||
+		h.tcp.ackno != t->tcp.ackno || h.tcp.wnd != t->tcp.wnd ||
+		h.tcp.urgp != t->tcp.urgp)
+		return 0;
+
+	pbuf_copy_partial(p, jif->tso->jp_data + jif->tso->jp_len, payload, JIF_TSO_HDRLEN);
+	jif->tso->jp_len += payload;
+	// Only the card's last segment gets PSH, so ask for it if any had it
+	if (TCPH_FLAGS(&h.tcp) & TCP_PSH)
+		TCPH_SET_FLAG(&t->tcp, TCP_PSH);
+	jif->tso_seqno += payload;
+	jif->tso_nsegs++;
+	// A short segment ends the super-segment
+	if (payload < jif->tso_mss)
+		jif_tso_flush(jif);
+	return 1;
+}
+
 static void
 low_level_init(struct netif *netif)
 {
 	int r;
 
 	netif->hwaddr_len = 6;
-	netif->mtu = 1500;
+	netif->mtu = NET_MTU;
 	netif->flags = NETIF_FLAG_BROADCAST;
 
+	// The e1000 fills in TCP and UDP checksums and checks incoming
+	// ones; jif_input turns software checks back on for each packet
+	// the card could not vouch for.
+	NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_GEN_IP | JIF_CHECKSUM_CHECK_ALL);
+
 	// MAC address is hardcoded to eliminate a system call
 	netif->hwaddr[0] = 0x52;
 	netif->hwaddr[1] = 0x54;
@@ -80,14 +219,22 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-	int r = sys_page_alloc(0, (void *) PKTMAP, PTE_U | PTE_W | PTE_P);
-	if (r < 0)
-		panic("jif: could not allocate page of memory");
-	struct jif_pkt *pkt = (struct jif_pkt *) PKTMAP;
-
 	struct jif *jif;
 	jif = netif->state;
 
+	if (jif->tso != NULL && jif_tso_join(jif, p))
+		return ERR_OK;
+	jif_tso_flush(jif);
+
+	// Wait for the output environment to free a slot, letting it at
+	// what is ready first.
+	struct jif_pkt *pkt;
+	while ((pkt = ring_reserve_nth(jif->ring, jif->pending)) == NULL)
+	{
+		jif_publish(jif);
+		sys_yield();
+	}
+
 	char *txbuf = pkt->jp_data;
 	int txsize = 0;
 	struct pbuf *q;
@@ -97,20 +244,46 @@ low_level_output(struct netif *netif, struct pbuf *p)
 		   time. The size of the data in each pbuf is kept in the ->len
 		   variable. */
 
-		if (txsize + q->len > 2000)
+		if (txsize + q->len > jif->ring->slotsize - sizeof(*pkt))
 			panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
 		memcpy(&txbuf[txsize], q->payload, q->len);
 		txsize += q->len;
 	}
 
 	pkt->jp_len = txsize;
+	// lwIP left TCP and UDP checksums to the card (see low_level_init)
+	pkt->jp_flags = NETBUF_TX_L4CSUM;
 
-	ipc_send(jif->envid, NSREQ_OUTPUT, (void *) pkt, PTE_P | PTE_W | PTE_U);
-	sys_page_unmap(0, (void *) pkt);
+	// Hold a data segment back in case the next one can join it
+	if ((jif->tso_mss = jif_tso_payload((struct jif_tso_hdr *) pkt->jp_data, txsize)) != 0)
+	{
+		jif->tso = pkt;
+		jif->tso_seqno = ntohl(((struct jif_tso_hdr *) pkt->jp_data)->tcp.seqno) + jif->tso_mss;
+		jif->tso_nsegs = 1;
+		LINK_STATS_INC(link.xmit);
+		return ERR_OK;
+	}
+	jif->pending++;
+	LINK_STATS_INC(link.xmit);
 
 	return ERR_OK;
 }
 
+/*
+ * jif_flush():
+ *
+ * Send the TCP super-segment low_level_output is holding back, if any,
+ * and publish every packet queued since the last flush to the output
+ * environment.  Must be called before the network server sleeps.
+ *
+ */
+void
+jif_flush(struct netif *netif)
+{
+	jif_tso_flush(netif->state);
+	jif_publish(netif->state);
+}
+
 /*
  * low_level_input():
  *
@@ -119,18 +292,18 @@ low_level_output(struct netif *netif, struct pbuf *p)
  *
  */
 static struct pbuf *
-low_level_input(void *va)
+jif_copyin(const void *rxbuf, int len)
 {
-	struct jif_pkt *pkt = (struct jif_pkt *) va;
-	s16_t len = pkt->jp_len;
-
 	struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
 	if (p == 0)
+	{
+		LINK_STATS_INC(link.memerr);
+		LINK_STATS_INC(link.drop);
 		return 0;
+	}
 
 	/* We iterate over the pbuf chain until we have read the entire
 	 * packet into the pbuf. */
-	void *rxbuf = (void *) pkt->jp_data;
 	int copied = 0;
 	struct pbuf *q;
 	for (q = p; q != NULL; q = q->next)
@@ -141,10 +314,21 @@ low_level_input(void *va)
 		int bytes = q->len;
 		if (bytes > (len - copied))
 			bytes = len - copied;
-		memcpy(q->payload, rxbuf + copied, bytes);
+		memcpy(q->payload, (const char *) rxbuf + copied, bytes);
 		copied += bytes;
 	}
+	return p;
+}
+
+static struct pbuf *
+low_level_input(void *va)
+{
+	struct jif_pkt *pkt = (struct jif_pkt *) va;
+	struct pbuf *p;
 
+	if ((p = jif_copyin(pkt->jp_data, pkt->jp_len)) == NULL)
+		return NULL;
+	LINK_STATS_INC(link.recv);
 	return p;
 }
 
@@ -175,20 +359,12 @@ jif_output(struct netif *netif, struct pbuf *p,
  *
  */
 
-void
-jif_input(struct netif *netif, void *va)
+static void
+jif_deliver(struct netif *netif, uint32_t jp_flags, struct pbuf *p)
 {
-	struct jif *jif;
+	struct jif *jif = netif->state;
 	struct eth_hdr *ethhdr;
-	struct pbuf *p;
-
-	jif = netif->state;
-
-	/* move received packet into a new pbuf */
-	p = low_level_input(va);
 
-	/* no packet could be read, silently ignore this */
-	if (p == NULL) return;
 	/* points to packet payload, which starts with an Ethernet header */
 	ethhdr = p->payload;
 
@@ -199,6 +375,13 @@ jif_input(struct netif *netif, void *va)
 			etharp_ip_input(netif, p);
 			/* skip Ethernet header */
 			pbuf_header(p, -(int) sizeof(struct eth_hdr));
+			/* skip the checks the card has already made; netif->input
+			   runs to completion before the next packet */
+			netif->chksum_flags |= JIF_CHECKSUM_CHECK_ALL;
+			if (jp_flags & NETBUF_RX_IPCS_OK)
+				netif->chksum_flags &= ~NETIF_CHECKSUM_CHECK_IP;
+			if (jp_flags & NETBUF_RX_L4CS_OK)
+				netif->chksum_flags &= ~(NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP);
 			/* pass to network layer */
 			netif->input(p, netif);
 			break;
@@ -209,10 +392,211 @@ jif_input(struct netif *netif, void *va)
 			break;
 
 		default:
+			LINK_STATS_INC(link.proterr);
 			pbuf_free(p);
 	}
 }
 
+void
+jif_input(struct netif *netif, void *va)
+{
+	struct pbuf *p;
+
+	/* move received packet into a new pbuf */
+	p = low_level_input(va);
+
+	/* no packet could be read, silently ignore this */
+	if (p == NULL) return;
+	jif_deliver(netif, ((struct jif_pkt *) va)->jp_flags, p);
+}
+
+/*
+ * jif_input_page():
+ *
+ * As jif_input, for a packet received in 'npages' pages of its own at
+ * 'va', but without the copy: lwIP gets a PBUF_REF pbuf of the pages,
+ * which calls release(va, npages) once lwIP frees it.  If there is no
+ * memory for the pbuf, copies as jif_input does and releases the pages
+ * at once.
+ *
+ */
+
+struct jif_rxpage {
+	struct pbuf_custom pc;
+	void *va;
+	uint32_t npages;
+	void (*release)(void *va, uint32_t npages);
+};
+
+static void
+jif_rxpage_free(struct pbuf *p)
+{
+	struct jif_rxpage *rp = (struct jif_rxpage *) p;
+
+	rp->release(rp->va, rp->npages);
+	mem_free(rp);
+}
+
+void
+jif_input_page(struct netif *netif, void *va, uint32_t npages,
+			   void (*release)(void *va, uint32_t npages))
+{
+	struct jif_pkt *pkt = va;
+	struct jif_rxpage *rp;
+	struct pbuf *p = NULL;
+	size_t room = npages * PGSIZE - offsetof(struct jif_pkt, jp_data);
+
+	if (pkt->jp_len > 0 && (rp = mem_malloc(sizeof(*rp))) != NULL)
+	{
+		rp->pc.custom_free_function = jif_rxpage_free;
+		rp->va = va;
+		rp->npages = npages;
+		rp->release = release;
+		p = pbuf_alloced_custom(PBUF_RAW, pkt->jp_len, PBUF_REF, &rp->pc,
+								pkt->jp_data, MIN(room, 0xffff));
+		if (p == NULL)
+			mem_free(rp);
+	}
+	if (p == NULL)
+	{
+		jif_input(netif, va);
+		release(va, npages);
+		return;
+	}
+	LINK_STATS_INC(link.recv);
+	jif_deliver(netif, pkt->jp_flags, p);
+}
+
+/*
+ * Receive offload, the other way round from TSO: consecutive in-order
+ * data segments of one connection within a batch from jif_input_ring
+ * are glued into one pbuf chain before lwIP sees them, so that TCP
+ * processes, and ACKs, the run as one segment.  Only segments whose
+ * checksums the card has verified can join, since the TCP checksum of
+ * the result is not redone.
+ */
+#define JIF_GRO_CSUM_OK	(NETBUF_RX_IPCS_OK | NETBUF_RX_L4CS_OK)
+
+struct jif_gro {
+	struct pbuf *p;		// Super-segment being built, or NULL
+	struct jif_tso_hdr h;	// Its first segment's headers
+	u32_t seqno;		// Sequence number the next segment must have
+	u16_t mss;		// Payload of its first segment
+};
+
+/*
+ * Give lwIP the super-segment being built, if any, with the IP length
+ * and checksum fixed up for its full size.
+ */
+static void
+jif_gro_flush(struct netif *netif, struct jif_gro *g)
+{
+	struct ip_hdr *ip;
+
+	if (g->p == NULL)
+		return;
+	ip = (struct ip_hdr *) ((char *) g->p->payload + sizeof(struct eth_hdr));
+	IPH_LEN_SET(ip, htons(g->p->tot_len - sizeof(struct eth_hdr)));
+	IPH_CHKSUM_SET(ip, 0);
+	IPH_CHKSUM_SET(ip, inet_chksum(ip, IP_HLEN));
+	jif_deliver(netif, JIF_GRO_CSUM_OK, g->p);
+	g->p = NULL;
+}
+
+/*
+ * Append pkt's payload to the super-segment being built, if it is the
+ * next piece of the same connection with the same ACK and window, no
+ * longer than the first, and fits.  Returns 1 if it was appended.
+ */
+static int
+jif_gro_join(struct netif *netif, struct jif_gro *g, struct jif_pkt *pkt)
+{
+	const struct jif_tso_hdr *h = (const struct jif_tso_hdr *) pkt->jp_data;
+	struct tcp_hdr *t;
+	struct pbuf *q;
+	u16_t payload;
+
+	if ((pkt->jp_flags & JIF_GRO_CSUM_OK) != JIF_GRO_CSUM_OK ||
+		(payload = jif_tso_payload(h, pkt->jp_len)) == 0 ||
+		payload > g->mss || g->p->tot_len + payload > 0xffff ||
+		ntohl(h->tcp.seqno) != g->seqno ||
+		!ip_addr_cmp(&h->ip.src, &g->h.ip.src) || !ip_addr_cmp(&h->ip.dest, &g->h.ip.dest) ||
+		h->tcp.src != g->h.tcp.src || h->tcp.dest != g->h.tcp.dest ||
+		h->tcp.ackno != g->h.tcp.ackno || h->tcp.wnd != g->h.tcp.wnd)
+		return 0;
+	if ((q = jif_copyin(pkt->jp_data + JIF_TSO_HDRLEN, payload)) == NULL)
+	{
+		// Dropped, as jif_input would; the sender will resend it
+		return 1;
+	}
+	LINK_STATS_INC(link.recv);
+	pbuf_cat(g->p, q);
+	g->seqno += payload;
+	// A pushed or short segment ends the super-segment
+	if (TCPH_FLAGS(&h->tcp) & TCP_PSH)
+	{
+		t = (struct tcp_hdr *) ((char *) g->p->payload + sizeof(struct eth_hdr) + IP_HLEN);
+		TCPH_SET_FLAG(t, TCP_PSH);
+		jif_gro_flush(netif, g);
+	} else if (payload < g->mss)
+		jif_gro_flush(netif, g);
+	return 1;
+}
+
+/*
+ * Start a super-segment with pkt, if it is an unpushed data segment
+ * with verified checksums.  Returns 1 if it was taken.
+ */
+static int
+jif_gro_start(struct jif_gro *g, struct jif_pkt *pkt)
+{
+	const struct jif_tso_hdr *h = (const struct jif_tso_hdr *) pkt->jp_data;
+
+	if ((pkt->jp_flags & JIF_GRO_CSUM_OK) != JIF_GRO_CSUM_OK ||
+		(g->mss = jif_tso_payload(h, pkt->jp_len)) == 0 ||
+		(TCPH_FLAGS(&h->tcp) & TCP_PSH))
+		return 0;
+	g->p = low_level_input(pkt);
+	memcpy(&g->h, h, sizeof(g->h));
+	g->seqno = ntohl(h->tcp.seqno) + g->mss;
+	return 1;
+}
+
+/*
+ * jif_input_ring():
+ *
+ * Feed lwIP every packet published on 'ring', in batches of up to
+ * NET_MAXBATCH, releasing each batch's slots to the producer at once.
+ * Runs of in-order TCP data within a batch are coalesced (see
+ * jif_gro_join).  Returns the number of packets fed.
+ *
+ */
+
+int
+jif_input_ring(struct netif *netif, struct Ring *ring)
+{
+	struct jif_gro gro;
+	struct jif_pkt *pkt;
+	int n, total = 0;
+
+	gro.p = NULL;
+	do
+	{
+		for (n = 0; n < NET_MAXBATCH && (pkt = ring_peek_nth(ring, n)) != NULL; n++)
+		{
+			if (gro.p != NULL && jif_gro_join(netif, &gro, pkt))
+				continue;
+			jif_gro_flush(netif, &gro);
+			if (!jif_gro_start(&gro, pkt))
+				jif_input(netif, pkt);
+		}
+		jif_gro_flush(netif, &gro);
+		ring_release_n(ring, n);
+		total += n;
+	} while (n == NET_MAXBATCH);
+	return total;
+}
+
 /*
  * jif_init():
  *
@@ -226,7 +610,7 @@ err_t
 jif_init(struct netif *netif)
 {
 	struct jif *jif;
-	envid_t *output_envid;
+	struct Ring *ring;
 
 	jif = mem_malloc(sizeof(struct jif));
 
@@ -236,7 +620,7 @@ jif_init(struct netif *netif)
 		return ERR_MEM;
 	}
 
-	output_envid = (envid_t *) netif->state;
+	ring = (struct Ring *) netif->state;
 
 	netif->state = jif;
 	netif->output = jif_output;
@@ -244,7 +628,9 @@ jif_init(struct netif *netif)
 	memcpy(&netif->name[0], "en", 2);
 
 	jif->ethaddr = (struct eth_addr *) &(netif->hwaddr[0]);
-	jif->envid = *output_envid;
+	jif->ring = ring;
+	jif->pending = 0;
+	jif->tso = NULL;
 
 	low_level_init(netif);
 
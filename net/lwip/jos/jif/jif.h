@@ -1,4 +1,9 @@
 #include <lwip/netif.h>
+#include <inc/ring.h>
 
 void jif_input(struct netif *netif, void *va);
+void jif_input_page(struct netif *netif, void *va, uint32_t npages,
+					void (*release)(void *va, uint32_t npages));
+int jif_input_ring(struct netif *netif, struct Ring *ring);
+void jif_flush(struct netif *netif);
 err_t jif_init(struct netif *netif);
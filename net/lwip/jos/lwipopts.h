@@ -6,14 +6,23 @@
 // here to make it lwip visible. I am hiding lwip because JOS seems to want to
 // do so. There is a declaration of memcpy in JOS but not a definition.
 #include <inc/types.h>
+#include <inc/syscall.h>
+#include <inc/malloc.h>
 
 void *memcpy(void *dst, const void *src, size_t n);
 
 //#define NO_SYS 1
 
-#define LWIP_STATS        0
+#define LWIP_STATS        1
+#define LWIP_STATS_LARGE  1
 #define LWIP_STATS_DISPLAY    0
 #define LWIP_DHCP        1
+// The resolver behind NSREQ_GETHOSTBYNAME, asking QEMU user-net's DNS
+// proxy; answers stay cached for their TTL, up to a day
+#define LWIP_DNS        1
+#define DNS_TABLE_SIZE    64
+#define DNS_SERVER_ADDRESS    inet_addr("10.0.2.3")
+#define DNS_MAX_TTL        86400
 #define LWIP_COMPAT_SOCKETS    0
 //#define SYS_LIGHTWEIGHT_PROT	1
 #define LWIP_PROVIDE_ERRNO      1
@@ -32,19 +41,44 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define MEMP_NUM_NETCONN    32
 #define MEMP_NUM_SYS_TIMEOUT    6
 
-#define PER_TCP_PCB_BUFFER    (16 * 4096)
-#define MEM_SIZE        (PER_TCP_PCB_BUFFER*MEMP_NUM_TCP_SEG + 4096*MEMP_NUM_TCP_SEG)
+// Room for many hosts on one segment; each pending one queues a few
+// packets of its own rather than sharing one pool first come first served
+#define ARP_TABLE_SIZE        256
+#define ARP_HASH_BITS        8
+#define ARP_QUEUE_LEN        4
+#define MEMP_NUM_ARP_QUEUE    64
+
+// mem_malloc is libjos's malloc, not a fixed heap of lwIP's own.
+// pbuf_realloc, mem_realloc's only caller, shrinks a pbuf in place and
+// keeps using it, so mem_realloc must not move it: leave it as it is.
+#define MEM_LIBC_MALLOC        1
+#define mem_realloc(mem, size)    (mem)
 
 #define PBUF_POOL_SIZE        512
 #define PBUF_POOL_BUFSIZE    2000
+// jif_input_page hands lwIP a received page itself, in a custom pbuf
+// that gives the page back when freed, rather than a copy in the pool
+#define LWIP_SUPPORT_CUSTOM_PBUF    1
 
-#define TCP_MSS            1460
-#define TCP_WND            24000
-#define TCP_SND_BUF        (16 * TCP_MSS)
+#define TCP_MSS            (NET_MTU - 40)
+// Window scaling lets the receive window cover a gigabit link's
+// bandwidth-delay product (128KB is 1ms); the pbuf pool has room for it
+#define LWIP_WND_SCALE        1
+#define TCP_RCV_SCALE        2
+#define TCP_WND            (128 * 1024)
+// snd_buf and acked are u16_ts even with window scaling, so this can't
+// go past 64KB
+#define TCP_SND_BUF        (44 * 1460)
 // lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS), 
 // but 16 is faster.. 
 #define TCP_SND_QUEUELEN    (2 * TCP_SND_BUF/TCP_MSS)
 //#define TCP_SND_QUEUELEN	16
+// Bulk transfers are nearly all in-order data and pure ACKs
+#define TCP_HEADER_PREDICTION    1
+// jif coalesces received runs of full segments, so ACK every fourth
+// segment or run; delayed ACKs go out on a 20ms fast timer, not 250ms
+#define TCP_ACK_SEGS        4
+#define TCP_FAST_INTERVAL    20
 
 // Print error messages when we run out of memory
 #define LWIP_DEBUG    1
@@ -59,6 +93,18 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define LWIP_DBG_MIN_LEVEL    0
 #define MEMP_SANITY_CHECK    0
 
+// Let jif hand TCP/UDP checksums to the e1000 (see jif_init)
+#define LWIP_CHECKSUM_CTRL_PER_NETIF	1
+
+// Packets to our own address go back up the stack through netif_poll
+// rather than out of the card (for user/bench's TCP loopback)
+#define LWIP_NETIF_LOOPBACK	1
+
+// A network server shard (see inc/ns.h) picks ephemeral ports only
+// among the ports it owns, so that replies come back to it
+extern unsigned lwip_shard, lwip_nshards;
+#define LWIP_PORT_OWNED(port)	((port) % lwip_nshards == lwip_shard)
+
 #define ERRNO
 
 #endif
@@ -0,0 +1,7 @@
+#ifndef JOS_LWIP_STDDEF_H
+#define JOS_LWIP_STDDEF_H
+
+// lwip/mem.h wants size_t from here when MEM_LIBC_MALLOC is on
+#include <inc/types.h>
+
+#endif
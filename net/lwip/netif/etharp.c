@@ -96,11 +96,18 @@ struct etharp_entry {
 	 * Pointer to queue of pending outgoing packets on this ARP entry.
 	 */
 	struct etharp_q_entry *q;
+	/** Number of packets on q */
+	u8_t qlen;
 #endif
 	struct ip_addr ipaddr;
 	struct eth_addr ethaddr;
 	enum etharp_state state;
 	u8_t ctime;
+	/**
+	 * Index + 1 of the next entry on this one's hash chain or, if this one
+	 * is EMPTY, on the free list; 0 ends either.
+	 */
+	u16_t next;
 	struct netif *netif;
 };
 
@@ -108,8 +115,20 @@ const struct eth_addr ethbroadcast = {{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
 const struct eth_addr ethzero = {{0, 0, 0, 0, 0, 0}};
 static struct etharp_entry arp_table[ARP_TABLE_SIZE];
 #if !LWIP_NETIF_HWADDRHINT
-static u8_t etharp_cached_entry;
+static u16_t etharp_cached_entry;
 #endif
+/**
+ * Index + 1 of the first entry on each hash chain, 0 if there is none.
+ * Every entry that is not EMPTY is on the chain for its IP address.
+ */
+static u16_t arp_hash[1 << ARP_HASH_BITS];
+/** Index + 1 of the first EMPTY entry that etharp_tmr has freed */
+static u16_t arp_free;
+/** Entries from this one up have never been used */
+static u16_t arp_unused;
+
+#define ETHARP_HASH(ipaddr) \
+	((u16_t)(((ipaddr)->addr * 0x9e3779b1UL) >> (32 - ARP_HASH_BITS)))
 
 /**
  * Try hard to create a new entry - we want the IP address to appear in
@@ -120,17 +139,17 @@ static u8_t etharp_cached_entry;
 #if LWIP_NETIF_HWADDRHINT
 #define NETIF_SET_HINT(netif, hint)  if (((netif) != NULL) && ((netif)->addr_hint != NULL))  \
 									  *((netif)->addr_hint) = (hint);
-static s8_t find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif);
+static s16_t find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif);
 #else /* LWIP_NETIF_HWADDRHINT */
-static s8_t find_entry(struct ip_addr *ipaddr, u8_t flags);
+static s16_t find_entry(struct ip_addr *ipaddr, u8_t flags);
 #endif /* LWIP_NETIF_HWADDRHINT */
 
 static err_t update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *ethaddr, u8_t flags);
 
 
 /* Some checks, instead of etharp_init(): */
-#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7f))
-#error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s8_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_ARP && (ARP_TABLE_SIZE > 0x7fff))
+#error "If you want to use ARP, ARP_TABLE_SIZE must fit in an s16_t, so, you have to reduce it in your lwipopts.h"
 #endif
 
 
@@ -159,6 +178,39 @@ free_etharp_q(struct etharp_q_entry *q)
 
 #endif
 
+/**
+ * Put an entry on the hash chain for its IP address.
+ *
+ * @param i index of the entry
+ */
+static void
+arp_hash_insert(u16_t i)
+{
+	u16_t *head = &arp_hash[ETHARP_HASH(&arp_table[i].ipaddr)];
+
+	arp_table[i].next = *head;
+	*head = i + 1;
+}
+
+/**
+ * Take an entry off the hash chain for its IP address.
+ *
+ * @param i index of the entry
+ */
+static void
+arp_hash_remove(u16_t i)
+{
+	u16_t *link = &arp_hash[ETHARP_HASH(&arp_table[i].ipaddr)];
+
+	while (*link != i + 1)
+	{
+		LWIP_ASSERT("ARP entry on its hash chain", *link != 0);
+		link = &arp_table[*link - 1].next;
+	}
+	*link = arp_table[i].next;
+	arp_table[i].next = 0;
+}
+
 /**
  * Clears expired entries in the ARP table.
  *
@@ -168,11 +220,11 @@ free_etharp_q(struct etharp_q_entry *q)
 void
 etharp_tmr(void)
 {
-	u8_t i;
+	u16_t i;
 
 	LWIP_DEBUGF(ETHARP_DEBUG, ("etharp_timer\n"));
 	/* remove expired entries from the ARP table */
-	for (i = 0; i < ARP_TABLE_SIZE; ++i)
+	for (i = 0; i < arp_unused; ++i)
 	{
 		arp_table[i].ctime++;
 		if (((arp_table[i].state == ETHARP_STATE_STABLE) &&
@@ -195,10 +247,14 @@ etharp_tmr(void)
 							("etharp_timer: freeing entry %"U16_F", packet queue %p.\n", (u16_t) i, (void *) (arp_table[i].q)));
 				free_etharp_q(arp_table[i].q);
 				arp_table[i].q = NULL;
+				arp_table[i].qlen = 0;
 			}
 #endif
 			/* recycle entry for re-use */
+			arp_hash_remove(i);
 			arp_table[i].state = ETHARP_STATE_EMPTY;
+			arp_table[i].next = arp_free;
+			arp_free = i + 1;
 		}
 #if ARP_QUEUEING
 		/* still pending entry? (not expired) */
@@ -213,16 +269,15 @@ etharp_tmr(void)
 /**
  * Search the ARP table for a matching or new entry.
  * 
- * If an IP address is given, return a pending or stable ARP entry that matches
- * the address. If no match is found, create a new entry with this address set,
- * but in state ETHARP_EMPTY. The caller must check and possibly change the
- * state of the returned entry.
- * 
- * If ipaddr is NULL, return a initialized new entry in state ETHARP_EMPTY.
+ * Return a pending or stable ARP entry that matches the IP address,
+ * found along the address's hash chain. If no match is found, create a
+ * new entry with this address set, but in state ETHARP_EMPTY. The caller
+ * must change the state of a new entry to pending or stable: it is
+ * already on the hash chain.
  * 
- * In all cases, attempt to create new entries from an empty entry. If no
- * empty entries are available and ETHARP_TRY_HARD flag is set, recycle
- * old entries. Heuristic choose the least important entry for recycling.
+ * New entries come from an empty entry. If no empty entries are
+ * available and ETHARP_TRY_HARD flag is set, recycle old entries.
+ * Heuristic choose the least important entry for recycling.
  *
  * @param ipaddr IP address to find in ARP cache, or to add if not found.
  * @param flags
@@ -232,220 +287,179 @@ etharp_tmr(void)
  * @return The ARP entry index that matched or is created, ERR_MEM if no
  * entry is found or could be recycled.
  */
-static s8_t
+static s16_t
 #if LWIP_NETIF_HWADDRHINT
 find_entry(struct ip_addr *ipaddr, u8_t flags, struct netif *netif)
 #else /* LWIP_NETIF_HWADDRHINT */
 find_entry(struct ip_addr *ipaddr, u8_t flags)
 #endif /* LWIP_NETIF_HWADDRHINT */
 {
-	s8_t old_pending = ARP_TABLE_SIZE, old_stable = ARP_TABLE_SIZE;
-	s8_t empty = ARP_TABLE_SIZE;
-	u8_t i = 0, age_pending = 0, age_stable = 0;
+	s16_t old_pending = -1, old_stable = -1;
+	u16_t i;
+	u8_t age_pending = 0, age_stable = 0;
 #if ARP_QUEUEING
 	/* oldest entry with packets on queue */
-	s8_t old_queue = ARP_TABLE_SIZE;
+	s16_t old_queue = -1;
 	/* its age */
 	u8_t age_queue = 0;
 #endif
 
+	LWIP_ASSERT("find_entry: ipaddr != NULL", ipaddr != NULL);
+
 	/* First, test if the last call to this function asked for the
 	 * same address. If so, we're really fast! */
-	if (ipaddr)
-	{
-		/* ipaddr to search for was given */
 #if LWIP_NETIF_HWADDRHINT
-		if ((netif != NULL) && (netif->addr_hint != NULL)) {
-		  /* per-pcb cached entry was given */
-		  u8_t per_pcb_cache = *(netif->addr_hint);
-		  if ((per_pcb_cache < ARP_TABLE_SIZE) && arp_table[per_pcb_cache].state == ETHARP_STATE_STABLE) {
-			/* the per-pcb-cached entry is stable */
-			if (ip_addr_cmp(ipaddr, &arp_table[per_pcb_cache].ipaddr)) {
-			  /* per-pcb cached entry was the right one! */
-			  ETHARP_STATS_INC(etharp.cachehit);
-			  return per_pcb_cache;
-			}
-		  }
+	if ((netif != NULL) && (netif->addr_hint != NULL)) {
+	  /* per-pcb cached entry was given */
+	  u8_t per_pcb_cache = *(netif->addr_hint);
+	  if ((per_pcb_cache < ARP_TABLE_SIZE) && arp_table[per_pcb_cache].state == ETHARP_STATE_STABLE) {
+		/* the per-pcb-cached entry is stable */
+		if (ip_addr_cmp(ipaddr, &arp_table[per_pcb_cache].ipaddr)) {
+		  /* per-pcb cached entry was the right one! */
+		  ETHARP_STATS_INC(etharp.cachehit);
+		  return per_pcb_cache;
 		}
+	  }
+	}
 #else /* #if LWIP_NETIF_HWADDRHINT */
-		if (arp_table[etharp_cached_entry].state == ETHARP_STATE_STABLE)
+	if (arp_table[etharp_cached_entry].state == ETHARP_STATE_STABLE)
+	{
+		/* the cached entry is stable */
+		if (ip_addr_cmp(ipaddr, &arp_table[etharp_cached_entry].ipaddr))
 		{
-			/* the cached entry is stable */
-			if (ip_addr_cmp(ipaddr, &arp_table[etharp_cached_entry].ipaddr))
-			{
-				/* cached entry was the right one! */
-				ETHARP_STATS_INC(etharp.cachehit);
-				return etharp_cached_entry;
-			}
+			/* cached entry was the right one! */
+			ETHARP_STATS_INC(etharp.cachehit);
+			return etharp_cached_entry;
 		}
-#endif /* #if LWIP_NETIF_HWADDRHINT */
 	}
+#endif /* #if LWIP_NETIF_HWADDRHINT */
 
-	/**
-	 * a) do a search through the cache, remember candidates
-	 * b) select candidate entry
-	 * c) create new entry
-	 */
-
-	/* a) in a single search sweep, do all of this
-	 * 1) remember the first empty entry (if any)
-	 * 2) remember the oldest stable entry (if any)
-	 * 3) remember the oldest pending entry without queued packets (if any)
-	 * 4) remember the oldest pending entry with queued packets (if any)
-	 * 5) search for a matching IP entry, either pending or stable
-	 *    until 5 matches, or all entries are searched for.
-	 */
-
-	for (i = 0; i < ARP_TABLE_SIZE; ++i)
+	/* a) look for a pending or stable entry along the address's chain */
+	for (i = arp_hash[ETHARP_HASH(ipaddr)]; i != 0; i = arp_table[i - 1].next)
 	{
-		/* no empty entry found yet and now we do find one? */
-		if ((empty == ARP_TABLE_SIZE) && (arp_table[i].state == ETHARP_STATE_EMPTY))
+		LWIP_ASSERT("hashed ARP entry is not EMPTY",
+					arp_table[i - 1].state != ETHARP_STATE_EMPTY);
+		if (ip_addr_cmp(ipaddr, &arp_table[i - 1].ipaddr))
 		{
-			LWIP_DEBUGF(ETHARP_DEBUG, ("find_entry: found empty entry %"U16_F"\n", (u16_t) i));
-			/* remember first empty entry */
-			empty = i;
-		}
-			/* pending entry? */
-		else if (arp_table[i].state == ETHARP_STATE_PENDING)
-		{
-			/* if given, does IP address match IP address in ARP entry? */
-			if (ipaddr && ip_addr_cmp(ipaddr, &arp_table[i].ipaddr))
-			{
-				LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
-							("find_entry: found matching pending entry %"U16_F"\n", (u16_t) i));
-				/* found exact IP address match, simply bail out */
+			LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
+						("find_entry: found matching %s entry %"U16_F"\n",
+						 arp_table[i - 1].state == ETHARP_STATE_STABLE ? "stable" : "pending",
+						 (u16_t) (i - 1)));
+			/* found exact IP address match, simply bail out */
 #if LWIP_NETIF_HWADDRHINT
-				NETIF_SET_HINT(netif, i);
+			NETIF_SET_HINT(netif, i - 1);
 #else /* #if LWIP_NETIF_HWADDRHINT */
-				etharp_cached_entry = i;
+			etharp_cached_entry = i - 1;
 #endif /* #if LWIP_NETIF_HWADDRHINT */
-				return i;
-#if ARP_QUEUEING
-				/* pending with queued packets? */
-			} else if (arp_table[i].q != NULL)
+			return i - 1;
+		}
+	}
+	/* { we have no match } => try to create a new entry */
+
+	/* don't create new entry, only search? */
+	if ((flags & ETHARP_FIND_ONLY) != 0)
+	{
+		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: no matching entry found\n"));
+		return (s16_t) ERR_MEM;
+	}
+
+	/* b) take an empty entry: one etharp_tmr freed, or one never used */
+	if (arp_free != 0)
+	{
+		i = arp_free - 1;
+		arp_free = arp_table[i].next;
+		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting empty entry %"U16_F"\n", (u16_t) i));
+	} else if (arp_unused < ARP_TABLE_SIZE)
+	{
+		i = arp_unused++;
+		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting unused entry %"U16_F"\n", (u16_t) i));
+	} else if ((flags & ETHARP_TRY_HARD) == 0)
+	{
+		/* no empty entry found and not allowed to recycle */
+		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: no empty entry found and not allowed to recycle\n"));
+		return (s16_t) ERR_MEM;
+	} else
+	{
+		/* c) the table is full: in a single sweep, remember
+		 * 1) the oldest stable entry
+		 * 2) the oldest pending entry without queued packets
+		 * 3) the oldest pending entry with queued packets
+		 * and recycle the least destructive, in that order.
+		 */
+		for (i = 0; i < ARP_TABLE_SIZE; ++i)
+		{
+			if (arp_table[i].state == ETHARP_STATE_PENDING)
 			{
-				if (arp_table[i].ctime >= age_queue)
+#if ARP_QUEUEING
+				if (arp_table[i].q != NULL)
 				{
-					old_queue = i;
-					age_queue = arp_table[i].ctime;
-				}
+					if (arp_table[i].ctime >= age_queue)
+					{
+						old_queue = i;
+						age_queue = arp_table[i].ctime;
+					}
+				} else
 #endif
-				/* pending without queued packets? */
-			} else
-			{
 				if (arp_table[i].ctime >= age_pending)
 				{
 					old_pending = i;
 					age_pending = arp_table[i].ctime;
 				}
-			}
-		}
-			/* stable entry? */
-		else if (arp_table[i].state == ETHARP_STATE_STABLE)
-		{
-			/* if given, does IP address match IP address in ARP entry? */
-			if (ipaddr && ip_addr_cmp(ipaddr, &arp_table[i].ipaddr))
-			{
-				LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
-							("find_entry: found matching stable entry %"U16_F"\n", (u16_t) i));
-				/* found exact IP address match, simply bail out */
-#if LWIP_NETIF_HWADDRHINT
-				NETIF_SET_HINT(netif, i);
-#else /* #if LWIP_NETIF_HWADDRHINT */
-				etharp_cached_entry = i;
-#endif /* #if LWIP_NETIF_HWADDRHINT */
-				return i;
-				/* remember entry with oldest stable entry in oldest, its age in maxtime */
 			} else if (arp_table[i].ctime >= age_stable)
 			{
 				old_stable = i;
 				age_stable = arp_table[i].ctime;
 			}
 		}
-	}
-	/* { we have no match } => try to create a new entry */
-
-	/* no empty entry found and not allowed to recycle? */
-	if (((empty == ARP_TABLE_SIZE) && ((flags & ETHARP_TRY_HARD) == 0))
-		/* or don't create new entry, only search? */
-		|| ((flags & ETHARP_FIND_ONLY) != 0))
-	{
-		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: no empty entry found and not allowed to recycle\n"));
-		return (s8_t) ERR_MEM;
-	}
-
-	/* b) choose the least destructive entry to recycle:
-	 * 1) empty entry
-	 * 2) oldest stable entry
-	 * 3) oldest pending entry without queued packets
-	 * 4) oldest pending entry with queued packets
-	 *
-	 * { ETHARP_TRY_HARD is set at this point }
-	 */
 
-	/* 1) empty entry available? */
-	if (empty < ARP_TABLE_SIZE)
-	{
-		i = empty;
-		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting empty entry %"U16_F"\n", (u16_t) i));
-	}
-		/* 2) found recyclable stable entry? */
-	else if (old_stable < ARP_TABLE_SIZE)
-	{
-		/* recycle oldest stable*/
-		i = old_stable;
-		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest stable entry %"U16_F"\n", (u16_t) i));
+		if (old_stable >= 0)
+		{
+			/* recycle oldest stable*/
+			i = old_stable;
+			LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE, ("find_entry: selecting oldest stable entry %"U16_F"\n", (u16_t) i));
 #if ARP_QUEUEING
-		/* no queued packets should exist on stable entries */
-		LWIP_ASSERT("arp_table[i].q == NULL", arp_table[i].q == NULL);
+			/* no queued packets should exist on stable entries */
+			LWIP_ASSERT("arp_table[i].q == NULL", arp_table[i].q == NULL);
 #endif
-		/* 3) found recyclable pending entry without queued packets? */
-	} else if (old_pending < ARP_TABLE_SIZE)
-	{
-		/* recycle oldest pending */
-		i = old_pending;
-		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
-					("find_entry: selecting oldest pending entry %"U16_F" (without queue)\n", (u16_t) i));
+		} else if (old_pending >= 0)
+		{
+			/* recycle oldest pending */
+			i = old_pending;
+			LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
+						("find_entry: selecting oldest pending entry %"U16_F" (without queue)\n", (u16_t) i));
 #if ARP_QUEUEING
-		/* 4) found recyclable pending entry with queued packets? */
-	} else if (old_queue < ARP_TABLE_SIZE)
-	{
-		/* recycle oldest pending */
-		i = old_queue;
-		LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
-					("find_entry: selecting oldest pending entry %"U16_F", freeing packet queue %p\n", (u16_t) i, (void *) (arp_table[i].q)));
-		free_etharp_q(arp_table[i].q);
-		arp_table[i].q = NULL;
+		} else if (old_queue >= 0)
+		{
+			/* recycle oldest pending */
+			i = old_queue;
+			LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
+						("find_entry: selecting oldest pending entry %"U16_F", freeing packet queue %p\n", (u16_t) i, (void *) (arp_table[i].q)));
+			free_etharp_q(arp_table[i].q);
+			arp_table[i].q = NULL;
+			arp_table[i].qlen = 0;
 #endif
-		/* no empty or recyclable entries found */
-	} else
-	{
-		return (s8_t) ERR_MEM;
+		} else
+		{
+			return (s16_t) ERR_MEM;
+		}
+		snmp_delete_arpidx_tree(arp_table[i].netif, &arp_table[i].ipaddr);
+		arp_hash_remove(i);
 	}
 
 	/* { empty or recyclable entry found } */
 	LWIP_ASSERT("i < ARP_TABLE_SIZE", i < ARP_TABLE_SIZE);
 
-	if (arp_table[i].state != ETHARP_STATE_EMPTY)
-	{
-		snmp_delete_arpidx_tree(arp_table[i].netif, &arp_table[i].ipaddr);
-	}
 	/* recycle entry (no-op for an already empty entry) */
 	arp_table[i].state = ETHARP_STATE_EMPTY;
-
-	/* IP address given? */
-	if (ipaddr != NULL)
-	{
-		/* set IP address */
-		ip_addr_set(&arp_table[i].ipaddr, ipaddr);
-	}
+	ip_addr_set(&arp_table[i].ipaddr, ipaddr);
+	arp_hash_insert(i);
 	arp_table[i].ctime = 0;
 #if LWIP_NETIF_HWADDRHINT
 	NETIF_SET_HINT(netif, i);
 #else /* #if LWIP_NETIF_HWADDRHINT */
 	etharp_cached_entry = i;
 #endif /* #if LWIP_NETIF_HWADDRHINT */
-	return (err_t) i;
+	return (s16_t) i;
 }
 
 /**
@@ -501,7 +515,7 @@ etharp_send_ip(struct netif *netif, struct pbuf *p, struct eth_addr *src, struct
 static err_t
 update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *ethaddr, u8_t flags)
 {
-	s8_t i;
+	s16_t i;
 	u8_t k;
 	LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE | 3, ("update_arp_entry()\n"));
 	LWIP_ASSERT("netif->hwaddr_len == ETHARP_HWADDR_LEN", netif->hwaddr_len == ETHARP_HWADDR_LEN);
@@ -565,6 +579,7 @@ update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *e
 		/* free the queued IP packet */
 		pbuf_free(p);
 	}
+	arp_table[i].qlen = 0;
 #endif
 	return ERR_OK;
 }
@@ -580,11 +595,11 @@ update_arp_entry(struct netif *netif, struct ip_addr *ipaddr, struct eth_addr *e
  * @param ip_ret points to return pointer
  * @return table index if found, -1 otherwise
  */
-s8_t
+s16_t
 etharp_find_addr(struct netif *netif, struct ip_addr *ipaddr,
 				 struct eth_addr **eth_ret, struct ip_addr **ip_ret)
 {
-	s8_t i;
+	s16_t i;
 
 	LWIP_UNUSED_ARG(netif);
 
@@ -939,7 +954,7 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
 {
 	struct eth_addr *srcaddr = (struct eth_addr *) netif->hwaddr;
 	err_t result = ERR_MEM;
-	s8_t i; /* ARP entry index */
+	s16_t i; /* ARP entry index */
 
 	/* non-unicast address? */
 	if (ip_addr_isbroadcast(ipaddr, netif) ||
@@ -1047,6 +1062,18 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
 			{
 				/* queue packet ... */
 				struct etharp_q_entry *new_entry;
+				/* ... dropping the oldest if the entry's queue is full */
+				if (arp_table[i].qlen >= ARP_QUEUE_LEN)
+				{
+					new_entry = arp_table[i].q;
+					arp_table[i].q = new_entry->next;
+					arp_table[i].qlen--;
+					LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
+								("etharp_query: dropped oldest packet %p queued on ARP entry %"S16_F"\n", (void *) new_entry->p, (s16_t) i));
+					pbuf_free(new_entry->p);
+					memp_free(MEMP_ARP_QUEUE, new_entry);
+					ETHARP_STATS_INC(etharp.memerr);
+				}
 				/* allocate a new arp queue entry */
 				new_entry = memp_malloc(MEMP_ARP_QUEUE);
 				if (new_entry != NULL)
@@ -1068,6 +1095,7 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
 						/* queue did not exist, first item in queue */
 						arp_table[i].q = new_entry;
 					}
+					arp_table[i].qlen++;
 					LWIP_DEBUGF(ETHARP_DEBUG | LWIP_DBG_TRACE,
 								("etharp_query: queued packet %p on ARP entry %"S16_F"\n", (void *) q, (s16_t) i));
 					result = ERR_OK;
@@ -7,16 +7,56 @@
 
 #define TIMER_INTERVAL 250
 
+// With INPUT_PAGEFLIP set, packets are not copied at all: the kernel
+// maps the page the card received each one into at a fixed address,
+// and that page is passed on to the network server with NSREQ_INPUT.
+// Otherwise the kernel copies each packet into a slot of the input
+// ring, which costs a copy but no IPC per packet.  Page flipping hands
+// every packet to the one server, so it runs unsharded.
+#ifndef INPUT_PAGEFLIP
+#define INPUT_PAGEFLIP 0
+#endif
+
 // Virtual address at which to receive page mappings containing client requests.
+// Each of the QUEUE_SIZE buffers there has room for a request page and
+// the NSIPC_MAXPAGES data pages that may follow it.
 #define QUEUE_SIZE    20
-#define REQVA        (0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQPAGES     (1 + NSIPC_MAXPAGES)
+#define REQVA        (0x0ffff000 - QUEUE_SIZE * REQPAGES * PGSIZE)
+
+// Rings carrying packets from the input helpers to the network server
+// and from the server to the output helper.  Each slot holds one
+// struct jif_pkt; the server creates them all before forking the
+// helpers.  There is one input helper per receive queue of the card,
+// up to NS_MAX_INPUTS, and one ring from each to each shard of the
+// server (see inc/ns.h); each shard has an output helper of its own.
+// Shard 0's rings are INRING, or NS_INRING(q) for queue q, and OUTRING.
+// Input slots hold the largest frame the card takes (see NET_MTU).
+// Output slots are big enough for a TCP super-segment that the card
+// cuts up itself (see NETBUF_TX_TSO), and are page-aligned so that its
+// headers never straddle a page.
+#define NS_RING_NSLOTS    32
+#define NS_RING_SLOTSIZE  ((sizeof(struct jif_pkt) + NET_MAXFRAME + 2047) & ~2047)
+#define NS_RING_NPAGES    RING_NPAGES(NS_RING_NSLOTS, NS_RING_SLOTSIZE)
+#define NS_OUTRING_SLOTSIZE  NET_TSO_MAXLEN
+#define NS_OUTRING_NPAGES RING_NPAGES(NS_RING_NSLOTS, NS_OUTRING_SLOTSIZE)
+#define NS_MAX_INPUTS     2
+#define NS_SHARD_INRING(q, s) \
+	((struct Ring *) (0x10000000 + ((s) * NS_MAX_INPUTS + (q)) * NS_RING_NPAGES * PGSIZE))
+#define NS_SHARD_OUTRING(s) \
+	((struct Ring *) ((uintptr_t) NS_SHARD_INRING(0, NS_MAX_SHARDS) + \
+					  (s) * NS_OUTRING_NPAGES * PGSIZE))
+#define NS_INRING(q)   NS_SHARD_INRING(q, 0)
+#define INRING         NS_INRING(0)
+#define OUTRING        NS_SHARD_OUTRING(0)
 
-/* timer.c */
-void timer(envid_t ns_envid, uint32_t initial_to);
+// How many shards the server runs as; the input helpers hand each
+// packet to the shard it belongs to
+extern uint32_t ns_nshards;
 
 /* input.c */
-void input(envid_t ns_envid);
+void input(struct Ring *ring, uint32_t queue);
 
 /* output.c */
-void output(envid_t ns_envid);
+void output(struct Ring *ring);
 
@@ -21,6 +21,7 @@
 #include <lwip/tcpip.h>
 #include <lwip/stats.h>
 #include <lwip/netbuf.h>
+#include <lwip/api.h>
 #include <netif/etharp.h>
 #include <jif/jif.h>
 
@@ -33,6 +34,12 @@ struct netif nif;
 
 #define debug 0
 
+// How many shards to run the server as (see inc/ns.h), at most one per
+// CPU.  Each is pinned to a CPU of its own.
+#ifndef NS_SHARDS
+#define NS_SHARDS NS_MAX_SHARDS
+#endif
+
 struct timer_thread {
 	uint32_t msec;
 	void (*func)(void);
@@ -43,44 +50,64 @@ static struct timer_thread t_arp;
 static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
 
-static envid_t timer_envid;
-static envid_t input_envid;
+static envid_t input_envids[NS_MAX_INPUTS];
+static uint32_t ninputs;
 static envid_t output_envid;
+// Which shard this server is
+static uint32_t ns_shard;
 
-static bool buse[QUEUE_SIZE];
+// Request buffers: the page slots at REQVA that a request page may be
+// received into.  The free ones are kept on a stack, so taking and
+// returning one is O(1).
+static uint8_t free_bufs[QUEUE_SIZE];
+static int nfree_bufs;
 
-static int next_i(int i)
-{ return (i + 1) % QUEUE_SIZE; }
+// Received packets keep their buffers for as long as lwIP holds them
+// (see jif_input_page), but only while this many others are free for
+// requests; below that, a packet is copied and its buffer freed at once.
+#define RX_RESERVE    (QUEUE_SIZE / 2)
 
-static int prev_i(int i)
-{ return (i ? i - 1 : QUEUE_SIZE - 1); }
+static void
+init_buffers(void)
+{
+	for (nfree_bufs = 0; nfree_bufs < QUEUE_SIZE; nfree_bufs++)
+		free_bufs[nfree_bufs] = QUEUE_SIZE - 1 - nfree_bufs;
+}
 
+// Return a free request buffer, or NULL if every one holds a request
+// still being served.
 static void *
 get_buffer(void)
 {
-	void *va;
-
 	int i;
-	for (i = 0; i < QUEUE_SIZE; i++)
-		if (!buse[i]) break;
 
-	if (i == QUEUE_SIZE)
-	{
-		panic("NS: buffer overflow");
-		return 0;
-	}
-
-	va = (void *) (REQVA + i * PGSIZE);
-	buse[i] = 1;
-
-	return va;
+	if (nfree_bufs == 0)
+		return NULL;
+	i = free_bufs[--nfree_bufs];
+	return (void *) (REQVA + i * REQPAGES * PGSIZE);
 }
 
 static void
 put_buffer(void *va)
 {
-	int i = ((uint32_t) va - REQVA) / PGSIZE;
-	buse[i] = 0;
+	int i = ((uint32_t) va - REQVA) / (REQPAGES * PGSIZE);
+	free_bufs[nfree_bufs++] = i;
+}
+
+// Unmap the 'npages' pages received into request buffer 'va' and
+// return it to the free stack.
+static void
+release_buffer(void *va, uint32_t npages)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	op.srcva = 0;
+	op.dstva = (uintptr_t) va;
+	op.npages = MAX(npages, 1);
+	op.perm = 0;
+	sys_page_map_batch(0, 0, &op, 1, &done);
+	put_buffer(va);
 }
 
 static void
@@ -109,7 +136,7 @@ net_timer(uint32_t arg)
 
 	for (;;)
 	{
-		uint32_t cur = sys_time_msec();
+		uint32_t cur = time_msec();
 
 		lwip_core_lock();
 		t->func();
@@ -150,53 +177,282 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t) ~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, NS_SHARD_OUTRING(ns_shard), ipaddr, netmask, gw);
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
 	start_timer(&t_tcps, &tcp_slowtmr, "tcp s timer", TCP_SLOW_INTERVAL);
 
+	lwip_core_unlock();
+	if (ns_shard != 0)
+		return;
+
 	struct in_addr ia = {ipaddr};
 	cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
 			" bound to static IP %s\n",
 			nif.hwaddr[0], nif.hwaddr[1], nif.hwaddr[2],
 			nif.hwaddr[3], nif.hwaddr[4], nif.hwaddr[5],
 			inet_ntoa(ia));
-
-	lwip_core_unlock();
+	if (ns_nshards > 1)
+		cprintf("ns: %u shards\n", ns_nshards);
 
 	cprintf("NS: TCP/IP initialized.\n");
 }
 
+struct st_args {
+	int32_t reqno;
+	uint32_t whom;
+	union Nsipc *req;
+	uint32_t npages;	// Pages received at req
+};
+
+// Requests that may block in lwIP run on serve threads, which are kept
+// in a pool with their stacks rather than created per request.  An
+// idle serve thread waits for 'busy' to become 1; the pool grows on
+// demand up to SERVE_POOL_SIZE threads, past which a request gets a
+// thread of its own that exits when done.
+#define SERVE_POOL_SIZE 16
+
+struct serve_worker {
+	volatile uint32_t busy;		// 1 while 'args' holds a request
+	struct st_args args;
+};
+
+static struct serve_worker workers[SERVE_POOL_SIZE];
+static int nworkers;
+
+// Blocking accepts on a listening socket, say from the processes of a
+// preforked server sharing it, take each connection in the order they
+// arrived: each takes a ticket and waits for its turn.
+struct accept_queue {
+	uint32_t next;			// Ticket of the next accept to arrive
+	volatile uint32_t turn;	// Ticket of the accept to take the next connection
+};
+
+static struct accept_queue accept_queues[FD_SETSIZE];
+
+static void
+stats_proto(struct Nsstats_proto *dst, const struct stats_proto *src)
+{
+	dst->xmit = src->xmit;
+	dst->recv = src->recv;
+	dst->drop = src->drop;
+	dst->chkerr = src->chkerr;
+	dst->lenerr = src->lenerr;
+	dst->memerr = src->memerr;
+	dst->rterr = src->rterr;
+	dst->proterr = src->proterr;
+	dst->err = src->err;
+}
+
+// Copy lwIP's counters into 'ret' for NSREQ_STATS, and the heap's,
+// which lwIP's mem_malloc now comes from.
 static void
-process_timer(envid_t envid)
+serve_stats(struct Nsret_stats *ret)
 {
-	uint32_t start, now, to;
+	struct MallocStats ms;
+
+	stats_proto(&ret->ret_link, &lwip_stats.link);
+	stats_proto(&ret->ret_etharp, &lwip_stats.etharp);
+	stats_proto(&ret->ret_ip, &lwip_stats.ip);
+	stats_proto(&ret->ret_icmp, &lwip_stats.icmp);
+	stats_proto(&ret->ret_udp, &lwip_stats.udp);
+	stats_proto(&ret->ret_tcp, &lwip_stats.tcp);
+	malloc_stats(&ms);
+	ret->ret_mem_used = ms.ms_inuse;
+	ret->ret_mem_max = ms.ms_peak;
+	ret->ret_mem_err = ms.ms_failed;
+}
 
-	if (envid != timer_envid)
+// Is socket s ready to be read (or written, if 'write') without
+// waiting?  Sockets lwIP doesn't know are left for the call to fail.
+static bool
+sock_ready(int s, bool write)
+{
+	struct timeval tv = { 0, 0 };
+	fd_set set;
+
+	if (s < 0 || s >= FD_SETSIZE)
+		return true;
+	FD_ZERO(&set);
+	FD_SET(s, &set);
+	return lwip_select(s + 1, write ? NULL : &set, write ? &set : NULL,
+					   NULL, &tv) > 0;
+}
+
+// Accept a connection on socket s, after the blocking accepts already
+// waiting on it (see struct accept_queue).  A non-blocking accept, made
+// only once a connection is ready, takes it at once.
+static int
+serve_accept(int s, struct sockaddr *addr, socklen_t *addrlen, bool nonblock)
+{
+	struct accept_queue *q;
+	uint32_t ticket;
+	int r;
+
+	if (nonblock || s < 0 || s >= FD_SETSIZE)
+		return lwip_accept(s, addr, addrlen);
+
+	q = &accept_queues[s];
+	ticket = q->next++;
+	while (q->turn != ticket)
+		thread_wait(&q->turn, q->turn, (uint32_t) ~0);
+	r = lwip_accept(s, addr, addrlen);
+	q->turn++;
+	thread_wakeup(&q->turn);
+	return r;
+}
+
+// Wait as NSREQ_POLL asks, and set the revents of its sockets.
+// Returns the number of sockets ready.
+static int
+serve_poll(struct Nsreq_poll *req)
+{
+	struct timeval tv, *tvp = NULL;
+	fd_set rset, wset;
+	int i, s, n, maxs = -1;
+
+	if (req->req_nfds < 0 || req->req_nfds > NSIPC_MAXPOLL)
+		return -E_INVAL;
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	for (i = 0; i < req->req_nfds; i++)
 	{
-		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
-		return;
+		if ((s = req->req_fds[i].s) < 0 || s >= FD_SETSIZE)
+			return -E_INVAL;
+		if (req->req_fds[i].events & POLLIN)
+			FD_SET(s, &rset);
+		if (req->req_fds[i].events & POLLOUT)
+			FD_SET(s, &wset);
+		maxs = MAX(maxs, s);
+	}
+	if (req->req_timeout >= 0)
+	{
+		tv.tv_sec = req->req_timeout / 1000;
+		tv.tv_usec = (req->req_timeout % 1000) * 1000;
+		tvp = &tv;
 	}
 
-	start = sys_time_msec();
-	thread_yield();
-	now = sys_time_msec();
+	if (lwip_select(maxs + 1, &rset, &wset, NULL, tvp) < 0)
+		return -E_INVAL;
+	for (i = n = 0; i < req->req_nfds; i++)
+	{
+		s = req->req_fds[i].s;
+		req->req_fds[i].revents = (FD_ISSET(s, &rset) ? POLLIN : 0) |
+								  (FD_ISSET(s, &wset) ? POLLOUT : 0);
+		if (req->req_fds[i].revents)
+			n++;
+	}
+	return n;
+}
 
-	to = TIMER_INTERVAL - (now - start);
-	ipc_send(envid, to, 0, 0);
+// Did the request come with data pages holding 'len' bytes from
+// 'offset' in the first of them, writable if 'write'?
+static bool
+req_data_ok(struct st_args *args, int offset, int len, bool write)
+{
+	uintptr_t va = (uintptr_t) args->req + PGSIZE;
+	uint32_t i, npages;
+
+	if (len < 0 || offset < 0)
+		return false;
+	npages = ROUNDUP(offset + len, PGSIZE) / PGSIZE;
+	if (args->npages < 1 + npages)
+		return false;
+	for (i = 0; write && i < npages; i++)
+		if (!(uvpt[PGNUM(va + i * PGSIZE)] & PTE_W))
+			return false;
+	return true;
 }
 
-struct st_args {
-	int32_t reqno;
-	uint32_t whom;
-	union Nsipc *req;
-};
+// lwIP's result for a datagram call, with a would-block errno mapped
+// to -E_WOULD_BLOCK
+static int
+dgram_result(int r)
+{
+	if (r == -1 && errno == EWOULDBLOCK)
+		return -E_WOULD_BLOCK;
+	return r;
+}
+
+// Check that NSREQ_SENDMMSG or NSREQ_RECVMMSG's datagrams fit in the
+// request page, and return where the first one's data starts, or NULL.
+static char *
+mmsg_data(struct Nsreq_mmsg *m)
+{
+	size_t off;
+	int i;
+
+	if (m->req_nmsgs < 1 || m->req_nmsgs > NSIPC_MAXMSGS)
+		return NULL;
+	off = offsetof(struct Nsreq_mmsg, req_msgs[m->req_nmsgs]);
+	for (i = 0; i < m->req_nmsgs; i++)
+	{
+		if (m->req_msgs[i].len < 0 || m->req_msgs[i].len > PGSIZE - off)
+			return NULL;
+		off += m->req_msgs[i].len;
+	}
+	return (char *) &m->req_msgs[m->req_nmsgs];
+}
+
+// Send NSREQ_SENDMMSG's datagrams in order, stopping at the first
+// that fails.  Returns how many were sent, or the first one's error.
+static int
+serve_sendmmsg(struct Nsreq_mmsg *m)
+{
+	struct Nsmsg *msg;
+	char *data;
+	int i, r = 0;
+
+	if ((data = mmsg_data(m)) == NULL)
+		return -E_INVAL;
+	if ((m->req_flags & MSG_DONTWAIT) && !sock_ready(m->req_s, true))
+		return -E_WOULD_BLOCK;
+	for (i = 0; i < m->req_nmsgs; i++)
+	{
+		msg = &m->req_msgs[i];
+		r = lwip_sendto(m->req_s, data, msg->len, m->req_flags & ~MSG_DONTWAIT,
+						msg->addr.sa_family ? &msg->addr : NULL,
+						msg->addr.sa_family ? sizeof(msg->addr) : 0);
+		if (r < 0)
+			break;
+		data += msg->len;
+	}
+	return i > 0 ? i : dgram_result(r);
+}
+
+// Receive NSREQ_RECVMMSG's datagrams: the first as the flags say, the
+// rest only while more have already arrived.  Returns how many were
+// received, or the first one's error.
+static int
+serve_recvmmsg(struct Nsreq_mmsg *m)
+{
+	struct Nsmsg *msg;
+	socklen_t fromlen;
+	char *data;
+	int i, room, r = 0;
+
+	if ((data = mmsg_data(m)) == NULL)
+		return -E_INVAL;
+	for (i = 0; i < m->req_nmsgs; i++)
+	{
+		msg = &m->req_msgs[i];
+		room = msg->len;
+		fromlen = sizeof(msg->addr);
+		r = lwip_recvfrom(m->req_s, data, room,
+						  m->req_flags | (i > 0 ? MSG_DONTWAIT : 0),
+						  &msg->addr, &fromlen);
+		if (r < 0)
+			break;
+		msg->len = r;
+		data += room;
+	}
+	return i > 0 ? i : dgram_result(r);
+}
 
 static void
-serve_thread(uint32_t a)
+serve_request(struct st_args *args)
 {
-	struct st_args *args = (struct st_args *) a;
 	union Nsipc *req = args->req;
 	int r;
 
@@ -205,9 +461,15 @@ serve_thread(uint32_t a)
 		case NSREQ_ACCEPT:
 		{
 			struct Nsret_accept ret;
+			if ((req->accept.req_flags & MSG_DONTWAIT) &&
+				!sock_ready(req->accept.req_s, false))
+			{
+				r = -E_WOULD_BLOCK;
+				break;
+			}
 			ret.ret_addrlen = req->accept.req_addrlen;
-			r = lwip_accept(req->accept.req_s, &ret.ret_addr,
-							&ret.ret_addrlen);
+			r = serve_accept(req->accept.req_s, &ret.ret_addr, &ret.ret_addrlen,
+							 req->accept.req_flags & MSG_DONTWAIT);
 			memmove(req, &ret, sizeof ret);
 			break;
 		}
@@ -229,23 +491,162 @@ serve_thread(uint32_t a)
 			r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
 			break;
 		case NSREQ_RECV:
+		{
 			// Note that we read the request fields before we
-			// overwrite it with the response data.
-			r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-						  req->recv.req_len, req->recv.req_flags);
+			// overwrite it with the response data.  Data that does
+			// not fit in the request page goes in the pages after it.
+			struct Nsreq_recv rq = req->recv;
+			char *buf = req->recvRet.ret_buf;
+			if (rq.req_len > PGSIZE)
+			{
+				buf = (char *) req + PGSIZE;
+				if (!req_data_ok(args, 0, rq.req_len, true))
+				{
+					r = -E_INVAL;
+					break;
+				}
+			}
+			r = lwip_recv(rq.req_s, buf, rq.req_len, rq.req_flags);
+			if (r == -1 && errno == EWOULDBLOCK)
+				r = -E_WOULD_BLOCK;
 			break;
+		}
 		case NSREQ_SEND:
-			r = lwip_send(req->send.req_s, &req->send.req_buf,
-						  req->send.req_size, req->send.req_flags);
+		{
+			const char *buf = req->send.req_buf;
+			if (req->send.req_size > (int) sizeof(req->send.req_buf))
+			{
+				buf = (const char *) req + PGSIZE;
+				if (!req_data_ok(args, 0, req->send.req_size, false))
+				{
+					r = -E_INVAL;
+					break;
+				}
+			}
+			if ((req->send.req_flags & MSG_DONTWAIT) &&
+				!sock_ready(req->send.req_s, true))
+			{
+				r = -E_WOULD_BLOCK;
+				break;
+			}
+			r = lwip_send(req->send.req_s, buf,
+						  req->send.req_size, req->send.req_flags & ~MSG_DONTWAIT);
+			break;
+		}
+		case NSREQ_SENDTO:
+		{
+			struct Nsreq_sendto *st = &req->sendto;
+			if (st->req_size < 0 || st->req_size > (int) sizeof(req->_pad) -
+				(int) offsetof(struct Nsreq_sendto, req_buf))
+			{
+				r = -E_INVAL;
+				break;
+			}
+			if ((st->req_flags & MSG_DONTWAIT) && !sock_ready(st->req_s, true))
+			{
+				r = -E_WOULD_BLOCK;
+				break;
+			}
+			r = lwip_sendto(st->req_s, st->req_buf, st->req_size,
+							st->req_flags & ~MSG_DONTWAIT,
+							st->req_tolen ? &st->req_to : NULL, st->req_tolen);
+			break;
+		}
+		case NSREQ_RECVFROM:
+		{
+			// As NSREQ_RECV, read the request before the reply
+			// overwrites it
+			struct Nsreq_recvfrom rq = req->recvfrom;
+			struct Nsret_recvfrom *ret = &req->recvfromRet;
+			if (rq.req_len < 0 || rq.req_len > (int) sizeof(req->_pad) -
+				(int) offsetof(struct Nsret_recvfrom, ret_buf))
+			{
+				r = -E_INVAL;
+				break;
+			}
+			ret->ret_fromlen = sizeof(ret->ret_from);
+			r = dgram_result(lwip_recvfrom(rq.req_s, ret->ret_buf, rq.req_len,
+										   rq.req_flags, &ret->ret_from,
+										   &ret->ret_fromlen));
+			break;
+		}
+		case NSREQ_SENDMMSG:
+			r = serve_sendmmsg(&req->mmsg);
 			break;
+		case NSREQ_RECVMMSG:
+			r = serve_recvmmsg(&req->mmsg);
+			break;
+		case NSREQ_GETHOSTBYNAME:
+		{
+			struct ip_addr addr;
+			err_t err;
+			req->gethostbyname.req_name[NSIPC_MAXNAME - 1] = '\0';
+			if (req->gethostbyname.req_name[0] == '\0')
+			{
+				r = -E_INVAL;
+				break;
+			}
+			// lwIP reports a failed lookup as ERR_VAL, like a bad name
+			err = netconn_gethostbyname(req->gethostbyname.req_name, &addr);
+			if (err == ERR_OK)
+			{
+				req->gethostbynameRet.ret_addr.s_addr = addr.addr;
+				r = 0;
+			} else if (err == ERR_MEM)
+				r = -E_NO_MEM;
+			else
+				r = -E_NOT_FOUND;
+			break;
+		}
 		case NSREQ_SOCKET:
 			r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 							req->socket.req_protocol);
 			break;
-		case NSREQ_INPUT:
-			jif_input(&nif, (void *) &req->pkt);
+		case NSREQ_STATS:
+			serve_stats(&req->statsRet);
 			r = 0;
 			break;
+		case NSREQ_SHARDS:
+			req->shardsRet.ret_addr.s_addr = nif.ip_addr.addr;
+			r = ns_nshards;
+			break;
+		case NSREQ_POLL:
+			r = serve_poll(&req->poll);
+			break;
+		case NSREQ_EPOLL_CREATE:
+			r = lwip_evq_create();
+			break;
+		case NSREQ_EPOLL_CTL:
+			static_assert(EPOLLIN == LWIP_EVQ_IN && EPOLLOUT == LWIP_EVQ_OUT);
+			static_assert(EPOLL_CTL_ADD == LWIP_EVQ_ADD && EPOLL_CTL_DEL == LWIP_EVQ_DEL);
+			r = lwip_evq_ctl(req->epollCtl.req_q, req->epollCtl.req_op,
+							 req->epollCtl.req_s, req->epollCtl.req_events,
+							 req->epollCtl.req_data);
+			break;
+		case NSREQ_EPOLL_WAIT:
+		{
+			// Read the request fields before the events overwrite them
+			struct Nsreq_epoll_wait w = req->epollWait;
+			r = lwip_evq_wait(w.req_q, req->epollWaitRet.ret_events,
+							  MIN(w.req_maxevents, NSIPC_MAXEVENTS), w.req_timeout);
+			break;
+		}
+		case NSREQ_EPOLL_CLOSE:
+			r = lwip_evq_close(req->epollClose.req_q);
+			break;
+		case NSREQ_SENDFILE:
+		{
+			struct Nsreq_sendfile *sf = &req->sendfile;
+			if (sf->req_offset < 0 || sf->req_offset >= PGSIZE ||
+				!req_data_ok(args, sf->req_offset, sf->req_size, false))
+			{
+				r = -E_INVAL;
+				break;
+			}
+			r = lwip_send_ref(sf->req_s, (char *) req + PGSIZE + sf->req_offset,
+							  sf->req_size, 0);
+			break;
+		}
 		default:
 			cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
 			r = -E_INVAL;
@@ -259,43 +660,167 @@ serve_thread(uint32_t a)
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	ipc_send(args->whom, r, 0, 0);
+
+	release_buffer(args->req, args->npages);
+}
+
+static void
+serve_thread(uint32_t a)
+{
+	struct st_args *args = (struct st_args *) a;
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void *) args->req);
+	serve_request(args);
 	free(args);
 }
 
+static void __attribute__((noreturn))
+serve_worker(uint32_t a)
+{
+	struct serve_worker *w = (struct serve_worker *) a;
+
+	for (;;)
+	{
+		thread_wait(&w->busy, 0, (uint32_t) ~0);
+		if (!w->busy)
+			continue;
+		serve_request(&w->args);
+		w->busy = 0;
+	}
+}
+
+// Hand a request to an idle serve thread, starting one if the pool
+// has room, or else to a thread of its own.
+static void
+dispatch(int32_t reqno, uint32_t whom, union Nsipc *req, uint32_t npages)
+{
+	struct serve_worker *w;
+	struct st_args *args;
+	int i;
+
+	for (i = 0; i < nworkers && workers[i].busy; i++)
+		;
+	if (i == nworkers && nworkers < SERVE_POOL_SIZE &&
+		thread_create(0, "serve_worker", serve_worker,
+					  (uint32_t) &workers[nworkers]) == 0)
+		nworkers++;
+
+	if (i < nworkers)
+	{
+		w = &workers[i];
+		w->args.reqno = reqno;
+		w->args.whom = whom;
+		w->args.req = req;
+		w->args.npages = npages;
+		w->busy = 1;
+		thread_wakeup(&w->busy);
+		return;
+	}
+
+	args = malloc(sizeof(struct st_args));
+	if (!args)
+		panic("could not allocate thread args structure");
+
+	args->reqno = reqno;
+	args->whom = whom;
+	args->req = req;
+	args->npages = npages;
+
+	if (thread_create(0, "serve_thread", serve_thread, (uint32_t) args) < 0)
+		panic("could not create serve thread");
+}
+
+static bool
+is_input_env(envid_t envid)
+{
+	uint32_t q;
+
+	for (q = 0; q < ninputs; q++)
+		if (input_envids[q] == envid)
+			return true;
+	return false;
+}
+
 void
 serve(void)
 {
 	int32_t reqno;
-	uint32_t whom;
+	uint32_t whom, q, tick;
+	int32_t wait;
 	int i, perm;
 	void *va;
 
+	init_buffers();
+	tick = time_msec() + TIMER_INTERVAL;
 	while (1)
 	{
+		// With every request buffer taken, stop accepting requests
+		// until a serve thread finishes one: clients then block in
+		// their IPC send instead of the server running out of room.
+		// Packets keep flowing in, since the requests in progress
+		// may be waiting for them.
+		if (nfree_bufs == 0)
+		{
+			for (q = 0; q < ninputs; q++)
+				jif_input_ring(&nif, NS_SHARD_INRING(q, ns_shard));
+			thread_yield();
+			jif_flush(&nif);
+			continue;
+		}
+
+		// Feed lwIP every packet the input environments have queued.
+		// Arm each ring before blocking so that the next packet
+		// arrives as an NSREQ_INPUT doorbell.
+		for (q = 0; q < ninputs; q++)
+			do
+				jif_input_ring(&nif, NS_SHARD_INRING(q, ns_shard));
+			while (!ring_arm(NS_SHARD_INRING(q, ns_shard)));
+
 		// ipc_recv will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
+		// Nor may a TCP super-segment wait for our next wakeup.
+		jif_flush(&nif);
 
+		// Wait no longer than the next timer tick, on which lwIP's
+		// timer threads get to check their deadlines.
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		wait = (int32_t) (tick - time_msec());
+		reqno = ipc_recv_timeout((int32_t *) &whom, (void *) va, REQPAGES, &perm,
+								 wait > 0 ? wait : 1);
+		if ((int32_t) (time_msec() - tick) >= 0)
+		{
+			tick += TIMER_INTERVAL;
+			thread_yield();
+			if ((int32_t) (time_msec() - tick) >= 0)
+				tick = time_msec() + TIMER_INTERVAL;
+		}
+		if (reqno == -E_TIMEOUT && whom == 0)
+		{
+			put_buffer(va);
+			continue;
+		}
 		if (debug)
 		{
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
 
 		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER)
+		// NSREQ_INPUT is either a doorbell for the input ring or, in
+		// page-flip mode (see net/input.c), a page holding one packet.
+		if (reqno == NSREQ_INPUT && is_input_env(whom))
 		{
-			process_timer(whom);
-			put_buffer(va);
+			if ((perm & PTE_P) && nfree_bufs >= RX_RESERVE)
+				jif_input_page(&nif, va, thisenv->env_ipc_npages, release_buffer);
+			else if (perm & PTE_P)
+			{
+				jif_input(&nif, va);
+				release_buffer(va, thisenv->env_ipc_npages);
+			} else
+				put_buffer(va);
 			continue;
 		}
 
@@ -306,18 +831,18 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
+		// Requests that never block are answered right here.
+		if (reqno == NSREQ_STATS || reqno == NSREQ_SHARDS)
+		{
+			struct st_args args = { reqno, whom, va, thisenv->env_ipc_npages };
+			serve_request(&args);
+			continue;
+		}
 
-		thread_create(0, "serve_thread", serve_thread, (uint32_t) args);
-		thread_yield(); // let the thread created run
+		// Since some lwIP socket calls will block, process the rest
+		// of the request on a serve thread.
+		dispatch(reqno, whom, va, thisenv->env_ipc_npages);
+		thread_yield(); // let the serve thread run
 	}
 }
 
@@ -333,30 +858,71 @@ tmain(uint32_t arg)
 void
 umain(int argc, char **argv)
 {
-	envid_t ns_envid = sys_getenvid();
+	char name[SERVICE_NAMELEN];
+	struct NetStats st;
+	envid_t envid;
+	uint32_t q, i;
+	int r;
 
 	binaryname = "ns";
 
-	// fork off the timer thread which will send us periodic messages
-	timer_envid = fork();
-	if (timer_envid < 0)
-		panic("error forking");
-	else if (timer_envid == 0)
+	// One input environment per receive queue of the card, so that a
+	// multi-queue card spreads the flows over the CPUs.
+	ninputs = 1;
+	if (sys_net_stats(&st) == 0 && st.rx_queues > 1)
+		ninputs = MIN(st.rx_queues, NS_MAX_INPUTS);
+	ns_nshards = INPUT_PAGEFLIP ? 1 : MIN(MIN(NS_SHARDS, NS_MAX_SHARDS), uinfo.ncpu);
+
+	for (i = 0; i < ns_nshards; i++)
 	{
-		timer(ns_envid, TIMER_INTERVAL);
-		return;
+		for (q = 0; q < ninputs; q++)
+			if ((r = ring_create(NS_SHARD_INRING(q, i), NS_RING_NSLOTS,
+								 NS_RING_SLOTSIZE)) < 0)
+				panic("ns: could not create input ring: %e", r);
+		if ((r = ring_create(NS_SHARD_OUTRING(i), NS_RING_NSLOTS,
+							 NS_OUTRING_SLOTSIZE)) < 0)
+			panic("ns: could not create output ring: %e", r);
 	}
 
-	// fork off the input thread which will poll the NIC driver for input
-	// packets
-	input_envid = fork();
-	if (input_envid < 0)
-		panic("error forking");
-	else if (input_envid == 0)
+	// fork off the input threads which will poll the NIC driver for
+	// input packets, one per receive queue, each kept to its own CPU
+	// when there are enough
+	for (q = 0; q < ninputs; q++)
 	{
-		input(ns_envid);
-		return;
+		input_envids[q] = fork();
+		if (input_envids[q] < 0)
+			panic("error forking");
+		else if (input_envids[q] == 0)
+		{
+			input(NS_INRING(q), q);
+			return;
+		}
+		if (ninputs > 1 && uinfo.ncpu > q + 1)
+			sys_env_set_affinity(input_envids[q], 1 << (q + 1));
+	}
+
+	// Fork off the other shards, which go on from here as servers of
+	// their own, lwIP and all.  Clients find them once shard 0 starts
+	// answering, so it registers them first.
+	for (i = 1; i < ns_nshards; i++)
+	{
+		if ((envid = fork()) < 0)
+			panic("error forking");
+		else if (envid == 0)
+		{
+			ns_shard = i;
+			break;
+		}
+		snprintf(name, sizeof(name), "%s%u", SERVICE_NS, i);
+		if ((r = sys_service_register(envid, name)) < 0)
+			panic("ns: could not register shard %u: %e", i, r);
 	}
+	for (q = 0; q < ninputs; q++)
+		ring_set_consumer(NS_SHARD_INRING(q, ns_shard), sys_getenvid(), NSREQ_INPUT);
+	if (ns_nshards > 1)
+		sys_env_set_affinity(0, 1 << ns_shard);
+	lwip_shard = ns_shard;
+	lwip_nshards = ns_nshards;
 
 	// fork off the output thread that will send the packets to the NIC
 	// driver
@@ -365,9 +931,10 @@ umain(int argc, char **argv)
 		panic("error forking");
 	else if (output_envid == 0)
 	{
-		output(ns_envid);
+		output(NS_SHARD_OUTRING(ns_shard));
 		return;
 	}
+	ring_set_consumer(NS_SHARD_OUTRING(ns_shard), output_envid, 0);
 
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
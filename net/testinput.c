@@ -4,8 +4,6 @@
 static envid_t output_envid;
 static envid_t input_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt *) REQVA;
-
 
 static void
 announce(void)
@@ -19,13 +17,14 @@ announce(void)
 	uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 	uint32_t myip = inet_addr(IP);
 	uint32_t gwip = inet_addr(DEFAULT);
-	int r;
+	struct jif_pkt *pkt;
 
-	if ((r = sys_page_alloc(0, pkt, PTE_P | PTE_U | PTE_W)) < 0)
-		panic("sys_page_map: %e", r);
+	while ((pkt = ring_reserve(OUTRING)) == NULL)
+		sys_yield();
 
 	struct etharp_hdr *arp = (struct etharp_hdr *) pkt->jp_data;
 	pkt->jp_len = sizeof(*arp);
+	pkt->jp_flags = 0;
 
 	memset(arp->ethhdr.dest.addr, 0xff, ETHARP_HWADDR_LEN);
 	memcpy(arp->ethhdr.src.addr, mac, ETHARP_HWADDR_LEN);
@@ -39,8 +38,7 @@ announce(void)
 	memset(arp->dhwaddr.addr, 0x00, ETHARP_HWADDR_LEN);
 	memcpy(arp->dipaddr.addrw, &gwip, 4);
 
-	ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P | PTE_W | PTE_U);
-	sys_page_unmap(0, pkt);
+	ring_publish(OUTRING);
 }
 
 static void
@@ -73,21 +71,27 @@ umain(int argc, char **argv)
 
 	binaryname = "testinput";
 
+	if ((r = ring_create(INRING, NS_RING_NSLOTS, NS_RING_SLOTSIZE)) < 0 ||
+		(r = ring_create(OUTRING, NS_RING_NSLOTS, NS_OUTRING_SLOTSIZE)) < 0)
+		panic("ring_create: %e", r);
+	ring_set_consumer(INRING, ns_envid, NSREQ_INPUT);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
 	else if (output_envid == 0)
 	{
-		output(ns_envid);
+		output(OUTRING);
 		return;
 	}
+	ring_set_consumer(OUTRING, output_envid, 0);
 
 	input_envid = fork();
 	if (input_envid < 0)
 		panic("error forking");
 	else if (input_envid == 0)
 	{
-		input(ns_envid);
+		input(INRING, 0);
 		return;
 	}
 
@@ -96,24 +100,27 @@ umain(int argc, char **argv)
 
 	while (1)
 	{
-		envid_t whom;
-		int perm;
-
-		int32_t req = ipc_recv((int32_t *) &whom, pkt, &perm);
+		struct jif_pkt *pkt;
+
+		while ((pkt = ring_peek(INRING)) != NULL)
+		{
+			hexdump("input: ", pkt->jp_data, pkt->jp_len);
+			cprintf("\n");
+			ring_release(INRING);
+
+			// Only indicate that we're waiting for packets once
+			// we've received the ARP reply
+			if (first)
+				cprintf("Waiting for packets...\n");
+			first = 0;
+		}
+		if (!ring_arm(INRING))
+			continue;
+
+		int32_t req = ipc_recv_from(input_envid, 0, 1, 0, 0);
 		if (req < 0)
-			panic("ipc_recv: %e", req);
-		if (whom != input_envid)
-			panic("IPC from unexpected environment %08x", whom);
+			panic("ipc_recv_from: %e", req);
 		if (req != NSREQ_INPUT)
 			panic("Unexpected IPC %d", req);
-
-		hexdump("input: ", pkt->jp_data, pkt->jp_len);
-		cprintf("\n");
-
-		// Only indicate that we're waiting for packets once
-		// we've received the ARP reply
-		if (first)
-			cprintf("Waiting for packets...\n");
-		first = 0;
 	}
 }
@@ -6,8 +6,6 @@
 
 static envid_t output_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt *) REQVA;
-
 
 void
 umain(int argc, char **argv)
@@ -17,28 +15,34 @@ umain(int argc, char **argv)
 
 	binaryname = "testoutput";
 
+	if ((r = ring_create(OUTRING, NS_RING_NSLOTS, NS_OUTRING_SLOTSIZE)) < 0)
+		panic("ring_create: %e", r);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
 	else if (output_envid == 0)
 	{
-		output(ns_envid);
+		output(OUTRING);
 		return;
 	}
+	ring_set_consumer(OUTRING, output_envid, 0);
 
 	for (i = 0; i < TESTOUTPUT_COUNT; i++)
 	{
-		if ((r = sys_page_alloc(0, pkt, PTE_P | PTE_U | PTE_W)) < 0)
-			panic("sys_page_alloc: %e", r);
+		struct jif_pkt *pkt;
+
+		while ((pkt = ring_reserve(OUTRING)) == NULL)
+			sys_yield();
 		pkt->jp_len = snprintf(pkt->jp_data,
-							   PGSIZE - sizeof(pkt->jp_len),
+							   NS_OUTRING_SLOTSIZE - sizeof(*pkt),
 							   "Packet %02d", i);
+		pkt->jp_flags = 0;
 		cprintf("Transmitting packet %d\n", i);
-		ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P | PTE_W | PTE_U);
-		sys_page_unmap(0, pkt);
+		ring_publish(OUTRING);
 	}
 
-	// Spin for a while, just in case IPC's or packets need to be flushed
+	// Spin for a while, just in case packets need to be flushed
 	for (i = 0; i < TESTOUTPUT_COUNT * 2; i++)
 		sys_yield();
 }
@@ -0,0 +1,131 @@
+// Packets/sec through the raw ns_output and ns_input path, with no
+// network server in between: run with "make run-net_testpps-nox".
+// The output half sends TESTPPS_COUNT minimum-size frames; the input
+// half then counts what arrives for TESTPPS_SECS seconds, so start
+// "./loadgen flood <PORT7>" on the host first to give it something to
+// count.  Results are "testpps <key> <value>" lines.
+
+#include "ns.h"
+#include <netif/etharp.h>
+
+#ifndef TESTPPS_COUNT
+#define TESTPPS_COUNT 20000
+#endif
+#ifndef TESTPPS_SECS
+#define TESTPPS_SECS 5
+#endif
+
+// The same gratuitous announcement as testinput's, so that QEMU's
+// user-mode network knows where to deliver the flood.
+static void
+announce(void)
+{
+	uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+	uint32_t myip = inet_addr(IP);
+	uint32_t gwip = inet_addr(DEFAULT);
+	struct etharp_hdr *arp;
+	struct jif_pkt *pkt;
+
+	while ((pkt = ring_reserve(OUTRING)) == NULL)
+		sys_yield();
+	arp = (struct etharp_hdr *) pkt->jp_data;
+	pkt->jp_len = sizeof(*arp);
+	pkt->jp_flags = 0;
+	memset(arp->ethhdr.dest.addr, 0xff, ETHARP_HWADDR_LEN);
+	memcpy(arp->ethhdr.src.addr, mac, ETHARP_HWADDR_LEN);
+	arp->ethhdr.type = htons(ETHTYPE_ARP);
+	arp->hwtype = htons(1); // Ethernet
+	arp->proto = htons(ETHTYPE_IP);
+	arp->_hwlen_protolen = htons((ETHARP_HWADDR_LEN << 8) | 4);
+	arp->opcode = htons(ARP_REQUEST);
+	memcpy(arp->shwaddr.addr, mac, ETHARP_HWADDR_LEN);
+	memcpy(arp->sipaddr.addrw, &myip, 4);
+	memset(arp->dhwaddr.addr, 0x00, ETHARP_HWADDR_LEN);
+	memcpy(arp->dipaddr.addrw, &gwip, 4);
+	ring_publish(OUTRING);
+}
+
+static void
+output_pps(void)
+{
+	struct jif_pkt *pkt;
+	uint64_t start;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < TESTPPS_COUNT; i++)
+	{
+		while ((pkt = ring_reserve(OUTRING)) == NULL)
+			sys_yield();
+		// A minimum-size broadcast frame of the local experimental
+		// EtherType, which nothing on the other side answers
+		memset(pkt->jp_data, 0xff, ETHARP_HWADDR_LEN);
+		memset(pkt->jp_data + ETHARP_HWADDR_LEN, 0, 60 - ETHARP_HWADDR_LEN);
+		pkt->jp_data[12] = 0x88;
+		pkt->jp_data[13] = 0xb5;
+		pkt->jp_len = 60;
+		pkt->jp_flags = 0;
+		ring_publish(OUTRING);
+	}
+	// Done once the card has taken every slot back
+	while (ring_reserve_nth(OUTRING, NS_RING_NSLOTS - 1) == NULL)
+		sys_yield();
+	if (uinfo.tsc_khz)
+		cprintf("testpps output_pps %llu\n", (uint64_t) TESTPPS_COUNT *
+				uinfo.tsc_khz * 1000 / (read_tsc() - start));
+}
+
+static void
+input_pps(void)
+{
+	uint32_t n = 0, stop = time_msec() + TESTPPS_SECS * 1000;
+	int32_t wait;
+
+	while ((wait = (int32_t) (stop - time_msec())) > 0)
+	{
+		while (ring_peek(INRING) != NULL)
+		{
+			ring_release(INRING);
+			n++;
+		}
+		if (ring_arm(INRING))
+			ipc_recv_timeout(0, 0, 1, 0, wait);
+	}
+	cprintf("testpps input_pps %u\n", n / TESTPPS_SECS);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ns_envid = sys_getenvid(), envid;
+	int r;
+
+	binaryname = "testpps";
+
+	if ((r = ring_create(INRING, NS_RING_NSLOTS, NS_RING_SLOTSIZE)) < 0 ||
+		(r = ring_create(OUTRING, NS_RING_NSLOTS, NS_OUTRING_SLOTSIZE)) < 0)
+		panic("ring_create: %e", r);
+	ring_set_consumer(INRING, ns_envid, NSREQ_INPUT);
+
+	if ((envid = fork()) < 0)
+		panic("error forking");
+	else if (envid == 0)
+	{
+		output(OUTRING);
+		return;
+	}
+	ring_set_consumer(OUTRING, envid, 0);
+
+	if ((envid = fork()) < 0)
+		panic("error forking");
+	else if (envid == 0)
+	{
+		input(INRING, 0);
+		return;
+	}
+
+	output_pps();
+	announce();
+	input_pps();
+	cprintf("testpps done\n");
+}
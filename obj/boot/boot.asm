@@ -0,0 +1,369 @@
+
+obj/boot/boot.out:     file format elf32-i386
+
+
+Disassembly of section .text:
+
+00007c00 <start>:
+.set CR0_PE_ON,      0x1         # protected mode enable flag
+
+.globl start
+start:
+  .code16                     # Assemble for 16-bit mode
+  cli                         # Disable interrupts
+    7c00:	fa                   	cli
+  cld                         # String operations increment
+    7c01:	fc                   	cld
+
+  # Set up the important data segment registers (DS, ES, SS).
+  xorw    %ax,%ax             # Segment number zero
+    7c02:	31 c0                	xor    %eax,%eax
+  movw    %ax,%ds             # -> Data Segment
+    7c04:	8e d8                	mov    %eax,%ds
+  movw    %ax,%es             # -> Extra Segment
+    7c06:	8e c0                	mov    %eax,%es
+  movw    %ax,%ss             # -> Stack Segment
+    7c08:	8e d0                	mov    %eax,%ss
+
+00007c0a <seta20.1>:
+  # Enable A20:
+  #   For backwards compatibility with the earliest PCs, physical
+  #   address line 20 is tied low, so that addresses higher than
+  #   1MB wrap around to zero by default.  This code undoes this.
+seta20.1:
+  inb     $0x64,%al               # Wait for not busy
+    7c0a:	e4 64                	in     $0x64,%al
+  testb   $0x2,%al
+    7c0c:	a8 02                	test   $0x2,%al
+  jnz     seta20.1
+    7c0e:	75 fa                	jne    7c0a <seta20.1>
+
+  movb    $0xd1,%al               # 0xd1 -> port 0x64
+    7c10:	b0 d1                	mov    $0xd1,%al
+  outb    %al,$0x64
+    7c12:	e6 64                	out    %al,$0x64
+
+00007c14 <seta20.2>:
+
+seta20.2:
+  inb     $0x64,%al               # Wait for not busy
+    7c14:	e4 64                	in     $0x64,%al
+  testb   $0x2,%al
+    7c16:	a8 02                	test   $0x2,%al
+  jnz     seta20.2
+    7c18:	75 fa                	jne    7c14 <seta20.2>
+
+  movb    $0xdf,%al               # 0xdf -> port 0x60
+    7c1a:	b0 df                	mov    $0xdf,%al
+  outb    %al,$0x60
+    7c1c:	e6 60                	out    %al,$0x60
+
+  # Switch from real to protected mode, using a bootstrap GDT
+  # and segment translation that makes virtual addresses 
+  # identical to their physical addresses, so that the 
+  # effective memory map does not change during the switch.
+  lgdt    gdtdesc
+    7c1e:	0f 01 16             	lgdtl  (%esi)
+    7c21:	64 7c 0f             	fs jl  7c33 <protcseg+0x1>
+  movl    %cr0, %eax
+    7c24:	20 c0                	and    %al,%al
+  orl     $CR0_PE_ON, %eax
+    7c26:	66 83 c8 01          	or     $0x1,%ax
+  movl    %eax, %cr0
+    7c2a:	0f 22 c0             	mov    %eax,%cr0
+  
+  # Jump to next instruction, but in 32-bit code segment.
+  # Switches processor into 32-bit mode.
+  ljmp    $PROT_MODE_CSEG, $protcseg
+    7c2d:	ea                   	.byte 0xea
+    7c2e:	32 7c 08 00          	xor    0x0(%eax,%ecx,1),%bh
+
+00007c32 <protcseg>:
+
+  .code32                     # Assemble for 32-bit mode
+protcseg:
+  # Set up the protected-mode data segment registers
+  movw    $PROT_MODE_DSEG, %ax    # Our data segment selector
+    7c32:	66 b8 10 00          	mov    $0x10,%ax
+  movw    %ax, %ds                # -> DS: Data Segment
+    7c36:	8e d8                	mov    %eax,%ds
+  movw    %ax, %es                # -> ES: Extra Segment
+    7c38:	8e c0                	mov    %eax,%es
+  movw    %ax, %fs                # -> FS
+    7c3a:	8e e0                	mov    %eax,%fs
+  movw    %ax, %gs                # -> GS
+    7c3c:	8e e8                	mov    %eax,%gs
+  movw    %ax, %ss                # -> SS: Stack Segment
+    7c3e:	8e d0                	mov    %eax,%ss
+  
+  # Set up the stack pointer and call into C.
+  movl    $start, %esp
+    7c40:	bc 00 7c 00 00       	mov    $0x7c00,%esp
+  call bootmain
+    7c45:	e8 0a 01 00 00       	call   7d54 <bootmain>
+
+00007c4a <spin>:
+
+  # If bootmain returns (it shouldn't), loop.
+spin:
+  jmp spin
+    7c4a:	eb fe                	jmp    7c4a <spin>
+
+00007c4c <gdt>:
+	...
+    7c54:	ff                   	(bad)
+    7c55:	ff 00                	incl   (%eax)
+    7c57:	00 00                	add    %al,(%eax)
+    7c59:	9a cf 00 ff ff 00 00 	lcall  $0x0,$0xffff00cf
+    7c60:	00                   	.byte 0x0
+    7c61:	92                   	xchg   %eax,%edx
+    7c62:	cf                   	iret
+	...
+
+00007c64 <gdtdesc>:
+    7c64:	17                   	pop    %ss
+    7c65:	00 4c 7c 00          	add    %cl,0x0(%esp,%edi,2)
+	...
+
+00007c6a <waitdisk>:
+
+static inline uint8_t
+inb(int port)
+{
+	uint8_t data;
+	asm volatile("inb %w1,%0" : "=a" (data) : "d" (port));
+    7c6a:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7c6f:	ec                   	in     (%dx),%al
+
+void
+waitdisk(void)
+{
+	// wait for disk reaady
+	while ((inb(0x1F7) & 0xC0) != 0x40)
+    7c70:	83 e0 c0             	and    $0xffffffc0,%eax
+    7c73:	3c 40                	cmp    $0x40,%al
+    7c75:	75 f8                	jne    7c6f <waitdisk+0x5>
+		/* do nothing */;
+}
+    7c77:	c3                   	ret
+
+00007c78 <readsects>:
+
+// Read 'nsecs' sectors, 1 to MAXSECTS, from sector 'offset' into 'dst'
+// with a single command.
+void
+readsects(void *dst, uint32_t offset, uint32_t nsecs)
+{
+    7c78:	55                   	push   %ebp
+    7c79:	89 e5                	mov    %esp,%ebp
+    7c7b:	57                   	push   %edi
+    7c7c:	56                   	push   %esi
+    7c7d:	53                   	push   %ebx
+    7c7e:	83 ec 0c             	sub    $0xc,%esp
+    7c81:	8b 5d 10             	mov    0x10(%ebp),%ebx
+    7c84:	8b 75 08             	mov    0x8(%ebp),%esi
+    7c87:	8b 4d 0c             	mov    0xc(%ebp),%ecx
+	// wait for disk to be ready
+	waitdisk();
+    7c8a:	e8 db ff ff ff       	call   7c6a <waitdisk>
+}
+
+static inline void
+outb(int port, uint8_t data)
+{
+	asm volatile("outb %0,%w1" : : "a" (data), "d" (port));
+    7c8f:	ba f2 01 00 00       	mov    $0x1f2,%edx
+    7c94:	89 d8                	mov    %ebx,%eax
+    7c96:	ee                   	out    %al,(%dx)
+    7c97:	ba f3 01 00 00       	mov    $0x1f3,%edx
+    7c9c:	89 c8                	mov    %ecx,%eax
+    7c9e:	ee                   	out    %al,(%dx)
+
+	outb(0x1F2, nsecs);    // count; 0 means 256
+	outb(0x1F3, offset);
+	outb(0x1F4, offset >> 8);
+    7c9f:	89 c8                	mov    %ecx,%eax
+    7ca1:	ba f4 01 00 00       	mov    $0x1f4,%edx
+    7ca6:	c1 e8 08             	shr    $0x8,%eax
+    7ca9:	ee                   	out    %al,(%dx)
+	outb(0x1F5, offset >> 16);
+    7caa:	89 c8                	mov    %ecx,%eax
+    7cac:	ba f5 01 00 00       	mov    $0x1f5,%edx
+    7cb1:	c1 e8 10             	shr    $0x10,%eax
+    7cb4:	ee                   	out    %al,(%dx)
+	outb(0x1F6, (offset >> 24) | 0xE0);
+    7cb5:	89 c8                	mov    %ecx,%eax
+    7cb7:	ba f6 01 00 00       	mov    $0x1f6,%edx
+    7cbc:	c1 e8 18             	shr    $0x18,%eax
+    7cbf:	83 c8 e0             	or     $0xffffffe0,%eax
+    7cc2:	ee                   	out    %al,(%dx)
+    7cc3:	b0 20                	mov    $0x20,%al
+    7cc5:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7cca:	ee                   	out    %al,(%dx)
+	outb(0x1F7, 0x20);    // cmd 0x20 - read sectors
+
+	// the disk raises DRQ for each sector in turn
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE)
+    7ccb:	85 db                	test   %ebx,%ebx
+    7ccd:	74 1d                	je     7cec <readsects+0x74>
+	{
+		// wait for disk to be ready
+		waitdisk();
+    7ccf:	e8 96 ff ff ff       	call   7c6a <waitdisk>
+	asm volatile("cld\n\trepne\n\tinsl"
+    7cd4:	89 f7                	mov    %esi,%edi
+    7cd6:	b9 80 00 00 00       	mov    $0x80,%ecx
+    7cdb:	ba f0 01 00 00       	mov    $0x1f0,%edx
+    7ce0:	fc                   	cld
+    7ce1:	f2 6d                	repnz insl (%dx),%es:(%edi)
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE)
+    7ce3:	4b                   	dec    %ebx
+    7ce4:	81 c6 00 02 00 00    	add    $0x200,%esi
+    7cea:	eb df                	jmp    7ccb <readsects+0x53>
+
+		// read a sector
+		insl(0x1F0, dst, SECTSIZE / 4);
+	}
+}
+    7cec:	83 c4 0c             	add    $0xc,%esp
+    7cef:	5b                   	pop    %ebx
+    7cf0:	5e                   	pop    %esi
+    7cf1:	5f                   	pop    %edi
+    7cf2:	5d                   	pop    %ebp
+    7cf3:	c3                   	ret
+
+00007cf4 <readseg>:
+{
+    7cf4:	55                   	push   %ebp
+    7cf5:	89 e5                	mov    %esp,%ebp
+    7cf7:	57                   	push   %edi
+    7cf8:	56                   	push   %esi
+    7cf9:	53                   	push   %ebx
+    7cfa:	83 ec 1c             	sub    $0x1c,%esp
+	offset = (offset / SECTSIZE) + 1;
+    7cfd:	8b 75 10             	mov    0x10(%ebp),%esi
+{
+    7d00:	8b 5d 08             	mov    0x8(%ebp),%ebx
+	end_pa = pa + count;
+    7d03:	8b 55 0c             	mov    0xc(%ebp),%edx
+	offset = (offset / SECTSIZE) + 1;
+    7d06:	c1 ee 09             	shr    $0x9,%esi
+	end_pa = pa + count;
+    7d09:	01 da                	add    %ebx,%edx
+	offset = (offset / SECTSIZE) + 1;
+    7d0b:	46                   	inc    %esi
+	pa &= ~(SECTSIZE - 1);
+    7d0c:	81 e3 00 fe ff ff    	and    $0xfffffe00,%ebx
+	while (pa < end_pa)
+    7d12:	39 d3                	cmp    %edx,%ebx
+    7d14:	73 36                	jae    7d4c <readseg+0x58>
+		n = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+    7d16:	8d 82 ff 01 00 00    	lea    0x1ff(%edx),%eax
+			n = MAXSECTS;
+    7d1c:	bf 00 01 00 00       	mov    $0x100,%edi
+		n = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+    7d21:	29 d8                	sub    %ebx,%eax
+		if (n > MAXSECTS)
+    7d23:	3d ff 01 02 00       	cmp    $0x201ff,%eax
+    7d28:	77 05                	ja     7d2f <readseg+0x3b>
+		n = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+    7d2a:	c1 e8 09             	shr    $0x9,%eax
+    7d2d:	89 c7                	mov    %eax,%edi
+    7d2f:	89 55 e4             	mov    %edx,-0x1c(%ebp)
+		readsects((uint8_t *) pa, offset, n);
+    7d32:	50                   	push   %eax
+    7d33:	57                   	push   %edi
+    7d34:	56                   	push   %esi
+		offset += n;
+    7d35:	01 fe                	add    %edi,%esi
+		readsects((uint8_t *) pa, offset, n);
+    7d37:	53                   	push   %ebx
+    7d38:	e8 3b ff ff ff       	call   7c78 <readsects>
+		pa += n * SECTSIZE;
+    7d3d:	89 f8                	mov    %edi,%eax
+		offset += n;
+    7d3f:	8b 55 e4             	mov    -0x1c(%ebp),%edx
+    7d42:	83 c4 10             	add    $0x10,%esp
+		pa += n * SECTSIZE;
+    7d45:	c1 e0 09             	shl    $0x9,%eax
+    7d48:	01 c3                	add    %eax,%ebx
+		offset += n;
+    7d4a:	eb c6                	jmp    7d12 <readseg+0x1e>
+}
+    7d4c:	8d 65 f4             	lea    -0xc(%ebp),%esp
+    7d4f:	5b                   	pop    %ebx
+    7d50:	5e                   	pop    %esi
+    7d51:	5f                   	pop    %edi
+    7d52:	5d                   	pop    %ebp
+    7d53:	c3                   	ret
+
+00007d54 <bootmain>:
+{
+    7d54:	55                   	push   %ebp
+    7d55:	89 e5                	mov    %esp,%ebp
+    7d57:	56                   	push   %esi
+    7d58:	53                   	push   %ebx
+	readseg((uint32_t) ELFHDR, SECTSIZE * 8, 0);
+    7d59:	52                   	push   %edx
+    7d5a:	6a 00                	push   $0x0
+    7d5c:	68 00 10 00 00       	push   $0x1000
+    7d61:	68 00 00 01 00       	push   $0x10000
+    7d66:	e8 89 ff ff ff       	call   7cf4 <readseg>
+	if (ELFHDR->e_magic != ELF_MAGIC)
+    7d6b:	83 c4 10             	add    $0x10,%esp
+    7d6e:	81 3d 00 00 01 00 7f 	cmpl   $0x464c457f,0x10000
+    7d75:	45 4c 46 
+    7d78:	75 51                	jne    7dcb <bootmain+0x77>
+	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
+    7d7a:	a1 1c 00 01 00       	mov    0x1001c,%eax
+	eph = ph + ELFHDR->e_phnum;
+    7d7f:	0f b7 35 2c 00 01 00 	movzwl 0x1002c,%esi
+	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
+    7d86:	8d 98 00 00 01 00    	lea    0x10000(%eax),%ebx
+	eph = ph + ELFHDR->e_phnum;
+    7d8c:	c1 e6 05             	shl    $0x5,%esi
+    7d8f:	01 de                	add    %ebx,%esi
+	for (; ph < eph; ph++)
+    7d91:	39 f3                	cmp    %esi,%ebx
+    7d93:	73 30                	jae    7dc5 <bootmain+0x71>
+		readseg(ph->p_pa, ph->p_memsz, ph->p_offset);
+    7d95:	50                   	push   %eax
+    7d96:	ff 73 04             	push   0x4(%ebx)
+    7d99:	ff 73 14             	push   0x14(%ebx)
+    7d9c:	ff 73 0c             	push   0xc(%ebx)
+    7d9f:	e8 50 ff ff ff       	call   7cf4 <readseg>
+		for (i = 0; i < ph->p_memsz - ph->p_filesz; i++)
+    7da4:	83 c4 10             	add    $0x10,%esp
+    7da7:	31 d2                	xor    %edx,%edx
+    7da9:	8b 43 10             	mov    0x10(%ebx),%eax
+    7dac:	8b 4b 14             	mov    0x14(%ebx),%ecx
+    7daf:	29 c1                	sub    %eax,%ecx
+    7db1:	39 ca                	cmp    %ecx,%edx
+    7db3:	73 0b                	jae    7dc0 <bootmain+0x6c>
+			*((char *) ph->p_pa + ph->p_filesz + i) = 0;
+    7db5:	01 d0                	add    %edx,%eax
+    7db7:	03 43 0c             	add    0xc(%ebx),%eax
+		for (i = 0; i < ph->p_memsz - ph->p_filesz; i++)
+    7dba:	42                   	inc    %edx
+			*((char *) ph->p_pa + ph->p_filesz + i) = 0;
+    7dbb:	c6 00 00             	movb   $0x0,(%eax)
+		for (i = 0; i < ph->p_memsz - ph->p_filesz; i++)
+    7dbe:	eb e9                	jmp    7da9 <bootmain+0x55>
+	for (; ph < eph; ph++)
+    7dc0:	83 c3 20             	add    $0x20,%ebx
+    7dc3:	eb cc                	jmp    7d91 <bootmain+0x3d>
+	((void (*)(void)) (ELFHDR->e_entry))();
+    7dc5:	ff 15 18 00 01 00    	call   *0x10018
+}
+
+static inline void
+outw(int port, uint16_t data)
+{
+	asm volatile("outw %0,%w1" : : "a" (data), "d" (port));
+    7dcb:	ba 00 8a 00 00       	mov    $0x8a00,%edx
+    7dd0:	b8 00 8a ff ff       	mov    $0xffff8a00,%eax
+    7dd5:	66 ef                	out    %ax,(%dx)
+    7dd7:	b8 00 8e ff ff       	mov    $0xffff8e00,%eax
+    7ddc:	66 ef                	out    %ax,(%dx)
+	while (1)
+    7dde:	eb fe                	jmp    7dde <bootmain+0x8a>
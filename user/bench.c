@@ -0,0 +1,323 @@
+// Microbenchmarks of the kernel and the servers, for tracking
+// regressions between builds.  Each benchmark prints one line,
+//	bench <name> <ops> <cycles/op> <bytes/op>
+// with fields separated by tabs, and a run ends with "bench done"; a
+// benchmark that cannot run prints a "#" comment instead.  Throughput
+// is bytes/op * uinfo.tsc_khz * 1000 / cycles/op bytes a second.
+//	bench		run every benchmark
+//	bench name...	run just these
+// "make bench" boots JOS with this as its only program and collects
+// the lines.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define BENCH_VA        ((char *) 0x20000000)  // pages the page benchmarks use
+#define BENCH_VA2       ((char *) 0x30000000)  // ... and map them to
+#define BENCH_NPAGES    256
+#define BENCH_CHUNK     4096                   // bytes per pipe, file, TCP op
+#define BENCH_FILE      "/bench.tmp"
+#define BENCH_PORT      7001
+#define BENCH_IP        "10.0.2.15"            // ours: lwIP loops it back
+
+static char buf[BENCH_CHUNK];
+
+static void
+report(const char *name, uint32_t ops, uint64_t cycles, uint32_t bytes)
+{
+	printf("bench\t%s\t%u\t%llu\t%u\n", name, ops, ops ? cycles / ops : 0, bytes);
+}
+
+static void
+null_syscall(void)
+{
+	const uint32_t n = 10000;
+	uint64_t start;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		sys_getenvid();
+	report("null_syscall", n, read_tsc() - start, 0);
+}
+
+static void
+ipc_round_trip(void)
+{
+	const uint32_t n = 2000;
+	uint64_t start;
+	uint32_t i, v;
+	envid_t child, whom;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+	{
+		v = ipc_recv(&whom, 0, 0);
+		while (1)
+			v = ipc_reply_wait(whom, v, 0, 0, &whom, 0, 0);
+	}
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		ipc_call(child, i, 0, 0, 0, 0);
+	report("ipc_round_trip", n, read_tsc() - start, 0);
+	sys_env_destroy(child);
+}
+
+static void
+page_ops(void)
+{
+	uint64_t start;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < BENCH_NPAGES; i++)
+		if ((r = sys_page_alloc(0, BENCH_VA + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	report("page_alloc", BENCH_NPAGES, read_tsc() - start, 0);
+
+	start = read_tsc();
+	for (i = 0; i < BENCH_NPAGES; i++)
+		if ((r = sys_page_map(0, BENCH_VA + i * PGSIZE, 0, BENCH_VA2 + i * PGSIZE,
+							  PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_map: %e", r);
+	report("page_map", BENCH_NPAGES, read_tsc() - start, 0);
+
+	start = read_tsc();
+	for (i = 0; i < BENCH_NPAGES; i++)
+		sys_page_unmap(0, BENCH_VA2 + i * PGSIZE);
+	report("page_unmap", BENCH_NPAGES, read_tsc() - start, 0);
+	for (i = 0; i < BENCH_NPAGES; i++)
+		sys_page_unmap(0, BENCH_VA + i * PGSIZE);
+}
+
+// The child writes to every page of a region it shares copy-on-write
+// with us, and sends back how long that took.
+static void
+cow_fault(void)
+{
+	uint64_t start;
+	uint32_t cycles;
+	envid_t child;
+	int i, r;
+
+	for (i = 0; i < BENCH_NPAGES; i++)
+	{
+		if ((r = sys_page_alloc(0, BENCH_VA + i * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		BENCH_VA[i * PGSIZE] = i;
+	}
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+	{
+		start = read_tsc();
+		for (i = 0; i < BENCH_NPAGES; i++)
+			BENCH_VA[i * PGSIZE]++;
+		ipc_send(thisenv->env_parent_id, (uint32_t) (read_tsc() - start), 0, 0);
+		exit();
+	}
+	cycles = ipc_recv(0, 0, 0);
+	wait(child);
+	report("cow_fault", BENCH_NPAGES, cycles, 0);
+	for (i = 0; i < BENCH_NPAGES; i++)
+		sys_page_unmap(0, BENCH_VA + i * PGSIZE);
+}
+
+static void
+fork_exit(void)
+{
+	const uint32_t n = 50;
+	uint64_t start;
+	envid_t child;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+	{
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		wait(child);
+	}
+	report("fork_exit", n, read_tsc() - start, 0);
+}
+
+static void
+spawn_wait(void)
+{
+	const uint32_t n = 20;
+	uint64_t start;
+	envid_t child;
+	uint32_t i;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+	{
+		if ((child = spawnl("/bench", "bench", "-exit", (char *) 0)) < 0)
+		{
+			printf("# spawn_wait: spawn: %e\n", child);
+			return;
+		}
+		wait(child);
+	}
+	report("spawn_wait", n, read_tsc() - start, 0);
+}
+
+static void
+pipe_throughput(void)
+{
+	const uint32_t n = 256;
+	uint64_t start;
+	envid_t child;
+	uint32_t i;
+	int p[2], r;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+	{
+		close(p[0]);
+		for (i = 0; i < n; i++)
+			write(p[1], buf, sizeof(buf));
+		exit();
+	}
+	close(p[1]);
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		if ((r = readn(p[0], buf, sizeof(buf))) != sizeof(buf))
+			panic("pipe read: %e", r);
+	report("pipe_throughput", n, read_tsc() - start, sizeof(buf));
+	close(p[0]);
+	wait(child);
+}
+
+static void
+file_throughput(void)
+{
+	const uint32_t n = 64;
+	uint64_t start;
+	uint32_t i;
+	int fd, r;
+
+	if ((fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+	{
+		printf("# file_write: open %s: %e\n", BENCH_FILE, fd);
+		return;
+	}
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		if ((r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("file write: %e", r);
+	report("file_write", n, read_tsc() - start, sizeof(buf));
+
+	seek(fd, 0);
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		if ((r = readn(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("file read: %e", r);
+	report("file_read", n, read_tsc() - start, sizeof(buf));
+	// There is no remove(), but the blocks can go back
+	ftruncate(fd, 0);
+	close(fd);
+}
+
+// The child accepts one connection and reads it to the end; the time
+// is from connect to the child's exit.
+static void
+tcp_loopback(void)
+{
+	const uint32_t n = 256;
+	struct sockaddr_in addr;
+	uint64_t start;
+	envid_t child;
+	uint32_t i;
+	int s, c;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	if ((s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+		bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(s, 1) < 0)
+	{
+		printf("# tcp_loopback: cannot listen on port %d\n", BENCH_PORT);
+		return;
+	}
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+	{
+		if ((c = accept(s, 0, 0)) < 0)
+			exit();
+		while (read(c, buf, sizeof(buf)) > 0)
+			/* do nothing */;
+		exit();
+	}
+	close(s);
+
+	addr.sin_addr.s_addr = inet_addr(BENCH_IP);
+	start = read_tsc();
+	if ((s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+		connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		printf("# tcp_loopback: cannot connect to %s\n", BENCH_IP);
+		sys_env_destroy(child);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		if (write(s, buf, sizeof(buf)) != sizeof(buf))
+			panic("tcp write failed");
+	close(s);
+	wait(child);
+	report("tcp_loopback", n, read_tsc() - start, sizeof(buf));
+}
+
+static struct {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "null_syscall", null_syscall },
+	{ "ipc_round_trip", ipc_round_trip },
+	{ "page", page_ops },
+	{ "cow_fault", cow_fault },
+	{ "fork_exit", fork_exit },
+	{ "spawn_wait", spawn_wait },
+	{ "pipe_throughput", pipe_throughput },
+	{ "file", file_throughput },
+	{ "tcp_loopback", tcp_loopback },
+};
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, r;
+
+	binaryname = "bench";
+	// What spawn_wait spawns
+	if (argc == 2 && strcmp(argv[1], "-exit") == 0)
+		return;
+	// Run straight from the kernel by make bench, with no fds open yet
+	if (thisenv->env_parent_id == 0)
+	{
+		if ((r = opencons()) < 0)
+			panic("opencons: %e", r);
+		if (r != 1 && (r = dup(r, 1)) < 0)
+			panic("dup: %e", r);
+	}
+
+	printf("# bench\tname\tops\tcycles/op\tbytes/op, %u kHz TSC\n", uinfo.tsc_khz);
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+	{
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				break;
+		if (argc == 1 || j < argc)
+			benches[i].fn();
+	}
+	printf("bench done\n");
+}
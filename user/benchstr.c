@@ -0,0 +1,124 @@
+// Time lib/string.c's word-at-a-time strlen, strcmp, strchr and memcmp
+// against the byte loops they replaced, on names like the file system's.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER   2000
+
+static const char *names[] = {
+	"/", "sh", "init", "motd", "newmotd", "index.html",
+	"a-longer-file-name-in-a-big-directory.txt",
+	"/usr/share/doc/some/deeply/nested/path/to/a/file/name",
+};
+#define NNAMES  ARRAY_SIZE(names)
+
+// Copies, so that strcmp and memcmp look at different memory
+static char copies[NNAMES][64];
+
+static int
+byte_strlen(const char *s)
+{
+	int n;
+
+	for (n = 0; *s != '\0'; s++)
+		n++;
+	return n;
+}
+
+static int
+byte_strcmp(const char *p, const char *q)
+{
+	while (*p && *p == *q)
+		p++, q++;
+	return (int) ((unsigned char) *p - (unsigned char) *q);
+}
+
+static char *
+byte_strchr(const char *s, char c)
+{
+	for (; *s; s++)
+		if (*s == c)
+			return (char *) s;
+	return 0;
+}
+
+static int
+byte_memcmp(const void *v1, const void *v2, size_t n)
+{
+	const uint8_t *s1 = v1, *s2 = v2;
+
+	while (n-- > 0)
+	{
+		if (*s1 != *s2)
+			return (int) *s1 - (int) *s2;
+		s1++, s2++;
+	}
+	return 0;
+}
+
+// All of the benchmarks call through these, so that neither version
+// is inlined away.
+static int (*volatile fstrlen)(const char *);
+static int (*volatile fstrcmp)(const char *, const char *);
+static char *(*volatile fstrchr)(const char *, char);
+static int (*volatile fmemcmp)(const void *, const void *, size_t);
+static volatile int sink;
+
+// Cycles per call of the routine 'which' names, for the current set.
+static uint32_t
+run(int which)
+{
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		for (j = 0; j < NNAMES; j++)
+			switch (which)
+			{
+			case 0:
+				sink = fstrlen(names[j]);
+				break;
+			case 1:
+				sink = fstrcmp(names[j], copies[j]);
+				break;
+			case 2:
+				sink = fstrchr(names[j], '#') != 0;
+				break;
+			case 3:
+				sink = fmemcmp(names[j], copies[j], strlen(names[j]));
+				break;
+			}
+	return (uint32_t) (read_tsc() - start) / (NITER * NNAMES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const char *routines[] = { "strlen", "strcmp", "strchr", "memcmp" };
+	uint32_t bytes[4], words[4];
+	int i;
+
+	for (i = 0; i < NNAMES; i++)
+		strcpy(copies[i], names[i]);
+
+	fstrlen = byte_strlen;
+	fstrcmp = byte_strcmp;
+	fstrchr = byte_strchr;
+	fmemcmp = byte_memcmp;
+	for (i = 0; i < 4; i++)
+		bytes[i] = run(i);
+
+	fstrlen = strlen;
+	fstrcmp = strcmp;
+	fstrchr = strchr;
+	fmemcmp = memcmp;
+	for (i = 0; i < 4; i++)
+		words[i] = run(i);
+
+	printf("cycles per call, %d names:\n", NNAMES);
+	printf("%-8s %8s %8s\n", "", "bytes", "words");
+	for (i = 0; i < 4; i++)
+		printf("%-8s %8u %8u\n", routines[i], bytes[i], words[i]);
+}
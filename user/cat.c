@@ -1,18 +1,14 @@
 #include <inc/lib.h>
 
-char buf[8192];
-
 void
 cat(int f, char *s)
 {
 	long n;
-	int r;
 
-	while ((n = read(f, buf, (long) sizeof(buf))) > 0)
-		if ((r = write(1, buf, n)) != n)
-			panic("write error copying %s: %e", s, r);
+	while ((n = splice(f, 1, ~0U)) > 0)
+		/* do nothing */;
 	if (n < 0)
-		panic("error reading %s: %e", s, n);
+		panic("error copying %s: %e", s, n);
 }
 
 void
@@ -0,0 +1,236 @@
+// File-system benchmarks: sequential and random reads and writes,
+// small-file create, open and stat rates, and directory lookups, each
+// timed with the server's caches warm and, where it differs, cold,
+// just after drop_caches().  Output is as user/bench's,
+//	fsbench <name> <ops> <cycles/op> <bytes/op>
+// tab-separated, ending with "fsbench done".
+//	fsbench		run everything
+//	fsbench name...	run just these groups: seq, random, small, lookup
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FSB_DATA        "/fsbench.dat"
+#define FSB_SIZE        (256 * 1024)    // bytes in FSB_DATA
+#define FSB_CHUNK       4096
+#define FSB_NFILES      64              // small files, in the root
+#define FSB_NRANDOM     128             // random reads or writes
+
+static char buf[FSB_CHUNK];
+static char path[MAXPATHLEN];
+
+static void
+report(const char *name, const char *cache, uint32_t ops, uint64_t cycles,
+	   uint32_t bytes)
+{
+	printf("fsbench\t%s%s\t%u\t%llu\t%u\n", name, cache, ops,
+		   ops ? cycles / ops : 0, bytes);
+}
+
+static int
+xopen(const char *p, int mode)
+{
+	int fd;
+
+	if ((fd = open(p, mode)) < 0)
+		panic("open %s: %e", p, fd);
+	return fd;
+}
+
+static const char *
+small_file(int i)
+{
+	snprintf(path, sizeof(path), "/fsbench.%03d", i);
+	return path;
+}
+
+// Start each cold run with nothing cached
+static void
+cool(bool cold)
+{
+	int r;
+
+	if (cold && (r = drop_caches()) < 0)
+		panic("drop_caches: %e", r);
+}
+
+static const char *
+cache_name(bool cold)
+{
+	return cold ? "_cold" : "_warm";
+}
+
+static void
+seq(void)
+{
+	uint64_t start;
+	int fd, i, r, cold;
+
+	fd = xopen(FSB_DATA, O_RDWR | O_CREAT | O_TRUNC);
+	start = read_tsc();
+	for (i = 0; i < FSB_SIZE / FSB_CHUNK; i++)
+		if ((r = write(fd, buf, FSB_CHUNK)) != FSB_CHUNK)
+			panic("write: %e", r);
+	report("seq_write", "", FSB_SIZE / FSB_CHUNK, read_tsc() - start, FSB_CHUNK);
+	close(fd);
+
+	for (cold = 1; cold >= 0; cold--)
+	{
+		cool(cold);
+		fd = xopen(FSB_DATA, O_RDONLY);
+		start = read_tsc();
+		for (i = 0; i < FSB_SIZE / FSB_CHUNK; i++)
+			if ((r = readn(fd, buf, FSB_CHUNK)) != FSB_CHUNK)
+				panic("read: %e", r);
+		report("seq_read", cache_name(cold), FSB_SIZE / FSB_CHUNK,
+			   read_tsc() - start, FSB_CHUNK);
+		close(fd);
+	}
+}
+
+// The same pseudo-random sequence of chunks on every run
+static uint32_t
+next_chunk(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) % (FSB_SIZE / FSB_CHUNK);
+}
+
+static void
+rand_rw(void)
+{
+	uint32_t seed;
+	uint64_t start;
+	int fd, i, r, cold;
+
+	fd = xopen(FSB_DATA, O_RDWR | O_CREAT);
+	if ((r = fallocate(fd, 0, FSB_SIZE)) < 0)
+		panic("fallocate: %e", r);
+	close(fd);
+	for (cold = 1; cold >= 0; cold--)
+	{
+		cool(cold);
+		fd = xopen(FSB_DATA, O_RDONLY);
+		seed = 1;
+		start = read_tsc();
+		for (i = 0; i < FSB_NRANDOM; i++)
+		{
+			seek(fd, next_chunk(&seed) * FSB_CHUNK);
+			if ((r = readn(fd, buf, FSB_CHUNK)) != FSB_CHUNK)
+				panic("read: %e", r);
+		}
+		report("random_read", cache_name(cold), FSB_NRANDOM, read_tsc() - start,
+			   FSB_CHUNK);
+		close(fd);
+
+		cool(cold);
+		fd = xopen(FSB_DATA, O_RDWR);
+		start = read_tsc();
+		for (i = 0; i < FSB_NRANDOM; i++)
+		{
+			seek(fd, next_chunk(&seed) * FSB_CHUNK);
+			if ((r = write(fd, buf, FSB_CHUNK)) != FSB_CHUNK)
+				panic("write: %e", r);
+		}
+		report("random_write", cache_name(cold), FSB_NRANDOM, read_tsc() - start,
+			   FSB_CHUNK);
+		close(fd);
+	}
+}
+
+// There is no remove, so a second run creates over the first's files.
+static void
+small(void)
+{
+	struct Stat st;
+	uint64_t start;
+	int i, r, cold;
+
+	start = read_tsc();
+	for (i = 0; i < FSB_NFILES; i++)
+	{
+		r = xopen(small_file(i), O_WRONLY | O_CREAT | O_TRUNC);
+		write(r, buf, 100);
+		close(r);
+	}
+	report("small_create", "", FSB_NFILES, read_tsc() - start, 100);
+
+	for (cold = 1; cold >= 0; cold--)
+	{
+		cool(cold);
+		start = read_tsc();
+		for (i = 0; i < FSB_NFILES; i++)
+			close(xopen(small_file(i), O_RDONLY));
+		report("small_open", cache_name(cold), FSB_NFILES, read_tsc() - start, 0);
+
+		cool(cold);
+		start = read_tsc();
+		for (i = 0; i < FSB_NFILES; i++)
+			if ((r = stat(small_file(i), &st)) < 0)
+				panic("stat %s: %e", path, r);
+		report("small_stat", cache_name(cold), FSB_NFILES, read_tsc() - start, 0);
+	}
+}
+
+// Lookups of names in the root directory, which holds FSB_NFILES and
+// the file system's programs, found and not found: what open and stat
+// pay per path component.
+static void
+lookup(void)
+{
+	struct Stat st;
+	uint64_t start;
+	int i, cold;
+
+	for (i = 0; i < FSB_NFILES; i++)
+		if (stat(small_file(i), &st) < 0)
+			close(xopen(path, O_WRONLY | O_CREAT));
+	for (cold = 1; cold >= 0; cold--)
+	{
+		cool(cold);
+		start = read_tsc();
+		for (i = FSB_NFILES - 1; i >= 0; i--)
+			stat(small_file(i), &st);
+		report("lookup_hit", cache_name(cold), FSB_NFILES, read_tsc() - start, 0);
+
+		cool(cold);
+		start = read_tsc();
+		for (i = 0; i < FSB_NFILES; i++)
+		{
+			snprintf(path, sizeof(path), "/fsbench.missing%03d", i);
+			if (stat(path, &st) >= 0)
+				panic("stat %s found a file", path);
+		}
+		report("lookup_miss", cache_name(cold), FSB_NFILES, read_tsc() - start, 0);
+	}
+}
+
+static struct {
+	const char *name;
+	void (*fn)(void);
+} groups[] = {
+	{ "seq", seq },
+	{ "random", rand_rw },
+	{ "small", small },
+	{ "lookup", lookup },
+};
+
+void
+umain(int argc, char **argv)
+{
+	int i, j;
+
+	binaryname = "fsbench";
+	memset(buf, 'x', sizeof(buf));
+
+	printf("# fsbench\tname\tops\tcycles/op\tbytes/op, %u kHz TSC\n", uinfo.tsc_khz);
+	for (i = 0; i < ARRAY_SIZE(groups); i++)
+	{
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], groups[i].name) == 0)
+				break;
+		if (argc == 1 || j < argc)
+			groups[i].fn();
+	}
+	printf("fsbench done\n");
+}
@@ -0,0 +1,66 @@
+// Show the file server's counters (see struct FsStats in inc/fs.h).
+//	fsstat			show them
+//	fsstat reset		show them and count afresh
+// Times are in TSC cycles; p50 and p99 are histogram bucket bounds.
+
+#include <inc/lib.h>
+
+static const char *const reqname[FSSTAT_NREQ] = {
+	[FSREQ_OPEN] = "open",
+	[FSREQ_SET_SIZE] = "set_size",
+	[FSREQ_READ] = "read",
+	[FSREQ_WRITE] = "write",
+	[FSREQ_STAT] = "stat",
+	[FSREQ_FLUSH] = "flush",
+	[FSREQ_REMOVE] = "remove",
+	[FSREQ_SYNC] = "sync",
+	[FSREQ_MAP] = "map",
+	[FSREQ_VERSIONS] = "versions",
+	[FSREQ_READV] = "readv",
+	[FSREQ_WRITEV] = "writev",
+	[FSREQ_WRITE_PAGES] = "wrpages",
+	[FSREQ_READDIR] = "readdir",
+	[FSREQ_SESSION] = "session",
+	[FSREQ_DROP_CACHE] = "dropcache",
+	[FSREQ_FALLOCATE] = "fallocate",
+	[FSREQ_STATS] = "stats",
+	[FSREQ_SPLICE] = "splice",
+	[FSREQ_TICK] = "tick",
+	[FSREQ_RECLAIM] = "reclaim",
+	[FSREQ_DISK] = "disk",
+};
+
+static struct FsStats st;
+
+static void
+print_line(const char *name, const struct SysStat *ss)
+{
+	printf("%-10s %10u %10llu %10llu %10llu\n", name, ss->ss_calls,
+		   ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0,
+		   sysstat_percentile(ss, 50), sysstat_percentile(ss, 99));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t i;
+	int r;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0))
+	{
+		printf("usage: fsstat [reset]\n");
+		exit();
+	}
+	if ((r = fs_stats(&st, argc == 2)) < 0)
+		panic("fs_stats: %e", r);
+
+	printf("cache: %u blocks resident, %u of %u lookups missed, %u faults, %u read ahead\n",
+		   st.fs_resident, st.fs_misses, st.fs_lookups, st.fs_faults, st.fs_readahead);
+	printf("disk: %u blocks read, %u written\n", st.fs_blocks_read, st.fs_blocks_written);
+	printf("%-10s %10s %10s %10s %10s\n", "", "count", "avg", "p50<", "p99<");
+	print_line("disk read", &st.fs_disk_read);
+	print_line("disk write", &st.fs_disk_write);
+	for (i = 0; i < FSSTAT_NREQ; i++)
+		if (st.fs_req[i].ss_calls > 0)
+			print_line(reqname[i] ? reqname[i] : "?", &st.fs_req[i]);
+}
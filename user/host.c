@@ -0,0 +1,27 @@
+// Print the address of each host name given, as the network server's
+// resolver finds it.
+//	host name...
+
+#include <inc/lib.h>
+#include <lwip/inet.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct in_addr addr;
+	int i, r;
+
+	binaryname = "host";
+	if (argc < 2)
+	{
+		printf("usage: host name...\n");
+		exit();
+	}
+	for (i = 1; i < argc; i++)
+	{
+		if ((r = gethostaddr(argv[i], &addr)) < 0)
+			printf("%s: %e\n", argv[i], r);
+		else
+			printf("%s has address %s\n", argv[i], inet_ntoa(addr));
+	}
+}
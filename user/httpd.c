@@ -5,17 +5,23 @@
 
 #define PORT 80
 #define VERSION "0.1"
-#define HTTP_VERSION "1.0"
+#define HTTP_VERSION "1.1"
 
 #define E_BAD_REQ    1000
 
-#define BUFFSIZE 512
+#define BUFFSIZE 2048    // Room for a request line and its headers
 #define MAXPENDING 5    // Max connection requests
 
 struct http_request {
 	int sock;
+	struct Arena *arena;    // holds the strings below until req_free
 	char *url;
 	char *version;
+	bool keep_alive;    // Leave the connection open after the response
+	int body_len;       // Content-Length of the request's body
+	bool accept_gzip;   // Accept-Encoding allows gzip
+	char *path;         // The file sent: url, or its .gz sibling
+	bool gzipped;       // ... which it is, sent with Content-Encoding: gzip
 };
 
 struct responce_header {
@@ -49,8 +55,7 @@ die(char *m)
 static void
 req_free(struct http_request *req)
 {
-	free(req->url);
-	free(req->version);
+	arena_reset(req->arena);
 }
 
 static int
@@ -77,20 +82,16 @@ send_header(struct http_request *req, int code)
 }
 
 static int
-send_data(struct http_request *req, int fd)
+send_data(struct http_request *req, int fd, off_t size)
 {
 	// LAB 6: Your code here.
-	char buffer[MAX_ETHERNET_PACKET_SIZE];
+	// sendfile hands the file server's pages straight to the network
+	// server, so the data never passes through this environment.
+	ssize_t r;
 
-	while (1)
-	{
-		ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-		if (bytes_read < 0)
-			return bytes_read;
-		if (bytes_read == 0)
-			return 0;
-		write(req->sock, buffer, bytes_read);
-	}
+	if ((r = sendfile(req->sock, fd, 0, size)) < 0)
+		return r;
+	return r == size ? 0 : -1;
 }
 
 static int
@@ -137,6 +138,34 @@ send_content_type(struct http_request *req)
 	return 0;
 }
 
+// A response from a .gz sibling says so, and that it depends on the
+// request's Accept-Encoding
+#define GZIP_HEADERS    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"
+
+static int
+send_encoding(struct http_request *req)
+{
+	int len = strlen(GZIP_HEADERS);
+
+	if (req->gzipped && write(req->sock, GZIP_HEADERS, len) != len)
+		return -1;
+
+	return 0;
+}
+
+static int
+send_connection(struct http_request *req)
+{
+	const char *conn = req->keep_alive ? "Connection: keep-alive\r\n"
+									   : "Connection: close\r\n";
+	int len = strlen(conn);
+
+	if (write(req->sock, conn, len) != len)
+		return -1;
+
+	return 0;
+}
+
 static int
 send_header_fin(struct http_request *req)
 {
@@ -149,12 +178,72 @@ send_header_fin(struct http_request *req)
 	return 0;
 }
 
-// given a request, this function creates a struct http_request
+// Does header line 'line' have the name 'name' (in lower case)?  If
+// so, return its value, else NULL.
+static const char *
+header_value(const char *line, const char *name)
+{
+	for (; *name; line++, name++)
+	{
+		char c = *line;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != *name)
+			return NULL;
+	}
+	if (*line++ != ':')
+		return NULL;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+// Does the Accept-Encoding header value 'value' allow gzip?  Only a
+// "gzip" (or "*") coding counts, and not with a q of 0.
+static bool
+accepts_gzip(const char *value)
+{
+	const char *tok, *q;
+	int len;
+
+	while (*value && *value != '\r' && *value != '\n')
+	{
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		tok = value;
+		while (*value && *value != ',' && *value != ';' &&
+			   *value != ' ' && *value != '\r' && *value != '\n')
+			value++;
+		len = value - tok;
+		q = value;
+		while (*value && *value != ',' && *value != '\r' && *value != '\n')
+			value++;
+		if (!((len == 4 && strncmp(tok, "gzip", 4) == 0) ||
+			  (len == 1 && *tok == '*')))
+			continue;
+		// "q=0", "q=0.", "q=0.0" and so on turn it off
+		while (q < value && *q != 'q')
+			q++;
+		if (q + 2 < value && q[1] == '=' && q[2] == '0')
+		{
+			for (q += 3; q < value && (*q == '.' || *q == '0'); q++)
+				/* do nothing */;
+			if (q == value || *q == ' ' || *q == '\t')
+				return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+// given a request, this function creates a struct http_request.
+// 'request' is the request line and headers, NUL-terminated.
 static int
 http_request_parse(struct http_request *req, char *request)
 {
 	const char *url;
 	const char *version;
+	const char *value;
 	int url_len, version_len;
 
 	if (!req)
@@ -172,21 +261,37 @@ http_request_parse(struct http_request *req, char *request)
 		request++;
 	url_len = request - url;
 
-	req->url = malloc(url_len + 1);
-	memmove(req->url, url, url_len);
-	req->url[url_len] = '\0';
+	if (!(req->url = arena_strndup(req->arena, url, url_len)))
+		return -E_NO_MEM;
 
 	// skip space
 	request++;
 
 	version = request;
-	while (*request && *request != '\n')
+	while (*request && *request != '\r' && *request != '\n')
 		request++;
 	version_len = request - version;
 
-	req->version = malloc(version_len + 1);
-	memmove(req->version, version, version_len);
-	req->version[version_len] = '\0';
+	if (!(req->version = arena_strndup(req->arena, version, version_len)))
+		return -E_NO_MEM;
+
+	// HTTP/1.1 connections persist unless the client says otherwise
+	req->keep_alive = strcmp(req->version, "HTTP/1.1") == 0;
+	while ((request = strchr(request, '\n')) != NULL && *++request)
+	{
+		if ((value = header_value(request, "connection")) != NULL)
+		{
+			if (strncmp(value, "close", 5) == 0)
+				req->keep_alive = false;
+			else if (strncmp(value, "keep-alive", 10) == 0)
+				req->keep_alive = true;
+		} else if ((value = header_value(request, "content-length")) != NULL)
+			req->body_len = strtol(value, NULL, 10);
+		else if ((value = header_value(request, "accept-encoding")) != NULL)
+			req->accept_gzip = accepts_gzip(value);
+	}
+	if (req->body_len < 0)
+		return -E_BAD_REQ;
 
 	// no entity parsing
 
@@ -210,13 +315,20 @@ send_error(struct http_request *req, int code)
 	if (e->code == 0)
 		return -1;
 
+	char body[128];
+	int body_len = snprintf(body, sizeof(body),
+							"<html><body><p>%d - %s</p></body></html>\r\n",
+							e->code, e->msg);
+
 	r = snprintf(buf, 512, "HTTP/" HTTP_VERSION" %d %s\r\n"
 						   "Server: jhttpd/" VERSION "\r\n"
-						   "Connection: close"
-						   "Content-type: text/html\r\n"
+						   "Connection: %s\r\n"
+						   "Content-Type: text/html\r\n"
+						   "Content-Length: %d\r\n"
 						   "\r\n"
-						   "<html><body><p>%d - %s</p></body></html>\r\n",
-				 e->code, e->msg, e->code, e->msg);
+						   "%s",
+				 e->code, e->msg, req->keep_alive ? "keep-alive" : "close",
+				 body_len, body);
 
 	if (write(req->sock, buf, r) != r)
 		return -1;
@@ -224,36 +336,251 @@ send_error(struct http_request *req, int code)
 	return 0;
 }
 
+// The response cache holds whole responses, headers and body, for
+// small files.  Its pages are shared by all the workers, so that a hot
+// file is read once and then served with a single send from the page-
+// aligned slot holding it.  An entry is good for as long as its file's
+// size and version (see struct File) stay the same.
+#define CACHEVA            0xB0000000
+#define CACHE_NSLOTS       16
+#define CACHE_SLOTPAGES    8
+#define CACHE_SLOTSIZE     (CACHE_SLOTPAGES * PGSIZE)
+#define CACHE_HDRMAX       256    // Room for a cached response's headers
+
+struct cache_entry {
+	char path[128];
+	off_t size;
+	uint32_t version;
+	int len;          // Bytes of response in the slot, 0 if none
+	int refs;         // Workers filling or sending the slot
+	uint32_t used;    // Tick of the last hit
+};
+
+struct response_cache {
+	volatile uint32_t lock;
+	uint32_t tick;
+	struct cache_entry entries[CACHE_NSLOTS];
+};
+
+#define cache        ((struct response_cache *) CACHEVA)
+#define cache_slot(i)    ((char *) CACHEVA + PGSIZE + (i) * CACHE_SLOTSIZE)
+
+static bool cache_enabled;
+
+// Map the cache's pages shared, so that workers forked later use the
+// same cache.  Without the memory for it, httpd runs without a cache.
+static void
+cache_init(void)
+{
+	struct PageMapOp op;
+	size_t done;
+
+	static_assert(sizeof(struct response_cache) <= PGSIZE);
+	op.srcva = PAGEMAP_ALLOC;
+	op.dstva = CACHEVA;
+	op.npages = 1 + CACHE_NSLOTS * CACHE_SLOTPAGES;
+	op.perm = PTE_P | PTE_U | PTE_W | PTE_SHARE;
+	cache_enabled = sys_page_map_batch(0, 0, &op, 1, &done) == 0;
+}
+
+static void
+cache_lock(void)
+{
+	while (xchg(&cache->lock, 1) != 0)
+		sys_yield();
+}
+
+static void
+cache_unlock(void)
+{
+	xchg(&cache->lock, 0);
+}
+
+// Read file 'fd', described by 'st', into cache slot i along with the
+// headers of its response.  Returns the response's length, or < 0 on
+// error.
+static int
+cache_fill(int i, struct http_request *req, int fd, struct Stat *st)
+{
+	char *slot = cache_slot(i);
+	int hdr_len, r;
+
+	hdr_len = snprintf(slot, CACHE_HDRMAX, "%s"
+										   "Content-Type: %s\r\n"
+										   "Content-Length: %ld\r\n"
+										   "%s"
+										   "\r\n",
+					   headers[0].header, mime_type(req->url), (long) st->st_size,
+					   req->gzipped ? GZIP_HEADERS : "");
+	if (hdr_len >= CACHE_HDRMAX)
+		return -1;
+	if ((r = readn(fd, slot + hdr_len, st->st_size)) != st->st_size)
+		return r < 0 ? r : -1;
+	return hdr_len + st->st_size;
+}
+
+// Find the cached response for req->path, whose file 'fd' is described
+// by 'st', filling a slot with it on a miss.  Returns the slot, held
+// until cache_put, or -1 if the response is not cached.
+static int
+cache_get(struct http_request *req, int fd, struct Stat *st)
+{
+	struct cache_entry *e;
+	int i, victim = -1, len;
+
+	if (!cache_enabled)
+		return -1;
+
+	cache_lock();
+	for (i = 0; i < CACHE_NSLOTS; i++)
+	{
+		e = &cache->entries[i];
+		if (e->len && strcmp(e->path, req->path) == 0)
+		{
+			if (e->size == st->st_size && e->version == st->st_version)
+			{
+				e->refs++;
+				e->used = ++cache->tick;
+				cache_unlock();
+				return i;
+			}
+			if (e->refs == 0)
+				e->len = 0;    // Stale
+		}
+		if (e->refs == 0 &&
+			(victim < 0 || e->len == 0 ||
+			 (cache->entries[victim].len && e->used < cache->entries[victim].used)))
+			victim = i;
+	}
+	if (victim < 0 || strlen(req->path) >= sizeof(e->path) ||
+		st->st_size > CACHE_SLOTSIZE - CACHE_HDRMAX)
+	{
+		cache_unlock();
+		return -1;
+	}
+
+	// Claim the least recently used slot and fill it unlocked
+	e = &cache->entries[victim];
+	e->len = 0;
+	e->refs = 1;
+	strcpy(e->path, req->path);
+	cache_unlock();
+
+	len = cache_fill(victim, req, fd, st);
+
+	cache_lock();
+	if (len > 0)
+	{
+		e->size = st->st_size;
+		e->version = st->st_version;
+		e->used = ++cache->tick;
+		e->len = len;
+	} else
+		e->refs--;
+	cache_unlock();
+	return len > 0 ? victim : -1;
+}
+
+static void
+cache_put(int i)
+{
+	cache_lock();
+	cache->entries[i].refs--;
+	cache_unlock();
+}
+
+// Send the whole response in cache slot i
+static int
+send_cached(struct http_request *req, int i)
+{
+	const char *buf = cache_slot(i);
+	int len = cache->entries[i].len, r;
+
+	// The cached headers say nothing of the connection, which means
+	// keep-alive to HTTP/1.1 clients only.
+	if (strcmp(req->version, "HTTP/1.1") != 0)
+		req->keep_alive = false;
+	while (len > 0)
+	{
+		if ((r = write(req->sock, buf, len)) <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+// If the client takes gzip, open the requested file's precompressed
+// sibling, url.gz, to send in its place.  Returns the file descriptor,
+// or < 0 if there is none to send.
+static int
+open_gzipped(struct http_request *req, struct Stat *st)
+{
+	char *path;
+	int fd;
+
+	if (!req->accept_gzip ||
+		!(path = arena_alloc(req->arena, strlen(req->url) + 4)))
+		return -1;
+	strcpy(path, req->url);
+	strcat(path, ".gz");
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fd;
+	if (fstat(fd, st) < 0 || st->st_isdir)
+	{
+		close(fd);
+		return -1;
+	}
+	req->path = path;
+	req->gzipped = true;
+	return fd;
+}
+
 static int
 send_file(struct http_request *req)
 {
 	int r;
 	off_t file_size = -1;
 	int fd;
+	struct Stat fdStat;
+
+	// A precompressed copy of a text file is several times smaller,
+	// and sending it costs the network server as much less.
+	if ((fd = open_gzipped(req, &fdStat)) >= 0)
+		goto found;
 
 	// open the requested url for reading
 	// if the file does not exist, send a 404 error using send_error
 	// if the file is a directory, send a 404 error using send_error
 	// set file_size to the size of the file
 	// LAB 6: Your code here.
+	req->path = req->url;
 	fd = open(req->url, O_RDONLY);
 	if (fd < 0)
-		send_error(req, 404);
+		return send_error(req, 404);
 
-	struct Stat fdStat;
 	if (fstat(fd, &fdStat) < 0)
 	{
-		send_error(req, 404);
+		r = send_error(req, 404);
 		goto end;
 	}
 	if (fdStat.st_isdir)
 	{
-		send_error(req, 404);
+		r = send_error(req, 404);
 		goto end;
 	}
 
+	found:
 	file_size = fdStat.st_size;
 
+	if ((r = cache_get(req, fd, &fdStat)) >= 0)
+	{
+		int slot = r;
+		r = send_cached(req, slot);
+		cache_put(slot);
+		goto end;
+	}
+
 	if ((r = send_header(req, 200)) < 0)
 		goto end;
 
@@ -263,60 +590,171 @@ send_file(struct http_request *req)
 	if ((r = send_content_type(req)) < 0)
 		goto end;
 
+	if ((r = send_encoding(req)) < 0)
+		goto end;
+
+	if ((r = send_connection(req)) < 0)
+		goto end;
+
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
-	r = send_data(req, fd);
+	r = send_data(req, fd, file_size);
 
 	end:
 	close(fd);
 	return r;
 }
 
+// If buf[0..len) starts with a whole request line and headers, return
+// their length, up to and including the blank line that ends them.
+// Otherwise return 0.
+static int
+request_head_len(const char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i + 1 < len; i++)
+		if (buf[i] == '\n' &&
+			(buf[i + 1] == '\n' ||
+			 (buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n')))
+			return i + (buf[i + 1] == '\n' ? 2 : 3);
+	return 0;
+}
+
+// Serve the requests that arrive on 'sock' until the client closes the
+// connection or one of them asks not to keep it alive.  A client may
+// pipeline its requests, sending several before reading any response:
+// whatever follows one request in the buffer is the start of the next.
 static void
 handle_client(int sock)
 {
 	struct http_request con_d;
-	int r;
-	char buffer[BUFFSIZE];
-	int received = -1;
+	int r, len = 0, head_len, skip;
+	char buffer[BUFFSIZE + 1];
+	char c;
 	struct http_request *req = &con_d;
+	struct Arena *arena;
+
+	// Room for the strings of a typical request
+	if (!(arena = arena_create(256)))
+	{
+		close(sock);
+		return;
+	}
 
 	while (1)
 	{
-		// Receive message
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			panic("failed to read");
+		// Receive until the buffer holds a whole request head
+		while ((head_len = request_head_len(buffer, len)) == 0)
+		{
+			if (len == BUFFSIZE)
+			{
+				memset(req, 0, sizeof(*req));
+				req->sock = sock;
+				req->arena = arena;
+				send_error(req, 400);
+				goto done;
+			}
+			if ((r = read(sock, buffer + len, BUFFSIZE - len)) <= 0)
+				goto done;
+			len += r;
+		}
 
 		memset(req, 0, sizeof(*req));
 
 		req->sock = sock;
+		req->arena = arena;
 
+		c = buffer[head_len];
+		buffer[head_len] = '\0';
 		r = http_request_parse(req, buffer);
+		buffer[head_len] = c;
+
+		// Drop the head, then any body the request came with
+		skip = head_len + (r == 0 ? req->body_len : 0);
+		while (skip > len)
+		{
+			skip -= len;
+			if ((len = read(sock, buffer, MIN(skip, BUFFSIZE))) <= 0)
+			{
+				req_free(req);
+				goto done;
+			}
+		}
+		memmove(buffer, buffer + skip, len - skip);
+		len -= skip;
+
 		if (r == -E_BAD_REQ)
+		{
+			req->keep_alive = false;
 			send_error(req, 400);
-		else if (r < 0)
+		} else if (r < 0)
 			panic("parse failed");
-		else
-			send_file(req);
+		else if (send_file(req) < 0)
+			req->keep_alive = false;
 
+		r = req->keep_alive;
 		req_free(req);
-
-		// no keep alive
-		break;
+		if (!r)
+			break;
 	}
 
+	done:
+	arena_destroy(arena);
 	close(sock);
 }
 
+// Accept and serve clients on 'serversock' forever
+static void __attribute__((noreturn))
+serve_clients(int serversock)
+{
+	int clientsock;
+	struct sockaddr_in client;
+
+	while (1)
+	{
+		unsigned int clientlen = sizeof(client);
+		// Wait for client connection
+		if ((clientsock = accept(serversock,
+								 (struct sockaddr *) &client,
+								 &clientlen)) < 0)
+		{
+			die("Failed to accept client connection");
+		}
+		handle_client(clientsock);
+	}
+}
+
+static void
+usage(void)
+{
+	cprintf("usage: httpd [-p nworkers]\n");
+	exit();
+}
+
 void
 umain(int argc, char **argv)
 {
-	int serversock, clientsock;
-	struct sockaddr_in server, client;
+	int serversock, nworkers = 1, i, r;
+	struct sockaddr_in server;
+	struct Argstate args;
 
 	binaryname = "jhttpd";
 
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i)
+		{
+			case 'p':
+				nworkers = strtol(argvalue(&args), NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	if (argc != 1 || nworkers < 1)
+		usage();
+
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 		die("Failed to create socket");
@@ -338,20 +776,20 @@ umain(int argc, char **argv)
 	if (listen(serversock, MAXPENDING) < 0)
 		die("Failed to listen on server socket");
 
+	cache_init();
+
 	cprintf("Waiting for http connections...\n");
 
-	while (1)
+	// Prefork: this environment and nworkers - 1 children all accept
+	// on the shared listening socket, and the network server hands
+	// each connection to the worker that has waited longest.
+	for (i = 1; i < nworkers; i++)
 	{
-		unsigned int clientlen = sizeof(client);
-		// Wait for client connection
-		if ((clientsock = accept(serversock,
-								 (struct sockaddr *) &client,
-								 &clientlen)) < 0)
-		{
-			die("Failed to accept client connection");
-		}
-		handle_client(clientsock);
+		if ((r = fork()) < 0)
+			die("Failed to fork a worker");
+		if (r == 0)
+			break;
 	}
 
-	close(serversock);
+	serve_clients(serversock);
 }
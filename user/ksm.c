@@ -0,0 +1,29 @@
+// Turn same-page merging on or off, and print what it has saved.
+//
+// Usage: ksm [on|off]
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct KsmStats st;
+	int enable = -1, r;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "on") != 0 &&
+					 strcmp(argv[1], "off") != 0))
+	{
+		printf("usage: ksm [on|off]\n");
+		exit();
+	}
+	if (argc == 2)
+		enable = strcmp(argv[1], "on") == 0;
+
+	if ((r = sys_ksm(enable, &st)) < 0)
+		panic("sys_ksm: %e", r);
+	printf("merging %s, %u full scans, %llu pages scanned\n",
+		   st.ks_enabled ? "on" : "off", st.ks_full_scans, st.ks_pages_scanned);
+	printf("%u frames shared by %u mappings: %u pages saved\n",
+		   st.ks_pages_shared, st.ks_pages_sharing,
+		   st.ks_pages_sharing - st.ks_pages_shared);
+}
@@ -0,0 +1,177 @@
+// In-JOS load generator for httpd and echosrv, over lwIP's loopback
+// to our own address (see the host-side ./loadgen for the same load
+// from outside).
+//	loadgen [-c clients] [-n requests] http|echo [port]
+// Each of 'clients' forked clients makes 'requests' requests, one
+// connection per request for http (httpd closes after each reply) and
+// one connection in all for echo.  Results are one "loadgen <key>
+// <value>" line each: requests/sec, p50 and p99 latency in
+// microseconds, and errors.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/args.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define LOADGEN_IP      "10.0.2.15"
+#define LOADGEN_MAXREQ  (PGSIZE / sizeof(uint32_t))    // per client
+#define LOADGEN_MAXCLIENTS 16
+#define LAT_VA          ((uint32_t *) 0x20000000)      // clients' pages
+#define ECHO_SIZE       32
+
+static char buf[4096];
+static uint32_t lat[LOADGEN_MAXCLIENTS * LOADGEN_MAXREQ];
+
+static int
+dial(int port)
+{
+	struct sockaddr_in addr;
+	int s;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(LOADGEN_IP);
+	addr.sin_port = htons(port);
+	if ((s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		return s;
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		close(s);
+		return -E_INVAL;
+	}
+	return s;
+}
+
+// One client: make n requests, recording each one's latency in cycles
+// in the page at LAT_VA, then send the page to the parent with the
+// number of failed requests as the value.
+static void
+client(bool http, int port, uint32_t n)
+{
+	static const char req[] = "GET / HTTP/1.0\r\n\r\n";
+	uint32_t *l = LAT_VA, i, errors = 0;
+	uint64_t start;
+	int s = -1, r;
+
+	if ((r = sys_page_alloc(0, l, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	memset(buf, 'x', ECHO_SIZE);
+	if (!http && (s = dial(port)) < 0)
+		errors = n;
+	for (i = 0; i < n && errors < n; i++)
+	{
+		start = read_tsc();
+		if (http)
+		{
+			if ((s = dial(port)) < 0 ||
+				write(s, req, sizeof(req) - 1) != sizeof(req) - 1)
+				r = -1;
+			else
+				while ((r = read(s, buf, sizeof(buf))) > 0)
+					/* do nothing */;
+			if (s >= 0)
+				close(s);
+		} else if (write(s, buf, ECHO_SIZE) != ECHO_SIZE ||
+				   readn(s, buf, ECHO_SIZE) != ECHO_SIZE)
+			r = -1;
+		else
+			r = 0;
+		l[i] = (uint32_t) (read_tsc() - start);
+		if (r < 0)
+			errors++;
+	}
+	if (!http && s >= 0)
+		close(s);
+	ipc_send(thisenv->env_parent_id, errors, l, PTE_P | PTE_U);
+	exit();
+}
+
+static void
+sort(uint32_t *a, uint32_t n)
+{
+	uint32_t gap, i, j, t;
+
+	// Shell sort: a few thousand latencies need nothing better
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++)
+			for (j = i; j >= gap && a[j - gap] > a[j]; j -= gap)
+			{
+				t = a[j];
+				a[j] = a[j - gap];
+				a[j - gap] = t;
+			}
+}
+
+static uint32_t
+usec(uint32_t cycles)
+{
+	return uinfo.tsc_khz ? (uint64_t) cycles * 1000 / uinfo.tsc_khz : cycles;
+}
+
+static void
+usage(void)
+{
+	printf("usage: loadgen [-c clients] [-n requests] http|echo [port]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t nclients = 1, n = 100, errors = 0, total, i;
+	struct Argstate args;
+	uint64_t start, cycles;
+	envid_t whom;
+	bool http;
+	int port, c, r, perm;
+
+	binaryname = "loadgen";
+	argstart(&argc, argv, &args);
+	while ((c = argnext(&args)) >= 0)
+		switch (c)
+		{
+			case 'c':
+				nclients = strtol(argnextvalue(&args), 0, 0);
+				break;
+			case 'n':
+				n = strtol(argnextvalue(&args), 0, 0);
+				break;
+			default:
+				usage();
+		}
+	if (argc < 2 || argc > 3 ||
+		(strcmp(argv[1], "http") != 0 && strcmp(argv[1], "echo") != 0))
+		usage();
+	http = strcmp(argv[1], "http") == 0;
+	port = argc == 3 ? strtol(argv[2], 0, 0) : (http ? 80 : 7);
+	nclients = MAX(1, MIN(nclients, LOADGEN_MAXCLIENTS));
+	n = MAX(1, MIN(n, LOADGEN_MAXREQ));
+
+	start = read_tsc();
+	for (i = 0; i < nclients; i++)
+	{
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			client(http, port, n);
+	}
+	for (i = 0; i < nclients; i++)
+	{
+		errors += ipc_recv(&whom, LAT_VA, &perm);
+		if (!(perm & PTE_P))
+			panic("loadgen: client %08x sent no latencies", whom);
+		memmove(lat + i * n, LAT_VA, n * sizeof(uint32_t));
+		sys_page_unmap(0, LAT_VA);
+	}
+	cycles = read_tsc() - start;
+
+	total = nclients * n;
+	sort(lat, total);
+	if (uinfo.tsc_khz)
+		printf("loadgen requests/sec %llu\n",
+			   (uint64_t) (total - errors) * uinfo.tsc_khz * 1000 / cycles);
+	printf("loadgen p50_usec %u\n", usec(lat[total / 2]));
+	printf("loadgen p99_usec %u\n", usec(lat[MIN(total - 1, total * 99 / 100)]));
+	printf("loadgen errors %u\n", errors);
+}
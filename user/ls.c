@@ -12,49 +12,60 @@ ls(const char *path, const char *prefix)
 	struct Stat st;
 
 	if ((r = stat(path, &st)) < 0)
+	{
+		fflush(stdout);
 		panic("stat %s: %e", path, r);
+	}
 	if (st.st_isdir && !flag['d'])
 		lsdir(path, prefix);
 	else
 		ls1(0, st.st_isdir, st.st_size, path);
 }
 
+// Each readdir brings a page of entries, just their names, sizes and
+// types, rather than the directory's struct Files, free ones and all.
 void
 lsdir(const char *path, const char *prefix)
 {
+	static char buf[PGSIZE];
+	struct Dirent *d;
 	int fd, n;
-	struct File f;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
+	{
+		fflush(stdout);
 		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type == FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	}
+	while ((n = readdir(fd, buf, sizeof buf)) > 0)
+		for (d = (struct Dirent *) buf; (char *) d < buf + n;
+			 d = (struct Dirent *) ((char *) d + d->d_reclen))
+			ls1(prefix, d->d_type == FTYPE_DIR, d->d_size, d->d_name);
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
+	close(fd);
 }
 
+// Through stdout's buffer, so that a listing goes out a buffer full,
+// not a field, at a time
 void
 ls1(const char *prefix, bool isdir, off_t size, const char *name)
 {
 	const char *sep;
 
 	if (flag['l'])
-		printf("%11d %c ", size, isdir ? 'd' : '-');
+		fsprintf(stdout, "%11d %c ", size, isdir ? 'd' : '-');
 	if (prefix)
 	{
 		if (prefix[0] && prefix[strlen(prefix) - 1] != '/')
 			sep = "/";
 		else
 			sep = "";
-		printf("%s%s", prefix, sep);
+		fsprintf(stdout, "%s%s", prefix, sep);
 	}
-	printf("%s", name);
+	fsprintf(stdout, "%s", name);
 	if (flag['F'] && isdir)
-		printf("/");
-	printf("\n");
+		fsprintf(stdout, "/");
+	fsprintf(stdout, "\n");
 }
 
 void
@@ -21,7 +21,7 @@ umain(int argc, char **argv)
 		else
 			usage();
 
-	for (i = 0; i < 32; i++)
+	for (i = 0; i < MAXFD; i++)
 		if (fstat(i, &st) >= 0)
 		{
 			if (usefprint)
@@ -0,0 +1,45 @@
+// Print the network card's and the network server's counters.
+
+#include <inc/lib.h>
+
+static void
+print_proto(const char *name, const struct Nsstats_proto *p)
+{
+	printf("%-7s %10u %10u %8u %8u %8u %8u %8u %8u %8u\n", name,
+		   p->xmit, p->recv, p->drop, p->chkerr, p->lenerr,
+		   p->memerr, p->rterr, p->proterr, p->err);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct NetStats st;
+	struct Nsret_stats ns;
+	int r;
+
+	if ((r = sys_net_stats(&st)) < 0)
+		panic("sys_net_stats: %e", r);
+	printf("e1000:\n");
+	printf("  rx %llu good, %u missed, %u bad CRC, %u out of buffers, %u too long\n",
+		   st.rx_good, st.rx_missed, st.rx_crc_errors, st.rx_no_buffers,
+		   st.rx_too_long);
+	printf("  tx %llu good of %llu, %u refused with the queue full\n",
+		   st.tx_good, st.tx_total, st.tx_queue_full);
+	printf("  rx ring %u/%u filled, tx ring %u/%u busy (%u pinned)\n",
+		   st.rx_ring_used, st.rx_ring_size, st.tx_ring_used,
+		   st.tx_ring_size, st.tx_pinned);
+
+	if ((r = nsipc_stats(&ns)) < 0)
+		panic("nsipc_stats: %e", r);
+	printf("lwIP:\n");
+	printf("%-7s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n", "", "xmit", "recv",
+		   "drop", "chkerr", "lenerr", "memerr", "rterr", "proterr", "err");
+	print_proto("link", &ns.ret_link);
+	print_proto("etharp", &ns.ret_etharp);
+	print_proto("ip", &ns.ret_ip);
+	print_proto("icmp", &ns.ret_icmp);
+	print_proto("udp", &ns.ret_udp);
+	print_proto("tcp", &ns.ret_tcp);
+	printf("  heap %u bytes in use, %u at most, %u failed allocations\n",
+		   ns.ret_mem_used, ns.ret_mem_max, ns.ret_mem_err);
+}
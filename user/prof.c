@@ -0,0 +1,54 @@
+// Drive the kernel's sampling profiler (see kern/prof.c).
+//	prof start	start profiling afresh
+//	prof stop	stop, and print the profile
+//	prof		print the profile so far
+
+#include <inc/lib.h>
+
+static struct ProfReport r;
+
+static void
+print_report(void)
+{
+	struct ProfEntry *pe;
+	int ret;
+
+	if ((ret = sys_prof_report(&r)) < 0)
+		panic("sys_prof_report: %e", ret);
+	printf("%u samples, %u dropped, in %u functions\n", r.pr_samples,
+		   r.pr_dropped, r.pr_nfns);
+	if (r.pr_samples == 0)
+		return;
+	printf("%8s %6s %-8s %-8s %s\n", "samples", "%", "env", "addr", "function");
+	for (pe = r.pr_fns; pe < r.pr_fns + MIN(r.pr_nfns, PROF_NREPORT); pe++)
+	{
+		printf("%8u %3u.%u%% ", pe->pe_samples, pe->pe_samples * 100 / r.pr_samples,
+			   pe->pe_samples * 1000 / r.pr_samples % 10);
+		if (pe->pe_env)
+			printf("%08x ", pe->pe_env);
+		else
+			printf("%-8s ", "kernel");
+		printf("%08x %s\n", pe->pe_fn, pe->pe_name[0] ? pe->pe_name : "?");
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if (argc == 2 && strcmp(argv[1], "start") == 0)
+	{
+		if ((r = sys_prof_ctl(true)) < 0)
+			panic("sys_prof_ctl: %e", r);
+		return;
+	}
+	if (argc == 2 && strcmp(argv[1], "stop") == 0)
+		sys_prof_ctl(false);
+	else if (argc != 1)
+	{
+		printf("usage: prof [start|stop]\n");
+		exit();
+	}
+	print_report();
+}
@@ -13,17 +13,247 @@ int debug = 0;
 int gettoken(char *s, char **token);
 
 
+#define WHITESPACE " \t\r\n"
+#define SYMBOLS "<|>&;()"
+
+// The shell's directory, which cd changes: relative paths in
+// redirections and in cd and test are taken from it.  Programs still
+// see paths from the root, as JOS has no working directory of its own.
+static char cwd[MAXPATHLEN] = "/";
+
+// What the last command returned: a builtin's result, or for a
+// program, 0 if it could be spawned (JOS has no exit status) and 1
+// if not.  echo prints it for "$?".
+static int status;
+
+// Path 'p' taken from cwd, in a static buffer if it is relative.
+static const char *
+shpath(const char *p)
+{
+	static char buf[MAXPATHLEN];
+	size_t n = strlen(cwd);
+
+	if (p[0] == '/')
+		return p;
+	snprintf(buf, sizeof(buf), "%s%s%s", cwd, cwd[n - 1] == '/' ? "" : "/", p);
+	return buf;
+}
+
+static int
+sh_echo(int argc, char **argv)
+{
+	int i, nflag = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-n") == 0)
+	{
+		nflag = 1;
+		argc--;
+		argv++;
+	}
+	for (i = 1; i < argc; i++)
+	{
+		if (i > 1)
+			printf(" ");
+		if (strcmp(argv[i], "$?") == 0)
+			printf("%d", status);
+		else
+			printf("%s", argv[i]);
+	}
+	if (!nflag)
+		printf("\n");
+	return 0;
+}
+
+static int
+sh_true(int argc, char **argv)
+{
+	return 0;
+}
+
+static int
+sh_false(int argc, char **argv)
+{
+	return 1;
+}
+
+// test expr, or [ expr ]: 0 if expr holds, 1 if not, and 2 if it is
+// not one of
+//	-e|-f|-d path		path exists, is a file, is a directory
+//	-n|-z string		string is not empty, is empty
+//	s1 =|!= s2		the strings are equal, differ
+//	n1 -eq|-ne|-lt|-le|-gt|-ge n2	the integers compare so
+//	string			string is not empty
+// any of which "!" in front negates.
+static int
+sh_test(int argc, char **argv)
+{
+	static const char *ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+	struct Stat st;
+	bool neg = false, holds;
+	long a, b;
+	int i;
+
+	if (strcmp(argv[0], "[") == 0 && strcmp(argv[--argc], "]") != 0)
+	{
+		cprintf("[: missing ]\n");
+		return 2;
+	}
+	argc--;
+	argv++;
+	if (argc > 0 && strcmp(argv[0], "!") == 0)
+	{
+		neg = true;
+		argc--;
+		argv++;
+	}
+	if (argc == 0)
+		holds = false;
+	else if (argc == 1)
+		holds = argv[0][0] != '\0';
+	else if (argc == 2 && strcmp(argv[0], "-n") == 0)
+		holds = argv[1][0] != '\0';
+	else if (argc == 2 && strcmp(argv[0], "-z") == 0)
+		holds = argv[1][0] == '\0';
+	else if (argc == 2 && (strcmp(argv[0], "-e") == 0 ||
+						   strcmp(argv[0], "-f") == 0 || strcmp(argv[0], "-d") == 0))
+		holds = stat(shpath(argv[1]), &st) >= 0 &&
+				(argv[0][1] == 'e' || st.st_isdir == (argv[0][1] == 'd'));
+	else if (argc == 3 && strcmp(argv[1], "=") == 0)
+		holds = strcmp(argv[0], argv[2]) == 0;
+	else if (argc == 3 && strcmp(argv[1], "!=") == 0)
+		holds = strcmp(argv[0], argv[2]) != 0;
+	else if (argc == 3)
+	{
+		for (i = 0; i < ARRAY_SIZE(ops) && strcmp(argv[1], ops[i]) != 0; i++)
+			;
+		if (i == ARRAY_SIZE(ops))
+			goto bad;
+		a = strtol(argv[0], 0, 10);
+		b = strtol(argv[2], 0, 10);
+		holds = (i == 0 && a == b) || (i == 1 && a != b) || (i == 2 && a < b) ||
+				(i == 3 && a <= b) || (i == 4 && a > b) || (i == 5 && a >= b);
+	} else
+		goto bad;
+	return holds != neg ? 0 : 1;
+
+	bad:
+	cprintf("test: bad expression\n");
+	return 2;
+}
+
+static int
+sh_cd(int argc, char **argv)
+{
+	struct Stat st;
+	const char *p;
+	int r;
+
+	if (argc > 2)
+	{
+		cprintf("usage: cd [dir]\n");
+		return 2;
+	}
+	p = argc == 2 ? shpath(argv[1]) : "/";
+	if ((r = stat(p, &st)) < 0)
+	{
+		cprintf("cd %s: %e\n", p, r);
+		return 1;
+	}
+	if (!st.st_isdir)
+	{
+		cprintf("cd %s: not a directory\n", p);
+		return 1;
+	}
+	strcpy(cwd, p);
+	return 0;
+}
+
+static int
+sh_pwd(int argc, char **argv)
+{
+	printf("%s\n", cwd);
+	return 0;
+}
+
+static int
+sh_exit(int argc, char **argv)
+{
+	exit();
+	return 0;
+}
+
+// Commands the shell runs itself, without a fork or a spawn
+static const struct Builtin {
+	const char *name;
+	int (*fn)(int argc, char **argv);
+} builtins[] = {
+	{ "echo", sh_echo },
+	{ "true", sh_true },
+	{ "false", sh_false },
+	{ "test", sh_test },
+	{ "[", sh_test },
+	{ "cd", sh_cd },
+	{ "pwd", sh_pwd },
+	{ "exit", sh_exit },
+};
+
+static const struct Builtin *
+builtin(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(builtins); i++)
+		if (strcmp(builtins[i].name, name) == 0)
+			return &builtins[i];
+	return NULL;
+}
+
+// Where a command that the shell runs itself sets the shell's own fd
+// 0 or 1 aside while it is redirected, and whether it did: 1 if set
+// aside at SAVEFD + fd, -1 if the fd was closed, 0 if not redirected.
+#define SAVEFD    (MAXFD - 2)
+
+static int saved[2];
+
+static void
+save_fd(int fd)
+{
+	if (!saved[fd])
+		saved[fd] = dup(fd, SAVEFD + fd) >= 0 ? 1 : -1;
+}
+
+static void
+restore_fds(void)
+{
+	int fd;
+
+	for (fd = 0; fd < 2; fd++)
+	{
+		if (saved[fd] > 0)
+		{
+			dup(SAVEFD + fd, fd);
+			close(SAVEFD + fd);
+		} else if (saved[fd] < 0)
+			close(fd);
+		saved[fd] = 0;
+	}
+}
+
 // Parse a shell command from string 's' and execute it.
 // Do not return until the shell command is finished.
-// runcmd() is called in a forked child,
-// so it's OK to manipulate file descriptor state.
+// runcmd() is called in a forked child, which exits when it is done,
+// except for a command with no pipe that is a builtin or has no
+// redirections (see umain): then 'inshell' is set and runcmd() runs
+// in the shell itself, so sets aside any fds it redirects and puts
+// them back before returning.
 #define MAXARGS 16
 
 void
-runcmd(char *s)
+runcmd(char *s, bool inshell)
 {
 	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
 	int argc, c, i, r, p[2], fd, pipe_child;
+	const struct Builtin *b;
 
 	pipe_child = 0;
 	gettoken(s, 0);
@@ -39,7 +269,7 @@ runcmd(char *s)
 				if (argc == MAXARGS)
 				{
 					cprintf("too many arguments\n");
-					exit();
+					goto out;
 				}
 				argv[argc++] = t;
 				break;
@@ -49,7 +279,7 @@ runcmd(char *s)
 				if (gettoken(0, &t) != 'w')
 				{
 					cprintf("syntax error: < not followed by word\n");
-					exit();
+					goto out;
 				}
 				// Open 't' for reading as file descriptor 0
 				// (which environments use as standard input).
@@ -60,10 +290,12 @@ runcmd(char *s)
 				// then close the original 'fd'.
 
 				// LAB 5: Your code here.
-				if ((fd = open(t, O_RDONLY)) < 0)
+				if (inshell)
+					save_fd(0);
+				if ((fd = open(shpath(t), O_RDONLY)) < 0)
 				{
 					cprintf("open %s for write: %e", t, fd);
-					exit();
+					goto out;
 				}
 				if (fd != 0)
 				{
@@ -77,12 +309,14 @@ runcmd(char *s)
 				if (gettoken(0, &t) != 'w')
 				{
 					cprintf("syntax error: > not followed by word\n");
-					exit();
+					goto out;
 				}
-				if ((fd = open(t, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+				if (inshell)
+					save_fd(1);
+				if ((fd = open(shpath(t), O_WRONLY | O_CREAT | O_TRUNC)) < 0)
 				{
 					cprintf("open %s for write: %e", t, fd);
-					exit();
+					goto out;
 				}
 				if (fd != 1)
 				{
@@ -92,17 +326,18 @@ runcmd(char *s)
 				break;
 
 			case '|':    // Pipe
+				assert(!inshell);
 				if ((r = pipe(p)) < 0)
 				{
 					cprintf("pipe: %e", r);
-					exit();
+					goto out;
 				}
 				if (debug)
 					cprintf("PIPE: %d %d\n", p[0], p[1]);
 				if ((r = fork()) < 0)
 				{
 					cprintf("fork: %e", r);
-					exit();
+					goto out;
 				}
 				if (r == 0)
 				{
@@ -144,7 +379,17 @@ runcmd(char *s)
 	{
 		if (debug)
 			cprintf("EMPTY COMMAND\n");
-		return;
+		goto out;
+	}
+	argv[argc] = 0;
+
+	if ((b = builtin(argv[0])) != NULL)
+	{
+		if (debug)
+			cprintf("[%08x] BUILTIN %s\n", thisenv->env_id, argv[0]);
+		status = b->fn(argc, argv);
+		r = -1;
+		goto done;
 	}
 
 	// Clean up command line.
@@ -157,7 +402,6 @@ runcmd(char *s)
 		strcpy(argv0buf + 1, argv[0]);
 		argv[0] = argv0buf;
 	}
-	argv[argc] = 0;
 
 	// Print the command.
 	if (debug)
@@ -171,10 +415,13 @@ runcmd(char *s)
 	// Spawn the command!
 	if ((r = spawn(argv[0], (const char **) argv)) < 0)
 		cprintf("spawn %s: %e\n", argv[0], r);
+	status = r < 0;
 
+	done:
 	// In the parent, close all file descriptors and wait for the
-	// spawned command to exit.
-	close_all();
+	// spawned command to exit.  The shell itself keeps its own.
+	if (!inshell)
+		close_all();
 	if (r >= 0)
 	{
 		if (debug)
@@ -196,6 +443,12 @@ runcmd(char *s)
 	}
 
 	// Done!
+	out:
+	if (inshell)
+	{
+		restore_fds();
+		return;
+	}
 	exit();
 }
 
@@ -211,8 +464,6 @@ runcmd(char *s)
 //
 // Eventually (once we parse the space where the \0 will go),
 // words get nul-terminated.
-#define WHITESPACE " \t\r\n"
-#define SYMBOLS "<|>&;()"
 
 int
 _gettoken(char *s, char **p1, char **p2)
@@ -282,6 +533,30 @@ gettoken(char *s, char **p1)
 }
 
 
+// Can the shell run line 's' itself, without forking for it?  It can
+// if the line has no pipe or other symbol and its command is a builtin
+// or has no redirections, which would otherwise be the shell's own
+// fds that the program inherits.
+static bool
+inshell(const char *s)
+{
+	char name[16];
+	bool redir = false;
+	int i, n;
+
+	for (i = 0; s[i]; i++)
+		if (strchr("|&;()", s[i]))
+			return false;
+		else if (s[i] == '<' || s[i] == '>')
+			redir = true;
+	while (*s && strchr(WHITESPACE, *s))
+		s++;
+	for (n = 0; n < sizeof(name) - 1 && s[n] && !strchr(WHITESPACE SYMBOLS, s[n]); n++)
+		name[n] = s[n];
+	name[n] = '\0';
+	return !redir || builtin(name) != NULL;
+}
+
 void
 usage(void)
 {
@@ -343,6 +618,11 @@ umain(int argc, char **argv)
 			continue;
 		if (echocmds)
 			printf("# %s\n", buf);
+		if (inshell(buf))
+		{
+			runcmd(buf, true);
+			continue;
+		}
 		if (debug)
 			cprintf("BEFORE FORK\n");
 		if ((r = fork()) < 0)
@@ -351,7 +631,7 @@ umain(int argc, char **argv)
 			cprintf("FORK: %d\n", r);
 		if (r == 0)
 		{
-			runcmd(buf);
+			runcmd(buf, false);
 			exit();
 		} else
 			wait(r);
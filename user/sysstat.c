@@ -0,0 +1,49 @@
+// Show the kernel's system call statistics (see kern/sysstat.c).
+//	sysstat			every CPU's, added up
+//	sysstat cpu		CPU cpu's
+//	sysstat reset [envid]	count afresh, only envid's calls if given
+// Latencies are in TSC cycles; p50 and p99 are histogram bucket bounds.
+// The last line is the time environments waited on run queues.
+
+#include <inc/lib.h>
+
+static struct SysStatReport r;
+
+void
+umain(int argc, char **argv)
+{
+	struct SysStat *ss;
+	uint32_t i;
+	int ret;
+
+	if (argc >= 2 && strcmp(argv[1], "reset") == 0)
+	{
+		if ((ret = sys_sysstat_reset(argc > 2 ? strtol(argv[2], NULL, 16) : 0)) < 0)
+			panic("sys_sysstat_reset: %e", ret);
+		return;
+	}
+	if (argc > 2)
+	{
+		printf("usage: sysstat [cpu|reset [envid]]\n");
+		exit();
+	}
+	if ((ret = sys_sysstat_read(argc == 2 ? strtol(argv[1], NULL, 0) : -1, &r)) < 0)
+		panic("sys_sysstat_read: %e", ret);
+
+	if (r.sr_env)
+		printf("environment %08x only\n", r.sr_env);
+	printf("%4s %10s %10s %10s %10s %10s\n", "sys", "calls", "returns", "avg", "p50<", "p99<");
+	for (i = 0; i < SYSSTAT_NSYSCALL; i++)
+	{
+		ss = &r.sr_calls[i];
+		if (ss->ss_calls == 0)
+			continue;
+		printf("%4u %10u %10u %10llu %10llu %10llu\n", i, ss->ss_calls, ss->ss_returns,
+			   ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0,
+			   sysstat_percentile(ss, 50), sysstat_percentile(ss, 99));
+	}
+	ss = &r.sr_runwait;
+	printf("%4s %10u %10u %10llu %10llu %10llu\n", "runq", ss->ss_calls, ss->ss_returns,
+		   ss->ss_returns ? ss->ss_cycles / ss->ss_returns : 0,
+		   sysstat_percentile(ss, 50), sysstat_percentile(ss, 99));
+}
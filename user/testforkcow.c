@@ -0,0 +1,60 @@
+// Test that parent and child stay apart after fork leaves them
+// sharing a page table: each writes the region under it and must
+// still see only its own data.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xB0000000)
+#define NPAGES	8
+
+static void
+fill(int start, int end, char c)
+{
+	memset(VA + start * PGSIZE, c, (end - start) * PGSIZE);
+}
+
+static bool
+holds(int start, int end, char c)
+{
+	int i;
+
+	for (i = start * PGSIZE; i < end * PGSIZE; i++)
+		if (VA[i] != c)
+			return false;
+	return true;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int i, r;
+
+	// Several pages, none PTE_SHARE, alone in their 4MB
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, VA + i * PGSIZE, PTE_P|PTE_W|PTE_U)) < 0)
+			panic("sys_page_alloc: %e", r);
+	fill(0, NPAGES, 'a');
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		// write half before the parent writes, half after
+		fill(0, NPAGES / 2, 'c');
+		ipc_recv(0, 0, 0);
+		if (!holds(0, NPAGES / 2, 'c') || !holds(NPAGES / 2, NPAGES, 'a'))
+			panic("child sees the parent's writes");
+		fill(NPAGES / 2, NPAGES, 'c');
+		cprintf("fork child sees its own data %s\n",
+			holds(0, NPAGES, 'c') ? "right" : "wrong");
+		exit();
+	}
+
+	cprintf("fork shares the page table %s\n",
+		(uvpd[PDX(VA)] & PTE_COW) ? "right" : "wrong");
+	fill(0, NPAGES, 'p');
+	ipc_send(child, 0, 0, 0);
+	wait(child);
+	cprintf("fork parent sees its own data %s\n",
+		holds(0, NPAGES, 'p') ? "right" : "wrong");
+}
@@ -0,0 +1,47 @@
+// Test futex waits: a word that has changed, a timeout, and a wakeup
+// from another environment sharing the word.
+
+#include <inc/lib.h>
+
+#define VA	((volatile uint32_t *) 0xA0000000)
+#define TIMEOUT	100
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child;
+	unsigned start;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) VA, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// the word no longer holds what we expect
+	if ((r = sys_futex_wait(VA, 1, 0)) != -E_WOULD_BLOCK)
+		panic("futex wait on a changed word: %e", r);
+
+	// nobody wakes us
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(VA, 0, TIMEOUT)) != -E_TIMEOUT)
+		panic("futex wait with timeout: %e", r);
+	cprintf("futex timeout %s\n",
+		sys_time_msec() - start >= TIMEOUT ? "right" : "wrong");
+
+	// the child wakes us once we sleep
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (envs[ENVX(parent)].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+		*VA = 1;
+		if ((r = sys_futex_wake(VA, 1)) != 1)
+			panic("futex wake: %e", r);
+		exit();
+	}
+	if ((r = sys_futex_wait(VA, 0, 0)) < 0)
+		panic("futex wait: %e", r);
+	cprintf("futex wake %s\n", *VA == 1 ? "right" : "wrong");
+	wait(child);
+
+	cprintf("futex tests done\n");
+}
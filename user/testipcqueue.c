@@ -0,0 +1,35 @@
+// Test that senders blocked on one receiver are served in the order
+// they arrived.
+
+#include <inc/lib.h>
+
+#define NSENDERS	4
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, who[NSENDERS], from;
+	int i, r;
+
+	// Start the senders one at a time, each blocked sending to us
+	// before the next one starts
+	for (i = 0; i < NSENDERS; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			ipc_send(parent, i, 0, 0);
+			exit();
+		}
+		who[i] = r;
+		while (envs[ENVX(r)].env_ipc_send_to != parent)
+			sys_yield();
+	}
+
+	for (i = 0; i < NSENDERS; i++) {
+		r = ipc_recv(&from, 0, 0);
+		if (from != who[i] || r != i)
+			panic("message %d: got %d from %08x, expected %d from %08x",
+			      i, r, from, i, who[i]);
+	}
+	cprintf("ipc senders served in order\n");
+}
@@ -6,6 +6,7 @@ umain(int argc, char **argv)
 	char *buf;
 	int n;
 	void *v;
+	struct MallocStats ms;
 
 	while (1) {
 		buf = readline("> ");
@@ -18,6 +19,11 @@ umain(int argc, char **argv)
 			n = strtol(buf + 7, 0, 0);
 			v = malloc(n);
 			printf("\t0x%x\n", (uintptr_t) v);
+		} else if (strcmp(buf, "stats") == 0) {
+			malloc_stats(&ms);
+			printf("\t%d small in %d slab pages, %d bytes free in them\n",
+			       ms.ms_small, ms.ms_slab_pages, ms.ms_slab_free);
+			printf("\t%d large in %d pages\n", ms.ms_large, ms.ms_large_pages);
 		} else
 			printf("?unknown command\n");
 	}
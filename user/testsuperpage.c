@@ -0,0 +1,55 @@
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+const char *msg = "hello, superpage\n";
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, VA, PTE_P|PTE_W|PTE_U|PTE_PS)) < 0) {
+		if (r == -E_NOT_SUPP) {
+			cprintf("superpages not supported\n");
+			return;
+		}
+		panic("sys_page_alloc: %e", r);
+	}
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("superpage not mapped with PTE_PS");
+	if (VA[0] != 0 || VA[PTSIZE - 1] != 0)
+		panic("superpage not zeroed");
+	VA[PTSIZE - 1] = 'x';
+
+	// misaligned superpages are rejected
+	if ((r = sys_page_alloc(0, VA + PTSIZE + PGSIZE, PTE_P|PTE_W|PTE_U|PTE_PS)) != -E_INVAL)
+		panic("misaligned superpage alloc: %e", r);
+
+	// fork gives the child a copy-on-write superpage
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		if (VA[PTSIZE - 1] != 'x')
+			panic("child does not see the parent's superpage");
+		strcpy(VA, msg);
+		if (strcmp(VA, msg) != 0)
+			panic("child cannot write its superpage");
+		exit();
+	}
+	wait(r);
+	cprintf("fork copies superpage %s\n",
+		VA[0] == 0 && VA[PTSIZE - 1] == 'x' ? "right" : "wrong");
+
+	// a 4KB mapping inside the superpage splits it, keeping the rest
+	VA[PGSIZE] = 'y';
+	if ((r = sys_page_alloc(0, VA + PGSIZE, PTE_P|PTE_W|PTE_U)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((uvpd[PDX(VA)] & PTE_PS) || !(uvpt[PGNUM(VA)] & PTE_P))
+		panic("superpage not split");
+	cprintf("4KB page in superpage %s\n",
+		VA[PGSIZE] == 0 && VA[PTSIZE - 1] == 'x' ? "right" : "wrong");
+	sys_page_unmap(0, VA + PGSIZE);
+
+	cprintf("superpage tests done\n");
+}
@@ -0,0 +1,128 @@
+// Show which environments are using the CPUs: sample every
+// environment's accounting in envs[] (see env_charge_user in
+// kern/env.c), wait, sample again and list the busiest first.
+//	top [msec [count]]	count reports of msec each; 1 of 1000 by default
+// %cpu is of one CPU.  The switch, fault and IPC counts are totals
+// since the environment was created.
+
+#include <inc/lib.h>
+
+#define TOP_NROWS	20
+
+struct Sample {
+	envid_t id;
+	uint64_t user, kern;
+};
+
+static struct Sample before[NENV];
+
+static void
+sample(struct Sample *s, uint32_t n)
+{
+	const volatile struct Env *e;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		e = &envs[i];
+		s[i].id = e->env_status == ENV_FREE ? 0 : e->env_id;
+		s[i].user = e->env_user_cycles;
+		s[i].kern = e->env_kern_cycles;
+	}
+}
+
+static char
+status_char(unsigned status)
+{
+	switch (status)
+	{
+		case ENV_RUNNING:
+			return 'R';
+		case ENV_RUNNABLE:
+			return 'r';
+		case ENV_NOT_RUNNABLE:
+			return 'S';
+		case ENV_DYING:
+			return 'Z';
+		default:
+			return '?';
+	}
+}
+
+// Print one report: what each environment alive at both samples did
+// in the 'elapsed' TSC cycles between them.
+static void
+report(uint32_t n, uint64_t elapsed)
+{
+	static struct { uint32_t i; uint64_t user, kern; } rows[TOP_NROWS];
+	const volatile struct Env *e;
+	uint64_t user, kern, total = 0;
+	uint32_t i, j, nrows = 0, nlive = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		e = &envs[i];
+		if (before[i].id == 0 || e->env_id != before[i].id || e->env_status == ENV_FREE)
+			continue;
+		nlive++;
+		user = e->env_user_cycles - before[i].user;
+		kern = e->env_kern_cycles - before[i].kern;
+		total += user + kern;
+		// Keep the TOP_NROWS busiest, busiest first
+		for (j = nrows; j > 0 && rows[j - 1].user + rows[j - 1].kern < user + kern; j--)
+			if (j < TOP_NROWS)
+				rows[j] = rows[j - 1];
+		if (j < TOP_NROWS)
+		{
+			rows[j].i = i;
+			rows[j].user = user;
+			rows[j].kern = kern;
+			nrows = MIN(nrows + 1, TOP_NROWS);
+		}
+	}
+
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("%u environments, %u CPUs %llu%% busy\n", nlive, uinfo.ncpu,
+		   total * 100 / (elapsed * uinfo.ncpu));
+	printf("%-8s %c %6s %6s %6s %8s %8s %8s %8s %8s\n", "env", 'S', "%cpu", "%usr",
+		   "%sys", "vol", "invol", "pgflt", "ipcsend", "ipcrecv");
+	for (j = 0; j < nrows; j++)
+	{
+		e = &envs[rows[j].i];
+		printf("%08x %c %6llu %6llu %6llu %8u %8u %8u %8u %8u\n", e->env_id,
+			   status_char(e->env_status),
+			   (rows[j].user + rows[j].kern) * 100 / elapsed,
+			   rows[j].user * 100 / elapsed, rows[j].kern * 100 / elapsed,
+			   e->env_vol_switches, e->env_invol_switches, e->env_pgfaults,
+			   e->env_ipc_sends, e->env_ipc_recvs);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t msec = 1000, count = 1, n, zero = 0;
+	uint64_t t0;
+
+	if (argc > 3)
+	{
+		printf("usage: top [msec [count]]\n");
+		exit();
+	}
+	if (argc > 1)
+		msec = strtol(argv[1], NULL, 0);
+	if (argc > 2)
+		count = strtol(argv[2], NULL, 0);
+
+	while (count-- > 0)
+	{
+		n = uinfo.nenv;
+		sample(before, n);
+		t0 = read_tsc();
+		sys_futex_wait(&zero, 0, msec);
+		report(n, read_tsc() - t0);
+		if (count > 0)
+			printf("\n");
+	}
+}
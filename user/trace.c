@@ -0,0 +1,100 @@
+// Dump the kernel's trace rings (see kern/trace.c): every CPU's
+// events, merged into one timeline by TSC, oldest first.  Times are in
+// microseconds since the oldest event, or in TSC cycles if the kernel
+// could not measure the TSC's rate.
+
+#include <inc/lib.h>
+
+struct CpuTrace {
+	struct TraceEvent *ev;
+	int n, next;
+};
+
+static void
+print_event(const struct TraceEvent *te, uint64_t t0)
+{
+	const uint32_t *a = te->te_arg;
+	uint64_t t = te->te_tsc - t0;
+
+	if (uinfo.tsc_khz)
+		printf("%10llu.%03llu", t * 1000 / uinfo.tsc_khz,
+			   t * 1000000 / uinfo.tsc_khz % 1000);
+	else
+		printf("%14llu", t);
+	printf(" %2d %08x ", te->te_cpu, te->te_env);
+	switch (te->te_type)
+	{
+		case TRACE_SYSCALL_ENTER:
+			printf("syscall %u (%x, %x, %x)\n", a[0], a[1], a[2], a[3]);
+			break;
+		case TRACE_SYSCALL_EXIT:
+			printf("syscall %u returns %d\n", a[0], a[1]);
+			break;
+		case TRACE_SWITCH:
+			printf("switch to %08x, runnable for %u cycles\n", a[0], a[1]);
+			break;
+		case TRACE_IPC_SEND:
+			printf("ipc %08x -> %08x, value %u, %u pages\n", a[3], a[0], a[1], a[2]);
+			break;
+		case TRACE_IPC_RECV:
+			printf("ipc recv at %08x, %u pages", a[0], a[1]);
+			if (a[2])
+				printf(" from %08x", a[2]);
+			printf("\n");
+			break;
+		case TRACE_PGFLT:
+			printf("page fault at %08x, eip %08x, err %x\n", a[0], a[1], a[2]);
+			break;
+		case TRACE_IRQ:
+			printf("irq %u\n", a[0]);
+			break;
+		case TRACE_LOCK_CONTEND:
+			printf("lock %08x contended for %u cycles\n", a[0], a[1]);
+			break;
+		default:
+			printf("event %u (%x, %x, %x, %x)\n", te->te_type, a[0], a[1], a[2], a[3]);
+			break;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct CpuTrace cpus[UINFO_NCPU];
+	struct CpuTrace *c, *first;
+	uint32_t pos;
+	uint64_t t0;
+	int ncpu = uinfo.ncpu, i, r;
+
+	// Copy every ring out before printing, which itself makes events
+	for (i = 0; i < ncpu; i++)
+	{
+		c = &cpus[i];
+		c->n = c->next = 0;
+		if (!(c->ev = malloc(TRACE_NEVENTS * sizeof(struct TraceEvent))))
+			panic("trace: out of memory");
+		pos = 0;
+		if ((r = sys_trace_read(i, &pos, c->ev, TRACE_NEVENTS)) < 0)
+			printf("CPU %d: %e\n", i, r);
+		else
+			c->n = r;
+	}
+
+	t0 = ~0ULL;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].n > 0)
+			t0 = MIN(t0, cpus[i].ev[0].te_tsc);
+
+	printf("%14s cpu env      event\n", uinfo.tsc_khz ? "usec" : "cycles");
+	for (;;)
+	{
+		first = 0;
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c->next < c->n &&
+				(!first || c->ev[c->next].te_tsc < first->ev[first->next].te_tsc))
+				first = c;
+		if (!first)
+			break;
+		print_event(&first->ev[first->next++], t0);
+	}
+}